@@ -121,6 +121,8 @@ typedef enum LOGGROUP
     LOG_GROUP_DEV_LSILOGICSCSI,
     /** NE2000 Device group. */
     LOG_GROUP_DEV_NE2000,
+    /** NVMe controller Device group. */
+    LOG_GROUP_DEV_NVME,
     /** USB OHCI Device group. */
     LOG_GROUP_DEV_OHCI,
     /** Parallel Device group */
@@ -153,6 +155,8 @@ typedef enum LOGGROUP
     LOG_GROUP_DEV_VGA,
     /** Virtio PCI Device group. */
     LOG_GROUP_DEV_VIRTIO,
+    /** Virtio Block Device group. */
+    LOG_GROUP_DEV_VIRTIO_BLK,
     /** Virtio Network Device group. */
     LOG_GROUP_DEV_VIRTIO_NET,
     /** VMM Device group. */
@@ -829,6 +833,7 @@ typedef enum LOGGROUP
     "DEV_LPC",      \
     "DEV_LSILOGICSCSI", \
     "DEV_NE2000",   \
+    "DEV_NVME",     \
     "DEV_OHCI",     \
     "DEV_PARALLEL", \
     "DEV_PC",       \
@@ -845,6 +850,7 @@ typedef enum LOGGROUP
     "DEV_SMC",      \
     "DEV_VGA",      \
     "DEV_VIRTIO",   \
+    "DEV_VIRTIO_BLK", \
     "DEV_VIRTIO_NET", \
     "DEV_VMM",      \
     "DEV_VMM_BACKDOOR", \
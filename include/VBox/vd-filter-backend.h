@@ -99,6 +99,17 @@ typedef struct VDFILTERBACKEND
     DECLR3CALLBACKMEMBER(int, pfnFilterWrite, (void *pvBackendData, uint64_t uOffset, size_t cbWrite,
                                                PVDIOCTX pIoCtx));
 
+    /**
+     * Makes the state the filter keeps outside of the image chain persistent.
+     * Called synchronously for every flush of the disk before the images are
+     * flushed. Optional, may be NULL. Filter backends built against an older
+     * version of this interface don't have this member, see cbSize.
+     *
+     * @returns VBox status code.
+     * @param   pvBackendData   Opaque state data for the filter instance.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnFlush, (void *pvBackendData));
+
 } VDFILTERBACKEND;
 /** Pointer to VD filter backend. */
 typedef VDFILTERBACKEND *PVDFILTERBACKEND;
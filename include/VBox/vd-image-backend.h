@@ -584,6 +584,28 @@ typedef struct VBOXHDDBACKEND
                                                     PVDINTERFACE pVDIfsImage,
                                                     PVDINTERFACE pVDIfsOperation));
 
+    /**
+     * Query the allocation status of a range in the image. The pointer may be
+     * NULL, indicating that every range must be considered allocated.
+     *
+     * Only the allocation tables kept in memory are consulted, no I/O is done.
+     * A range may therefore be reported as allocated even though reading it
+     * returns VERR_VD_BLOCK_FREE, but a range reported as unallocated must
+     * return VERR_VD_BLOCK_FREE for every read.
+     *
+     * @returns VBox status code.
+     * @param   pBackendData    Opaque state data for this image.
+     * @param   uOffset         The offset of the virtual disk to start at.
+     * @param   cbRange         Maximum number of bytes to query.
+     * @param   pfAllocated     Where to store whether the range is allocated.
+     * @param   pcbExtent       Where to store the number of bytes starting at
+     *                          uOffset with the same allocation status, at most
+     *                          cbRange.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnQueryAllocationStatus, (void *pBackendData, uint64_t uOffset,
+                                                         uint64_t cbRange, bool *pfAllocated,
+                                                         uint64_t *pcbExtent));
+
 } VBOXHDDBACKEND;
 
 /** Pointer to VD backend. */
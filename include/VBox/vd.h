@@ -90,6 +90,9 @@ RT_C_DECLS_BEGIN
 /** VDI: Fill new blocks with zeroes while expanding image file. Only valid
  * for newly created images, never set for opened existing images. */
 #define VD_VDI_IMAGE_FLAGS_ZERO_EXPAND          (0x0100)
+/** VDI: Store blocks compressed, dynamic images only. Blocks are located
+ * through a per-block index and relocated when they outgrow their slot. */
+#define VD_VDI_IMAGE_FLAGS_COMPRESSED           (0x0200)
 
 /** Mask of valid image flags for VMDK. */
 #define VD_VMDK_IMAGE_FLAGS_MASK            (   VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE \
@@ -97,7 +100,8 @@ RT_C_DECLS_BEGIN
                                              | VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED | VD_VMDK_IMAGE_FLAGS_ESX)
 
 /** Mask of valid image flags for VDI. */
-#define VD_VDI_IMAGE_FLAGS_MASK             (VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE | VD_VDI_IMAGE_FLAGS_ZERO_EXPAND)
+#define VD_VDI_IMAGE_FLAGS_MASK             (   VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE \
+                                             | VD_VDI_IMAGE_FLAGS_ZERO_EXPAND | VD_VDI_IMAGE_FLAGS_COMPRESSED)
 
 /** Mask of all valid image flags for all formats. */
 #define VD_IMAGE_FLAGS_MASK                 (VD_VMDK_IMAGE_FLAGS_MASK | VD_VDI_IMAGE_FLAGS_MASK)
@@ -957,6 +961,22 @@ VBOXDDU_DECL(int) VDClose(PVBOXHDD pDisk, bool fDelete);
  */
 VBOXDDU_DECL(int) VDFilterRemove(PVBOXHDD pDisk, uint32_t fFlags);
 
+/**
+ * Removes all blocks from a deduplication content store (see the DEDUP filter)
+ * which are not referenced by any of the given block maps anymore.
+ *
+ * @return  VBox status code.
+ * @retval  VERR_FILE_LOCK_VIOLATION if a disk using the store is open or the
+ *          store is being compacted already.
+ * @param   pszStorePath    Path of the content store directory.
+ * @param   papszMaps       Array of all block maps referencing the content store.
+ * @param   cMaps           Number of entries in the map array.
+ * @param   pcBlocksFreed   Where to store the number of blocks removed, optional.
+ * @param   pcBlocksInUse   Where to store the number of blocks still referenced, optional.
+ */
+VBOXDDU_DECL(int) VDDedupStoreCompact(const char *pszStorePath, const char * const *papszMaps, unsigned cMaps,
+                                      uint64_t *pcBlocksFreed, uint64_t *pcBlocksInUse);
+
 /**
  * Closes the currently opened cache image file in HDD container.
  *
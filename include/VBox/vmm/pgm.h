@@ -700,6 +700,32 @@ VMMR3DECL(int)      PGMR3PhysGetRange(PVM pVM, uint32_t iRange, PRTGCPHYS pGCPhy
 VMMR3DECL(int)      PGMR3QueryMemoryStats(PUVM pUVM, uint64_t *pcbTotalMem, uint64_t *pcbPrivateMem, uint64_t *pcbSharedMem, uint64_t *pcbZeroMem);
 VMMR3DECL(int)      PGMR3QueryGlobalMemoryStats(PUVM pUVM, uint64_t *pcbAllocMem, uint64_t *pcbFreeMem, uint64_t *pcbBallonedMem, uint64_t *pcbSharedMem);
 
+/** @name Post-copy live migration.
+ * @{ */
+/**
+ * Callback for requesting a page which is absent on the post-copy target.
+ *
+ * @returns VBox status code.
+ * @param   pUVM            The user mode VM handle.
+ * @param   GCPhys          The address of the page.
+ * @param   pvUser          The user argument.
+ * @thread  Any, usually an EMT blocked on the page.
+ */
+typedef DECLCALLBACK(int) FNPGMPOSTCOPYREQUEST(PUVM pUVM, RTGCPHYS GCPhys, void *pvUser);
+/** Pointer to a FNPGMPOSTCOPYREQUEST(). */
+typedef FNPGMPOSTCOPYREQUEST *PFNPGMPOSTCOPYREQUEST;
+
+VMMR3DECL(int)      PGMR3PostCopySrcEnable(PUVM pUVM);
+VMMR3DECL(void)     PGMR3PostCopySrcDisable(PUVM pUVM);
+VMMR3DECL(uint32_t) PGMR3PostCopySrcPagesLeft(PUVM pUVM);
+VMMR3DECL(int)      PGMR3PostCopySrcNextPage(PUVM pUVM, PRTGCPHYS pGCPhys);
+VMMR3DECL(int)      PGMR3PostCopySrcGetPage(PUVM pUVM, RTGCPHYS GCPhys, void *pvPage);
+VMMR3DECL(uint32_t) PGMR3PostCopyTrgPagesLeft(PUVM pUVM);
+VMMR3DECL(int)      PGMR3PostCopyTrgStart(PUVM pUVM, PFNPGMPOSTCOPYREQUEST pfnRequest, void *pvUser);
+VMMR3DECL(int)      PGMR3PostCopyTrgPutPage(PUVM pUVM, RTGCPHYS GCPhys, const void *pvPage);
+VMMR3DECL(void)     PGMR3PostCopyTrgAbort(PUVM pUVM);
+/** @} */
+
 VMMR3DECL(int)      PGMR3PhysMMIORegister(PVM pVM, RTGCPHYS GCPhys, RTGCPHYS cb, PGMPHYSHANDLERTYPE hType,
                                           RTR3PTR pvUserR3, RTR0PTR pvUserR0, RTRCPTR pvUserRC, const char *pszDesc);
 VMMR3DECL(int)      PGMR3PhysMMIODeregister(PVM pVM, RTGCPHYS GCPhys, RTGCPHYS cb);
@@ -1376,8 +1376,15 @@ RTDECL(int) RTFileAioCtxCreate(PRTFILEAIOCTX phAioCtx, uint32_t cAioReqsMax,
  * even when there is none waiting currently, instead of returning
  * VERR_FILE_AIO_NO_REQUEST. */
 #define RTFILEAIOCTX_FLAGS_WAIT_WITHOUT_PENDING_REQUESTS RT_BIT_32(0)
+/** Use the io_uring interface instead of the legacy kernel async I/O interface
+ * (Linux only). The io_uring interface batches submissions and reaps completions
+ * without entering the kernel and doesn't require the file to be opened with
+ * RTFILE_O_NO_CACHE to be truly asynchronous. RTFileAioCtxCreate() fails with
+ * VERR_NOT_SUPPORTED if the host doesn't support it, the caller is expected to
+ * retry without this flag. */
+#define RTFILEAIOCTX_FLAGS_IO_RING                       RT_BIT_32(1)
 /** mask of valid flags. */
-#define RTFILEAIOCTX_FLAGS_VALID_MASK (RTFILEAIOCTX_FLAGS_WAIT_WITHOUT_PENDING_REQUESTS)
+#define RTFILEAIOCTX_FLAGS_VALID_MASK (RTFILEAIOCTX_FLAGS_WAIT_WITHOUT_PENDING_REQUESTS | RTFILEAIOCTX_FLAGS_IO_RING)
 
 /**
  * Destroys an async I/O context.
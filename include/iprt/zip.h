@@ -87,6 +87,10 @@ typedef enum RTZIPTYPE
     RTZIPTYPE_LZO,
     /* Zlib compression the data without zlib header. */
     RTZIPTYPE_ZLIB_NO_HEADER,
+    /** LZ4 block format compression (block API only). */
+    RTZIPTYPE_LZ4,
+    /** Zstandard compression (block API only, requires libzstd). */
+    RTZIPTYPE_ZSTD,
     /** End of valid the valid compression types.  */
     RTZIPTYPE_END
 } RTZIPTYPE;
@@ -290,6 +290,13 @@ AssertCompileSize(AHCITXSTATE, sizeof(uint32_t));
 #define AHCI_REQ_IS_QUEUED   RT_BIT_32(3)
 /** Flag whether the request is stored on the stack. */
 #define AHCI_REQ_IS_ON_STACK RT_BIT_32(4)
+/** The data segments of the request map guest memory directly. */
+#define AHCI_REQ_ZERO_COPY   RT_BIT_32(5)
+
+/** Alignment of guest buffers required for zero copy transfers. */
+#define AHCI_ZERO_COPY_ALIGNMENT 512
+/** Maximum number of guest pages mapped for a single zero copy request. */
+#define AHCI_ZERO_COPY_PAGES_MAX 1024
 
 /**
  * A task state.
@@ -336,6 +343,12 @@ typedef struct AHCIREQ
     size_t                     cbAlloc;
     /** Number of times we had too much memory allocated for the request. */
     unsigned                   cAllocTooMuch;
+    /** Segments mapping the guest buffer for zero copy transfers. */
+    PRTSGSEG                   paSegsGuest;
+    /** Page mapping locks backing the segments above. */
+    PPGMPAGEMAPLOCK            paPageLocks;
+    /** Number of entries the two arrays above have room for. */
+    unsigned                   cSegsGuestMax;
     /** Data dependent on the transfer direction. */
     union
     {
@@ -348,6 +361,10 @@ typedef struct AHCIREQ
              * If this is set we will use a buffer for the data
              * and the callback returns a buffer with the final data. */
             PFNAHCIPOSTPROCESS pfnPostProcess;
+            /** Number of valid entries in paSegsGuest if AHCI_REQ_ZERO_COPY is set. */
+            unsigned           cSegsGuest;
+            /** Number of held page mapping locks. */
+            unsigned           cPageLocks;
         } Io;
         /** Data for a trim request. */
         struct
@@ -546,6 +563,14 @@ typedef struct AHCIPort
     STAMCOUNTER                     StatBytesRead;
     /** Release statistics: Number of I/O requests processed per second. */
     STAMCOUNTER                     StatIORequestsPerSecond;
+    /** Release statistics: Number of requests transferred without a bounce buffer. */
+    STAMCOUNTER                     StatZeroCopy;
+    /** Release statistics: Number of requests falling back to a bounce buffer in zero copy mode. */
+    STAMCOUNTER                     StatZeroCopyFallback;
+    /** Release statistics: Number of requests submitted to the driver in one batch. */
+    STAMCOUNTER                     StatReqsBatched;
+    /** Release statistics: Number of interrupts saved by interrupt coalescing. */
+    STAMCOUNTER                     StatIntrCoalesced;
 #ifdef VBOX_WITH_STATISTICS
     /** Statistics: Time to complete one request. */
     STAMPROFILE                     StatProfileProcessTime;
@@ -568,7 +593,9 @@ typedef struct AHCIPort
     /** Error counter */
     uint32_t                        cErrors;
 
-    uint32_t                        u32Alignment5;
+    /** Number of completed queued commands whose interrupt is still held back
+     * because of interrupt coalescing. */
+    volatile uint32_t               cIntrCoalesced;
 
     /** Critical section protecting the global free list. */
     RTCRITSECT                      CritSectReqsFree;
@@ -713,6 +740,9 @@ typedef struct AHCI
     bool                            fBootable;
     /** Flag whether the legacy port reset method should be used to make it work with saved states. */
     bool                            fLegacyPortResetMethod;
+    /** Flag whether aligned guest buffers are handed to the driver directly instead
+     * of going through a bounce buffer. */
+    bool                            fZeroCopy;
 
     /** Number of usable ports on this controller. */
     uint32_t                        cPortsImpl;
@@ -728,6 +758,14 @@ typedef struct AHCI
 
     /** The support driver session handle. */
     R3R0PTRTYPE(PSUPDRVSESSION)     pSupDrvSession;
+
+    /** Timer flushing held back completion interrupts - R3 ptr. */
+    PTMTIMERR3                      pIntrCoalesceTimerR3;
+    /** Maximum number of completions to hold back before raising an interrupt,
+     * 0 disables interrupt coalescing. */
+    uint32_t                        cIntrCoalesceMax;
+    /** Maximum time in microseconds a completion interrupt is held back. */
+    uint32_t                        cUsIntrCoalesceTimeout;
 } AHCI;
 /** Pointer to the state of an AHCI device. */
 typedef AHCI *PAHCI;
@@ -956,6 +994,7 @@ static void ahciHBAReset(PAHCI pThis);
 #ifdef IN_RING3
 static int  ahciPostFisIntoMemory(PAHCIPort pAhciPort, unsigned uFisType, uint8_t *cmdFis);
 static void ahciPostFirstD2HFisIntoMemory(PAHCIPort pAhciPort);
+static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fInterrupt);
 static size_t ahciCopyToPrdtl(PPDMDEVINS pDevIns, PAHCIREQ pAhciReq,
                               void *pvBuf, size_t cbBuf);
 static size_t ahciCopyFromPrdtl(PPDMDEVINS pDevIns, PAHCIREQ pAhciReq,
@@ -1079,6 +1118,33 @@ static DECLCALLBACK(void) ahciCccTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void
     AssertRC(rc);
 }
 
+/**
+ * Raises the interrupt for all completions held back on the given port.
+ *
+ * @returns nothing.
+ * @param   pAhciPort    The port to flush.
+ */
+static void ahciR3IntrCoalesceFlush(PAHCIPort pAhciPort)
+{
+    uint32_t cIntrCoalesced = ASMAtomicXchgU32(&pAhciPort->cIntrCoalesced, 0);
+    if (cIntrCoalesced)
+    {
+        STAM_REL_COUNTER_ADD(&pAhciPort->StatIntrCoalesced, cIntrCoalesced - 1);
+        ahciSendSDBFis(pAhciPort, 0, true);
+    }
+}
+
+/**
+ * Raises the held back completion interrupts when the coalescing timeout expires.
+ */
+static DECLCALLBACK(void) ahciR3IntrCoalesceTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
+{
+    PAHCI pAhci = (PAHCI)pvUser;
+
+    for (unsigned i = 0; i < pAhci->cPortsImpl; i++)
+        ahciR3IntrCoalesceFlush(&pAhci->ahciPort[i]);
+}
+
 /**
  * Finishes the port reset of the given port.
  *
@@ -2065,6 +2131,7 @@ static void ahciPortSwReset(PAHCIPort pAhciPort)
     pAhciPort->u32TasksFinished = 0;
     pAhciPort->u32QueuedTasksFinished = 0;
     pAhciPort->u32CurrentCommandSlot = 0;
+    ASMAtomicWriteU32(&pAhciPort->cIntrCoalesced, 0);
 
     ASMAtomicWriteU32(&pAhciPort->MediaEventStatus, ATA_EVENT_STATUS_UNCHANGED);
     ASMAtomicWriteU32(&pAhciPort->MediaTrackType, ATA_MEDIA_TYPE_UNKNOWN);
@@ -5619,6 +5686,151 @@ static size_t ahciCopyFromPrdtl(PPDMDEVINS pDevIns, PAHCIREQ pAhciReq,
     return cbCopied;
 }
 
+/**
+ * Releases the guest page mappings of a zero copy request.
+ *
+ * @returns nothing.
+ * @param   pAhciPort   The AHCI port.
+ * @param   pAhciReq    The request state.
+ */
+static void ahciIoBufUnmapGuest(PAHCIPort pAhciPort, PAHCIREQ pAhciReq)
+{
+    for (unsigned i = 0; i < pAhciReq->u.Io.cPageLocks; i++)
+        PDMDevHlpPhysReleasePageMappingLock(pAhciPort->pDevInsR3, &pAhciReq->paPageLocks[i]);
+
+    pAhciReq->u.Io.cPageLocks = 0;
+    pAhciReq->u.Io.cSegsGuest = 0;
+    pAhciReq->fFlags &= ~AHCI_REQ_ZERO_COPY;
+}
+
+/**
+ * Tries to map the guest buffer described by the PRDTL so the data is
+ * transferred without a bounce buffer. Every PRDT entry must be sector aligned
+ * for the host to do unbuffered I/O on the memory directly.
+ *
+ * @returns Flag whether the guest buffer could be mapped.
+ * @param   pAhciPort   The AHCI port.
+ * @param   pAhciReq    The request state.
+ * @param   cbTransfer  Amount of bytes to map.
+ */
+static bool ahciIoBufMapGuest(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, size_t cbTransfer)
+{
+    PPDMDEVINS pDevIns = pAhciPort->pDevInsR3;
+    SGLEntry aPrdtlEntries[32];
+    RTGCPHYS GCPhysPrdtl = pAhciReq->GCPhysPrdtl;
+    unsigned cPrdtlEntries = pAhciReq->cPrdtlEntries;
+    unsigned cSegs = 0;
+    size_t cbLeft = cbTransfer;
+    bool fFailed = false;
+
+    Assert(!pAhciReq->u.Io.cPageLocks);
+    if (!cPrdtlEntries)
+        return false;
+
+    do
+    {
+        uint32_t cPrdtlEntriesRead =   (cPrdtlEntries < RT_ELEMENTS(aPrdtlEntries))
+                                     ? cPrdtlEntries
+                                     : RT_ELEMENTS(aPrdtlEntries);
+
+        PDMDevHlpPhysRead(pDevIns, GCPhysPrdtl, &aPrdtlEntries[0], cPrdtlEntriesRead * sizeof(SGLEntry));
+
+        for (uint32_t i = 0; (i < cPrdtlEntriesRead) && cbLeft && !fFailed; i++)
+        {
+            RTGCPHYS GCPhysAddrDataBase = AHCI_RTGCPHYS_FROM_U32(aPrdtlEntries[i].u32DBAUp, aPrdtlEntries[i].u32DBA);
+            size_t cbThisEntry = (aPrdtlEntries[i].u32DescInf & SGLENTRY_DESCINF_DBC) + 1;
+
+            cbThisEntry = RT_MIN(cbThisEntry, cbLeft);
+            if ((GCPhysAddrDataBase | cbThisEntry) & (AHCI_ZERO_COPY_ALIGNMENT - 1))
+            {
+                fFailed = true;
+                break;
+            }
+
+            while (cbThisEntry)
+            {
+                size_t cbThisPage = RT_MIN(cbThisEntry, PAGE_SIZE - (GCPhysAddrDataBase & PAGE_OFFSET_MASK));
+                unsigned idxLock = pAhciReq->u.Io.cPageLocks;
+                void *pv = NULL;
+                int rc;
+
+                if (idxLock == pAhciReq->cSegsGuestMax)
+                {
+                    unsigned cSegsNew = pAhciReq->cSegsGuestMax ? pAhciReq->cSegsGuestMax * 2 : 32;
+                    PRTSGSEG paSegsNew = NULL;
+                    PPGMPAGEMAPLOCK paPageLocksNew = NULL;
+
+                    if (cSegsNew <= AHCI_ZERO_COPY_PAGES_MAX)
+                    {
+                        paSegsNew = (PRTSGSEG)RTMemRealloc(pAhciReq->paSegsGuest, cSegsNew * sizeof(RTSGSEG));
+                        if (paSegsNew)
+                        {
+                            pAhciReq->paSegsGuest = paSegsNew;
+                            paPageLocksNew = (PPGMPAGEMAPLOCK)RTMemRealloc(pAhciReq->paPageLocks, cSegsNew * sizeof(PGMPAGEMAPLOCK));
+                            if (paPageLocksNew)
+                            {
+                                pAhciReq->paPageLocks   = paPageLocksNew;
+                                pAhciReq->cSegsGuestMax = cSegsNew;
+                            }
+                        }
+                    }
+
+                    if (!paSegsNew || !paPageLocksNew)
+                    {
+                        fFailed = true;
+                        break;
+                    }
+                }
+
+                /* Reading from the disk writes to guest memory. */
+                if (pAhciReq->enmTxDir == AHCITXDIR_READ)
+                    rc = PDMDevHlpPhysGCPhys2CCPtr(pDevIns, GCPhysAddrDataBase, 0, &pv,
+                                                   &pAhciReq->paPageLocks[idxLock]);
+                else
+                    rc = PDMDevHlpPhysGCPhys2CCPtrReadOnly(pDevIns, GCPhysAddrDataBase, 0, (void const **)&pv,
+                                                           &pAhciReq->paPageLocks[idxLock]);
+                if (RT_FAILURE(rc))
+                {
+                    fFailed = true;
+                    break;
+                }
+
+                pAhciReq->u.Io.cPageLocks++;
+
+                if (   cSegs
+                    && (uint8_t *)pAhciReq->paSegsGuest[cSegs - 1].pvSeg + pAhciReq->paSegsGuest[cSegs - 1].cbSeg == pv)
+                    pAhciReq->paSegsGuest[cSegs - 1].cbSeg += cbThisPage;
+                else
+                {
+                    pAhciReq->paSegsGuest[cSegs].pvSeg = pv;
+                    pAhciReq->paSegsGuest[cSegs].cbSeg = cbThisPage;
+                    cSegs++;
+                }
+
+                GCPhysAddrDataBase += cbThisPage;
+                cbThisEntry        -= cbThisPage;
+                cbLeft             -= cbThisPage;
+            }
+        }
+
+        GCPhysPrdtl   += cPrdtlEntriesRead * sizeof(SGLEntry);
+        cPrdtlEntries -= cPrdtlEntriesRead;
+    } while (cPrdtlEntries && cbLeft && !fFailed);
+
+    /* Overflows are left to the bounce buffer path which knows how to report them. */
+    if (fFailed || cbLeft)
+    {
+        ahciIoBufUnmapGuest(pAhciPort, pAhciReq);
+        STAM_REL_COUNTER_INC(&pAhciPort->StatZeroCopyFallback);
+        return false;
+    }
+
+    pAhciReq->u.Io.cSegsGuest = cSegs;
+    pAhciReq->fFlags |= AHCI_REQ_ZERO_COPY;
+    STAM_REL_COUNTER_INC(&pAhciPort->StatZeroCopy);
+    return true;
+}
+
 /**
  * Allocate I/O memory and copies the guest buffer for writes.
  *
@@ -5633,6 +5845,16 @@ static int ahciIoBufAllocate(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, size_t cbTr
               || pAhciReq->enmTxDir == AHCITXDIR_WRITE,
               ("Allocating I/O memory for a non I/O request is not allowed\n"));
 
+    if (   pAhciPort->CTX_SUFF(pAhci)->fZeroCopy
+        && pAhciPort->fAsyncInterface
+        && !pAhciPort->fATAPI
+        && ahciIoBufMapGuest(pAhciPort, pAhciReq, cbTransfer))
+    {
+        pAhciReq->u.Io.DataSeg.pvSeg = NULL;
+        pAhciReq->u.Io.DataSeg.cbSeg = cbTransfer;
+        return VINF_SUCCESS;
+    }
+
     pAhciReq->u.Io.DataSeg.pvSeg = ahciReqMemAlloc(pAhciPort, pAhciReq, cbTransfer);
     if (!pAhciReq->u.Io.DataSeg.pvSeg)
         return VERR_NO_MEMORY;
@@ -5663,6 +5885,14 @@ static void ahciIoBufFree(PAHCIPort pAhciPort, PAHCIREQ pAhciReq,
               || pAhciReq->enmTxDir == AHCITXDIR_WRITE,
               ("Freeing I/O memory for a non I/O request is not allowed\n"));
 
+    if (pAhciReq->fFlags & AHCI_REQ_ZERO_COPY)
+    {
+        /* The data went to or came from guest memory directly. */
+        ahciIoBufUnmapGuest(pAhciPort, pAhciReq);
+        pAhciReq->u.Io.DataSeg.cbSeg = 0;
+        return;
+    }
+
     if (   pAhciReq->enmTxDir == AHCITXDIR_READ
         && fCopyToGuest)
     {
@@ -5708,6 +5938,8 @@ static void ahciR3PortCachedReqsFree(PAHCIPort pAhciPort)
         {
             RTListNodeRemove(&pReq->NodeList);
             ahciReqMemFree(pAhciPort, pReq, true /* fForceFree */);
+            RTMemFree(pReq->paSegsGuest);
+            RTMemFree(pReq->paPageLocks);
             RTMemFree(pReq);
         }
         RTCritSectLeave(&pAhciPort->CritSectReqsFree);
@@ -5756,7 +5988,15 @@ static bool ahciCancelActiveTasks(PAHCIPort pAhciPort, PAHCIREQ pAhciReqExcept)
         }
     }
 
-    return true; /* always true for now because tasks don't use guest memory as the buffer which makes canceling a task impossible. */
+    /*
+     * Always true for now. Tasks using a bounce buffer never touch guest memory
+     * once canceled. Tasks doing zero copy I/O (AHCI_REQ_ZERO_COPY) have guest
+     * pages mapped which the driver may still access until the request
+     * completes. ahciTransferComplete releases their page mapping locks
+     * without touching the data, releasing them any earlier would leave the
+     * driver doing I/O on pages PGM is free to reuse.
+     */
+    return true;
 }
 
 /* -=-=-=-=- IBlockAsyncPort -=-=-=-=- */
@@ -6160,12 +6400,33 @@ static bool ahciTransferComplete(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, int rcR
 
             if (pAhciReq->fFlags & AHCI_REQ_IS_QUEUED)
             {
-                /*
-                 * Always raise an interrupt after task completion; delaying
-                 * this (interrupt coalescing) increases latency and has a significant
-                 * impact on performance (see @bugref{5071})
-                 */
-                ahciSendSDBFis(pAhciPort, 0, true);
+                PAHCI pAhci = pAhciPort->CTX_SUFF(pAhci);
+
+                if (!pAhci->cIntrCoalesceMax)
+                {
+                    /*
+                     * Always raise an interrupt after task completion; delaying
+                     * this (interrupt coalescing) increases latency and has a significant
+                     * impact on performance (see @bugref{5071})
+                     */
+                    ahciSendSDBFis(pAhciPort, 0, true);
+                }
+                else
+                {
+                    /*
+                     * Interrupt coalescing was configured explicitly. Hold the interrupt back
+                     * unless enough completions accumulated, this is the last outstanding
+                     * request or an error must be reported. The timer makes sure the guest
+                     * doesn't wait longer than the configured timeout.
+                     */
+                    uint32_t cIntrCoalesced = ASMAtomicIncU32(&pAhciPort->cIntrCoalesced);
+                    if (   cIntrCoalesced >= pAhci->cIntrCoalesceMax
+                        || ASMAtomicReadU32(&pAhciPort->cTasksActive) <= 1
+                        || RT_FAILURE(rcReq))
+                        ahciR3IntrCoalesceFlush(pAhciPort);
+                    else if (cIntrCoalesced == 1)
+                        TMTimerSetMicro(pAhci->pIntrCoalesceTimerR3, pAhci->cUsIntrCoalesceTimeout);
+                }
             }
             else
                 ahciSendD2HFis(pAhciPort, pAhciReq, pAhciReq->cmdFis, true);
@@ -6663,6 +6924,14 @@ static bool ahciR3ReqSubmit(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, AHCITXDIR en
 {
     int rc = VINF_SUCCESS;
     bool fReqCanceled = false;
+    PCRTSGSEG paSegs = &pAhciReq->u.Io.DataSeg;
+    unsigned cSegs = 1;
+
+    if (pAhciReq->fFlags & AHCI_REQ_ZERO_COPY)
+    {
+        paSegs = pAhciReq->paSegsGuest;
+        cSegs  = pAhciReq->u.Io.cSegsGuest;
+    }
 
     if (pAhciPort->fAsyncInterface)
     {
@@ -6687,7 +6956,7 @@ static bool ahciR3ReqSubmit(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, AHCITXDIR en
         {
             pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 1;
             rc = pAhciPort->pDrvBlockAsync->pfnStartRead(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
-                                                         &pAhciReq->u.Io.DataSeg, 1,
+                                                         paSegs, cSegs,
                                                          pAhciReq->cbTransfer,
                                                          pAhciReq);
         }
@@ -6695,7 +6964,7 @@ static bool ahciR3ReqSubmit(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, AHCITXDIR en
         {
             pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
             rc = pAhciPort->pDrvBlockAsync->pfnStartWrite(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
-                                                          &pAhciReq->u.Io.DataSeg, 1,
+                                                          paSegs, cSegs,
                                                           pAhciReq->cbTransfer,
                                                           pAhciReq);
         }
@@ -6853,6 +7122,7 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
     uint32_t uIORequestsProcessed = 0;
     uint32_t uIOsPerSec = 0;
     uint32_t fTasksToProcess = 0;
+    PAHCIREQ apReqsSubmit[AHCI_NR_COMMAND_SLOTS];
 
     ahciLog(("%s: Port %d entering async IO loop.\n", __FUNCTION__, pAhciPort->iLUN));
 
@@ -6903,6 +7173,13 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
             continue;
         }
 
+        /*
+         * All commands the guest issued with the last PxCI write are prepared first and
+         * submitted to the driver back to back afterwards when the async interface is used.
+         * This lets the async I/O manager pick up the whole batch with a single wakeup.
+         */
+        unsigned cReqsSubmit = 0;
+
         idx = ASMBitFirstSetU32(u32Tasks);
         while (   idx
                && !pAhciPort->fPortReset)
@@ -6950,7 +7227,10 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
                             }
                         }
 
-                        if (!(pAhciReq->fFlags & AHCI_REQ_OVERFLOW))
+                        if (   !(pAhciReq->fFlags & AHCI_REQ_OVERFLOW)
+                            && pAhciPort->fAsyncInterface)
+                            apReqsSubmit[cReqsSubmit++] = pAhciReq;
+                        else if (!(pAhciReq->fFlags & AHCI_REQ_OVERFLOW))
                             fReqCanceled = ahciR3ReqSubmit(pAhciPort, pAhciReq, enmTxDir);
                         else /* Overflow is handled in completion routine. */
                             fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, VINF_SUCCESS);
@@ -6986,6 +7266,25 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
             idx = ASMBitFirstSetU32(u32Tasks);
         } /* while tasks available */
 
+        /*
+         * Submit the prepared requests. The guest may have started a port reset or
+         * a request may have been canceled while the batch was prepared. Such requests
+         * must not reach the driver as the guest might use their memory for other
+         * things already, they are completed as canceled right away.
+         */
+        if (cReqsSubmit > 1)
+            STAM_REL_COUNTER_ADD(&pAhciPort->StatReqsBatched, cReqsSubmit);
+        for (unsigned i = 0; i < cReqsSubmit; i++)
+        {
+            PAHCIREQ pAhciReq = apReqsSubmit[i];
+            if (ASMAtomicReadBool(&pAhciPort->fPortReset))
+                ahciCancelActiveTasks(pAhciPort, NULL);
+            if (ASMAtomicReadPtrT(&pAhciPort->aActiveTasks[pAhciReq->uTag], PAHCIREQ) == pAhciReq)
+                ahciR3ReqSubmit(pAhciPort, pAhciReq, pAhciReq->enmTxDir);
+            else
+                ahciTransferComplete(pAhciPort, pAhciReq, VERR_CANCELLED);
+        }
+
         /* Check whether a port reset was active. */
         if (   ASMAtomicReadBool(&pAhciPort->fPortReset)
             && (pAhciPort->regSCTL & AHCI_PORT_SCTL_DET) == AHCI_PORT_SCTL_DET_NINIT)
@@ -7788,10 +8087,14 @@ static DECLCALLBACK(bool) ahciR3IsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
     ASMAtomicWriteBool(&pThis->fSignalIdle, false);
     /*
      * Free all cached tasks here, not possible on destruct because the driver
-     * is destroyed before us.
+     * is destroyed before us. Held back completion interrupts are raised
+     * because the coalescing state is not part of the saved state.
      */
     for (unsigned iPort = 0; iPort < pThis->cPortsImpl; iPort++)
+    {
+        ahciR3IntrCoalesceFlush(&pThis->ahciPort[iPort]);
         ahciR3PortCachedReqsFree(&pThis->ahciPort[iPort]);
+    }
     return true;
 }
 
@@ -7809,10 +8112,14 @@ static void ahciR3SuspendOrPowerOff(PPDMDEVINS pDevIns)
     {
         /*
          * Free all cached tasks here, not possible on destruct because the driver
-         * is destroyed before us.
+         * is destroyed before us. Held back completion interrupts are raised
+         * because the coalescing state is not part of the saved state.
          */
         for (unsigned iPort = 0; iPort < pThis->cPortsImpl; iPort++)
+        {
+            ahciR3IntrCoalesceFlush(&pThis->ahciPort[iPort]);
             ahciR3PortCachedReqsFree(&pThis->ahciPort[iPort]);
+        }
 
         ASMAtomicWriteBool(&pThis->fSignalIdle, false);
     }
@@ -8323,7 +8630,10 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                     "PortCount\0"
                                     "UseAsyncInterfaceIfAvailable\0"
                                     "Bootable\0"
-                                    "CmdSlotsAvail\0"))
+                                    "CmdSlotsAvail\0"
+                                    "ZeroCopy\0"
+                                    "IntrCoalescingMax\0"
+                                    "IntrCoalescingTimeoutUs\0"))
         return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                 N_("AHCI configuration error: unknown option specified"));
 
@@ -8363,6 +8673,37 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
         return PDMDEV_SET_ERROR(pDevIns, rc,
                                 N_("AHCI configuration error: failed to read Bootable as boolean"));
 
+    /*
+     * Hand sector aligned guest buffers to the driver directly. The guest
+     * memory stays mapped until the request completes, so a canceled read
+     * may still update guest memory like real DMA would.
+     */
+    rc = CFGMR3QueryBoolDef(pCfg, "ZeroCopy", &pThis->fZeroCopy, false);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read ZeroCopy as boolean"));
+
+    /*
+     * Host side interrupt coalescing for queued commands, independent of the
+     * guest controlled CCC feature. Disabled by default because it adds latency.
+     */
+    rc = CFGMR3QueryU32Def(pCfg, "IntrCoalescingMax", &pThis->cIntrCoalesceMax, 0);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read IntrCoalescingMax as integer"));
+    if (pThis->cIntrCoalesceMax > AHCI_NR_COMMAND_SLOTS)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("AHCI configuration error: IntrCoalescingMax=%u should not exceed %u"),
+                                   pThis->cIntrCoalesceMax, AHCI_NR_COMMAND_SLOTS);
+
+    rc = CFGMR3QueryU32Def(pCfg, "IntrCoalescingTimeoutUs", &pThis->cUsIntrCoalesceTimeout, 50);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read IntrCoalescingTimeoutUs as integer"));
+    if (pThis->cIntrCoalesceMax)
+        LogRel(("AHCI#%d: Interrupt coalescing enabled (max %u completions, %u us)\n", iInstance,
+                pThis->cIntrCoalesceMax, pThis->cUsIntrCoalesceTimeout));
+
     rc = CFGMR3QueryU32Def(pCfg, "CmdSlotsAvail", &pThis->cCmdSlotsAvail, AHCI_NR_COMMAND_SLOTS);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc,
@@ -8524,6 +8865,18 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
         return rc;
     }
     pThis->pHbaCccTimerR0 = TMTimerR0Ptr(pThis->pHbaCccTimerR3);
+
+    /* Create the timer for host side interrupt coalescing. */
+    rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, ahciR3IntrCoalesceTimer, pThis,
+                                TMTIMER_FLAGS_NO_CRIT_SECT, "AHCI Interrupt Coalescing", &pThis->pIntrCoalesceTimerR3);
+    if (RT_FAILURE(rc))
+    {
+        AssertMsgFailed(("pfnTMTimerCreate -> %Rrc\n", rc));
+        return rc;
+    }
+    /* The callback updates the port and HBA interrupt state like the MMIO handlers. */
+    rc = TMR3TimerSetCritSect(pThis->pIntrCoalesceTimerR3, &pThis->lock);
+    AssertRCReturn(rc, rc);
     pThis->pHbaCccTimerRC = TMTimerRCPtr(pThis->pHbaCccTimerR3);
 
     /* Status LUN. */
@@ -8555,6 +8908,14 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                "Amount of data written.", "/Devices/SATA%d/Port%d/WrittenBytes", iInstance, i);
         PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatIORequestsPerSecond, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
                                "Number of processed I/O requests per second.", "/Devices/SATA%d/Port%d/IORequestsPerSecond", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatZeroCopy, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of requests transferred without a bounce buffer.", "/Devices/SATA%d/Port%d/ZeroCopy", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatZeroCopyFallback, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of unaligned requests using a bounce buffer.", "/Devices/SATA%d/Port%d/ZeroCopyFallback", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatReqsBatched, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of requests submitted together with others.", "/Devices/SATA%d/Port%d/ReqsBatched", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatIntrCoalesced, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of interrupts saved by interrupt coalescing.", "/Devices/SATA%d/Port%d/IntrCoalesced", iInstance, i);
 #ifdef VBOX_WITH_STATISTICS
         PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatProfileProcessTime, STAMTYPE_PROFILE, STAMVISIBILITY_USED, STAMUNIT_NS_PER_CALL,
                                "Amount of time to process one request.", "/Devices/SATA%d/Port%d/ProfileProcessTime", iInstance, i);
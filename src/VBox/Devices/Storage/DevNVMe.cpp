@@ -0,0 +1,3475 @@
+/* $Id$ */
+/** @file
+ * DevNVMe - NVM Express controller device.
+ *
+ * Implements a subset of the NVM Express 1.2 specification.
+ */
+
+/*
+ * Copyright (C) 2015 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_dev_nvme   NVMe - NVM Express Controller Emulation.
+ *
+ * This component implements an NVM Express controller exposing a single
+ * namespace which is backed by the block driver attached to LUN 0.
+ *
+ * The controller offers one admin queue pair and a configurable number of I/O
+ * queue pairs, by default one per virtual CPU, so a guest driver can submit
+ * and complete requests without serializing the vCPUs on a single queue.
+ * Every I/O completion queue can be bound to its own MSI-X vector. Without
+ * MSI-X all completion queues share the legacy INTx pin.
+ *
+ * A doorbell write to a submission queue tail fetches and starts all new
+ * commands on the EMT doing the write. Read, write, flush and discard
+ * requests are handed to the asynchronous block interface when available,
+ * completions are posted from whatever thread the driver completes them on.
+ * Drivers without it get the requests from an I/O thread so the EMT never
+ * blocks on the medium while holding a queue lock.
+ * Each queue has its own lock so different vCPUs working on different queue
+ * pairs never contend. The lock order is submission queue, completion queue
+ * and finally the INTx interrupt state.
+ *
+ * Completion interrupts of I/O queues can be coalesced with the aggregation
+ * threshold and time of the Interrupt Coalescing feature. The host can enable
+ * coalescing by default through the configuration.
+ *
+ * Data is transferred through a bounce buffer per request. Only the 4KB
+ * memory page size and PRP based transfers are supported.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_NVME
+#include <VBox/vmm/pdmdev.h>
+#include <VBox/vmm/pdmcritsect.h>
+#include <VBox/vmm/pdmthread.h>
+#include <VBox/vmm/stam.h>
+#include <VBox/msi.h>
+#include <VBox/sup.h>
+#include <iprt/assert.h>
+#include <iprt/asm.h>
+#include <iprt/string.h>
+#include <iprt/list.h>
+#ifdef IN_RING3
+# include <iprt/critsect.h>
+# include <iprt/mem.h>
+# include <iprt/memcache.h>
+# include <iprt/uuid.h>
+#endif
+#include "VBoxDD.h"
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The current saved state version. */
+#define NVME_SAVED_STATE_VERSION                1
+
+/** Maximum number of I/O queue pairs, limited by the number of MSI-X vectors
+ * (one vector for each I/O completion queue plus the admin queue). */
+#define NVME_IO_QUEUES_MAX                      (VBOX_MSIX_MAX_ENTRIES - 1)
+/** Number of queue slots including the admin queue. */
+#define NVME_QUEUES_MAX                         (NVME_IO_QUEUES_MAX + 1)
+/** Maximum number of entries in a queue (CAP.MQES + 1). */
+#define NVME_QUEUE_ENTRIES_MAX                  4096
+
+/** Size of the register MMIO region. */
+#define NVME_MMIO_SIZE                          _16K
+/** Offset of the first doorbell register. */
+#define NVME_DOORBELL_OFFSET                    0x1000
+/** The BAR holding the MSI-X table. */
+#define NVME_MSIX_BAR                           4
+/** Offset of the MSI-X capability in the configuration space. */
+#define NVME_MSIX_CAP_OFFSET                    0x80
+
+/** The only supported memory page size. */
+#define NVME_PAGE_SIZE                          _4K
+/** Offset mask for NVME_PAGE_SIZE. */
+#define NVME_PAGE_OFFSET_MASK                   (NVME_PAGE_SIZE - 1)
+/** Maximum data transfer size as a power of two of the page size. */
+#define NVME_MDTS                               6
+/** Maximum data transfer size in bytes. */
+#define NVME_XFER_SIZE_MAX                      (NVME_PAGE_SIZE << NVME_MDTS)
+/** Maximum number of guest memory segments of one transfer. */
+#define NVME_PRP_SEGS_MAX                       ((NVME_XFER_SIZE_MAX / NVME_PAGE_SIZE) + 1)
+/** Number of submission queue entries fetched from guest memory at once. */
+#define NVME_SQE_BATCH                          16
+/** Asynchronous event request limit (0's based). */
+#define NVME_AERL                               3
+/** Maximum number of ranges of a Dataset Management command. */
+#define NVME_DSM_RANGES_MAX                     256
+
+/** @name Controller registers.
+ * @{ */
+#define NVME_REG_CAP                            0x00
+#define NVME_REG_VS                             0x08
+#define NVME_REG_INTMS                          0x0c
+#define NVME_REG_INTMC                          0x10
+#define NVME_REG_CC                             0x14
+#define NVME_REG_CSTS                           0x1c
+#define NVME_REG_NSSR                           0x20
+#define NVME_REG_AQA                            0x24
+#define NVME_REG_ASQ                            0x28
+#define NVME_REG_ACQ                            0x30
+/** @} */
+
+/** The capabilities: MQES, CQR, a 7.5 second timeout, the NVM command set
+ * and 4KB pages only. */
+#define NVME_CAP_VALUE                          (  (uint64_t)(NVME_QUEUE_ENTRIES_MAX - 1) \
+                                                 | RT_BIT_64(16) \
+                                                 | ((uint64_t)15 << 24) \
+                                                 | RT_BIT_64(37))
+/** The implemented version, 1.2. */
+#define NVME_VS_VALUE                           UINT32_C(0x00010200)
+
+/** @name Controller configuration register bits.
+ * @{ */
+#define NVME_CC_EN                              RT_BIT_32(0)
+#define NVME_CC_CSS_GET(a_u32)                  (((a_u32) >> 4) & 0x7)
+#define NVME_CC_MPS_GET(a_u32)                  (((a_u32) >> 7) & 0xf)
+#define NVME_CC_AMS_GET(a_u32)                  (((a_u32) >> 11) & 0x7)
+#define NVME_CC_SHN_GET(a_u32)                  (((a_u32) >> 14) & 0x3)
+#define NVME_CC_IOSQES_GET(a_u32)               (((a_u32) >> 16) & 0xf)
+#define NVME_CC_IOCQES_GET(a_u32)               (((a_u32) >> 20) & 0xf)
+#define NVME_CC_WRITABLE_MASK                   UINT32_C(0x00fffff1)
+/** @} */
+
+/** @name Controller status register bits.
+ * @{ */
+#define NVME_CSTS_RDY                           RT_BIT_32(0)
+#define NVME_CSTS_CFS                           RT_BIT_32(1)
+#define NVME_CSTS_SHST_COMPLETE                 (2 << 2)
+#define NVME_CSTS_SHST_MASK                     (3 << 2)
+/** @} */
+
+/** @name Admin command opcodes.
+ * @{ */
+#define NVME_ADM_DELETE_IO_SQ                   0x00
+#define NVME_ADM_CREATE_IO_SQ                   0x01
+#define NVME_ADM_GET_LOG_PAGE                   0x02
+#define NVME_ADM_DELETE_IO_CQ                   0x04
+#define NVME_ADM_CREATE_IO_CQ                   0x05
+#define NVME_ADM_IDENTIFY                       0x06
+#define NVME_ADM_ABORT                          0x08
+#define NVME_ADM_SET_FEATURES                   0x09
+#define NVME_ADM_GET_FEATURES                   0x0a
+#define NVME_ADM_ASYNC_EVENT_REQ                0x0c
+/** @} */
+
+/** @name NVM command opcodes.
+ * @{ */
+#define NVME_NVM_FLUSH                          0x00
+#define NVME_NVM_WRITE                          0x01
+#define NVME_NVM_READ                           0x02
+#define NVME_NVM_DSM                            0x09
+/** @} */
+
+/** @name Feature identifiers.
+ * @{ */
+#define NVME_FEAT_ARBITRATION                   0x01
+#define NVME_FEAT_POWER_MGMT                    0x02
+#define NVME_FEAT_TEMP_THRESHOLD                0x04
+#define NVME_FEAT_ERROR_RECOVERY                0x05
+#define NVME_FEAT_VOLATILE_WC                   0x06
+#define NVME_FEAT_NUM_QUEUES                    0x07
+#define NVME_FEAT_INTR_COALESCING               0x08
+#define NVME_FEAT_INTR_VECTOR_CFG               0x09
+#define NVME_FEAT_WRITE_ATOMICITY               0x0a
+#define NVME_FEAT_ASYNC_EVENT_CFG               0x0b
+/** @} */
+
+/** @name Completion status values, status code type in bits 10:8 and the status
+ * code in bits 7:0. Shifted left by one when written to the completion entry.
+ * @{ */
+#define NVME_STS(a_uSct, a_uSc)                 ((uint16_t)(((a_uSct) << 8) | (a_uSc)))
+/** Do not retry flag. */
+#define NVME_STS_DNR                            RT_BIT(14)
+#define NVME_STS_SUCCESS                        NVME_STS(0, 0x00)
+#define NVME_STS_INVALID_OPCODE                 (NVME_STS(0, 0x01) | NVME_STS_DNR)
+#define NVME_STS_INVALID_FIELD                  (NVME_STS(0, 0x02) | NVME_STS_DNR)
+#define NVME_STS_DATA_XFER_ERROR                NVME_STS(0, 0x04)
+#define NVME_STS_INTERNAL_ERROR                 NVME_STS(0, 0x06)
+#define NVME_STS_INVALID_NAMESPACE              (NVME_STS(0, 0x0b) | NVME_STS_DNR)
+#define NVME_STS_CMD_SEQUENCE_ERROR             (NVME_STS(0, 0x0c) | NVME_STS_DNR)
+#define NVME_STS_PRP_OFFSET_INVALID             (NVME_STS(0, 0x13) | NVME_STS_DNR)
+#define NVME_STS_LBA_OUT_OF_RANGE               (NVME_STS(0, 0x80) | NVME_STS_DNR)
+#define NVME_STS_CQ_INVALID                     (NVME_STS(1, 0x00) | NVME_STS_DNR)
+#define NVME_STS_INVALID_QID                    (NVME_STS(1, 0x01) | NVME_STS_DNR)
+#define NVME_STS_INVALID_QUEUE_SIZE             (NVME_STS(1, 0x02) | NVME_STS_DNR)
+#define NVME_STS_AER_LIMIT_EXCEEDED             (NVME_STS(1, 0x05) | NVME_STS_DNR)
+#define NVME_STS_INVALID_INTR_VECTOR            (NVME_STS(1, 0x08) | NVME_STS_DNR)
+#define NVME_STS_INVALID_LOG_PAGE               (NVME_STS(1, 0x09) | NVME_STS_DNR)
+#define NVME_STS_INVALID_QUEUE_DELETION         (NVME_STS(1, 0x0c) | NVME_STS_DNR)
+#define NVME_STS_FEATURE_NOT_SAVEABLE           (NVME_STS(1, 0x0d) | NVME_STS_DNR)
+#define NVME_STS_WRITE_FAULT                    NVME_STS(2, 0x80)
+#define NVME_STS_UNRECOVERED_READ_ERROR         NVME_STS(2, 0x81)
+/** Internal marker, the completion is posted later. */
+#define NVME_STS_DEFERRED                       UINT16_MAX
+/** @} */
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+
+/**
+ * Submission queue entry.
+ */
+typedef struct NVMESQE
+{
+    /** Opcode. */
+    uint8_t                         u8Opc;
+    /** Fused operation and PRP/SGL selection. */
+    uint8_t                         u8Flags;
+    /** Command identifier. */
+    uint16_t                        u16Cid;
+    /** Namespace identifier. */
+    uint32_t                        u32Nsid;
+    /** Reserved. */
+    uint64_t                        u64Rsvd;
+    /** Metadata pointer. */
+    uint64_t                        u64MPtr;
+    /** PRP entry 1. */
+    uint64_t                        u64Prp1;
+    /** PRP entry 2. */
+    uint64_t                        u64Prp2;
+    /** Command dwords 10 to 15. */
+    uint32_t                        au32Cdw[6];
+} NVMESQE;
+AssertCompileSize(NVMESQE, 64);
+/** Pointer to a submission queue entry. */
+typedef NVMESQE *PNVMESQE;
+/** Pointer to a const submission queue entry. */
+typedef const NVMESQE *PCNVMESQE;
+
+/** Accessor for command dword 10 to 15 of a submission queue entry. */
+#define NVME_SQE_CDW(a_pSqe, a_iDw)             ((a_pSqe)->au32Cdw[(a_iDw) - 10])
+
+/**
+ * Completion queue entry.
+ */
+typedef struct NVMECQE
+{
+    /** Command specific result. */
+    uint32_t                        u32Dw0;
+    /** Reserved. */
+    uint32_t                        u32Rsvd;
+    /** Submission queue head pointer. */
+    uint16_t                        u16SqHead;
+    /** Submission queue identifier. */
+    uint16_t                        u16SqId;
+    /** Command identifier. */
+    uint16_t                        u16Cid;
+    /** Status field and phase tag. */
+    uint16_t                        u16Status;
+} NVMECQE;
+AssertCompileSize(NVMECQE, 16);
+/** Pointer to a completion queue entry. */
+typedef NVMECQE *PNVMECQE;
+
+/**
+ * Completion which could not be posted yet because the completion queue is full.
+ */
+typedef struct NVMECQEPENDING
+{
+    /** Node for the pending list of the completion queue. */
+    RTLISTNODE                      NodePending;
+    /** The entry without the phase tag. */
+    NVMECQE                         Cqe;
+} NVMECQEPENDING;
+/** Pointer to a pending completion. */
+typedef NVMECQEPENDING *PNVMECQEPENDING;
+
+/**
+ * Submission queue state.
+ */
+typedef struct NVMESQ
+{
+    /** Lock serializing the doorbell and command fetching. */
+    RTCRITSECT                      CritSect;
+    /** Guest physical address of the queue. */
+    RTGCPHYS                        GCPhysBase;
+    /** Number of entries. */
+    uint32_t                        cEntries;
+    /** Head index, the next entry to fetch. */
+    uint32_t volatile               uHead;
+    /** Tail index as written by the guest. */
+    uint32_t                        uTail;
+    /** Number of requests started from this queue which are not completed yet. */
+    uint32_t volatile               cReqsActive;
+    /** The completion queue this queue posts to. */
+    uint16_t                        idCq;
+    /** Command identifier of the pending Delete I/O Submission Queue command. */
+    uint16_t                        uCidDelete;
+    /** Flag whether the queue was created. */
+    bool                            fValid;
+    /** Flag whether the queue is waiting for outstanding requests before it is deleted. */
+    bool volatile                   fDeletePending;
+    /** Flag whether fetching stopped because the completion queue is congested. */
+    bool volatile                   fStalled;
+    /** Queue priority (unused, round robin arbitration only). */
+    uint8_t                         u8Prio;
+    /** Number of commands fetched from this queue. */
+    STAMCOUNTER                     StatCmds;
+} NVMESQ;
+/** Pointer to a submission queue. */
+typedef NVMESQ *PNVMESQ;
+
+/**
+ * Completion queue state.
+ */
+typedef struct NVMECQ
+{
+    /** Lock serializing posting completions and the doorbell. */
+    RTCRITSECT                      CritSect;
+    /** Guest physical address of the queue. */
+    RTGCPHYS                        GCPhysBase;
+    /** Number of entries. */
+    uint32_t                        cEntries;
+    /** Head index as written by the guest. */
+    uint32_t                        uHead;
+    /** Tail index, the next entry to post. */
+    uint32_t                        uTail;
+    /** Number of submission queues using this queue. */
+    uint32_t                        cSqs;
+    /** Number of completions posted since the last interrupt while coalescing. */
+    uint32_t                        cIntrCoalesced;
+    /** Number of completions in the pending list. */
+    uint32_t volatile               cPending;
+    /** Completions waiting for room in the queue, NVMECQEPENDING. */
+    RTLISTANCHOR                    LstPending;
+    /** Timer for the aggregation time of interrupt coalescing. */
+    PTMTIMERR3                      pTimerCoalesceR3;
+    /** Interrupt vector. */
+    uint16_t                        uVector;
+    /** The queue identifier. */
+    uint16_t                        idCq;
+    /** Flag whether the queue was created. */
+    bool                            fValid;
+    /** Current phase tag. */
+    bool                            fPhase;
+    /** Flag whether interrupts are enabled for this queue. */
+    bool                            fIntrEnabled;
+} NVMECQ;
+/** Pointer to a completion queue. */
+typedef NVMECQ *PNVMECQ;
+
+/**
+ * Guest memory segment of a transfer.
+ */
+typedef struct NVMEPRPSEG
+{
+    /** Guest physical address. */
+    RTGCPHYS                        GCPhys;
+    /** Size of the segment. */
+    uint32_t                        cb;
+} NVMEPRPSEG;
+/** Pointer to a guest memory segment. */
+typedef NVMEPRPSEG *PNVMEPRPSEG;
+
+/**
+ * Request type.
+ */
+typedef enum NVMEREQTYPE
+{
+    NVMEREQTYPE_INVALID = 0,
+    NVMEREQTYPE_READ,
+    NVMEREQTYPE_WRITE,
+    NVMEREQTYPE_FLUSH,
+    NVMEREQTYPE_DISCARD,
+    NVMEREQTYPE_32BIT_HACK = 0x7fffffff
+} NVMEREQTYPE;
+
+/**
+ * An I/O request in flight.
+ */
+typedef struct NVMEREQ
+{
+    /** The request type. */
+    NVMEREQTYPE                     enmType;
+    /** Controller generation the request was started in. */
+    uint32_t                        uGen;
+    /** The submission queue the command came from. */
+    uint16_t                        idSq;
+    /** Command identifier. */
+    uint16_t                        uCid;
+    /** Flag whether a flush is issued when the write completed. */
+    bool                            fFlushAfter;
+    /** Node in the list of requests for the I/O thread. */
+    RTLISTNODE                      NodeIo;
+    /** Start offset on the medium. */
+    uint64_t                        offStart;
+    /** Size of the transfer. */
+    size_t                          cbXfer;
+    /** The bounce buffer. */
+    RTSGSEG                         DataSeg;
+    /** Ranges for discard requests. */
+    PRTRANGE                        paRanges;
+    /** Number of ranges. */
+    unsigned                        cRanges;
+    /** Number of guest memory segments. */
+    uint32_t                        cPrpSegs;
+    /** The guest memory segments. */
+    NVMEPRPSEG                      aPrpSegs[NVME_PRP_SEGS_MAX];
+} NVMEREQ;
+/** Pointer to a request. */
+typedef NVMEREQ *PNVMEREQ;
+
+/**
+ * NVMe controller instance data.
+ */
+typedef struct NVME
+{
+    /** The PCI device structure. */
+    PCIDEVICE                       PciDev;
+    /** Pointer to the device instance. */
+    PPDMDEVINSR3                    pDevInsR3;
+    /** Base address of the register MMIO region. */
+    RTGCPHYS                        GCPhysMmio;
+
+    /** Controller lock, serializes the configuration registers. */
+    PDMCRITSECT                     CritSectCtrl;
+    /** Lock protecting the INTx state. */
+    RTCRITSECT                      CritSectIntr;
+
+    /** @name Registers.
+     * @{ */
+    uint32_t                        u32RegIntMask;
+    uint32_t                        u32RegCc;
+    uint32_t volatile               u32RegCsts;
+    uint32_t                        u32RegAqa;
+    uint64_t                        u64RegAsq;
+    uint64_t                        u64RegAcq;
+    /** @} */
+
+    /** @name Features.
+     * @{ */
+    uint32_t                        u32FeatArbitration;
+    uint32_t                        u32FeatPowerMgmt;
+    uint32_t                        u32FeatTempThreshold;
+    uint32_t                        u32FeatErrorRecovery;
+    uint32_t                        u32FeatVolatileWc;
+    uint32_t volatile               u32FeatIntrCoalescing;
+    uint32_t                        u32FeatWriteAtomicity;
+    uint32_t                        u32FeatAsyncEventCfg;
+    /** Flag whether Set Features Number of Queues was issued. */
+    bool                            fNumQueuesSet;
+    /** Per vector coalescing disable flags of the Interrupt Vector Configuration feature. */
+    bool                            afIntrVecCoalesceDisable[NVME_QUEUES_MAX];
+    /** @} */
+
+    /** Number of I/O queue pairs offered to the guest. */
+    uint32_t                        cIoQueues;
+    /** Default value of the interrupt coalescing feature. */
+    uint32_t                        u32IntrCoalescingDef;
+    /** Number of outstanding asynchronous event requests. */
+    uint32_t                        cAerOutstanding;
+    /** Controller generation, incremented on every reset. */
+    uint32_t volatile               uGen;
+    /** Completion queues with interrupts pending for INTx. */
+    uint64_t                        bmIntxPending;
+    /** Current INTx level. */
+    bool                            fIntxAsserted;
+    /** Flag whether MSI-X could be registered. */
+    bool                            fMsixRegistered;
+    /** Flag whether to use the asynchronous block interface if the driver has one. */
+    bool                            fUseAsyncInterfaceIfAvailable;
+    /** Flag whether the controller should signal when it becomes idle. */
+    bool volatile                   fSignalIdle;
+    /** Flag whether RDY is kept set after a reset until the requests of the
+     * previous generation completed. */
+    bool volatile                   fRdyHeld;
+    /** Number of requests in flight on all queues. */
+    uint32_t volatile               cReqsActive;
+
+    /** @name I/O thread for drivers without the asynchronous interface.
+     * @{ */
+    /** The I/O thread. */
+    R3PTRTYPE(PPDMTHREAD)           pThreadIo;
+    /** Event semaphore the I/O thread waits on. */
+    SUPSEMEVENT                     hEvtIo;
+    /** The support driver session handle. */
+    R3R0PTRTYPE(PSUPDRVSESSION)     pSupDrvSession;
+    /** Lock protecting the request list. */
+    RTCRITSECT                      CritSectIo;
+    /** Requests waiting for the I/O thread, NVMEREQ. */
+    RTLISTANCHOR                    LstReqsIo;
+    /** @} */
+
+    /** The submission queues, index 0 is the admin queue. */
+    NVMESQ                          aSqs[NVME_QUEUES_MAX];
+    /** The completion queues, index 0 is the admin queue. */
+    NVMECQ                          aCqs[NVME_QUEUES_MAX];
+
+    /** Cache for request structures. */
+    RTMEMCACHE                      hReqCache;
+
+    /** Serial number reported in the identify data. */
+    char                            szSerialNumber[20+1];
+    /** Model number reported in the identify data. */
+    char                            szModelNumber[40+1];
+    /** Firmware revision reported in the identify data. */
+    char                            szFirmwareRevision[8+1];
+
+    /** @name Namespace, LUN 0.
+     * @{ */
+    /** The base interface of the LUN. */
+    PDMIBASE                        INsBase;
+    /** The block port interface of the LUN. */
+    PDMIBLOCKPORT                   INsPort;
+    /** The asynchronous block port interface of the LUN. */
+    PDMIBLOCKASYNCPORT              INsPortAsync;
+    /** The attached driver. */
+    R3PTRTYPE(PPDMIBASE)            pDrvBase;
+    /** The block interface of the driver. */
+    R3PTRTYPE(PPDMIBLOCK)           pDrvBlock;
+    /** The asynchronous block interface of the driver, optional. */
+    R3PTRTYPE(PPDMIBLOCKASYNC)      pDrvBlockAsync;
+    /** Number of logical blocks. */
+    uint64_t                        cSectors;
+    /** Size of a logical block. */
+    uint32_t                        cbSector;
+    /** Flag whether discard is supported by the driver. */
+    bool                            fDiscard;
+    /** The LED of the namespace. */
+    PDMLED                          Led;
+    /** @} */
+
+    /** Status LUN: The base interface. */
+    PDMIBASE                        IBase;
+    /** Status LUN: Leds interface. */
+    PDMILEDPORTS                    ILeds;
+    /** Status LUN: Partner of ILeds. */
+    R3PTRTYPE(PPDMILEDCONNECTORS)   pLedsConnector;
+
+    /** @name SMART counters.
+     * @{ */
+    uint64_t volatile               cbDataRead;
+    uint64_t volatile               cbDataWritten;
+    uint64_t volatile               cHostReads;
+    uint64_t volatile               cHostWrites;
+    /** @} */
+
+    /** @name Statistics.
+     * @{ */
+    STAMCOUNTER                     StatReads;
+    STAMCOUNTER                     StatWrites;
+    STAMCOUNTER                     StatFlushes;
+    STAMCOUNTER                     StatDiscards;
+    STAMCOUNTER                     StatBytesRead;
+    STAMCOUNTER                     StatBytesWritten;
+    STAMCOUNTER                     StatAdminCmds;
+    STAMCOUNTER                     StatDoorbellWrites;
+    STAMCOUNTER                     StatIntrRaised;
+    STAMCOUNTER                     StatIntrCoalesced;
+    STAMCOUNTER                     StatCqFull;
+    STAMCOUNTER                     StatSqStalled;
+    STAMCOUNTER                     StatErrors;
+    /** @} */
+} NVME;
+/** Pointer to the NVMe controller instance data. */
+typedef NVME *PNVME;
+
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+#ifdef IN_RING3
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+static void nvmeR3SqProcess(PNVME pThis, PNVMESQ pSq, uint16_t idSq);
+
+
+/* -=-=-=-=-=- Interrupts -=-=-=-=-=- */
+
+/**
+ * Returns whether the guest enabled MSI-X.
+ *
+ * @returns true if MSI-X is enabled.
+ * @param   pThis       The NVMe controller instance.
+ */
+DECLINLINE(bool) nvmeR3IsMsixEnabled(PNVME pThis)
+{
+    return    pThis->fMsixRegistered
+           && (  PCIDevGetWord(&pThis->PciDev, NVME_MSIX_CAP_OFFSET + VBOX_MSIX_CAP_MESSAGE_CONTROL)
+               & VBOX_PCI_MSIX_FLAGS_ENABLE);
+}
+
+/**
+ * Updates the INTx level from the pending completion queues and the mask.
+ *
+ * @param   pThis       The NVMe controller instance.
+ *
+ * @note Caller must own CritSectIntr.
+ */
+static void nvmeR3IntxUpdate(PNVME pThis)
+{
+    Assert(RTCritSectIsOwner(&pThis->CritSectIntr));
+
+    bool fAssert =    pThis->bmIntxPending != 0
+                   && !(pThis->u32RegIntMask & RT_BIT_32(0))
+                   && !nvmeR3IsMsixEnabled(pThis);
+    if (fAssert != pThis->fIntxAsserted)
+    {
+        pThis->fIntxAsserted = fAssert;
+        PDMDevHlpPCISetIrq(pThis->pDevInsR3, 0, fAssert ? PDM_IRQ_LEVEL_HIGH : PDM_IRQ_LEVEL_LOW);
+    }
+}
+
+/**
+ * Sets or clears the INTx pending state of a completion queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   idCq        The completion queue.
+ * @param   fPending    Whether entries are waiting to be processed by the guest.
+ */
+static void nvmeR3IntxSet(PNVME pThis, uint16_t idCq, bool fPending)
+{
+    RTCritSectEnter(&pThis->CritSectIntr);
+    if (fPending)
+        pThis->bmIntxPending |= RT_BIT_64(idCq);
+    else
+        pThis->bmIntxPending &= ~RT_BIT_64(idCq);
+    nvmeR3IntxUpdate(pThis);
+    RTCritSectLeave(&pThis->CritSectIntr);
+}
+
+/**
+ * Signals the guest that new entries were posted to a completion queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ *
+ * @note Caller must own the lock of the completion queue.
+ */
+static void nvmeR3CqIntrRaise(PNVME pThis, PNVMECQ pCq)
+{
+    pCq->cIntrCoalesced = 0;
+    STAM_REL_COUNTER_INC(&pThis->StatIntrRaised);
+
+    if (nvmeR3IsMsixEnabled(pThis))
+        PDMDevHlpPCISetIrq(pThis->pDevInsR3, pCq->uVector, PDM_IRQ_LEVEL_HIGH);
+    else
+        nvmeR3IntxSet(pThis, pCq->idCq, true /*fPending*/);
+}
+
+/**
+ * Decides whether to raise an interrupt for new completions right away or
+ * to hold it back for coalescing.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ *
+ * @note Caller must own the lock of the completion queue.
+ */
+static void nvmeR3CqIntrNotify(PNVME pThis, PNVMECQ pCq)
+{
+    if (!pCq->fIntrEnabled)
+        return;
+
+    uint32_t u32Coalescing = ASMAtomicReadU32(&pThis->u32FeatIntrCoalescing);
+    uint32_t uThreshold    = u32Coalescing & 0xff;
+    uint32_t uTime         = (u32Coalescing >> 8) & 0xff;
+
+    /* The admin queue is never coalesced. The threshold is 0's based. */
+    if (   pCq->idCq != 0
+        && uThreshold
+        && uTime
+        && !pThis->afIntrVecCoalesceDisable[pCq->uVector])
+    {
+        pCq->cIntrCoalesced++;
+        if (pCq->cIntrCoalesced <= uThreshold)
+        {
+            STAM_REL_COUNTER_INC(&pThis->StatIntrCoalesced);
+            if (!TMTimerIsActive(pCq->pTimerCoalesceR3))
+                TMTimerSetMicro(pCq->pTimerCoalesceR3, uTime * 100);
+            return;
+        }
+
+        TMTimerStop(pCq->pTimerCoalesceR3);
+    }
+
+    nvmeR3CqIntrRaise(pThis, pCq);
+}
+
+/**
+ * Raises the interrupt held back for coalescing, if any.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ */
+static void nvmeR3CqIntrCoalesceFlush(PNVME pThis, PNVMECQ pCq)
+{
+    RTCritSectEnter(&pCq->CritSect);
+    if (pCq->pTimerCoalesceR3)
+        TMTimerStop(pCq->pTimerCoalesceR3);
+    if (pCq->fValid && pCq->cIntrCoalesced)
+        nvmeR3CqIntrRaise(pThis, pCq);
+    RTCritSectLeave(&pCq->CritSect);
+}
+
+/**
+ * @callback_method_impl{FNTMTIMERDEV, Aggregation time of interrupt coalescing.}
+ */
+static DECLCALLBACK(void) nvmeR3IntrCoalesceTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
+{
+    PNVME   pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PNVMECQ pCq   = (PNVMECQ)pvUser;
+    NOREF(pTimer);
+
+    RTCritSectEnter(&pCq->CritSect);
+    if (pCq->fValid && pCq->cIntrCoalesced)
+        nvmeR3CqIntrRaise(pThis, pCq);
+    RTCritSectLeave(&pCq->CritSect);
+}
+
+
+/* -=-=-=-=-=- Completion queues -=-=-=-=-=- */
+
+/**
+ * Writes a completion entry to the next free slot of the completion queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ * @param   pCqe        The entry without the phase tag.
+ *
+ * @note Caller must own the lock of the completion queue and make sure the queue is not full.
+ */
+static void nvmeR3CqWriteEntry(PNVME pThis, PNVMECQ pCq, PNVMECQE pCqe)
+{
+    NVMECQE Cqe = *pCqe;
+    Cqe.u16Status = (uint16_t)((Cqe.u16Status << 1) | (pCq->fPhase ? 1 : 0));
+
+    PDMDevHlpPCIPhysWrite(pThis->pDevInsR3, pCq->GCPhysBase + pCq->uTail * sizeof(NVMECQE), &Cqe, sizeof(Cqe));
+
+    pCq->uTail++;
+    if (pCq->uTail == pCq->cEntries)
+    {
+        pCq->uTail  = 0;
+        pCq->fPhase = !pCq->fPhase;
+    }
+}
+
+/**
+ * Returns whether the completion queue has no free slot.
+ *
+ * @returns true if full.
+ * @param   pCq         The completion queue.
+ */
+DECLINLINE(bool) nvmeR3CqIsFull(PNVMECQ pCq)
+{
+    return (pCq->uTail + 1) % pCq->cEntries == pCq->uHead;
+}
+
+/**
+ * Posts a completion to a completion queue, queueing it if the queue is full.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   idCq        The completion queue.
+ * @param   idSq        The submission queue the command came from.
+ * @param   uCid        The command identifier.
+ * @param   u32Dw0      Command specific result.
+ * @param   u16Status   The status, NVME_STS_XXX.
+ */
+static void nvmeR3CqPost(PNVME pThis, uint16_t idCq, uint16_t idSq, uint16_t uCid, uint32_t u32Dw0, uint16_t u16Status)
+{
+    PNVMECQ pCq = &pThis->aCqs[idCq];
+    NVMECQE Cqe;
+
+    Cqe.u32Dw0    = u32Dw0;
+    Cqe.u32Rsvd   = 0;
+    Cqe.u16SqHead = (uint16_t)ASMAtomicReadU32(&pThis->aSqs[idSq].uHead);
+    Cqe.u16SqId   = idSq;
+    Cqe.u16Cid    = uCid;
+    Cqe.u16Status = u16Status;
+
+    if (u16Status != NVME_STS_SUCCESS)
+        STAM_REL_COUNTER_INC(&pThis->StatErrors);
+
+    RTCritSectEnter(&pCq->CritSect);
+    if (pCq->fValid)
+    {
+        if (   !RTListIsEmpty(&pCq->LstPending)
+            || nvmeR3CqIsFull(pCq))
+        {
+            PNVMECQEPENDING pPending = (PNVMECQEPENDING)RTMemAllocZ(sizeof(NVMECQEPENDING));
+            if (pPending)
+            {
+                pPending->Cqe = Cqe;
+                RTListAppend(&pCq->LstPending, &pPending->NodePending);
+                ASMAtomicIncU32(&pCq->cPending);
+                STAM_REL_COUNTER_INC(&pThis->StatCqFull);
+            }
+            else
+                LogRel(("NVMe#%u: Out of memory queueing a completion for CQ %u, dropped\n",
+                        pThis->pDevInsR3->iInstance, idCq));
+        }
+        else
+        {
+            nvmeR3CqWriteEntry(pThis, pCq, &Cqe);
+            nvmeR3CqIntrNotify(pThis, pCq);
+        }
+    }
+    RTCritSectLeave(&pCq->CritSect);
+}
+
+/**
+ * Frees all completions waiting for room in the completion queue.
+ *
+ * @param   pCq         The completion queue.
+ */
+static void nvmeR3CqPendingFree(PNVMECQ pCq)
+{
+    PNVMECQEPENDING pIt, pItNext;
+    RTListForEachSafe(&pCq->LstPending, pIt, pItNext, NVMECQEPENDING, NodePending)
+    {
+        RTListNodeRemove(&pIt->NodePending);
+        RTMemFree(pIt);
+    }
+    pCq->cPending = 0;
+}
+
+/**
+ * Moves pending completions to the queue as long as there is room.
+ *
+ * @returns true if at least one entry was posted.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pCq         The completion queue.
+ *
+ * @note Caller must own the lock of the completion queue.
+ */
+static bool nvmeR3CqPendingDrain(PNVME pThis, PNVMECQ pCq)
+{
+    bool fPosted = false;
+
+    while (   !RTListIsEmpty(&pCq->LstPending)
+           && !nvmeR3CqIsFull(pCq))
+    {
+        PNVMECQEPENDING pPending = RTListGetFirst(&pCq->LstPending, NVMECQEPENDING, NodePending);
+        RTListNodeRemove(&pPending->NodePending);
+        ASMAtomicDecU32(&pCq->cPending);
+        nvmeR3CqWriteEntry(pThis, pCq, &pPending->Cqe);
+        RTMemFree(pPending);
+        fPosted = true;
+    }
+
+    return fPosted;
+}
+
+/**
+ * Handles a write to the head doorbell of a completion queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   idCq        The completion queue.
+ * @param   uHead       The new head index.
+ */
+static void nvmeR3CqDoorbellWrite(PNVME pThis, uint16_t idCq, uint32_t uHead)
+{
+    PNVMECQ pCq = &pThis->aCqs[idCq];
+    bool fKickSqs = false;
+
+    RTCritSectEnter(&pCq->CritSect);
+    if (   pCq->fValid
+        && uHead < pCq->cEntries)
+    {
+        pCq->uHead = uHead;
+
+        if (nvmeR3CqPendingDrain(pThis, pCq))
+            nvmeR3CqIntrNotify(pThis, pCq);
+        fKickSqs = ASMAtomicReadU32(&pCq->cPending) < pCq->cEntries;
+
+        /* INTx stays asserted as long as the guest didn't consume all entries. */
+        if (   pCq->uHead == pCq->uTail
+            && (pThis->bmIntxPending & RT_BIT_64(idCq)))
+            nvmeR3IntxSet(pThis, idCq, false /*fPending*/);
+    }
+    else
+        Log(("NVMe: Invalid head doorbell write to CQ %u (uHead=%u)\n", idCq, uHead));
+    RTCritSectLeave(&pCq->CritSect);
+
+    /* Resume submission queues which stopped fetching because of this queue. */
+    if (fKickSqs)
+    {
+        for (uint16_t idSq = 1; idSq <= pThis->cIoQueues; idSq++)
+        {
+            PNVMESQ pSq = &pThis->aSqs[idSq];
+            if (   ASMAtomicReadBool(&pSq->fStalled)
+                && pSq->idCq == idCq)
+            {
+                RTCritSectEnter(&pSq->CritSect);
+                ASMAtomicWriteBool(&pSq->fStalled, false);
+                nvmeR3SqProcess(pThis, pSq, idSq);
+                RTCritSectLeave(&pSq->CritSect);
+            }
+        }
+    }
+}
+
+
+/* -=-=-=-=-=- Guest memory transfers -=-=-=-=-=- */
+
+/**
+ * Adds a guest memory segment, merging it with the previous one if contiguous.
+ *
+ * @returns true on success, false if there is no free segment.
+ */
+static bool nvmeR3PrpSegAdd(PNVMEPRPSEG paSegs, uint32_t cSegsMax, uint32_t *pcSegs, RTGCPHYS GCPhys, uint32_t cb)
+{
+    uint32_t cSegs = *pcSegs;
+
+    if (   cSegs
+        && paSegs[cSegs - 1].GCPhys + paSegs[cSegs - 1].cb == GCPhys)
+    {
+        paSegs[cSegs - 1].cb += cb;
+        return true;
+    }
+
+    if (cSegs == cSegsMax)
+        return false;
+
+    paSegs[cSegs].GCPhys = GCPhys;
+    paSegs[cSegs].cb     = cb;
+    *pcSegs = cSegs + 1;
+    return true;
+}
+
+/**
+ * Converts the PRP entries of a command into a list of guest memory segments.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   u64Prp1     PRP entry 1.
+ * @param   u64Prp2     PRP entry 2, either the second page or a PRP list pointer.
+ * @param   cbXfer      Size of the transfer, at most NVME_XFER_SIZE_MAX.
+ * @param   paSegs      Where to store the segments.
+ * @param   cSegsMax    Number of entries in paSegs.
+ * @param   pcSegs      Where to store the number of segments used.
+ */
+static uint16_t nvmeR3PrpParse(PNVME pThis, uint64_t u64Prp1, uint64_t u64Prp2, size_t cbXfer,
+                               PNVMEPRPSEG paSegs, uint32_t cSegsMax, uint32_t *pcSegs)
+{
+    uint32_t cSegs = 0;
+
+    Assert(cbXfer <= NVME_XFER_SIZE_MAX);
+    *pcSegs = 0;
+
+    if (u64Prp1 & 0x3)
+        return NVME_STS_PRP_OFFSET_INVALID;
+
+    uint32_t cbThis = (uint32_t)RT_MIN(cbXfer, NVME_PAGE_SIZE - (u64Prp1 & NVME_PAGE_OFFSET_MASK));
+    nvmeR3PrpSegAdd(paSegs, cSegsMax, &cSegs, u64Prp1, cbThis);
+    cbXfer -= cbThis;
+
+    if (cbXfer && cbXfer <= NVME_PAGE_SIZE)
+    {
+        /* PRP entry 2 is the second and last page. */
+        if (u64Prp2 & NVME_PAGE_OFFSET_MASK)
+            return NVME_STS_PRP_OFFSET_INVALID;
+        nvmeR3PrpSegAdd(paSegs, cSegsMax, &cSegs, u64Prp2, (uint32_t)cbXfer);
+        cbXfer = 0;
+    }
+    else if (cbXfer)
+    {
+        /* PRP entry 2 points to a PRP list, the last entry of each list page chains to the next one. */
+        uint64_t au64Prps[NVME_PRP_SEGS_MAX];
+        RTGCPHYS GCPhysList = u64Prp2;
+        uint32_t cLists     = 0;
+
+        while (cbXfer)
+        {
+            if (   (GCPhysList & 0x7)
+                || ++cLists > NVME_PRP_SEGS_MAX)
+                return NVME_STS_PRP_OFFSET_INVALID;
+
+            uint32_t cPrpsPage  = (uint32_t)((NVME_PAGE_SIZE - (GCPhysList & NVME_PAGE_OFFSET_MASK)) / sizeof(uint64_t));
+            uint32_t cPagesLeft = (uint32_t)((cbXfer + NVME_PAGE_SIZE - 1) / NVME_PAGE_SIZE);
+            bool     fChain     = cPagesLeft > cPrpsPage;
+            uint32_t cPrps      = fChain ? cPrpsPage : cPagesLeft;
+
+            AssertReturn(cPrps <= RT_ELEMENTS(au64Prps), NVME_STS_INTERNAL_ERROR);
+            int rc = PDMDevHlpPCIPhysRead(pThis->pDevInsR3, GCPhysList, &au64Prps[0], cPrps * sizeof(uint64_t));
+            if (RT_FAILURE(rc))
+                return NVME_STS_DATA_XFER_ERROR;
+
+            uint32_t cPrpsData = fChain ? cPrps - 1 : cPrps;
+            for (uint32_t i = 0; i < cPrpsData; i++)
+            {
+                if (au64Prps[i] & NVME_PAGE_OFFSET_MASK)
+                    return NVME_STS_PRP_OFFSET_INVALID;
+
+                cbThis = (uint32_t)RT_MIN(cbXfer, NVME_PAGE_SIZE);
+                if (!nvmeR3PrpSegAdd(paSegs, cSegsMax, &cSegs, au64Prps[i], cbThis))
+                    return NVME_STS_INTERNAL_ERROR;
+                cbXfer -= cbThis;
+            }
+
+            if (fChain)
+                GCPhysList = au64Prps[cPrps - 1];
+        }
+    }
+
+    *pcSegs = cSegs;
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Copies data between a buffer and guest memory segments.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   paSegs      The guest memory segments.
+ * @param   cSegs       Number of segments.
+ * @param   pvBuf       The buffer.
+ * @param   cbBuf       Size of the buffer.
+ * @param   fToGuest    Whether to copy from the buffer into guest memory.
+ */
+static int nvmeR3PrpCopy(PNVME pThis, PNVMEPRPSEG paSegs, uint32_t cSegs, void *pvBuf, size_t cbBuf, bool fToGuest)
+{
+    uint8_t *pbBuf = (uint8_t *)pvBuf;
+    int      rc    = VINF_SUCCESS;
+
+    for (uint32_t i = 0; i < cSegs && cbBuf && RT_SUCCESS(rc); i++)
+    {
+        size_t cbThis = RT_MIN(cbBuf, paSegs[i].cb);
+        if (fToGuest)
+            rc = PDMDevHlpPCIPhysWrite(pThis->pDevInsR3, paSegs[i].GCPhys, pbBuf, cbThis);
+        else
+            rc = PDMDevHlpPCIPhysRead(pThis->pDevInsR3, paSegs[i].GCPhys, pbBuf, cbThis);
+        pbBuf += cbThis;
+        cbBuf -= cbThis;
+    }
+
+    return rc;
+}
+
+/**
+ * Copies the data of an admin command into the guest buffer described by the command.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSqe        The command.
+ * @param   pvBuf       The data.
+ * @param   cbBuf       Size of the data, at most a few pages.
+ */
+static uint16_t nvmeR3AdmDataToGuest(PNVME pThis, PCNVMESQE pSqe, const void *pvBuf, size_t cbBuf)
+{
+    NVMEPRPSEG aSegs[3];
+    uint32_t   cSegs = 0;
+
+    uint16_t u16Sts = nvmeR3PrpParse(pThis, pSqe->u64Prp1, pSqe->u64Prp2, cbBuf, &aSegs[0], RT_ELEMENTS(aSegs), &cSegs);
+    if (u16Sts == NVME_STS_SUCCESS)
+    {
+        int rc = nvmeR3PrpCopy(pThis, &aSegs[0], cSegs, (void *)pvBuf, cbBuf, true /*fToGuest*/);
+        if (RT_FAILURE(rc))
+            u16Sts = NVME_STS_DATA_XFER_ERROR;
+    }
+
+    return u16Sts;
+}
+
+
+/* -=-=-=-=-=- I/O requests -=-=-=-=-=- */
+
+/**
+ * Finishes the pending deletion of a submission queue once all its requests completed.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   idSq        The submission queue.
+ */
+static void nvmeR3SqDeleteFinish(PNVME pThis, uint16_t idSq)
+{
+    PNVMESQ  pSq = &pThis->aSqs[idSq];
+    uint16_t uCid;
+
+    RTCritSectEnter(&pSq->CritSect);
+    PNVMECQ pCq = &pThis->aCqs[pSq->idCq];
+    RTCritSectEnter(&pCq->CritSect);
+    if (pCq->cSqs)
+        pCq->cSqs--;
+    RTCritSectLeave(&pCq->CritSect);
+
+    pSq->fValid   = false;
+    pSq->fStalled = false;
+    uCid = pSq->uCidDelete;
+    RTCritSectLeave(&pSq->CritSect);
+
+    Log(("NVMe: Deleted SQ %u\n", idSq));
+    nvmeR3CqPost(pThis, 0, 0, uCid, 0, NVME_STS_SUCCESS);
+}
+
+/**
+ * Completes a request, posting the completion and freeing the request.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pReq        The request.
+ * @param   rcReq       Status code of the request.
+ */
+static void nvmeR3ReqComplete(PNVME pThis, PNVMEREQ pReq, int rcReq);
+
+/**
+ * Starts a request on the attached driver.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pReq        The request.
+ */
+static void nvmeR3ReqSubmit(PNVME pThis, PNVMEREQ pReq)
+{
+    int rc;
+
+    if (pThis->pDrvBlockAsync)
+    {
+        switch (pReq->enmType)
+        {
+            case NVMEREQTYPE_READ:
+                rc = pThis->pDrvBlockAsync->pfnStartRead(pThis->pDrvBlockAsync, pReq->offStart,
+                                                         &pReq->DataSeg, 1, pReq->cbXfer, pReq);
+                break;
+            case NVMEREQTYPE_WRITE:
+                rc = pThis->pDrvBlockAsync->pfnStartWrite(pThis->pDrvBlockAsync, pReq->offStart,
+                                                          &pReq->DataSeg, 1, pReq->cbXfer, pReq);
+                break;
+            case NVMEREQTYPE_FLUSH:
+                rc = pThis->pDrvBlockAsync->pfnStartFlush(pThis->pDrvBlockAsync, pReq);
+                break;
+            case NVMEREQTYPE_DISCARD:
+                rc = pThis->pDrvBlockAsync->pfnStartDiscard(pThis->pDrvBlockAsync, pReq->paRanges, pReq->cRanges, pReq);
+                break;
+            default:
+                AssertMsgFailed(("Invalid request type %d\n", pReq->enmType));
+                rc = VERR_INVALID_PARAMETER;
+        }
+
+        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+            nvmeR3ReqComplete(pThis, pReq, VINF_SUCCESS);
+        else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            nvmeR3ReqComplete(pThis, pReq, rc);
+    }
+    else
+    {
+        /* The synchronous interface blocks, leave it to the I/O thread. */
+        RTCritSectEnter(&pThis->CritSectIo);
+        RTListAppend(&pThis->LstReqsIo, &pReq->NodeIo);
+        RTCritSectLeave(&pThis->CritSectIo);
+
+        rc = SUPSemEventSignal(pThis->pSupDrvSession, pThis->hEvtIo);
+        AssertRC(rc);
+    }
+}
+
+/**
+ * Processes a request with the synchronous block interface.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pReq        The request.
+ */
+static void nvmeR3ReqProcessSync(PNVME pThis, PNVMEREQ pReq)
+{
+    int rc;
+
+    switch (pReq->enmType)
+    {
+        case NVMEREQTYPE_READ:
+            rc = pThis->pDrvBlock->pfnRead(pThis->pDrvBlock, pReq->offStart, pReq->DataSeg.pvSeg, pReq->cbXfer);
+            break;
+        case NVMEREQTYPE_WRITE:
+            rc = pThis->pDrvBlock->pfnWrite(pThis->pDrvBlock, pReq->offStart, pReq->DataSeg.pvSeg, pReq->cbXfer);
+            break;
+        case NVMEREQTYPE_FLUSH:
+            rc = pThis->pDrvBlock->pfnFlush(pThis->pDrvBlock);
+            break;
+        case NVMEREQTYPE_DISCARD:
+            rc = pThis->pDrvBlock->pfnDiscard(pThis->pDrvBlock, pReq->paRanges, pReq->cRanges);
+            break;
+        default:
+            AssertMsgFailed(("Invalid request type %d\n", pReq->enmType));
+            rc = VERR_INVALID_PARAMETER;
+    }
+
+    nvmeR3ReqComplete(pThis, pReq, rc);
+}
+
+/**
+ * I/O thread processing the requests for drivers without the asynchronous
+ * block interface.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   pThread     The thread.
+ */
+static DECLCALLBACK(int) nvmeR3IoThread(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (pThread->enmState == PDMTHREADSTATE_INITIALIZING)
+        return VINF_SUCCESS;
+
+    while (pThread->enmState == PDMTHREADSTATE_RUNNING)
+    {
+        RTLISTANCHOR LstReqs;
+
+        RTCritSectEnter(&pThis->CritSectIo);
+        RTListMove(&LstReqs, &pThis->LstReqsIo);
+        RTCritSectLeave(&pThis->CritSectIo);
+
+        if (RTListIsEmpty(&LstReqs))
+        {
+            int rc = SUPSemEventWaitNoResume(pThis->pSupDrvSession, pThis->hEvtIo, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+            continue;
+        }
+
+        PNVMEREQ pReq, pReqNext;
+        RTListForEachSafe(&LstReqs, pReq, pReqNext, NVMEREQ, NodeIo)
+        {
+            RTListNodeRemove(&pReq->NodeIo);
+            nvmeR3ReqProcessSync(pThis, pReq);
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Unblocks the I/O thread so it can respond to a state change.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   pThread     The thread.
+ */
+static DECLCALLBACK(int) nvmeR3IoThreadWakeUp(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(pThread);
+
+    return SUPSemEventSignal(pThis->pSupDrvSession, pThis->hEvtIo);
+}
+
+static void nvmeR3ReqComplete(PNVME pThis, PNVMEREQ pReq, int rcReq)
+{
+    PPDMDEVINS pDevIns = pThis->pDevInsR3;
+    uint16_t   u16Sts  = NVME_STS_SUCCESS;
+    uint16_t   idSq    = pReq->idSq;
+    PNVMESQ    pSq     = &pThis->aSqs[idSq];
+
+    /*
+     * Requests started before the last controller reset complete silently,
+     * the guest may have reused the memory of their transfers already.
+     */
+    bool fCurrent = pReq->uGen == ASMAtomicReadU32(&pThis->uGen);
+
+    if (RT_SUCCESS(rcReq))
+    {
+        if (pReq->enmType == NVMEREQTYPE_READ)
+        {
+            if (fCurrent)
+            {
+                int rc = nvmeR3PrpCopy(pThis, &pReq->aPrpSegs[0], pReq->cPrpSegs, pReq->DataSeg.pvSeg,
+                                       pReq->cbXfer, true /*fToGuest*/);
+                if (RT_FAILURE(rc))
+                    u16Sts = NVME_STS_DATA_XFER_ERROR;
+            }
+            pThis->Led.Actual.s.fReading = 0;
+        }
+        else if (pReq->enmType == NVMEREQTYPE_WRITE)
+        {
+            pThis->Led.Actual.s.fWriting = 0;
+            if (pReq->fFlushAfter && fCurrent)
+            {
+                /* Forced unit access or disabled write cache, make the data stable first. */
+                pReq->fFlushAfter = false;
+                pReq->enmType     = NVMEREQTYPE_FLUSH;
+                nvmeR3ReqSubmit(pThis, pReq);
+                return;
+            }
+        }
+    }
+    else
+    {
+        LogRel(("NVMe#%u: Request type %d on SQ %u (CID %#x, offset %#RX64, %zu bytes) failed with %Rrc\n",
+                pDevIns->iInstance, pReq->enmType, idSq, pReq->uCid, pReq->offStart, pReq->cbXfer, rcReq));
+        if (pReq->enmType == NVMEREQTYPE_READ)
+        {
+            u16Sts = NVME_STS_UNRECOVERED_READ_ERROR;
+            pThis->Led.Actual.s.fReading = 0;
+        }
+        else if (pReq->enmType == NVMEREQTYPE_WRITE)
+        {
+            u16Sts = NVME_STS_WRITE_FAULT;
+            pThis->Led.Actual.s.fWriting = 0;
+        }
+        else
+            u16Sts = NVME_STS_INTERNAL_ERROR;
+    }
+
+    if (fCurrent)
+        nvmeR3CqPost(pThis, pSq->idCq, idSq, pReq->uCid, 0, u16Sts);
+
+    if (pReq->DataSeg.pvSeg)
+        RTMemFree(pReq->DataSeg.pvSeg);
+    if (pReq->paRanges)
+        RTMemFree(pReq->paRanges);
+    RTMemCacheFree(pThis->hReqCache, pReq);
+
+    if (   ASMAtomicDecU32(&pSq->cReqsActive) == 0
+        && ASMAtomicXchgBool(&pSq->fDeletePending, false))
+        nvmeR3SqDeleteFinish(pThis, idSq);
+
+    if (ASMAtomicDecU32(&pThis->cReqsActive) == 0)
+    {
+        /* The last request of the previous generation is gone, finish the reset. */
+        if (ASMAtomicXchgBool(&pThis->fRdyHeld, false))
+            ASMAtomicAndU32(&pThis->u32RegCsts, ~NVME_CSTS_RDY);
+        if (pThis->fSignalIdle)
+            PDMDevHlpAsyncNotificationCompleted(pDevIns);
+    }
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKASYNCPORT,pfnTransferCompleteNotify}
+ */
+static DECLCALLBACK(int) nvmeR3TransferCompleteNotify(PPDMIBLOCKASYNCPORT pInterface, void *pvUser, int rcReq)
+{
+    PNVME pThis = RT_FROM_MEMBER(pInterface, NVME, INsPortAsync);
+
+    nvmeR3ReqComplete(pThis, (PNVMEREQ)pvUser, rcReq);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Checks the namespace and LBA range of a read or write command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3IoCheckRange(PNVME pThis, uint64_t uLba, uint32_t cLbas)
+{
+    if (   uLba >= pThis->cSectors
+        || cLbas > pThis->cSectors - uLba)
+        return NVME_STS_LBA_OUT_OF_RANGE;
+    if ((uint64_t)cLbas * pThis->cbSector > NVME_XFER_SIZE_MAX)
+        return NVME_STS_INVALID_FIELD;
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Processes a command from an I/O submission queue.
+ *
+ * @returns NVMe status code if the command completed right away,
+ *          NVME_STS_DEFERRED if a request was started.
+ * @param   pThis       The NVMe controller instance.
+ * @param   idSq        The submission queue.
+ * @param   pSqe        The command.
+ */
+static uint16_t nvmeR3IoCmdProcess(PNVME pThis, uint16_t idSq, PCNVMESQE pSqe)
+{
+    NVMEREQTYPE enmType;
+
+    if (!pThis->pDrvBase)
+        return NVME_STS_INVALID_NAMESPACE;
+
+    switch (pSqe->u8Opc)
+    {
+        case NVME_NVM_READ:
+            enmType = NVMEREQTYPE_READ;
+            break;
+        case NVME_NVM_WRITE:
+            enmType = NVMEREQTYPE_WRITE;
+            break;
+        case NVME_NVM_FLUSH:
+            enmType = NVMEREQTYPE_FLUSH;
+            break;
+        case NVME_NVM_DSM:
+            if (!pThis->fDiscard)
+                return NVME_STS_INVALID_OPCODE;
+            /* Only deallocation does anything, the attributes are hints. */
+            if (!(NVME_SQE_CDW(pSqe, 11) & RT_BIT_32(2)))
+                return NVME_STS_SUCCESS;
+            enmType = NVMEREQTYPE_DISCARD;
+            break;
+        default:
+            return NVME_STS_INVALID_OPCODE;
+    }
+
+    if (   pSqe->u32Nsid != 1
+        && !(enmType == NVMEREQTYPE_FLUSH && pSqe->u32Nsid == UINT32_MAX))
+        return NVME_STS_INVALID_NAMESPACE;
+
+    PNVMEREQ pReq = (PNVMEREQ)RTMemCacheAlloc(pThis->hReqCache);
+    if (!pReq)
+        return NVME_STS_INTERNAL_ERROR;
+
+    pReq->enmType     = enmType;
+    pReq->uGen        = ASMAtomicReadU32(&pThis->uGen);
+    pReq->idSq        = idSq;
+    pReq->uCid        = pSqe->u16Cid;
+    pReq->fFlushAfter = false;
+    pReq->offStart    = 0;
+    pReq->cbXfer      = 0;
+    pReq->DataSeg.pvSeg = NULL;
+    pReq->DataSeg.cbSeg = 0;
+    pReq->paRanges    = NULL;
+    pReq->cRanges     = 0;
+    pReq->cPrpSegs    = 0;
+
+    uint16_t u16Sts = NVME_STS_SUCCESS;
+    bool     fDone  = false;
+    if (enmType == NVMEREQTYPE_READ || enmType == NVMEREQTYPE_WRITE)
+    {
+        uint64_t uLba  = RT_MAKE_U64(NVME_SQE_CDW(pSqe, 10), NVME_SQE_CDW(pSqe, 11));
+        uint32_t cLbas = (NVME_SQE_CDW(pSqe, 12) & 0xffff) + 1;
+
+        u16Sts = nvmeR3IoCheckRange(pThis, uLba, cLbas);
+        if (u16Sts == NVME_STS_SUCCESS)
+        {
+            pReq->offStart = uLba * pThis->cbSector;
+            pReq->cbXfer   = (size_t)cLbas * pThis->cbSector;
+            u16Sts = nvmeR3PrpParse(pThis, pSqe->u64Prp1, pSqe->u64Prp2, pReq->cbXfer,
+                                    &pReq->aPrpSegs[0], RT_ELEMENTS(pReq->aPrpSegs), &pReq->cPrpSegs);
+        }
+        if (u16Sts == NVME_STS_SUCCESS)
+        {
+            pReq->DataSeg.cbSeg = pReq->cbXfer;
+            pReq->DataSeg.pvSeg = RTMemAlloc(pReq->cbXfer);
+            if (!pReq->DataSeg.pvSeg)
+                u16Sts = NVME_STS_INTERNAL_ERROR;
+        }
+        if (   u16Sts == NVME_STS_SUCCESS
+            && enmType == NVMEREQTYPE_WRITE)
+        {
+            int rc = nvmeR3PrpCopy(pThis, &pReq->aPrpSegs[0], pReq->cPrpSegs, pReq->DataSeg.pvSeg,
+                                   pReq->cbXfer, false /*fToGuest*/);
+            if (RT_FAILURE(rc))
+                u16Sts = NVME_STS_DATA_XFER_ERROR;
+
+            pReq->fFlushAfter =    (NVME_SQE_CDW(pSqe, 12) & RT_BIT_32(30))
+                                || !(pThis->u32FeatVolatileWc & RT_BIT_32(0));
+        }
+    }
+    else if (enmType == NVMEREQTYPE_DISCARD)
+    {
+        uint32_t cRanges = (NVME_SQE_CDW(pSqe, 10) & 0xff) + 1;
+        uint32_t *pau32Ranges = (uint32_t *)RTMemTmpAlloc(cRanges * 4 * sizeof(uint32_t));
+
+        pReq->paRanges = (PRTRANGE)RTMemAllocZ(cRanges * sizeof(RTRANGE));
+        if (pau32Ranges && pReq->paRanges)
+        {
+            uint32_t   cSegs = 0;
+            NVMEPRPSEG aSegs[3];
+
+            u16Sts = nvmeR3PrpParse(pThis, pSqe->u64Prp1, pSqe->u64Prp2, cRanges * 4 * sizeof(uint32_t),
+                                    &aSegs[0], RT_ELEMENTS(aSegs), &cSegs);
+            if (u16Sts == NVME_STS_SUCCESS)
+            {
+                int rc = nvmeR3PrpCopy(pThis, &aSegs[0], cSegs, pau32Ranges, cRanges * 4 * sizeof(uint32_t),
+                                       false /*fToGuest*/);
+                if (RT_FAILURE(rc))
+                    u16Sts = NVME_STS_DATA_XFER_ERROR;
+            }
+
+            /* Each range consists of the context attributes, the length and the starting LBA. */
+            for (uint32_t i = 0; i < cRanges && u16Sts == NVME_STS_SUCCESS; i++)
+            {
+                uint32_t cLbas = pau32Ranges[i * 4 + 1];
+                uint64_t uLba  = RT_MAKE_U64(pau32Ranges[i * 4 + 2], pau32Ranges[i * 4 + 3]);
+
+                if (!cLbas)
+                    continue;
+                if (   uLba >= pThis->cSectors
+                    || cLbas > pThis->cSectors - uLba)
+                    u16Sts = NVME_STS_LBA_OUT_OF_RANGE;
+                else
+                {
+                    pReq->paRanges[pReq->cRanges].offStart = uLba * pThis->cbSector;
+                    pReq->paRanges[pReq->cRanges].cbRange  = (size_t)cLbas * pThis->cbSector;
+                    pReq->cRanges++;
+                }
+            }
+        }
+        else
+            u16Sts = NVME_STS_INTERNAL_ERROR;
+
+        if (pau32Ranges)
+            RTMemTmpFree(pau32Ranges);
+
+        /* Nothing to deallocate if all ranges are empty. */
+        fDone = !pReq->cRanges;
+    }
+
+    if (   u16Sts != NVME_STS_SUCCESS
+        || fDone)
+    {
+        if (pReq->DataSeg.pvSeg)
+            RTMemFree(pReq->DataSeg.pvSeg);
+        if (pReq->paRanges)
+            RTMemFree(pReq->paRanges);
+        RTMemCacheFree(pThis->hReqCache, pReq);
+        return u16Sts;
+    }
+
+    switch (enmType)
+    {
+        case NVMEREQTYPE_READ:
+            STAM_REL_COUNTER_INC(&pThis->StatReads);
+            STAM_REL_COUNTER_ADD(&pThis->StatBytesRead, pReq->cbXfer);
+            ASMAtomicIncU64(&pThis->cHostReads);
+            ASMAtomicAddU64(&pThis->cbDataRead, pReq->cbXfer);
+            pThis->Led.Asserted.s.fReading = pThis->Led.Actual.s.fReading = 1;
+            break;
+        case NVMEREQTYPE_WRITE:
+            STAM_REL_COUNTER_INC(&pThis->StatWrites);
+            STAM_REL_COUNTER_ADD(&pThis->StatBytesWritten, pReq->cbXfer);
+            ASMAtomicIncU64(&pThis->cHostWrites);
+            ASMAtomicAddU64(&pThis->cbDataWritten, pReq->cbXfer);
+            pThis->Led.Asserted.s.fWriting = pThis->Led.Actual.s.fWriting = 1;
+            break;
+        case NVMEREQTYPE_FLUSH:
+            STAM_REL_COUNTER_INC(&pThis->StatFlushes);
+            break;
+        case NVMEREQTYPE_DISCARD:
+            STAM_REL_COUNTER_INC(&pThis->StatDiscards);
+            break;
+        default:
+            break;
+    }
+
+    ASMAtomicIncU32(&pThis->cReqsActive);
+    ASMAtomicIncU32(&pThis->aSqs[idSq].cReqsActive);
+    nvmeR3ReqSubmit(pThis, pReq);
+    return NVME_STS_DEFERRED;
+}
+
+
+/* -=-=-=-=-=- Admin commands -=-=-=-=-=- */
+
+/**
+ * Copies a string into a space padded identify data field.
+ *
+ * @param   pbDst       The field.
+ * @param   cbDst       Size of the field.
+ * @param   pszSrc      The string.
+ */
+static void nvmeR3IdStrCopy(uint8_t *pbDst, size_t cbDst, const char *pszSrc)
+{
+    size_t cchSrc = RT_MIN(strlen(pszSrc), cbDst);
+    memset(pbDst, ' ', cbDst);
+    memcpy(pbDst, pszSrc, cchSrc);
+}
+
+/**
+ * Fills in the Identify Controller data structure.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pbBuf       The zeroed 4KB buffer.
+ */
+static void nvmeR3IdentifyCtrl(PNVME pThis, uint8_t *pbBuf)
+{
+    *(uint16_t *)&pbBuf[0]   = RT_H2LE_U16(0x80ee);                /* VID */
+    *(uint16_t *)&pbBuf[2]   = RT_H2LE_U16(0x80ee);                /* SSVID */
+    nvmeR3IdStrCopy(&pbBuf[4],  20, pThis->szSerialNumber);         /* SN */
+    nvmeR3IdStrCopy(&pbBuf[24], 40, pThis->szModelNumber);          /* MN */
+    nvmeR3IdStrCopy(&pbBuf[64],  8, pThis->szFirmwareRevision);     /* FR */
+    pbBuf[72]                = 0;                                   /* RAB */
+    pbBuf[77]                = NVME_MDTS;                           /* MDTS */
+    *(uint32_t *)&pbBuf[80]  = RT_H2LE_U32(NVME_VS_VALUE);          /* VER */
+    pbBuf[258]               = 3;                                   /* ACL */
+    pbBuf[259]               = NVME_AERL;                           /* AERL */
+    pbBuf[260]               = RT_BIT(0) | (1 << 1);                /* FRMW: one read only slot */
+    pbBuf[263]               = 0;                                   /* NPSS */
+    pbBuf[512]               = (6 << 4) | 6;                        /* SQES */
+    pbBuf[513]               = (4 << 4) | 4;                        /* CQES */
+    *(uint32_t *)&pbBuf[516] = RT_H2LE_U32(1);                      /* NN */
+    *(uint16_t *)&pbBuf[520] = RT_H2LE_U16(pThis->fDiscard ? RT_BIT(2) : 0); /* ONCS: DSM */
+    pbBuf[525]               = RT_BIT(0);                           /* VWC */
+    /* Power state 0, 9W maximum power. */
+    *(uint16_t *)&pbBuf[2048] = RT_H2LE_U16(900);
+}
+
+/**
+ * Fills in the Identify Namespace data structure.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pbBuf       The zeroed 4KB buffer.
+ */
+static void nvmeR3IdentifyNs(PNVME pThis, uint8_t *pbBuf)
+{
+    if (!pThis->pDrvBase)
+        return; /* Inactive namespaces report all zeros. */
+
+    *(uint64_t *)&pbBuf[0]   = RT_H2LE_U64(pThis->cSectors);       /* NSZE */
+    *(uint64_t *)&pbBuf[8]   = RT_H2LE_U64(pThis->cSectors);       /* NCAP */
+    *(uint64_t *)&pbBuf[16]  = RT_H2LE_U64(pThis->cSectors);       /* NUSE */
+    pbBuf[24]                = pThis->fDiscard ? RT_BIT(0) : 0;     /* NSFEAT: thin provisioning */
+    pbBuf[25]                = 0;                                   /* NLBAF */
+    pbBuf[26]                = 0;                                   /* FLBAS */
+    /* LBA format 0, no metadata. */
+    *(uint32_t *)&pbBuf[128] = RT_H2LE_U32((uint32_t)(ASMBitFirstSetU32(pThis->cbSector) - 1) << 16);
+}
+
+/**
+ * Processes the Identify command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmIdentify(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint8_t *pbBuf = (uint8_t *)RTMemTmpAllocZ(NVME_PAGE_SIZE);
+    if (!pbBuf)
+        return NVME_STS_INTERNAL_ERROR;
+
+    uint16_t u16Sts = NVME_STS_SUCCESS;
+    switch (NVME_SQE_CDW(pSqe, 10) & 0xff)
+    {
+        case 0x00: /* Namespace. */
+            if (pSqe->u32Nsid != 1)
+                u16Sts = NVME_STS_INVALID_NAMESPACE;
+            else
+                nvmeR3IdentifyNs(pThis, pbBuf);
+            break;
+        case 0x01: /* Controller. */
+            nvmeR3IdentifyCtrl(pThis, pbBuf);
+            break;
+        case 0x02: /* Active namespace list. */
+            if (pSqe->u32Nsid >= UINT32_C(0xfffffffe))
+                u16Sts = NVME_STS_INVALID_NAMESPACE;
+            else if (pThis->pDrvBase && pSqe->u32Nsid < 1)
+                *(uint32_t *)&pbBuf[0] = RT_H2LE_U32(1);
+            break;
+        default:
+            u16Sts = NVME_STS_INVALID_FIELD;
+    }
+
+    if (u16Sts == NVME_STS_SUCCESS)
+        u16Sts = nvmeR3AdmDataToGuest(pThis, pSqe, pbBuf, NVME_PAGE_SIZE);
+
+    RTMemTmpFree(pbBuf);
+    return u16Sts;
+}
+
+/**
+ * Stores a 64-bit counter into a 128-bit SMART log field.
+ */
+DECLINLINE(void) nvmeR3LogSetU128(uint8_t *pbField, uint64_t u64)
+{
+    *(uint64_t *)pbField = RT_H2LE_U64(u64);
+}
+
+/**
+ * Processes the Get Log Page command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmGetLogPage(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint32_t uLid = NVME_SQE_CDW(pSqe, 10) & 0xff;
+    size_t   cb   = RT_MIN(((NVME_SQE_CDW(pSqe, 10) >> 16) & 0xfff) * 4 + 4, NVME_PAGE_SIZE);
+
+    uint8_t *pbBuf = (uint8_t *)RTMemTmpAllocZ(NVME_PAGE_SIZE);
+    if (!pbBuf)
+        return NVME_STS_INTERNAL_ERROR;
+
+    uint16_t u16Sts = NVME_STS_SUCCESS;
+    switch (uLid)
+    {
+        case 0x01: /* Error information, nothing is logged. */
+            break;
+        case 0x02: /* SMART / health information. */
+        {
+            /* Data units are thousands of 512 byte units, rounded up. */
+            uint64_t cbRead    = ASMAtomicReadU64(&pThis->cbDataRead);
+            uint64_t cbWritten = ASMAtomicReadU64(&pThis->cbDataWritten);
+
+            *(uint16_t *)&pbBuf[1] = RT_H2LE_U16(310);                  /* Composite temperature in Kelvin. */
+            pbBuf[3] = 100;                                             /* Available spare. */
+            pbBuf[4] = 10;                                              /* Available spare threshold. */
+            nvmeR3LogSetU128(&pbBuf[32], (cbRead    / 512 + 999) / 1000);
+            nvmeR3LogSetU128(&pbBuf[48], (cbWritten / 512 + 999) / 1000);
+            nvmeR3LogSetU128(&pbBuf[64], ASMAtomicReadU64(&pThis->cHostReads));
+            nvmeR3LogSetU128(&pbBuf[80], ASMAtomicReadU64(&pThis->cHostWrites));
+            nvmeR3LogSetU128(&pbBuf[112], 1);                           /* Power cycles. */
+            break;
+        }
+        case 0x03: /* Firmware slot information. */
+            pbBuf[0] = 1;                                               /* Slot 1 active. */
+            nvmeR3IdStrCopy(&pbBuf[8], 8, pThis->szFirmwareRevision);
+            break;
+        default:
+            u16Sts = NVME_STS_INVALID_LOG_PAGE;
+    }
+
+    if (u16Sts == NVME_STS_SUCCESS)
+        u16Sts = nvmeR3AdmDataToGuest(pThis, pSqe, pbBuf, cb);
+
+    RTMemTmpFree(pbBuf);
+    return u16Sts;
+}
+
+/**
+ * Processes the Create I/O Completion Queue command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmCreateIoCq(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint16_t idCq     = NVME_SQE_CDW(pSqe, 10) & 0xffff;
+    uint32_t cEntries = (NVME_SQE_CDW(pSqe, 10) >> 16) + 1;
+    uint16_t uVector  = NVME_SQE_CDW(pSqe, 11) >> 16;
+
+    if (   idCq == 0
+        || idCq > pThis->cIoQueues
+        || pThis->aCqs[idCq].fValid)
+        return NVME_STS_INVALID_QID;
+    if (   cEntries < 2
+        || cEntries > NVME_QUEUE_ENTRIES_MAX)
+        return NVME_STS_INVALID_QUEUE_SIZE;
+    if (!(NVME_SQE_CDW(pSqe, 11) & RT_BIT_32(0)))   /* Physically contiguous queues only (CAP.CQR). */
+        return NVME_STS_INVALID_FIELD;
+    if (pSqe->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        return NVME_STS_PRP_OFFSET_INVALID;
+    if (uVector > pThis->cIoQueues)
+        return NVME_STS_INVALID_INTR_VECTOR;
+
+    PNVMECQ pCq = &pThis->aCqs[idCq];
+    RTCritSectEnter(&pCq->CritSect);
+    pCq->GCPhysBase     = pSqe->u64Prp1;
+    pCq->cEntries       = cEntries;
+    pCq->uHead          = 0;
+    pCq->uTail          = 0;
+    pCq->cSqs           = 0;
+    pCq->cIntrCoalesced = 0;
+    pCq->uVector        = uVector;
+    pCq->fPhase         = true;
+    pCq->fIntrEnabled   = RT_BOOL(NVME_SQE_CDW(pSqe, 11) & RT_BIT_32(1));
+    pCq->fValid         = true;
+    RTCritSectLeave(&pCq->CritSect);
+
+    Log(("NVMe: Created CQ %u with %u entries at %RGp, vector %u\n", idCq, cEntries, pCq->GCPhysBase, uVector));
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Processes the Create I/O Submission Queue command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmCreateIoSq(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint16_t idSq     = NVME_SQE_CDW(pSqe, 10) & 0xffff;
+    uint32_t cEntries = (NVME_SQE_CDW(pSqe, 10) >> 16) + 1;
+    uint16_t idCq     = NVME_SQE_CDW(pSqe, 11) >> 16;
+
+    if (   idSq == 0
+        || idSq > pThis->cIoQueues
+        || pThis->aSqs[idSq].fValid)
+        return NVME_STS_INVALID_QID;
+    if (   cEntries < 2
+        || cEntries > NVME_QUEUE_ENTRIES_MAX)
+        return NVME_STS_INVALID_QUEUE_SIZE;
+    if (!(NVME_SQE_CDW(pSqe, 11) & RT_BIT_32(0)))
+        return NVME_STS_INVALID_FIELD;
+    if (pSqe->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        return NVME_STS_PRP_OFFSET_INVALID;
+    if (   idCq == 0
+        || idCq > pThis->cIoQueues)
+        return NVME_STS_CQ_INVALID;
+
+    PNVMECQ pCq = &pThis->aCqs[idCq];
+    RTCritSectEnter(&pCq->CritSect);
+    bool fCqValid = pCq->fValid;
+    if (fCqValid)
+        pCq->cSqs++;
+    RTCritSectLeave(&pCq->CritSect);
+    if (!fCqValid)
+        return NVME_STS_CQ_INVALID;
+
+    PNVMESQ pSq = &pThis->aSqs[idSq];
+    RTCritSectEnter(&pSq->CritSect);
+    pSq->GCPhysBase = pSqe->u64Prp1;
+    pSq->cEntries   = cEntries;
+    pSq->uHead      = 0;
+    pSq->uTail      = 0;
+    pSq->idCq       = idCq;
+    pSq->u8Prio     = (NVME_SQE_CDW(pSqe, 11) >> 1) & 0x3;
+    pSq->fStalled   = false;
+    pSq->fDeletePending = false;
+    pSq->fValid     = true;
+    RTCritSectLeave(&pSq->CritSect);
+
+    Log(("NVMe: Created SQ %u with %u entries at %RGp for CQ %u\n", idSq, cEntries, pSq->GCPhysBase, idCq));
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Processes the Delete I/O Submission Queue command.
+ *
+ * @returns NVMe status code, NVME_STS_DEFERRED if the completion is posted
+ *          when all outstanding requests of the queue completed.
+ */
+static uint16_t nvmeR3AdmDeleteIoSq(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint16_t idSq = NVME_SQE_CDW(pSqe, 10) & 0xffff;
+
+    if (   idSq == 0
+        || idSq > pThis->cIoQueues
+        || !pThis->aSqs[idSq].fValid
+        || ASMAtomicReadBool(&pThis->aSqs[idSq].fDeletePending))
+        return NVME_STS_INVALID_QID;
+
+    PNVMESQ pSq = &pThis->aSqs[idSq];
+    RTCritSectEnter(&pSq->CritSect);
+    pSq->uCidDelete = pSqe->u16Cid;
+    ASMAtomicWriteBool(&pSq->fDeletePending, true);
+    RTCritSectLeave(&pSq->CritSect);
+
+    /* Whoever clears the pending flag with no requests left posts the completion. */
+    if (   ASMAtomicReadU32(&pSq->cReqsActive) == 0
+        && ASMAtomicXchgBool(&pSq->fDeletePending, false))
+        nvmeR3SqDeleteFinish(pThis, idSq);
+
+    return NVME_STS_DEFERRED;
+}
+
+/**
+ * Processes the Delete I/O Completion Queue command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmDeleteIoCq(PNVME pThis, PCNVMESQE pSqe)
+{
+    uint16_t idCq = NVME_SQE_CDW(pSqe, 10) & 0xffff;
+
+    if (   idCq == 0
+        || idCq > pThis->cIoQueues
+        || !pThis->aCqs[idCq].fValid)
+        return NVME_STS_INVALID_QID;
+
+    PNVMECQ  pCq = &pThis->aCqs[idCq];
+    uint16_t u16Sts = NVME_STS_SUCCESS;
+    RTCritSectEnter(&pCq->CritSect);
+    if (!pCq->cSqs)
+    {
+        TMTimerStop(pCq->pTimerCoalesceR3);
+        nvmeR3CqPendingFree(pCq);
+        pCq->cIntrCoalesced = 0;
+        pCq->fValid         = false;
+        nvmeR3IntxSet(pThis, idCq, false /*fPending*/);
+    }
+    else
+        u16Sts = NVME_STS_INVALID_QUEUE_DELETION;
+    RTCritSectLeave(&pCq->CritSect);
+
+    return u16Sts;
+}
+
+/**
+ * Returns the value of a feature.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance.
+ * @param   uFid        The feature identifier.
+ * @param   u32Cdw11    Command dword 11, selects the vector for some features.
+ * @param   fDefault    Whether to return the default instead of the current value.
+ * @param   pu32Dw0     Where to store the value.
+ */
+static uint16_t nvmeR3FeatGet(PNVME pThis, uint8_t uFid, uint32_t u32Cdw11, bool fDefault, uint32_t *pu32Dw0)
+{
+    switch (uFid)
+    {
+        case NVME_FEAT_ARBITRATION:
+            *pu32Dw0 = fDefault ? 0 : pThis->u32FeatArbitration;
+            break;
+        case NVME_FEAT_POWER_MGMT:
+            *pu32Dw0 = fDefault ? 0 : pThis->u32FeatPowerMgmt;
+            break;
+        case NVME_FEAT_TEMP_THRESHOLD:
+            *pu32Dw0 = fDefault ? 343 : pThis->u32FeatTempThreshold;
+            break;
+        case NVME_FEAT_ERROR_RECOVERY:
+            *pu32Dw0 = fDefault ? 0 : pThis->u32FeatErrorRecovery;
+            break;
+        case NVME_FEAT_VOLATILE_WC:
+            *pu32Dw0 = fDefault ? 1 : pThis->u32FeatVolatileWc;
+            break;
+        case NVME_FEAT_NUM_QUEUES:
+            *pu32Dw0 = (pThis->cIoQueues - 1) | ((pThis->cIoQueues - 1) << 16);
+            break;
+        case NVME_FEAT_INTR_COALESCING:
+            *pu32Dw0 = fDefault ? pThis->u32IntrCoalescingDef : pThis->u32FeatIntrCoalescing;
+            break;
+        case NVME_FEAT_INTR_VECTOR_CFG:
+        {
+            uint16_t uVector = u32Cdw11 & 0xffff;
+            if (uVector > pThis->cIoQueues)
+                return NVME_STS_INVALID_FIELD;
+            *pu32Dw0 = uVector;
+            if (!fDefault && pThis->afIntrVecCoalesceDisable[uVector])
+                *pu32Dw0 |= RT_BIT_32(16);
+            break;
+        }
+        case NVME_FEAT_WRITE_ATOMICITY:
+            *pu32Dw0 = fDefault ? 0 : pThis->u32FeatWriteAtomicity;
+            break;
+        case NVME_FEAT_ASYNC_EVENT_CFG:
+            *pu32Dw0 = fDefault ? 0 : pThis->u32FeatAsyncEventCfg;
+            break;
+        default:
+            return NVME_STS_INVALID_FIELD;
+    }
+
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Processes the Get Features command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmGetFeatures(PNVME pThis, PCNVMESQE pSqe, uint32_t *pu32Dw0)
+{
+    uint8_t  uFid = NVME_SQE_CDW(pSqe, 10) & 0xff;
+    uint32_t uSel = (NVME_SQE_CDW(pSqe, 10) >> 8) & 0x7;
+
+    switch (uSel)
+    {
+        case 0: /* Current. */
+            return nvmeR3FeatGet(pThis, uFid, NVME_SQE_CDW(pSqe, 11), false /*fDefault*/, pu32Dw0);
+        case 1: /* Default. */
+        case 2: /* Saved, nothing is saveable so the same as the default. */
+            return nvmeR3FeatGet(pThis, uFid, NVME_SQE_CDW(pSqe, 11), true /*fDefault*/, pu32Dw0);
+        case 3: /* Supported capabilities: changeable, not saveable, not namespace specific. */
+        {
+            uint16_t u16Sts = nvmeR3FeatGet(pThis, uFid, NVME_SQE_CDW(pSqe, 11), true /*fDefault*/, pu32Dw0);
+            *pu32Dw0 = RT_BIT_32(2);
+            return u16Sts;
+        }
+        default:
+            return NVME_STS_INVALID_FIELD;
+    }
+}
+
+/**
+ * Processes the Set Features command.
+ *
+ * @returns NVMe status code.
+ */
+static uint16_t nvmeR3AdmSetFeatures(PNVME pThis, PCNVMESQE pSqe, uint32_t *pu32Dw0)
+{
+    uint8_t  uFid     = NVME_SQE_CDW(pSqe, 10) & 0xff;
+    uint32_t u32Cdw11 = NVME_SQE_CDW(pSqe, 11);
+
+    if (NVME_SQE_CDW(pSqe, 10) & RT_BIT_32(31))
+        return NVME_STS_FEATURE_NOT_SAVEABLE;
+
+    switch (uFid)
+    {
+        case NVME_FEAT_ARBITRATION:
+            pThis->u32FeatArbitration = u32Cdw11;
+            break;
+        case NVME_FEAT_POWER_MGMT:
+            if (u32Cdw11 & 0x1f)    /* Only power state 0 exists. */
+                return NVME_STS_INVALID_FIELD;
+            pThis->u32FeatPowerMgmt = u32Cdw11 & 0xff;
+            break;
+        case NVME_FEAT_TEMP_THRESHOLD:
+            /* Only the over temperature threshold of the composite temperature is kept. */
+            if (!(u32Cdw11 & UINT32_C(0x003f0000)))
+                pThis->u32FeatTempThreshold = u32Cdw11 & 0xffff;
+            break;
+        case NVME_FEAT_ERROR_RECOVERY:
+            pThis->u32FeatErrorRecovery = u32Cdw11 & 0xffff;
+            break;
+        case NVME_FEAT_VOLATILE_WC:
+            pThis->u32FeatVolatileWc = u32Cdw11 & RT_BIT_32(0);
+            LogRel(("NVMe#%u: Volatile write cache %s\n", pThis->pDevInsR3->iInstance,
+                    pThis->u32FeatVolatileWc ? "enabled" : "disabled"));
+            break;
+        case NVME_FEAT_NUM_QUEUES:
+        {
+            for (uint32_t i = 1; i <= pThis->cIoQueues; i++)
+                if (pThis->aSqs[i].fValid || pThis->aCqs[i].fValid)
+                    return NVME_STS_CMD_SEQUENCE_ERROR;
+            if (   (u32Cdw11 & 0xffff) == 0xffff
+                || (u32Cdw11 >> 16) == 0xffff)
+                return NVME_STS_INVALID_FIELD;
+            /* The allocation doesn't depend on the request. */
+            pThis->fNumQueuesSet = true;
+            *pu32Dw0 = (pThis->cIoQueues - 1) | ((pThis->cIoQueues - 1) << 16);
+            break;
+        }
+        case NVME_FEAT_INTR_COALESCING:
+            ASMAtomicWriteU32(&pThis->u32FeatIntrCoalescing, u32Cdw11 & 0xffff);
+            break;
+        case NVME_FEAT_INTR_VECTOR_CFG:
+        {
+            uint16_t uVector = u32Cdw11 & 0xffff;
+            if (uVector > pThis->cIoQueues)
+                return NVME_STS_INVALID_FIELD;
+            pThis->afIntrVecCoalesceDisable[uVector] = RT_BOOL(u32Cdw11 & RT_BIT_32(16));
+            break;
+        }
+        case NVME_FEAT_WRITE_ATOMICITY:
+            pThis->u32FeatWriteAtomicity = u32Cdw11 & RT_BIT_32(0);
+            break;
+        case NVME_FEAT_ASYNC_EVENT_CFG:
+            pThis->u32FeatAsyncEventCfg = u32Cdw11 & 0xff;
+            break;
+        default:
+            return NVME_STS_INVALID_FIELD;
+    }
+
+    return NVME_STS_SUCCESS;
+}
+
+/**
+ * Processes a command from the admin submission queue.
+ *
+ * @returns NVMe status code, NVME_STS_DEFERRED if the completion is posted later.
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSqe        The command.
+ * @param   pu32Dw0     Where to store the command specific result.
+ */
+static uint16_t nvmeR3AdmCmdProcess(PNVME pThis, PCNVMESQE pSqe, uint32_t *pu32Dw0)
+{
+    STAM_REL_COUNTER_INC(&pThis->StatAdminCmds);
+    Log2(("NVMe: Admin command %#x CID %#x\n", pSqe->u8Opc, pSqe->u16Cid));
+
+    switch (pSqe->u8Opc)
+    {
+        case NVME_ADM_DELETE_IO_SQ:
+            return nvmeR3AdmDeleteIoSq(pThis, pSqe);
+        case NVME_ADM_CREATE_IO_SQ:
+            return nvmeR3AdmCreateIoSq(pThis, pSqe);
+        case NVME_ADM_GET_LOG_PAGE:
+            return nvmeR3AdmGetLogPage(pThis, pSqe);
+        case NVME_ADM_DELETE_IO_CQ:
+            return nvmeR3AdmDeleteIoCq(pThis, pSqe);
+        case NVME_ADM_CREATE_IO_CQ:
+            return nvmeR3AdmCreateIoCq(pThis, pSqe);
+        case NVME_ADM_IDENTIFY:
+            return nvmeR3AdmIdentify(pThis, pSqe);
+        case NVME_ADM_ABORT:
+            /* Commands are started as soon as they are fetched, nothing can be aborted. */
+            *pu32Dw0 = RT_BIT_32(0);
+            return NVME_STS_SUCCESS;
+        case NVME_ADM_SET_FEATURES:
+            return nvmeR3AdmSetFeatures(pThis, pSqe, pu32Dw0);
+        case NVME_ADM_GET_FEATURES:
+            return nvmeR3AdmGetFeatures(pThis, pSqe, pu32Dw0);
+        case NVME_ADM_ASYNC_EVENT_REQ:
+            /* No events are ever reported, keep the request outstanding until the next reset. */
+            if (pThis->cAerOutstanding > NVME_AERL)
+                return NVME_STS_AER_LIMIT_EXCEEDED;
+            pThis->cAerOutstanding++;
+            return NVME_STS_DEFERRED;
+        default:
+            return NVME_STS_INVALID_OPCODE;
+    }
+}
+
+
+/* -=-=-=-=-=- Submission queues -=-=-=-=-=- */
+
+/**
+ * Fetches and starts all new commands of a submission queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   pSq         The submission queue.
+ * @param   idSq        The submission queue identifier.
+ *
+ * @note Caller must own the lock of the submission queue.
+ */
+static void nvmeR3SqProcess(PNVME pThis, PNVMESQ pSq, uint16_t idSq)
+{
+    NVMESQE aSqes[NVME_SQE_BATCH];
+
+    Assert(RTCritSectIsOwner(&pSq->CritSect));
+
+    while (   pSq->fValid
+           && !ASMAtomicReadBool(&pSq->fDeletePending)
+           && pSq->uHead != pSq->uTail)
+    {
+        uint32_t uHead = pSq->uHead;
+        uint32_t cSqes = pSq->uTail > uHead ? pSq->uTail - uHead : pSq->cEntries - uHead;
+        cSqes = RT_MIN(cSqes, RT_ELEMENTS(aSqes));
+
+        int rc = PDMDevHlpPCIPhysRead(pThis->pDevInsR3, pSq->GCPhysBase + uHead * sizeof(NVMESQE),
+                                      &aSqes[0], cSqes * sizeof(NVMESQE));
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("NVMe#%u: Failed to read entries of SQ %u from %RGp: %Rrc\n", pThis->pDevInsR3->iInstance,
+                    idSq, pSq->GCPhysBase + uHead * sizeof(NVMESQE), rc));
+            ASMAtomicOrU32(&pThis->u32RegCsts, NVME_CSTS_CFS);
+            return;
+        }
+
+        for (uint32_t i = 0; i < cSqes; i++)
+        {
+            /*
+             * Stop fetching while the completion queue has a full queue worth of
+             * completions waiting, the head doorbell of the completion queue resumes.
+             */
+            PNVMECQ pCq = &pThis->aCqs[pSq->idCq];
+            if (ASMAtomicReadU32(&pCq->cPending) >= pCq->cEntries)
+            {
+                ASMAtomicWriteBool(&pSq->fStalled, true);
+                if (ASMAtomicReadU32(&pCq->cPending) >= pCq->cEntries)
+                {
+                    STAM_REL_COUNTER_INC(&pThis->StatSqStalled);
+                    return;
+                }
+                ASMAtomicWriteBool(&pSq->fStalled, false);
+            }
+
+            ASMAtomicWriteU32(&pSq->uHead, (pSq->uHead + 1) % pSq->cEntries);
+            STAM_REL_COUNTER_INC(&pSq->StatCmds);
+
+            uint32_t u32Dw0 = 0;
+            uint16_t u16Sts;
+            if (idSq == 0)
+                u16Sts = nvmeR3AdmCmdProcess(pThis, &aSqes[i], &u32Dw0);
+            else
+                u16Sts = nvmeR3IoCmdProcess(pThis, idSq, &aSqes[i]);
+            if (u16Sts != NVME_STS_DEFERRED)
+                nvmeR3CqPost(pThis, pSq->idCq, idSq, aSqes[i].u16Cid, u32Dw0, u16Sts);
+
+            /* The queue may have been deleted by a command from another vCPU. */
+            if (   !pSq->fValid
+                || ASMAtomicReadBool(&pSq->fDeletePending))
+                return;
+        }
+    }
+}
+
+/**
+ * Handles a write to the tail doorbell of a submission queue.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   idSq        The submission queue.
+ * @param   uTail       The new tail index.
+ */
+static void nvmeR3SqDoorbellWrite(PNVME pThis, uint16_t idSq, uint32_t uTail)
+{
+    PNVMESQ pSq = &pThis->aSqs[idSq];
+
+    RTCritSectEnter(&pSq->CritSect);
+    if (   pSq->fValid
+        && uTail < pSq->cEntries)
+    {
+        pSq->uTail = uTail;
+        if (!ASMAtomicReadBool(&pSq->fStalled))
+            nvmeR3SqProcess(pThis, pSq, idSq);
+    }
+    else
+        Log(("NVMe: Invalid tail doorbell write to SQ %u (uTail=%u)\n", idSq, uTail));
+    RTCritSectLeave(&pSq->CritSect);
+}
+
+
+/* -=-=-=-=-=- Controller -=-=-=-=-=- */
+
+/**
+ * Resets the controller state the guest can change, deleting all queues.
+ *
+ * Requests still in flight complete silently.
+ *
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlReset(PNVME pThis)
+{
+    ASMAtomicIncU32(&pThis->uGen);
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        RTCritSectEnter(&pSq->CritSect);
+        pSq->fValid = false;
+        pSq->uHead  = 0;
+        pSq->uTail  = 0;
+        ASMAtomicWriteBool(&pSq->fStalled, false);
+        ASMAtomicWriteBool(&pSq->fDeletePending, false);
+        RTCritSectLeave(&pSq->CritSect);
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        PNVMECQ pCq = &pThis->aCqs[i];
+        RTCritSectEnter(&pCq->CritSect);
+        if (pCq->pTimerCoalesceR3)
+            TMTimerStop(pCq->pTimerCoalesceR3);
+        nvmeR3CqPendingFree(pCq);
+        pCq->fValid         = false;
+        pCq->uHead          = 0;
+        pCq->uTail          = 0;
+        pCq->cSqs           = 0;
+        pCq->cIntrCoalesced = 0;
+        RTCritSectLeave(&pCq->CritSect);
+    }
+
+    RTCritSectEnter(&pThis->CritSectIntr);
+    pThis->bmIntxPending = 0;
+    pThis->u32RegIntMask = 0;
+    nvmeR3IntxUpdate(pThis);
+    RTCritSectLeave(&pThis->CritSectIntr);
+
+    pThis->u32FeatArbitration    = 0;
+    pThis->u32FeatPowerMgmt      = 0;
+    pThis->u32FeatTempThreshold  = 343;
+    pThis->u32FeatErrorRecovery  = 0;
+    pThis->u32FeatVolatileWc     = 1;
+    pThis->u32FeatIntrCoalescing = pThis->u32IntrCoalescingDef;
+    pThis->u32FeatWriteAtomicity = 0;
+    pThis->u32FeatAsyncEventCfg  = 0;
+    pThis->fNumQueuesSet         = false;
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->afIntrVecCoalesceDisable); i++)
+        pThis->afIntrVecCoalesceDisable[i] = false;
+    pThis->cAerOutstanding       = 0;
+
+    /*
+     * Keep RDY set while requests of the previous generation are in flight,
+     * the guest must not reuse their buffers before they completed. RDY is
+     * set before the flag so a completion racing with us can't leave it set.
+     */
+    ASMAtomicWriteU32(&pThis->u32RegCsts, pThis->u32RegCsts & NVME_CSTS_RDY);
+    ASMAtomicWriteBool(&pThis->fRdyHeld, true);
+    if (   !ASMAtomicReadU32(&pThis->cReqsActive)
+        && ASMAtomicXchgBool(&pThis->fRdyHeld, false))
+        ASMAtomicWriteU32(&pThis->u32RegCsts, 0);
+}
+
+/**
+ * Enables the controller, setting up the admin queues.
+ *
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3CtrlEnable(PNVME pThis)
+{
+    uint32_t cSqEntries = (pThis->u32RegAqa & 0xfff) + 1;
+    uint32_t cCqEntries = ((pThis->u32RegAqa >> 16) & 0xfff) + 1;
+
+    if (   NVME_CC_MPS_GET(pThis->u32RegCc) != 0
+        || NVME_CC_CSS_GET(pThis->u32RegCc) != 0
+        || NVME_CC_AMS_GET(pThis->u32RegCc) != 0
+        || cSqEntries < 2
+        || cCqEntries < 2
+        || !pThis->u64RegAsq
+        || !pThis->u64RegAcq)
+    {
+        LogRel(("NVMe#%u: Invalid controller configuration CC=%#RX32 AQA=%#RX32 ASQ=%#RX64 ACQ=%#RX64\n",
+                pThis->pDevInsR3->iInstance, pThis->u32RegCc, pThis->u32RegAqa, pThis->u64RegAsq, pThis->u64RegAcq));
+        ASMAtomicWriteU32(&pThis->u32RegCsts, NVME_CSTS_CFS);
+        return;
+    }
+
+    PNVMECQ pCq = &pThis->aCqs[0];
+    RTCritSectEnter(&pCq->CritSect);
+    pCq->GCPhysBase     = pThis->u64RegAcq;
+    pCq->cEntries       = cCqEntries;
+    pCq->uHead          = 0;
+    pCq->uTail          = 0;
+    pCq->cSqs           = 1;
+    pCq->cIntrCoalesced = 0;
+    pCq->uVector        = 0;
+    pCq->fPhase         = true;
+    pCq->fIntrEnabled   = true;
+    pCq->fValid         = true;
+    RTCritSectLeave(&pCq->CritSect);
+
+    PNVMESQ pSq = &pThis->aSqs[0];
+    RTCritSectEnter(&pSq->CritSect);
+    pSq->GCPhysBase = pThis->u64RegAsq;
+    pSq->cEntries   = cSqEntries;
+    pSq->uHead      = 0;
+    pSq->uTail      = 0;
+    pSq->idCq       = 0;
+    pSq->fValid     = true;
+    RTCritSectLeave(&pSq->CritSect);
+
+    ASMAtomicWriteBool(&pThis->fRdyHeld, false);
+    ASMAtomicWriteU32(&pThis->u32RegCsts, NVME_CSTS_RDY);
+    LogRel(("NVMe#%u: Controller enabled\n", pThis->pDevInsR3->iInstance));
+}
+
+/**
+ * Handles a write to the controller configuration register.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   u32Value    The written value.
+ */
+static void nvmeR3CcWrite(PNVME pThis, uint32_t u32Value)
+{
+    uint32_t u32Old = pThis->u32RegCc;
+    pThis->u32RegCc = u32Value & NVME_CC_WRITABLE_MASK;
+
+    if ((u32Value & NVME_CC_EN) && !(u32Old & NVME_CC_EN))
+        nvmeR3CtrlEnable(pThis);
+    else if (!(u32Value & NVME_CC_EN) && (u32Old & NVME_CC_EN))
+    {
+        LogRel(("NVMe#%u: Controller reset\n", pThis->pDevInsR3->iInstance));
+        nvmeR3CtrlReset(pThis);
+    }
+
+    /* Data is written through to the driver, so shutting down is instant. */
+    if (NVME_CC_SHN_GET(u32Value) && !NVME_CC_SHN_GET(u32Old))
+    {
+        LogRel(("NVMe#%u: Shutdown notification\n", pThis->pDevInsR3->iInstance));
+        ASMAtomicWriteU32(&pThis->u32RegCsts, (pThis->u32RegCsts & ~NVME_CSTS_SHST_MASK) | NVME_CSTS_SHST_COMPLETE);
+    }
+    else if (!NVME_CC_SHN_GET(u32Value))
+        ASMAtomicAndU32(&pThis->u32RegCsts, ~NVME_CSTS_SHST_MASK);
+}
+
+/**
+ * Reads a controller register.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   offReg      The dword aligned register offset.
+ */
+static uint32_t nvmeR3RegRead(PNVME pThis, uint32_t offReg)
+{
+    switch (offReg)
+    {
+        case NVME_REG_CAP:      return RT_LO_U32(NVME_CAP_VALUE);
+        case NVME_REG_CAP + 4:  return RT_HI_U32(NVME_CAP_VALUE);
+        case NVME_REG_VS:       return NVME_VS_VALUE;
+        case NVME_REG_INTMS:
+        case NVME_REG_INTMC:    return pThis->u32RegIntMask;
+        case NVME_REG_CC:       return pThis->u32RegCc;
+        case NVME_REG_CSTS:     return ASMAtomicReadU32(&pThis->u32RegCsts);
+        case NVME_REG_AQA:      return pThis->u32RegAqa;
+        case NVME_REG_ASQ:      return RT_LO_U32(pThis->u64RegAsq);
+        case NVME_REG_ASQ + 4:  return RT_HI_U32(pThis->u64RegAsq);
+        case NVME_REG_ACQ:      return RT_LO_U32(pThis->u64RegAcq);
+        case NVME_REG_ACQ + 4:  return RT_HI_U32(pThis->u64RegAcq);
+        default:                return 0;
+    }
+}
+
+/**
+ * Writes a controller register.
+ *
+ * @param   pThis       The NVMe controller instance.
+ * @param   offReg      The dword aligned register offset.
+ * @param   u32Value    The value.
+ */
+static void nvmeR3RegWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value)
+{
+    if (offReg >= NVME_DOORBELL_OFFSET)
+    {
+        /* Doorbells use the queue locks only, so vCPUs on different queues don't contend. */
+        uint32_t idxDoorbell = (offReg - NVME_DOORBELL_OFFSET) / sizeof(uint32_t);
+        uint32_t idQueue     = idxDoorbell / 2;
+
+        STAM_REL_COUNTER_INC(&pThis->StatDoorbellWrites);
+        if (idQueue > pThis->cIoQueues)
+            Log(("NVMe: Write to doorbell of non existing queue %u\n", idQueue));
+        else if (idxDoorbell & 1)
+            nvmeR3CqDoorbellWrite(pThis, (uint16_t)idQueue, u32Value);
+        else
+            nvmeR3SqDoorbellWrite(pThis, (uint16_t)idQueue, u32Value);
+        return;
+    }
+
+    PDMCritSectEnter(&pThis->CritSectCtrl, VERR_IGNORED);
+    switch (offReg)
+    {
+        case NVME_REG_INTMS:
+        case NVME_REG_INTMC:
+            /* The mask registers are not used with MSI-X. */
+            if (!nvmeR3IsMsixEnabled(pThis))
+            {
+                RTCritSectEnter(&pThis->CritSectIntr);
+                if (offReg == NVME_REG_INTMS)
+                    pThis->u32RegIntMask |= u32Value;
+                else
+                    pThis->u32RegIntMask &= ~u32Value;
+                nvmeR3IntxUpdate(pThis);
+                RTCritSectLeave(&pThis->CritSectIntr);
+            }
+            break;
+        case NVME_REG_CC:
+            nvmeR3CcWrite(pThis, u32Value);
+            break;
+        case NVME_REG_AQA:
+            pThis->u32RegAqa = u32Value & UINT32_C(0x0fff0fff);
+            break;
+        case NVME_REG_ASQ:
+            pThis->u64RegAsq = RT_MAKE_U64(u32Value & ~NVME_PAGE_OFFSET_MASK, RT_HI_U32(pThis->u64RegAsq));
+            break;
+        case NVME_REG_ASQ + 4:
+            pThis->u64RegAsq = RT_MAKE_U64(RT_LO_U32(pThis->u64RegAsq), u32Value);
+            break;
+        case NVME_REG_ACQ:
+            pThis->u64RegAcq = RT_MAKE_U64(u32Value & ~NVME_PAGE_OFFSET_MASK, RT_HI_U32(pThis->u64RegAcq));
+            break;
+        case NVME_REG_ACQ + 4:
+            pThis->u64RegAcq = RT_MAKE_U64(RT_LO_U32(pThis->u64RegAcq), u32Value);
+            break;
+        case NVME_REG_NSSR: /* Subsystem reset is not supported (CAP.NSSRS=0). */
+        default:
+            Log(("NVMe: Write to read only register %#x (%#RX32) ignored\n", offReg, u32Value));
+    }
+    PDMCritSectLeave(&pThis->CritSectCtrl);
+}
+
+/**
+ * @callback_method_impl{FNIOMMMIOREAD}
+ */
+static DECLCALLBACK(int) nvmeR3MmioRead(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void *pv, unsigned cb)
+{
+    PNVME    pThis  = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMmio);
+    uint32_t *pu32  = (uint32_t *)pv;
+    NOREF(pvUser);
+
+    Assert(cb == 4 || cb == 8); Assert(!(offReg & 3));
+    for (unsigned i = 0; i < cb / sizeof(uint32_t); i++)
+        pu32[i] = offReg + i * 4 < NVME_DOORBELL_OFFSET ? nvmeR3RegRead(pThis, offReg + i * 4) : 0;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNIOMMMIOWRITE}
+ */
+static DECLCALLBACK(int) nvmeR3MmioWrite(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void const *pv, unsigned cb)
+{
+    PNVME           pThis  = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t        offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMmio);
+    uint32_t const *pu32   = (uint32_t const *)pv;
+    NOREF(pvUser);
+
+    Assert(cb == 4 || cb == 8); Assert(!(offReg & 3));
+    for (unsigned i = 0; i < cb / sizeof(uint32_t); i++)
+        nvmeR3RegWrite(pThis, offReg + i * 4, pu32[i]);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNPCIIOREGIONMAP}
+ */
+static DECLCALLBACK(int) nvmeR3MmioMap(PPCIDEVICE pPciDev, /*unsigned*/ int iRegion, RTGCPHYS GCPhysAddress,
+                                       uint32_t cb, PCIADDRESSSPACE enmType)
+{
+    PPDMDEVINS pDevIns = pPciDev->pDevIns;
+    PNVME      pThis   = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(iRegion);
+
+    Log2(("%s: registering MMIO area at GCPhysAddr=%RGp cb=%u\n", __FUNCTION__, GCPhysAddress, cb));
+    Assert(enmType == PCI_ADDRESS_SPACE_MEM); NOREF(enmType);
+    Assert(cb >= NVME_MMIO_SIZE);
+
+    int rc = PDMDevHlpMMIORegister(pDevIns, GCPhysAddress, cb, NULL /*pvUser*/,
+                                   IOMMMIO_FLAGS_READ_DWORD_QWORD | IOMMMIO_FLAGS_WRITE_ONLY_DWORD_QWORD,
+                                   nvmeR3MmioWrite, nvmeR3MmioRead, "NVMe");
+    if (RT_SUCCESS(rc))
+        pThis->GCPhysMmio = GCPhysAddress;
+    return rc;
+}
+
+
+/* -=-=-=-=-=- Interfaces -=-=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMILEDPORTS,pfnQueryStatusLed}
+ */
+static DECLCALLBACK(int) nvmeR3Status_QueryStatusLed(PPDMILEDPORTS pInterface, unsigned iLUN, PPDMLED *ppLed)
+{
+    PNVME pThis = RT_FROM_MEMBER(pInterface, NVME, ILeds);
+    if (iLUN == 0)
+    {
+        *ppLed = &pThis->Led;
+        Assert((*ppLed)->u32Magic == PDMLED_MAGIC);
+        return VINF_SUCCESS;
+    }
+    return VERR_PDM_LUN_NOT_FOUND;
+}
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface, Status LUN}
+ */
+static DECLCALLBACK(void *) nvmeR3Status_QueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVME pThis = RT_FROM_MEMBER(pInterface, NVME, IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pThis->IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMILEDPORTS, &pThis->ILeds);
+    return NULL;
+}
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface, Namespace LUN}
+ */
+static DECLCALLBACK(void *) nvmeR3NsQueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVME pThis = RT_FROM_MEMBER(pInterface, NVME, INsBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pThis->INsBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKPORT, &pThis->INsPort);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKASYNCPORT, &pThis->INsPortAsync);
+    return NULL;
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKPORT,pfnQueryDeviceLocation}
+ */
+static DECLCALLBACK(int) nvmeR3NsQueryDeviceLocation(PPDMIBLOCKPORT pInterface, const char **ppcszController,
+                                                     uint32_t *piInstance, uint32_t *piLUN)
+{
+    PNVME      pThis   = RT_FROM_MEMBER(pInterface, NVME, INsPort);
+    PPDMDEVINS pDevIns = pThis->pDevInsR3;
+
+    AssertPtrReturn(ppcszController, VERR_INVALID_POINTER);
+    AssertPtrReturn(piInstance, VERR_INVALID_POINTER);
+    AssertPtrReturn(piLUN, VERR_INVALID_POINTER);
+
+    *ppcszController = pDevIns->pReg->szName;
+    *piInstance = pDevIns->iInstance;
+    *piLUN = 0;
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=-=- Debug info -=-=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNDBGFHANDLERDEV}
+ */
+static DECLCALLBACK(void) nvmeR3Info(PPDMDEVINS pDevIns, PCDBGFINFOHLP pHlp, const char *pszArgs)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(pszArgs);
+
+    pHlp->pfnPrintf(pHlp, "%s#%d: mmio=%RGp I/O queues=%u MSI-X=%RTbool INTx=%RTbool\n",
+                    pDevIns->pReg->szName, pDevIns->iInstance, pThis->GCPhysMmio, pThis->cIoQueues,
+                    nvmeR3IsMsixEnabled(pThis), pThis->fIntxAsserted);
+    pHlp->pfnPrintf(pHlp, "CC=%#RX32 CSTS=%#RX32 AQA=%#RX32 ASQ=%#RX64 ACQ=%#RX64 INTMS=%#RX32\n",
+                    pThis->u32RegCc, pThis->u32RegCsts, pThis->u32RegAqa, pThis->u64RegAsq, pThis->u64RegAcq,
+                    pThis->u32RegIntMask);
+    pHlp->pfnPrintf(pHlp, "Interrupt coalescing=%#RX32 VWC=%RU32 AERs=%u requests active=%u\n",
+                    pThis->u32FeatIntrCoalescing, pThis->u32FeatVolatileWc, pThis->cAerOutstanding, pThis->cReqsActive);
+    if (pThis->pDrvBase)
+        pHlp->pfnPrintf(pHlp, "Namespace 1: %RU64 blocks of %u bytes, %s I/O, discard %RTbool\n",
+                        pThis->cSectors, pThis->cbSector, pThis->pDrvBlockAsync ? "async" : "sync", pThis->fDiscard);
+
+    for (uint32_t i = 0; i <= pThis->cIoQueues; i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        PNVMECQ pCq = &pThis->aCqs[i];
+
+        if (pSq->fValid)
+            pHlp->pfnPrintf(pHlp, "  SQ%-2u: base=%RGp entries=%u head=%u tail=%u cq=%u active=%u%s%s\n",
+                            i, pSq->GCPhysBase, pSq->cEntries, pSq->uHead, pSq->uTail, pSq->idCq, pSq->cReqsActive,
+                            pSq->fStalled ? " stalled" : "", pSq->fDeletePending ? " deleting" : "");
+        if (pCq->fValid)
+            pHlp->pfnPrintf(pHlp, "  CQ%-2u: base=%RGp entries=%u head=%u tail=%u phase=%u vector=%u%s pending=%u\n",
+                            i, pCq->GCPhysBase, pCq->cEntries, pCq->uHead, pCq->uTail, pCq->fPhase, pCq->uVector,
+                            pCq->fIntrEnabled ? "" : " (no interrupts)", pCq->cPending);
+    }
+}
+
+
+/* -=-=-=-=-=- Saved State -=-=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNSSMDEVLIVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LiveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(uPass);
+
+    SSMR3PutU32(pSSM, pThis->cIoQueues);
+    SSMR3PutBool(pSSM, pThis->pDrvBase != NULL);
+    SSMR3PutStrZ(pSSM, pThis->szSerialNumber);
+    SSMR3PutStrZ(pSSM, pThis->szModelNumber);
+    SSMR3PutStrZ(pSSM, pThis->szFirmwareRevision);
+
+    return VINF_SSM_DONT_CALL_AGAIN;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    /* All requests are done at this point, see nvmeR3SuspendOrPowerOff. */
+    Assert(!pThis->cReqsActive);
+
+    /* config */
+    nvmeR3LiveExec(pDevIns, pSSM, SSM_PASS_FINAL);
+
+    /* registers */
+    SSMR3PutU32(pSSM, pThis->u32RegIntMask);
+    SSMR3PutU32(pSSM, pThis->u32RegCc);
+    SSMR3PutU32(pSSM, pThis->u32RegCsts);
+    SSMR3PutU32(pSSM, pThis->u32RegAqa);
+    SSMR3PutU64(pSSM, pThis->u64RegAsq);
+    SSMR3PutU64(pSSM, pThis->u64RegAcq);
+
+    /* features */
+    SSMR3PutU32(pSSM, pThis->u32FeatArbitration);
+    SSMR3PutU32(pSSM, pThis->u32FeatPowerMgmt);
+    SSMR3PutU32(pSSM, pThis->u32FeatTempThreshold);
+    SSMR3PutU32(pSSM, pThis->u32FeatErrorRecovery);
+    SSMR3PutU32(pSSM, pThis->u32FeatVolatileWc);
+    SSMR3PutU32(pSSM, pThis->u32FeatIntrCoalescing);
+    SSMR3PutU32(pSSM, pThis->u32FeatWriteAtomicity);
+    SSMR3PutU32(pSSM, pThis->u32FeatAsyncEventCfg);
+    SSMR3PutBool(pSSM, pThis->fNumQueuesSet);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->afIntrVecCoalesceDisable); i++)
+        SSMR3PutBool(pSSM, pThis->afIntrVecCoalesceDisable[i]);
+
+    SSMR3PutU32(pSSM, pThis->cAerOutstanding);
+    SSMR3PutU64(pSSM, pThis->bmIntxPending);
+
+    /* queues */
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        SSMR3PutBool(pSSM, pSq->fValid);
+        SSMR3PutBool(pSSM, pSq->fStalled);
+        SSMR3PutU8(pSSM, pSq->u8Prio);
+        SSMR3PutU16(pSSM, pSq->idCq);
+        SSMR3PutU32(pSSM, pSq->cEntries);
+        SSMR3PutU32(pSSM, pSq->uHead);
+        SSMR3PutU32(pSSM, pSq->uTail);
+        SSMR3PutGCPhys(pSSM, pSq->GCPhysBase);
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        PNVMECQ pCq = &pThis->aCqs[i];
+        SSMR3PutBool(pSSM, pCq->fValid);
+        SSMR3PutBool(pSSM, pCq->fPhase);
+        SSMR3PutBool(pSSM, pCq->fIntrEnabled);
+        SSMR3PutU16(pSSM, pCq->uVector);
+        SSMR3PutU32(pSSM, pCq->cEntries);
+        SSMR3PutU32(pSSM, pCq->uHead);
+        SSMR3PutU32(pSSM, pCq->uTail);
+        SSMR3PutU32(pSSM, pCq->cSqs);
+        SSMR3PutGCPhys(pSSM, pCq->GCPhysBase);
+
+        SSMR3PutU32(pSSM, pCq->cPending);
+        PNVMECQEPENDING pIt;
+        RTListForEach(&pCq->LstPending, pIt, NVMECQEPENDING, NodePending)
+        {
+            SSMR3PutU32(pSSM, pIt->Cqe.u32Dw0);
+            SSMR3PutU16(pSSM, pIt->Cqe.u16SqHead);
+            SSMR3PutU16(pSSM, pIt->Cqe.u16SqId);
+            SSMR3PutU16(pSSM, pIt->Cqe.u16Cid);
+            SSMR3PutU16(pSSM, pIt->Cqe.u16Status);
+        }
+    }
+
+    return SSMR3PutU32(pSSM, UINT32_MAX); /* sanity/terminator */
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PNVME    pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t u32;
+    bool     fAttached;
+    char     szSerialNumber[sizeof(pThis->szSerialNumber)];
+    char     szModelNumber[sizeof(pThis->szModelNumber)];
+    char     szFirmwareRevision[sizeof(pThis->szFirmwareRevision)];
+    int      rc;
+
+    if (uVersion != NVME_SAVED_STATE_VERSION)
+        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+
+    /* config */
+    rc = SSMR3GetU32(pSSM, &u32);
+    AssertRCReturn(rc, rc);
+    if (u32 != pThis->cIoQueues)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - QueueCount: saved=%u config=%u"),
+                                u32, pThis->cIoQueues);
+
+    rc = SSMR3GetBool(pSSM, &fAttached);
+    AssertRCReturn(rc, rc);
+    if (fAttached != (pThis->pDrvBase != NULL))
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - namespace: saved=%RTbool config=%RTbool"),
+                                fAttached, pThis->pDrvBase != NULL);
+
+    SSMR3GetStrZ(pSSM, szSerialNumber, sizeof(szSerialNumber));
+    SSMR3GetStrZ(pSSM, szModelNumber, sizeof(szModelNumber));
+    rc = SSMR3GetStrZ(pSSM, szFirmwareRevision, sizeof(szFirmwareRevision));
+    AssertRCReturn(rc, rc);
+    if (strcmp(szSerialNumber, pThis->szSerialNumber))
+        LogRel(("NVMe#%u: config mismatch: SerialNumber - saved='%s' config='%s'\n",
+                pDevIns->iInstance, szSerialNumber, pThis->szSerialNumber));
+    if (strcmp(szModelNumber, pThis->szModelNumber))
+        LogRel(("NVMe#%u: config mismatch: ModelNumber - saved='%s' config='%s'\n",
+                pDevIns->iInstance, szModelNumber, pThis->szModelNumber));
+    if (strcmp(szFirmwareRevision, pThis->szFirmwareRevision))
+        LogRel(("NVMe#%u: config mismatch: FirmwareRevision - saved='%s' config='%s'\n",
+                pDevIns->iInstance, szFirmwareRevision, pThis->szFirmwareRevision));
+
+    if (uPass != SSM_PASS_FINAL)
+        return VINF_SUCCESS;
+
+    /* registers */
+    SSMR3GetU32(pSSM, &pThis->u32RegIntMask);
+    SSMR3GetU32(pSSM, &pThis->u32RegCc);
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32RegCsts);
+    SSMR3GetU32(pSSM, &pThis->u32RegAqa);
+    SSMR3GetU64(pSSM, &pThis->u64RegAsq);
+    SSMR3GetU64(pSSM, &pThis->u64RegAcq);
+
+    /* features */
+    SSMR3GetU32(pSSM, &pThis->u32FeatArbitration);
+    SSMR3GetU32(pSSM, &pThis->u32FeatPowerMgmt);
+    SSMR3GetU32(pSSM, &pThis->u32FeatTempThreshold);
+    SSMR3GetU32(pSSM, &pThis->u32FeatErrorRecovery);
+    SSMR3GetU32(pSSM, &pThis->u32FeatVolatileWc);
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32FeatIntrCoalescing);
+    SSMR3GetU32(pSSM, &pThis->u32FeatWriteAtomicity);
+    SSMR3GetU32(pSSM, &pThis->u32FeatAsyncEventCfg);
+    SSMR3GetBool(pSSM, &pThis->fNumQueuesSet);
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->afIntrVecCoalesceDisable); i++)
+        SSMR3GetBool(pSSM, &pThis->afIntrVecCoalesceDisable[i]);
+
+    SSMR3GetU32(pSSM, &pThis->cAerOutstanding);
+    rc = SSMR3GetU64(pSSM, &pThis->bmIntxPending);
+    AssertRCReturn(rc, rc);
+    pThis->fIntxAsserted =    pThis->bmIntxPending != 0
+                           && !(pThis->u32RegIntMask & RT_BIT_32(0))
+                           && !nvmeR3IsMsixEnabled(pThis);
+
+    /* queues */
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        bool    fStalled;
+        SSMR3GetBool(pSSM, &pSq->fValid);
+        SSMR3GetBool(pSSM, &fStalled);
+        SSMR3GetU8(pSSM, &pSq->u8Prio);
+        SSMR3GetU16(pSSM, &pSq->idCq);
+        SSMR3GetU32(pSSM, &pSq->cEntries);
+        SSMR3GetU32(pSSM, (uint32_t *)&pSq->uHead);
+        SSMR3GetU32(pSSM, &pSq->uTail);
+        rc = SSMR3GetGCPhys(pSSM, &pSq->GCPhysBase);
+        AssertRCReturn(rc, rc);
+        pSq->fStalled       = fStalled;
+        pSq->fDeletePending = false;
+
+        if (   pSq->fValid
+            && (   pSq->cEntries > NVME_QUEUE_ENTRIES_MAX
+                || pSq->uHead >= pSq->cEntries
+                || pSq->uTail >= pSq->cEntries
+                || pSq->idCq >= RT_ELEMENTS(pThis->aCqs)))
+            return VERR_SSM_DATA_UNIT_FORMAT_CHANGED;
+    }
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        PNVMECQ pCq = &pThis->aCqs[i];
+        uint32_t cPending;
+        SSMR3GetBool(pSSM, &pCq->fValid);
+        SSMR3GetBool(pSSM, &pCq->fPhase);
+        SSMR3GetBool(pSSM, &pCq->fIntrEnabled);
+        SSMR3GetU16(pSSM, &pCq->uVector);
+        SSMR3GetU32(pSSM, &pCq->cEntries);
+        SSMR3GetU32(pSSM, &pCq->uHead);
+        SSMR3GetU32(pSSM, &pCq->uTail);
+        SSMR3GetU32(pSSM, &pCq->cSqs);
+        SSMR3GetGCPhys(pSSM, &pCq->GCPhysBase);
+        rc = SSMR3GetU32(pSSM, &cPending);
+        AssertRCReturn(rc, rc);
+
+        if (   pCq->fValid
+            && (   pCq->cEntries > NVME_QUEUE_ENTRIES_MAX
+                || pCq->uHead >= pCq->cEntries
+                || pCq->uTail >= pCq->cEntries
+                || pCq->uVector > pThis->cIoQueues
+                || cPending > pCq->cEntries))
+            return VERR_SSM_DATA_UNIT_FORMAT_CHANGED;
+
+        nvmeR3CqPendingFree(pCq);
+        pCq->cIntrCoalesced = 0;
+        for (uint32_t j = 0; j < cPending; j++)
+        {
+            PNVMECQEPENDING pPending = (PNVMECQEPENDING)RTMemAllocZ(sizeof(NVMECQEPENDING));
+            if (!pPending)
+                return VERR_NO_MEMORY;
+
+            SSMR3GetU32(pSSM, &pPending->Cqe.u32Dw0);
+            SSMR3GetU16(pSSM, &pPending->Cqe.u16SqHead);
+            SSMR3GetU16(pSSM, &pPending->Cqe.u16SqId);
+            SSMR3GetU16(pSSM, &pPending->Cqe.u16Cid);
+            rc = SSMR3GetU16(pSSM, &pPending->Cqe.u16Status);
+            RTListAppend(&pCq->LstPending, &pPending->NodePending);
+            pCq->cPending++;
+            AssertRCReturn(rc, rc);
+        }
+    }
+
+    rc = SSMR3GetU32(pSSM, &u32);
+    if (RT_FAILURE(rc))
+        return rc;
+    AssertMsgReturn(u32 == UINT32_MAX, ("%#x\n", u32), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=-=- Namespace LUN -=-=-=-=-=- */
+
+/**
+ * Queries the interfaces of the driver attached to the namespace LUN.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   pThis       The NVMe controller instance.
+ */
+static int nvmeR3NsConfigure(PPDMDEVINS pDevIns, PNVME pThis)
+{
+    pThis->pDrvBlock = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCK);
+    if (!pThis->pDrvBlock)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 hasn't a block interface!\n"));
+        return VERR_PDM_MISSING_INTERFACE;
+    }
+
+    PDMBLOCKTYPE enmType = pThis->pDrvBlock->pfnGetType(pThis->pDrvBlock);
+    if (enmType != PDMBLOCKTYPE_HARD_DISK)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 isn't a disk. enmType=%d\n", enmType));
+        return VERR_PDM_UNSUPPORTED_BLOCK_TYPE;
+    }
+
+    pThis->pDrvBlockAsync = NULL;
+    if (pThis->fUseAsyncInterfaceIfAvailable)
+        pThis->pDrvBlockAsync = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCKASYNC);
+
+    pThis->cbSector = pThis->pDrvBlock->pfnGetSectorSize(pThis->pDrvBlock);
+    if (   pThis->cbSector < 512
+        || pThis->cbSector > NVME_PAGE_SIZE
+        || !RT_IS_POWER_OF_TWO(pThis->cbSector))
+        pThis->cbSector = 512;
+    pThis->cSectors = pThis->pDrvBlock->pfnGetSize(pThis->pDrvBlock) / pThis->cbSector;
+
+    if (pThis->pDrvBlockAsync)
+        pThis->fDiscard = pThis->pDrvBlockAsync->pfnStartDiscard != NULL;
+    else
+        pThis->fDiscard = pThis->pDrvBlock->pfnDiscard != NULL;
+
+    /* Derive a serial number from the medium if none is configured. */
+    if (!pThis->szSerialNumber[0])
+    {
+        RTUUID Uuid;
+        int rc = pThis->pDrvBlock->pfnGetUuid(pThis->pDrvBlock, &Uuid);
+        if (RT_SUCCESS(rc) && !RTUuidIsNull(&Uuid))
+            RTStrPrintf(pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "VB%08x-%08x",
+                        Uuid.au32[0], Uuid.au32[3]);
+        else
+            RTStrPrintf(pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "VB%08x-%08x",
+                        pDevIns->iInstance, 0);
+    }
+
+    LogRel(("NVMe#%u: Namespace 1: %RU64 blocks of %u bytes, %s I/O, discard %s\n", pDevIns->iInstance,
+            pThis->cSectors, pThis->cbSector, pThis->pDrvBlockAsync ? "async" : "sync",
+            pThis->fDiscard ? "supported" : "not supported"));
+    return VINF_SUCCESS;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDetach}
+ */
+static DECLCALLBACK(void) nvmeR3Detach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(fFlags);
+
+    Log(("%s: iLUN=%u\n", __FUNCTION__, iLUN));
+    AssertReturnVoid(iLUN == 0);
+
+    pThis->pDrvBase       = NULL;
+    pThis->pDrvBlock      = NULL;
+    pThis->pDrvBlockAsync = NULL;
+    pThis->cSectors       = 0;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnAttach}
+ */
+static DECLCALLBACK(int) nvmeR3Attach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    NOREF(fFlags);
+
+    Log(("%s: iLUN=%u\n", __FUNCTION__, iLUN));
+    AssertReturn(iLUN == 0, VERR_PDM_LUN_NOT_FOUND);
+    AssertRelease(!pThis->pDrvBase);
+
+    int rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->INsBase, &pThis->pDrvBase, NULL);
+    if (RT_SUCCESS(rc))
+        rc = nvmeR3NsConfigure(pDevIns, pThis);
+    else
+        AssertMsgFailed(("Failed to attach LUN#0. rc=%Rrc\n", rc));
+
+    if (RT_FAILURE(rc))
+    {
+        pThis->pDrvBase       = NULL;
+        pThis->pDrvBlock      = NULL;
+        pThis->pDrvBlockAsync = NULL;
+    }
+    return rc;
+}
+
+
+/* -=-=-=-=-=- Life cycle -=-=-=-=-=- */
+
+/**
+ * Releases all resources held while the VM is not running.
+ *
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3Quiesced(PNVME pThis)
+{
+    /*
+     * Held back completion interrupts are raised because the coalescing
+     * state is not part of the saved state.
+     */
+    for (uint32_t i = 1; i <= pThis->cIoQueues; i++)
+        nvmeR3CqIntrCoalesceFlush(pThis, &pThis->aCqs[i]);
+}
+
+/**
+ * Callback employed by nvmeR3Suspend and nvmeR3PowerOff.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        return false;
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    nvmeR3Quiesced(pThis);
+    return true;
+}
+
+/**
+ * Common worker for nvmeR3Suspend and nvmeR3PowerOff.
+ */
+static void nvmeR3SuspendOrPowerOff(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncSuspendOrPowerOffDone);
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        nvmeR3Quiesced(pThis);
+    }
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnSuspend}
+ */
+static DECLCALLBACK(void) nvmeR3Suspend(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3Suspend\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnPowerOff}
+ */
+static DECLCALLBACK(void) nvmeR3PowerOff(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3PowerOff\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * Common reset worker.
+ *
+ * @param   pThis       The NVMe controller instance.
+ */
+static void nvmeR3ResetCommon(PNVME pThis)
+{
+    nvmeR3CtrlReset(pThis);
+    pThis->u32RegCc  = 0;
+    pThis->u32RegAqa = 0;
+    pThis->u64RegAsq = 0;
+    pThis->u64RegAcq = 0;
+}
+
+/**
+ * Callback employed by nvmeR3Reset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncResetDone(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+
+    nvmeR3ResetCommon(pThis);
+    return true;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnReset}
+ */
+static DECLCALLBACK(void) nvmeR3Reset(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncResetDone);
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        nvmeR3ResetCommon(pThis);
+    }
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDestruct}
+ */
+static DECLCALLBACK(int) nvmeR3Destruct(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        if (RTCritSectIsInitialized(&pThis->aCqs[i].CritSect))
+        {
+            nvmeR3CqPendingFree(&pThis->aCqs[i]);
+            RTCritSectDelete(&pThis->aCqs[i].CritSect);
+        }
+        if (RTCritSectIsInitialized(&pThis->aSqs[i].CritSect))
+            RTCritSectDelete(&pThis->aSqs[i].CritSect);
+    }
+
+    if (RTCritSectIsInitialized(&pThis->CritSectIntr))
+        RTCritSectDelete(&pThis->CritSectIntr);
+
+    if (pThis->hEvtIo != NIL_SUPSEMEVENT)
+    {
+        SUPSemEventClose(pThis->pSupDrvSession, pThis->hEvtIo);
+        pThis->hEvtIo = NIL_SUPSEMEVENT;
+    }
+
+    if (RTCritSectIsInitialized(&pThis->CritSectIo))
+        RTCritSectDelete(&pThis->CritSectIo);
+
+    if (pThis->hReqCache != NIL_RTMEMCACHE)
+    {
+        RTMemCacheDestroy(pThis->hReqCache);
+        pThis->hReqCache = NIL_RTMEMCACHE;
+    }
+
+    if (PDMCritSectIsInitialized(&pThis->CritSectCtrl))
+        PDMR3CritSectDelete(&pThis->CritSectCtrl);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnConstruct}
+ */
+static DECLCALLBACK(int) nvmeR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
+{
+    PNVME       pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PPDMIBASE   pBase;
+    uint32_t    cCpus;
+    int         rc;
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+
+    /*
+     * Initialize the instance data (everything touched by the destructor need
+     * to be initialized here!).
+     */
+    pThis->pDevInsR3 = pDevIns;
+    pThis->hReqCache = NIL_RTMEMCACHE;
+    pThis->hEvtIo    = NIL_SUPSEMEVENT;
+    pThis->pSupDrvSession = PDMDevHlpGetSupDrvSession(pDevIns);
+    RTListInit(&pThis->LstReqsIo);
+    pThis->Led.u32Magic = PDMLED_MAGIC;
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        pThis->aCqs[i].idCq = (uint16_t)i;
+        RTListInit(&pThis->aCqs[i].LstPending);
+    }
+
+    /*
+     * Validate and read configuration.
+     */
+    if (!CFGMR3AreValuesValid(pCfg, "QueueCount\0"
+                                    "NumCPUs\0"
+                                    "UseAsyncInterfaceIfAvailable\0"
+                                    "IntrCoalescingThreshold\0"
+                                    "IntrCoalescingTimeUs\0"
+                                    "SerialNumber\0"
+                                    "ModelNumber\0"
+                                    "FirmwareRevision\0"))
+        return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
+                                N_("NVMe configuration error: unknown option specified"));
+
+    rc = CFGMR3QueryU32Def(pCfg, "NumCPUs", &cCpus, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read NumCPUs as integer"));
+
+    /* One I/O queue pair per vCPU by default. */
+    rc = CFGMR3QueryU32Def(pCfg, "QueueCount", &pThis->cIoQueues, RT_MIN(RT_MAX(cCpus, 1), NVME_IO_QUEUES_MAX));
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read QueueCount as integer"));
+    if (   pThis->cIoQueues < 1
+        || pThis->cIoQueues > NVME_IO_QUEUES_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: QueueCount=%u should be between 1 and %u"),
+                                   pThis->cIoQueues, NVME_IO_QUEUES_MAX);
+
+    rc = CFGMR3QueryBoolDef(pCfg, "UseAsyncInterfaceIfAvailable", &pThis->fUseAsyncInterfaceIfAvailable, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read UseAsyncInterfaceIfAvailable as boolean"));
+
+    /*
+     * Default of the Interrupt Coalescing feature, the guest can change it.
+     * Disabled by default because it adds latency.
+     */
+    uint32_t cIntrCoalesceThreshold;
+    rc = CFGMR3QueryU32Def(pCfg, "IntrCoalescingThreshold", &cIntrCoalesceThreshold, 0);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read IntrCoalescingThreshold as integer"));
+    if (cIntrCoalesceThreshold > 256)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: IntrCoalescingThreshold=%u should not exceed 256"),
+                                   cIntrCoalesceThreshold);
+
+    uint32_t cUsIntrCoalesceTime;
+    rc = CFGMR3QueryU32Def(pCfg, "IntrCoalescingTimeUs", &cUsIntrCoalesceTime, 100);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read IntrCoalescingTimeUs as integer"));
+    if (cUsIntrCoalesceTime > 255 * 100)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: IntrCoalescingTimeUs=%u should not exceed %u"),
+                                   cUsIntrCoalesceTime, 255 * 100);
+    if (cIntrCoalesceThreshold > 1)
+    {
+        /* The feature has a 0's based threshold and the time in 100us units. */
+        pThis->u32IntrCoalescingDef = (cIntrCoalesceThreshold - 1) | (RT_MAX(cUsIntrCoalesceTime / 100, 1) << 8);
+        LogRel(("NVMe#%d: Interrupt coalescing enabled by default (%u completions, %u us)\n", iInstance,
+                cIntrCoalesceThreshold, cUsIntrCoalesceTime));
+    }
+
+    rc = CFGMR3QueryStringDef(pCfg, "SerialNumber", pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"SerialNumber\" is longer than 20 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"SerialNumber\" as string"));
+    }
+
+    rc = CFGMR3QueryStringDef(pCfg, "ModelNumber", pThis->szModelNumber, sizeof(pThis->szModelNumber),
+                              "VBOX NVME HARDDISK");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"ModelNumber\" is longer than 40 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"ModelNumber\" as string"));
+    }
+
+    rc = CFGMR3QueryStringDef(pCfg, "FirmwareRevision", pThis->szFirmwareRevision, sizeof(pThis->szFirmwareRevision),
+                              "1.0");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"FirmwareRevision\" is longer than 8 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"FirmwareRevision\" as string"));
+    }
+
+    /*
+     * PCI configuration space.
+     */
+    PCIDevSetVendorId         (&pThis->PciDev, 0x80ee);
+    PCIDevSetDeviceId         (&pThis->PciDev, 0x4e56);
+    PCIDevSetSubSystemVendorId(&pThis->PciDev, 0x80ee);
+    PCIDevSetSubSystemId      (&pThis->PciDev, 0x4e56);
+    PCIDevSetRevisionId       (&pThis->PciDev, 0x01);
+    PCIDevSetClassProg        (&pThis->PciDev, 0x02); /* NVM Express */
+    PCIDevSetClassSub         (&pThis->PciDev, 0x08); /* Non-volatile memory controller */
+    PCIDevSetClassBase        (&pThis->PciDev, 0x01); /* Mass storage */
+    PCIDevSetInterruptPin     (&pThis->PciDev, 0x01); /* Interrupt pin A */
+    PCIDevSetStatus           (&pThis->PciDev, VBOX_PCI_STATUS_CAP_LIST);
+    PCIDevSetCapabilityList   (&pThis->PciDev, NVME_MSIX_CAP_OFFSET);
+
+    /*
+     * Locks, the doorbells and completions use the per queue locks.
+     * Note! We do our own syncronization, so NOP the default crit sect for the device.
+     */
+    rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
+    AssertRCReturn(rc, rc);
+
+    rc = PDMDevHlpCritSectInit(pDevIns, &pThis->CritSectCtrl, RT_SRC_POS, "NVMe#%u", iInstance);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create critical section"));
+
+    rc = RTCritSectInit(&pThis->CritSectIntr);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create interrupt critical section"));
+
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        rc = RTCritSectInit(&pThis->aSqs[i].CritSect);
+        if (RT_SUCCESS(rc))
+            rc = RTCritSectInit(&pThis->aCqs[i].CritSect);
+        if (RT_FAILURE(rc))
+            return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create queue critical sections"));
+    }
+
+    rc = RTMemCacheCreate(&pThis->hReqCache, sizeof(NVMEREQ), 0, UINT32_MAX, NULL, NULL, NULL, 0);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create request cache"));
+
+    /* The I/O thread serves drivers without the asynchronous interface, a driver attached later may be one. */
+    rc = RTCritSectInit(&pThis->CritSectIo);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create I/O critical section"));
+
+    rc = SUPSemEventCreate(pThis->pSupDrvSession, &pThis->hEvtIo);
+    if (RT_FAILURE(rc))
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("NVMe: Failed to create SUP event semaphore"));
+
+    char szThread[16];
+    RTStrPrintf(szThread, sizeof(szThread), "NVMe%u-IO", iInstance);
+    rc = PDMDevHlpThreadCreate(pDevIns, &pThis->pThreadIo, pThis, nvmeR3IoThread, nvmeR3IoThreadWakeUp, 0,
+                               RTTHREADTYPE_IO, szThread);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe: cannot create I/O thread"));
+
+    /*
+     * Register the PCI device and its I/O regions.
+     */
+    rc = PDMDevHlpPCIRegister(pDevIns, &pThis->PciDev);
+    if (RT_FAILURE(rc))
+        return rc;
+
+#ifdef VBOX_WITH_MSI_DEVICES
+    PDMMSIREG MsiReg;
+    RT_ZERO(MsiReg);
+    MsiReg.cMsixVectors    = (uint16_t)(pThis->cIoQueues + 1);
+    MsiReg.iMsixCapOffset  = NVME_MSIX_CAP_OFFSET;
+    MsiReg.iMsixNextOffset = 0x00;
+    MsiReg.iMsixBar        = NVME_MSIX_BAR;
+    rc = PDMDevHlpPCIRegisterMsi(pDevIns, &MsiReg);
+    if (RT_SUCCESS(rc))
+        pThis->fMsixRegistered = true;
+    else
+    {
+        /* That's OK, we can work with INTx only. */
+        LogRel(("NVMe#%d: MSI-X not available (%Rrc), using INTx\n", iInstance, rc));
+        PCIDevSetStatus(&pThis->PciDev, 0);
+        PCIDevSetCapabilityList(&pThis->PciDev, 0x00);
+    }
+#else
+    PCIDevSetStatus(&pThis->PciDev, 0);
+    PCIDevSetCapabilityList(&pThis->PciDev, 0x00);
+#endif
+
+    rc = PDMDevHlpPCIIORegionRegister(pDevIns, 0, NVME_MMIO_SIZE, PCI_ADDRESS_SPACE_MEM, nvmeR3MmioMap);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe cannot register PCI memory region for registers"));
+
+    /* Timers for the aggregation time of interrupt coalescing, the admin queue is never coalesced. */
+    for (uint32_t i = 1; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        char szDesc[32];
+        RTStrPrintf(szDesc, sizeof(szDesc), "NVMe#%d CQ%u Coalescing", iInstance, i);
+        rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, nvmeR3IntrCoalesceTimer, &pThis->aCqs[i],
+                                    TMTIMER_FLAGS_NO_CRIT_SECT, szDesc, &pThis->aCqs[i].pTimerCoalesceR3);
+        if (RT_FAILURE(rc))
+        {
+            AssertMsgFailed(("pfnTMTimerCreate -> %Rrc\n", rc));
+            return rc;
+        }
+    }
+
+    /*
+     * Interfaces and the namespace LUN.
+     */
+    pThis->IBase.pfnQueryInterface            = nvmeR3Status_QueryInterface;
+    pThis->ILeds.pfnQueryStatusLed            = nvmeR3Status_QueryStatusLed;
+    pThis->INsBase.pfnQueryInterface          = nvmeR3NsQueryInterface;
+    pThis->INsPort.pfnQueryDeviceLocation     = nvmeR3NsQueryDeviceLocation;
+    pThis->INsPortAsync.pfnTransferCompleteNotify = nvmeR3TransferCompleteNotify;
+
+    rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->INsBase, &pThis->pDrvBase, "Namespace1");
+    if (RT_SUCCESS(rc))
+    {
+        rc = nvmeR3NsConfigure(pDevIns, pThis);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    else if (rc == VERR_PDM_NO_ATTACHED_DRIVER)
+    {
+        pThis->pDrvBase = NULL;
+        LogRel(("NVMe#%d: No driver attached to the namespace\n", iInstance));
+    }
+    else
+        return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS, N_("NVMe: Failed to attach the namespace driver"));
+
+    /*
+     * Attach status driver (optional).
+     */
+    rc = PDMDevHlpDriverAttach(pDevIns, PDM_STATUS_LUN, &pThis->IBase, &pBase, "Status Port");
+    if (RT_SUCCESS(rc))
+        pThis->pLedsConnector = PDMIBASE_QUERY_INTERFACE(pBase, PDMILEDCONNECTORS);
+    else if (rc != VERR_PDM_NO_ATTACHED_DRIVER)
+    {
+        AssertMsgFailed(("Failed to attach to status driver. rc=%Rrc\n", rc));
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe cannot attach to status driver"));
+    }
+
+    rc = PDMDevHlpSSMRegister3(pDevIns, NVME_SAVED_STATE_VERSION, sizeof(*pThis),
+                               nvmeR3LiveExec, nvmeR3SaveExec, nvmeR3LoadExec);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /*
+     * Statistics.
+     */
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReads, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of read requests.", "/Devices/NVMe%d/Reads", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatWrites, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of write requests.", "/Devices/NVMe%d/Writes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatFlushes, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of flush requests.", "/Devices/NVMe%d/Flushes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDiscards, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of discard requests.", "/Devices/NVMe%d/Discards", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesRead, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                           "Amount of data read.", "/Devices/NVMe%d/ReadBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesWritten, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                           "Amount of data written.", "/Devices/NVMe%d/WrittenBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatAdminCmds, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of admin commands.", "/Devices/NVMe%d/AdminCmds", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDoorbellWrites, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of doorbell writes.", "/Devices/NVMe%d/DoorbellWrites", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrRaised, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of completion interrupts raised.", "/Devices/NVMe%d/IntrRaised", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntrCoalesced, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of interrupts saved by interrupt coalescing.", "/Devices/NVMe%d/IntrCoalesced", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatCqFull, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of completions held back by a full completion queue.", "/Devices/NVMe%d/CqFull", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatSqStalled, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of times fetching commands stopped because of a congested completion queue.",
+                           "/Devices/NVMe%d/SqStalled", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatErrors, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of commands completed with an error status.", "/Devices/NVMe%d/Errors", iInstance);
+    for (uint32_t i = 0; i <= pThis->cIoQueues; i++)
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aSqs[i].StatCmds, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of commands fetched from the submission queue.", "/Devices/NVMe%d/SQ%u/Cmds",
+                               iInstance, i);
+
+    /*
+     * Register the info item.
+     */
+    char szTmp[128];
+    RTStrPrintf(szTmp, sizeof(szTmp), "%s%d", pDevIns->pReg->szName, pDevIns->iInstance);
+    PDMDevHlpDBGFInfoRegister(pDevIns, szTmp, "NVMe info", nvmeR3Info);
+
+    LogRel(("NVMe#%d: %u I/O queue pairs, %s\n", iInstance, pThis->cIoQueues,
+            pThis->fMsixRegistered ? "MSI-X" : "INTx"));
+
+    nvmeR3ResetCommon(pThis);
+    return VINF_SUCCESS;
+}
+
+/**
+ * The device registration structure.
+ */
+const PDMDEVREG g_DeviceNVMe =
+{
+    /* u32Version */
+    PDM_DEVREG_VERSION,
+    /* szName */
+    "nvme",
+    /* szRCMod */
+    "",
+    /* szR0Mod */
+    "",
+    /* pszDescription */
+    "NVM Express controller.\n",
+    /* fFlags */
+    PDM_DEVREG_FLAGS_DEFAULT_BITS |
+    PDM_DEVREG_FLAGS_FIRST_SUSPEND_NOTIFICATION | PDM_DEVREG_FLAGS_FIRST_POWEROFF_NOTIFICATION |
+    PDM_DEVREG_FLAGS_FIRST_RESET_NOTIFICATION,
+    /* fClass */
+    PDM_DEVREG_CLASS_STORAGE,
+    /* cMaxInstances */
+    ~0U,
+    /* cbInstance */
+    sizeof(NVME),
+    /* pfnConstruct */
+    nvmeR3Construct,
+    /* pfnDestruct */
+    nvmeR3Destruct,
+    /* pfnRelocate */
+    NULL,
+    /* pfnMemSetup */
+    NULL,
+    /* pfnPowerOn */
+    NULL,
+    /* pfnReset */
+    nvmeR3Reset,
+    /* pfnSuspend */
+    nvmeR3Suspend,
+    /* pfnResume */
+    NULL,
+    /* pfnAttach */
+    nvmeR3Attach,
+    /* pfnDetach */
+    nvmeR3Detach,
+    /* pfnQueryInterface. */
+    NULL,
+    /* pfnInitComplete */
+    NULL,
+    /* pfnPowerOff */
+    nvmeR3PowerOff,
+    /* pfnSoftReset */
+    NULL,
+    /* u32VersionEnd */
+    PDM_DEVREG_VERSION
+};
+
+#endif /* IN_RING3 */
+#endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
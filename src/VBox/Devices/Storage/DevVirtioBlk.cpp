@@ -0,0 +1,1446 @@
+/* $Id$ */
+/** @file
+ * DevVirtioBlk - Virtio Block Device
+ */
+
+/*
+ * Copyright (C) 2015 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_dev_virtio_blk     Virtio Block Device
+ *
+ * A paravirtual disk using the legacy virtio PCI transport in Virtio.cpp,
+ * backed by the block driver attached to LUN 0.
+ *
+ * The device offers one request queue per virtual CPU by default
+ * (VIRTIO_BLK_F_MQ) so guest drivers can submit from every vCPU without
+ * sharing a queue lock. Each queue has its own lock on the host side too,
+ * requests are started on the EMT which notified the queue and completed on
+ * whatever thread the driver completes them. All queues share the INTx
+ * interrupt of the transport.
+ *
+ * Indirect descriptors and the event index notification suppression of the
+ * transport are offered to the guest. While a queue is being processed
+ * guest notifications are disabled, and completions of requests finishing
+ * during processing are published with a single used ring update.
+ *
+ * Data is transferred through a bounce buffer per request.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_VIRTIO_BLK
+
+#include <VBox/vmm/pdmdev.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/string.h>
+#ifdef IN_RING3
+# include <iprt/critsect.h>
+# include <iprt/mem.h>
+# include <iprt/uuid.h>
+#endif /* IN_RING3 */
+#include "VBoxDD.h"
+#include "../VirtIO/Virtio.h"
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+#define INSTANCE(pThis) pThis->VPCI.szInstance
+
+#define VBLK_PCI_SUBSYSTEM_ID        1 + VIRTIO_BLK_ID
+#define VBLK_PCI_CLASS               0x0180
+#define VBLK_NAME_FMT                "VBlk%d"
+
+/** Size of each request queue. */
+#define VBLK_QUEUE_SIZE              256
+/** Maximum number of data segments of a request, the header and the status
+ * take one descriptor each. */
+#define VBLK_SEG_MAX                 (VBLK_QUEUE_SIZE - 2)
+/** Maximum size of a single transfer. */
+#define VBLK_XFER_SIZE_MAX           (64 * _1M)
+/** Maximum number of ranges of a discard request. */
+#define VBLK_DISCARD_SEGS_MAX        32
+/** Size of the serial number returned by VBLK_T_GET_ID. */
+#define VBLK_ID_BYTES                20
+/** Virtio block devices always address in units of 512 bytes. */
+#define VBLK_SECTOR_SHIFT            9
+
+/** @name Virtio block features
+ * @{  */
+#define VBLK_F_SIZE_MAX   0x00000002  /**< Maximum size of a segment in size_max. */
+#define VBLK_F_SEG_MAX    0x00000004  /**< Maximum number of segments in seg_max. */
+#define VBLK_F_RO         0x00000020  /**< Device is read only. */
+#define VBLK_F_BLK_SIZE   0x00000040  /**< Logical block size in blk_size. */
+#define VBLK_F_FLUSH      0x00000200  /**< Flush command supported. */
+#define VBLK_F_TOPOLOGY   0x00000400  /**< Topology information available. */
+#define VBLK_F_CONFIG_WCE 0x00000800  /**< Guest can toggle the write cache in writeback. */
+#define VBLK_F_MQ         0x00001000  /**< Multiple request queues, count in num_queues. */
+#define VBLK_F_DISCARD    0x00002000  /**< Discard command supported. */
+/** @} */
+
+/** @name Request types
+ * @{ */
+#define VBLK_T_IN         0
+#define VBLK_T_OUT        1
+#define VBLK_T_FLUSH      4
+#define VBLK_T_GET_ID     8
+#define VBLK_T_DISCARD    11
+/** @} */
+
+/** @name Request status
+ * @{ */
+#define VBLK_S_OK         0
+#define VBLK_S_IOERR      1
+#define VBLK_S_UNSUPP     2
+/** @} */
+
+/** Saved state version of the device specific part. */
+#define VBLK_SAVEDSTATE_VERSION      1
+
+
+/*********************************************************************************************************************************
+*   Structures and Typedefs                                                                                                      *
+*********************************************************************************************************************************/
+#pragma pack(1)
+/**
+ * The device configuration space (struct virtio_blk_config).
+ */
+struct VBlkPCIConfig
+{
+    uint64_t u64Capacity;                 /**< Size in 512 byte sectors. */
+    uint32_t u32SizeMax;
+    uint32_t u32SegMax;
+    uint16_t u16Cylinders;
+    uint8_t  u8Heads;
+    uint8_t  u8Sectors;
+    uint32_t u32BlkSize;
+    uint8_t  u8PhysBlockExp;
+    uint8_t  u8AlignmentOffset;
+    uint16_t u16MinIoSize;
+    uint32_t u32OptIoSize;
+    uint8_t  u8Writeback;                 /**< Writable with VBLK_F_CONFIG_WCE. */
+    uint8_t  u8Unused0;
+    uint16_t u16NumQueues;
+    uint32_t u32MaxDiscardSectors;
+    uint32_t u32MaxDiscardSeg;
+    uint32_t u32DiscardSectorAlignment;
+};
+#pragma pack()
+AssertCompileMemberOffset(struct VBlkPCIConfig, u8Writeback, 32);
+AssertCompileMemberOffset(struct VBlkPCIConfig, u16NumQueues, 34);
+AssertCompileSize(struct VBlkPCIConfig, 48);
+
+/**
+ * Request header, the first descriptor of every request.
+ */
+typedef struct VBLKREQHDR
+{
+    uint32_t u32Type;
+    uint32_t u32Ioprio;
+    uint64_t u64Sector;
+} VBLKREQHDR;
+AssertCompileSize(VBLKREQHDR, 16);
+
+/**
+ * Range of a discard request.
+ */
+typedef struct VBLKDISCARDSEG
+{
+    uint64_t u64Sector;
+    uint32_t u32NumSectors;
+    uint32_t u32Flags;
+} VBLKDISCARDSEG;
+AssertCompileSize(VBLKDISCARDSEG, 16);
+
+/**
+ * An in flight request.
+ */
+typedef struct VBLKREQ
+{
+    /** The request type (VBLK_T_XXX). */
+    uint32_t                u32Type;
+    /** Device reset generation the request was started in. */
+    uint32_t                uGen;
+    /** The queue the request came from. */
+    uint16_t                iQueue;
+    /** Issue a flush when the write completed. */
+    bool                    fFlushAfter;
+    /** Index of the head descriptor of the request. */
+    uint32_t                uIndex;
+    /** Guest address of the status byte. */
+    RTGCPHYS                GCPhysStatus;
+    /** Start offset on the medium. */
+    uint64_t                offStart;
+    /** Number of bytes to transfer. */
+    size_t                  cbXfer;
+    /** The bounce buffer. */
+    RTSGSEG                 DataSeg;
+    /** Ranges of a discard request. */
+    PRTRANGE                paRanges;
+    /** Number of ranges. */
+    unsigned                cRanges;
+    /** Number of guest data segments. */
+    uint32_t                cSegs;
+    /** The guest data segments. */
+    VQUEUESEG               aSegs[1];
+} VBLKREQ;
+/** Pointer to a request. */
+typedef VBLKREQ *PVBLKREQ;
+
+/**
+ * Host side state of a request queue.
+ */
+typedef struct VBLKQUEUE
+{
+    /** Serializes fetching and completing requests. */
+    RTCRITSECT              CritSect;
+    /** The transport queue. */
+    R3PTRTYPE(PVQUEUE)      pQueue;
+    /** Scratch element for fetching requests. */
+    R3PTRTYPE(PVQUEUEELEM)  pElem;
+    /** Set while the queue is being processed by the notifying EMT. */
+    bool                    fSubmitting;
+    /** Completions were added to the used ring while submitting. */
+    bool                    fSyncPending;
+    /** Number of requests fetched. */
+    STAMCOUNTER             StatRequests;
+} VBLKQUEUE;
+/** Pointer to a request queue. */
+typedef VBLKQUEUE *PVBLKQUEUE;
+
+/**
+ * Device state structure.
+ *
+ * @extends     VPCISTATE
+ * @implements  PDMIBLOCKPORT
+ * @implements  PDMIBLOCKASYNCPORT
+ */
+typedef struct VBlkState_st
+{
+    /* VPCISTATE must be the first member! */
+    VPCISTATE               VPCI;
+
+    /** The block port interface. */
+    PDMIBLOCKPORT           IPort;
+    /** The async block port interface. */
+    PDMIBLOCKASYNCPORT      IPortAsync;
+    /** Attached block driver. */
+    R3PTRTYPE(PPDMIBASE)    pDrvBase;
+    /** The block interface of the driver. */
+    R3PTRTYPE(PPDMIBLOCK)   pDrvBlock;
+    /** The async block interface of the driver, NULL if not used. */
+    R3PTRTYPE(PPDMIBLOCKASYNC) pDrvBlockAsync;
+
+    /** The configuration space. */
+    struct VBlkPCIConfig    config;
+    /** Serial number returned by VBLK_T_GET_ID. */
+    char                    szSerialNumber[VBLK_ID_BYTES + 1];
+    /** Whether the medium is read only. */
+    bool                    fReadOnly;
+    /** Whether discarding is supported by the driver. */
+    bool                    fDiscard;
+    /** Whether to use the async interface of the driver. */
+    bool                    fUseAsyncInterfaceIfAvailable;
+    /** Set when suspending, resetting or powering off with requests in flight. */
+    volatile bool           fSignalIdle;
+    /** Number of request queues. */
+    uint32_t                cQueues;
+    /** Incremented on every reset, requests of earlier generations are dropped. */
+    volatile uint32_t       uGen;
+    /** Number of requests in flight. */
+    volatile uint32_t       cReqsActive;
+
+    /** The request queues. */
+    VBLKQUEUE               aQueues[VIRTIO_MAX_NQUEUES];
+
+    STAMCOUNTER             StatReads;
+    STAMCOUNTER             StatWrites;
+    STAMCOUNTER             StatFlushes;
+    STAMCOUNTER             StatDiscards;
+    STAMCOUNTER             StatBytesRead;
+    STAMCOUNTER             StatBytesWritten;
+    STAMCOUNTER             StatErrors;
+} VBLKSTATE;
+/** Pointer to the virtio block device state. */
+typedef VBLKSTATE *PVBLKSTATE;
+
+
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+#ifdef IN_RING3
+
+static DECLCALLBACK(uint32_t) vblkIoCb_GetHostFeatures(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+
+    uint32_t fFeatures = VBLK_F_SEG_MAX
+                       | VBLK_F_BLK_SIZE
+                       | VBLK_F_FLUSH
+                       | VBLK_F_TOPOLOGY
+                       | VBLK_F_CONFIG_WCE
+                       | VPCI_F_INDIRECT_DESC
+                       | VPCI_F_EVENT_IDX;
+    if (pThis->fReadOnly)
+        fFeatures |= VBLK_F_RO;
+    if (pThis->cQueues > 1)
+        fFeatures |= VBLK_F_MQ;
+    if (pThis->fDiscard)
+        fFeatures |= VBLK_F_DISCARD;
+    return fFeatures;
+}
+
+static DECLCALLBACK(uint32_t) vblkIoCb_GetHostMinimalFeatures(void *pvState)
+{
+    NOREF(pvState);
+    return 0;
+}
+
+static DECLCALLBACK(void) vblkIoCb_SetHostFeatures(void *pvState, uint32_t fFeatures)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    LogFlow(("%s vblkIoCb_SetHostFeatures: uFeatures=%x\n", INSTANCE(pThis), fFeatures));
+    NOREF(pThis); NOREF(fFeatures);
+}
+
+static DECLCALLBACK(int) vblkIoCb_GetConfig(void *pvState, uint32_t offCfg, uint32_t cb, void *data)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    if (offCfg + cb > sizeof(struct VBlkPCIConfig))
+    {
+        Log(("%s vblkIoCb_GetConfig: Read beyond the config structure is attempted (offCfg=%#x cb=%x).\n", INSTANCE(pThis), offCfg, cb));
+        return VERR_IOM_IOPORT_UNUSED;
+    }
+    memcpy(data, (uint8_t *)&pThis->config + offCfg, cb);
+    return VINF_SUCCESS;
+}
+
+static DECLCALLBACK(int) vblkIoCb_SetConfig(void *pvState, uint32_t offCfg, uint32_t cb, void *data)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+
+    /* Only the write cache mode is writable. */
+    if (   offCfg == RT_OFFSETOF(struct VBlkPCIConfig, u8Writeback)
+        && cb == 1)
+    {
+        pThis->config.u8Writeback = *(uint8_t *)data ? 1 : 0;
+        LogRel(("%s: Write cache %s by the guest\n", INSTANCE(pThis),
+                pThis->config.u8Writeback ? "enabled" : "disabled"));
+    }
+    else
+        Log(("%s vblkIoCb_SetConfig: Write to read only config field ignored (offCfg=%#x cb=%x).\n", INSTANCE(pThis), offCfg, cb));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Hardware reset. Revert all registers to initial values.
+ *
+ * Requests in flight complete without touching the guest, the generation is
+ * bumped while owning the queue locks and checked under them on completion.
+ *
+ * @param   pvState    The device state structure.
+ */
+static DECLCALLBACK(int) vblkIoCb_Reset(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    Log(("%s Reset triggered\n", INSTANCE(pThis)));
+
+    for (uint32_t i = 0; i < pThis->cQueues; i++)
+        RTCritSectEnter(&pThis->aQueues[i].CritSect);
+    ASMAtomicIncU32(&pThis->uGen);
+    vpciReset(&pThis->VPCI);
+    for (uint32_t i = pThis->cQueues; i-- > 0;)
+        RTCritSectLeave(&pThis->aQueues[i].CritSect);
+
+    pThis->config.u8Writeback = 1;
+    return VINF_SUCCESS;
+}
+
+/**
+ * This function is called when the driver becomes ready.
+ *
+ * @param   pvState    The device state structure.
+ */
+static DECLCALLBACK(void) vblkIoCb_Ready(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    LogRel(("%s: Driver ready, features %#x\n", INSTANCE(pThis), pThis->VPCI.uGuestFeatures));
+}
+
+
+/**
+ * I/O port callbacks.
+ */
+static const VPCIIOCALLBACKS g_IOCallbacks =
+{
+     vblkIoCb_GetHostFeatures,
+     vblkIoCb_GetHostMinimalFeatures,
+     vblkIoCb_SetHostFeatures,
+     vblkIoCb_GetConfig,
+     vblkIoCb_SetConfig,
+     vblkIoCb_Reset,
+     vblkIoCb_Ready,
+};
+
+
+/**
+ * @callback_method_impl{FNIOMIOPORTIN}
+ */
+static DECLCALLBACK(int) vblkIOPortIn(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t *pu32, unsigned cb)
+{
+    return vpciIOPortIn(pDevIns, pvUser, port, pu32, cb, &g_IOCallbacks);
+}
+
+
+/**
+ * @callback_method_impl{FNIOMIOPORTOUT}
+ */
+static DECLCALLBACK(int) vblkIOPortOut(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t u32, unsigned cb)
+{
+    return vpciIOPortOut(pDevIns, pvUser, port, u32, cb, &g_IOCallbacks);
+}
+
+
+/* -=-=-=-=- Requests -=-=-=-=- */
+
+/**
+ * Copies data between the bounce buffer and the guest data segments.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request.
+ * @param   fToGuest    The direction.
+ */
+static void vblkReqCopy(PVBLKSTATE pThis, PVBLKREQ pReq, bool fToGuest)
+{
+    PPDMDEVINS pDevIns = pThis->VPCI.pDevInsR3;
+    uint8_t   *pbBuf   = (uint8_t *)pReq->DataSeg.pvSeg;
+    size_t     cbLeft  = pReq->cbXfer;
+
+    for (uint32_t i = 0; i < pReq->cSegs && cbLeft; i++)
+    {
+        size_t cbSeg = RT_MIN(pReq->aSegs[i].cb, cbLeft);
+        if (fToGuest)
+            PDMDevHlpPCIPhysWrite(pDevIns, pReq->aSegs[i].addr, pbBuf, cbSeg);
+        else
+            PDMDevHlpPhysRead(pDevIns, pReq->aSegs[i].addr, pbBuf, cbSeg);
+        pbBuf  += cbSeg;
+        cbLeft -= cbSeg;
+    }
+}
+
+/**
+ * Publishes the status of a request in the used ring of its queue.
+ *
+ * @param   pThis       The device state structure.
+ * @param   iQueue      The queue.
+ * @param   uIndex      Head descriptor index of the request.
+ * @param   GCPhysStatus Guest address of the status byte.
+ * @param   u8Status    The status.
+ * @param   cbWritten   Number of bytes written to the guest, including the status.
+ */
+static void vblkReqPut(PVBLKSTATE pThis, uint16_t iQueue, uint32_t uIndex, RTGCPHYS GCPhysStatus,
+                       uint8_t u8Status, uint32_t cbWritten)
+{
+    PVBLKQUEUE pBlkQueue = &pThis->aQueues[iQueue];
+
+    RTCritSectEnter(&pBlkQueue->CritSect);
+    PDMDevHlpPCIPhysWrite(pThis->VPCI.pDevInsR3, GCPhysStatus, &u8Status, sizeof(u8Status));
+    vqueuePutIndex(&pThis->VPCI, pBlkQueue->pQueue, uIndex, cbWritten);
+
+    /* The EMT processing the queue publishes everything completed meanwhile in one go. */
+    if (pBlkQueue->fSubmitting)
+        pBlkQueue->fSyncPending = true;
+    else
+        vqueueSync(&pThis->VPCI, pBlkQueue->pQueue);
+    RTCritSectLeave(&pBlkQueue->CritSect);
+}
+
+/**
+ * Completes a request, publishing the status and freeing the request.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request.
+ * @param   rcReq       Status code of the request.
+ */
+static void vblkReqComplete(PVBLKSTATE pThis, PVBLKREQ pReq, int rcReq);
+
+/**
+ * Starts a request on the attached driver.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request.
+ */
+static void vblkReqSubmit(PVBLKSTATE pThis, PVBLKREQ pReq)
+{
+    int rc;
+
+    if (pThis->pDrvBlockAsync)
+    {
+        switch (pReq->u32Type)
+        {
+            case VBLK_T_IN:
+                rc = pThis->pDrvBlockAsync->pfnStartRead(pThis->pDrvBlockAsync, pReq->offStart,
+                                                         &pReq->DataSeg, 1, pReq->cbXfer, pReq);
+                break;
+            case VBLK_T_OUT:
+                rc = pThis->pDrvBlockAsync->pfnStartWrite(pThis->pDrvBlockAsync, pReq->offStart,
+                                                          &pReq->DataSeg, 1, pReq->cbXfer, pReq);
+                break;
+            case VBLK_T_FLUSH:
+                rc = pThis->pDrvBlockAsync->pfnStartFlush(pThis->pDrvBlockAsync, pReq);
+                break;
+            case VBLK_T_DISCARD:
+                rc = pThis->pDrvBlockAsync->pfnStartDiscard(pThis->pDrvBlockAsync, pReq->paRanges, pReq->cRanges, pReq);
+                break;
+            default:
+                AssertMsgFailed(("Invalid request type %u\n", pReq->u32Type));
+                rc = VERR_INVALID_PARAMETER;
+        }
+
+        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+            vblkReqComplete(pThis, pReq, VINF_SUCCESS);
+        else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            vblkReqComplete(pThis, pReq, rc);
+    }
+    else
+    {
+        switch (pReq->u32Type)
+        {
+            case VBLK_T_IN:
+                rc = pThis->pDrvBlock->pfnRead(pThis->pDrvBlock, pReq->offStart, pReq->DataSeg.pvSeg, pReq->cbXfer);
+                break;
+            case VBLK_T_OUT:
+                rc = pThis->pDrvBlock->pfnWrite(pThis->pDrvBlock, pReq->offStart, pReq->DataSeg.pvSeg, pReq->cbXfer);
+                break;
+            case VBLK_T_FLUSH:
+                rc = pThis->pDrvBlock->pfnFlush(pThis->pDrvBlock);
+                break;
+            case VBLK_T_DISCARD:
+                rc = pThis->pDrvBlock->pfnDiscard(pThis->pDrvBlock, pReq->paRanges, pReq->cRanges);
+                break;
+            default:
+                AssertMsgFailed(("Invalid request type %u\n", pReq->u32Type));
+                rc = VERR_INVALID_PARAMETER;
+        }
+
+        vblkReqComplete(pThis, pReq, rc);
+    }
+}
+
+static void vblkReqComplete(PVBLKSTATE pThis, PVBLKREQ pReq, int rcReq)
+{
+    PPDMDEVINS pDevIns  = pThis->VPCI.pDevInsR3;
+    uint8_t    u8Status = VBLK_S_OK;
+    uint32_t   cbWritten = 1;
+
+    if (RT_SUCCESS(rcReq))
+    {
+        if (pReq->u32Type == VBLK_T_IN)
+        {
+            cbWritten += (uint32_t)pReq->cbXfer;
+            vpciSetReadLed(&pThis->VPCI, false);
+        }
+        else if (pReq->u32Type == VBLK_T_OUT)
+        {
+            vpciSetWriteLed(&pThis->VPCI, false);
+            if (pReq->fFlushAfter)
+            {
+                /* Write through mode, make the data stable before completing. */
+                pReq->fFlushAfter = false;
+                pReq->u32Type     = VBLK_T_FLUSH;
+                vblkReqSubmit(pThis, pReq);
+                return;
+            }
+        }
+    }
+    else
+    {
+        LogRel(("%s: Request type %u (offset %#RX64, %zu bytes) failed with %Rrc\n",
+                INSTANCE(pThis), pReq->u32Type, pReq->offStart, pReq->cbXfer, rcReq));
+        STAM_REL_COUNTER_INC(&pThis->StatErrors);
+        u8Status = VBLK_S_IOERR;
+        if (pReq->u32Type == VBLK_T_IN)
+            vpciSetReadLed(&pThis->VPCI, false);
+        else if (pReq->u32Type == VBLK_T_OUT)
+            vpciSetWriteLed(&pThis->VPCI, false);
+    }
+
+    /*
+     * Don't touch guest memory the driver may have reused after a reset. The
+     * reset bumps the generation while owning the queue locks, so checking it
+     * under the lock makes sure no reset slips in before we're done.
+     */
+    PVBLKQUEUE pBlkQueue = &pThis->aQueues[pReq->iQueue];
+    RTCritSectEnter(&pBlkQueue->CritSect);
+    if (pReq->uGen == ASMAtomicReadU32(&pThis->uGen))
+    {
+        if (u8Status == VBLK_S_OK && pReq->u32Type == VBLK_T_IN)
+            vblkReqCopy(pThis, pReq, true /*fToGuest*/);
+        vblkReqPut(pThis, pReq->iQueue, pReq->uIndex, pReq->GCPhysStatus, u8Status, cbWritten);
+    }
+    RTCritSectLeave(&pBlkQueue->CritSect);
+
+    if (pReq->DataSeg.pvSeg)
+        RTMemFree(pReq->DataSeg.pvSeg);
+    if (pReq->paRanges)
+        RTMemFree(pReq->paRanges);
+    RTMemFree(pReq);
+
+    if (   ASMAtomicDecU32(&pThis->cReqsActive) == 0
+        && pThis->fSignalIdle)
+        PDMDevHlpAsyncNotificationCompleted(pDevIns);
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKASYNCPORT,pfnTransferCompleteNotify}
+ */
+static DECLCALLBACK(int) vblkTransferCompleteNotify(PPDMIBLOCKASYNCPORT pInterface, void *pvUser, int rcReq)
+{
+    PVBLKSTATE pThis = RT_FROM_MEMBER(pInterface, VBLKSTATE, IPortAsync);
+
+    vblkReqComplete(pThis, (PVBLKREQ)pvUser, rcReq);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Reads the ranges of a discard request from the guest.
+ *
+ * @returns Request status.
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request, the ranges are stored here.
+ * @param   paSegs      The guest segments holding the ranges.
+ * @param   cSegs       Number of segments.
+ */
+static uint8_t vblkReqDiscardRanges(PVBLKSTATE pThis, PVBLKREQ pReq, VQUEUESEG *paSegs, uint32_t cSegs)
+{
+    VBLKDISCARDSEG aDiscard[VBLK_DISCARD_SEGS_MAX];
+    uint8_t       *pbDst = (uint8_t *)&aDiscard[0];
+    uint64_t       cbRanges = 0;
+
+    /* The segment sizes come from the guest, sum them up without wrapping
+     * and never read more than the range buffer holds. */
+    for (uint32_t i = 0; i < cSegs; i++)
+    {
+        if (paSegs[i].cb > sizeof(aDiscard) - cbRanges)
+            return VBLK_S_UNSUPP;
+        cbRanges += paSegs[i].cb;
+    }
+    if (   !cbRanges
+        || cbRanges % sizeof(VBLKDISCARDSEG))
+        return VBLK_S_UNSUPP;
+
+    for (uint32_t i = 0; i < cSegs; i++)
+    {
+        Assert((size_t)(pbDst - (uint8_t *)&aDiscard[0]) + paSegs[i].cb <= sizeof(aDiscard));
+        PDMDevHlpPhysRead(pThis->VPCI.pDevInsR3, paSegs[i].addr, pbDst, paSegs[i].cb);
+        pbDst += paSegs[i].cb;
+    }
+
+    unsigned cRanges = (unsigned)(cbRanges / sizeof(VBLKDISCARDSEG));
+    pReq->paRanges = (PRTRANGE)RTMemAllocZ(cRanges * sizeof(RTRANGE));
+    if (!pReq->paRanges)
+        return VBLK_S_IOERR;
+
+    for (unsigned i = 0; i < cRanges; i++)
+    {
+        uint64_t uSector = aDiscard[i].u64Sector;
+        uint32_t cSectors = aDiscard[i].u32NumSectors;
+        if (   uSector >= pThis->config.u64Capacity
+            || cSectors > pThis->config.u64Capacity - uSector)
+            return VBLK_S_IOERR;
+
+        /* Larger ranges than advertised could overflow size_t on 32-bit hosts. */
+        if (cSectors > pThis->config.u32MaxDiscardSectors)
+            return VBLK_S_IOERR;
+
+        pReq->paRanges[i].offStart = uSector << VBLK_SECTOR_SHIFT;
+        pReq->paRanges[i].cbRange  = (size_t)((uint64_t)cSectors << VBLK_SECTOR_SHIFT);
+    }
+    pReq->cRanges = cRanges;
+    return VBLK_S_OK;
+}
+
+/**
+ * Processes a request fetched from a queue.
+ *
+ * @param   pThis       The device state structure.
+ * @param   iQueue      The queue.
+ * @param   pElem       The queue element holding the request.
+ *
+ * @note Caller must own the lock of the queue.
+ */
+static void vblkReqProcess(PVBLKSTATE pThis, uint16_t iQueue, PVQUEUEELEM pElem)
+{
+    PPDMDEVINS pDevIns = pThis->VPCI.pDevInsR3;
+    VBLKREQHDR Hdr;
+
+    /*
+     * Without VIRTIO_F_ANY_LAYOUT the header is the first readable descriptor
+     * and the status the last writable one.
+     */
+    if (   pElem->nOut < 1
+        || pElem->aSegsOut[0].cb < sizeof(Hdr)
+        || pElem->nIn < 1
+        || pElem->aSegsIn[pElem->nIn - 1].cb < 1)
+    {
+        LogRel(("%s: Malformed request (nOut=%u nIn=%u), ignored\n", INSTANCE(pThis), pElem->nOut, pElem->nIn));
+        vqueuePutIndex(&pThis->VPCI, pThis->aQueues[iQueue].pQueue, pElem->uIndex, 0);
+        pThis->aQueues[iQueue].fSyncPending = true;
+        return;
+    }
+
+    PDMDevHlpPhysRead(pDevIns, pElem->aSegsOut[0].addr, &Hdr, sizeof(Hdr));
+    RTGCPHYS GCPhysStatus = pElem->aSegsIn[pElem->nIn - 1].addr + pElem->aSegsIn[pElem->nIn - 1].cb - 1;
+    Log2(("%s vblkReqProcess: type=%u sector=%RU64 nOut=%u nIn=%u\n", INSTANCE(pThis), Hdr.u32Type,
+          Hdr.u64Sector, pElem->nOut, pElem->nIn));
+
+    /* Legacy drivers may set the barrier flag in the type. */
+    uint32_t   u32Type = Hdr.u32Type & ~UINT32_C(0x80000000);
+    VQUEUESEG *paSegs  = NULL;
+    uint32_t   cSegs   = 0;
+    uint8_t    u8Status = VBLK_S_OK;
+
+    switch (u32Type)
+    {
+        case VBLK_T_IN:
+        case VBLK_T_GET_ID:
+            paSegs = &pElem->aSegsIn[0];
+            cSegs  = pElem->nIn - 1;
+            break;
+        case VBLK_T_OUT:
+        case VBLK_T_DISCARD:
+            paSegs = &pElem->aSegsOut[1];
+            cSegs  = pElem->nOut - 1;
+            break;
+        case VBLK_T_FLUSH:
+            break;
+        default:
+            u8Status = VBLK_S_UNSUPP;
+    }
+
+    if (   u8Status == VBLK_S_OK
+        && !pThis->pDrvBase)
+        u8Status = VBLK_S_IOERR;
+
+    if (   u8Status == VBLK_S_OK
+        && (   (u32Type == VBLK_T_OUT && pThis->fReadOnly)
+            || (u32Type == VBLK_T_DISCARD && (!pThis->fDiscard || pThis->fReadOnly))))
+        u8Status = VBLK_S_UNSUPP;
+
+    if (u8Status == VBLK_S_OK && u32Type == VBLK_T_GET_ID)
+    {
+        /* Answered right away, the serial needn't be terminated if it fills the buffer. */
+        char     szId[VBLK_ID_BYTES];
+        uint32_t cbId = 0;
+        RT_ZERO(szId);
+        memcpy(szId, pThis->szSerialNumber, strlen(pThis->szSerialNumber));
+        for (uint32_t i = 0; i < cSegs && cbId < sizeof(szId); i++)
+        {
+            uint32_t cbSeg = RT_MIN(paSegs[i].cb, sizeof(szId) - cbId);
+            PDMDevHlpPCIPhysWrite(pDevIns, paSegs[i].addr, &szId[cbId], cbSeg);
+            cbId += cbSeg;
+        }
+        vblkReqPut(pThis, iQueue, pElem->uIndex, GCPhysStatus, VBLK_S_OK, cbId + 1);
+        return;
+    }
+
+    if (u8Status != VBLK_S_OK)
+    {
+        vblkReqPut(pThis, iQueue, pElem->uIndex, GCPhysStatus, u8Status, 1);
+        return;
+    }
+
+    PVBLKREQ pReq = (PVBLKREQ)RTMemAllocZ(RT_OFFSETOF(VBLKREQ, aSegs[RT_MAX(cSegs, 1)]));
+    if (!pReq)
+    {
+        vblkReqPut(pThis, iQueue, pElem->uIndex, GCPhysStatus, VBLK_S_IOERR, 1);
+        return;
+    }
+
+    pReq->u32Type      = u32Type;
+    pReq->uGen         = ASMAtomicReadU32(&pThis->uGen);
+    pReq->iQueue       = iQueue;
+    pReq->uIndex       = pElem->uIndex;
+    pReq->GCPhysStatus = GCPhysStatus;
+
+    if (u32Type == VBLK_T_IN || u32Type == VBLK_T_OUT)
+    {
+        uint64_t cbXfer = 0;
+        for (uint32_t i = 0; i < cSegs; i++)
+        {
+            pReq->aSegs[i] = paSegs[i];
+            cbXfer += paSegs[i].cb;
+        }
+        pReq->cSegs    = cSegs;
+        pReq->offStart = Hdr.u64Sector << VBLK_SECTOR_SHIFT;
+
+        if (   cbXfer > VBLK_XFER_SIZE_MAX
+            || cbXfer % 512
+            || Hdr.u64Sector > pThis->config.u64Capacity
+            || (cbXfer >> VBLK_SECTOR_SHIFT) > pThis->config.u64Capacity - Hdr.u64Sector)
+            u8Status = VBLK_S_IOERR;
+        else if (cbXfer)
+        {
+            pReq->cbXfer         = (size_t)cbXfer;
+            pReq->DataSeg.cbSeg  = pReq->cbXfer;
+            pReq->DataSeg.pvSeg  = RTMemAlloc(pReq->cbXfer);
+            if (!pReq->DataSeg.pvSeg)
+                u8Status = VBLK_S_IOERR;
+        }
+
+        /* Requests without data complete right away. */
+        if (u8Status != VBLK_S_OK || !cbXfer)
+        {
+            RTMemFree(pReq->DataSeg.pvSeg);
+            RTMemFree(pReq);
+            vblkReqPut(pThis, iQueue, pElem->uIndex, GCPhysStatus, u8Status, 1);
+            return;
+        }
+
+        if (u32Type == VBLK_T_IN)
+        {
+            STAM_REL_COUNTER_INC(&pThis->StatReads);
+            STAM_REL_COUNTER_ADD(&pThis->StatBytesRead, cbXfer);
+            vpciSetReadLed(&pThis->VPCI, true);
+        }
+        else
+        {
+            vblkReqCopy(pThis, pReq, false /*fToGuest*/);
+            /* Legacy drivers without flush support expect write through semantics. */
+            pReq->fFlushAfter =    !(pThis->VPCI.uGuestFeatures & VBLK_F_FLUSH)
+                                || !pThis->config.u8Writeback;
+            STAM_REL_COUNTER_INC(&pThis->StatWrites);
+            STAM_REL_COUNTER_ADD(&pThis->StatBytesWritten, cbXfer);
+            vpciSetWriteLed(&pThis->VPCI, true);
+        }
+    }
+    else if (u32Type == VBLK_T_DISCARD)
+    {
+        u8Status = vblkReqDiscardRanges(pThis, pReq, paSegs, cSegs);
+        if (u8Status != VBLK_S_OK)
+        {
+            RTMemFree(pReq->paRanges);
+            RTMemFree(pReq);
+            vblkReqPut(pThis, iQueue, pElem->uIndex, GCPhysStatus, u8Status, 1);
+            return;
+        }
+        STAM_REL_COUNTER_INC(&pThis->StatDiscards);
+    }
+    else
+        STAM_REL_COUNTER_INC(&pThis->StatFlushes);
+
+    ASMAtomicIncU32(&pThis->cReqsActive);
+    vblkReqSubmit(pThis, pReq);
+}
+
+/**
+ * Queue notification callback, fetches and starts all new requests.
+ *
+ * @param   pvState     The device state structure.
+ * @param   pQueue      The notified queue.
+ */
+static DECLCALLBACK(void) vblkQueueNotify(void *pvState, PVQUEUE pQueue)
+{
+    PVBLKSTATE pThis     = (PVBLKSTATE)pvState;
+    uint16_t   iQueue    = (uint16_t)(pQueue - &pThis->VPCI.Queues[0]);
+    PVBLKQUEUE pBlkQueue = &pThis->aQueues[iQueue];
+
+    AssertReturnVoid(iQueue < pThis->cQueues);
+
+    RTCritSectEnter(&pBlkQueue->CritSect);
+    pBlkQueue->fSubmitting = true;
+
+    /*
+     * The guest doesn't need to notify while we're draining the queue. Check
+     * again after enabling notifications as the guest may have added requests
+     * without notifying in between.
+     */
+    do
+    {
+        vqueueSetNotification(&pThis->VPCI, pQueue, false);
+        while (vqueueGet(&pThis->VPCI, pQueue, pBlkQueue->pElem))
+        {
+            STAM_REL_COUNTER_INC(&pBlkQueue->StatRequests);
+            vblkReqProcess(pThis, iQueue, pBlkQueue->pElem);
+        }
+        vqueueSetNotification(&pThis->VPCI, pQueue, true);
+        ASMMemoryFence();
+    } while (   vqueueIsReady(&pThis->VPCI, pQueue)
+             && !vqueueIsEmpty(&pThis->VPCI, pQueue));
+
+    pBlkQueue->fSubmitting = false;
+    if (pBlkQueue->fSyncPending)
+    {
+        pBlkQueue->fSyncPending = false;
+        vqueueSync(&pThis->VPCI, pQueue);
+    }
+    RTCritSectLeave(&pBlkQueue->CritSect);
+}
+
+
+/* -=-=-=-=- Interfaces -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface}
+ */
+static DECLCALLBACK(void *) vblkQueryInterface(struct PDMIBASE *pInterface, const char *pszIID)
+{
+    PVBLKSTATE pThis = RT_FROM_MEMBER(pInterface, VBLKSTATE, VPCI.IBase);
+
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKPORT, &pThis->IPort);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKASYNCPORT, &pThis->IPortAsync);
+    return vpciQueryInterface(pInterface, pszIID);
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKPORT,pfnQueryDeviceLocation}
+ */
+static DECLCALLBACK(int) vblkQueryDeviceLocation(PPDMIBLOCKPORT pInterface, const char **ppcszController,
+                                                 uint32_t *piInstance, uint32_t *piLUN)
+{
+    PVBLKSTATE pThis   = RT_FROM_MEMBER(pInterface, VBLKSTATE, IPort);
+    PPDMDEVINS pDevIns = pThis->VPCI.pDevInsR3;
+
+    AssertPtrReturn(ppcszController, VERR_INVALID_POINTER);
+    AssertPtrReturn(piInstance, VERR_INVALID_POINTER);
+    AssertPtrReturn(piLUN, VERR_INVALID_POINTER);
+
+    *ppcszController = pDevIns->pReg->szName;
+    *piInstance = pDevIns->iInstance;
+    *piLUN = 0;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Queries the interfaces of the attached block driver and sets up the
+ * configuration space from the medium.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The device state structure.
+ */
+static int vblkConfigure(PVBLKSTATE pThis)
+{
+    pThis->pDrvBlock = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCK);
+    if (!pThis->pDrvBlock)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 hasn't a block interface!\n"));
+        return VERR_PDM_MISSING_INTERFACE;
+    }
+
+    PDMBLOCKTYPE enmType = pThis->pDrvBlock->pfnGetType(pThis->pDrvBlock);
+    if (enmType != PDMBLOCKTYPE_HARD_DISK)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 isn't a disk. enmType=%d\n", enmType));
+        return VERR_PDM_UNSUPPORTED_BLOCK_TYPE;
+    }
+
+    pThis->pDrvBlockAsync = NULL;
+    if (pThis->fUseAsyncInterfaceIfAvailable)
+        pThis->pDrvBlockAsync = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCKASYNC);
+
+    uint32_t cbSector = pThis->pDrvBlock->pfnGetSectorSize(pThis->pDrvBlock);
+    if (   cbSector < 512
+        || cbSector > _4K
+        || !RT_IS_POWER_OF_TWO(cbSector))
+        cbSector = 512;
+
+    pThis->fReadOnly = pThis->pDrvBlock->pfnIsReadOnly(pThis->pDrvBlock);
+    if (pThis->pDrvBlockAsync)
+        pThis->fDiscard = pThis->pDrvBlockAsync->pfnStartDiscard != NULL;
+    else
+        pThis->fDiscard = pThis->pDrvBlock->pfnDiscard != NULL;
+
+    pThis->config.u64Capacity                = pThis->pDrvBlock->pfnGetSize(pThis->pDrvBlock) >> VBLK_SECTOR_SHIFT;
+    pThis->config.u32BlkSize                 = cbSector;
+    pThis->config.u8PhysBlockExp             = 0;
+    pThis->config.u16MinIoSize               = (uint16_t)(cbSector >> VBLK_SECTOR_SHIFT);
+    pThis->config.u32MaxDiscardSectors       = UINT32_MAX >> VBLK_SECTOR_SHIFT;
+    pThis->config.u32MaxDiscardSeg           = VBLK_DISCARD_SEGS_MAX;
+    pThis->config.u32DiscardSectorAlignment  = cbSector >> VBLK_SECTOR_SHIFT;
+
+    /* Derive a serial number from the medium if none is configured. */
+    if (!pThis->szSerialNumber[0])
+    {
+        RTUUID Uuid;
+        int rc = pThis->pDrvBlock->pfnGetUuid(pThis->pDrvBlock, &Uuid);
+        if (RT_SUCCESS(rc) && !RTUuidIsNull(&Uuid))
+            RTStrPrintf(pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "VB%08x-%08x",
+                        Uuid.au32[0], Uuid.au32[3]);
+    }
+
+    LogRel(("%s: %RU64 sectors, %u byte blocks, %s I/O, %u queues%s%s\n", INSTANCE(pThis),
+            pThis->config.u64Capacity, cbSector, pThis->pDrvBlockAsync ? "async" : "sync", pThis->cQueues,
+            pThis->fReadOnly ? ", read only" : "", pThis->fDiscard ? ", discard" : ""));
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- Saved state -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNSSMDEVLIVEEXEC}
+ */
+static DECLCALLBACK(int) vblkLiveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    NOREF(uPass);
+
+    SSMR3PutU32(pSSM, pThis->cQueues);
+    SSMR3PutU64(pSSM, pThis->config.u64Capacity);
+    return VINF_SSM_DONT_CALL_AGAIN;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEEXEC}
+ */
+static DECLCALLBACK(int) vblkSaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    /* All requests completed when suspending. */
+    Assert(!pThis->cReqsActive);
+
+    vblkLiveExec(pDevIns, pSSM, SSM_PASS_FINAL);
+
+    /* Save the common part */
+    int rc = vpciSaveExec(&pThis->VPCI, pSSM);
+    AssertRCReturn(rc, rc);
+
+    /* Save device-specific part */
+    SSMR3PutU32(pSSM, VBLK_SAVEDSTATE_VERSION);
+    return SSMR3PutU8(pSSM, pThis->config.u8Writeback);
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADEXEC}
+ */
+static DECLCALLBACK(int) vblkLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    uint32_t   cQueues;
+    uint64_t   cSectors;
+    int        rc;
+
+    if (uVersion != VIRTIO_SAVEDSTATE_VERSION)
+        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+
+    /* config checks */
+    rc = SSMR3GetU32(pSSM, &cQueues);
+    AssertRCReturn(rc, rc);
+    rc = SSMR3GetU64(pSSM, &cSectors);
+    AssertRCReturn(rc, rc);
+    if (cQueues != pThis->cQueues)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - QueueCount: saved=%u config=%u"),
+                                cQueues, pThis->cQueues);
+    if (cSectors != pThis->config.u64Capacity)
+        LogRel(("%s: The medium size differs: config=%RU64 saved=%RU64 sectors\n", INSTANCE(pThis),
+                pThis->config.u64Capacity, cSectors));
+
+    rc = vpciLoadExec(&pThis->VPCI, pSSM, uVersion, uPass, pThis->cQueues);
+    AssertRCReturn(rc, rc);
+
+    if (uPass == SSM_PASS_FINAL)
+    {
+        AssertLogRelMsgReturn(pThis->VPCI.nQueues == pThis->cQueues,
+                              ("%u vs %u\n", pThis->VPCI.nQueues, pThis->cQueues), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+        uint32_t uBlkVersion;
+        rc = SSMR3GetU32(pSSM, &uBlkVersion);
+        AssertRCReturn(rc, rc);
+        if (uBlkVersion != VBLK_SAVEDSTATE_VERSION)
+            return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+        rc = SSMR3GetU8(pSSM, &pThis->config.u8Writeback);
+        AssertRCReturn(rc, rc);
+    }
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- PCI Device -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNPCIIOREGIONMAP}
+ */
+static DECLCALLBACK(int) vblkMap(PPCIDEVICE pPciDev, int iRegion,
+                                 RTGCPHYS GCPhysAddress, uint32_t cb, PCIADDRESSSPACE enmType)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pPciDev->pDevIns, PVBLKSTATE);
+    NOREF(iRegion);
+
+    if (enmType != PCI_ADDRESS_SPACE_IO)
+    {
+        /* We should never get here */
+        AssertMsgFailed(("Invalid PCI address space param in map callback"));
+        return VERR_INTERNAL_ERROR;
+    }
+
+    /* Queue notifications are handled in ring-3 only, so is everything else. */
+    pThis->VPCI.IOPortBase = (RTIOPORT)GCPhysAddress;
+    int rc = PDMDevHlpIOPortRegister(pPciDev->pDevIns, pThis->VPCI.IOPortBase,
+                                     cb, 0, vblkIOPortOut, vblkIOPortIn,
+                                     NULL, NULL, "VirtioBlk");
+    AssertRC(rc);
+    return rc;
+}
+
+
+/* -=-=-=-=- PDMDEVREG -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDetach}
+ */
+static DECLCALLBACK(void) vblkDetach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    Log(("%s vblkDetach:\n", INSTANCE(pThis)));
+    NOREF(fFlags);
+
+    AssertLogRelReturnVoid(iLUN == 0);
+
+    pThis->pDrvBase       = NULL;
+    pThis->pDrvBlock      = NULL;
+    pThis->pDrvBlockAsync = NULL;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnAttach}
+ */
+static DECLCALLBACK(int) vblkAttach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    Log(("%s vblkAttach:\n", INSTANCE(pThis)));
+    NOREF(fFlags);
+
+    AssertLogRelReturn(iLUN == 0, VERR_PDM_LUN_NOT_FOUND);
+    AssertRelease(!pThis->pDrvBase);
+
+    int rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->VPCI.IBase, &pThis->pDrvBase, NULL);
+    if (RT_SUCCESS(rc))
+        rc = vblkConfigure(pThis);
+    else
+        AssertMsgFailed(("Failed to attach LUN#0. rc=%Rrc\n", rc));
+
+    if (RT_FAILURE(rc))
+    {
+        pThis->pDrvBase       = NULL;
+        pThis->pDrvBlock      = NULL;
+        pThis->pDrvBlockAsync = NULL;
+    }
+    return rc;
+}
+
+/**
+ * Callback employed by vblkSuspend and vblkPowerOff.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) vblkIsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    return true;
+}
+
+/**
+ * Common worker for vblkSuspend and vblkPowerOff.
+ */
+static void vblkSuspendOrPowerOff(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        PDMDevHlpSetAsyncNotification(pDevIns, vblkIsAsyncSuspendOrPowerOffDone);
+    else
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnSuspend}
+ */
+static DECLCALLBACK(void) vblkSuspend(PPDMDEVINS pDevIns)
+{
+    vblkSuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnPowerOff}
+ */
+static DECLCALLBACK(void) vblkPowerOff(PPDMDEVINS pDevIns)
+{
+    vblkSuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * Callback employed by vblkReset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) vblkIsAsyncResetDone(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+
+    vblkIoCb_Reset(pThis);
+    return true;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnReset}
+ */
+static DECLCALLBACK(void) vblkReset(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (ASMAtomicReadU32(&pThis->cReqsActive))
+        PDMDevHlpSetAsyncNotification(pDevIns, vblkIsAsyncResetDone);
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        vblkIoCb_Reset(pThis);
+    }
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDestruct}
+ */
+static DECLCALLBACK(int) vblkDestruct(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
+
+    Log(("%s Destroying instance\n", INSTANCE(pThis)));
+    for (uint32_t i = 0; i < RT_ELEMENTS(pThis->aQueues); i++)
+    {
+        if (RTCritSectIsInitialized(&pThis->aQueues[i].CritSect))
+            RTCritSectDelete(&pThis->aQueues[i].CritSect);
+        if (pThis->aQueues[i].pElem)
+        {
+            RTMemFree(pThis->aQueues[i].pElem);
+            pThis->aQueues[i].pElem = NULL;
+        }
+    }
+
+    return vpciDestruct(&pThis->VPCI);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnConstruct}
+ */
+static DECLCALLBACK(int) vblkConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    uint32_t   cCpus;
+    int        rc;
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+
+    /*
+     * Validate configuration.
+     */
+    if (!CFGMR3AreValuesValid(pCfg, "QueueCount\0" "NumCPUs\0" "UseAsyncInterfaceIfAvailable\0" "SerialNumber\0"))
+        return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
+                                N_("Invalid configuration for VirtioBlk device"));
+
+    rc = CFGMR3QueryU32Def(pCfg, "NumCPUs", &cCpus, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'NumCPUs'"));
+
+    /* One request queue per vCPU by default. */
+    rc = CFGMR3QueryU32Def(pCfg, "QueueCount", &pThis->cQueues, RT_MIN(RT_MAX(cCpus, 1), VIRTIO_MAX_NQUEUES));
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'QueueCount'"));
+    if (   pThis->cQueues < 1
+        || pThis->cQueues > VIRTIO_MAX_NQUEUES)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: 'QueueCount'=%u should be between 1 and %u"),
+                                   pThis->cQueues, VIRTIO_MAX_NQUEUES);
+
+    rc = CFGMR3QueryBoolDef(pCfg, "UseAsyncInterfaceIfAvailable", &pThis->fUseAsyncInterfaceIfAvailable, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'UseAsyncInterfaceIfAvailable'"));
+
+    rc = CFGMR3QueryStringDef(pCfg, "SerialNumber", pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "");
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("Configuration error: 'SerialNumber' is longer than 20 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'SerialNumber'"));
+    }
+
+    /* Do our own locking. */
+    rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
+    AssertRCReturn(rc, rc);
+
+    /* Initialize PCI part. */
+    pThis->VPCI.IBase.pfnQueryInterface = vblkQueryInterface;
+    rc = vpciConstruct(pDevIns, &pThis->VPCI, iInstance,
+                       VBLK_NAME_FMT, VBLK_PCI_SUBSYSTEM_ID,
+                       VBLK_PCI_CLASS, pThis->cQueues);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    Log(("%s Constructing new instance\n", INSTANCE(pThis)));
+
+    for (uint32_t i = 0; i < pThis->cQueues; i++)
+    {
+        PVBLKQUEUE pBlkQueue = &pThis->aQueues[i];
+
+        rc = RTCritSectInit(&pBlkQueue->CritSect);
+        if (RT_FAILURE(rc))
+            return rc;
+        pBlkQueue->pElem = (PVQUEUEELEM)RTMemAllocZ(sizeof(VQUEUEELEM));
+        if (!pBlkQueue->pElem)
+            return VERR_NO_MEMORY;
+        pBlkQueue->pQueue = vpciAddQueue(&pThis->VPCI, VBLK_QUEUE_SIZE, vblkQueueNotify, "REQ");
+        AssertReturn(pBlkQueue->pQueue, VERR_INTERNAL_ERROR_2);
+    }
+
+    /* Initialize PCI config space */
+    pThis->config.u32SegMax    = VBLK_SEG_MAX;
+    pThis->config.u16NumQueues = (uint16_t)pThis->cQueues;
+    pThis->config.u8Writeback  = 1;
+
+    /* Interfaces */
+    pThis->IPort.pfnQueryDeviceLocation        = vblkQueryDeviceLocation;
+    pThis->IPortAsync.pfnTransferCompleteNotify = vblkTransferCompleteNotify;
+
+    /* Map our ports to IO space. */
+    rc = PDMDevHlpPCIIORegionRegister(pDevIns, 0,
+                                      VPCI_CONFIG + sizeof(struct VBlkPCIConfig),
+                                      PCI_ADDRESS_SPACE_IO, vblkMap);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* Register save/restore state handlers. */
+    rc = PDMDevHlpSSMRegister3(pDevIns, VIRTIO_SAVEDSTATE_VERSION, sizeof(VBLKSTATE),
+                               vblkLiveExec, vblkSaveExec, vblkLoadExec);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->VPCI.IBase, &pThis->pDrvBase, "Disk Port");
+    if (RT_SUCCESS(rc))
+    {
+        rc = vblkConfigure(pThis);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    else if (   rc == VERR_PDM_NO_ATTACHED_DRIVER
+             || rc == VERR_PDM_CFG_MISSING_DRIVER_NAME)
+    {
+        /* No error! */
+        pThis->pDrvBase = NULL;
+        Log(("%s This device is not attached to any medium!\n", INSTANCE(pThis)));
+    }
+    else
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to attach the disk LUN"));
+
+    if (!pThis->szSerialNumber[0])
+        RTStrPrintf(pThis->szSerialNumber, sizeof(pThis->szSerialNumber), "VBLK%u", iInstance);
+
+    rc = vblkIoCb_Reset(pThis);
+    AssertRC(rc);
+
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReads,        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of read requests",            "/Devices/VBlk%d/Reads", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatWrites,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of write requests",           "/Devices/VBlk%d/Writes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatFlushes,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of flush requests",           "/Devices/VBlk%d/Flushes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDiscards,     STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of discard requests",         "/Devices/VBlk%d/Discards", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesRead,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,          "Amount of data read",                "/Devices/VBlk%d/ReadBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesWritten, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,          "Amount of data written",             "/Devices/VBlk%d/WrittenBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatErrors,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of failed requests",          "/Devices/VBlk%d/Errors", iInstance);
+    for (uint32_t i = 0; i < pThis->cQueues; i++)
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aQueues[i].StatRequests, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES, "Number of requests fetched from the queue", "/Devices/VBlk%d/Queue%u/Requests", iInstance, i);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * The device registration structure.
+ */
+const PDMDEVREG g_DeviceVirtioBlk =
+{
+    /* Structure version. PDM_DEVREG_VERSION defines the current version. */
+    PDM_DEVREG_VERSION,
+    /* Device name. */
+    "virtio-blk",
+    /* Name of guest context module (no path).
+     * Only evalutated if PDM_DEVREG_FLAGS_RC is set. */
+    "",
+    /* Name of ring-0 module (no path).
+     * Only evalutated if PDM_DEVREG_FLAGS_RC is set. */
+    "",
+    /* The description of the device. The UTF-8 string pointed to shall, like this structure,
+     * remain unchanged from registration till VM destruction. */
+    "Virtio Block Device.\n",
+
+    /* Flags, combination of the PDM_DEVREG_FLAGS_* \#defines. */
+    PDM_DEVREG_FLAGS_DEFAULT_BITS |
+    PDM_DEVREG_FLAGS_FIRST_SUSPEND_NOTIFICATION | PDM_DEVREG_FLAGS_FIRST_POWEROFF_NOTIFICATION |
+    PDM_DEVREG_FLAGS_FIRST_RESET_NOTIFICATION,
+    /* Device class(es), combination of the PDM_DEVREG_CLASS_* \#defines. */
+    PDM_DEVREG_CLASS_STORAGE,
+    /* Maximum number of instances (per VM). */
+    ~0U,
+    /* Size of the instance data. */
+    sizeof(VBLKSTATE),
+
+    /* pfnConstruct */
+    vblkConstruct,
+    /* pfnDestruct */
+    vblkDestruct,
+    /* pfnRelocate */
+    NULL,
+    /* pfnMemSetup. */
+    NULL,
+    /* pfnPowerOn */
+    NULL,
+    /* pfnReset */
+    vblkReset,
+    /* pfnSuspend */
+    vblkSuspend,
+    /* pfnResume */
+    NULL,
+    /* pfnAttach */
+    vblkAttach,
+    /* pfnDetach */
+    vblkDetach,
+    /* pfnQueryInterface */
+    NULL,
+    /* pfnInitComplete */
+    NULL,
+    /* pfnPowerOff */
+    vblkPowerOff,
+    /* pfnSoftReset */
+    NULL,
+
+    /* u32VersionEnd */
+    PDM_DEVREG_VERSION
+};
+
+#endif /* IN_RING3 */
+#endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
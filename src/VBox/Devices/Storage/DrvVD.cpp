@@ -37,6 +37,10 @@
 #include <iprt/pipe.h>
 #include <iprt/system.h>
 #include <iprt/memsafer.h>
+#include <iprt/stream.h>
+#include <iprt/critsect.h>
+#include <iprt/thread.h>
+#include <iprt/time.h>
 
 #ifdef VBOX_WITH_INIP
 /* All lwip header files are not C++ safe. So hack around this. */
@@ -73,6 +77,11 @@ extern bool DevINIPConfigured(void);
 #define PDMIMEDIAASYNC_2_VBOXDISK(pInterface) \
     ( (PVBOXDISK)((uintptr_t)pInterface - RT_OFFSETOF(VBOXDISK, IMediaAsync)) )
 
+/** Maximum number of sequential streams the read-ahead engine can track. */
+#define DRVVD_RA_STREAMS_MAX        16
+/** Number of back to back sequential reads before a stream starts prefetching. */
+#define DRVVD_RA_SEQ_THRESHOLD      2
+
 /**
  * VBox disk container, image information, private part.
  */
@@ -110,6 +119,58 @@ typedef struct DRVVDSTORAGEBACKEND
     PFNVDCOMPLETED              pfnCompleted;
 } DRVVDSTORAGEBACKEND, *PDRVVDSTORAGEBACKEND;
 
+/** Pointer to the VBox disk container. */
+typedef struct VBOXDISK *PVBOXDISK;
+
+/**
+ * Read-ahead buffer of a sequential stream.
+ */
+typedef struct DRVVDRABUF
+{
+    /** Disk offset of the buffered data. */
+    uint64_t                    off;
+    /** Number of valid bytes in the buffer, 0 if empty. */
+    size_t                      cbValid;
+    /** Number of bytes the guest read from the buffer, for the hit ratio. */
+    size_t                      cbUsed;
+    /** Flag whether a prefetch into this buffer is in progress. */
+    bool                        fBusy;
+    /** The buffer, VBOXDISK::cbRaWindowMax in size. */
+    uint8_t                    *pbBuf;
+} DRVVDRABUF, *PDRVVDRABUF;
+
+/**
+ * Sequential read stream tracked by the read-ahead engine.
+ *
+ * A stream keeps two buffers, the guest consumes one while the other one
+ * is prefetched.
+ */
+typedef struct DRVVDRASTREAM
+{
+    /** Disk offset the next sequential read of the stream is expected at. */
+    uint64_t                    offNext;
+    /** Last use for LRU replacement. */
+    uint64_t                    uLastUse;
+    /** Number of back to back sequential reads, 0 if the slot is unused. */
+    uint32_t                    cSeqReads;
+    /** Current prefetch window. */
+    size_t                      cbWindow;
+    /** Generation, incremented when a write invalidates a prefetch in progress. */
+    uint32_t                    uGen;
+    /** Generation the active prefetch was started with. */
+    uint32_t                    uGenPrefetch;
+    /** Buffer the active prefetch reads into. */
+    unsigned                    idxBufPrefetch;
+    /** Number of bytes the active prefetch reads. */
+    size_t                      cbPrefetch;
+    /** S/G segment for the prefetch. */
+    RTSGSEG                     Seg;
+    /** S/G buffer for the prefetch. */
+    RTSGBUF                     SgBuf;
+    /** The buffers. */
+    DRVVDRABUF                  aBufs[2];
+} DRVVDRASTREAM, *PDRVVDRASTREAM;
+
 /**
  * VBox disk container media main structure, private part.
  *
@@ -205,7 +266,45 @@ typedef struct VBOXDISK
     /** The secret key helper interface used to notify about missing keys. */
     PPDMISECKEYHLP           pIfSecKeyHlp;
     /** @} */
-} VBOXDISK, *PVBOXDISK;
+
+    /** Read-ahead engine
+     * @{ */
+    /** Flag whether read-ahead is enabled. */
+    bool                     fReadAhead;
+    /** Number of streams tracked. */
+    unsigned                 cRaStreams;
+    /** Smallest prefetch window. */
+    size_t                   cbRaWindowMin;
+    /** Largest prefetch window, also the size of the stream buffers. */
+    size_t                   cbRaWindowMax;
+    /** Protects the stream state. */
+    RTCRITSECT               CritSectRa;
+    /** Use counter for the LRU replacement of streams. */
+    uint64_t                 uRaUseCounter;
+    /** Number of prefetches in progress. */
+    volatile uint32_t        cRaPrefetchesActive;
+    /** Number of guest writes in progress, prefetching is held off while non zero. */
+    volatile uint32_t        cRaWritesActive;
+    /** The stream slots. */
+    PDRVVDRASTREAM           paRaStreams;
+    /** Reads served from prefetched data. */
+    STAMCOUNTER              StatRaHits;
+    /** Sequential reads which weren't prefetched. */
+    STAMCOUNTER              StatRaMisses;
+    /** Number of prefetches started. */
+    STAMCOUNTER              StatRaPrefetches;
+    /** Number of bytes prefetched. */
+    STAMCOUNTER              StatRaBytesPrefetched;
+    /** Number of prefetched bytes the guest read. */
+    STAMCOUNTER              StatRaBytesUsed;
+    /** Number of new streams detected. */
+    STAMCOUNTER              StatRaStreams;
+    /** Number of times a stream window was increased. */
+    STAMCOUNTER              StatRaWindowGrow;
+    /** Number of times a stream window was decreased. */
+    STAMCOUNTER              StatRaWindowShrink;
+    /** @} */
+} VBOXDISK;
 
 
 /*********************************************************************************************************************************
@@ -1629,6 +1728,451 @@ static int drvvdKeyCheckPrereqs(PVBOXDISK pThis)
 }
 
 
+/*********************************************************************************************************************************
+*   Read-ahead engine                                                                                                            *
+*********************************************************************************************************************************/
+
+/**
+ * Retires a read-ahead buffer and adapts the window of the stream to the amount
+ * of prefetched data the guest actually read from it.
+ *
+ * @returns nothing.
+ * @param   pThis      The disk instance.
+ * @param   pStream    The stream the buffer belongs to.
+ * @param   pBuf       The buffer to retire.
+ */
+static void drvvdRaBufRetire(PVBOXDISK pThis, PDRVVDRASTREAM pStream, PDRVVDRABUF pBuf)
+{
+    Assert(!pBuf->fBusy);
+
+    if (pBuf->cbValid)
+    {
+        if (pBuf->cbUsed >= pBuf->cbValid)
+        {
+            /* Everything was used, the guest reads faster than we prefetch. */
+            if (pStream->cbWindow < pThis->cbRaWindowMax)
+            {
+                pStream->cbWindow = RT_MIN(pStream->cbWindow * 2, pThis->cbRaWindowMax);
+                STAM_REL_COUNTER_INC(&pThis->StatRaWindowGrow);
+            }
+        }
+        else if (pBuf->cbUsed < pBuf->cbValid / 2)
+        {
+            /* Most of the data was wasted. */
+            if (pStream->cbWindow > pThis->cbRaWindowMin)
+            {
+                pStream->cbWindow = RT_MAX(pStream->cbWindow / 2, pThis->cbRaWindowMin);
+                STAM_REL_COUNTER_INC(&pThis->StatRaWindowShrink);
+            }
+        }
+    }
+
+    pBuf->cbValid = 0;
+    pBuf->cbUsed  = 0;
+}
+
+/**
+ * Returns the stream the given read belongs to, creating a new one if the read
+ * doesn't continue any known stream.
+ *
+ * @returns Pointer to the stream or NULL if no slot is available.
+ * @param   pThis      The disk instance.
+ * @param   off        Start offset of the read.
+ * @param   pfNew      Where to store whether a new stream was created.
+ */
+static PDRVVDRASTREAM drvvdRaStreamGet(PVBOXDISK pThis, uint64_t off, bool *pfNew)
+{
+    PDRVVDRASTREAM pLru = NULL;
+
+    *pfNew = false;
+    for (unsigned i = 0; i < pThis->cRaStreams; i++)
+    {
+        PDRVVDRASTREAM pStream = &pThis->paRaStreams[i];
+
+        if (pStream->cSeqReads)
+        {
+            if (pStream->offNext == off)
+                return pStream;
+
+            for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+            {
+                PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+                if (   !pBuf->fBusy
+                    && off >= pBuf->off
+                    && off - pBuf->off < pBuf->cbValid)
+                    return pStream;
+            }
+        }
+
+        /* Streams with a prefetch in progress can't be recycled. */
+        if (   !pStream->aBufs[0].fBusy
+            && !pStream->aBufs[1].fBusy
+            && (   !pLru
+                || pStream->uLastUse < pLru->uLastUse))
+            pLru = pStream;
+    }
+
+    if (pLru)
+    {
+        for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pLru->aBufs); iBuf++)
+            drvvdRaBufRetire(pThis, pLru, &pLru->aBufs[iBuf]);
+        pLru->offNext   = off;
+        pLru->cSeqReads = 0;
+        pLru->cbWindow  = pThis->cbRaWindowMin;
+        *pfNew = true;
+        STAM_REL_COUNTER_INC(&pThis->StatRaStreams);
+    }
+
+    return pLru;
+}
+
+/**
+ * Tries to serve a read from the read-ahead buffers and updates the stream
+ * state. The caller must own VBOXDISK::CritSectRa.
+ *
+ * @returns true if the read was served from a read-ahead buffer, false otherwise.
+ * @param   pThis      The disk instance.
+ * @param   off        Start offset of the read.
+ * @param   cbRead     Size of the read.
+ * @param   pSgBuf     Where to copy the data to on a hit.
+ * @param   ppStream   Where to store the stream to prefetch for, NULL if the read
+ *                     is not part of a sequential stream (yet).
+ */
+static bool drvvdRaRead(PVBOXDISK pThis, uint64_t off, size_t cbRead, PRTSGBUF pSgBuf,
+                        PDRVVDRASTREAM *ppStream)
+{
+    bool fNew = false;
+    bool fHit = false;
+
+    *ppStream = NULL;
+
+    PDRVVDRASTREAM pStream = drvvdRaStreamGet(pThis, off, &fNew);
+    if (!pStream)
+        return false;
+
+    pStream->uLastUse = ++pThis->uRaUseCounter;
+
+    for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs) && !fHit; iBuf++)
+    {
+        PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+        if (   !pBuf->fBusy
+            && off >= pBuf->off
+            && off - pBuf->off < pBuf->cbValid
+            && cbRead <= pBuf->cbValid - (off - pBuf->off))
+        {
+            RTSgBufCopyFromBuf(pSgBuf, pBuf->pbBuf + (off - pBuf->off), cbRead);
+            pBuf->cbUsed += cbRead;
+            fHit = true;
+        }
+    }
+
+    if (fHit)
+    {
+        STAM_REL_COUNTER_INC(&pThis->StatRaHits);
+        STAM_REL_COUNTER_ADD(&pThis->StatRaBytesUsed, cbRead);
+    }
+    else if (pStream->cSeqReads >= DRVVD_RA_SEQ_THRESHOLD)
+        STAM_REL_COUNTER_INC(&pThis->StatRaMisses);
+
+    pStream->offNext = off + cbRead;
+    if (pStream->cSeqReads < UINT32_MAX)
+        pStream->cSeqReads++;
+
+    /* Retire buffers the stream has moved past. */
+    for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+    {
+        PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+        if (   !pBuf->fBusy
+            && pBuf->cbValid
+            && pBuf->off + pBuf->cbValid <= pStream->offNext)
+            drvvdRaBufRetire(pThis, pStream, pBuf);
+    }
+
+    if (pStream->cSeqReads >= DRVVD_RA_SEQ_THRESHOLD)
+        *ppStream = pStream;
+
+    return fHit;
+}
+
+/**
+ * Determines whether the given stream needs more data prefetched and where.
+ *
+ * @returns Index of the buffer to prefetch into or UINT32_MAX if there is nothing to do.
+ * @param   pThis      The disk instance.
+ * @param   pStream    The stream.
+ * @param   poff       Where to store the start offset of the prefetch.
+ * @param   pcb        Where to store the size of the prefetch.
+ */
+static unsigned drvvdRaPrefetchPrepare(PVBOXDISK pThis, PDRVVDRASTREAM pStream, uint64_t *poff, size_t *pcb)
+{
+    unsigned idxBuf = UINT32_MAX;
+
+    if (   pStream->aBufs[0].fBusy
+        || pStream->aBufs[1].fBusy)
+        return UINT32_MAX;
+
+    /* Find the end of the data already buffered ahead of the stream. */
+    uint64_t offAhead = pStream->offNext;
+    for (unsigned iPass = 0; iPass < RT_ELEMENTS(pStream->aBufs); iPass++)
+        for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+        {
+            PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+            if (   pBuf->cbValid
+                && pBuf->off <= offAhead
+                && pBuf->off + pBuf->cbValid > offAhead)
+                offAhead = pBuf->off + pBuf->cbValid;
+        }
+
+    if (   offAhead - pStream->offNext >= pStream->cbWindow / 2
+        || offAhead >= pThis->cbDisk)
+        return UINT32_MAX;
+
+    /* Use a buffer not holding data ahead of the stream. */
+    for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+    {
+        PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+        if (   !pBuf->cbValid
+            || pBuf->off >= offAhead
+            || pBuf->off + pBuf->cbValid <= pStream->offNext)
+        {
+            idxBuf = iBuf;
+            break;
+        }
+    }
+
+    if (idxBuf != UINT32_MAX)
+    {
+        drvvdRaBufRetire(pThis, pStream, &pStream->aBufs[idxBuf]);
+        *poff = offAhead;
+        *pcb  = (size_t)RT_MIN(pStream->cbWindow, pThis->cbDisk - offAhead);
+    }
+
+    return idxBuf;
+}
+
+/**
+ * Completion callback for a prefetch.
+ *
+ * @returns nothing.
+ * @param   pvUser1    The disk instance.
+ * @param   pvUser2    The stream the prefetch was started for.
+ * @param   rcReq      Status code of the prefetch.
+ */
+static void drvvdRaPrefetchComplete(void *pvUser1, void *pvUser2, int rcReq)
+{
+    PVBOXDISK pThis = (PVBOXDISK)pvUser1;
+    PDRVVDRASTREAM pStream = (PDRVVDRASTREAM)pvUser2;
+
+    RTCritSectEnter(&pThis->CritSectRa);
+    PDRVVDRABUF pBuf = &pStream->aBufs[pStream->idxBufPrefetch];
+    Assert(pBuf->fBusy);
+
+    pBuf->fBusy   = false;
+    pBuf->cbUsed  = 0;
+    /* Drop the data if a write touched the range in the meantime. */
+    if (   RT_SUCCESS(rcReq)
+        && pStream->uGen == pStream->uGenPrefetch)
+        pBuf->cbValid = pStream->cbPrefetch;
+    else
+        pBuf->cbValid = 0;
+    RTCritSectLeave(&pThis->CritSectRa);
+
+    ASMAtomicDecU32(&pThis->cRaPrefetchesActive);
+}
+
+/**
+ * Starts an asynchronous prefetch for the given stream if required.
+ * The caller must own VBOXDISK::CritSectRa.
+ *
+ * @returns nothing.
+ * @param   pThis      The disk instance.
+ * @param   pStream    The stream.
+ */
+static void drvvdRaPrefetchStart(PVBOXDISK pThis, PDRVVDRASTREAM pStream)
+{
+    uint64_t off = 0;
+    size_t cb = 0;
+
+    /* Hold off while guest writes are in flight, they are not ordered against the prefetch. */
+    if (ASMAtomicReadU32(&pThis->cRaWritesActive))
+        return;
+
+    unsigned idxBuf = drvvdRaPrefetchPrepare(pThis, pStream, &off, &cb);
+    if (idxBuf == UINT32_MAX)
+        return;
+
+    PDRVVDRABUF pBuf = &pStream->aBufs[idxBuf];
+    pBuf->fBusy             = true;
+    pBuf->off               = off;
+    pStream->idxBufPrefetch = idxBuf;
+    pStream->cbPrefetch     = cb;
+    pStream->uGenPrefetch   = pStream->uGen;
+    pStream->Seg.pvSeg      = pBuf->pbBuf;
+    pStream->Seg.cbSeg      = cb;
+    RTSgBufInit(&pStream->SgBuf, &pStream->Seg, 1);
+
+    ASMAtomicIncU32(&pThis->cRaPrefetchesActive);
+    STAM_REL_COUNTER_INC(&pThis->StatRaPrefetches);
+    STAM_REL_COUNTER_ADD(&pThis->StatRaBytesPrefetched, cb);
+
+    int rc;
+    if (!pThis->pBlkCache)
+        rc = VDAsyncRead(pThis->pDisk, off, cb, &pStream->SgBuf,
+                         drvvdRaPrefetchComplete, pThis, pStream);
+    else
+    {
+        /* Go through the block cache so dirty data cached there is picked up. */
+        rc = PDMR3BlkCacheRead(pThis->pBlkCache, off, &pStream->SgBuf, cb, pStream);
+        if (rc == VINF_AIO_TASK_PENDING)
+            rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+        else if (rc == VINF_SUCCESS)
+            rc = VINF_VD_ASYNC_IO_FINISHED;
+    }
+
+    if (rc == VINF_VD_ASYNC_IO_FINISHED)
+        drvvdRaPrefetchComplete(pThis, pStream, VINF_SUCCESS);
+    else if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        drvvdRaPrefetchComplete(pThis, pStream, rc);
+}
+
+/**
+ * Fills a read-ahead buffer synchronously for a read which missed, used by the
+ * synchronous media interface. The caller must own VBOXDISK::CritSectRa.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_NOT_FOUND if the read can't be served from a read-ahead buffer.
+ * @param   pThis      The disk instance.
+ * @param   pStream    The stream the read belongs to.
+ * @param   off        Start offset of the read.
+ * @param   pvBuf      Where to store the read data.
+ * @param   cbRead     Size of the read.
+ */
+static int drvvdRaReadSync(PVBOXDISK pThis, PDRVVDRASTREAM pStream, uint64_t off, void *pvBuf, size_t cbRead)
+{
+    if (   cbRead >= pStream->cbWindow
+        || off >= pThis->cbDisk)
+        return VERR_NOT_FOUND;
+
+    size_t cbFill = (size_t)RT_MIN(pStream->cbWindow, pThis->cbDisk - off);
+    if (cbFill < cbRead)
+        return VERR_NOT_FOUND;
+
+    /* Take the least useful buffer, the other one might still hold data of the stream. */
+    PDRVVDRABUF pBuf = &pStream->aBufs[0];
+    if (pStream->aBufs[1].off + pStream->aBufs[1].cbValid <= pBuf->off + pBuf->cbValid)
+        pBuf = &pStream->aBufs[1];
+    drvvdRaBufRetire(pThis, pStream, pBuf);
+
+    STAM_REL_COUNTER_INC(&pThis->StatRaPrefetches);
+    STAM_REL_COUNTER_ADD(&pThis->StatRaBytesPrefetched, cbFill);
+
+    int rc = VDRead(pThis->pDisk, off, pBuf->pbBuf, cbFill);
+    if (RT_SUCCESS(rc))
+    {
+        pBuf->off     = off;
+        pBuf->cbValid = cbFill;
+        pBuf->cbUsed  = cbRead;
+        memcpy(pvBuf, pBuf->pbBuf, cbRead);
+    }
+
+    return rc;
+}
+
+/**
+ * Invalidates prefetched data overlapping the given range, called before
+ * the range is written or discarded.
+ *
+ * @returns nothing.
+ * @param   pThis      The disk instance.
+ * @param   off        Start offset of the range.
+ * @param   cb         Size of the range.
+ */
+static void drvvdRaInvalidate(PVBOXDISK pThis, uint64_t off, uint64_t cb)
+{
+    if (!pThis->fReadAhead)
+        return;
+
+    RTCritSectEnter(&pThis->CritSectRa);
+    for (unsigned i = 0; i < pThis->cRaStreams; i++)
+    {
+        PDRVVDRASTREAM pStream = &pThis->paRaStreams[i];
+
+        for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+        {
+            PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+            size_t cbBuf = pBuf->fBusy ? pStream->cbPrefetch : pBuf->cbValid;
+
+            if (   cbBuf
+                && off < pBuf->off + cbBuf
+                && pBuf->off < off + cb)
+            {
+                if (pBuf->fBusy)
+                    pStream->uGen++;
+                else
+                {
+                    pBuf->cbValid = 0;
+                    pBuf->cbUsed  = 0;
+                }
+            }
+        }
+    }
+    RTCritSectLeave(&pThis->CritSectRa);
+}
+
+/**
+ * Drops all prefetched data and forgets about all streams.
+ *
+ * @returns nothing.
+ * @param   pThis      The disk instance.
+ */
+static void drvvdRaReset(PVBOXDISK pThis)
+{
+    if (!pThis->fReadAhead)
+        return;
+
+    RTCritSectEnter(&pThis->CritSectRa);
+    for (unsigned i = 0; i < pThis->cRaStreams; i++)
+    {
+        PDRVVDRASTREAM pStream = &pThis->paRaStreams[i];
+
+        for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+        {
+            PDRVVDRABUF pBuf = &pStream->aBufs[iBuf];
+            if (pBuf->fBusy)
+                pStream->uGen++;
+            else
+            {
+                pBuf->cbValid = 0;
+                pBuf->cbUsed  = 0;
+            }
+        }
+        pStream->cSeqReads = 0;
+        pStream->cbWindow  = pThis->cbRaWindowMin;
+    }
+    RTCritSectLeave(&pThis->CritSectRa);
+}
+
+/**
+ * Waits for all prefetches in progress to complete.
+ *
+ * @returns nothing.
+ * @param   pThis      The disk instance.
+ */
+static void drvvdRaQuiesce(PVBOXDISK pThis)
+{
+    if (!pThis->fReadAhead)
+        return;
+
+    uint64_t tsStart = RTTimeMilliTS();
+    while (   ASMAtomicReadU32(&pThis->cRaPrefetchesActive)
+           && RTTimeMilliTS() - tsStart < 30 * RT_MS_1SEC)
+        RTThreadSleep(1);
+
+    if (ASMAtomicReadU32(&pThis->cRaPrefetchesActive))
+        LogRel(("VD: %u read-ahead requests didn't complete in time\n",
+                ASMAtomicReadU32(&pThis->cRaPrefetchesActive)));
+}
+
 /*********************************************************************************************************************************
 *   Media interface methods                                                                                                      *
 *********************************************************************************************************************************/
@@ -1646,7 +2190,30 @@ static DECLCALLBACK(int) drvvdRead(PPDMIMEDIA pInterface,
     if (RT_FAILURE(rc))
         return rc;
 
-    if (!pThis->fBootAccelActive)
+    if (   pThis->fReadAhead
+        && !pThis->fBootAccelActive)
+    {
+        RTSGSEG Seg;
+        RTSGBUF SgBuf;
+        PDRVVDRASTREAM pStream = NULL;
+
+        Seg.pvSeg = pvBuf;
+        Seg.cbSeg = cbRead;
+        RTSgBufInit(&SgBuf, &Seg, 1);
+
+        RTCritSectEnter(&pThis->CritSectRa);
+        if (!drvvdRaRead(pThis, off, cbRead, &SgBuf, &pStream))
+        {
+            rc = VERR_NOT_FOUND;
+            if (pStream)
+                rc = drvvdRaReadSync(pThis, pStream, off, pvBuf, cbRead);
+        }
+        RTCritSectLeave(&pThis->CritSectRa);
+
+        if (rc == VERR_NOT_FOUND)
+            rc = VDRead(pThis->pDisk, off, pvBuf, cbRead);
+    }
+    else if (!pThis->fBootAccelActive)
         rc = VDRead(pThis->pDisk, off, pvBuf, cbRead);
     else
     {
@@ -1763,7 +2330,13 @@ static DECLCALLBACK(int) drvvdWrite(PPDMIMEDIA pInterface,
         pThis->offDisk     = 0;
     }
 
+    /* Count the write before invalidating, a prefetch started in between would read stale data. */
+    if (pThis->fReadAhead)
+        ASMAtomicIncU32(&pThis->cRaWritesActive);
+    drvvdRaInvalidate(pThis, off, cbWrite);
     rc = VDWrite(pThis->pDisk, off, pvBuf, cbWrite);
+    if (pThis->fReadAhead)
+        ASMAtomicDecU32(&pThis->cRaWritesActive);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1991,7 +2564,14 @@ static DECLCALLBACK(int) drvvdDiscard(PPDMIMEDIA pInterface, PCRTRANGE paRanges,
     LogFlowFunc(("\n"));
     PVBOXDISK pThis = PDMIMEDIA_2_VBOXDISK(pInterface);
 
+    if (pThis->fReadAhead)
+        ASMAtomicIncU32(&pThis->cRaWritesActive);
+    for (unsigned i = 0; i < cRanges; i++)
+        drvvdRaInvalidate(pThis, paRanges[i].offStart, paRanges[i].cbRange);
+
     int rc = VDDiscardRanges(pThis->pDisk, paRanges, cRanges);
+    if (pThis->fReadAhead)
+        ASMAtomicDecU32(&pThis->cRaWritesActive);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -2061,6 +2641,22 @@ static void drvvdAsyncReqComplete(void *pvUser1, void *pvUser2, int rcReq)
         PDMR3BlkCacheIoXferComplete(pThis->pBlkCache, (PPDMBLKCACHEIOXFER)pvUser2, rcReq);
 }
 
+/**
+ * Completion callback for guest writes and discards issued while read-ahead is enabled.
+ *
+ * @returns nothing.
+ * @param   pvUser1    The disk instance.
+ * @param   pvUser2    Opaque user data of the guest request.
+ * @param   rcReq      Status code of the request.
+ */
+static void drvvdRaAsyncWriteReqComplete(void *pvUser1, void *pvUser2, int rcReq)
+{
+    PVBOXDISK pThis = (PVBOXDISK)pvUser1;
+
+    ASMAtomicDecU32(&pThis->cRaWritesActive);
+    drvvdAsyncReqComplete(pvUser1, pvUser2, rcReq);
+}
+
 static DECLCALLBACK(int) drvvdStartRead(PPDMIMEDIAASYNC pInterface, uint64_t uOffset,
                                         PCRTSGSEG paSeg, unsigned cSeg,
                                         size_t cbRead, void *pvUser)
@@ -2078,7 +2674,19 @@ static DECLCALLBACK(int) drvvdStartRead(PPDMIMEDIAASYNC pInterface, uint64_t uOf
 
     RTSGBUF SgBuf;
     RTSgBufInit(&SgBuf, paSeg, cSeg);
-    if (!pThis->pBlkCache)
+
+    PDRVVDRASTREAM pStream = NULL;
+    bool fHit = false;
+    if (pThis->fReadAhead)
+    {
+        RTCritSectEnter(&pThis->CritSectRa);
+        fHit = drvvdRaRead(pThis, uOffset, cbRead, &SgBuf, &pStream);
+        RTCritSectLeave(&pThis->CritSectRa);
+    }
+
+    if (fHit)
+        rc = VINF_VD_ASYNC_IO_FINISHED;
+    else if (!pThis->pBlkCache)
         rc = VDAsyncRead(pThis->pDisk, uOffset, cbRead, &SgBuf,
                          drvvdAsyncReqComplete, pThis, pvUser);
     else
@@ -2090,6 +2698,14 @@ static DECLCALLBACK(int) drvvdStartRead(PPDMIMEDIAASYNC pInterface, uint64_t uOf
             rc = VINF_VD_ASYNC_IO_FINISHED;
     }
 
+    /* Keep the stream ahead of the guest. */
+    if (pStream)
+    {
+        RTCritSectEnter(&pThis->CritSectRa);
+        drvvdRaPrefetchStart(pThis, pStream);
+        RTCritSectLeave(&pThis->CritSectRa);
+    }
+
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -2112,9 +2728,25 @@ static DECLCALLBACK(int) drvvdStartWrite(PPDMIMEDIAASYNC pInterface, uint64_t uO
     RTSGBUF SgBuf;
     RTSgBufInit(&SgBuf, paSeg, cSeg);
 
+    /* Count the write before invalidating, a prefetch started in between would read stale data. */
+    bool const fRaWrite = !pThis->pBlkCache && pThis->fReadAhead;
+    if (fRaWrite)
+        ASMAtomicIncU32(&pThis->cRaWritesActive);
+    drvvdRaInvalidate(pThis, uOffset, cbWrite);
+
     if (!pThis->pBlkCache)
-        rc = VDAsyncWrite(pThis->pDisk, uOffset, cbWrite, &SgBuf,
-                          drvvdAsyncReqComplete, pThis, pvUser);
+    {
+        if (!fRaWrite)
+            rc = VDAsyncWrite(pThis->pDisk, uOffset, cbWrite, &SgBuf,
+                              drvvdAsyncReqComplete, pThis, pvUser);
+        else
+        {
+            rc = VDAsyncWrite(pThis->pDisk, uOffset, cbWrite, &SgBuf,
+                              drvvdRaAsyncWriteReqComplete, pThis, pvUser);
+            if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                ASMAtomicDecU32(&pThis->cRaWritesActive);
+        }
+    }
     else
     {
         rc = PDMR3BlkCacheWrite(pThis->pBlkCache, uOffset, &SgBuf, cbWrite, pvUser);
@@ -2157,9 +2789,25 @@ static DECLCALLBACK(int) drvvdStartDiscard(PPDMIMEDIAASYNC pInterface, PCRTRANGE
     LogFlowFunc(("paRanges=%#p cRanges=%u pvUser=%#p\n",
                  paRanges, cRanges, pvUser));
 
+    bool const fRaWrite = !pThis->pBlkCache && pThis->fReadAhead;
+    if (fRaWrite)
+        ASMAtomicIncU32(&pThis->cRaWritesActive);
+    for (unsigned i = 0; i < cRanges; i++)
+        drvvdRaInvalidate(pThis, paRanges[i].offStart, paRanges[i].cbRange);
+
     if (!pThis->pBlkCache)
-        rc = VDAsyncDiscardRanges(pThis->pDisk, paRanges, cRanges, drvvdAsyncReqComplete,
-                                  pThis, pvUser);
+    {
+        if (!fRaWrite)
+            rc = VDAsyncDiscardRanges(pThis->pDisk, paRanges, cRanges, drvvdAsyncReqComplete,
+                                      pThis, pvUser);
+        else
+        {
+            rc = VDAsyncDiscardRanges(pThis->pDisk, paRanges, cRanges, drvvdRaAsyncWriteReqComplete,
+                                      pThis, pvUser);
+            if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                ASMAtomicDecU32(&pThis->cRaWritesActive);
+        }
+    }
     else
     {
         rc = PDMR3BlkCacheDiscard(pThis->pBlkCache, paRanges, cRanges, pvUser);
@@ -2177,6 +2825,15 @@ static DECLCALLBACK(void) drvvdBlkCacheXferComplete(PPDMDRVINS pDrvIns, void *pv
 {
     PVBOXDISK pThis = PDMINS_2_DATA(pDrvIns, PVBOXDISK);
 
+    /* Prefetches use the stream as the request handle. */
+    if (   pThis->paRaStreams
+        && (uintptr_t)pvUser >= (uintptr_t)&pThis->paRaStreams[0]
+        && (uintptr_t)pvUser <  (uintptr_t)&pThis->paRaStreams[pThis->cRaStreams])
+    {
+        drvvdRaPrefetchComplete(pThis, pvUser, rcReq);
+        return;
+    }
+
     int rc = pThis->pDrvMediaAsyncPort->pfnTransferCompleteNotify(pThis->pDrvMediaAsyncPort,
                                                                   pvUser, rcReq);
     AssertRC(rc);
@@ -2268,6 +2925,155 @@ static int drvvdLoadPlugins(PVBOXDISK pThis, PCFGMNODE pCfg)
 }
 
 
+/**
+ * Warms up the persistent cache by reading all ranges listed in the given trace file.
+ *
+ * Each line of the trace contains the start offset and the length of a range in bytes,
+ * separated by whitespace. Lines starting with # are ignored. Reading the data through
+ * the disk populates the cache, errors are not fatal.
+ *
+ * @returns nothing.
+ * @param   pThis       The disk instance.
+ * @param   pszTrace    Path of the trace file.
+ */
+static void drvvdCacheWarmup(PVBOXDISK pThis, const char *pszTrace)
+{
+    PRTSTREAM pStrm = NULL;
+    int rc = RTStrmOpen(pszTrace, "r", &pStrm);
+    if (RT_FAILURE(rc))
+    {
+        LogRel(("VD: Failed to open cache warmup trace '%s' rc=%Rrc\n", pszTrace, rc));
+        return;
+    }
+
+    size_t cbBuf = _1M;
+    void *pvBuf = RTMemPageAlloc(cbBuf);
+    if (pvBuf)
+    {
+        uint64_t cbDisk = VDGetSize(pThis->pDisk, VD_LAST_IMAGE);
+        uint64_t cbWarmedUp = 0;
+        uint64_t tsStart = RTTimeNanoTS();
+        char szLine[128];
+
+        while (RT_SUCCESS(RTStrmGetLine(pStrm, szLine, sizeof(szLine))))
+        {
+            char *psz = RTStrStrip(szLine);
+            uint64_t uOffset = 0;
+            uint64_t cbRange = 0;
+
+            if (!*psz || *psz == '#')
+                continue;
+
+            rc = RTStrToUInt64Ex(psz, &psz, 0, &uOffset);
+            if (RT_SUCCESS(rc))
+                rc = RTStrToUInt64Ex(RTStrStripL(psz), NULL, 0, &cbRange);
+            if (RT_FAILURE(rc))
+            {
+                LogRel(("VD: Invalid line in cache warmup trace '%s', stopping\n", pszTrace));
+                break;
+            }
+
+            /* Align to sectors and clip to the disk size. */
+            cbRange += uOffset & 511;
+            uOffset &= ~(uint64_t)511;
+            cbRange = RT_ALIGN_64(cbRange, 512);
+            if (uOffset >= cbDisk)
+                continue;
+            cbRange = RT_MIN(cbRange, cbDisk - uOffset);
+
+            while (cbRange)
+            {
+                size_t cbThisRead = (size_t)RT_MIN(cbRange, cbBuf);
+
+                rc = VDRead(pThis->pDisk, uOffset, pvBuf, cbThisRead);
+                if (RT_FAILURE(rc))
+                    break;
+
+                uOffset    += cbThisRead;
+                cbRange    -= cbThisRead;
+                cbWarmedUp += cbThisRead;
+            }
+        }
+
+        LogRel(("VD: Cache warmup read %llu bytes in %llu ms\n",
+                cbWarmedUp, (RTTimeNanoTS() - tsStart) / RT_NS_1MS));
+        RTMemPageFree(pvBuf, cbBuf);
+    }
+
+    RTStrmClose(pStrm);
+}
+
+/**
+ * Sets up the read-ahead engine.
+ *
+ * @returns VBox status code.
+ * @param   pThis    The disk instance.
+ */
+static int drvvdSetupReadAhead(PVBOXDISK pThis)
+{
+    PPDMDRVINS pDrvIns = pThis->pDrvIns;
+    const char *pcszController = NULL;
+    uint32_t iInstance = 0;
+    uint32_t iLUN = 0;
+
+    int rc = pThis->pDrvMediaPort->pfnQueryDeviceLocation(pThis->pDrvMediaPort, &pcszController,
+                                                          &iInstance, &iLUN);
+    if (RT_FAILURE(rc))
+        return PDMDRV_SET_ERROR(pDrvIns, VERR_PDM_DRIVER_INVALID_PROPERTIES,
+                                N_("DrvVD: Configuration error: Could not query device data"));
+
+    rc = RTCritSectInit(&pThis->CritSectRa);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    pThis->cbDisk = VDGetSize(pThis->pDisk, VD_LAST_IMAGE);
+    pThis->paRaStreams = (PDRVVDRASTREAM)RTMemAllocZ(pThis->cRaStreams * sizeof(DRVVDRASTREAM));
+    if (!pThis->paRaStreams)
+        return VERR_NO_MEMORY;
+
+    for (unsigned i = 0; i < pThis->cRaStreams; i++)
+    {
+        PDRVVDRASTREAM pStream = &pThis->paRaStreams[i];
+
+        pStream->cbWindow = pThis->cbRaWindowMin;
+        for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pStream->aBufs); iBuf++)
+        {
+            pStream->aBufs[iBuf].pbBuf = (uint8_t *)RTMemPageAlloc(pThis->cbRaWindowMax);
+            if (!pStream->aBufs[iBuf].pbBuf)
+                return VERR_NO_MEMORY;
+        }
+    }
+
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaHits, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Reads served from prefetched data.", "/Devices/%s%u/%u/ReadAhead/Hits",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaMisses, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Sequential reads which were not prefetched.", "/Devices/%s%u/%u/ReadAhead/Misses",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaPrefetches, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of prefetches.", "/Devices/%s%u/%u/ReadAhead/Prefetches",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaBytesPrefetched, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                           "Amount of data prefetched.", "/Devices/%s%u/%u/ReadAhead/BytesPrefetched",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaBytesUsed, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,
+                           "Amount of prefetched data read by the guest.", "/Devices/%s%u/%u/ReadAhead/BytesUsed",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaStreams, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of streams started.", "/Devices/%s%u/%u/ReadAhead/Streams",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaWindowGrow, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of times a window was increased.", "/Devices/%s%u/%u/ReadAhead/WindowGrow",
+                           pcszController, iInstance, iLUN);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatRaWindowShrink, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,
+                           "Number of times a window was decreased.", "/Devices/%s%u/%u/ReadAhead/WindowShrink",
+                           pcszController, iInstance, iLUN);
+
+    LogRel(("VD: Read-ahead enabled with %u streams, window %zu..%zu bytes\n",
+            pThis->cRaStreams, pThis->cbRaWindowMin, pThis->cbRaWindowMax));
+    return VINF_SUCCESS;
+}
+
 /**
  * Sets up the disk filter chain.
  *
@@ -2389,6 +3195,8 @@ static void drvvdPowerOffOrDestruct(PPDMDRVINS pDrvIns)
         AssertRC(rc);
     }
 
+    drvvdRaQuiesce(pThis);
+
     if (RT_VALID_PTR(pThis->pBlkCache))
     {
         PDMR3BlkCacheRelease(pThis->pBlkCache);
@@ -2459,6 +3267,8 @@ static DECLCALLBACK(void) drvvdSuspend(PPDMDRVINS pDrvIns)
     LogFlowFunc(("\n"));
     PVBOXDISK pThis = PDMINS_2_DATA(pDrvIns, PVBOXDISK);
 
+    drvvdRaQuiesce(pThis);
+
     if (pThis->pBlkCache)
     {
         int rc = PDMR3BlkCacheSuspend(pThis->pBlkCache);
@@ -2505,6 +3315,8 @@ static DECLCALLBACK(void) drvvdReset(PPDMDRVINS pDrvIns)
         pThis->cbDataValid      = 0;
         pThis->offDisk          = 0;
     }
+
+    drvvdRaReset(pThis);
 }
 
 /**
@@ -2533,6 +3345,29 @@ static DECLCALLBACK(void) drvvdDestruct(PPDMDRVINS pDrvIns)
         RTMemFree(pThis->pbData);
         pThis->pbData = NULL;
     }
+    if (pThis->paRaStreams)
+    {
+        /*
+         * Deregister the read-ahead statistics, the driver can be destroyed
+         * without the VM going away (reconfiguration after a snapshot).
+         */
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaHits);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaMisses);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaPrefetches);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaBytesPrefetched);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaBytesUsed);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaStreams);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaWindowGrow);
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatRaWindowShrink);
+
+        for (unsigned i = 0; i < pThis->cRaStreams; i++)
+            for (unsigned iBuf = 0; iBuf < RT_ELEMENTS(pThis->paRaStreams[i].aBufs); iBuf++)
+                RTMemPageFree(pThis->paRaStreams[i].aBufs[iBuf].pbBuf, pThis->cbRaWindowMax);
+        RTMemFree(pThis->paRaStreams);
+        pThis->paRaStreams = NULL;
+    }
+    if (RTCritSectIsInitialized(&pThis->CritSectRa))
+        RTCritSectDelete(&pThis->CritSectRa);
     if (pThis->pszBwGroup)
     {
         MMR3HeapFree(pThis->pszBwGroup);
@@ -2557,6 +3392,7 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
     char *pszFormat = NULL;      /**< The format backed to use for this image. */
     char *pszCachePath = NULL;   /**< The path to the cache image. */
     char *pszCacheFormat = NULL; /**< The format backend to use for the cache image. */
+    char *pszCacheWarmupTrace = NULL; /**< Trace of ranges to read into the cache after opening it. */
     bool fReadOnly;              /**< True if the media is read-only. */
     bool fMaybeReadOnly;         /**< True if the media may or may not be read-only. */
     bool fHonorZeroWrites;       /**< True if zero blocks should be written. */
@@ -2655,8 +3491,9 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                           "ReadOnly\0MaybeReadOnly\0TempReadOnly\0Shareable\0HonorZeroWrites\0"
                                           "HostIPStack\0UseNewIo\0BootAcceleration\0BootAccelerationBuffer\0"
                                           "SetupMerge\0MergeSource\0MergeTarget\0BwGroup\0Type\0BlockCache\0"
-                                          "CachePath\0CacheFormat\0Discard\0InformAboutZeroBlocks\0"
-                                          "SkipConsistencyChecks\0");
+                                          "CachePath\0CacheFormat\0CacheWarmupTrace\0Discard\0InformAboutZeroBlocks\0"
+                                          "SkipConsistencyChecks\0ReadAhead\0ReadAheadStreams\0ReadAheadWindowMin\0"
+                                          "ReadAheadWindowMax\0");
         }
         else
         {
@@ -2762,6 +3599,48 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                       N_("DrvVD: Configuration error: Querying \"BootAccelerationBuffer\" as integer failed"));
                 break;
             }
+            rc = CFGMR3QueryBoolDef(pCurNode, "ReadAhead", &pThis->fReadAhead, false);
+            if (RT_FAILURE(rc))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                      N_("DrvVD: Configuration error: Querying \"ReadAhead\" as boolean failed"));
+                break;
+            }
+            rc = CFGMR3QueryU32Def(pCurNode, "ReadAheadStreams", &pThis->cRaStreams, 4);
+            if (   RT_SUCCESS(rc)
+                && (   pThis->cRaStreams == 0
+                    || pThis->cRaStreams > DRVVD_RA_STREAMS_MAX))
+                rc = VERR_OUT_OF_RANGE;
+            if (RT_FAILURE(rc))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                      N_("DrvVD: Configuration error: Querying \"ReadAheadStreams\" as integer failed or value out of range"));
+                break;
+            }
+            rc = CFGMR3QueryU32Def(pCurNode, "ReadAheadWindowMin", (uint32_t *)&pThis->cbRaWindowMin, 64 * _1K);
+            if (RT_FAILURE(rc))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                      N_("DrvVD: Configuration error: Querying \"ReadAheadWindowMin\" as integer failed"));
+                break;
+            }
+            rc = CFGMR3QueryU32Def(pCurNode, "ReadAheadWindowMax", (uint32_t *)&pThis->cbRaWindowMax, _1M);
+            if (RT_FAILURE(rc))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                      N_("DrvVD: Configuration error: Querying \"ReadAheadWindowMax\" as integer failed"));
+                break;
+            }
+            if (   pThis->cbRaWindowMin < 512
+                || pThis->cbRaWindowMin > pThis->cbRaWindowMax
+                || pThis->cbRaWindowMax > 16 * _1M
+                || (pThis->cbRaWindowMin & 511)
+                || (pThis->cbRaWindowMax & 511))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, VERR_PDM_DRIVER_INVALID_PROPERTIES,
+                                      N_("DrvVD: Configuration error: \"ReadAheadWindowMin\" and \"ReadAheadWindowMax\" are invalid"));
+                break;
+            }
             rc = CFGMR3QueryBoolDef(pCurNode, "BlockCache", &fUseBlockCache, false);
             if (RT_FAILURE(rc))
             {
@@ -2847,6 +3726,16 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                           N_("DrvVD: Configuration error: Querying \"CacheFormat\" as string failed"));
                     break;
                 }
+
+                rc = CFGMR3QueryStringAlloc(pCurNode, "CacheWarmupTrace", &pszCacheWarmupTrace);
+                if (RT_FAILURE(rc) && rc != VERR_CFGM_VALUE_NOT_FOUND)
+                {
+                    rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                          N_("DrvVD: Configuration error: Querying \"CacheWarmupTrace\" as string failed"));
+                    break;
+                }
+                else
+                    rc = VINF_SUCCESS;
             }
         }
 
@@ -3226,12 +4115,16 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
         rc = VDCacheOpen(pThis->pDisk, pszCacheFormat, pszCachePath, VD_OPEN_FLAGS_NORMAL, pThis->pVDIfsCache);
         if (RT_FAILURE(rc))
             rc = PDMDRV_SET_ERROR(pDrvIns, rc, N_("DrvVD: Could not open cache image"));
+        else if (RT_VALID_PTR(pszCacheWarmupTrace))
+            drvvdCacheWarmup(pThis, pszCacheWarmupTrace);
     }
 
     if (RT_VALID_PTR(pszCachePath))
         MMR3HeapFree(pszCachePath);
     if (RT_VALID_PTR(pszCacheFormat))
         MMR3HeapFree(pszCacheFormat);
+    if (RT_VALID_PTR(pszCacheWarmupTrace))
+        MMR3HeapFree(pszCacheWarmupTrace);
 
     if (   RT_SUCCESS(rc)
         && pThis->fMergePending
@@ -3324,6 +4217,9 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
             LogRel(("VD: Boot acceleration, out of memory, disabled\n"));
     }
 
+    if (RT_SUCCESS(rc) && pThis->fReadAhead)
+        rc = drvvdSetupReadAhead(pThis);
+
     if (RT_FAILURE(rc))
     {
         if (RT_VALID_PTR(pszName))
@@ -21,6 +21,7 @@
 *********************************************************************************************************************************/
 #define LOG_GROUP LOG_GROUP_DEV_VIRTIO
 
+#include <iprt/asm.h>
 #include <iprt/param.h>
 #include <iprt/uuid.h>
 #include <VBox/vmm/pdmdev.h>
@@ -56,9 +57,10 @@ static void vqueueInit(PVQUEUE pQueue, uint32_t uPageNumber)
     pQueue->VRing.addrDescriptors = (uint64_t)uPageNumber << PAGE_SHIFT;
     pQueue->VRing.addrAvail       = pQueue->VRing.addrDescriptors
         + sizeof(VRINGDESC) * pQueue->VRing.uSize;
+    /* The used ring must start from the next page, behind the used_event field of the avail ring. */
     pQueue->VRing.addrUsed        = RT_ALIGN(
-        pQueue->VRing.addrAvail + RT_OFFSETOF(VRINGAVAIL, auRing[pQueue->VRing.uSize]),
-        PAGE_SIZE); /* The used ring must start from the next page. */
+        pQueue->VRing.addrAvail + RT_OFFSETOF(VRINGAVAIL, auRing[pQueue->VRing.uSize + 1]),
+        PAGE_SIZE);
     pQueue->uNextAvailIndex       = 0;
     pQueue->uNextUsedIndex        = 0;
 }
@@ -124,6 +126,91 @@ bool vqueueSkip(PVPCISTATE pState, PVQUEUE pQueue)
     return true;
 }
 
+/**
+ * Adds the buffer described by a descriptor to the segments of a queue element.
+ *
+ * @returns false if the element has no room left for the segment.
+ * @param   pState      The device state structure.
+ * @param   pQueue      The queue the element belongs to.
+ * @param   pElem       The queue element.
+ * @param   pDesc       The descriptor.
+ * @param   idx         The descriptor index, for logging.
+ */
+static bool vqueueElemAddSeg(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, PVRINGDESC pDesc, uint32_t idx)
+{
+    VQUEUESEG *pSeg;
+
+    if (pDesc->u16Flags & VRINGDESC_F_WRITE)
+    {
+        if (pElem->nIn >= RT_ELEMENTS(pElem->aSegsIn))
+            return false;
+        Log2(("%s vqueueGet: %s IN  seg=%u desc_idx=%u addr=%p cb=%u\n", INSTANCE(pState),
+              QUEUENAME(pState, pQueue), pElem->nIn, idx, pDesc->u64Addr, pDesc->uLen));
+        pSeg = &pElem->aSegsIn[pElem->nIn++];
+    }
+    else
+    {
+        if (pElem->nOut >= RT_ELEMENTS(pElem->aSegsOut))
+            return false;
+        Log2(("%s vqueueGet: %s OUT seg=%u desc_idx=%u addr=%p cb=%u\n", INSTANCE(pState),
+              QUEUENAME(pState, pQueue), pElem->nOut, idx, pDesc->u64Addr, pDesc->uLen));
+        pSeg = &pElem->aSegsOut[pElem->nOut++];
+    }
+
+    pSeg->addr = pDesc->u64Addr;
+    pSeg->cb   = pDesc->uLen;
+    pSeg->pv   = NULL;
+    return true;
+}
+
+/**
+ * Adds the buffers of an indirect descriptor table to a queue element.
+ *
+ * The table is read in chunks as drivers usually chain the entries in order.
+ *
+ * @param   pState          The device state structure.
+ * @param   pQueue          The queue the element belongs to.
+ * @param   pElem           The queue element.
+ * @param   pDescIndirect   The descriptor referring to the table.
+ */
+static void vqueueGetIndirect(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, PVRINGDESC pDescIndirect)
+{
+    VRINGDESC aDescs[32];
+    uint32_t  cDescs   = pDescIndirect->uLen / sizeof(VRINGDESC);
+    uint32_t  cLeft    = cDescs; /* Guards against loops in the table. */
+    uint32_t  idxFirst = 0;
+    uint32_t  cRead    = 0;
+    uint32_t  idx      = 0;
+
+    for (;;)
+    {
+        if (idx >= cDescs || !cLeft--)
+        {
+            Log(("%s vqueueGetIndirect: %s Malformed indirect table at %RGp (cDescs=%u idx=%u)\n", INSTANCE(pState),
+                 QUEUENAME(pState, pQueue), pDescIndirect->u64Addr, cDescs, idx));
+            break;
+        }
+
+        if (idx < idxFirst || idx >= idxFirst + cRead)
+        {
+            idxFirst = idx;
+            cRead    = RT_MIN(cDescs - idx, RT_ELEMENTS(aDescs));
+            PDMDevHlpPhysRead(pState->CTX_SUFF(pDevIns), pDescIndirect->u64Addr + idx * sizeof(VRINGDESC),
+                              &aDescs[0], cRead * sizeof(VRINGDESC));
+        }
+
+        PVRINGDESC pDesc = &aDescs[idx - idxFirst];
+        if (!vqueueElemAddSeg(pState, pQueue, pElem, pDesc, idx))
+        {
+            Log(("%s vqueueGetIndirect: %s Too many segments\n", INSTANCE(pState), QUEUENAME(pState, pQueue)));
+            break;
+        }
+        if (!(pDesc->u16Flags & VRINGDESC_F_NEXT))
+            break;
+        idx = pDesc->u16Next;
+    }
+}
+
 bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove)
 {
     if (vqueueIsEmpty(pState, pQueue))
@@ -135,34 +222,30 @@ bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemov
           QUEUENAME(pState, pQueue), pQueue->uNextAvailIndex));
 
     VRINGDESC desc;
-    uint16_t  idx = vringReadAvail(pState, &pQueue->VRing, pQueue->uNextAvailIndex);
+    uint16_t  idx   = vringReadAvail(pState, &pQueue->VRing, pQueue->uNextAvailIndex);
+    uint32_t  cLeft = pQueue->VRing.uSize; /* Guards against descriptor loops. */
     if (fRemove)
         pQueue->uNextAvailIndex++;
     pElem->uIndex = idx;
     do
     {
-        VQUEUESEG *pSeg;
-
         vringReadDesc(pState, &pQueue->VRing, idx, &desc);
-        if (desc.u16Flags & VRINGDESC_F_WRITE)
+        if (   (desc.u16Flags & VRINGDESC_F_INDIRECT)
+            && (pState->uGuestFeatures & VPCI_F_INDIRECT_DESC))
         {
-            Log2(("%s vqueueGet: %s IN  seg=%u desc_idx=%u addr=%p cb=%u\n", INSTANCE(pState),
-                  QUEUENAME(pState, pQueue), pElem->nIn, idx, desc.u64Addr, desc.uLen));
-            pSeg = &pElem->aSegsIn[pElem->nIn++];
+            /* An indirect descriptor is never chained. */
+            vqueueGetIndirect(pState, pQueue, pElem, &desc);
+            break;
         }
-        else
+
+        if (!vqueueElemAddSeg(pState, pQueue, pElem, &desc, idx))
         {
-            Log2(("%s vqueueGet: %s OUT seg=%u desc_idx=%u addr=%p cb=%u\n", INSTANCE(pState),
-                  QUEUENAME(pState, pQueue), pElem->nOut, idx, desc.u64Addr, desc.uLen));
-            pSeg = &pElem->aSegsOut[pElem->nOut++];
+            Log(("%s vqueueGet: %s Too many segments\n", INSTANCE(pState), QUEUENAME(pState, pQueue)));
+            break;
         }
 
-        pSeg->addr = desc.u64Addr;
-        pSeg->cb   = desc.uLen;
-        pSeg->pv   = NULL;
-
         idx = desc.u16Next;
-    } while (desc.u16Flags & VRINGDESC_F_NEXT);
+    } while ((desc.u16Flags & VRINGDESC_F_NEXT) && --cLeft);
 
     Log2(("%s vqueueGet: %s head_desc_idx=%u nIn=%u nOut=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), pElem->uIndex, pElem->nIn, pElem->nOut));
@@ -217,9 +300,52 @@ void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uL
     }
 
     Assert((uReserved + uOffset) == uLen || pElem->nIn == 0);
+    vqueuePutIndex(pState, pQueue, pElem->uIndex, uLen);
+}
+
+/**
+ * Adds a descriptor chain to the used ring, without copying any data.
+ *
+ * For devices which transfer the data themselves and don't keep the queue
+ * element around until the request completes.
+ *
+ * @param   pState      The device state structure.
+ * @param   pQueue      The queue.
+ * @param   uIndex      The index of the head descriptor of the chain.
+ * @param   uLen        Number of bytes written to the guest buffers.
+ */
+void vqueuePutIndex(PVPCISTATE pState, PVQUEUE pQueue, uint32_t uIndex, uint32_t uLen)
+{
     Log2(("%s vqueuePut: %s used_idx=%u guest_used_idx=%u id=%u len=%u\n", INSTANCE(pState),
-          QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, vringReadUsedIndex(pState, &pQueue->VRing), pElem->uIndex, uLen));
-    vringWriteUsedElem(pState, &pQueue->VRing, pQueue->uNextUsedIndex++, pElem->uIndex, uLen);
+          QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, vringReadUsedIndex(pState, &pQueue->VRing), uIndex, uLen));
+    vringWriteUsedElem(pState, &pQueue->VRing, pQueue->uNextUsedIndex++, uIndex, uLen);
+}
+
+/**
+ * Enables or disables guest notifications about new buffers in a queue.
+ *
+ * With VPCI_F_EVENT_IDX the guest ignores the VRINGUSED_F_NO_NOTIFY flag and
+ * notifies when it passes the avail_event index, so enabling publishes the
+ * current position and disabling leaves the stale one behind.
+ *
+ * @param   pState      The device state structure.
+ * @param   pQueue      The queue.
+ * @param   fEnabled    Whether the guest should notify.
+ */
+void vqueueSetNotification(PVPCISTATE pState, PVQUEUE pQueue, bool fEnabled)
+{
+    if (pState->uGuestFeatures & VPCI_F_EVENT_IDX)
+    {
+        if (fEnabled)
+        {
+            uint16_t u16AvailEvent = pQueue->uNextAvailIndex;
+            PDMDevHlpPCIPhysWrite(pState->CTX_SUFF(pDevIns),
+                                  pQueue->VRing.addrUsed + RT_OFFSETOF(VRINGUSED, aRing[pQueue->VRing.uSize]),
+                                  &u16AvailEvent, sizeof(u16AvailEvent));
+        }
+    }
+    else
+        vringSetNotification(pState, &pQueue->VRing, fEnabled);
 }
 
 void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue)
@@ -242,12 +368,44 @@ void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue)
 
 }
 
+/**
+ * Checks whether the guest asked for an interrupt when the used index moves
+ * from @a uOld to @a uNew (vring_need_event).
+ */
+DECLINLINE(bool) vringNeedEvent(uint16_t uEvent, uint16_t uNew, uint16_t uOld)
+{
+    return (uint16_t)(uNew - uEvent - 1) < (uint16_t)(uNew - uOld);
+}
+
 void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue)
 {
     Log2(("%s vqueueSync: %s old_used_idx=%u new_used_idx=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), vringReadUsedIndex(pState, &pQueue->VRing), pQueue->uNextUsedIndex));
-    vringWriteUsedIndex(pState, &pQueue->VRing, pQueue->uNextUsedIndex);
-    vqueueNotify(pState, pQueue);
+    if (pState->uGuestFeatures & VPCI_F_EVENT_IDX)
+    {
+        uint16_t uOldUsedIndex = vringReadUsedIndex(pState, &pQueue->VRing);
+        vringWriteUsedIndex(pState, &pQueue->VRing, pQueue->uNextUsedIndex);
+
+        /* The guest may update used_event concurrently, it must see the new index first. */
+        ASMMemoryFence();
+        uint16_t uUsedEvent;
+        PDMDevHlpPhysRead(pState->CTX_SUFF(pDevIns),
+                          pQueue->VRing.addrAvail + RT_OFFSETOF(VRINGAVAIL, auRing[pQueue->VRing.uSize]),
+                          &uUsedEvent, sizeof(uUsedEvent));
+        if (vringNeedEvent(uUsedEvent, pQueue->uNextUsedIndex, uOldUsedIndex))
+        {
+            int rc = vpciRaiseInterrupt(pState, VERR_INTERNAL_ERROR, VPCI_ISR_QUEUE);
+            if (RT_FAILURE(rc))
+                Log(("%s vqueueSync: Failed to raise an interrupt (%Rrc).\n", INSTANCE(pState), rc));
+        }
+        else
+            STAM_COUNTER_INC(&pState->StatIntsSkipped);
+    }
+    else
+    {
+        vringWriteUsedIndex(pState, &pQueue->VRing, pQueue->uNextUsedIndex);
+        vqueueNotify(pState, pQueue);
+    }
 }
 
 void vpciReset(PVPCISTATE pState)
@@ -279,7 +437,11 @@ int vpciRaiseInterrupt(VPCISTATE *pState, int rcBusy, uint8_t u8IntCause)
     LogFlow(("%s vpciRaiseInterrupt: u8IntCause=%x\n",
              INSTANCE(pState), u8IntCause));
 
-    pState->uISR |= u8IntCause;
+    /* Devices may complete requests on other threads than the EMT reading ISR. */
+    uint8_t u8Old;
+    do
+        u8Old = ASMAtomicReadU8(&pState->uISR);
+    while (!ASMAtomicCmpXchgU8(&pState->uISR, u8Old | u8IntCause, u8Old));
     PDMDevHlpPCISetIrq(pState->CTX_SUFF(pDevIns), 0, 1);
     // vpciCsLeave(pState);
     return VINF_SUCCESS;
@@ -377,9 +539,11 @@ int vpciIOPortIn(PPDMDEVINS         pDevIns,
 
         case VPCI_ISR:
             Assert(cb == 1);
-            *(uint8_t*)pu32 = pState->uISR;
-            pState->uISR = 0; /* read clears all interrupts */
+            *(uint8_t*)pu32 = ASMAtomicXchgU8(&pState->uISR, 0); /* read clears all interrupts */
             vpciLowerInterrupt(pState);
+            /* Don't lose an interrupt raised by another thread in between. */
+            if (ASMAtomicReadU8(&pState->uISR))
+                PDMDevHlpPCISetIrq(pDevIns, 0, 1);
             break;
 
         default:
@@ -35,7 +35,8 @@
 #define DEVICE_PCI_DEVICE_ID                0x1000
 #define DEVICE_PCI_SUBSYSTEM_VENDOR_ID      0x1AF4
 
-#define VIRTIO_MAX_NQUEUES                  3
+/** Maximum number of queues of a device, virtio-blk uses one per request queue. */
+#define VIRTIO_MAX_NQUEUES                  16
 
 #define VPCI_HOST_FEATURES                  0x0
 #define VPCI_GUEST_FEATURES                 0x4
@@ -56,11 +57,19 @@
 #define VPCI_STATUS_FAILED                  0x80
 
 #define VPCI_F_NOTIFY_ON_EMPTY              0x01000000
+/** The guest may use indirect descriptor tables.
+ * Devices opt in by returning it from pfnGetHostFeatures. */
+#define VPCI_F_INDIRECT_DESC                0x10000000
+/** The guest and the device suppress notifications with the used_event and
+ * avail_event ring fields. Devices opt in by returning it from
+ * pfnGetHostFeatures and must use vqueueSetNotification() then. */
+#define VPCI_F_EVENT_IDX                    0x20000000
 #define VPCI_F_BAD_FEATURE                  0x40000000
 
 #define VRINGDESC_MAX_SIZE                  (2 * 1024 * 1024)
 #define VRINGDESC_F_NEXT                    0x01
 #define VRINGDESC_F_WRITE                   0x02
+#define VRINGDESC_F_INDIRECT                0x04
 
 typedef struct VRingDesc
 {
@@ -301,6 +310,8 @@ DECLINLINE(uint16_t) vringReadAvailIndex(PVPCISTATE pState, PVRING pVRing)
 bool vqueueSkip(PVPCISTATE pState, PVQUEUE pQueue);
 bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove = true);
 void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved = 0);
+void vqueuePutIndex(PVPCISTATE pState, PVQUEUE pQueue, uint32_t uIndex, uint32_t uLen);
+void vqueueSetNotification(PVPCISTATE pState, PVQUEUE pQueue, bool fEnabled);
 void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue);
 void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue);
 
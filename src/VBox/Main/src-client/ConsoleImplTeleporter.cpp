@@ -28,13 +28,17 @@
 #include "HashedPw.h"
 
 #include <iprt/asm.h>
+#include <iprt/critsect.h>
 #include <iprt/err.h>
+#include <iprt/mem.h>
+#include <iprt/param.h>
 #include <iprt/rand.h>
 #include <iprt/socket.h>
 #include <iprt/tcp.h>
 #include <iprt/timer.h>
 
 #include <VBox/vmm/vmapi.h>
+#include <VBox/vmm/pgm.h>
 #include <VBox/vmm/ssm.h>
 #include <VBox/err.h>
 #include <VBox/version.h>
@@ -42,6 +46,14 @@
 #include "VBox/com/ErrorInfo.h"
 
 
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The max number of TCP connections the saved state stream can be striped
+ *  over (VBoxInternal2/TeleporterStreams). */
+#define TELEPORTER_MAX_STREAMS      16
+
+
 /*********************************************************************************************************************************
 *   Structures and Typedefs                                                                                                      *
 *********************************************************************************************************************************/
@@ -69,6 +81,21 @@ public:
     bool volatile       mfIOError;
     /** @} */
 
+    /** @name Parallel stream connections.
+     * The saved state stream blocks are sent round robin over the connections,
+     * starting with the control connection (mhSocket).
+     * @{  */
+    /** The number of connections (1 if not striping). */
+    uint32_t            mcStreams;
+    /** The connection the next block is sent or received on. */
+    uint32_t            miStream;
+    /** The additional connections, entry 0 is unused (mhSocket). */
+    RTSOCKET            mahStreams[TELEPORTER_MAX_STREAMS];
+    /** @} */
+
+    /** The post-copy connection, NIL if not doing post-copy. */
+    RTSOCKET            mhPostCopySocket;
+
     TeleporterState(Console *pConsole, PUVM pUVM, Progress *pProgress, bool fIsSource)
         : mptrConsole(pConsole)
         , mpUVM(pUVM)
@@ -80,7 +107,12 @@ public:
         , mfStopReading(false)
         , mfEndOfStream(false)
         , mfIOError(false)
+        , mcStreams(1)
+        , miStream(0)
+        , mhPostCopySocket(NIL_RTSOCKET)
     {
+        for (unsigned i = 0; i < RT_ELEMENTS(mahStreams); i++)
+            mahStreams[i] = NIL_RTSOCKET;
         VMR3RetainUVM(mpUVM);
     }
 
@@ -104,6 +136,12 @@ public:
     MachineState_T      menmOldMachineState;
     bool                mfSuspendedByUs;
     bool                mfUnlockedMedia;
+    /** Whether to hand over the VM before all RAM has been sent
+     *  (VBoxInternal2/TeleporterPostCopy). */
+    bool                mfPostCopy;
+    /** The post-copy error message, empty on success.  Post-copy failures
+     *  happen after the hand over so they don't undo the teleportation. */
+    Utf8Str             mstrPostCopyError;
 
     TeleporterStateSrc(Console *pConsole, PUVM pUVM, Progress *pProgress, MachineState_T enmOldMachineState)
         : TeleporterState(pConsole, pUVM, pProgress, true /*fIsSource*/)
@@ -112,6 +150,7 @@ public:
         , menmOldMachineState(enmOldMachineState)
         , mfSuspendedByUs(false)
         , mfUnlockedMedia(false)
+        , mfPostCopy(false)
     {
     }
 };
@@ -125,6 +164,8 @@ class TeleporterStateTrg : public TeleporterState
 public:
     IMachine                   *mpMachine;
     IInternalMachineControl    *mpControl;
+    /** The address we're listening on, empty if any. */
+    Utf8Str                     mstrAddress;
     PRTTCPSERVER                mhServer;
     PRTTIMERLR                  mphTimerLR;
     bool                        mfLockedMedia;
@@ -168,6 +209,78 @@ typedef struct TELEPORTERTCPHDR
 #define TELEPORTERTCPHDR_MAX_SIZE    UINT32_C(0x00fffff8)
 
 
+/**
+ * Post-copy message header.
+ *
+ * The source sends PAGE messages (followed by the page contents) and finally
+ * an END message, the destination sends REQUEST messages for pages the guest
+ * is waiting for and a DONE message in reply to END.
+ */
+typedef struct TELEPORTERPOSTCOPYHDR
+{
+    /** Magic value (TELEPORTERPOSTCOPYHDR_MAGIC). */
+    uint32_t    u32Magic;
+    /** The message type, TELEPORTERPOSTCOPYHDR_TYPE_XXX. */
+    uint32_t    u32Type;
+    /** The guest physical page address, 0 for END and DONE. */
+    uint64_t    u64GCPhys;
+} TELEPORTERPOSTCOPYHDR;
+/** Magic value for TELEPORTERPOSTCOPYHDR::u32Magic. (Hermeto Pascoal) */
+#define TELEPORTERPOSTCOPYHDR_MAGIC         UINT32_C(0x19360622)
+/** Page contents, source to destination. */
+#define TELEPORTERPOSTCOPYHDR_TYPE_PAGE     UINT32_C(1)
+/** Page request, destination to source. */
+#define TELEPORTERPOSTCOPYHDR_TYPE_REQUEST  UINT32_C(2)
+/** All pages sent, source to destination. */
+#define TELEPORTERPOSTCOPYHDR_TYPE_END      UINT32_C(3)
+/** All pages received, destination to source. */
+#define TELEPORTERPOSTCOPYHDR_TYPE_DONE     UINT32_C(4)
+
+
+/**
+ * The post-copy page receiver on the destination side.
+ *
+ * This outlives TeleporterStateTrg as the VM is running while the pages are
+ * coming in, the receiver thread deletes it when done.
+ */
+class TeleporterPostCopyTrg
+{
+public:
+    PUVM                mpUVM;
+    RTSOCKET            mhSocket;
+    /** Protects the request queue.  Only the receiver thread uses the socket
+     *  since RTSOCKET doesn't allow concurrent reads and writes. */
+    RTCRITSECT          mCritSect;
+    /** The number of queued page requests. */
+    uint32_t            mcRequests;
+    /** The number of entries allocated for mpaRequests. */
+    uint32_t            mcRequestsMax;
+    /** Queued page requests, there is normally at most one per vCPU. */
+    RTGCPHYS           *mpaRequests;
+
+    TeleporterPostCopyTrg(PUVM pUVM, RTSOCKET hSocket)
+        : mpUVM(pUVM)
+        , mhSocket(hSocket)
+        , mcRequests(0)
+        , mcRequestsMax(0)
+        , mpaRequests(NULL)
+    {
+        RTCritSectInit(&mCritSect);
+        VMR3RetainUVM(mpUVM);
+    }
+
+    ~TeleporterPostCopyTrg()
+    {
+        if (mhSocket != NIL_RTSOCKET)
+            RTTcpServerDisconnectClient2(mhSocket);
+        RTCritSectDelete(&mCritSect);
+        RTMemFree(mpaRequests);
+        VMR3ReleaseUVM(mpUVM);
+        mpUVM = NULL;
+    }
+};
+
+
 /*********************************************************************************************************************************
 *   Global Variables                                                                                                             *
 *********************************************************************************************************************************/
@@ -175,19 +288,18 @@ static const char g_szWelcome[] = "VirtualBox-Teleporter-1.0\n";
 
 
 /**
- * Reads a string from the socket.
+ * Reads a string from the given socket.
  *
  * @returns VBox status code.
  *
- * @param   pState      The teleporter state structure.
+ * @param   Sock        The socket to read from.
  * @param   pszBuf      The output buffer.
  * @param   cchBuf      The size of the output buffer.
  *
  */
-static int teleporterTcpReadLine(TeleporterState *pState, char *pszBuf, size_t cchBuf)
+static int teleporterTcpReadLineFrom(RTSOCKET Sock, char *pszBuf, size_t cchBuf)
 {
     char       *pszStart = pszBuf;
-    RTSOCKET    Sock     = pState->mhSocket;
 
     AssertReturn(cchBuf > 1, VERR_INTERNAL_ERROR);
     *pszBuf = '\0';
@@ -217,6 +329,46 @@ static int teleporterTcpReadLine(TeleporterState *pState, char *pszBuf, size_t c
 }
 
 
+/**
+ * Reads a string from the control connection.
+ *
+ * @returns VBox status code.
+ *
+ * @param   pState      The teleporter state structure.
+ * @param   pszBuf      The output buffer.
+ * @param   cchBuf      The size of the output buffer.
+ *
+ */
+static int teleporterTcpReadLine(TeleporterState *pState, char *pszBuf, size_t cchBuf)
+{
+    return teleporterTcpReadLineFrom(pState->mhSocket, pszBuf, cchBuf);
+}
+
+
+/**
+ * Gets the connection the next stream block goes over.
+ *
+ * @returns Socket handle.
+ * @param   pState      The teleporter state structure.
+ */
+DECLINLINE(RTSOCKET) teleporterTcpStreamSocket(TeleporterState *pState)
+{
+    return pState->miStream == 0 ? pState->mhSocket : pState->mahStreams[pState->miStream];
+}
+
+
+/**
+ * Advances to the connection of the next stream block.
+ *
+ * @param   pState      The teleporter state structure.
+ */
+DECLINLINE(void) teleporterTcpNextStream(TeleporterState *pState)
+{
+    if (++pState->miStream >= pState->mcStreams)
+        pState->miStream = 0;
+}
+
+
 /**
  * Reads an ACK or NACK.
  *
@@ -319,12 +471,13 @@ static DECLCALLBACK(int) teleporterTcpOpWrite(void *pvUser, uint64_t offStream,
         TELEPORTERTCPHDR Hdr;
         Hdr.u32Magic = TELEPORTERTCPHDR_MAGIC;
         Hdr.cb       = RT_MIN((uint32_t)cbToWrite, TELEPORTERTCPHDR_MAX_SIZE);
-        int rc = RTTcpSgWriteL(pState->mhSocket, 2, &Hdr, sizeof(Hdr), pvBuf, (size_t)Hdr.cb);
+        int rc = RTTcpSgWriteL(teleporterTcpStreamSocket(pState), 2, &Hdr, sizeof(Hdr), pvBuf, (size_t)Hdr.cb);
         if (RT_FAILURE(rc))
         {
-            LogRel(("Teleporter/TCP: Write error: %Rrc (cb=%#x)\n", rc, Hdr.cb));
+            LogRel(("Teleporter/TCP: Write error: %Rrc (cb=%#x, stream #%u)\n", rc, Hdr.cb, pState->miStream));
             return rc;
         }
+        teleporterTcpNextStream(pState);
         pState->moffStream += Hdr.cb;
         if (Hdr.cb == cbToWrite)
             return VINF_SUCCESS;
@@ -352,7 +505,7 @@ static int teleporterTcpReadSelect(TeleporterState *pState)
     int rc;
     do
     {
-        rc = RTTcpSelectOne(pState->mhSocket, 1000);
+        rc = RTTcpSelectOne(teleporterTcpStreamSocket(pState), 1000);
         if (RT_FAILURE(rc) && rc != VERR_TIMEOUT)
         {
             pState->mfIOError = true;
@@ -401,7 +554,7 @@ static DECLCALLBACK(int) teleporterTcpOpRead(void *pvUser, uint64_t offStream, v
             if (RT_FAILURE(rc))
                 return rc;
             TELEPORTERTCPHDR Hdr;
-            rc = RTTcpRead(pState->mhSocket, &Hdr, sizeof(Hdr), NULL);
+            rc = RTTcpRead(teleporterTcpStreamSocket(pState), &Hdr, sizeof(Hdr), NULL);
             if (RT_FAILURE(rc))
             {
                 pState->mfIOError = true;
@@ -439,11 +592,11 @@ static DECLCALLBACK(int) teleporterTcpOpRead(void *pvUser, uint64_t offStream, v
         if (RT_FAILURE(rc))
             return rc;
         uint32_t cb = (uint32_t)RT_MIN(pState->mcbReadBlock, cbToRead);
-        rc = RTTcpRead(pState->mhSocket, pvBuf, cb, pcbRead);
+        rc = RTTcpRead(teleporterTcpStreamSocket(pState), pvBuf, cb, pcbRead);
         if (RT_FAILURE(rc))
         {
             pState->mfIOError = true;
-            LogRel(("Teleporter/TCP: Data read error: %Rrc (cb=%#x)\n", rc, cb));
+            LogRel(("Teleporter/TCP: Data read error: %Rrc (cb=%#x, stream #%u)\n", rc, cb, pState->miStream));
             return rc;
         }
         if (pcbRead)
@@ -451,10 +604,14 @@ static DECLCALLBACK(int) teleporterTcpOpRead(void *pvUser, uint64_t offStream, v
             cb = (uint32_t)*pcbRead;
             pState->moffStream   += cb;
             pState->mcbReadBlock -= cb;
+            if (!pState->mcbReadBlock)
+                teleporterTcpNextStream(pState);
             return VINF_SUCCESS;
         }
         pState->moffStream   += cb;
         pState->mcbReadBlock -= cb;
+        if (!pState->mcbReadBlock)
+            teleporterTcpNextStream(pState);
         if (cbToRead == cb)
             return VINF_SUCCESS;
 
@@ -533,7 +690,7 @@ static DECLCALLBACK(int) teleporterTcpOpClose(void *pvUser, bool fCanceled)
         TELEPORTERTCPHDR EofHdr;
         EofHdr.u32Magic = TELEPORTERTCPHDR_MAGIC;
         EofHdr.cb       = fCanceled ? UINT32_MAX : 0;
-        int rc = RTTcpWrite(pState->mhSocket, &EofHdr, sizeof(EofHdr));
+        int rc = RTTcpWrite(teleporterTcpStreamSocket(pState), &EofHdr, sizeof(EofHdr));
         if (RT_FAILURE(rc))
         {
             LogRel(("Teleporter/TCP: EOF Header write error: %Rrc\n", rc));
@@ -617,6 +774,167 @@ static DECLCALLBACK(void) teleporterDstTimeout(RTTIMERLR hTimerLR, void *pvUser,
 }
 
 
+/**
+ * Opens additional connections to the destination.
+ *
+ * The destination replies to the command with the port to connect to and a
+ * cookie which each new connection must present, then ACKs once all the
+ * connections are in.
+ *
+ * @returns S_OK on success, E_FAIL+setError() on failure.
+ * @param   pState              The teleporter source state.
+ * @param   pszCommand          The command requesting the connections.
+ * @param   pszReply            The reply tag preceding the port and cookie.
+ * @param   cSockets            The number of connections to open.
+ * @param   pahSockets          Where to return the connections.
+ *
+ * @remarks The caller closes the connections.
+ */
+HRESULT Console::i_teleporterSrcConnectExtra(TeleporterStateSrc *pState, const char *pszCommand, const char *pszReply,
+                                             uint32_t cSockets, PRTSOCKET pahSockets)
+{
+    HRESULT hrc = i_teleporterSrcSubmitCommand(pState, pszCommand, false /*fWaitForAck*/);
+    if (FAILED(hrc))
+        return hrc;
+
+    char szLine[128];
+    int vrc = teleporterTcpReadLine(pState, szLine, sizeof(szLine));
+    if (RT_FAILURE(vrc))
+        return setError(E_FAIL, tr("Failed reading the %s reply: %Rrc"), pszCommand, vrc);
+    size_t const cchReply = strlen(pszReply);
+    if (   strncmp(szLine, pszReply, cchReply)
+        || szLine[cchReply] != '=')
+        return setError(E_FAIL, tr("%s: Expected %s, got '%s'"), pszCommand, pszReply, szLine);
+
+    char    *pszCookie;
+    uint16_t uPort;
+    vrc = RTStrToUInt16Ex(&szLine[cchReply + 1], &pszCookie, 10, &uPort);
+    if (   vrc != VWRN_TRAILING_CHARS
+        || *pszCookie != ';'
+        || !pszCookie[1])
+        return setError(E_FAIL, tr("%s: Malformed reply '%s'"), pszCommand, szLine);
+    pszCookie++;
+    size_t const cchCookie = strlen(pszCookie);
+
+    for (uint32_t i = 0; i < cSockets; i++)
+    {
+        vrc = RTTcpClientConnect(pState->mstrHostname.c_str(), uPort, &pahSockets[i]);
+        if (RT_FAILURE(vrc))
+            return setError(E_FAIL, tr("%s: Failed to connect #%u to port %u on '%s': %Rrc"),
+                            pszCommand, i, uPort, pState->mstrHostname.c_str(), vrc);
+        vrc = RTTcpSetSendCoalescing(pahSockets[i], false /*fEnable*/);
+        AssertRC(vrc);
+        vrc = RTTcpSgWriteL(pahSockets[i], 2, pszCookie, cchCookie, "\n", sizeof("\n") - 1);
+        if (RT_FAILURE(vrc))
+            return setError(E_FAIL, tr("%s: Failed to send the cookie on #%u: %Rrc"), pszCommand, i, vrc);
+    }
+
+    return i_teleporterSrcReadACK(pState, pszCommand);
+}
+
+
+/**
+ * Sends the RAM pages left out of the saved state after the hand over.
+ *
+ * Pages requested by the destination are sent first, the rest are pushed in
+ * address order.
+ *
+ * @returns S_OK on success, E_FAIL+setError() on failure.
+ * @param   pState              The teleporter source state.
+ */
+HRESULT Console::i_teleporterSrcPostCopy(TeleporterStateSrc *pState)
+{
+    RTSOCKET const  hSocket   = pState->mhPostCopySocket;
+    uint32_t const  cPages    = PGMR3PostCopySrcPagesLeft(pState->mpUVM);
+    uint32_t        cRequests = 0;
+    LogRel(("Teleporter: Post-copy: Sending %u pages\n", cPages));
+
+    uint8_t *pbPage = (uint8_t *)RTMemTmpAlloc(PAGE_SIZE);
+    if (!pbPage)
+        return setError(E_OUTOFMEMORY, tr("Out of memory"));
+
+    TELEPORTERPOSTCOPYHDR Hdr;
+    int vrc;
+    for (;;)
+    {
+        RTGCPHYS GCPhys;
+        vrc = RTTcpSelectOne(hSocket, 0);
+        if (RT_SUCCESS(vrc))
+        {
+            vrc = RTTcpRead(hSocket, &Hdr, sizeof(Hdr), NULL);
+            if (RT_FAILURE(vrc))
+                break;
+            if (   Hdr.u32Magic != TELEPORTERPOSTCOPYHDR_MAGIC
+                || Hdr.u32Type  != TELEPORTERPOSTCOPYHDR_TYPE_REQUEST)
+            {
+                LogRel(("Teleporter: Post-copy: Bad message %#x/%#x\n", Hdr.u32Magic, Hdr.u32Type));
+                vrc = VERR_INVALID_MAGIC;
+                break;
+            }
+            GCPhys = Hdr.u64GCPhys;
+            vrc = PGMR3PostCopySrcGetPage(pState->mpUVM, GCPhys, pbPage);
+            if (vrc == VERR_NOT_FOUND)
+                continue; /* Already sent. */
+            cRequests++;
+        }
+        else if (vrc == VERR_TIMEOUT)
+        {
+            vrc = PGMR3PostCopySrcNextPage(pState->mpUVM, &GCPhys);
+            if (vrc == VERR_NOT_FOUND)
+            {
+                vrc = VINF_SUCCESS;
+                break;
+            }
+            if (RT_SUCCESS(vrc))
+                vrc = PGMR3PostCopySrcGetPage(pState->mpUVM, GCPhys, pbPage);
+        }
+        if (RT_FAILURE(vrc))
+            break;
+
+        Hdr.u32Magic  = TELEPORTERPOSTCOPYHDR_MAGIC;
+        Hdr.u32Type   = TELEPORTERPOSTCOPYHDR_TYPE_PAGE;
+        Hdr.u64GCPhys = GCPhys;
+        vrc = RTTcpSgWriteL(hSocket, 2, &Hdr, sizeof(Hdr), pbPage, (size_t)PAGE_SIZE);
+        if (RT_FAILURE(vrc))
+            break;
+    }
+    RTMemTmpFree(pbPage);
+
+    /*
+     * Tell the destination we're done and wait for it to confirm that it got
+     * everything.  Requests still in flight are ignored.
+     */
+    if (RT_SUCCESS(vrc))
+    {
+        Hdr.u32Magic  = TELEPORTERPOSTCOPYHDR_MAGIC;
+        Hdr.u32Type   = TELEPORTERPOSTCOPYHDR_TYPE_END;
+        Hdr.u64GCPhys = 0;
+        vrc = RTTcpWrite(hSocket, &Hdr, sizeof(Hdr));
+        while (RT_SUCCESS(vrc))
+        {
+            vrc = RTTcpSelectOne(hSocket, 30000);
+            if (RT_SUCCESS(vrc))
+                vrc = RTTcpRead(hSocket, &Hdr, sizeof(Hdr), NULL);
+            if (RT_SUCCESS(vrc))
+            {
+                if (Hdr.u32Magic != TELEPORTERPOSTCOPYHDR_MAGIC)
+                    vrc = VERR_INVALID_MAGIC;
+                else if (Hdr.u32Type == TELEPORTERPOSTCOPYHDR_TYPE_DONE)
+                    break;
+                else if (Hdr.u32Type != TELEPORTERPOSTCOPYHDR_TYPE_REQUEST)
+                    vrc = VERR_INVALID_PARAMETER;
+            }
+        }
+    }
+    if (RT_FAILURE(vrc))
+        return setError(E_FAIL, tr("Post-copy failed with %u of %u pages left: %Rrc"),
+                        PGMR3PostCopySrcPagesLeft(pState->mpUVM), cPages, vrc);
+
+    LogRel(("Teleporter: Post-copy: Sent %u pages, %u on request\n", cPages, cRequests));
+    return S_OK;
+}
+
+
 /**
  * Do the teleporter.
  *
@@ -671,6 +989,34 @@ HRESULT Console::i_teleporterSrc(TeleporterStateSrc *pState)
     if (FAILED(hrc))
         return hrc;
 
+    /*
+     * Open additional connections to stripe the state over if configured.
+     * (Only older destinations will NACK this and drop the connection.)
+     */
+    if (pState->mcStreams > 1)
+    {
+        char szCmd[32];
+        RTStrPrintf(szCmd, sizeof(szCmd), "streams=%u", pState->mcStreams);
+        hrc = i_teleporterSrcConnectExtra(pState, szCmd, "STREAMS", pState->mcStreams - 1, &pState->mahStreams[1]);
+        if (FAILED(hrc))
+            return hrc;
+        LogRel(("Teleporter: Using %u streams\n", pState->mcStreams));
+    }
+
+    /*
+     * Same for the post-copy connection.  The pages left out of the saved
+     * state are sent over it once the VM has been handed over.
+     */
+    if (pState->mfPostCopy)
+    {
+        hrc = i_teleporterSrcConnectExtra(pState, "post-copy", "POST-COPY", 1, &pState->mhPostCopySocket);
+        if (FAILED(hrc))
+            return hrc;
+        vrc = PGMR3PostCopySrcEnable(pState->mpUVM);
+        if (RT_FAILURE(vrc))
+            return setError(E_FAIL, tr("PGMR3PostCopySrcEnable -> %Rrc"), vrc);
+    }
+
     /*
      * Start loading the state.
      *
@@ -682,6 +1028,7 @@ HRESULT Console::i_teleporterSrc(TeleporterStateSrc *pState)
     if (FAILED(hrc))
         return hrc;
 
+    pState->miStream = 0;
     RTSocketRetain(pState->mhSocket);
     void *pvUser = static_cast<void *>(static_cast<TeleporterState *>(pState));
     vrc = VMR3Teleport(pState->mpUVM,
@@ -741,6 +1088,21 @@ HRESULT Console::i_teleporterSrc(TeleporterStateSrc *pState)
     if (FAILED(hrc))
         return hrc;
 
+    /*
+     * Send the pages left out of the saved state.  The destination owns the
+     * VM now, so a failure here doesn't stop us from powering off.
+     */
+    if (   pState->mfPostCopy
+        && PGMR3PostCopySrcPagesLeft(pState->mpUVM) > 0)
+    {
+        hrc = i_teleporterSrcPostCopy(pState);
+        if (FAILED(hrc))
+        {
+            pState->mstrPostCopyError = com::ErrorInfo().getText();
+            LogRel(("Teleporter: %s\n", pState->mstrPostCopyError.c_str()));
+        }
+    }
+
     /*
      * teleporterSrcThreadWrapper will do the automatic power off because it
      * has to release the AutoVMCaller.
@@ -772,11 +1134,24 @@ Console::i_teleporterSrcThreadWrapper(RTTHREAD hThread, void *pvUser)
         hrc = pState->mptrConsole->i_teleporterSrc(pState);
 
     /* Close the connection ASAP on so that the other side can complete. */
+    for (unsigned i = 1; i < RT_ELEMENTS(pState->mahStreams); i++)
+        if (pState->mahStreams[i] != NIL_RTSOCKET)
+        {
+            RTTcpClientClose(pState->mahStreams[i]);
+            pState->mahStreams[i] = NIL_RTSOCKET;
+        }
+    if (pState->mhPostCopySocket != NIL_RTSOCKET)
+    {
+        RTTcpClientClose(pState->mhPostCopySocket);
+        pState->mhPostCopySocket = NIL_RTSOCKET;
+    }
     if (pState->mhSocket != NIL_RTSOCKET)
     {
         RTTcpClientClose(pState->mhSocket);
         pState->mhSocket = NIL_RTSOCKET;
     }
+    if (pState->mfPostCopy)
+        PGMR3PostCopySrcDisable(pState->mpUVM);
 
     /* Aaarg! setMachineState trashes error info on Windows, so we have to
        complete things here on failure instead of right before cleanup. */
@@ -817,7 +1192,11 @@ Console::i_teleporterSrcThreadWrapper(RTTHREAD hThread, void *pvUser)
         autoLock.acquire();
         pState->mptrConsole->mVMIsAlreadyPoweringOff = false;
 
-        pState->mptrProgress->i_notifyComplete(hrc);
+        if (SUCCEEDED(hrc) && pState->mstrPostCopyError.isNotEmpty())
+            pState->mptrProgress->i_notifyComplete(E_FAIL, COM_IIDOF(IConsole), Console::getStaticComponentName(),
+                                                   "%s", pState->mstrPostCopyError.c_str());
+        else
+            pState->mptrProgress->i_notifyComplete(hrc);
     }
     else
     {
@@ -982,6 +1361,22 @@ HRESULT Console::teleport(const com::Utf8Str &aHostname, ULONG aTcpport, const c
     pState->muPort          = aTcpport;
     pState->mcMsMaxDowntime = aMaxDowntime;
 
+    /* Striping the stream over several connections is opt-in as older
+       destinations do not know the command. */
+    Bstr bstrStreams;
+    hrc = mMachine->GetExtraData(Bstr("VBoxInternal2/TeleporterStreams").raw(), bstrStreams.asOutParam());
+    if (SUCCEEDED(hrc) && !bstrStreams.isEmpty())
+    {
+        uint32_t cStreams = Utf8Str(bstrStreams).toUInt32();
+        pState->mcStreams = RT_MAX(RT_MIN(cStreams, (uint32_t)TELEPORTER_MAX_STREAMS), 1U);
+    }
+
+    /* Ditto for post-copy. */
+    Bstr bstrPostCopy;
+    hrc = mMachine->GetExtraData(Bstr("VBoxInternal2/TeleporterPostCopy").raw(), bstrPostCopy.asOutParam());
+    if (SUCCEEDED(hrc))
+        pState->mfPostCopy = Utf8Str(bstrPostCopy) == "1";
+
     void *pvUser = static_cast<void *>(static_cast<TeleporterState *>(pState));
     ptrProgress->i_setCancelCallback(teleporterProgressCancelCallback, pvUser);
 
@@ -1103,6 +1498,7 @@ HRESULT Console::i_teleporterTrg(PUVM pUVM, IMachine *pMachine, Utf8Str *pErrorM
              */
             TeleporterStateTrg theState(this, pUVM, pProgress, pMachine, mControl, &hTimerLR, fStartPaused);
             theState.mstrPassword      = strPassword;
+            theState.mstrAddress       = strAddress;
             theState.mhServer          = hServer;
 
             void *pvUser = static_cast<void *>(static_cast<TeleporterState *>(&theState));
@@ -1241,6 +1637,373 @@ static int teleporterTcpWriteNACK(TeleporterStateTrg *pState, int32_t rc2, const
 }
 
 
+/**
+ * Accepts additional connections from the source.
+ *
+ * Replies with the port to connect to and a cookie which each connection
+ * must present.  The caller ACKs or NACKs.
+ *
+ * @returns VBox status code.
+ * @param   pState              The teleporter destination state.
+ * @param   pszReply            The reply tag preceding the port and cookie.
+ * @param   cSockets            The number of connections to accept.
+ * @param   pahSockets          Where to return the connections.
+ */
+static int teleporterTrgAcceptExtra(TeleporterStateTrg *pState, const char *pszReply, uint32_t cSockets, PRTSOCKET pahSockets)
+{
+    /*
+     * Listen on a random port for the new connections.
+     */
+    const char  *pszAddress = pState->mstrAddress.isEmpty() ? NULL : pState->mstrAddress.c_str();
+    PRTTCPSERVER hServer;
+    uint32_t     uPort;
+    unsigned     cTries = 0;
+    int          vrc;
+    do
+    {
+        uPort = RTRandU32Ex(49152, 65534);
+        vrc = RTTcpServerCreateEx(pszAddress, uPort, &hServer);
+    } while (vrc == VERR_NET_ADDRESS_IN_USE && ++cTries < 64);
+    if (RT_FAILURE(vrc))
+    {
+        LogRel(("Teleporter: RTTcpServerCreateEx failed for %s: %Rrc\n", pszReply, vrc));
+        return vrc;
+    }
+
+    /* Shut down the server if the connections do not show up in time. */
+    RTTIMERLR hTimerLR;
+    vrc = RTTimerLRCreateEx(&hTimerLR, 0 /*ns*/, RTTIMER_FLAGS_CPU_ANY, teleporterDstTimeout, hServer);
+    if (RT_SUCCESS(vrc))
+    {
+        vrc = RTTimerLRStart(hTimerLR, 30*UINT64_C(1000000000) /*ns*/);
+        if (RT_SUCCESS(vrc))
+        {
+            char szCookie[32];
+            RTStrPrintf(szCookie, sizeof(szCookie), "%016RX64", RTRandU64());
+            char szReply[64];
+            size_t cch = RTStrPrintf(szReply, sizeof(szReply), "%s=%u;%s\n", pszReply, uPort, szCookie);
+            vrc = RTTcpWrite(pState->mhSocket, szReply, cch);
+
+            for (uint32_t i = 0; i < cSockets && RT_SUCCESS(vrc); i++)
+            {
+                vrc = RTTcpServerListen2(hServer, &pahSockets[i]);
+                if (RT_FAILURE(vrc))
+                {
+                    LogRel(("Teleporter: Failed to accept %s #%u: %Rrc\n", pszReply, i, vrc));
+                    break;
+                }
+                vrc = RTTcpSetSendCoalescing(pahSockets[i], false /*fEnable*/);
+                AssertRC(vrc);
+
+                char szLine[sizeof(szCookie)];
+                vrc = RTTcpSelectOne(pahSockets[i], 30000);
+                if (RT_SUCCESS(vrc))
+                    vrc = teleporterTcpReadLineFrom(pahSockets[i], szLine, sizeof(szLine));
+                if (RT_SUCCESS(vrc) && strcmp(szLine, szCookie))
+                {
+                    LogRel(("Teleporter: Bad cookie on %s #%u\n", pszReply, i));
+                    vrc = VERR_AUTHENTICATION_FAILURE;
+                }
+                else if (RT_FAILURE(vrc))
+                    LogRel(("Teleporter: Failed to read the cookie on %s #%u: %Rrc\n", pszReply, i, vrc));
+            }
+        }
+        RTTimerLRDestroy(hTimerLR);
+    }
+    RTTcpServerDestroy(hServer);
+    return vrc;
+}
+
+
+/**
+ * Handles the streams command, accepting the additional connections the
+ * saved state stream is striped over.
+ *
+ * @returns VBox status code, failures are NACKed.
+ * @param   pState              The teleporter destination state.
+ * @param   pszCount            The requested number of connections.
+ */
+static int teleporterTrgOpenStreams(TeleporterStateTrg *pState, const char *pszCount)
+{
+    uint32_t cStreams;
+    int vrc = RTStrToUInt32Full(pszCount, 10, &cStreams);
+    if (   vrc != VINF_SUCCESS
+        || cStreams < 2
+        || cStreams > TELEPORTER_MAX_STREAMS
+        || pState->mcStreams != 1)
+    {
+        LogRel(("Teleporter: Invalid streams command '%s' (cStreams=%u)\n", pszCount, pState->mcStreams));
+        vrc = VERR_INVALID_PARAMETER;
+        teleporterTcpWriteNACK(pState, vrc);
+        return vrc;
+    }
+
+    vrc = teleporterTrgAcceptExtra(pState, "STREAMS", cStreams - 1, &pState->mahStreams[1]);
+    if (RT_FAILURE(vrc))
+    {
+        teleporterTcpWriteNACK(pState, vrc);
+        return vrc;
+    }
+
+    pState->mcStreams = cStreams;
+    LogRel(("Teleporter: Using %u streams\n", cStreams));
+    return teleporterTcpWriteACK(pState);
+}
+
+
+/**
+ * Handles the post-copy command, accepting the connection the pages left out
+ * of the saved state are sent over after the hand over.
+ *
+ * @returns VBox status code, failures are NACKed.
+ * @param   pState              The teleporter destination state.
+ */
+static int teleporterTrgOpenPostCopy(TeleporterStateTrg *pState)
+{
+    int vrc;
+    if (pState->mhPostCopySocket == NIL_RTSOCKET)
+        vrc = teleporterTrgAcceptExtra(pState, "POST-COPY", 1, &pState->mhPostCopySocket);
+    else
+        vrc = VERR_WRONG_ORDER;
+    if (RT_FAILURE(vrc))
+    {
+        teleporterTcpWriteNACK(pState, vrc);
+        return vrc;
+    }
+    LogRel(("Teleporter: Post-copy connection established\n"));
+    return teleporterTcpWriteACK(pState);
+}
+
+
+/**
+ * @callback_method_impl{FNPGMPOSTCOPYREQUEST,
+ *      Queues the request for the receiver thread.}
+ */
+static DECLCALLBACK(int) teleporterTrgPostCopyRequest(PUVM pUVM, RTGCPHYS GCPhys, void *pvUser)
+{
+    TeleporterPostCopyTrg *pThis = (TeleporterPostCopyTrg *)pvUser;
+    NOREF(pUVM);
+
+    /* The queue grows as needed, the caller retries if we fail. */
+    int vrc = VINF_SUCCESS;
+    RTCritSectEnter(&pThis->mCritSect);
+    if (pThis->mcRequests >= pThis->mcRequestsMax)
+    {
+        uint32_t const cNew = pThis->mcRequestsMax + 64;
+        RTGCPHYS *paNew = (RTGCPHYS *)RTMemRealloc(pThis->mpaRequests, cNew * sizeof(RTGCPHYS));
+        if (paNew)
+        {
+            pThis->mpaRequests   = paNew;
+            pThis->mcRequestsMax = cNew;
+        }
+        else
+            vrc = VERR_NO_MEMORY;
+    }
+    if (RT_SUCCESS(vrc))
+        pThis->mpaRequests[pThis->mcRequests++] = GCPhys;
+    RTCritSectLeave(&pThis->mCritSect);
+    return vrc;
+}
+
+
+/**
+ * Checks whether the VM is going or gone, in which case the receiver thread
+ * should give up.
+ *
+ * @returns true if it is, false if not.
+ * @param   pUVM                The user mode VM handle.
+ */
+static bool teleporterTrgIsVMOff(PUVM pUVM)
+{
+    switch (VMR3GetStateU(pUVM))
+    {
+        case VMSTATE_POWERING_OFF:
+        case VMSTATE_POWERING_OFF_LS:
+        case VMSTATE_OFF:
+        case VMSTATE_OFF_LS:
+        case VMSTATE_DESTROYING:
+        case VMSTATE_TERMINATED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/**
+ * Receives the RAM pages left out of the saved state while the VM runs.
+ *
+ * The VM is powered off if the connection fails since it cannot go on with
+ * parts of its memory missing.
+ *
+ * @returns VINF_SUCCESS (ignored).
+ * @param   hThread             The thread.
+ * @param   pvUser              Pointer to a TeleporterPostCopyTrg instance.
+ */
+static DECLCALLBACK(int) teleporterTrgPostCopyThread(RTTHREAD hThread, void *pvUser)
+{
+    TeleporterPostCopyTrg *pThis = (TeleporterPostCopyTrg *)pvUser;
+    RTSOCKET const         hSocket = pThis->mhSocket;
+    NOREF(hThread);
+
+    RTGCPHYS *paRequests    = NULL;
+    uint32_t  cRequestsMax  = 0;
+    uint8_t  *pbPage        = (uint8_t *)RTMemTmpAlloc(PAGE_SIZE);
+    int vrc = pbPage ? VINF_SUCCESS : VERR_NO_TMP_MEMORY;
+    while (RT_SUCCESS(vrc))
+    {
+        if (teleporterTrgIsVMOff(pThis->mpUVM))
+        {
+            vrc = VERR_VM_INVALID_VM_STATE;
+            break;
+        }
+
+        /*
+         * Pass on the requests, swapping queues with the request callback.
+         */
+        RTCritSectEnter(&pThis->mCritSect);
+        RTGCPHYS * const paQueued   = pThis->mpaRequests;
+        uint32_t const   cQueuedMax = pThis->mcRequestsMax;
+        uint32_t const   cRequests  = pThis->mcRequests;
+        pThis->mpaRequests   = paRequests;
+        pThis->mcRequestsMax = cRequestsMax;
+        pThis->mcRequests    = 0;
+        RTCritSectLeave(&pThis->mCritSect);
+        paRequests   = paQueued;
+        cRequestsMax = cQueuedMax;
+
+        TELEPORTERPOSTCOPYHDR Hdr;
+        for (uint32_t i = 0; i < cRequests && RT_SUCCESS(vrc); i++)
+        {
+            Hdr.u32Magic  = TELEPORTERPOSTCOPYHDR_MAGIC;
+            Hdr.u32Type   = TELEPORTERPOSTCOPYHDR_TYPE_REQUEST;
+            Hdr.u64GCPhys = paRequests[i];
+            vrc = RTTcpWrite(hSocket, &Hdr, sizeof(Hdr));
+        }
+        if (RT_FAILURE(vrc))
+            break;
+
+        /*
+         * Take the next message.  The short timeout keeps the request
+         * latency down, the source is normally pushing pages anyway.
+         */
+        vrc = RTTcpSelectOne(hSocket, 1);
+        if (vrc == VERR_TIMEOUT)
+        {
+            vrc = VINF_SUCCESS;
+            continue;
+        }
+        if (RT_SUCCESS(vrc))
+            vrc = RTTcpRead(hSocket, &Hdr, sizeof(Hdr), NULL);
+        if (RT_FAILURE(vrc))
+            break;
+        if (Hdr.u32Magic != TELEPORTERPOSTCOPYHDR_MAGIC)
+        {
+            LogRel(("Teleporter: Post-copy: Bad magic %#x\n", Hdr.u32Magic));
+            vrc = VERR_INVALID_MAGIC;
+        }
+        else if (Hdr.u32Type == TELEPORTERPOSTCOPYHDR_TYPE_PAGE)
+        {
+            vrc = RTTcpRead(hSocket, pbPage, PAGE_SIZE, NULL);
+            if (RT_SUCCESS(vrc))
+                vrc = PGMR3PostCopyTrgPutPage(pThis->mpUVM, Hdr.u64GCPhys, pbPage);
+        }
+        else if (Hdr.u32Type == TELEPORTERPOSTCOPYHDR_TYPE_END)
+        {
+            uint32_t const cPagesLeft = PGMR3PostCopyTrgPagesLeft(pThis->mpUVM);
+            if (cPagesLeft == 0)
+            {
+                Hdr.u32Type   = TELEPORTERPOSTCOPYHDR_TYPE_DONE;
+                Hdr.u64GCPhys = 0;
+                vrc = RTTcpWrite(hSocket, &Hdr, sizeof(Hdr));
+                if (RT_SUCCESS(vrc))
+                    break;
+            }
+            else
+            {
+                LogRel(("Teleporter: Post-copy: The source ended with %u pages missing\n", cPagesLeft));
+                vrc = VERR_MISSING;
+            }
+        }
+        else
+        {
+            LogRel(("Teleporter: Post-copy: Unexpected message type %#x\n", Hdr.u32Type));
+            vrc = VERR_INVALID_PARAMETER;
+        }
+    }
+    RTMemTmpFree(pbPage);
+    RTMemFree(paRequests);
+
+    /*
+     * Clean up.  On failure, give up on the missing pages and power off the
+     * VM unless it is already on its way out.  The request callback must be
+     * gone before pThis is, whatever the VM state, as long as PGM is still
+     * around to call it.
+     */
+    bool fPowerOff = false;
+    if (RT_SUCCESS(vrc))
+        LogRel(("Teleporter: Post-copy: Completed\n"));
+    else if (!teleporterTrgIsVMOff(pThis->mpUVM))
+    {
+        LogRel(("Teleporter: Post-copy: Failed with %Rrc, powering off the VM\n", vrc));
+        fPowerOff = true;
+    }
+    else
+        LogRel(("Teleporter: Post-copy: Stopped (%Rrc), the VM is off\n", vrc));
+
+    if (VMR3GetStateU(pThis->mpUVM) != VMSTATE_TERMINATED)
+    {
+        /* Release the threads blocked on pages which won't come anymore. */
+        if (RT_FAILURE(vrc))
+            PGMR3PostCopyTrgAbort(pThis->mpUVM);
+        PGMR3PostCopyTrgStart(pThis->mpUVM, NULL, NULL);
+    }
+
+    if (fPowerOff)
+    {
+        int vrc2 = VMR3PowerOff(pThis->mpUVM);
+        AssertLogRelRC(vrc2);
+    }
+
+    delete pThis;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Starts receiving the pages left out of the saved state, if any, before the
+ * VM is resumed.
+ *
+ * @returns VBox status code.
+ * @param   pState              The teleporter destination state.
+ */
+static int teleporterTrgStartPostCopy(TeleporterStateTrg *pState)
+{
+    if (   pState->mhPostCopySocket == NIL_RTSOCKET
+        || PGMR3PostCopyTrgPagesLeft(pState->mpUVM) == 0)
+        return VINF_SUCCESS;
+
+    TeleporterPostCopyTrg *pPostCopy = new TeleporterPostCopyTrg(pState->mpUVM, pState->mhPostCopySocket);
+    pState->mhPostCopySocket = NIL_RTSOCKET;
+
+    int vrc = PGMR3PostCopyTrgStart(pState->mpUVM, teleporterTrgPostCopyRequest, pPostCopy);
+    if (RT_SUCCESS(vrc))
+    {
+        vrc = RTThreadCreate(NULL, teleporterTrgPostCopyThread, pPostCopy, 0 /*cbStack*/,
+                             RTTHREADTYPE_IO, 0 /*fFlags*/, "TeleportPC");
+        if (RT_SUCCESS(vrc))
+        {
+            LogRel(("Teleporter: Post-copy: Waiting for %u pages\n", PGMR3PostCopyTrgPagesLeft(pState->mpUVM)));
+            return VINF_SUCCESS;
+        }
+        PGMR3PostCopyTrgStart(pState->mpUVM, NULL, NULL);
+    }
+    LogRel(("Teleporter: Failed to start post-copy: %Rrc\n", vrc));
+    delete pPostCopy;
+    return vrc;
+}
+
+
 /**
  * @copydoc FNRTTCPSERVE
  *
@@ -1338,6 +2101,7 @@ Console::i_teleporterTrgServeConnection(RTSOCKET Sock, void *pvUser)
                                            Console::i_genericVMSetErrorCallback, &pState->mErrorText); AssertRC(vrc2);
             RTSocketRetain(pState->mhSocket); /* For concurrent access by I/O thread and EMT. */
             pState->moffStream = 0;
+            pState->miStream   = 0;
 
             void *pvUser2 = static_cast<void *>(static_cast<TeleporterState *>(pState));
             vrc = VMR3LoadFromStream(pState->mpUVM,
@@ -1368,6 +2132,10 @@ Console::i_teleporterTrgServeConnection(RTSOCKET Sock, void *pvUser)
 
             vrc = teleporterTcpWriteACK(pState);
         }
+        else if (!strncmp(szCmd, RT_STR_TUPLE("streams=")))
+            vrc = teleporterTrgOpenStreams(pState, &szCmd[sizeof("streams=") - 1]);
+        else if (!strcmp(szCmd, "post-copy"))
+            vrc = teleporterTrgOpenPostCopy(pState);
         else if (!strcmp(szCmd, "cancel"))
         {
             /* Don't ACK this. */
@@ -1405,7 +2173,12 @@ Console::i_teleporterTrgServeConnection(RTSOCKET Sock, void *pvUser)
             if (   pState->mptrProgress->i_notifyPointOfNoReturn()
                 && pState->mfLockedMedia)
             {
-                vrc = teleporterTcpWriteACK(pState);
+                /* The missing pages must be on their way before the guest runs. */
+                vrc = teleporterTrgStartPostCopy(pState);
+                if (RT_SUCCESS(vrc))
+                    vrc = teleporterTcpWriteACK(pState);
+                else
+                    teleporterTcpWriteNACK(pState, vrc);
                 if (RT_SUCCESS(vrc))
                 {
                     if (!strcmp(szCmd, "hand-over-resume"))
@@ -1438,6 +2211,18 @@ Console::i_teleporterTrgServeConnection(RTSOCKET Sock, void *pvUser)
     if (RT_FAILURE(vrc))
         teleporterTrgUnlockMedia(pState);
 
+    for (unsigned i = 1; i < RT_ELEMENTS(pState->mahStreams); i++)
+        if (pState->mahStreams[i] != NIL_RTSOCKET)
+        {
+            RTTcpServerDisconnectClient2(pState->mahStreams[i]);
+            pState->mahStreams[i] = NIL_RTSOCKET;
+        }
+    if (pState->mhPostCopySocket != NIL_RTSOCKET)
+    {
+        RTTcpServerDisconnectClient2(pState->mhPostCopySocket);
+        pState->mhPostCopySocket = NIL_RTSOCKET;
+    }
+
     pState->mRc = vrc;
     pState->mhSocket = NIL_RTSOCKET;
     LogFlowFunc(("returns mRc=%Rrc\n", vrc));
@@ -33,8 +33,10 @@
 //#define RTZIP_USE_BZLIB 1
 #define RTZIP_USE_LZF 1
 #define RTZIP_LZF_BLOCK_BY_BLOCK
+#define RTZIP_USE_LZ4 1
 //#define RTZIP_USE_LZJB 1
 //#define RTZIP_USE_LZO 1
+//#define RTZIP_USE_ZSTD 1
 
 /** @todo FastLZ? QuickLZ? Others? */
 
@@ -58,6 +60,9 @@
 #ifdef RTZIP_USE_LZO
 # include <lzo/lzo1x.h>
 #endif
+#ifdef RTZIP_USE_ZSTD
+# include <zstd.h>
+#endif
 
 #include <iprt/zip.h>
 #include "internal/iprt.h"
@@ -113,6 +118,22 @@ typedef const RTZIPLZFHDR *PCRTZIPLZFHDR;
 
 #endif /* RTZIP_USE_LZF */
 
+#ifdef RTZIP_USE_LZ4
+/** Number of bits in the LZ4 match finder hash table index. */
+# define RTZIPLZ4_HASH_BITS                      12
+/** The minimum match length of the LZ4 block format. */
+# define RTZIPLZ4_MIN_MATCH                      4
+/** The max distance a LZ4 match can reference (16-bit offset). */
+# define RTZIPLZ4_MAX_DISTANCE                   65535
+/** The LZ4 block format requires the last 5 bytes to be literals. */
+# define RTZIPLZ4_LAST_LITERALS                  5
+/** The LZ4 block format requires the last match to start at least 12 bytes
+ *  before the end of the block. */
+# define RTZIPLZ4_MF_LIMIT                       12
+/** Blocks of this size or smaller are stored as literals only. */
+# define RTZIPLZ4_MIN_MATCH_INPUT                (RTZIPLZ4_MF_LIMIT + 1)
+#endif /* RTZIP_USE_LZ4 */
+
 
 /**
  * Compressor/Decompressor instance data.
@@ -1351,6 +1372,245 @@ static DECLCALLBACK(int) rtZipLZFDecompInit(PRTZIPDECOMP pZip)
 
 #endif /* RTZIP_USE_LZF */
 
+#ifdef RTZIP_USE_LZ4
+
+/**
+ * Reads an unaligned 32-bit value for the LZ4 match finder.
+ * @returns The value.
+ * @param   pb          Where to read.
+ */
+DECLINLINE(uint32_t) rtZipLz4Read32(const uint8_t *pb)
+{
+    uint32_t u32;
+    memcpy(&u32, pb, sizeof(u32));
+    return u32;
+}
+
+
+/**
+ * Hashes the 4 bytes at the current input position into the match table.
+ * @returns Hash table index.
+ * @param   u32         The 4 input bytes.
+ */
+DECLINLINE(uint32_t) rtZipLz4Hash(uint32_t u32)
+{
+    return (u32 * UINT32_C(2654435761)) >> (32 - RTZIPLZ4_HASH_BITS);
+}
+
+
+/**
+ * Encodes a LZ4 length that didn't fit into the token nibble.
+ * @returns Pointer to the byte following the encoded length.
+ * @param   pbDst       Where to write.
+ * @param   cb          The remaining length (i.e. minus 15).
+ */
+DECLINLINE(uint8_t *) rtZipLz4PutLength(uint8_t *pbDst, size_t cb)
+{
+    while (cb >= 255)
+    {
+        *pbDst++ = 255;
+        cb -= 255;
+    }
+    *pbDst++ = (uint8_t)cb;
+    return pbDst;
+}
+
+
+/**
+ * Compresses a block using the LZ4 block format.
+ *
+ * This is a greedy single pass compressor using a small hash table on the
+ * stack, i.e. the equivalent of the LZ4 "fast" mode.  The output is compatible
+ * with any other LZ4 block decoder.
+ *
+ * @returns The number of bytes written to pbDst, 0 if it doesn't fit.
+ * @param   pbSrc       The input data.
+ * @param   cbSrc       The size of the input data.
+ * @param   pbDst       The output buffer.
+ * @param   cbDst       The size of the output buffer.
+ */
+static size_t rtZipLz4CompressBlock(const uint8_t *pbSrc, size_t cbSrc, uint8_t *pbDst, size_t cbDst)
+{
+    uint8_t        *pbOut       = pbDst;
+    uint8_t * const pbOutEnd    = pbDst + cbDst;
+    const uint8_t  *pbAnchor    = pbSrc;
+    const uint8_t * const pbEnd = pbSrc + cbSrc;
+
+    if (cbSrc > RTZIPLZ4_MIN_MATCH_INPUT)
+    {
+        uint32_t        aoffHash[1 << RTZIPLZ4_HASH_BITS];
+        memset(aoffHash, 0, sizeof(aoffHash));
+
+        const uint8_t * const pbMatchLimit = pbEnd - RTZIPLZ4_LAST_LITERALS;
+        const uint8_t * const pbInLimit    = pbEnd - RTZIPLZ4_MF_LIMIT;
+        const uint8_t        *pbIn         = pbSrc + 1;
+        uint32_t              cMisses      = 0;
+        while (pbIn < pbInLimit)
+        {
+            uint32_t const  u32  = rtZipLz4Read32(pbIn);
+            uint32_t const  iHash = rtZipLz4Hash(u32);
+            const uint8_t  *pbRef = pbSrc + aoffHash[iHash];
+            aoffHash[iHash] = (uint32_t)(pbIn - pbSrc);
+            if (   pbIn - pbRef > RTZIPLZ4_MAX_DISTANCE
+                || rtZipLz4Read32(pbRef) != u32)
+            {
+                /* Skip faster and faster through incompressible data. */
+                pbIn += 1 + (cMisses++ >> 6);
+                continue;
+            }
+            cMisses = 0;
+
+            /* Extend the match backwards and forwards. */
+            while (pbIn > pbAnchor && pbRef > pbSrc && pbIn[-1] == pbRef[-1])
+                pbIn--, pbRef--;
+            const uint8_t *pbMatchEnd = pbIn + RTZIPLZ4_MIN_MATCH;
+            const uint8_t *pbRefEnd   = pbRef + RTZIPLZ4_MIN_MATCH;
+            while (pbMatchEnd < pbMatchLimit && *pbMatchEnd == *pbRefEnd)
+                pbMatchEnd++, pbRefEnd++;
+
+            /* Emit the sequence: token, literals, offset and match length. */
+            size_t const cLiterals = (size_t)(pbIn - pbAnchor);
+            size_t const cbMatch   = (size_t)(pbMatchEnd - pbIn) - RTZIPLZ4_MIN_MATCH;
+            if ((size_t)(pbOutEnd - pbOut) < 1 + cLiterals / 255 + 1 + cLiterals + 2 + cbMatch / 255 + 1)
+                return 0;
+
+            uint8_t *pbToken = pbOut++;
+            if (cLiterals >= 15)
+            {
+                *pbToken = 15 << 4;
+                pbOut = rtZipLz4PutLength(pbOut, cLiterals - 15);
+            }
+            else
+                *pbToken = (uint8_t)(cLiterals << 4);
+            memcpy(pbOut, pbAnchor, cLiterals);
+            pbOut += cLiterals;
+
+            uint16_t const offMatch = (uint16_t)(pbIn - pbRef);
+            *pbOut++ = (uint8_t)offMatch;
+            *pbOut++ = (uint8_t)(offMatch >> 8);
+
+            if (cbMatch >= 15)
+            {
+                *pbToken |= 15;
+                pbOut = rtZipLz4PutLength(pbOut, cbMatch - 15);
+            }
+            else
+                *pbToken |= (uint8_t)cbMatch;
+
+            pbIn = pbAnchor = pbMatchEnd;
+        }
+    }
+
+    /*
+     * The last sequence consists of literals only.
+     */
+    size_t const cLiterals = (size_t)(pbEnd - pbAnchor);
+    if ((size_t)(pbOutEnd - pbOut) < 1 + cLiterals / 255 + 1 + cLiterals)
+        return 0;
+    if (cLiterals >= 15)
+    {
+        *pbOut++ = 15 << 4;
+        pbOut = rtZipLz4PutLength(pbOut, cLiterals - 15);
+    }
+    else
+        *pbOut++ = (uint8_t)(cLiterals << 4);
+    memcpy(pbOut, pbAnchor, cLiterals);
+    pbOut += cLiterals;
+
+    return (size_t)(pbOut - pbDst);
+}
+
+
+/**
+ * Decompresses a block in the LZ4 block format.
+ *
+ * All lengths and offsets are validated, so this is safe to use on untrusted
+ * input.
+ *
+ * @returns iprt status code.
+ * @param   pbSrc           The compressed data.
+ * @param   cbSrc           The size of the compressed data.
+ * @param   pbDst           The output buffer.
+ * @param   cbDst           The size of the output buffer.
+ * @param   pcbDstActual    Where to return the number of bytes produced.
+ */
+static int rtZipLz4DecompressBlock(const uint8_t *pbSrc, size_t cbSrc, uint8_t *pbDst, size_t cbDst, size_t *pcbDstActual)
+{
+    const uint8_t        *pbIn     = pbSrc;
+    const uint8_t * const pbInEnd  = pbSrc + cbSrc;
+    uint8_t              *pbOut    = pbDst;
+    uint8_t * const       pbOutEnd = pbDst + cbDst;
+
+    for (;;)
+    {
+        if (RT_UNLIKELY(pbIn >= pbInEnd))
+            return VERR_ZIP_CORRUPTED;
+        uint8_t const bToken = *pbIn++;
+
+        /* Literals. */
+        size_t cLiterals = bToken >> 4;
+        if (cLiterals == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (RT_UNLIKELY(pbIn >= pbInEnd))
+                    return VERR_ZIP_CORRUPTED;
+                b = *pbIn++;
+                cLiterals += b;
+            } while (b == 255);
+        }
+        if (RT_UNLIKELY(cLiterals > (size_t)(pbInEnd - pbIn)))
+            return VERR_ZIP_CORRUPTED;
+        if (RT_UNLIKELY(cLiterals > (size_t)(pbOutEnd - pbOut)))
+            return VERR_BUFFER_OVERFLOW;
+        memcpy(pbOut, pbIn, cLiterals);
+        pbOut += cLiterals;
+        pbIn  += cLiterals;
+
+        /* The last sequence has no match part. */
+        if (pbIn == pbInEnd)
+            break;
+
+        /* Match. */
+        if (RT_UNLIKELY(pbInEnd - pbIn < 2))
+            return VERR_ZIP_CORRUPTED;
+        size_t const offMatch = pbIn[0] | ((size_t)pbIn[1] << 8);
+        pbIn += 2;
+        if (RT_UNLIKELY(offMatch == 0 || offMatch > (size_t)(pbOut - pbDst)))
+            return VERR_ZIP_CORRUPTED;
+
+        size_t cbMatch = bToken & 15;
+        if (cbMatch == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (RT_UNLIKELY(pbIn >= pbInEnd))
+                    return VERR_ZIP_CORRUPTED;
+                b = *pbIn++;
+                cbMatch += b;
+            } while (b == 255);
+        }
+        cbMatch += RTZIPLZ4_MIN_MATCH;
+        if (RT_UNLIKELY(cbMatch > (size_t)(pbOutEnd - pbOut)))
+            return VERR_BUFFER_OVERFLOW;
+
+        const uint8_t *pbRef = pbOut - offMatch;
+        if (offMatch >= cbMatch)
+            memcpy(pbOut, pbRef, cbMatch);
+        else
+            for (size_t i = 0; i < cbMatch; i++) /* overlapping, i.e. a run */
+                pbOut[i] = pbRef[i];
+        pbOut += cbMatch;
+    }
+
+    *pcbDstActual = (size_t)(pbOut - pbDst);
+    return VINF_SUCCESS;
+}
+
+#endif /* RTZIP_USE_LZ4 */
+
 
 /**
  * Create a compressor instance.
@@ -1440,6 +1700,8 @@ RTDECL(int)     RTZipCompCreate(PRTZIPCOMP *ppZip, void *pvUser, PFNRTZIPOUT pfn
 
         case RTZIPTYPE_LZJB:
         case RTZIPTYPE_LZO:
+        case RTZIPTYPE_LZ4:
+        case RTZIPTYPE_ZSTD:
             break;
 
         default:
@@ -1639,6 +1901,18 @@ static int rtzipDecompInit(PRTZIPDECOMP pZip)
 #endif
             break;
 
+        case RTZIPTYPE_LZ4:
+            AssertMsgFailed(("LZ4 streaming support is not implemented yet!\n"));
+            break;
+
+        case RTZIPTYPE_ZSTD:
+#ifdef RTZIP_USE_ZSTD
+            AssertMsgFailed(("Zstandard streaming support is not implemented yet!\n"));
+#else
+            AssertMsgFailed(("Zstandard is not include in this build!\n"));
+#endif
+            break;
+
         default:
             AssertMsgFailed(("Invalid compression type %d (%#x)!\n", pZip->enmType, pZip->enmType));
             rc = VERR_INVALID_MAGIC;
@@ -1817,6 +2091,37 @@ RTDECL(int) RTZipBlockCompress(RTZIPTYPE enmType, RTZIPLEVEL enmLevel, uint32_t
 #endif
         }
 
+        case RTZIPTYPE_LZ4:
+        {
+#ifdef RTZIP_USE_LZ4
+            size_t cbDstActual = rtZipLz4CompressBlock((const uint8_t *)pvSrc, cbSrc, (uint8_t *)pvDst, cbDst);
+            if (RT_UNLIKELY(cbDstActual < 1))
+                return VERR_BUFFER_OVERFLOW;
+            *pcbDstActual = cbDstActual;
+            break;
+#else
+            return VERR_NOT_SUPPORTED;
+#endif
+        }
+
+        case RTZIPTYPE_ZSTD:
+        {
+#ifdef RTZIP_USE_ZSTD
+            int iLevel = enmLevel == RTZIPLEVEL_FAST ? 1 : enmLevel == RTZIPLEVEL_MAX ? 19 : 3;
+            size_t cbDstActual = ZSTD_compress(pvDst, cbDst, pvSrc, cbSrc, iLevel);
+            if (RT_UNLIKELY(ZSTD_isError(cbDstActual)))
+                switch (ZSTD_getErrorCode(cbDstActual))
+                {
+                    case ZSTD_error_dstSize_tooSmall:   return VERR_BUFFER_OVERFLOW;
+                    default:                            return VERR_GENERAL_FAILURE;
+                }
+            *pcbDstActual = cbDstActual;
+            break;
+#else
+            return VERR_NOT_SUPPORTED;
+#endif
+        }
+
         case RTZIPTYPE_ZLIB:
         case RTZIPTYPE_BZLIB:
             return VERR_NOT_SUPPORTED;
@@ -1973,6 +2278,43 @@ RTDECL(int) RTZipBlockDecompress(RTZIPTYPE enmType, uint32_t fFlags,
 #endif
         }
 
+        case RTZIPTYPE_LZ4:
+        {
+#ifdef RTZIP_USE_LZ4
+            size_t cbDstActual;
+            int rc = rtZipLz4DecompressBlock((const uint8_t *)pvSrc, cbSrc, (uint8_t *)pvDst, cbDst, &cbDstActual);
+            if (RT_FAILURE(rc))
+                return rc;
+            if (pcbDstActual)
+                *pcbDstActual = cbDstActual;
+            if (pcbSrcActual)
+                *pcbSrcActual = cbSrc;
+            break;
+#else
+            return VERR_NOT_SUPPORTED;
+#endif
+        }
+
+        case RTZIPTYPE_ZSTD:
+        {
+#ifdef RTZIP_USE_ZSTD
+            size_t cbDstActual = ZSTD_decompress(pvDst, cbDst, pvSrc, cbSrc);
+            if (RT_UNLIKELY(ZSTD_isError(cbDstActual)))
+                switch (ZSTD_getErrorCode(cbDstActual))
+                {
+                    case ZSTD_error_dstSize_tooSmall:   return VERR_BUFFER_OVERFLOW;
+                    default:                            return VERR_ZIP_CORRUPTED;
+                }
+            if (pcbDstActual)
+                *pcbDstActual = cbDstActual;
+            if (pcbSrcActual)
+                *pcbSrcActual = cbSrc;
+            break;
+#else
+            return VERR_NOT_SUPPORTED;
+#endif
+        }
+
         case RTZIPTYPE_BZLIB:
             return VERR_NOT_SUPPORTED;
 
@@ -40,6 +40,18 @@
  * compensated if the user of this API implements caching itself. The next
  * limitation is that data buffers must be aligned at a 512 byte boundary or the
  * request will fail.
+ *
+ * Newer kernels (5.1+) provide the io_uring interface which is used instead if
+ * the context is created with RTFILEAIOCTX_FLAGS_IO_RING. Requests are placed
+ * into a submission queue shared with the kernel and all requests of one
+ * RTFileAioCtxSubmit() call are submitted with a single syscall. Completions
+ * are reaped from the shared completion queue without entering the kernel,
+ * RTFileAioCtxWait() only enters the kernel if there are not enough completed
+ * requests already. Unlike the io_* syscalls io_uring doesn't silently
+ * degrade to synchronous I/O for files opened without O_DIRECT, the kernel
+ * hands such requests to its worker threads instead. The interface is used
+ * through raw syscalls for the same reasons as the io_* one. Canceling
+ * requests is not supported with io_uring.
  */
 /** @todo r=bird: What's this about "must be opened with O_DIRECT"? An
  *        explanation would be nice, esp. seeing what Linus is quoted saying
@@ -59,9 +71,15 @@
 #include <iprt/thread.h>
 #include "internal/fileaio.h"
 
+#include <iprt/critsect.h>
+#include <iprt/time.h>
+
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <iprt/file.h>
 
@@ -166,6 +184,182 @@ typedef struct LNXKAIOIOEVENT
 #endif
 } LNXKAIOIOEVENT, *PLNXKAIOIOEVENT;
 
+/** @name io_uring syscall numbers, identical on all architectures.
+ * @{ */
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup    425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter    426
+#endif
+/** @} */
+
+/** @name io_uring opcodes.
+ * @{ */
+#define LNXIOURING_OP_READV             1
+#define LNXIOURING_OP_WRITEV            2
+#define LNXIOURING_OP_FSYNC             3
+/** @} */
+
+/** io_uring_enter() flag to wait for completions. */
+#define LNXIOURING_ENTER_GETEVENTS      RT_BIT_32(0)
+/** io_uring feature flag indicating that the SQ and CQ rings share one mapping. */
+#define LNXIOURING_FEAT_SINGLE_MMAP     RT_BIT_32(0)
+
+/** @name mmap offsets for the io_uring rings.
+ * @{ */
+#define LNXIOURING_OFF_SQ_RING          UINT64_C(0)
+#define LNXIOURING_OFF_CQ_RING          UINT64_C(0x8000000)
+#define LNXIOURING_OFF_SQES             UINT64_C(0x10000000)
+/** @} */
+
+/** Maximum number of submission queue entries we ask for. */
+#define LNXIOURING_SQ_ENTRIES_MAX       4096
+
+/**
+ * io_uring submission queue entry.
+ *
+ * Redefined here because the kernel header might not be available on the
+ * build host.
+ */
+typedef struct LNXIOURINGSQE
+{
+    /** The operation code. */
+    uint8_t   u8Opc;
+    /** IOSQE_* flags. */
+    uint8_t   fSqe;
+    /** Request priority. */
+    uint16_t  u16IoPrio;
+    /** The file descriptor. */
+    int32_t   iFd;
+    /** At which offset to start the transfer. */
+    uint64_t  off;
+    /** The buffer (I/O vector array for READV/WRITEV). */
+    uint64_t  u64Addr;
+    /** Buffer size or number of I/O vectors. */
+    uint32_t  cbLen;
+    /** Opcode specific flags (RWF_* or IORING_FSYNC_*). */
+    uint32_t  fOpc;
+    /** Opaque user data returned in the completion queue entry. */
+    uint64_t  u64User;
+    /** Reserved (buffer index, personality, ...). */
+    uint64_t  au64Rsvd[3];
+} LNXIOURINGSQE;
+AssertCompileSize(LNXIOURINGSQE, 64);
+/** Pointer to a io_uring submission queue entry. */
+typedef LNXIOURINGSQE *PLNXIOURINGSQE;
+
+/**
+ * io_uring completion queue entry.
+ */
+typedef struct LNXIOURINGCQE
+{
+    /** The user data of the submission queue entry. */
+    uint64_t  u64User;
+    /** Result code (negative errno). */
+    int32_t   rcLnx;
+    /** Flags. */
+    uint32_t  fFlags;
+} LNXIOURINGCQE;
+AssertCompileSize(LNXIOURINGCQE, 16);
+/** Pointer to a io_uring completion queue entry. */
+typedef LNXIOURINGCQE *PLNXIOURINGCQE;
+
+/**
+ * Offsets of the submission queue ring members.
+ */
+typedef struct LNXIOURINGSQOFFSETS
+{
+    uint32_t  u32OffHead;
+    uint32_t  u32OffTail;
+    uint32_t  u32OffRingMask;
+    uint32_t  u32OffRingEntries;
+    uint32_t  u32OffFlags;
+    uint32_t  u32OffDropped;
+    uint32_t  u32OffArray;
+    uint32_t  u32Rsvd0;
+    uint64_t  u64Rsvd1;
+} LNXIOURINGSQOFFSETS;
+AssertCompileSize(LNXIOURINGSQOFFSETS, 40);
+
+/**
+ * Offsets of the completion queue ring members.
+ */
+typedef struct LNXIOURINGCQOFFSETS
+{
+    uint32_t  u32OffHead;
+    uint32_t  u32OffTail;
+    uint32_t  u32OffRingMask;
+    uint32_t  u32OffRingEntries;
+    uint32_t  u32OffOverflow;
+    uint32_t  u32OffCqes;
+    uint32_t  u32OffFlags;
+    uint32_t  u32Rsvd0;
+    uint64_t  u64Rsvd1;
+} LNXIOURINGCQOFFSETS;
+AssertCompileSize(LNXIOURINGCQOFFSETS, 40);
+
+/**
+ * Parameters for io_uring_setup().
+ */
+typedef struct LNXIOURINGPARAMS
+{
+    uint32_t             cSqEntries;
+    uint32_t             cCqEntries;
+    uint32_t             fFlags;
+    uint32_t             u32SqThreadCpu;
+    uint32_t             u32SqThreadIdle;
+    uint32_t             fFeatures;
+    uint32_t             u32WqFd;
+    uint32_t             au32Rsvd[3];
+    LNXIOURINGSQOFFSETS  SqOffsets;
+    LNXIOURINGCQOFFSETS  CqOffsets;
+} LNXIOURINGPARAMS;
+AssertCompileSize(LNXIOURINGPARAMS, 120);
+
+/**
+ * io_uring instance state.
+ */
+typedef struct LNXIOURING
+{
+    /** The io_uring file descriptor. */
+    int                 iFdRing;
+    /** Size of the submission queue ring mapping. */
+    size_t              cbSqRing;
+    /** The submission queue ring mapping. */
+    uint8_t            *pbSqRing;
+    /** Size of the completion queue ring mapping. */
+    size_t              cbCqRing;
+    /** The completion queue ring mapping, equals pbSqRing if single mapped. */
+    uint8_t            *pbCqRing;
+    /** Size of the submission queue entry array mapping. */
+    size_t              cbSqes;
+    /** The submission queue entries. */
+    PLNXIOURINGSQE      paSqes;
+    /** Submission queue head, written by the kernel. */
+    volatile uint32_t  *pu32SqHead;
+    /** Submission queue tail, written by us. */
+    volatile uint32_t  *pu32SqTail;
+    /** The submission queue index array. */
+    uint32_t           *pau32SqArray;
+    /** Submission queue index mask. */
+    uint32_t            fSqRingMask;
+    /** Number of submission queue entries. */
+    uint32_t            cSqEntries;
+    /** Completion queue head, written by us. */
+    volatile uint32_t  *pu32CqHead;
+    /** Completion queue tail, written by the kernel. */
+    volatile uint32_t  *pu32CqTail;
+    /** Completion queue index mask. */
+    uint32_t            fCqRingMask;
+    /** The completion queue entries. */
+    PLNXIOURINGCQE      paCqes;
+    /** Critical section serializing submissions (single producer). */
+    RTCRITSECT          CritSectSq;
+} LNXIOURING;
+/** Pointer to the io_uring instance state. */
+typedef LNXIOURING *PLNXIOURING;
+
 
 /**
  * Async I/O completion context state.
@@ -188,6 +382,10 @@ typedef struct RTFILEAIOCTXINTERNAL
     uint32_t            fFlags;
     /** Magic value (RTFILEAIOCTX_MAGIC). */
     uint32_t            u32Magic;
+    /** Flag whether io_uring is used instead of the io_* syscalls. */
+    bool                fIoRing;
+    /** The io_uring state if fIoRing is set. */
+    LNXIOURING          IoRing;
 } RTFILEAIOCTXINTERNAL;
 /** Pointer to an internal context structure. */
 typedef RTFILEAIOCTXINTERNAL *PRTFILEAIOCTXINTERNAL;
@@ -210,6 +408,8 @@ typedef struct RTFILEAIOREQINTERNAL
     size_t                cbTransfered;
     /** Completion context we are assigned to. */
     PRTFILEAIOCTXINTERNAL pCtxInt;
+    /** I/O vector for io_uring READV/WRITEV requests. */
+    struct iovec          IoVec;
     /** Magic value  (RTFILEAIOREQ_MAGIC). */
     uint32_t              u32Magic;
 } RTFILEAIOREQINTERNAL;
@@ -293,6 +493,317 @@ DECLINLINE(int) rtFileAsyncIoLinuxGetEvents(LNXKAIOCONTEXT AioContext, long cReq
     return rc;
 }
 
+/**
+ * Destroys the given io_uring instance unmapping the rings.
+ *
+ * @returns nothing.
+ * @param   pRing       The io_uring instance to destroy.
+ */
+static void rtFileAioLinuxIoRingDestroy(PLNXIOURING pRing)
+{
+    if (pRing->paSqes)
+        munmap(pRing->paSqes, pRing->cbSqes);
+    if (pRing->pbCqRing && pRing->pbCqRing != pRing->pbSqRing)
+        munmap(pRing->pbCqRing, pRing->cbCqRing);
+    if (pRing->pbSqRing)
+        munmap(pRing->pbSqRing, pRing->cbSqRing);
+    if (pRing->iFdRing >= 0)
+        close(pRing->iFdRing);
+    if (RTCritSectIsInitialized(&pRing->CritSectSq))
+        RTCritSectDelete(&pRing->CritSectSq);
+
+    pRing->paSqes   = NULL;
+    pRing->pbCqRing = NULL;
+    pRing->pbSqRing = NULL;
+    pRing->iFdRing  = -1;
+}
+
+/**
+ * Creates a new io_uring instance and maps the rings.
+ *
+ * @retval  VERR_NOT_SUPPORTED if the host kernel lacks or disables io_uring support.
+ * @retval  VERR_NOT_SUPPORTED if the host kernel lacks io_uring support.
+ * @param   pRing       The io_uring instance to initialize.
+ * @param   cEntries    Minimum number of submission queue entries.
+ */
+static int rtFileAioLinuxIoRingCreate(PLNXIOURING pRing, uint32_t cEntries)
+{
+    LNXIOURINGPARAMS Params;
+    RT_ZERO(Params);
+
+    pRing->iFdRing = -1;
+    if (cEntries > LNXIOURING_SQ_ENTRIES_MAX)
+        return VERR_OUT_OF_RANGE;
+
+    int rcLnx = syscall(__NR_io_uring_setup, cEntries, &Params);
+    if (rcLnx == -1)
+    {
+        /* EPERM: disabled through kernel.io_uring_disabled or a seccomp filter. */
+        if (errno == ENOSYS || errno == EPERM)
+            return VERR_NOT_SUPPORTED;
+        if (errno == EAGAIN || errno == ENOMEM)
+            return VERR_FILE_AIO_INSUFFICIENT_EVENTS;
+        return RTErrConvertFromErrno(errno);
+    }
+    pRing->iFdRing = rcLnx;
+
+    int rc = RTCritSectInit(&pRing->CritSectSq);
+    if (RT_FAILURE(rc))
+    {
+        rtFileAioLinuxIoRingDestroy(pRing);
+        return rc;
+    }
+
+    pRing->cbSqRing = Params.SqOffsets.u32OffArray + Params.cSqEntries * sizeof(uint32_t);
+    pRing->cbCqRing = Params.CqOffsets.u32OffCqes  + Params.cCqEntries * sizeof(LNXIOURINGCQE);
+    if (Params.fFeatures & LNXIOURING_FEAT_SINGLE_MMAP)
+        pRing->cbSqRing = pRing->cbCqRing = RT_MAX(pRing->cbSqRing, pRing->cbCqRing);
+
+    void *pv = mmap(NULL, pRing->cbSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    pRing->iFdRing, LNXIOURING_OFF_SQ_RING);
+    if (pv == MAP_FAILED)
+    {
+        rc = RTErrConvertFromErrno(errno);
+        rtFileAioLinuxIoRingDestroy(pRing);
+        return rc;
+    }
+    pRing->pbSqRing = (uint8_t *)pv;
+
+    if (Params.fFeatures & LNXIOURING_FEAT_SINGLE_MMAP)
+        pRing->pbCqRing = pRing->pbSqRing;
+    else
+    {
+        pv = mmap(NULL, pRing->cbCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  pRing->iFdRing, LNXIOURING_OFF_CQ_RING);
+        if (pv == MAP_FAILED)
+        {
+            rc = RTErrConvertFromErrno(errno);
+            rtFileAioLinuxIoRingDestroy(pRing);
+            return rc;
+        }
+        pRing->pbCqRing = (uint8_t *)pv;
+    }
+
+    pRing->cbSqes = Params.cSqEntries * sizeof(LNXIOURINGSQE);
+    pv = mmap(NULL, pRing->cbSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              pRing->iFdRing, LNXIOURING_OFF_SQES);
+    if (pv == MAP_FAILED)
+    {
+        rc = RTErrConvertFromErrno(errno);
+        rtFileAioLinuxIoRingDestroy(pRing);
+        return rc;
+    }
+    pRing->paSqes = (PLNXIOURINGSQE)pv;
+
+    pRing->pu32SqHead   = (volatile uint32_t *)(pRing->pbSqRing + Params.SqOffsets.u32OffHead);
+    pRing->pu32SqTail   = (volatile uint32_t *)(pRing->pbSqRing + Params.SqOffsets.u32OffTail);
+    pRing->pau32SqArray = (uint32_t *)(pRing->pbSqRing + Params.SqOffsets.u32OffArray);
+    pRing->fSqRingMask  = *(uint32_t *)(pRing->pbSqRing + Params.SqOffsets.u32OffRingMask);
+    pRing->cSqEntries   = *(uint32_t *)(pRing->pbSqRing + Params.SqOffsets.u32OffRingEntries);
+    pRing->pu32CqHead   = (volatile uint32_t *)(pRing->pbCqRing + Params.CqOffsets.u32OffHead);
+    pRing->pu32CqTail   = (volatile uint32_t *)(pRing->pbCqRing + Params.CqOffsets.u32OffTail);
+    pRing->fCqRingMask  = *(uint32_t *)(pRing->pbCqRing + Params.CqOffsets.u32OffRingMask);
+    pRing->paCqes       = (PLNXIOURINGCQE)(pRing->pbCqRing + Params.CqOffsets.u32OffCqes);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Submits the given requests through the io_uring submission queue.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt     The async I/O context using io_uring.
+ * @param   pahReqs     The requests to submit, already validated and marked as submitted.
+ * @param   cReqs       Number of requests to submit.
+ */
+static int rtFileAioLinuxIoRingSubmit(PRTFILEAIOCTXINTERNAL pCtxInt, PRTFILEAIOREQ pahReqs, size_t cReqs)
+{
+    PLNXIOURING pRing = &pCtxInt->IoRing;
+    int rc = VINF_SUCCESS;
+
+    RTCritSectEnter(&pRing->CritSectSq);
+
+    /* The number of requests in flight is limited to the ring size so the completion queue can't overflow. */
+    if (ASMAtomicReadS32(&pCtxInt->cRequests) + cReqs > (size_t)pCtxInt->cRequestsMax)
+    {
+        RTCritSectLeave(&pRing->CritSectSq);
+        return VERR_FILE_AIO_INSUFFICIENT_RESSOURCES;
+    }
+
+    uint32_t idxTail = *pRing->pu32SqTail;
+    for (size_t i = 0; i < cReqs; i++)
+    {
+        PRTFILEAIOREQINTERNAL pReqInt = pahReqs[i];
+        uint32_t idxSqe = idxTail & pRing->fSqRingMask;
+        PLNXIOURINGSQE pSqe = &pRing->paSqes[idxSqe];
+
+        RT_ZERO(*pSqe);
+        pSqe->iFd     = pReqInt->AioCB.uFileDesc;
+        pSqe->u64User = (uintptr_t)pReqInt;
+        switch (pReqInt->AioCB.u16IoOpCode)
+        {
+            case LNXKAIO_IOCB_CMD_READ:
+            case LNXKAIO_IOCB_CMD_WRITE:
+                pReqInt->IoVec.iov_base = pReqInt->AioCB.pvBuf;
+                pReqInt->IoVec.iov_len  = pReqInt->AioCB.cbTransfer;
+                pSqe->u8Opc   =   pReqInt->AioCB.u16IoOpCode == LNXKAIO_IOCB_CMD_READ
+                                ? LNXIOURING_OP_READV
+                                : LNXIOURING_OP_WRITEV;
+                pSqe->off     = pReqInt->AioCB.off;
+                pSqe->u64Addr = (uintptr_t)&pReqInt->IoVec;
+                pSqe->cbLen   = 1;
+                break;
+            case LNXKAIO_IOCB_CMD_FSYNC:
+                pSqe->u8Opc   = LNXIOURING_OP_FSYNC;
+                break;
+            default:
+                AssertMsgFailed(("Invalid opcode %u\n", pReqInt->AioCB.u16IoOpCode));
+        }
+
+        pRing->pau32SqArray[idxSqe] = idxSqe;
+        idxTail++;
+    }
+
+    /* Make the entries visible to the kernel before updating the tail. */
+    ASMAtomicWriteU32(pRing->pu32SqTail, idxTail);
+    ASMAtomicAddS32(&pCtxInt->cRequests, (int32_t)cReqs);
+
+    /* Hand everything to the kernel with as few syscalls as possible. */
+    size_t cLeft = cReqs;
+    while (cLeft)
+    {
+        int rcLnx = syscall(__NR_io_uring_enter, pRing->iFdRing, (unsigned)cLeft, 0, 0, NULL, 0);
+        if (rcLnx >= 0)
+            cLeft -= RT_MIN((size_t)rcLnx, cLeft);
+        else if (errno != EINTR && errno != EAGAIN)
+        {
+            /*
+             * The entries are already in the ring and will be consumed with the
+             * next io_uring_enter() call, so there is no way to revert them.
+             */
+            rc = RTErrConvertFromErrno(errno);
+            AssertLogRelMsgFailed(("io_uring_enter failed with %Rrc, %zu requests left\n", rc, cLeft));
+            break;
+        }
+    }
+
+    RTCritSectLeave(&pRing->CritSectSq);
+    return rc;
+}
+
+/**
+ * Reaps completed requests from the io_uring completion queue.
+ *
+ * @returns Number of requests reaped.
+ * @param   pCtxInt     The async I/O context using io_uring.
+ * @param   pahReqs     Where to store the completed request handles.
+ * @param   cReqs       Maximum number of requests to reap.
+ */
+static uint32_t rtFileAioLinuxIoRingReap(PRTFILEAIOCTXINTERNAL pCtxInt, PRTFILEAIOREQ pahReqs, size_t cReqs)
+{
+    PLNXIOURING pRing = &pCtxInt->IoRing;
+    uint32_t    cDone = 0;
+    uint32_t    idxHead = *pRing->pu32CqHead;
+    uint32_t    idxTail = ASMAtomicReadU32(pRing->pu32CqTail);
+
+    while (   idxHead != idxTail
+           && cDone < cReqs)
+    {
+        PLNXIOURINGCQE pCqe = &pRing->paCqes[idxHead & pRing->fCqRingMask];
+        PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)(uintptr_t)pCqe->u64User;
+        AssertPtr(pReqInt);
+        Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+
+        if (RT_UNLIKELY(pCqe->rcLnx < 0))
+            pReqInt->Rc = RTErrConvertFromErrno(-pCqe->rcLnx);
+        else
+        {
+            pReqInt->Rc = VINF_SUCCESS;
+            pReqInt->cbTransfered = pCqe->rcLnx;
+        }
+
+        RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+        pahReqs[cDone++] = (RTFILEAIOREQ)pReqInt;
+        idxHead++;
+    }
+
+    /* Release the entries to the kernel. */
+    if (cDone)
+        ASMAtomicWriteU32(pRing->pu32CqHead, idxHead);
+
+    return cDone;
+}
+
+/**
+ * RTFileAioCtxWait() worker for io_uring based contexts.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt     The async I/O context using io_uring.
+ * @param   cMinReqs    Minimum number of requests to wait for, at least one.
+ * @param   cMillies    How long to wait.
+ * @param   pahReqs     Where to store the completed request handles.
+ * @param   cReqs       Size of the pahReqs array.
+ * @param   pcReqs      Where to store the number of completed requests.
+ */
+static int rtFileAioLinuxIoRingWait(PRTFILEAIOCTXINTERNAL pCtxInt, size_t cMinReqs, RTMSINTERVAL cMillies,
+                                    PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
+{
+    PLNXIOURING pRing = &pCtxInt->IoRing;
+    uint64_t    StartNanoTS = cMillies != RT_INDEFINITE_WAIT ? RTTimeNanoTS() : 0;
+    uint32_t    cRequestsCompleted = 0;
+    int         rc = VINF_SUCCESS;
+
+    while (!pCtxInt->fWokenUp)
+    {
+        /* Reap whatever completed already without entering the kernel. */
+        cRequestsCompleted += rtFileAioLinuxIoRingReap(pCtxInt, &pahReqs[cRequestsCompleted],
+                                                       cReqs - cRequestsCompleted);
+        if (cRequestsCompleted >= cMinReqs)
+            break;
+
+        int rcLnx;
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
+        if (cMillies == RT_INDEFINITE_WAIT)
+            rcLnx = syscall(__NR_io_uring_enter, pRing->iFdRing, 0, (unsigned)(cMinReqs - cRequestsCompleted),
+                            LNXIOURING_ENTER_GETEVENTS, NULL, 0);
+        else
+        {
+            /* io_uring_enter() has no timeout on older kernels, the ring fd is pollable though. */
+            uint64_t cMilliesElapsed = (RTTimeNanoTS() - StartNanoTS) / RT_NS_1MS;
+            if (cMilliesElapsed >= cMillies)
+                rcLnx = 0;
+            else
+            {
+                struct pollfd PollFd;
+                PollFd.fd      = pRing->iFdRing;
+                PollFd.events  = POLLIN;
+                PollFd.revents = 0;
+                rcLnx = poll(&PollFd, 1, (int)(cMillies - cMilliesElapsed));
+            }
+
+            if (rcLnx == 0)
+            {
+                ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+                cRequestsCompleted += rtFileAioLinuxIoRingReap(pCtxInt, &pahReqs[cRequestsCompleted],
+                                                               cReqs - cRequestsCompleted);
+                if (cRequestsCompleted < cMinReqs)
+                    rc = VERR_TIMEOUT;
+                break;
+            }
+        }
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+
+        if (rcLnx == -1)
+        {
+            rc = RTErrConvertFromErrno(errno);
+            break;
+        }
+    }
+
+    *pcReqs = cRequestsCompleted;
+    return rc;
+}
+
 RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
 {
     int rc = VINF_SUCCESS;
@@ -442,6 +953,10 @@ RTDECL(int) RTFileAioReqCancel(RTFILEAIOREQ hReq)
     RTFILEAIOREQ_VALID_RETURN(pReqInt);
     RTFILEAIOREQ_STATE_RETURN_RC(pReqInt, SUBMITTED, VERR_FILE_AIO_NOT_SUBMITTED);
 
+    /* Canceling is asynchronous with io_uring, pretend the request is already being processed. */
+    if (pReqInt->pCtxInt->fIoRing)
+        return VERR_FILE_AIO_IN_PROGRESS;
+
     LNXKAIOIOEVENT AioEvent;
     int rc = rtFileAsyncIoLinuxCancel(pReqInt->AioContext, &pReqInt->AioCB, &AioEvent);
     if (RT_SUCCESS(rc))
@@ -496,7 +1011,14 @@ RTDECL(int) RTFileAioCtxCreate(PRTFILEAIOCTX phAioCtx, uint32_t cAioReqsMax,
         return VERR_NO_MEMORY;
 
     /* Init the event handle. */
-    int rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
+    int rc;
+    if (fFlags & RTFILEAIOCTX_FLAGS_IO_RING)
+    {
+        pCtxInt->fIoRing = true;
+        rc = rtFileAioLinuxIoRingCreate(&pCtxInt->IoRing, cAioReqsMax);
+    }
+    else
+        rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
     if (RT_SUCCESS(rc))
     {
         pCtxInt->fWokenUp     = false;
@@ -527,9 +1049,14 @@ RTDECL(int) RTFileAioCtxDestroy(RTFILEAIOCTX hAioCtx)
         return VERR_FILE_AIO_BUSY;
 
     /* The native bit first, then mark it as dead and free it. */
-    int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
-    if (RT_FAILURE(rc))
-        return rc;
+    if (pCtxInt->fIoRing)
+        rtFileAioLinuxIoRingDestroy(&pCtxInt->IoRing);
+    else
+    {
+        int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
     ASMAtomicUoWriteU32(&pCtxInt->u32Magic, RTFILEAIOCTX_MAGIC_DEAD);
     RTMemFree(pCtxInt);
 
@@ -596,6 +1123,23 @@ RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size
         RTFILEAIOREQ_SET_STATE(pReqInt, SUBMITTED);
     }
 
+    if (pCtxInt->fIoRing)
+    {
+        rc = rtFileAioLinuxIoRingSubmit(pCtxInt, pahReqs, cReqs);
+        if (rc == VERR_FILE_AIO_INSUFFICIENT_RESSOURCES)
+        {
+            /* Nothing was submitted, revert everything into the prepared state. */
+            i = cReqs;
+            while (i-- > 0)
+            {
+                pReqInt = pahReqs[i];
+                pReqInt->pCtxInt = NULL;
+                RTFILEAIOREQ_SET_STATE(pReqInt, PREPARED);
+            }
+        }
+        return rc;
+    }
+
     do
     {
         /*
@@ -701,72 +1245,81 @@ RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL
      */
     int rc = VINF_SUCCESS;
     int cRequestsCompleted = 0;
-    while (!pCtxInt->fWokenUp)
+    if (pCtxInt->fIoRing)
     {
-        LNXKAIOIOEVENT  aPortEvents[AIO_MAXIMUM_REQUESTS_PER_CONTEXT];
-        int             cRequestsToWait = RT_MIN(cReqs, AIO_MAXIMUM_REQUESTS_PER_CONTEXT);
-        ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
-        rc = rtFileAsyncIoLinuxGetEvents(pCtxInt->AioContext, cMinReqs, cRequestsToWait, &aPortEvents[0], pTimeout);
-        ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
-        if (RT_FAILURE(rc))
-            break;
-        uint32_t const cDone = rc;
-        rc = VINF_SUCCESS;
-
-        /*
-         * Process received events / requests.
-         */
-        for (uint32_t i = 0; i < cDone; i++)
+        uint32_t cReqsRing = 0;
+        rc = rtFileAioLinuxIoRingWait(pCtxInt, cMinReqs, cMillies, pahReqs, cReqs, &cReqsRing);
+        cRequestsCompleted = cReqsRing;
+    }
+    else
+    {
+        while (!pCtxInt->fWokenUp)
         {
+            LNXKAIOIOEVENT  aPortEvents[AIO_MAXIMUM_REQUESTS_PER_CONTEXT];
+            int             cRequestsToWait = RT_MIN(cReqs, AIO_MAXIMUM_REQUESTS_PER_CONTEXT);
+            ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
+            rc = rtFileAsyncIoLinuxGetEvents(pCtxInt->AioContext, cMinReqs, cRequestsToWait, &aPortEvents[0], pTimeout);
+            ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+            if (RT_FAILURE(rc))
+                break;
+            uint32_t const cDone = rc;
+            rc = VINF_SUCCESS;
+
             /*
-             * The iocb is the first element in our request structure.
-             * So we can safely cast it directly to the handle (see above)
-             */
-            PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)aPortEvents[i].pIoCB;
-            AssertPtr(pReqInt);
-            Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
-
-            /** @todo aeichner: The rc field contains the result code
-             *  like you can find in errno for the normal read/write ops.
-             *  But there is a second field called rc2. I don't know the
-             *  purpose for it yet.
+             * Process received events / requests.
              */
-            if (RT_UNLIKELY(aPortEvents[i].rc < 0))
-                pReqInt->Rc = RTErrConvertFromErrno(-aPortEvents[i].rc); /* Convert to positive value. */
-            else
+            for (uint32_t i = 0; i < cDone; i++)
             {
-                pReqInt->Rc = VINF_SUCCESS;
-                pReqInt->cbTransfered = aPortEvents[i].rc;
-            }
-
-            /* Mark the request as finished. */
-            RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+                /*
+                 * The iocb is the first element in our request structure.
+                 * So we can safely cast it directly to the handle (see above)
+                 */
+                PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)aPortEvents[i].pIoCB;
+                AssertPtr(pReqInt);
+                Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+
+                /** @todo aeichner: The rc field contains the result code
+                 *  like you can find in errno for the normal read/write ops.
+                 *  But there is a second field called rc2. I don't know the
+                 *  purpose for it yet.
+                 */
+                if (RT_UNLIKELY(aPortEvents[i].rc < 0))
+                    pReqInt->Rc = RTErrConvertFromErrno(-aPortEvents[i].rc); /* Convert to positive value. */
+                else
+                {
+                    pReqInt->Rc = VINF_SUCCESS;
+                    pReqInt->cbTransfered = aPortEvents[i].rc;
+                }
+
+                /* Mark the request as finished. */
+                RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
 
-            pahReqs[cRequestsCompleted++] = (RTFILEAIOREQ)pReqInt;
-        }
+                pahReqs[cRequestsCompleted++] = (RTFILEAIOREQ)pReqInt;
+            }
 
-        /*
-         * Done Yet? If not advance and try again.
-         */
-        if (cDone >= cMinReqs)
-            break;
-        cMinReqs -= cDone;
-        cReqs    -= cDone;
+            /*
+             * Done Yet? If not advance and try again.
+             */
+            if (cDone >= cMinReqs)
+                break;
+            cMinReqs -= cDone;
+            cReqs    -= cDone;
 
-        if (cMillies != RT_INDEFINITE_WAIT)
-        {
-            /* The API doesn't return ETIMEDOUT, so we have to fix that ourselves. */
-            uint64_t NanoTS = RTTimeNanoTS();
-            uint64_t cMilliesElapsed = (NanoTS - StartNanoTS) / 1000000;
-            if (cMilliesElapsed >= cMillies)
+            if (cMillies != RT_INDEFINITE_WAIT)
             {
-                rc = VERR_TIMEOUT;
-                break;
+                /* The API doesn't return ETIMEDOUT, so we have to fix that ourselves. */
+                uint64_t NanoTS = RTTimeNanoTS();
+                uint64_t cMilliesElapsed = (NanoTS - StartNanoTS) / 1000000;
+                if (cMilliesElapsed >= cMillies)
+                {
+                    rc = VERR_TIMEOUT;
+                    break;
+                }
+
+                /* The syscall supposedly updates it, but we're paranoid. :-) */
+                Timeout.tv_sec  = (cMillies - (RTMSINTERVAL)cMilliesElapsed) / 1000;
+                Timeout.tv_nsec = (cMillies - (RTMSINTERVAL)cMilliesElapsed) % 1000 * 1000000;
             }
-
-            /* The syscall supposedly updates it, but we're paranoid. :-) */
-            Timeout.tv_sec  = (cMillies - (RTMSINTERVAL)cMilliesElapsed) / 1000;
-            Timeout.tv_nsec = (cMillies - (RTMSINTERVAL)cMilliesElapsed) % 1000 * 1000000;
         }
     }
 
@@ -534,6 +534,10 @@ RTDECL(int) RTFileAioCtxCreate(PRTFILEAIOCTX phAioCtx, uint32_t cAioReqsMax,
     AssertPtrReturn(phAioCtx, VERR_INVALID_POINTER);
     AssertReturn(!(fFlags & ~RTFILEAIOCTX_FLAGS_VALID_MASK), VERR_INVALID_PARAMETER);
 
+    /* io_uring is Linux only. */
+    if (fFlags & RTFILEAIOCTX_FLAGS_IO_RING)
+        return VERR_NOT_SUPPORTED;
+
     if (cAioReqsMax == RTFILEAIO_UNLIMITED_REQS)
         return VERR_OUT_OF_RANGE;
 
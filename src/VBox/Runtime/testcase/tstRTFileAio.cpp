@@ -52,7 +52,8 @@ static RTTEST g_hTest = NIL_RTTEST;
 
 
 void tstFileAioTestReadWriteBasic(RTFILE File, bool fWrite, void *pvTestBuf,
-                                  size_t cbTestBuf, size_t cbTestFile, uint32_t cMaxReqsInFlight)
+                                  size_t cbTestBuf, size_t cbTestFile, uint32_t cMaxReqsInFlight,
+                                  uint32_t fFlags)
 {
     /* Allocate request array. */
     RTFILEAIOREQ *paReqs;
@@ -84,7 +85,7 @@ void tstFileAioTestReadWriteBasic(RTFILE File, bool fWrite, void *pvTestBuf,
 
     /* Create a context and associate the file handle with it. */
     RTFILEAIOCTX hAioContext;
-    RTTESTI_CHECK_RC_RETV(RTFileAioCtxCreate(&hAioContext, cMaxReqsInFlight, 0 /* fFlags */), VINF_SUCCESS);
+    RTTESTI_CHECK_RC_RETV(RTFileAioCtxCreate(&hAioContext, cMaxReqsInFlight, fFlags), VINF_SUCCESS);
     RTTESTI_CHECK_RC_RETV(RTFileAioCtxAssociateWithFile(hAioContext, File), VINF_SUCCESS);
 
     /* Initialize requests. */
@@ -169,6 +170,75 @@ void tstFileAioTestReadWriteBasic(RTFILE File, bool fWrite, void *pvTestBuf,
     RTTestGuardedFree(g_hTest, paReqs);
 }
 
+/**
+ * Runs the write and read/write tests using contexts created with the given
+ * flags.
+ *
+ * @param   cReqsMax    The maximum number of requests in flight.
+ * @param   fFlags      The RTFILEAIOCTX_FLAGS_* to create the contexts with.
+ * @param   pszDesc     The name of the interface being tested.
+ */
+static void tstFileAioTestFile(uint32_t cReqsMax, uint32_t fFlags, const char *pszDesc)
+{
+    RTTestSubF(g_hTest, "Write (%s)", pszDesc);
+
+    /* Optional interfaces aren't available everywhere, skip them if the host lacks them. */
+    if (fFlags & RTFILEAIOCTX_FLAGS_IO_RING)
+    {
+        RTFILEAIOCTX hAioContext;
+        int rc = RTFileAioCtxCreate(&hAioContext, cReqsMax, fFlags);
+        if (rc == VERR_NOT_SUPPORTED)
+        {
+            RTTestSkipped(g_hTest, "%s is not supported by the host", pszDesc);
+            return;
+        }
+        RTTESTI_CHECK_RC_RETV(rc, VINF_SUCCESS);
+        RTTESTI_CHECK_RC(RTFileAioCtxDestroy(hAioContext), VINF_SUCCESS);
+    }
+
+    RTFILE hFile;
+    RTFSTYPE enmType;
+    bool fAsyncMayFail = false;
+    int rc = RTFsQueryType("tstFileAio#1.tst", &enmType);
+    if (   RT_SUCCESS(rc)
+        && enmType == RTFSTYPE_TMPFS)
+        fAsyncMayFail = true;
+    rc = RTFileOpen(&hFile, "tstFileAio#1.tst",
+                            RTFILE_O_READWRITE | RTFILE_O_CREATE_REPLACE | RTFILE_O_DENY_NONE | RTFILE_O_ASYNC_IO);
+    RTTESTI_CHECK(   rc == VINF_SUCCESS
+                  || (rc == VERR_ACCESS_DENIED && fAsyncMayFail));
+    if (RT_SUCCESS(rc))
+    {
+        uint32_t const cErrors = RTTestErrorCount(g_hTest);
+        uint8_t *pbTestBuf = (uint8_t *)RTTestGuardedAllocTail(g_hTest, TSTFILEAIO_BUFFER_SIZE);
+        for (unsigned i = 0; i < TSTFILEAIO_BUFFER_SIZE; i++)
+            pbTestBuf[i] = i % 256;
+
+        /* Basic write test. */
+        RTTestIPrintf(RTTESTLVL_ALWAYS, "Preparing test file, this can take some time and needs quite a bit of harddisk space...\n");
+        tstFileAioTestReadWriteBasic(hFile, true /*fWrite*/, pbTestBuf, TSTFILEAIO_BUFFER_SIZE, 100*_1M, cReqsMax, fFlags);
+
+        /* Reopen the file before doing the next test. */
+        RTTESTI_CHECK_RC(RTFileClose(hFile), VINF_SUCCESS);
+        if (RTTestErrorCount(g_hTest) == cErrors)
+        {
+            RTTestSubF(g_hTest, "Read/Write (%s)", pszDesc);
+            RTTESTI_CHECK_RC(rc = RTFileOpen(&hFile, "tstFileAio#1.tst",
+                                             RTFILE_O_READWRITE | RTFILE_O_OPEN | RTFILE_O_DENY_NONE | RTFILE_O_ASYNC_IO),
+                             VINF_SUCCESS);
+            if (RT_SUCCESS(rc))
+            {
+                tstFileAioTestReadWriteBasic(hFile, false /*fWrite*/, pbTestBuf, TSTFILEAIO_BUFFER_SIZE, 100*_1M, cReqsMax, fFlags);
+                RTFileClose(hFile);
+            }
+        }
+
+        /* Cleanup */
+        RTTestGuardedFree(g_hTest, pbTestBuf);
+        RTFileDelete("tstFileAio#1.tst");
+    }
+}
+
 int main()
 {
     int rc = RTTestInitAndCreate("tstRTFileAio", &g_hTest);
@@ -182,50 +252,11 @@ int main()
     RTTESTI_CHECK_RC(rc = RTFileAioGetLimits(&AioLimits), VINF_SUCCESS);
     if (RT_SUCCESS(rc))
     {
-        RTTestSub(g_hTest, "Write");
-        RTFILE hFile;
-        RTFSTYPE enmType;
-        bool fAsyncMayFail = false;
-        rc = RTFsQueryType("tstFileAio#1.tst", &enmType);
-        if (   RT_SUCCESS(rc)
-            && enmType == RTFSTYPE_TMPFS)
-            fAsyncMayFail = true;
-        rc = RTFileOpen(&hFile, "tstFileAio#1.tst",
-                                RTFILE_O_READWRITE | RTFILE_O_CREATE_REPLACE | RTFILE_O_DENY_NONE | RTFILE_O_ASYNC_IO);
-        RTTESTI_CHECK(   rc == VINF_SUCCESS
-                      || (rc == VERR_ACCESS_DENIED && fAsyncMayFail));
-        if (RT_SUCCESS(rc))
-        {
-            uint8_t *pbTestBuf = (uint8_t *)RTTestGuardedAllocTail(g_hTest, TSTFILEAIO_BUFFER_SIZE);
-            for (unsigned i = 0; i < TSTFILEAIO_BUFFER_SIZE; i++)
-                pbTestBuf[i] = i % 256;
-
-            uint32_t cReqsMax = AioLimits.cReqsOutstandingMax < TSTFILEAIO_MAX_REQS_IN_FLIGHT
-                              ? AioLimits.cReqsOutstandingMax
-                              : TSTFILEAIO_MAX_REQS_IN_FLIGHT;
-
-            /* Basic write test. */
-            RTTestIPrintf(RTTESTLVL_ALWAYS, "Preparing test file, this can take some time and needs quite a bit of harddisk space...\n");
-            tstFileAioTestReadWriteBasic(hFile, true /*fWrite*/, pbTestBuf, TSTFILEAIO_BUFFER_SIZE, 100*_1M, cReqsMax);
-
-            /* Reopen the file before doing the next test. */
-            RTTESTI_CHECK_RC(RTFileClose(hFile), VINF_SUCCESS);
-            if (RTTestErrorCount(g_hTest) == 0)
-            {
-                RTTestSub(g_hTest, "Read/Write");
-                RTTESTI_CHECK_RC(rc = RTFileOpen(&hFile, "tstFileAio#1.tst",
-                                                 RTFILE_O_READWRITE | RTFILE_O_OPEN | RTFILE_O_DENY_NONE | RTFILE_O_ASYNC_IO),
-                                 VINF_SUCCESS);
-                if (RT_SUCCESS(rc))
-                {
-                    tstFileAioTestReadWriteBasic(hFile, false /*fWrite*/, pbTestBuf, TSTFILEAIO_BUFFER_SIZE, 100*_1M, cReqsMax);
-                    RTFileClose(hFile);
-                }
-            }
-
-            /* Cleanup */
-            RTFileDelete("tstFileAio#1.tst");
-        }
+        uint32_t cReqsMax = AioLimits.cReqsOutstandingMax < TSTFILEAIO_MAX_REQS_IN_FLIGHT
+                          ? AioLimits.cReqsOutstandingMax
+                          : TSTFILEAIO_MAX_REQS_IN_FLIGHT;
+        tstFileAioTestFile(cReqsMax, 0 /*fFlags*/, "default");
+        tstFileAioTestFile(cReqsMax, RTFILEAIOCTX_FLAGS_IO_RING, "io_uring");
     }
 
     /*
@@ -37,6 +37,7 @@
 #include <iprt/mem.h>
 #include <iprt/message.h>
 #include <iprt/param.h>
+#include <iprt/rand.h>
 #include <iprt/string.h>
 #include <iprt/test.h>
 
@@ -61,6 +62,139 @@ static void testFile(const char *pszFilename)
 }
 
 
+/**
+ * Compresses a block with LZ4 and checks that it decompresses to the same
+ * data again, also into an output buffer that is too small.
+ *
+ * @returns The compressed size, 0 on failure.
+ * @param   pabSrc      The data.
+ * @param   cbSrc       The size of the data.
+ * @param   pabComp     Where to return the compressed data.
+ * @param   cbComp      The size of the buffer.
+ */
+static size_t tstLz4RoundTrip(uint8_t const *pabSrc, size_t cbSrc, uint8_t *pabComp, size_t cbComp)
+{
+    size_t cbCompActual = 0;
+    int rc = RTZipBlockCompress(RTZIPTYPE_LZ4, RTZIPLEVEL_DEFAULT, 0, pabSrc, cbSrc, pabComp, cbComp, &cbCompActual);
+    RTTESTI_CHECK_MSG_RET(rc == VINF_SUCCESS, ("cbSrc=%zu rc=%Rrc\n", cbSrc, rc), 0);
+    RTTESTI_CHECK_RET(cbCompActual > 0 && cbCompActual <= cbComp, 0);
+
+    /* The output buffer ends right at a guard page to catch overruns. */
+    uint8_t *pabDst = (uint8_t *)RTTestGuardedAllocTail(NIL_RTTEST, RT_MAX(cbSrc, 1));
+    RTTESTI_CHECK_RET(pabDst, 0);
+    uint8_t *pabDstExact = pabDst + RT_MAX(cbSrc, 1) - cbSrc;
+
+    size_t cbSrcActual = 0;
+    size_t cbDstActual = 0;
+    rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, pabComp, cbCompActual, &cbSrcActual, pabDstExact, cbSrc, &cbDstActual);
+    RTTESTI_CHECK_RC(rc, VINF_SUCCESS);
+    if (RT_SUCCESS(rc))
+    {
+        RTTESTI_CHECK(cbSrcActual == cbCompActual);
+        RTTESTI_CHECK(cbDstActual == cbSrc);
+        RTTESTI_CHECK(!memcmp(pabDstExact, pabSrc, cbSrc));
+    }
+
+    if (cbSrc > 0)
+    {
+        rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, pabComp, cbCompActual, NULL, pabDstExact + 1, cbSrc - 1, &cbDstActual);
+        RTTESTI_CHECK_RC(rc, VERR_BUFFER_OVERFLOW);
+    }
+
+    RTTestGuardedFree(NIL_RTTEST, pabDst);
+    return cbCompActual;
+}
+
+
+/**
+ * Tests the LZ4 block compression.
+ */
+static void tstLz4(void)
+{
+    size_t const cbSrc  = _64K;
+    size_t const cbComp = cbSrc + cbSrc / 255 + 16; /* The LZ4 worst case. */
+    uint8_t *pabSrc  = (uint8_t *)RTMemAlloc(cbSrc);
+    uint8_t *pabComp = (uint8_t *)RTMemAlloc(cbComp);
+    RTTESTI_CHECK_RETV(pabSrc && pabComp);
+
+    /*
+     * Round trips of compressible data of various sizes, including the ones
+     * too short for the match finder.
+     */
+    RTTestISub("LZ4 round trip");
+    for (size_t i = 0; i < cbSrc; i++)
+        pabSrc[i] = (uint8_t)("The quick brown fox jumps over the lazy dog. "[i % 45] + (i / 4096));
+    static size_t const s_acbTests[] = { 0, 1, 5, 12, 13, 14, 100, 4095, _4K, _32K + 7, _64K };
+    for (unsigned i = 0; i < RT_ELEMENTS(s_acbTests); i++)
+        tstLz4RoundTrip(pabSrc, s_acbTests[i], pabComp, cbComp);
+    size_t cbCompressed = tstLz4RoundTrip(pabSrc, cbSrc, pabComp, cbComp);
+    RTTESTI_CHECK_MSG(cbCompressed < cbSrc / 4, ("cbCompressed=%zu\n", cbCompressed));
+
+    /* Long runs exercise the overlapping matches and the length extension bytes. */
+    memset(pabSrc, 0, cbSrc);
+    cbCompressed = tstLz4RoundTrip(pabSrc, cbSrc, pabComp, cbComp);
+    RTTESTI_CHECK_MSG(cbCompressed < 512, ("cbCompressed=%zu\n", cbCompressed));
+    memset(pabSrc + _4K, 0x5a, _1K);
+    tstLz4RoundTrip(pabSrc, cbSrc, pabComp, cbComp);
+
+    /*
+     * Incompressible data must fit into the worst case bound but not into a
+     * buffer of the input size.
+     */
+    RTTestISub("LZ4 incompressible");
+    RTRandBytes(pabSrc, cbSrc);
+    cbCompressed = tstLz4RoundTrip(pabSrc, cbSrc, pabComp, cbComp);
+    RTTESTI_CHECK_MSG(cbCompressed >= cbSrc, ("cbCompressed=%zu\n", cbCompressed));
+    size_t cbDstActual = 0;
+    int rc = RTZipBlockCompress(RTZIPTYPE_LZ4, RTZIPLEVEL_DEFAULT, 0, pabSrc, cbSrc, pabComp, cbSrc, &cbDstActual);
+    RTTESTI_CHECK_RC(rc, VERR_BUFFER_OVERFLOW);
+
+    /*
+     * Truncated input must never decompress to the full size, corrupted input
+     * must never write beyond the output buffer.
+     */
+    RTTestISub("LZ4 truncated and corrupted input");
+    for (size_t i = 0; i < _4K; i++)
+        pabSrc[i] = (uint8_t)("The quick brown fox jumps over the lazy dog. "[i % 45] ^ (i % 7 == 0 ? RTRandU32() : 0));
+    cbCompressed = tstLz4RoundTrip(pabSrc, _4K, pabComp, cbComp);
+    uint8_t *pabDst = (uint8_t *)RTTestGuardedAllocTail(NIL_RTTEST, _4K);
+    RTTESTI_CHECK_RETV(pabDst);
+    for (size_t cbTrunc = 0; cbTrunc < cbCompressed; cbTrunc++)
+    {
+        rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, pabComp, cbTrunc, NULL, pabDst, _4K, &cbDstActual);
+        RTTESTI_CHECK_MSG(rc == VERR_ZIP_CORRUPTED || (RT_SUCCESS(rc) && cbDstActual < _4K),
+                          ("cbTrunc=%zu rc=%Rrc cbDstActual=%zu\n", cbTrunc, rc, cbDstActual));
+    }
+
+    for (unsigned iIteration = 0; iIteration < 4096; iIteration++)
+    {
+        uint8_t abCorrupt[_8K];
+        RTTESTI_CHECK_BREAK(cbCompressed <= sizeof(abCorrupt));
+        memcpy(abCorrupt, pabComp, cbCompressed);
+        for (unsigned cFlips = RTRandU32Ex(1, 8); cFlips > 0; cFlips--)
+            abCorrupt[RTRandU32Ex(0, (uint32_t)cbCompressed - 1)] ^= (uint8_t)RTRandU32Ex(1, 255);
+        rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, abCorrupt, cbCompressed, NULL, pabDst, _4K, &cbDstActual);
+        RTTESTI_CHECK_MSG(   RT_SUCCESS(rc)
+                          || rc == VERR_ZIP_CORRUPTED
+                          || rc == VERR_BUFFER_OVERFLOW,
+                          ("rc=%Rrc\n", rc));
+        RTTESTI_CHECK(RT_FAILURE(rc) || cbDstActual <= _4K);
+    }
+
+    /* Matches referring to offset zero or to before the start of the output. */
+    static uint8_t const s_abOffZero[]   = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    static uint8_t const s_abOffBefore[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+    rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, s_abOffZero, sizeof(s_abOffZero), NULL, pabDst, _4K, &cbDstActual);
+    RTTESTI_CHECK_RC(rc, VERR_ZIP_CORRUPTED);
+    rc = RTZipBlockDecompress(RTZIPTYPE_LZ4, 0, s_abOffBefore, sizeof(s_abOffBefore), NULL, pabDst, _4K, &cbDstActual);
+    RTTESTI_CHECK_RC(rc, VERR_ZIP_CORRUPTED);
+
+    RTTestGuardedFree(NIL_RTTEST, pabDst);
+    RTMemFree(pabComp);
+    RTMemFree(pabSrc);
+}
+
+
 int main(int argc, char **argv)
 {
     RTTEST hTest;
@@ -75,9 +209,7 @@ int main(int argc, char **argv)
             testFile(argv[i]);
     }
     else
-    {
-        /** @todo testcase */
-    }
+        tstLz4();
 
     /*
      * Summary.
@@ -31,6 +31,7 @@
 #include <iprt/base64.h>
 #include <iprt/ctype.h>
 #include <iprt/mem.h>
+#include <iprt/sort.h>
 #include <iprt/string.h>
 #include <iprt/zip.h>
 #include <iprt/formats/xar.h>
@@ -303,10 +304,34 @@ typedef struct DMGEXTENT
     uint64_t             offFileStart;
     /** Number of bytes for the extent data in the file. */
     uint64_t             cbFile;
+    /** The cache entry holding the decompressed data of a compressed extent, NULL if not cached. */
+    struct DMGCHUNK     *pChunk;
 } DMGEXTENT;
 /** Pointer to an DMG extent. */
 typedef DMGEXTENT *PDMGEXTENT;
 
+/** Number of decompressed extents (chunks) to keep cached. */
+#define DMG_CHUNK_CACHE_ENTRIES    64
+/** Maximum amount of decompressed data to keep cached. */
+#define DMG_CHUNK_CACHE_SIZE_MAX   (64 * _1M)
+
+/**
+ * Cache entry for the decompressed data of a compressed extent.
+ */
+typedef struct DMGCHUNK
+{
+    /** The extent the data belongs to, NULL if the entry is unused. */
+    PDMGEXTENT           pExtent;
+    /** The decompressed data. */
+    void                *pvData;
+    /** Size of the data buffer. */
+    size_t               cbData;
+    /** Value of the use counter when the entry was last accessed, for LRU replacement. */
+    uint64_t             uLastUse;
+} DMGCHUNK;
+/** Pointer to a decompressed chunk cache entry. */
+typedef DMGCHUNK *PDMGCHUNK;
+
 /**
  * VirtualBox Apple Disk Image (DMG) interpreter instance data.
  */
@@ -364,12 +389,12 @@ typedef struct DMGIMAGE
     /** Index of the last accessed extent. */
     unsigned            idxExtentLast;
 
-    /** Extent which owns the data in the buffer. */
-    PDMGEXTENT          pExtentDecomp;
-    /** Buffer holding the decompressed data for a extent. */
-    void               *pvDecompExtent;
-    /** Size of the buffer. */
-    size_t              cbDecompExtent;
+    /** Cache of decompressed extents. */
+    DMGCHUNK            aChunks[DMG_CHUNK_CACHE_ENTRIES];
+    /** Number of bytes allocated for the chunk cache data buffers. */
+    size_t              cbChunksCached;
+    /** Use counter for the LRU replacement of the chunk cache. */
+    uint64_t            uChunkUseCounter;
 } DMGIMAGE;
 /** Pointer to an instance of the DMG Image Interpreter. */
 typedef DMGIMAGE *PDMGIMAGE;
@@ -859,11 +884,24 @@ static int dmgFreeImage(PDMGIMAGE pThis, bool fDelete)
         if (fDelete && pThis->pszFilename)
             vdIfIoIntFileDelete(pThis->pIfIoXxx, pThis->pszFilename);
 
-        if (pThis->pvDecompExtent)
+        for (unsigned i = 0; i < RT_ELEMENTS(pThis->aChunks); i++)
+        {
+            if (pThis->aChunks[i].pvData)
+            {
+                RTMemFree(pThis->aChunks[i].pvData);
+                pThis->aChunks[i].pvData = NULL;
+                pThis->aChunks[i].cbData = 0;
+            }
+            pThis->aChunks[i].pExtent = NULL;
+        }
+        pThis->cbChunksCached = 0;
+
+        if (pThis->paExtents)
         {
-            RTMemFree(pThis->pvDecompExtent);
-            pThis->pvDecompExtent = NULL;
-            pThis->cbDecompExtent = 0;
+            RTMemFree(pThis->paExtents);
+            pThis->paExtents = NULL;
+            pThis->cExtents = 0;
+            pThis->cExtentsMax = 0;
         }
     }
 
@@ -1355,57 +1393,206 @@ static int dmgExtentCreateFromBlkxDesc(PDMGIMAGE pThis, uint64_t uSectorPart, PD
             pExtentNew->cSectorsExtent = pBlkxDesc->u64SectorCount;
             pExtentNew->offFileStart   = pBlkxDesc->offData;
             pExtentNew->cbFile         = pBlkxDesc->cbData;
+            pExtentNew->pChunk         = NULL;
         }
     }
 
     return rc;
 }
 
+/**
+ * @callback_method_impl{FNRTSORTCMP, Orders extents by their first sector.}
+ */
+static DECLCALLBACK(int) dmgExtentCmp(void const *pvElement1, void const *pvElement2, void *pvUser)
+{
+    PDMGEXTENT pExtent1 = (PDMGEXTENT)pvElement1;
+    PDMGEXTENT pExtent2 = (PDMGEXTENT)pvElement2;
+    NOREF(pvUser);
+
+    if (pExtent1->uSectorExtent < pExtent2->uSectorExtent)
+        return -1;
+    if (pExtent1->uSectorExtent > pExtent2->uSectorExtent)
+        return 1;
+    return 0;
+}
+
+/**
+ * Builds the extent index after all blkx resources were parsed, i.e. sorts
+ * the extent array by sector and makes sure that no extents overlap, which
+ * is required by dmgExtentGetFromOffset().
+ *
+ * @returns VBox status code.
+ * @param   pThis          DMG instance data.
+ */
+static int dmgExtentIndexBuild(PDMGIMAGE pThis)
+{
+    if (!RTSortIsSorted(pThis->paExtents, pThis->cExtents, sizeof(DMGEXTENT), dmgExtentCmp, NULL))
+        RTSortShell(pThis->paExtents, pThis->cExtents, sizeof(DMGEXTENT), dmgExtentCmp, NULL);
+
+    for (unsigned i = 1; i < pThis->cExtents; i++)
+    {
+        PDMGEXTENT pExtentPrev = &pThis->paExtents[i - 1];
+        if (pExtentPrev->uSectorExtent + pExtentPrev->cSectorsExtent > pThis->paExtents[i].uSectorExtent)
+        {
+            DMG_PRINTF(("DMG: Extent %u (sector %llu) overlaps with the previous one\n",
+                        i, pThis->paExtents[i].uSectorExtent));
+            return VERR_VD_DMG_INVALID_HEADER;
+        }
+    }
+
+    pThis->idxExtentLast = 0;
+    return VINF_SUCCESS;
+}
+
 /**
  * Find the extent for the given sector number.
  */
 static PDMGEXTENT dmgExtentGetFromOffset(PDMGIMAGE pThis, uint64_t uSector)
 {
     /*
-     * We assume that the array is ordered from lower to higher sector
-     * numbers.
-     * This makes it possible to bisect the array to find the extent
-     * faster than using a linked list.
+     * The array is ordered from lower to higher sector numbers without
+     * overlaps (see dmgExtentIndexBuild()). Check the last accessed extent
+     * and the one after it first to make sequential access cheap, then
+     * bisect the array.
      */
-    PDMGEXTENT pExtent = NULL;
     unsigned idxCur = pThis->idxExtentLast;
-    unsigned idxMax = pThis->cExtents;
-    unsigned idxMin = 0;
+    for (unsigned i = 0; i < 2 && idxCur < pThis->cExtents; i++, idxCur++)
+    {
+        PDMGEXTENT pExtentCur = &pThis->paExtents[idxCur];
+        if (   uSector >= pExtentCur->uSectorExtent
+            && uSector < pExtentCur->uSectorExtent + pExtentCur->cSectorsExtent)
+        {
+            pThis->idxExtentLast = idxCur;
+            return pExtentCur;
+        }
+    }
 
+    unsigned idxMin = 0;
+    unsigned idxMax = pThis->cExtents;
     while (idxMin < idxMax)
     {
+        idxCur = idxMin + (idxMax - idxMin) / 2;
         PDMGEXTENT pExtentCur = &pThis->paExtents[idxCur];
 
         /* Determine the search direction. */
         if (uSector < pExtentCur->uSectorExtent)
-        {
-            /* Search left from the current extent. */
             idxMax = idxCur;
-        }
         else if (uSector >= pExtentCur->uSectorExtent + pExtentCur->cSectorsExtent)
-        {
-            /* Search right from the current extent. */
-            idxMin = idxCur;
-        }
+            idxMin = idxCur + 1;
         else
         {
             /* The sector lies in the extent, stop searching. */
-            pExtent = pExtentCur;
-            break;
+            pThis->idxExtentLast = idxCur;
+            return pExtentCur;
         }
+    }
 
-        idxCur = idxMin + (idxMax - idxMin) / 2;
+    return NULL;
+}
+
+/**
+ * Returns the least recently used chunk cache entry which is in use,
+ * skipping the given one.
+ */
+static PDMGCHUNK dmgChunkCacheGetLru(PDMGIMAGE pThis, PDMGCHUNK pChunkSkip)
+{
+    PDMGCHUNK pChunkLru = NULL;
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aChunks); i++)
+    {
+        PDMGCHUNK pChunk = &pThis->aChunks[i];
+        if (   pChunk != pChunkSkip
+            && pChunk->pExtent
+            && (!pChunkLru || pChunk->uLastUse < pChunkLru->uLastUse))
+            pChunkLru = pChunk;
     }
 
-    if (pExtent)
-        pThis->idxExtentLast = idxCur;
+    return pChunkLru;
+}
+
+/**
+ * Drops the data of a chunk cache entry, optionally freeing the buffer.
+ */
+static void dmgChunkCacheEvict(PDMGIMAGE pThis, PDMGCHUNK pChunk, bool fFree)
+{
+    if (pChunk->pExtent)
+    {
+        pChunk->pExtent->pChunk = NULL;
+        pChunk->pExtent = NULL;
+    }
+
+    if (fFree && pChunk->pvData)
+    {
+        RTMemFree(pChunk->pvData);
+        pThis->cbChunksCached -= pChunk->cbData;
+        pChunk->pvData = NULL;
+        pChunk->cbData = 0;
+    }
+}
+
+/**
+ * Returns the decompressed data of the given compressed extent, either from
+ * the chunk cache or by inflating it and adding it to the cache, replacing
+ * the least recently used entries if necessary.
+ *
+ * @returns VBox status code.
+ * @param   pThis          DMG instance data.
+ * @param   pExtent        The compressed extent.
+ * @param   ppChunk        Where to store the cache entry holding the data.
+ */
+static int dmgChunkCacheGet(PDMGIMAGE pThis, PDMGEXTENT pExtent, PDMGCHUNK *ppChunk)
+{
+    PDMGCHUNK pChunk = pExtent->pChunk;
+    int rc = VINF_SUCCESS;
+
+    if (!pChunk)
+    {
+        size_t cbChunk = DMG_BLOCK2BYTE(pExtent->cSectorsExtent);
+
+        /* Prefer an unused entry, replace the least recently used one otherwise. */
+        for (unsigned i = 0; i < RT_ELEMENTS(pThis->aChunks); i++)
+            if (!pThis->aChunks[i].pExtent)
+            {
+                pChunk = &pThis->aChunks[i];
+                break;
+            }
+        if (!pChunk)
+            pChunk = dmgChunkCacheGetLru(pThis, NULL);
+        AssertPtr(pChunk);
+
+        /* Keep the buffer if it has the right size, which is the common case. */
+        dmgChunkCacheEvict(pThis, pChunk, pChunk->cbData != cbChunk);
+
+        /* Stay within the memory limit. */
+        while (pThis->cbChunksCached + (pChunk->pvData ? 0 : cbChunk) > DMG_CHUNK_CACHE_SIZE_MAX)
+        {
+            PDMGCHUNK pChunkLru = dmgChunkCacheGetLru(pThis, pChunk);
+            if (!pChunkLru)
+                break;
+            dmgChunkCacheEvict(pThis, pChunkLru, true /* fFree */);
+        }
 
-    return pExtent;
+        if (!pChunk->pvData)
+        {
+            pChunk->pvData = RTMemAlloc(cbChunk);
+            if (!pChunk->pvData)
+                return VERR_NO_MEMORY;
+            pChunk->cbData = cbChunk;
+            pThis->cbChunksCached += cbChunk;
+        }
+
+        rc = dmgFileInflateSync(pThis, pExtent->offFileStart, pExtent->cbFile,
+                                pChunk->pvData, cbChunk);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        pChunk->pExtent = pExtent;
+        pExtent->pChunk = pChunk;
+    }
+
+    pChunk->uLastUse = ++pThis->uChunkUseCounter;
+    *ppChunk = pChunk;
+    return rc;
 }
 
 /**
@@ -1687,6 +1874,9 @@ static DECLCALLBACK(int) dmgOpenImage(PDMGIMAGE pThis, unsigned uOpenFlags)
                     if (RT_FAILURE(rc))
                         break;
                 }
+
+                if (RT_SUCCESS(rc))
+                    rc = dmgExtentIndexBuild(pThis);
             }
             else
                 rc = VERR_VD_DMG_INVALID_HEADER;
@@ -1939,33 +2129,11 @@ static DECLCALLBACK(int) dmgRead(void *pBackendData, uint64_t uOffset,  size_t c
             }
             case DMGEXTENTTYPE_COMP_ZLIB:
             {
-                if (pThis->pExtentDecomp != pExtent)
-                {
-                    if (DMG_BLOCK2BYTE(pExtent->cSectorsExtent) > pThis->cbDecompExtent)
-                    {
-                        if (RT_LIKELY(pThis->pvDecompExtent))
-                            RTMemFree(pThis->pvDecompExtent);
-
-                        pThis->pvDecompExtent = RTMemAllocZ(DMG_BLOCK2BYTE(pExtent->cSectorsExtent));
-                        if (!pThis->pvDecompExtent)
-                            rc = VERR_NO_MEMORY;
-                        else
-                            pThis->cbDecompExtent = DMG_BLOCK2BYTE(pExtent->cSectorsExtent);
-                    }
-
-                    if (RT_SUCCESS(rc))
-                    {
-                        rc = dmgFileInflateSync(pThis, pExtent->offFileStart, pExtent->cbFile,
-                                                pThis->pvDecompExtent,
-                                                RT_MIN(pThis->cbDecompExtent, DMG_BLOCK2BYTE(pExtent->cSectorsExtent)));
-                        if (RT_SUCCESS(rc))
-                            pThis->pExtentDecomp = pExtent;
-                    }
-                }
-
+                PDMGCHUNK pChunk = NULL;
+                rc = dmgChunkCacheGet(pThis, pExtent, &pChunk);
                 if (RT_SUCCESS(rc))
                     vdIfIoIntIoCtxCopyTo(pThis->pIfIoXxx, pIoCtx,
-                                         (uint8_t *)pThis->pvDecompExtent + DMG_BLOCK2BYTE(uExtentRel),
+                                         (uint8_t *)pChunk->pvData + DMG_BLOCK2BYTE(uExtentRel),
                                          cbToRead);
                 break;
             }
@@ -2574,6 +2742,8 @@ const VBOXHDDBACKEND g_DmgBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
+    NULL,
+    /* pfnQueryAllocationStatus */
     NULL
 };
 
@@ -110,7 +110,7 @@ typedef enum SCSIDEVTYPE
 
 /** Maximum PDU payload size we can handle in one piece. Greater or equal than
  * s_iscsiConfigDefaultWriteSplit. */
-#define ISCSI_DATA_LENGTH_MAX _256K
+#define ISCSI_DATA_LENGTH_MAX _1M
 
 /** Maximum PDU size we can handle in one piece. */
 #define ISCSI_RECV_PDU_BUFFER_SIZE (ISCSI_DATA_LENGTH_MAX + ISCSI_BHS_SIZE)
@@ -532,6 +532,12 @@ typedef struct ISCSIIMAGE
     uint32_t            cbSendDataLength;
     /** Negotiated maximum data length when receiving from target. */
     uint32_t            cbRecvDataLength;
+    /** Maximum data segment length the target accepts in a single PDU. */
+    uint32_t            cbSendSegmentLength;
+    /** Negotiated maximum amount of unsolicited data for a single command. */
+    uint32_t            cbFirstBurstLength;
+    /** Flag whether the target accepts immediate data in the command PDU. */
+    bool                fImmediateData;
 
     /** Current state of the connection/session. */
     ISCSISTATE          state;
@@ -595,6 +601,11 @@ typedef struct ISCSIIMAGE
     uint8_t             *pbRecvPDUBufCur;
     /** Flag whether we are currently reading the BHS. */
     bool                fRecvPDUBHS;
+    /** SCSI request the payload of the Data-In PDU being received is placed into
+     * directly, NULL if the payload goes into the PDU buffer. */
+    PSCSIREQ            pScsiReqRecvDirect;
+    /** Number of payload bytes left to place directly into the request. */
+    size_t              cbRecvDirectLeft;
     /** List of PDUs waiting to get transmitted. */
     PISCSIPDUTX         pIScsiPDUTxHead;
     /** Tail of PDUs waiting to get transmitted. */
@@ -627,7 +638,7 @@ static const char *s_iscsiConfigDefaultLUN = "0";
 static const char *s_iscsiConfigDefaultTimeout = "10000";
 
 /** Default write split value, less or equal to ISCSI_DATA_LENGTH_MAX. */
-static const char *s_iscsiConfigDefaultWriteSplit = "262144";
+static const char *s_iscsiConfigDefaultWriteSplit = "1048576";
 
 /** Default host IP stack. */
 static const char *s_iscsiConfigDefaultHostIPStack = "1";
@@ -1231,16 +1242,21 @@ static DECLCALLBACK(int) iscsiAttach(void *pvUser)
     PISCSIIMAGE pImage = (PISCSIIMAGE)pvUser;
 
     bool fParameterNeg = true;;
-    pImage->cbRecvDataLength = ISCSI_DATA_LENGTH_MAX;
-    pImage->cbSendDataLength = RT_MIN(ISCSI_DATA_LENGTH_MAX, pImage->cbWriteSplit);
+    pImage->cbRecvDataLength    = ISCSI_DATA_LENGTH_MAX;
+    pImage->cbSendDataLength    = RT_MIN(ISCSI_DATA_LENGTH_MAX, pImage->cbWriteSplit);
+    pImage->cbSendSegmentLength = ISCSI_DATA_LENGTH_MAX;
+    pImage->cbFirstBurstLength  = ISCSI_DATA_LENGTH_MAX;
+    pImage->fImmediateData      = true;
     char szMaxDataLength[16];
     RTStrPrintf(szMaxDataLength, sizeof(szMaxDataLength), "%u", ISCSI_DATA_LENGTH_MAX);
+    /* Data beyond the immediate data is only sent in answer to R2T PDUs, there are no
+     * unsolicited Data-Out PDUs. So the target must not wait for them (InitialR2T=Yes). */
     ISCSIPARAMETER aParameterNeg[] =
     {
         { "HeaderDigest", "None", 0 },
         { "DataDigest", "None", 0 },
         { "MaxConnections", "1", 0 },
-        { "InitialR2T", "No", 0 },
+        { "InitialR2T", "Yes", 0 },
         { "ImmediateData", "Yes", 0 },
         { "MaxRecvDataSegmentLength", szMaxDataLength, 0 },
         { "MaxBurstLength", szMaxDataLength, 0 },
@@ -2296,9 +2312,48 @@ static int iscsiRecvPDU(PISCSIIMAGE pImage, uint32_t itt, PISCSIRES paRes, uint3
  */
 static void iscsiRecvPDUReset(PISCSIIMAGE pImage)
 {
-    pImage->cbRecvPDUResidual = ISCSI_BHS_SIZE;
-    pImage->fRecvPDUBHS       = true;
-    pImage->pbRecvPDUBufCur   = (uint8_t *)pImage->pvRecvPDUBuf;
+    pImage->cbRecvPDUResidual  = ISCSI_BHS_SIZE;
+    pImage->fRecvPDUBHS        = true;
+    pImage->pbRecvPDUBufCur    = (uint8_t *)pImage->pvRecvPDUBuf;
+    pImage->pScsiReqRecvDirect = NULL;
+    pImage->cbRecvDirectLeft   = 0;
+}
+
+/**
+ * Checks whether the payload of the Data-In PDU whose BHS was just received
+ * can be placed into the buffers of the SCSI request directly and sets up
+ * the receive state accordingly.
+ *
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   cbData      Size of the payload without padding.
+ */
+static void iscsiRecvPDUDirectSetup(PISCSIIMAGE pImage, size_t cbData)
+{
+    const uint32_t *pcvResBHS = (const uint32_t *)pImage->pvRecvPDUBuf;
+    PISCSICMD pIScsiCmd = iscsiCmdGetFromItt(pImage, pcvResBHS[4]);
+
+    if (   pIScsiCmd
+        && pIScsiCmd->enmCmdType == ISCSICMDTYPE_REQ)
+    {
+        PSCSIREQ pScsiReq = pIScsiCmd->CmdType.ScsiReq.pScsiReq;
+        PRTSGBUF pSgBuf = &pScsiReq->SgBufT2I;
+        size_t cbLeft = 0;
+
+        if (pSgBuf->idxSeg < pSgBuf->cSegs)
+        {
+            cbLeft = pSgBuf->cbSegLeft;
+            for (unsigned iSeg = pSgBuf->idxSeg + 1; iSeg < pSgBuf->cSegs; iSeg++)
+                cbLeft += pSgBuf->paSegs[iSeg].cbSeg;
+        }
+
+        /* Anything not fitting is left to iscsiRecvPDUUpdateRequest to complain about. */
+        if (cbData <= cbLeft)
+        {
+            pImage->pScsiReqRecvDirect = pScsiReq;
+            pImage->cbRecvDirectLeft   = cbData;
+            pImage->cbRecvPDUResidual -= cbData; /* Only the padding goes into the PDU buffer. */
+        }
+    }
 }
 
 static void iscsiPDUTxAdd(PISCSIIMAGE pImage, PISCSIPDUTX pIScsiPDUTx, bool fFront)
@@ -2336,7 +2391,8 @@ static int iscsiRecvPDUAsync(PISCSIIMAGE pImage)
     LogFlowFunc(("pImage=%#p\n", pImage));
 
     /* Check if we are in the middle of a PDU receive. */
-    if (pImage->cbRecvPDUResidual == 0)
+    if (   pImage->cbRecvPDUResidual == 0
+        && pImage->cbRecvDirectLeft == 0)
     {
         /*
          * We are receiving a new PDU, don't read more than the BHS initially
@@ -2346,10 +2402,33 @@ static int iscsiRecvPDUAsync(PISCSIIMAGE pImage)
         LogFlow(("Receiving new PDU\n"));
     }
 
-    rc = pImage->pIfNet->pfnReadNB(pImage->Socket, pImage->pbRecvPDUBufCur,
-                                                   pImage->cbRecvPDUResidual, &cbActuallyRead);
-    if (RT_SUCCESS(rc) && cbActuallyRead == 0)
-        rc = VERR_BROKEN_PIPE;
+    if (pImage->cbRecvDirectLeft)
+    {
+        /* Place the Data-In payload directly into the buffers of the request. */
+        PRTSGBUF pSgBuf = &pImage->pScsiReqRecvDirect->SgBufT2I;
+
+        rc = pImage->pIfNet->pfnReadNB(pImage->Socket, pSgBuf->pvSegCur,
+                                       RT_MIN(pSgBuf->cbSegLeft, pImage->cbRecvDirectLeft),
+                                       &cbActuallyRead);
+        if (RT_SUCCESS(rc) && cbActuallyRead == 0)
+            rc = VERR_BROKEN_PIPE;
+        if (RT_SUCCESS(rc))
+        {
+            RTSgBufAdvance(pSgBuf, cbActuallyRead);
+            pImage->cbRecvDirectLeft -= cbActuallyRead;
+            /* Continue with the padding (if any) on the next call. */
+            if (pImage->cbRecvDirectLeft || pImage->cbRecvPDUResidual)
+                return VINF_SUCCESS;
+            cbActuallyRead = 0;
+        }
+    }
+    else
+    {
+        rc = pImage->pIfNet->pfnReadNB(pImage->Socket, pImage->pbRecvPDUBufCur,
+                                       pImage->cbRecvPDUResidual, &cbActuallyRead);
+        if (RT_SUCCESS(rc) && cbActuallyRead == 0)
+            rc = VERR_BROKEN_PIPE;
+    }
 
     if (RT_SUCCESS(rc))
     {
@@ -2371,9 +2450,15 @@ static int iscsiRecvPDUAsync(PISCSIIMAGE pImage)
             cbDataLength = ((cbDataLength - 1) | 3) + 1;    /* Add padding. */
             pImage->cbRecvPDUResidual = cbAHSLength + cbDataLength;
             pImage->fRecvPDUBHS = false; /* Start receiving the rest of the PDU. */
+
+            if (   (RT_N2H_U32(((uint32_t *)(pImage->pvRecvPDUBuf))[0]) & ISCSIOP_MASK) == ISCSIOP_SCSI_DATA_IN
+                && !cbAHSLength
+                && (word1 & 0x00ffffff))
+                iscsiRecvPDUDirectSetup(pImage, word1 & 0x00ffffff);
         }
 
-        if (!pImage->cbRecvPDUResidual)
+        if (   !pImage->cbRecvPDUResidual
+            && !pImage->cbRecvDirectLeft)
         {
             /* We received the complete PDU with or without any payload now. */
             LogFlow(("Received complete PDU\n"));
@@ -2402,11 +2487,13 @@ static int iscsiSendPDUAsync(PISCSIIMAGE pImage)
          * If there is no PDU active, get the first one from the list.
          * Check that we are allowed to transfer the PDU by comparing the
          * command sequence number and the maximum sequence number allowed by the target.
+         * Only PDUs starting a new command are subject to the command window.
          */
         if (!pImage->pIScsiPDUTxCur)
         {
             if (   !pImage->pIScsiPDUTxHead
-                || serial_number_greater(pImage->pIScsiPDUTxHead->CmdSN, pImage->MaxCmdSN))
+                || (   pImage->pIScsiPDUTxHead->pIScsiCmd
+                    && serial_number_greater(pImage->pIScsiPDUTxHead->CmdSN, pImage->MaxCmdSN)))
                 break;
 
             pImage->pIScsiPDUTxCur = pImage->pIScsiPDUTxHead;
@@ -2674,8 +2761,13 @@ static int iscsiValidatePDU(PISCSIRES paRes, uint32_t cnRes)
                 ||  (RT_N2H_U32(pcrgResBHS[4]) != ISCSI_TASK_TAG_RSVD))
                 return VERR_PARSE_ERROR;
             break;
-        case ISCSIOP_SCSI_TASKMGMT_RES:
         case ISCSIOP_R2T:
+            /* R2T PDUs must have the final bit set and must not contain any data. */
+            if (    ((hw0 & ISCSI_FINAL_BIT) == 0)
+                ||  (RT_N2H_U32(pcrgResBHS[1]) != 0))
+                return VERR_PARSE_ERROR;
+            break;
+        case ISCSIOP_SCSI_TASKMGMT_RES:
         case ISCSIOP_REJECT:
         default:
             /* Do some logging, ignore PDU. */
@@ -2691,6 +2783,56 @@ static int iscsiValidatePDU(PISCSIRES paRes, uint32_t cnRes)
 }
 
 
+/**
+ * Appends the segments describing the given range of the initiator to target
+ * data of a SCSI request to the segment array of a PDU, including the padding.
+ * The data is referenced directly, nothing is copied.
+ *
+ * @returns Number of bytes added to the PDU, including padding.
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   pIScsiPDU   The PDU to add the segments to, must have room for
+ *                      cI2TSegs + 1 more segments.
+ * @param   pScsiReq    The SCSI request holding the data.
+ * @param   offData     Start offset of the range in the request data.
+ * @param   cbData      Size of the range in bytes.
+ */
+static size_t iscsiPDUTxAddData(PISCSIIMAGE pImage, PISCSIPDUTX pIScsiPDU, PSCSIREQ pScsiReq,
+                                size_t offData, size_t cbData)
+{
+    size_t cbAdded = 0;
+
+    for (unsigned iSeg = 0; iSeg < pScsiReq->cI2TSegs && cbData; iSeg++)
+    {
+        size_t cbSeg = pScsiReq->paI2TSegs[iSeg].cbSeg;
+
+        if (offData >= cbSeg)
+        {
+            offData -= cbSeg;
+            continue;
+        }
+
+        size_t cbThisSeg = RT_MIN(cbSeg - offData, cbData);
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].pvSeg = (uint8_t *)pScsiReq->paI2TSegs[iSeg].pvSeg + offData;
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].cbSeg = cbThisSeg;
+        pIScsiPDU->cISCSIReq++;
+        cbAdded += cbThisSeg;
+        cbData  -= cbThisSeg;
+        offData  = 0;
+    }
+    Assert(!cbData);
+
+    /* Add padding if necessary. */
+    if (cbAdded & 3)
+    {
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].pvSeg = &pImage->aPadding[0];
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].cbSeg = 4 - (cbAdded & 3);
+        cbAdded += pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].cbSeg;
+        pIScsiPDU->cISCSIReq++;
+    }
+
+    return cbAdded;
+}
+
 /**
  * Prepares a PDU to transfer for the given command and adds it to the list.
  */
@@ -2699,7 +2841,7 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     int rc = VINF_SUCCESS;
     uint32_t *paReqBHS;
     size_t cbData = 0;
-    size_t cbSegs = 0;
+    size_t cbImmediate = 0;
     PSCSIREQ pScsiReq;
     PISCSIPDUTX pIScsiPDU = NULL;
 
@@ -2713,11 +2855,8 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     if (pScsiReq->cT2ISegs)
         RTSgBufInit(&pScsiReq->SgBufT2I, pScsiReq->paT2ISegs, pScsiReq->cT2ISegs);
 
-    /*
-     * Allocate twice as much entries as required for padding (worst case).
-     * The additional segment is for the BHS.
-     */
-    size_t cI2TSegs = 2*(pScsiReq->cI2TSegs + 1);
+    /* The additional segments are for the BHS and the padding. */
+    size_t cI2TSegs = pScsiReq->cI2TSegs + 2;
     pIScsiPDU = (PISCSIPDUTX)RTMemAllocZ(RT_OFFSETOF(ISCSIPDUTX, aISCSIReq[cI2TSegs]));
     if (!pIScsiPDU)
         return VERR_NO_MEMORY;
@@ -2729,12 +2868,20 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     else
         cbData = (uint32_t)pScsiReq->cbI2TData;
 
+    /*
+     * Send as much data as allowed as immediate data with the command, the target
+     * requests the rest with R2T PDUs. No unsolicited Data-Out PDUs are sent.
+     */
+    if (pImage->fImmediateData)
+        cbImmediate = RT_MIN(pScsiReq->cbI2TData,
+                             RT_MIN(pImage->cbFirstBurstLength, pImage->cbSendSegmentLength));
+
     paReqBHS = pIScsiPDU->aBHS;
 
     /* Setup the BHS. */
     paReqBHS[0] = RT_H2N_U32(  ISCSI_FINAL_BIT | ISCSI_TASK_ATTR_SIMPLE | ISCSIOP_SCSI_CMD
                              | (pScsiReq->enmXfer << 21)); /* I=0,F=1,Attr=Simple */
-    paReqBHS[1] = RT_H2N_U32(0x00000000 | ((uint32_t)pScsiReq->cbI2TData & 0xffffff)); /* TotalAHSLength=0 */
+    paReqBHS[1] = RT_H2N_U32(0x00000000 | ((uint32_t)cbImmediate & 0xffffff)); /* TotalAHSLength=0 */
     paReqBHS[2] = RT_H2N_U32(pImage->LUN >> 32);
     paReqBHS[3] = RT_H2N_U32(pImage->LUN & 0xffffffff);
     paReqBHS[4] = pIScsiCmd->Itt;
@@ -2747,38 +2894,17 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     pImage->CmdSN++;
 
     /* Setup the S/G buffers. */
-    uint32_t cnISCSIReq = 0;
-    pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg = sizeof(pIScsiPDU->aBHS);
-    pIScsiPDU->aISCSIReq[cnISCSIReq].pvSeg = pIScsiPDU->aBHS;
-    cnISCSIReq++;
-    cbSegs = sizeof(pIScsiPDU->aBHS);
+    pIScsiPDU->aISCSIReq[0].cbSeg = sizeof(pIScsiPDU->aBHS);
+    pIScsiPDU->aISCSIReq[0].pvSeg = pIScsiPDU->aBHS;
+    pIScsiPDU->cISCSIReq = 1;
+    pIScsiPDU->cbSgLeft  = sizeof(pIScsiPDU->aBHS);
     /* Padding is not necessary for the BHS. */
 
-    if (pScsiReq->cbI2TData)
-    {
-        for (unsigned cSeg = 0; cSeg < pScsiReq->cI2TSegs; cSeg++)
-        {
-            Assert(cnISCSIReq < cI2TSegs);
-            pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg = pScsiReq->paI2TSegs[cSeg].cbSeg;
-            pIScsiPDU->aISCSIReq[cnISCSIReq].pvSeg = pScsiReq->paI2TSegs[cSeg].pvSeg;
-            cbSegs += pScsiReq->paI2TSegs[cSeg].cbSeg;
-            cnISCSIReq++;
-
-            /* Add padding if necessary. */
-            if (pScsiReq->paI2TSegs[cSeg].cbSeg & 3)
-            {
-                Assert(cnISCSIReq < cI2TSegs);
-                pIScsiPDU->aISCSIReq[cnISCSIReq].pvSeg = &pImage->aPadding[0];
-                pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg = 4 - (pScsiReq->paI2TSegs[cSeg].cbSeg & 3);
-                cbSegs += pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg;
-                cnISCSIReq++;
-            }
-        }
-    }
+    if (cbImmediate)
+        pIScsiPDU->cbSgLeft += iscsiPDUTxAddData(pImage, pIScsiPDU, pScsiReq, 0 /* offData */, cbImmediate);
 
-    pIScsiPDU->cISCSIReq = cnISCSIReq;
-    pIScsiPDU->cbSgLeft  = cbSegs;
-    RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, cnISCSIReq);
+    Assert(pIScsiPDU->cISCSIReq <= cI2TSegs);
+    RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, pIScsiPDU->cISCSIReq);
 
     /* Link the PDU to the list. */
     iscsiPDUTxAdd(pImage, pIScsiPDU, false /* fFront */);
@@ -2791,6 +2917,104 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
 }
 
 
+/**
+ * Prepares the Data-Out PDUs answering a R2T PDU for the given command and
+ * puts them in front of the transmit list.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   pIScsiCmd   The command the target requested data for.
+ * @param   u32TTT      The target transfer tag from the R2T PDU (network byte order).
+ * @param   offBuf      Offset of the requested data in the initiator to target buffer.
+ * @param   cbDesired   Number of bytes requested.
+ */
+static int iscsiPDUTxDataOutPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd, uint32_t u32TTT,
+                                    uint32_t offBuf, uint32_t cbDesired)
+{
+    PSCSIREQ pScsiReq = pIScsiCmd->CmdType.ScsiReq.pScsiReq;
+    PISCSIPDUTX pIScsiPDUHead = NULL;
+    PISCSIPDUTX pIScsiPDUTail = NULL;
+    uint32_t DataSN = 0;
+    int rc = VINF_SUCCESS;
+
+    LogFlowFunc(("pImage=%#p pIScsiCmd=%#p offBuf=%u cbDesired=%u\n", pImage, pIScsiCmd, offBuf, cbDesired));
+
+    if (   !cbDesired
+        || offBuf > pScsiReq->cbI2TData
+        || cbDesired > pScsiReq->cbI2TData - offBuf)
+        return VERR_PARSE_ERROR;
+
+    /* Split the requested range into PDUs the target can accept. */
+    while (cbDesired)
+    {
+        uint32_t cbThisPDU = RT_MIN(cbDesired, pImage->cbSendSegmentLength);
+        PISCSIPDUTX pIScsiPDU = (PISCSIPDUTX)RTMemAllocZ(RT_OFFSETOF(ISCSIPDUTX, aISCSIReq[pScsiReq->cI2TSegs + 2]));
+        if (!pIScsiPDU)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        cbDesired -= cbThisPDU;
+
+        uint32_t *paReqBHS = pIScsiPDU->aBHS;
+        paReqBHS[0] = RT_H2N_U32((cbDesired ? 0 : ISCSI_FINAL_BIT) | ISCSIOP_SCSI_DATA_OUT);
+        paReqBHS[1] = RT_H2N_U32(cbThisPDU & 0xffffff); /* TotalAHSLength=0 */
+        paReqBHS[2] = RT_H2N_U32(pImage->LUN >> 32);
+        paReqBHS[3] = RT_H2N_U32(pImage->LUN & 0xffffffff);
+        paReqBHS[4] = pIScsiCmd->Itt;
+        paReqBHS[5] = u32TTT;
+        paReqBHS[6] = 0;            /* reserved */
+        paReqBHS[7] = RT_H2N_U32(pImage->ExpStatSN);
+        paReqBHS[8] = 0;            /* reserved */
+        paReqBHS[9] = RT_H2N_U32(DataSN);
+        paReqBHS[10] = RT_H2N_U32(offBuf);
+        paReqBHS[11] = 0;           /* reserved */
+
+        pIScsiPDU->aISCSIReq[0].cbSeg = sizeof(pIScsiPDU->aBHS);
+        pIScsiPDU->aISCSIReq[0].pvSeg = pIScsiPDU->aBHS;
+        pIScsiPDU->cISCSIReq = 1;
+        pIScsiPDU->cbSgLeft  = sizeof(pIScsiPDU->aBHS)
+                             + iscsiPDUTxAddData(pImage, pIScsiPDU, pScsiReq, offBuf, cbThisPDU);
+        RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, pIScsiPDU->cISCSIReq);
+
+        if (pIScsiPDUTail)
+            pIScsiPDUTail->pNext = pIScsiPDU;
+        else
+            pIScsiPDUHead = pIScsiPDU;
+        pIScsiPDUTail = pIScsiPDU;
+
+        offBuf += cbThisPDU;
+        DataSN++;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        /*
+         * Put the sequence in front of the list, the target can't complete the command
+         * and open the command window for the waiting PDUs before it got the data.
+         */
+        pIScsiPDUTail->pNext = pImage->pIScsiPDUTxHead;
+        pImage->pIScsiPDUTxHead = pIScsiPDUHead;
+        if (!pImage->pIScsiPDUTxTail)
+            pImage->pIScsiPDUTxTail = pIScsiPDUTail;
+
+        if (!pImage->pIScsiPDUTxCur)
+            rc = iscsiSendPDUAsync(pImage);
+    }
+    else
+    {
+        while (pIScsiPDUHead)
+        {
+            PISCSIPDUTX pIScsiPDUFree = pIScsiPDUHead;
+            pIScsiPDUHead = pIScsiPDUHead->pNext;
+            RTMemFree(pIScsiPDUFree);
+        }
+    }
+
+    return rc;
+}
+
 /**
  * Updates the state of a request from the PDU we received.
  *
@@ -2882,9 +3106,12 @@ static int iscsiRecvPDUUpdateRequest(PISCSIIMAGE pImage, PISCSIRES paRes, uint32
             }
             else
             {
-                /* Copy data from the received PDU into the T2I segments. */
-                size_t cbCopied = RTSgBufCopyFromBuf(&pScsiReq->SgBufT2I, pvData, cbData);
-                Assert(cbCopied == cbData);
+                /* Copy data from the received PDU into the T2I segments unless it was placed there already. */
+                if (pImage->pScsiReqRecvDirect != pScsiReq)
+                {
+                    size_t cbCopied = RTSgBufCopyFromBuf(&pScsiReq->SgBufT2I, pvData, cbData);
+                    Assert(cbCopied == cbData);
+                }
 
                 if (final && (RT_N2H_U32(paResBHS[0]) & ISCSI_STATUS_BIT) != 0)
                 {
@@ -2894,6 +3121,15 @@ static int iscsiRecvPDUUpdateRequest(PISCSIIMAGE pImage, PISCSIRES paRes, uint32
                 }
             }
         }
+        else if (cmd == ISCSIOP_R2T)
+        {
+            /* The target asks for the part of the write data which was not sent as immediate data. */
+            if (pScsiReq->enmXfer != SCSIXFER_TO_TARGET)
+                rc = VERR_PARSE_ERROR;
+            else
+                rc = iscsiPDUTxDataOutPrepare(pImage, pIScsiCmd, paResBHS[5], RT_N2H_U32(paResBHS[10]),
+                                              RT_N2H_U32(paResBHS[11]));
+        }
         else
             rc = VERR_PARSE_ERROR;
     }
@@ -3118,6 +3354,7 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     const char *pcszMaxRecvDataSegmentLength = NULL;
     const char *pcszMaxBurstLength = NULL;
     const char *pcszFirstBurstLength = NULL;
+    const char *pcszImmediateData = NULL;
     rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "MaxRecvDataSegmentLength", &pcszMaxRecvDataSegmentLength);
     if (rc == VERR_INVALID_NAME)
         rc = VINF_SUCCESS;
@@ -3129,16 +3366,21 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     if (RT_FAILURE(rc))
         return VERR_PARSE_ERROR;
     rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "FirstBurstLength", &pcszFirstBurstLength);
+    if (rc == VERR_INVALID_NAME)
+        rc = VINF_SUCCESS;
+    if (RT_FAILURE(rc))
+        return VERR_PARSE_ERROR;
+    rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "ImmediateData", &pcszImmediateData);
     if (rc == VERR_INVALID_NAME)
         rc = VINF_SUCCESS;
     if (RT_FAILURE(rc))
         return VERR_PARSE_ERROR;
     if (pcszMaxRecvDataSegmentLength)
     {
-        uint32_t cb = pImage->cbSendDataLength;
+        uint32_t cb = pImage->cbSendSegmentLength;
         rc = RTStrToUInt32Full(pcszMaxRecvDataSegmentLength, 0, &cb);
         AssertRC(rc);
-        pImage->cbSendDataLength = RT_MIN(pImage->cbSendDataLength, cb);
+        pImage->cbSendSegmentLength = RT_MIN(pImage->cbSendSegmentLength, cb);
     }
     if (pcszMaxBurstLength)
     {
@@ -3149,11 +3391,21 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     }
     if (pcszFirstBurstLength)
     {
-        uint32_t cb = pImage->cbSendDataLength;
+        uint32_t cb = pImage->cbFirstBurstLength;
         rc = RTStrToUInt32Full(pcszFirstBurstLength, 0, &cb);
         AssertRC(rc);
-        pImage->cbSendDataLength = RT_MIN(pImage->cbSendDataLength, cb);
+        pImage->cbFirstBurstLength = RT_MIN(pImage->cbFirstBurstLength, cb);
     }
+    if (pcszImmediateData)
+        pImage->fImmediateData = !strcmp(pcszImmediateData, "Yes");
+
+    /*
+     * Only the I/O thread answers R2T PDUs with Data-Out PDUs. Without it all data
+     * of a write must go out as immediate data in the command PDU.
+     */
+    if (!pImage->fExtendedSelectSupported)
+        pImage->cbSendDataLength = RT_MIN(pImage->cbSendDataLength,
+                                          RT_MIN(pImage->cbFirstBurstLength, pImage->cbSendSegmentLength));
     return VINF_SUCCESS;
 }
 
@@ -5559,5 +5811,7 @@ const VBOXHDDBACKEND g_ISCSIBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
+    NULL,
+    /* pfnQueryAllocationStatus */
     NULL
 };
@@ -1310,5 +1310,7 @@ const VBOXHDDBACKEND g_ParallelsBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
+    NULL,
+    /* pfnQueryAllocationStatus */
     NULL
 };
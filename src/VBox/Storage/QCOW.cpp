@@ -2476,6 +2476,38 @@ static DECLCALLBACK(int) qcowSetParentFilename(void *pBackendData, const char *p
 
 
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocationStatus */
+static DECLCALLBACK(int) qcowQueryAllocationStatus(void *pBackendData, uint64_t uOffset,
+                                                   uint64_t cbRange, bool *pfAllocated,
+                                                   uint64_t *pcbExtent)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu\n", pBackendData, uOffset, cbRange));
+    PQCOWIMAGE pImage = (PQCOWIMAGE)pBackendData;
+
+    AssertPtr(pImage);
+    AssertReturn(uOffset + cbRange <= pImage->cbSize && cbRange, VERR_INVALID_PARAMETER);
+
+    /*
+     * Only the L1 table is kept in memory, so a range is reported as unallocated
+     * only if it isn't covered by any L2 table.
+     */
+    uint64_t cbL1Entry = RT_BIT_64(pImage->cL1Shift);
+    uint32_t idxL1 = (uint32_t)(uOffset >> pImage->cL1Shift);
+    bool fAllocated = pImage->paL1Table[idxL1] != 0;
+    uint64_t cbExtent = cbL1Entry - (uOffset & (cbL1Entry - 1));
+
+    while (   cbExtent < cbRange
+           && ++idxL1 < pImage->cL1TableEntries
+           && (pImage->paL1Table[idxL1] != 0) == fAllocated)
+        cbExtent += cbL1Entry;
+
+    *pfAllocated = fAllocated;
+    *pcbExtent   = RT_MIN(cbExtent, cbRange);
+    LogFlowFunc(("returns VINF_SUCCESS fAllocated=%RTbool cbExtent=%llu\n", *pfAllocated, *pcbExtent));
+    return VINF_SUCCESS;
+}
+
+
 const VBOXHDDBACKEND g_QCowBackend =
 {
     /* pszBackendName */
@@ -2571,5 +2603,7 @@ const VBOXHDDBACKEND g_QCowBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
-    NULL
+    NULL,
+    /* pfnQueryAllocationStatus */
+    qcowQueryAllocationStatus
 };
@@ -1243,5 +1243,7 @@ const VBOXHDDBACKEND g_RawBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
+    NULL,
+    /* pfnQueryAllocationStatus */
     NULL
 };
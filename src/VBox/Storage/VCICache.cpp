@@ -28,6 +28,8 @@
 #include <iprt/alloc.h>
 #include <iprt/file.h>
 #include <iprt/asm.h>
+#include <iprt/avl.h>
+#include <iprt/list.h>
 
 #include "VDBackends.h"
 
@@ -207,6 +209,11 @@ typedef uint8_t VciBlkMapEnt;
 *   Constants And Macros, Structures and Typedefs                                                                                *
 *********************************************************************************************************************************/
 
+/** Maximum number of blocks a single cache extent covers, larger writes are split. */
+#define VCI_EXTENT_BLOCKS_MAX      VCI_BYTE2BLOCK(_1M)
+/** Maximum depth of the B+-Tree accepted when loading an image. */
+#define VCI_TREE_DEPTH_MAX         8
+
 /**
  * Block range descriptor.
  */
@@ -247,90 +254,19 @@ typedef struct VCIBLKMAP
 /** Pointer to a block map. */
 typedef VCIBLKMAP *PVCIBLKMAP;
 
-/**
- * B+-Tree node header.
- */
-typedef struct VCITREENODE
-{
-    /** Type of the node (VCI_TREE_NODE_TYPE_*). */
-    uint8_t             u8Type;
-    /** Block address where the node is stored. */
-    uint64_t            u64BlockAddr;
-    /** Pointer to the parent. */
-    struct VCITREENODE *pParent;
-} VCITREENODE, *PVCITREENODE;
-
-/**
- * B+-Tree node pointer.
- */
-typedef struct VCITREENODEPTR
-{
-    /** Flag whether the node is in memory or still on the disk. */
-    bool         fInMemory;
-    /** Type dependent data. */
-    union
-    {
-        /** Pointer to a in memory node. */
-        PVCITREENODE pNode;
-        /** Start block address of the node. */
-        uint64_t     offAddrBlockNode;
-    } u;
-} VCITREENODEPTR, *PVCITREENODEPTR;
-
-/**
- * Internal node.
- */
-typedef struct VCINODEINTERNAL
-{
-    /** First block of cached data the internal node represents. */
-    uint64_t       u64BlockOffset;
-    /** Number of blocks the internal node represents. */
-    uint32_t       u32Blocks;
-    /** Pointer to the child node. */
-    VCITREENODEPTR PtrChild;
-} VCINODEINTERNAL, *PVCINODEINTERNAL;
-
-/**
- * A in memory internal B+-tree node.
- */
-typedef struct VCITREENODEINT
-{
-    /** Node core. */
-    VCITREENODE     Core;
-    /** Number of used nodes. */
-    unsigned        cUsedNodes;
-    /** Array of internal nodes. */
-    VCINODEINTERNAL aIntNodes[VCI_TREE_INTERNAL_NODES_PER_NODE];
-} VCITREENODEINT, *PVCITREENODEINT;
-
 /**
  * A in memory cache extent.
  */
 typedef struct VCICACHEEXTENT
 {
-    /** First block of cached data the extent represents. */
-    uint64_t    u64BlockOffset;
-    /** Number of blocks the extent represents. */
-    uint32_t    u32Blocks;
+    /** AVL range tree node, the key covers the first and last cached block. */
+    AVLRU64NODECORE Core;
+    /** Node in the LRU list. */
+    RTLISTNODE      NodeLru;
     /** First block in the image where the data is stored. */
-    uint64_t    u64BlockAddr;
+    uint64_t        u64BlockAddr;
 } VCICACHEEXTENT, *PVCICACHEEXTENT;
 
-/**
- * A in memory leaf B+-tree node.
- */
-typedef struct VCITREENODELEAF
-{
-    /** Node core. */
-    VCITREENODE             Core;
-    /** Next leaf node in the list. */
-    struct VCITREENODELEAF *pNext;
-    /** Number of used nodes. */
-    unsigned                cUsedNodes;
-    /** The extents in the node. */
-    VCICACHEEXTENT          aExtents[VCI_TREE_EXTENTS_PER_NODE];
-} VCITREENODELEAF, *PVCITREENODELEAF;
-
 /**
  * VCI image data structure.
  */
@@ -356,15 +292,34 @@ typedef struct VCICACHE
     unsigned          uImageFlags;
     /** Total size of the image. */
     uint64_t          cbSize;
+    /** Cache type from the header. */
+    uint32_t          u32CacheType;
+    /** UUID of the image. */
+    RTUUID            uuidImage;
+    /** Modification UUID of the cache. */
+    RTUUID            uuidModification;
 
-    /** Offset of the B+-Tree in the image in bytes. */
+    /** Offset of the B+-Tree root in the image in blocks. */
     uint64_t          offTreeRoot;
-    /** Pointer to the root node of the B+-Tree. */
-    PVCITREENODE      pRoot;
-    /** Offset to the block allocation bitmap in bytes. */
+    /** Offset to the block allocation bitmap in blocks. */
     uint64_t          offBlksBitmap;
+    /** Size of the block allocation bitmap in blocks. */
+    uint32_t          cBlkMap;
     /** Block map. */
     PVCIBLKMAP        pBlkMap;
+    /** Number of tree nodes currently stored in the image. */
+    uint32_t          cTreeNodes;
+    /** Maximum number of entries in the tree node address array. */
+    uint32_t          cTreeNodesMax;
+    /** Block addresses of the tree nodes currently stored in the image. */
+    uint64_t         *paTreeNodes;
+
+    /** Extents of cached data, indexed by the virtual block address. */
+    AVLRU64TREE       TreeExtents;
+    /** LRU list of the extents, most recently used first. */
+    RTLISTANCHOR      ListLru;
+    /** Flag whether the header is marked as unclean on disk. */
+    bool              fHdrUnclean;
 } VCICACHE, *PVCICACHE;
 
 /** No block free in bitmap error code. */
@@ -392,6 +347,12 @@ static const char *const s_apszVciFileExtensions[] =
 *   Internal Functions                                                                                                           *
 *********************************************************************************************************************************/
 
+static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap);
+static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint64_t cBlocks,
+                          uint32_t fFlags);
+static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMap);
+static int vciTreeSave(PVCICACHE pCache);
+
 /**
  * Internal. Flush image data to disk.
  */
@@ -408,6 +369,69 @@ static int vciFlushImage(PVCICACHE pCache)
     return rc;
 }
 
+/**
+ * Internal. Writes the header of the image.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   fUnclean        Flag whether to mark the cache as not being closed cleanly.
+ */
+static int vciHdrWrite(PVCICACHE pCache, bool fUnclean)
+{
+    VciHdr Hdr;
+
+    memset(&Hdr, 0, sizeof(VciHdr));
+    Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
+    Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
+    Hdr.cBlocksCache     = RT_H2LE_U64(pCache->pBlkMap->cBlocks);
+    Hdr.fUncleanShutdown = fUnclean ? VCI_HDR_UNCLEAN_SHUTDOWN : VCI_HDR_CLEAN_SHUTDOWN;
+    Hdr.u32CacheType     = RT_H2LE_U32(pCache->u32CacheType);
+    Hdr.offTreeRoot      = RT_H2LE_U64(pCache->offTreeRoot);
+    Hdr.offBlkMap        = RT_H2LE_U64(pCache->offBlksBitmap);
+    Hdr.cBlkMap          = RT_H2LE_U32(pCache->cBlkMap);
+    Hdr.uuidImage        = pCache->uuidImage;
+    Hdr.uuidModification = pCache->uuidModification;
+
+    int rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr, sizeof(Hdr));
+    if (RT_SUCCESS(rc))
+        pCache->fHdrUnclean = fUnclean;
+    return rc;
+}
+
+/**
+ * Internal. Marks the cache as in use on the disk before the first modification.
+ *
+ * The index of the cached data is only written when the cache is closed. If the
+ * host crashes before, the flag makes the next open discard all cached data
+ * instead of trusting stale metadata.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ */
+static int vciHdrMarkUnclean(PVCICACHE pCache)
+{
+    int rc = VINF_SUCCESS;
+
+    if (!pCache->fHdrUnclean)
+    {
+        rc = vciHdrWrite(pCache, true /* fUnclean */);
+        if (RT_SUCCESS(rc))
+            rc = vciFlushImage(pCache);
+    }
+
+    return rc;
+}
+
+/**
+ * Internal. Frees a cache extent, callback for RTAvlrU64Destroy().
+ */
+static DECLCALLBACK(int) vciCacheExtentDestroy(PAVLRU64NODECORE pNode, void *pvUser)
+{
+    NOREF(pvUser);
+    RTMemFree(pNode);
+    return VINF_SUCCESS;
+}
+
 /**
  * Internal. Free all allocated space for representing an image except pCache,
  * and optionally delete the image from disk.
@@ -423,6 +447,25 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
         if (pCache->pStorage)
         {
             /* No point updating the file that is deleted anyway. */
+            if (   !fDelete
+                && !(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+                && pCache->fHdrUnclean
+                && pCache->pBlkMap)
+            {
+                /*
+                 * Write the index and the block map first and mark the cache as
+                 * clean only after everything reached the disk. Nothing to do if
+                 * the cache was not modified since it was opened.
+                 */
+                rc = vciTreeSave(pCache);
+                if (RT_SUCCESS(rc))
+                    rc = vciBlkMapSave(pCache->pBlkMap, pCache, pCache->offBlksBitmap, pCache->cBlkMap);
+                if (RT_SUCCESS(rc))
+                    rc = vciFlushImage(pCache);
+                if (RT_SUCCESS(rc))
+                    rc = vciHdrWrite(pCache, false /* fUnclean */);
+            }
+
             if (!fDelete)
                 vciFlushImage(pCache);
 
@@ -430,6 +473,23 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
             pCache->pStorage = NULL;
         }
 
+        RTAvlrU64Destroy(&pCache->TreeExtents, vciCacheExtentDestroy, NULL);
+        RTListInit(&pCache->ListLru);
+
+        if (pCache->pBlkMap)
+        {
+            vciBlkMapDestroy(pCache->pBlkMap);
+            pCache->pBlkMap = NULL;
+        }
+
+        if (pCache->paTreeNodes)
+        {
+            RTMemFree(pCache->paTreeNodes);
+            pCache->paTreeNodes   = NULL;
+            pCache->cTreeNodes    = 0;
+            pCache->cTreeNodesMax = 0;
+        }
+
         if (fDelete && pCache->pszFilename)
             vdIfIoIntFileDelete(pCache->pIfIo, pCache->pszFilename);
     }
@@ -438,6 +498,18 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
     return rc;
 }
 
+/**
+ * Returns the size of the block map on the disk for the given number of blocks.
+ *
+ * @returns Size of the block map in blocks, including the header.
+ * @param   cBlocks      The number of blocks the bitmap manages.
+ */
+DECLINLINE(uint32_t) vciBlkMapGetSize(uint64_t cBlocks)
+{
+    uint64_t cbBitmap = RT_ALIGN_64((cBlocks + 7) / 8, VCI_BLOCK_SIZE);
+    return (uint32_t)VCI_BYTE2BLOCK(cbBitmap + sizeof(VciBlkMap));
+}
+
 /**
  * Creates a new block map which can manage the given number of blocks.
  *
@@ -452,11 +524,10 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
 static int vciBlkMapCreate(uint64_t cBlocks, PVCIBLKMAP *ppBlkMap, uint32_t *pcBlkMap)
 {
     int rc = VINF_SUCCESS;
-    uint32_t cbBlkMap = RT_ALIGN_Z(cBlocks / sizeof(VciBlkMapEnt) / 8, VCI_BLOCK_SIZE);
     PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
     PVCIBLKRANGEDESC pFree   = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
 
-    LogFlowFunc(("cBlocks=%u ppBlkMap=%#p pcBlkMap=%#p\n", cBlocks, ppBlkMap, pcBlkMap));
+    LogFlowFunc(("cBlocks=%llu ppBlkMap=%#p pcBlkMap=%#p\n", cBlocks, ppBlkMap, pcBlkMap));
 
     if (pBlkMap && pFree)
     {
@@ -474,9 +545,8 @@ static int vciBlkMapCreate(uint64_t cBlocks, PVCIBLKMAP *ppBlkMap, uint32_t *pcB
         pBlkMap->pRangesHead = pFree;
         pBlkMap->pRangesTail = pFree;
 
-        Assert(!((cbBlkMap + sizeof(VciBlkMap)) % VCI_BLOCK_SIZE));
         *ppBlkMap = pBlkMap;
-        *pcBlkMap = VCI_BYTE2BLOCK(cbBlkMap + sizeof(VciBlkMap));
+        *pcBlkMap = vciBlkMapGetSize(cBlocks);
     }
     else
     {
@@ -508,9 +578,8 @@ static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap)
     {
         PVCIBLKRANGEDESC pTmp = pRangeCur;
 
-        RTMemFree(pTmp);
-
         pRangeCur = pRangeCur->pNext;
+        RTMemFree(pTmp);
     }
 
     RTMemFree(pBlkMap);
@@ -518,6 +587,44 @@ static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap)
     LogFlowFunc(("returns\n"));
 }
 
+/**
+ * Appends a block range to the end of the block map while loading it, merging
+ * it with the last range if both have the same state.
+ *
+ * @returns VBox status code.
+ * @param   pBlkMap         The block map.
+ * @param   cBlocks         Number of blocks in the range.
+ * @param   fFree           Flag whether the range is free.
+ */
+static int vciBlkMapAppendRange(PVCIBLKMAP pBlkMap, uint64_t cBlocks, bool fFree)
+{
+    PVCIBLKRANGEDESC pTail = pBlkMap->pRangesTail;
+
+    if (   pTail
+        && pTail->fFree == fFree)
+    {
+        pTail->cBlocks += cBlocks;
+        return VINF_SUCCESS;
+    }
+
+    PVCIBLKRANGEDESC pRangeNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+    if (!pRangeNew)
+        return VERR_NO_MEMORY;
+
+    pRangeNew->fFree        = fFree;
+    pRangeNew->offAddrStart = pTail ? pTail->offAddrStart + pTail->cBlocks : 0;
+    pRangeNew->cBlocks      = cBlocks;
+    pRangeNew->pPrev        = pTail;
+    pRangeNew->pNext        = NULL;
+    if (pTail)
+        pTail->pNext = pRangeNew;
+    else
+        pBlkMap->pRangesHead = pRangeNew;
+    pBlkMap->pRangesTail = pRangeNew;
+
+    return VINF_SUCCESS;
+}
+
 /**
  * Loads the block map from the specified medium and creates all necessary
  * in memory structures to manage used and free blocks.
@@ -536,152 +643,86 @@ static int vciBlkMapLoad(PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMa
     LogFlowFunc(("pStorage=%#p offBlkMap=%llu cBlkMap=%u ppBlkMap=%#p\n",
                  pStorage, offBlkMap, cBlkMap, ppBlkMap));
 
-    if (cBlkMap >= VCI_BYTE2BLOCK(sizeof(VciBlkMap)))
+    rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage, VCI_BLOCK2BYTE(offBlkMap),
+                               &BlkMap, sizeof(VciBlkMap));
+    if (RT_FAILURE(rc))
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    BlkMap.u32Magic         = RT_LE2H_U32(BlkMap.u32Magic);
+    BlkMap.u32Version       = RT_LE2H_U32(BlkMap.u32Version);
+    BlkMap.cBlocks          = RT_LE2H_U64(BlkMap.cBlocks);
+    BlkMap.cBlocksFree      = RT_LE2H_U64(BlkMap.cBlocksFree);
+    BlkMap.cBlocksAllocMeta = RT_LE2H_U64(BlkMap.cBlocksAllocMeta);
+    BlkMap.cBlocksAllocData = RT_LE2H_U64(BlkMap.cBlocksAllocData);
+
+    if (   BlkMap.u32Magic != VCI_BLKMAP_MAGIC
+        || BlkMap.u32Version != VCI_BLKMAP_VERSION
+        || BlkMap.cBlocks != BlkMap.cBlocksFree + BlkMap.cBlocksAllocMeta + BlkMap.cBlocksAllocData
+        || vciBlkMapGetSize(BlkMap.cBlocks) != cBlkMap)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
+    uint8_t *pbBitmap = (uint8_t *)RTMemTmpAlloc(16 * _1K);
+    if (pBlkMap && pbBitmap)
     {
-        cBlkMap -= VCI_BYTE2BLOCK(sizeof(VciBlkMap));
+        uint64_t offBitmap = VCI_BLOCK2BYTE(offBlkMap) + sizeof(VciBlkMap);
+        uint64_t iBlock = 0;
 
-        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                   &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
-        if (RT_SUCCESS(rc))
+        pBlkMap->cBlocks          = BlkMap.cBlocks;
+        pBlkMap->cBlocksFree      = BlkMap.cBlocksFree;
+        pBlkMap->cBlocksAllocMeta = BlkMap.cBlocksAllocMeta;
+        pBlkMap->cBlocksAllocData = BlkMap.cBlocksAllocData;
+
+        /* Read the bitmap in chunks and construct the range list. */
+        while (   RT_SUCCESS(rc)
+               && iBlock < pBlkMap->cBlocks)
         {
-            offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
-
-            BlkMap.u32Magic         = RT_LE2H_U32(BlkMap.u32Magic);
-            BlkMap.u32Version       = RT_LE2H_U32(BlkMap.u32Version);
-            BlkMap.cBlocks          = RT_LE2H_U32(BlkMap.cBlocks);
-            BlkMap.cBlocksFree      = RT_LE2H_U32(BlkMap.cBlocksFree);
-            BlkMap.cBlocksAllocMeta = RT_LE2H_U32(BlkMap.cBlocksAllocMeta);
-            BlkMap.cBlocksAllocData = RT_LE2H_U32(BlkMap.cBlocksAllocData);
-
-            if (   BlkMap.u32Magic == VCI_BLKMAP_MAGIC
-                && BlkMap.u32Version == VCI_BLKMAP_VERSION
-                && BlkMap.cBlocks == BlkMap.cBlocksFree + BlkMap.cBlocksAllocMeta + BlkMap.cBlocksAllocData
-                && VCI_BYTE2BLOCK(BlkMap.cBlocks / 8) == cBlkMap)
+            uint32_t cBitsChunk = (uint32_t)RT_MIN(16 * _1K * 8, RT_ALIGN_64(pBlkMap->cBlocks - iBlock, VCI_BLOCK_SIZE * 8));
+            uint32_t cBitsValid = (uint32_t)RT_MIN(cBitsChunk, pBlkMap->cBlocks - iBlock);
+            uint32_t iBit = 0;
+
+            rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage, offBitmap,
+                                       pbBitmap, cBitsChunk / 8);
+            if (RT_FAILURE(rc))
+                break;
+
+            while (iBit < cBitsValid)
             {
-                PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
-                if (pBlkMap)
-                {
-                    pBlkMap->cBlocks          = BlkMap.cBlocks;
-                    pBlkMap->cBlocksFree      = BlkMap.cBlocksFree;
-                    pBlkMap->cBlocksAllocMeta = BlkMap.cBlocksAllocMeta;
-                    pBlkMap->cBlocksAllocData = BlkMap.cBlocksAllocData;
-
-                    /* Load the bitmap and construct the range list. */
-                    uint32_t cBlocksFree = 0;
-                    uint32_t cBlocksAllocated = 0;
-                    PVCIBLKRANGEDESC pRangeCur = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-
-                    if (pRangeCur)
-                    {
-                        uint8_t abBitmapBuffer[16 * _1K];
-                        uint32_t cBlocksRead = 0;
-                        uint64_t cBlocksLeft = VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8);
-
-                        cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                   offBlkMap, abBitmapBuffer,
-                                                   cBlocksRead);
-
-                        if (RT_SUCCESS(rc))
-                        {
-                            pRangeCur->fFree        = !(abBitmapBuffer[0] & 0x01);
-                            pRangeCur->offAddrStart = 0;
-                            pRangeCur->cBlocks      = 0;
-                            pRangeCur->pNext        = NULL;
-                            pRangeCur->pPrev        = NULL;
-                            pBlkMap->pRangesHead = pRangeCur;
-                            pBlkMap->pRangesTail = pRangeCur;
-                        }
-                        else
-                            RTMemFree(pRangeCur);
-
-                        while (   RT_SUCCESS(rc)
-                               && cBlocksLeft)
-                        {
-                            int iBit = 0;
-                            uint32_t cBits = VCI_BLOCK2BYTE(cBlocksRead) * 8;
-                            uint32_t iBitPrev = 0xffffffff;
-
-                            while (cBits)
-                            {
-                                if (pRangeCur->fFree)
-                                {
-                                    /* Check for the first set bit. */
-                                    iBit = ASMBitNextSet(abBitmapBuffer, cBits, iBitPrev);
-                                }
-                                else
-                                {
-                                    /* Check for the first free bit. */
-                                    iBit = ASMBitNextClear(abBitmapBuffer, cBits, iBitPrev);
-                                }
-
-                                if (iBit == -1)
-                                {
-                                    /* No change. */
-                                    pRangeCur->cBlocks += cBits;
-                                    cBits = 0;
-                                }
-                                else
-                                {
-                                    Assert((uint32_t)iBit < cBits);
-                                    pRangeCur->cBlocks += iBit;
-
-                                    /* Create a new range descriptor. */
-                                    PVCIBLKRANGEDESC pRangeNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-                                    if (!pRangeNew)
-                                    {
-                                        rc = VERR_NO_MEMORY;
-                                        break;
-                                    }
-
-                                    pRangeNew->fFree = !pRangeCur->fFree;
-                                    pRangeNew->offAddrStart = pRangeCur->offAddrStart + pRangeCur->cBlocks;
-                                    pRangeNew->cBlocks = 0;
-                                    pRangeNew->pPrev = pRangeCur;
-                                    pRangeCur->pNext = pRangeNew;
-                                    pBlkMap->pRangesTail = pRangeNew;
-                                    pRangeCur = pRangeNew;
-                                    cBits -= iBit;
-                                    iBitPrev = iBit;
-                                }
-                            }
-
-                            cBlocksLeft -= cBlocksRead;
-                            offBlkMap   += cBlocksRead;
-
-                            if (   RT_SUCCESS(rc)
-                                && cBlocksLeft)
-                            {
-                                /* Read next chunk. */
-                                cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                                rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                           offBlkMap, abBitmapBuffer, cBlocksRead);
-                            }
-                        }
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
-
-                    if (RT_SUCCESS(rc))
-                    {
-                        *ppBlkMap = pBlkMap;
-                        LogFlowFunc(("return success\n"));
-                        return VINF_SUCCESS;
-                    }
-                    else
-                        RTMemFree(pBlkMap);
-                }
-                else
-                    rc = VERR_NO_MEMORY;
+                bool fFree = !ASMBitTest(pbBitmap, iBit);
+                int32_t iBitNext =   fFree
+                                   ? ASMBitNextSet(pbBitmap, cBitsChunk, iBit)
+                                   : ASMBitNextClear(pbBitmap, cBitsChunk, iBit);
+                uint32_t iBitEnd = iBitNext == -1 ? cBitsValid : RT_MIN((uint32_t)iBitNext, cBitsValid);
+
+                rc = vciBlkMapAppendRange(pBlkMap, iBitEnd - iBit, fFree);
+                if (RT_FAILURE(rc))
+                    break;
+                iBit = iBitEnd;
             }
-            else
-                rc = VERR_VD_GEN_INVALID_HEADER;
+
+            iBlock    += cBitsValid;
+            offBitmap += cBitsChunk / 8;
         }
-        else
-            rc = VERR_VD_GEN_INVALID_HEADER;
+
+        if (RT_SUCCESS(rc))
+        {
+            RTMemTmpFree(pbBitmap);
+            *ppBlkMap = pBlkMap;
+            LogFlowFunc(("return success\n"));
+            return VINF_SUCCESS;
+        }
+
+        vciBlkMapDestroy(pBlkMap);
     }
     else
-        rc = VERR_VD_GEN_INVALID_HEADER;
+    {
+        if (pBlkMap)
+            RTMemFree(pBlkMap);
+        rc = VERR_NO_MEMORY;
+    }
+
+    if (pbBitmap)
+        RTMemTmpFree(pbBitmap);
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
     return rc;
@@ -706,71 +747,71 @@ static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlk
                  pBlkMap, pStorage, offBlkMap, cBlkMap));
 
     /* Make sure the number of blocks allocated for us match our expectations. */
-    if (VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8) + VCI_BYTE2BLOCK(sizeof(VciBlkMap)) == cBlkMap)
+    if (vciBlkMapGetSize(pBlkMap->cBlocks) != cBlkMap)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    /* Setup the header */
+    memset(&BlkMap, 0, sizeof(VciBlkMap));
+
+    BlkMap.u32Magic         = RT_H2LE_U32(VCI_BLKMAP_MAGIC);
+    BlkMap.u32Version       = RT_H2LE_U32(VCI_BLKMAP_VERSION);
+    BlkMap.cBlocks          = RT_H2LE_U64(pBlkMap->cBlocks);
+    BlkMap.cBlocksFree      = RT_H2LE_U64(pBlkMap->cBlocksFree);
+    BlkMap.cBlocksAllocMeta = RT_H2LE_U64(pBlkMap->cBlocksAllocMeta);
+    BlkMap.cBlocksAllocData = RT_H2LE_U64(pBlkMap->cBlocksAllocData);
+
+    rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage, VCI_BLOCK2BYTE(offBlkMap),
+                                &BlkMap, sizeof(VciBlkMap));
+    if (RT_SUCCESS(rc))
     {
-        /* Setup the header */
-        memset(&BlkMap, 0, sizeof(VciBlkMap));
-
-        BlkMap.u32Magic         = RT_H2LE_U32(VCI_BLKMAP_MAGIC);
-        BlkMap.u32Version       = RT_H2LE_U32(VCI_BLKMAP_VERSION);
-        BlkMap.cBlocks          = RT_H2LE_U32(pBlkMap->cBlocks);
-        BlkMap.cBlocksFree      = RT_H2LE_U32(pBlkMap->cBlocksFree);
-        BlkMap.cBlocksAllocMeta = RT_H2LE_U32(pBlkMap->cBlocksAllocMeta);
-        BlkMap.cBlocksAllocData = RT_H2LE_U32(pBlkMap->cBlocksAllocData);
-
-        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                    &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
-        if (RT_SUCCESS(rc))
-        {
-            uint8_t abBitmapBuffer[16*_1K];
-            unsigned iBit = 0;
-            PVCIBLKRANGEDESC pCur = pBlkMap->pRangesHead;
+        uint8_t *pbBitmap = (uint8_t *)RTMemTmpAllocZ(16 * _1K);
+        uint64_t offBitmap = VCI_BLOCK2BYTE(offBlkMap) + sizeof(VciBlkMap);
+        uint32_t iBit = 0;
+        PVCIBLKRANGEDESC pCur = pBlkMap->pRangesHead;
+
+        if (!pbBitmap)
+            return VERR_NO_MEMORY;
 
-            offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
+        /* Write the descriptor ranges. */
+        while (   pCur
+               && RT_SUCCESS(rc))
+        {
+            uint64_t cBlocks = pCur->cBlocks;
 
-            /* Write the descriptor ranges. */
-            while (pCur)
+            while (cBlocks)
             {
-                uint64_t cBlocks = pCur->cBlocks;
+                uint32_t cBlocksMax = (uint32_t)RT_MIN(cBlocks, 16 * _1K * 8 - iBit);
+
+                if (!pCur->fFree)
+                    ASMBitSetRange(pbBitmap, iBit, iBit + cBlocksMax);
 
-                while (cBlocks)
+                iBit    += cBlocksMax;
+                cBlocks -= cBlocksMax;
+
+                if (iBit == 16 * _1K * 8)
                 {
-                    uint64_t cBlocksMax = RT_MIN(cBlocks, sizeof(abBitmapBuffer) * 8 - iBit);
-
-                    if (pCur->fFree)
-                        ASMBitClearRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
-                    else
-                        ASMBitSetRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
-
-                    iBit    += cBlocksMax;
-                    cBlocks -= cBlocksMax;
-
-                    if (iBit == sizeof(abBitmapBuffer) * 8)
-                    {
-                        /* Buffer is full, write to file and reset. */
-                        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                                    offBlkMap, abBitmapBuffer,
-                                                    VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)));
-                        if (RT_FAILURE(rc))
-                            break;
-
-                        offBlkMap += VCI_BYTE2BLOCK(sizeof(abBitmapBuffer));
-                        iBit = 0;
-                    }
+                    /* Buffer is full, write to file and reset. */
+                    rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
+                                                offBitmap, pbBitmap, 16 * _1K);
+                    if (RT_FAILURE(rc))
+                        break;
+
+                    offBitmap += 16 * _1K;
+                    memset(pbBitmap, 0, 16 * _1K);
+                    iBit = 0;
                 }
-
-                pCur = pCur->pNext;
             }
 
-            Assert(iBit % 8 == 0);
-
-            if (RT_SUCCESS(rc) && iBit)
-                rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                            offBlkMap, abBitmapBuffer, VCI_BYTE2BLOCK(iBit / 8));
+            pCur = pCur->pNext;
         }
+
+        if (RT_SUCCESS(rc) && iBit)
+            rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
+                                        offBitmap, pbBitmap,
+                                        RT_ALIGN_32((iBit + 7) / 8, VCI_BLOCK_SIZE));
+
+        RTMemTmpFree(pbBitmap);
     }
-    else
-        rc = VERR_INTERNAL_ERROR; /* @todo Better error code. */
 
     LogFlowFunc(("returns rc=%Rrc\n", rc));
     return rc;
@@ -788,7 +829,7 @@ static PVCIBLKRANGEDESC vciBlkMapFindByBlock(PVCIBLKMAP pBlkMap, uint64_t offBlo
     PVCIBLKRANGEDESC pBlk = pBlkMap->pRangesHead;
 
     while (   pBlk
-           && pBlk->offAddrStart < offBlockAddr)
+           && pBlk->offAddrStart + pBlk->cBlocks <= offBlockAddr)
         pBlk = pBlk->pNext;
 
     return pBlk;
@@ -854,10 +895,10 @@ static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint32_t cBlocks, uint32_t fFla
                 pFree->pNext = pBestFit->pNext;
                 pBestFit->pNext = pFree;
                 pFree->pPrev    = pBestFit;
-                if (!pFree->pNext)
+                if (pFree->pNext)
+                    pFree->pNext->pPrev = pFree;
+                else
                     pBlkMap->pRangesTail = pFree;
-
-                *poffBlockAddr = pBestFit->offAddrStart;
             }
             else
             {
@@ -865,6 +906,9 @@ static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint32_t cBlocks, uint32_t fFla
                 pBestFit->fFree = true;
             }
         }
+
+        if (RT_SUCCESS(rc))
+            *poffBlockAddr = pBestFit->offAddrStart;
     }
     else
         rc = VERR_VCI_NO_BLOCKS_FREE;
@@ -872,38 +916,62 @@ static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint32_t cBlocks, uint32_t fFla
     if (RT_SUCCESS(rc))
     {
         if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-            pBlkMap->cBlocksAllocMeta += cBlocks;
-        else
             pBlkMap->cBlocksAllocData += cBlocks;
+        else
+            pBlkMap->cBlocksAllocMeta += cBlocks;
 
         pBlkMap->cBlocksFree -= cBlocks;
     }
 
-    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
+    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, RT_SUCCESS(rc) ? *poffBlockAddr : 0));
     return rc;
 }
 
 /**
- * Try to extend the space of an already allocated block.
+ * Merges the given free range with free neighbours.
  *
- * @returns VBox status code.
- * @param   pBlkMap          The block bitmap to allocate the blocks from.
- * @param   cBlocksNew       How many blocks the extended block should have.
- * @param   offBlockAddrOld  The start address of the block to reallocate.
- * @param   poffBlockAddr    Where to store the start address of the allocated region.
+ * @returns nothing.
+ * @param   pBlkMap          The block bitmap.
+ * @param   pBlk             The free range.
  */
-static int vciBlkMapRealloc(PVCIBLKMAP pBlkMap, uint32_t cBlocksNew, uint64_t offBlockAddrOld,
-                            uint64_t *poffBlockAddr)
+static void vciBlkMapMergeFree(PVCIBLKMAP pBlkMap, PVCIBLKRANGEDESC pBlk)
 {
-    int rc = VINF_SUCCESS;
+    Assert(pBlk->fFree);
 
-    LogFlowFunc(("pBlkMap=%#p cBlocksNew=%u offBlockAddrOld=%llu poffBlockAddr=%#p\n",
-                 pBlkMap, cBlocksNew, offBlockAddrOld, poffBlockAddr));
+    /* Check if it is possible to merge free blocks. */
+    if (   pBlk->pPrev
+        && pBlk->pPrev->fFree)
+    {
+        PVCIBLKRANGEDESC pBlkPrev = pBlk->pPrev;
 
-    AssertMsgFailed(("Implement\n"));
+        Assert(pBlkPrev->offAddrStart + pBlkPrev->cBlocks == pBlk->offAddrStart);
+        pBlkPrev->cBlocks += pBlk->cBlocks;
+        pBlkPrev->pNext = pBlk->pNext;
+        if (pBlk->pNext)
+            pBlk->pNext->pPrev = pBlkPrev;
+        else
+            pBlkMap->pRangesTail = pBlkPrev;
 
-    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
-    return rc;
+        RTMemFree(pBlk);
+        pBlk = pBlkPrev;
+    }
+
+    /* Now the one to the right. */
+    if (   pBlk->pNext
+        && pBlk->pNext->fFree)
+    {
+        PVCIBLKRANGEDESC pBlkNext = pBlk->pNext;
+
+        Assert(pBlk->offAddrStart + pBlk->cBlocks == pBlkNext->offAddrStart);
+        pBlk->cBlocks += pBlkNext->cBlocks;
+        pBlk->pNext = pBlkNext->pNext;
+        if (pBlkNext->pNext)
+            pBlkNext->pNext->pPrev = pBlk;
+        else
+            pBlkMap->pRangesTail = pBlk;
+
+        RTMemFree(pBlkNext);
+    }
 }
 
 /**
@@ -915,288 +983,500 @@ static int vciBlkMapRealloc(PVCIBLKMAP pBlkMap, uint32_t cBlocksNew, uint64_t of
  * @param   cBlocks          How many blocks to free.
  * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
  */
-static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint32_t cBlocks,
+static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint64_t cBlocks,
                           uint32_t fFlags)
 {
     PVCIBLKRANGEDESC pBlk;
 
-    LogFlowFunc(("pBlkMap=%#p offBlockAddr=%llu cBlocks=%u\n",
+    LogFlowFunc(("pBlkMap=%#p offBlockAddr=%llu cBlocks=%llu\n",
                  pBlkMap, offBlockAddr, cBlocks));
 
+    if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
+        pBlkMap->cBlocksAllocData -= cBlocks;
+    else
+        pBlkMap->cBlocksAllocMeta -= cBlocks;
+
+    pBlkMap->cBlocksFree += cBlocks;
+
     while (cBlocks)
     {
         pBlk = vciBlkMapFindByBlock(pBlkMap, offBlockAddr);
-        AssertPtr(pBlk);
+        AssertPtrBreak(pBlk);
+        Assert(!pBlk->fFree);
 
-        /* Easy case, the whole block is freed. */
-        if (   pBlk->offAddrStart == offBlockAddr
-            && pBlk->cBlocks <= cBlocks)
+        /* Split off the part in front of the freed range. */
+        if (pBlk->offAddrStart < offBlockAddr)
         {
-            pBlk->fFree = true;
-            cBlocks      -= pBlk->cBlocks;
-            offBlockAddr += pBlk->cBlocks;
+            PVCIBLKRANGEDESC pBlkNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+            AssertPtrBreak(pBlkNew); /* Leaks the blocks until the cache is reset. */
+
+            pBlkNew->fFree        = false;
+            pBlkNew->offAddrStart = offBlockAddr;
+            pBlkNew->cBlocks      = pBlk->offAddrStart + pBlk->cBlocks - offBlockAddr;
+            pBlk->cBlocks        -= pBlkNew->cBlocks;
+
+            pBlkNew->pPrev = pBlk;
+            pBlkNew->pNext = pBlk->pNext;
+            if (pBlk->pNext)
+                pBlk->pNext->pPrev = pBlkNew;
+            else
+                pBlkMap->pRangesTail = pBlkNew;
+            pBlk->pNext = pBlkNew;
+            pBlk = pBlkNew;
+        }
 
-            /* Check if it is possible to merge free blocks. */
-            if (   pBlk->pPrev
-                && pBlk->pPrev->fFree)
-            {
-                PVCIBLKRANGEDESC pBlkPrev = pBlk->pPrev;
+        /* Split off the part after the freed range. */
+        if (pBlk->cBlocks > cBlocks)
+        {
+            PVCIBLKRANGEDESC pBlkNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+            AssertPtrBreak(pBlkNew);
+
+            pBlkNew->fFree        = false;
+            pBlkNew->offAddrStart = offBlockAddr + cBlocks;
+            pBlkNew->cBlocks      = pBlk->cBlocks - cBlocks;
+            pBlk->cBlocks         = cBlocks;
+
+            pBlkNew->pPrev = pBlk;
+            pBlkNew->pNext = pBlk->pNext;
+            if (pBlk->pNext)
+                pBlk->pNext->pPrev = pBlkNew;
+            else
+                pBlkMap->pRangesTail = pBlkNew;
+            pBlk->pNext = pBlkNew;
+        }
 
-                Assert(pBlkPrev->offAddrStart + pBlkPrev->cBlocks == pBlk->offAddrStart);
-                pBlkPrev->cBlocks += pBlk->cBlocks;
-                pBlkPrev->pNext = pBlk->pNext;
-                if (pBlk->pNext)
-                    pBlk->pNext->pPrev = pBlkPrev;
-                else
-                    pBlkMap->pRangesTail = pBlkPrev;
+        pBlk->fFree   = true;
+        cBlocks      -= pBlk->cBlocks;
+        offBlockAddr += pBlk->cBlocks;
 
-                RTMemFree(pBlk);
-                pBlk = pBlkPrev;
-            }
+        vciBlkMapMergeFree(pBlkMap, pBlk);
+    }
 
-            /* Now the one to the right. */
-            if (   pBlk->pNext
-                && pBlk->pNext->fFree)
-            {
-                PVCIBLKRANGEDESC pBlkNext = pBlk->pNext;
+    LogFlowFunc(("returns\n"));
+}
 
-                Assert(pBlk->offAddrStart + pBlk->cBlocks == pBlkNext->offAddrStart);
-                pBlk->cBlocks += pBlkNext->cBlocks;
-                pBlk->pNext = pBlkNext->pNext;
-                if (pBlkNext->pNext)
-                    pBlkNext->pNext->pPrev = pBlk;
-                else
-                    pBlkMap->pRangesTail = pBlk;
+/**
+ * Records the block address of a tree node stored in the image.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   offBlockAddr    Block address of the node.
+ */
+static int vciTreeNodeRecord(PVCICACHE pCache, uint64_t offBlockAddr)
+{
+    if (pCache->cTreeNodes == pCache->cTreeNodesMax)
+    {
+        uint32_t cTreeNodesMaxNew = pCache->cTreeNodesMax ? pCache->cTreeNodesMax * 2 : 16;
+        uint64_t *paTreeNodesNew = (uint64_t *)RTMemRealloc(pCache->paTreeNodes,
+                                                            cTreeNodesMaxNew * sizeof(uint64_t));
+        if (!paTreeNodesNew)
+            return VERR_NO_MEMORY;
+
+        pCache->paTreeNodes   = paTreeNodesNew;
+        pCache->cTreeNodesMax = cTreeNodesMaxNew;
+    }
 
-                RTMemFree(pBlkNext);
-            }
-        }
-        else
-        {
-            /* The block is intersecting. */
-            AssertMsgFailed(("TODO\n"));
-        }
+    pCache->paTreeNodes[pCache->cTreeNodes++] = offBlockAddr;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Inserts a new extent into the index of cached data.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   offBlockOffset  First virtual block the extent covers.
+ * @param   cBlocks         Number of blocks the extent covers.
+ * @param   offBlockAddr    Block address in the image where the data is stored.
+ * @param   fAppendLru      Flag whether to add the extent as the least recently used one.
+ */
+static int vciCacheExtentInsert(PVCICACHE pCache, uint64_t offBlockOffset, uint64_t cBlocks,
+                                uint64_t offBlockAddr, bool fAppendLru)
+{
+    PVCICACHEEXTENT pExtent = (PVCICACHEEXTENT)RTMemAllocZ(sizeof(VCICACHEEXTENT));
+    if (!pExtent)
+        return VERR_NO_MEMORY;
+
+    pExtent->Core.Key     = offBlockOffset;
+    pExtent->Core.KeyLast = offBlockOffset + cBlocks - 1;
+    pExtent->u64BlockAddr = offBlockAddr;
+
+    if (!RTAvlrU64Insert(&pCache->TreeExtents, &pExtent->Core))
+    {
+        RTMemFree(pExtent);
+        return VERR_VD_GEN_INVALID_HEADER;
     }
 
-    if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-        pBlkMap->cBlocksAllocMeta -= cBlocks;
+    if (fAppendLru)
+        RTListAppend(&pCache->ListLru, &pExtent->NodeLru);
     else
-        pBlkMap->cBlocksAllocData -= cBlocks;
+        RTListPrepend(&pCache->ListLru, &pExtent->NodeLru);
 
-    pBlkMap->cBlocksFree += cBlocks;
-
-    LogFlowFunc(("returns\n"));
+    return VINF_SUCCESS;
 }
 
 /**
- * Converts a tree node from the image to the in memory structure.
+ * Removes all cached data in the given range of virtual blocks, splitting
+ * extents which are only partially covered.
  *
- * @returns Pointer to the in memory tree node.
- * @param   offBlockAddrNode    Block address of the node.
- * @param   pNodeImage          Pointer to the image representation of the node.
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   offBlockOffset  First virtual block to invalidate.
+ * @param   cBlocks         Number of blocks to invalidate.
  */
-static PVCITREENODE vciTreeNodeImage2Host(uint64_t offBlockAddrNode, PVciTreeNode pNodeImage)
+static int vciCacheInvalidate(PVCICACHE pCache, uint64_t offBlockOffset, uint64_t cBlocks)
 {
-    PVCITREENODE pNode = NULL;
+    uint64_t offBlockLast = offBlockOffset + cBlocks - 1;
+    int rc = VINF_SUCCESS;
 
-    if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_LEAF)
+    for (;;)
     {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)RTMemAllocZ(sizeof(VCITREENODELEAF));
+        PVCICACHEEXTENT pExtent = (PVCICACHEEXTENT)RTAvlrU64RangeGet(&pCache->TreeExtents, offBlockOffset);
+        if (!pExtent)
+            pExtent = (PVCICACHEEXTENT)RTAvlrU64GetBestFit(&pCache->TreeExtents, offBlockOffset, true /* fAbove */);
+        if (   !pExtent
+            || pExtent->Core.Key > offBlockLast)
+            break;
 
-        if (pLeaf)
-        {
-            PVciCacheExtent pExtent = (PVciCacheExtent)&pNodeImage->au8Data[0];
+        RTAvlrU64Remove(&pCache->TreeExtents, pExtent->Core.Key);
 
-            pLeaf->Core.u8Type = VCI_TREE_NODE_TYPE_LEAF;
+        uint64_t offFirst = RT_MAX(pExtent->Core.Key, offBlockOffset);
+        uint64_t offLast  = RT_MIN(pExtent->Core.KeyLast, offBlockLast);
 
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pLeaf->aExtents); idx++)
+        /* Keep the part after the invalidated range. */
+        if (pExtent->Core.KeyLast > offBlockLast)
+        {
+            rc = vciCacheExtentInsert(pCache, offBlockLast + 1, pExtent->Core.KeyLast - offBlockLast,
+                                      pExtent->u64BlockAddr + (offBlockLast + 1 - pExtent->Core.Key),
+                                      false /* fAppendLru */);
+            if (RT_FAILURE(rc))
             {
-                pLeaf->aExtents[idx].u64BlockOffset = RT_LE2H_U64(pExtent->u64BlockOffset);
-                pLeaf->aExtents[idx].u32Blocks      = RT_LE2H_U32(pExtent->u32Blocks);
-                pLeaf->aExtents[idx].u64BlockAddr   = RT_LE2H_U64(pExtent->u64BlockAddr);
-                pExtent++;
-
-                if (   pLeaf->aExtents[idx].u32Blocks
-                    && pLeaf->aExtents[idx].u64BlockAddr)
-                    pLeaf->cUsedNodes++;
+                /* Drop the whole tail instead. */
+                offLast = pExtent->Core.KeyLast;
+                rc = VINF_SUCCESS;
             }
+        }
 
-            pNode = &pLeaf->Core;
+        vciBlkMapFree(pCache->pBlkMap, pExtent->u64BlockAddr + (offFirst - pExtent->Core.Key),
+                      offLast - offFirst + 1, VCIBLKMAP_ALLOC_DATA);
+
+        /* Keep the part in front of the invalidated range. */
+        if (pExtent->Core.Key < offBlockOffset)
+        {
+            pExtent->Core.KeyLast = offBlockOffset - 1;
+            bool fInserted = RTAvlrU64Insert(&pCache->TreeExtents, &pExtent->Core);
+            Assert(fInserted); NOREF(fInserted);
+        }
+        else
+        {
+            RTListNodeRemove(&pExtent->NodeLru);
+            RTMemFree(pExtent);
         }
     }
-    else if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_INTERNAL)
-    {
-        PVCITREENODEINT pInt = (PVCITREENODEINT)RTMemAllocZ(sizeof(VCITREENODEINT));
 
-        if (pInt)
-        {
-            PVciTreeNodeInternal pIntImage = (PVciTreeNodeInternal)&pNodeImage->au8Data[0];
+    return rc;
+}
+
+/**
+ * Evicts the least recently used extent from the cache.
+ *
+ * @returns true if an extent was evicted, false if the cache is empty.
+ * @param   pCache          The cache image instance.
+ */
+static bool vciCacheEvictLru(PVCICACHE pCache)
+{
+    PVCICACHEEXTENT pExtent = RTListGetLast(&pCache->ListLru, VCICACHEEXTENT, NodeLru);
+    if (!pExtent)
+        return false;
+
+    RTAvlrU64Remove(&pCache->TreeExtents, pExtent->Core.Key);
+    RTListNodeRemove(&pExtent->NodeLru);
+    vciBlkMapFree(pCache->pBlkMap, pExtent->u64BlockAddr,
+                  pExtent->Core.KeyLast - pExtent->Core.Key + 1, VCIBLKMAP_ALLOC_DATA);
+    RTMemFree(pExtent);
+    return true;
+}
+
+/**
+ * Loads the given tree node and all its children, adding all extents to the index.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   offBlockAddr    Block address of the node.
+ * @param   uDepth          Depth of the node in the tree.
+ */
+static int vciTreeLoadNode(PVCICACHE pCache, uint64_t offBlockAddr, unsigned uDepth)
+{
+    if (uDepth > VCI_TREE_DEPTH_MAX)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    PVciTreeNode pNode = (PVciTreeNode)RTMemTmpAlloc(sizeof(VciTreeNode));
+    if (!pNode)
+        return VERR_NO_MEMORY;
 
-            pInt->Core.u8Type = VCI_TREE_NODE_TYPE_INTERNAL;
+    int rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddr),
+                                   pNode, sizeof(VciTreeNode));
+    if (RT_SUCCESS(rc))
+        rc = vciTreeNodeRecord(pCache, offBlockAddr);
+    if (RT_SUCCESS(rc))
+    {
+        if (pNode->u8Type == VCI_TREE_NODE_TYPE_LEAF)
+        {
+            PVciCacheExtent pExtent = (PVciCacheExtent)&pNode->au8Data[0];
 
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pInt->aIntNodes); idx++)
+            for (unsigned idx = 0; idx < VCI_TREE_EXTENTS_PER_NODE && RT_SUCCESS(rc); idx++, pExtent++)
             {
-                pInt->aIntNodes[idx].u64BlockOffset              = RT_LE2H_U64(pIntImage->u64BlockOffset);
-                pInt->aIntNodes[idx].u32Blocks                   = RT_LE2H_U32(pIntImage->u32Blocks);
-                pInt->aIntNodes[idx].PtrChild.fInMemory          = false;
-                pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode = RT_LE2H_U64(pIntImage->u64ChildAddr);
-                pIntImage++;
-
-                if (   pInt->aIntNodes[idx].u32Blocks
-                    && pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode)
-                    pInt->cUsedNodes++;
+                uint32_t cBlocks = RT_LE2H_U32(pExtent->u32Blocks);
+                uint64_t u64BlockAddr = RT_LE2H_U64(pExtent->u64BlockAddr);
+
+                if (cBlocks && u64BlockAddr)
+                    rc = vciCacheExtentInsert(pCache, RT_LE2H_U64(pExtent->u64BlockOffset), cBlocks,
+                                              u64BlockAddr, true /* fAppendLru */);
             }
+        }
+        else if (pNode->u8Type == VCI_TREE_NODE_TYPE_INTERNAL)
+        {
+            PVciTreeNodeInternal pInt = (PVciTreeNodeInternal)&pNode->au8Data[0];
 
-            pNode = &pInt->Core;
+            for (unsigned idx = 0; idx < VCI_TREE_INTERNAL_NODES_PER_NODE && RT_SUCCESS(rc); idx++, pInt++)
+            {
+                uint64_t u64ChildAddr = RT_LE2H_U64(pInt->u64ChildAddr);
+
+                if (u64ChildAddr)
+                    rc = vciTreeLoadNode(pCache, u64ChildAddr, uDepth + 1);
+            }
         }
+        else
+            rc = VERR_VD_GEN_INVALID_HEADER;
     }
-    else
-        AssertMsgFailed(("Invalid node type %d\n", pNodeImage->u8Type));
-
-    if (pNode)
-        pNode->u64BlockAddr = offBlockAddrNode;
 
-    return pNode;
+    RTMemTmpFree(pNode);
+    return rc;
 }
 
 /**
- * Looks up the cache extent for the given virtual block address.
+ * State for building the B+-Tree from the extent index.
+ */
+typedef struct VCITREEBUILD
+{
+    /** The cache image instance. */
+    PVCICACHE            pCache;
+    /** The node currently being filled. */
+    PVciTreeNode         pNode;
+    /** Number of entries in the current node. */
+    unsigned             cEntries;
+    /** First virtual block covered by the current node. */
+    uint64_t             offBlockFirst;
+    /** Last virtual block covered by the current node. */
+    uint64_t             offBlockLast;
+    /** Array of entries for the next level. */
+    VciTreeNodeInternal *paParents;
+    /** Number of entries in the array for the next level. */
+    uint32_t             cParents;
+    /** Maximum number of entries in the array for the next level. */
+    uint32_t             cParentsMax;
+} VCITREEBUILD, *PVCITREEBUILD;
+
+/**
+ * Writes the current node of the tree being built and records it for the next level.
  *
- * @returns Pointer to the cache extent or NULL if none could be found.
- * @param   pCache         The cache image instance.
- * @param   offBlockOffset The block offset to search for.
- * @param   ppNextBestFit  Where to store the pointer to the next best fit
- *                         cache extent above offBlockOffset if existing. - Optional
- *                         This is always filled if possible even if the function returns NULL.
+ * @returns VBox status code.
+ * @param   pBuild          The build state.
  */
-static PVCICACHEEXTENT vciCacheExtentLookup(PVCICACHE pCache, uint64_t offBlockOffset,
-                                            PVCICACHEEXTENT *ppNextBestFit)
+static int vciTreeBuildFlushNode(PVCITREEBUILD pBuild)
 {
-    int rc = VINF_SUCCESS;
-    PVCICACHEEXTENT pExtent = NULL;
-    PVCITREENODE pNodeCur = pCache->pRoot;
+    PVCICACHE pCache = pBuild->pCache;
+    uint64_t offBlockAddr = 0;
 
-    while (   RT_SUCCESS(rc)
-           && pNodeCur
-           && pNodeCur->u8Type != VCI_TREE_NODE_TYPE_LEAF)
+    int rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciTreeNode)),
+                               VCIBLKMAP_ALLOC_META, &offBlockAddr);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddr),
+                                    pBuild->pNode, sizeof(VciTreeNode));
+    if (RT_SUCCESS(rc))
+        rc = vciTreeNodeRecord(pCache, offBlockAddr);
+    if (RT_SUCCESS(rc))
     {
-        PVCITREENODEINT pNodeInt = (PVCITREENODEINT)pNodeCur;
+        if (pBuild->cParents == pBuild->cParentsMax)
+        {
+            uint32_t cParentsMaxNew = pBuild->cParentsMax ? pBuild->cParentsMax * 2 : 16;
+            VciTreeNodeInternal *paParentsNew = (VciTreeNodeInternal *)RTMemRealloc(pBuild->paParents,
+                                                                                    cParentsMaxNew * sizeof(VciTreeNodeInternal));
+            if (!paParentsNew)
+                return VERR_NO_MEMORY;
+            pBuild->paParents   = paParentsNew;
+            pBuild->cParentsMax = cParentsMaxNew;
+        }
 
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_INTERNAL);
+        /* The range is informational only, lookups are done in memory. */
+        VciTreeNodeInternal *pParent = &pBuild->paParents[pBuild->cParents++];
+        pParent->u64BlockOffset = RT_H2LE_U64(pBuild->offBlockFirst);
+        pParent->u32Blocks      = RT_H2LE_U32((uint32_t)RT_MIN(pBuild->offBlockLast - pBuild->offBlockFirst + 1, UINT32_MAX));
+        pParent->u64ChildAddr   = RT_H2LE_U64(offBlockAddr);
 
-        /* Search for the correct internal node. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pNodeInt->cUsedNodes;
-        unsigned idxCur = pNodeInt->cUsedNodes / 2;
+        memset(pBuild->pNode, 0, sizeof(VciTreeNode));
+        pBuild->cEntries = 0;
+    }
 
-        while (idxMin < idxMax)
-        {
-            PVCINODEINTERNAL pInt = &pNodeInt->aIntNodes[idxCur];
+    return rc;
+}
 
-            /* Determine the search direction. */
-            if (offBlockOffset < pInt->u64BlockOffset)
-            {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pInt->u64BlockOffset + pInt->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
-            {
-                /* The block lies in the node, stop searching. */
-                if (pInt->PtrChild.fInMemory)
-                    pNodeCur = pInt->PtrChild.u.pNode;
-                else
-                {
-                    PVCITREENODE pNodeNew;
-                    VciTreeNode NodeTree;
-
-                    /* Read from disk and add to the tree. */
-                    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                               VCI_BLOCK2BYTE(pInt->PtrChild.u.offAddrBlockNode),
-                                               &NodeTree, sizeof(NodeTree));
-                    AssertRC(rc);
-
-                    pNodeNew = vciTreeNodeImage2Host(pInt->PtrChild.u.offAddrBlockNode, &NodeTree);
-                    if (pNodeNew)
-                    {
-                        /* Link to the parent. */
-                        pInt->PtrChild.fInMemory = true;
-                        pInt->PtrChild.u.pNode = pNodeNew;
-                        pNodeNew->pParent = pNodeCur;
-                        pNodeCur = pNodeNew;
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
-                }
-                break;
-            }
+/**
+ * Adds an extent to the leaf level of the tree being built, callback for RTAvlrU64DoWithAll().
+ */
+static DECLCALLBACK(int) vciTreeBuildAddExtent(PAVLRU64NODECORE pNode, void *pvUser)
+{
+    PVCITREEBUILD pBuild = (PVCITREEBUILD)pvUser;
+    PVCICACHEEXTENT pExtent = (PVCICACHEEXTENT)pNode;
+    PVciCacheExtent pExtentImg = (PVciCacheExtent)&pBuild->pNode->au8Data[0] + pBuild->cEntries;
+
+    pExtentImg->u64BlockOffset = RT_H2LE_U64(pExtent->Core.Key);
+    pExtentImg->u32Blocks      = RT_H2LE_U32((uint32_t)(pExtent->Core.KeyLast - pExtent->Core.Key + 1));
+    pExtentImg->u64BlockAddr   = RT_H2LE_U64(pExtent->u64BlockAddr);
+
+    if (!pBuild->cEntries)
+        pBuild->offBlockFirst = pExtent->Core.Key;
+    pBuild->offBlockLast = pExtent->Core.KeyLast;
+
+    if (++pBuild->cEntries == VCI_TREE_EXTENTS_PER_NODE)
+        return vciTreeBuildFlushNode(pBuild);
+
+    return VINF_SUCCESS;
+}
 
-            idxCur = idxMin + (idxMax - idxMin) / 2;
+/**
+ * Writes the index of cached data to the image as a packed B+-Tree, replacing
+ * the tree stored previously.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ */
+static int vciTreeSave(PVCICACHE pCache)
+{
+    VCITREEBUILD Build;
+    int rc = VINF_SUCCESS;
+
+    /* Free the old tree first, it is rebuilt from scratch. */
+    for (uint32_t i = 0; i < pCache->cTreeNodes; i++)
+        vciBlkMapFree(pCache->pBlkMap, pCache->paTreeNodes[i], VCI_BYTE2BLOCK(sizeof(VciTreeNode)),
+                      VCIBLKMAP_ALLOC_META);
+    pCache->cTreeNodes = 0;
+
+    /*
+     * Make sure there is enough room for the new tree by evicting the least recently
+     * used data. If allocating a node fails nevertheless because of fragmentation
+     * the header stays marked as unclean and the cache gets reset on the next open.
+     */
+    uint64_t cExtents = 0;
+    PVCICACHEEXTENT pIt;
+    RTListForEach(&pCache->ListLru, pIt, VCICACHEEXTENT, NodeLru)
+        cExtents++;
+
+    for (;;)
+    {
+        uint64_t cNodes = RT_MAX(1, (cExtents + VCI_TREE_EXTENTS_PER_NODE - 1) / VCI_TREE_EXTENTS_PER_NODE);
+        uint64_t cNodesTotal = cNodes;
+        while (cNodes > 1)
+        {
+            cNodes = (cNodes + VCI_TREE_INTERNAL_NODES_PER_NODE - 1) / VCI_TREE_INTERNAL_NODES_PER_NODE;
+            cNodesTotal += cNodes;
         }
+
+        if (   pCache->pBlkMap->cBlocksFree >= cNodesTotal * VCI_BYTE2BLOCK(sizeof(VciTreeNode))
+            || !vciCacheEvictLru(pCache))
+            break;
+        cExtents--;
     }
 
+    memset(&Build, 0, sizeof(Build));
+    Build.pCache = pCache;
+    Build.pNode  = (PVciTreeNode)RTMemTmpAllocZ(sizeof(VciTreeNode));
+    if (!Build.pNode)
+        return VERR_NO_MEMORY;
+
+    /* Leaf level. */
+    Build.pNode->u8Type = VCI_TREE_NODE_TYPE_LEAF;
+    rc = RTAvlrU64DoWithAll(&pCache->TreeExtents, true /* fFromLeft */, vciTreeBuildAddExtent, &Build);
     if (   RT_SUCCESS(rc)
-        && pNodeCur)
+        && (Build.cEntries || !Build.cParents))
+    {
+        Build.pNode->u8Type = VCI_TREE_NODE_TYPE_LEAF;
+        rc = vciTreeBuildFlushNode(&Build);
+    }
+
+    /* Internal levels until only the root is left. */
+    while (   RT_SUCCESS(rc)
+           && Build.cParents > 1)
     {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)pNodeCur;
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_LEAF);
+        VciTreeNodeInternal *paChilds = Build.paParents;
+        uint32_t cChilds = Build.cParents;
 
-        /* Search the range. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pLeaf->cUsedNodes;
-        unsigned idxCur = pLeaf->cUsedNodes / 2;
+        Build.paParents   = NULL;
+        Build.cParents    = 0;
+        Build.cParentsMax = 0;
 
-        while (idxMin < idxMax)
+        for (uint32_t i = 0; i < cChilds && RT_SUCCESS(rc); i++)
         {
-            PVCICACHEEXTENT pExtentCur = &pLeaf->aExtents[idxCur];
+            PVciTreeNodeInternal pInt = (PVciTreeNodeInternal)&Build.pNode->au8Data[0] + Build.cEntries;
 
-            /* Determine the search direction. */
-            if (offBlockOffset < pExtentCur->u64BlockOffset)
-            {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pExtentCur->u64BlockOffset + pExtentCur->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
-            {
-                /* We found the extent, stop searching. */
-                pExtent = pExtentCur;
-                break;
-            }
+            *pInt = paChilds[i];
+            if (!Build.cEntries)
+                Build.offBlockFirst = RT_LE2H_U64(pInt->u64BlockOffset);
+            Build.offBlockLast = RT_LE2H_U64(pInt->u64BlockOffset) + RT_LE2H_U32(pInt->u32Blocks) - 1;
+            Build.pNode->u8Type = VCI_TREE_NODE_TYPE_INTERNAL;
 
-            idxCur = idxMin + (idxMax - idxMin) / 2;
+            if (   ++Build.cEntries == VCI_TREE_INTERNAL_NODES_PER_NODE
+                || i == cChilds - 1)
+                rc = vciTreeBuildFlushNode(&Build);
         }
 
-        /* Get the next best fit extent if it exists. */
-        if (ppNextBestFit)
-        {
-            if (idxCur < pLeaf->cUsedNodes - 1)
-                *ppNextBestFit = &pLeaf->aExtents[idxCur + 1];
-            else
-            {
-                /*
-                 * Go up the tree and find the best extent
-                 * in the leftmost tree of the child subtree to the right.
-                 */
-                PVCITREENODEINT pInt = (PVCITREENODEINT)pLeaf->Core.pParent;
+        RTMemFree(paChilds);
+    }
 
-                while (pInt)
-                {
+    if (RT_SUCCESS(rc))
+    {
+        Assert(Build.cParents == 1);
+        pCache->offTreeRoot = RT_LE2H_U64(Build.paParents[0].u64ChildAddr);
+    }
 
-                }
-            }
-        }
+    if (Build.paParents)
+        RTMemFree(Build.paParents);
+    RTMemTmpFree(Build.pNode);
+    return rc;
+}
+
+/**
+ * Internal: Resets the cache to an empty state, used when the cache was not
+ * closed cleanly and the index can't be trusted.
+ */
+static int vciCacheReset(PVCICACHE pCache, uint64_t cBlocks)
+{
+    uint32_t cBlkMap = 0;
+    uint64_t offHdr = 0;
+    uint64_t offBlkMap = 0;
+
+    if (pCache->pBlkMap)
+    {
+        vciBlkMapDestroy(pCache->pBlkMap);
+        pCache->pBlkMap = NULL;
     }
+    RTAvlrU64Destroy(&pCache->TreeExtents, vciCacheExtentDestroy, NULL);
+    RTListInit(&pCache->ListLru);
+    pCache->cTreeNodes = 0;
 
-    return pExtent;
+    /* Recreate the block map with the same layout as during creation. */
+    int rc = vciBlkMapCreate(cBlocks, &pCache->pBlkMap, &cBlkMap);
+    if (RT_SUCCESS(rc))
+        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciHdr)), VCIBLKMAP_ALLOC_META, &offHdr);
+    if (RT_SUCCESS(rc))
+        rc = vciBlkMapAllocate(pCache->pBlkMap, cBlkMap, VCIBLKMAP_ALLOC_META, &offBlkMap);
+    if (   RT_SUCCESS(rc)
+        && (   offHdr != 0
+            || offBlkMap != pCache->offBlksBitmap
+            || cBlkMap != pCache->cBlkMap))
+        rc = VERR_VD_GEN_INVALID_HEADER;
+
+    return rc;
 }
 
 /**
@@ -1214,6 +1494,9 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
     pCache->pIfIo = VDIfIoIntGet(pCache->pVDIfsImage);
     AssertPtrReturn(pCache->pIfIo, VERR_INVALID_PARAMETER);
 
+    pCache->TreeExtents = NULL;
+    RTListInit(&pCache->ListLru);
+
     /*
      * Open the image.
      */
@@ -1236,7 +1519,7 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
     }
 
     rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr,
-                               VCI_BYTE2BLOCK(sizeof(Hdr)));
+                               sizeof(Hdr));
     if (RT_FAILURE(rc))
     {
         rc = VERR_VD_GEN_INVALID_HEADER;
@@ -1254,25 +1537,37 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
     if (   Hdr.u32Signature == VCI_HDR_SIGNATURE
         && Hdr.u32Version == VCI_HDR_VERSION)
     {
-        pCache->offTreeRoot   = Hdr.offTreeRoot;
-        pCache->offBlksBitmap = Hdr.offBlkMap;
-
-        /* Load the block map. */
-        rc = vciBlkMapLoad(pCache, pCache->offBlksBitmap, Hdr.cBlkMap, &pCache->pBlkMap);
-        if (RT_SUCCESS(rc))
+        pCache->offTreeRoot      = Hdr.offTreeRoot;
+        pCache->offBlksBitmap    = Hdr.offBlkMap;
+        pCache->cBlkMap          = Hdr.cBlkMap;
+        pCache->u32CacheType     = Hdr.u32CacheType;
+        pCache->uuidImage        = Hdr.uuidImage;
+        pCache->uuidModification = Hdr.uuidModification;
+        pCache->cbSize           = VCI_BLOCK2BYTE(Hdr.cBlocksCache);
+        pCache->fHdrUnclean      = Hdr.fUncleanShutdown != VCI_HDR_CLEAN_SHUTDOWN;
+
+        if (!pCache->fHdrUnclean)
         {
-            /* Load the first tree node. */
-            VciTreeNode RootNode;
-
-            rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                       pCache->offTreeRoot, &RootNode,
-                                       VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
+            /* Load the block map and the index of cached data. */
+            rc = vciBlkMapLoad(pCache, pCache->offBlksBitmap, Hdr.cBlkMap, &pCache->pBlkMap);
             if (RT_SUCCESS(rc))
-            {
-                pCache->pRoot = vciTreeNodeImage2Host(pCache->offTreeRoot, &RootNode);
-                if (!pCache->pRoot)
-                    rc = VERR_NO_MEMORY;
-            }
+                rc = vciTreeLoadNode(pCache, pCache->offTreeRoot, 0 /* uDepth */);
+        }
+        else if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        {
+            /*
+             * The cache was not closed cleanly, so the index might not match the
+             * data. Drop everything, the cache gets filled again on the next reads.
+             */
+            LogRel(("VCI: Cache '%s' was not closed cleanly, discarding cached data\n",
+                    pCache->pszFilename));
+            rc = vciCacheReset(pCache, Hdr.cBlocksCache);
+        }
+        else
+        {
+            /* Can't reset a read only cache, act like it is empty. */
+            uint32_t cBlkMap = 0;
+            rc = vciBlkMapCreate(Hdr.cBlocksCache, &pCache->pBlkMap, &cBlkMap);
         }
     }
     else
@@ -1293,8 +1588,6 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
                           void *pvUser, unsigned uPercentStart,
                           unsigned uPercentSpan)
 {
-    VciHdr Hdr;
-    VciTreeNode NodeRoot;
     int rc;
     uint64_t cBlocks = cbSize / VCI_BLOCK_SIZE; /* Size of the cache in blocks. */
 
@@ -1305,6 +1598,9 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
     pCache->pIfIo = VDIfIoIntGet(pCache->pVDIfsImage);
     AssertPtrReturn(pCache->pIfIo, VERR_INVALID_PARAMETER);
 
+    pCache->TreeExtents = NULL;
+    RTListInit(&pCache->ListLru);
+
     if (uImageFlags & VD_IMAGE_FLAGS_DIFF)
     {
         rc = vdIfError(pCache->pIfError, VERR_VD_RAW_INVALID_TYPE, RT_SRC_POS, N_("VCI: cannot create diff image '%s'"), pCache->pszFilename);
@@ -1358,56 +1654,26 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
             break;
         }
 
-        /*
-         * Allocate space for the tree root node.
-         */
-        uint64_t offTreeRoot = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciTreeNode)), VCIBLKMAP_ALLOC_META, &offTreeRoot);
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for block map in block map '%s'"), pCache->pszFilename);
-            break;
-        }
+        pCache->offBlksBitmap = offBlkMap;
+        pCache->cBlkMap       = cBlkMap;
+        pCache->u32CacheType  =   uImageFlags & VD_IMAGE_FLAGS_FIXED
+                                ? VCI_HDR_CACHE_TYPE_FIXED
+                                : VCI_HDR_CACHE_TYPE_DYNAMIC;
 
         /*
-         * Allocate the in memory root node.
+         * Write the empty tree, this allocates the root node.
          */
-        pCache->pRoot = (PVCITREENODE)RTMemAllocZ(sizeof(VCITREENODELEAF));
-        if (!pCache->pRoot)
+        rc = vciTreeSave(pCache);
+        if (RT_FAILURE(rc))
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate B+-Tree root pointer '%s'"), pCache->pszFilename);
+            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write root node '%s'"), pCache->pszFilename);
             break;
         }
 
-        pCache->pRoot->u8Type = VCI_TREE_NODE_TYPE_LEAF;
-        /* Rest remains 0 as the tree is still empty. */
-
         /*
          * Now that we are here we have all the basic structures and know where to place them in the image.
          * It's time to write it now.
          */
-
-        /* Setup the header. */
-        memset(&Hdr, 0, sizeof(VciHdr));
-        Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
-        Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
-        Hdr.cBlocksCache     = RT_H2LE_U64(cBlocks);
-        Hdr.fUncleanShutdown = VCI_HDR_UNCLEAN_SHUTDOWN;
-        Hdr.u32CacheType     = uImageFlags & VD_IMAGE_FLAGS_FIXED
-                               ? RT_H2LE_U32(VCI_HDR_CACHE_TYPE_FIXED)
-                               : RT_H2LE_U32(VCI_HDR_CACHE_TYPE_DYNAMIC);
-        Hdr.offTreeRoot      = RT_H2LE_U64(offTreeRoot);
-        Hdr.offBlkMap        = RT_H2LE_U64(offBlkMap);
-        Hdr.cBlkMap          = RT_H2LE_U32(cBlkMap);
-
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offHdr, &Hdr,
-                                    VCI_BYTE2BLOCK(sizeof(VciHdr)));
-        if (RT_FAILURE(rc))
-        {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write header '%s'"), pCache->pszFilename);
-            break;
-        }
-
         rc = vciBlkMapSave(pCache->pBlkMap, pCache, offBlkMap, cBlkMap);
         if (RT_FAILURE(rc))
         {
@@ -1415,15 +1681,10 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
             break;
         }
 
-        /* Setup the root tree. */
-        memset(&NodeRoot, 0, sizeof(VciTreeNode));
-        NodeRoot.u8Type = RT_H2LE_U32(VCI_TREE_NODE_TYPE_LEAF);
-
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offTreeRoot,
-                                    &NodeRoot, VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
+        rc = vciHdrWrite(pCache, false /* fUnclean */);
         if (RT_FAILURE(rc))
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write root node '%s'"), pCache->pszFilename);
+            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write header '%s'"), pCache->pszFilename);
             break;
         }
 
@@ -1654,20 +1915,26 @@ static DECLCALLBACK(int) vciRead(void *pBackendData, uint64_t uOffset, size_t cb
     Assert(uOffset % 512 == 0);
     Assert(cbToRead % 512 == 0);
 
-    pExtent = vciCacheExtentLookup(pCache, offBlockAddr, NULL);
+    pExtent = (PVCICACHEEXTENT)RTAvlrU64RangeGet(&pCache->TreeExtents, offBlockAddr);
     if (pExtent)
     {
-        uint64_t offRead = offBlockAddr - pExtent->u64BlockOffset;
-        cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->u32Blocks - offRead);
+        uint64_t offRead = offBlockAddr - pExtent->Core.Key;
+        cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->Core.KeyLast - offBlockAddr + 1);
 
         rc = vdIfIoIntFileReadUser(pCache->pIfIo, pCache->pStorage,
-                                   pExtent->u64BlockAddr + offRead,
-                                   pIoCtx, cBlocksToRead);
+                                   VCI_BLOCK2BYTE(pExtent->u64BlockAddr + offRead),
+                                   pIoCtx, VCI_BLOCK2BYTE(cBlocksToRead));
+
+        /* Move the extent to the front of the LRU list. */
+        RTListNodeRemove(&pExtent->NodeLru);
+        RTListPrepend(&pCache->ListLru, &pExtent->NodeLru);
     }
     else
     {
-        /** @todo Best fit to check whether we have cached data later and set
-         * pcbActuallyRead accordingly. */
+        /* Report everything up to the next cached extent as not available. */
+        pExtent = (PVCICACHEEXTENT)RTAvlrU64GetBestFit(&pCache->TreeExtents, offBlockAddr, true /* fAbove */);
+        if (pExtent)
+            cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->Core.Key - offBlockAddr);
         rc = VERR_VD_BLOCK_FREE;
     }
 
@@ -1686,19 +1953,53 @@ static DECLCALLBACK(int) vciWrite(void *pBackendData, uint64_t uOffset, size_t c
                  pBackendData, uOffset, cbToWrite, pIoCtx, pcbWriteProcess));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
-    uint64_t cBlocksToWrite = VCI_BYTE2BLOCK(cbToWrite);
-    uint64_t offBlockAddr  = VCI_BYTE2BLOCK(uOffset);
+    uint64_t cBlocksToWrite = RT_MIN(VCI_BYTE2BLOCK(cbToWrite), VCI_EXTENT_BLOCKS_MAX);
+    uint64_t offBlockOffset = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockAddr   = 0;
 
     AssertPtr(pCache);
     Assert(uOffset % 512 == 0);
     Assert(cbToWrite % 512 == 0);
 
-    while (cBlocksToWrite)
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        return VERR_VD_IMAGE_READ_ONLY;
+
+    rc = vciHdrMarkUnclean(pCache);
+    if (RT_SUCCESS(rc))
+        rc = vciCacheInvalidate(pCache, offBlockOffset, cBlocksToWrite);
+    if (RT_SUCCESS(rc))
     {
+        /* Make room by evicting the least recently used data if the cache is full. */
+        do
+        {
+            rc = vciBlkMapAllocate(pCache->pBlkMap, (uint32_t)cBlocksToWrite,
+                                   VCIBLKMAP_ALLOC_DATA, &offBlockAddr);
+        } while (   rc == VERR_VCI_NO_BLOCKS_FREE
+                 && vciCacheEvictLru(pCache));
+    }
 
+    if (RT_SUCCESS(rc))
+    {
+        rc = vdIfIoIntFileWriteUser(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddr),
+                                    pIoCtx, VCI_BLOCK2BYTE(cBlocksToWrite), NULL, NULL);
+        if (   RT_SUCCESS(rc)
+            || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            int rc2 = vciCacheExtentInsert(pCache, offBlockOffset, cBlocksToWrite, offBlockAddr,
+                                           false /* fAppendLru */);
+            if (RT_FAILURE(rc2))
+            {
+                vciBlkMapFree(pCache->pBlkMap, offBlockAddr, cBlocksToWrite, VCIBLKMAP_ALLOC_DATA);
+                rc = rc2;
+            }
+        }
+        else
+            vciBlkMapFree(pCache->pBlkMap, offBlockAddr, cBlocksToWrite, VCIBLKMAP_ALLOC_DATA);
     }
+    else if (rc == VERR_VCI_NO_BLOCKS_FREE)
+        rc = VERR_DISK_FULL;
 
-    *pcbWriteProcess = cbToWrite; /** @todo: Implement. */
+    *pcbWriteProcess = VCI_BLOCK2BYTE(cBlocksToWrite);
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -1716,6 +2017,47 @@ static DECLCALLBACK(int) vciFlush(void *pBackendData, PVDIOCTX pIoCtx)
     return rc;
 }
 
+/** @copydoc VDCACHEBACKEND::pfnDiscard */
+static DECLCALLBACK(int) vciDiscard(void *pBackendData, PVDIOCTX pIoCtx,
+                                    uint64_t uOffset, size_t cbDiscard,
+                                    size_t *pcbPreAllocated,
+                                    size_t *pcbPostAllocated,
+                                    size_t *pcbActuallyDiscarded,
+                                    void   **ppbmAllocationBitmap,
+                                    unsigned fDiscard)
+{
+    LogFlowFunc(("pBackendData=%#p pIoCtx=%#p uOffset=%llu cbDiscard=%zu\n",
+                 pBackendData, pIoCtx, uOffset, cbDiscard));
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+    int rc = VINF_SUCCESS;
+    uint64_t offBlockFirst = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockEnd   = VCI_BYTE2BLOCK(uOffset + cbDiscard + VCI_BLOCK_SIZE - 1);
+
+    AssertPtr(pCache);
+    NOREF(pIoCtx); NOREF(fDiscard);
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        return VERR_VD_IMAGE_READ_ONLY;
+
+    /* Partially covered blocks are dropped completely, the cache must never return stale data. */
+    rc = vciHdrMarkUnclean(pCache);
+    if (   RT_SUCCESS(rc)
+        && offBlockEnd > offBlockFirst)
+        rc = vciCacheInvalidate(pCache, offBlockFirst, offBlockEnd - offBlockFirst);
+
+    if (pcbPreAllocated)
+        *pcbPreAllocated = 0;
+    if (pcbPostAllocated)
+        *pcbPostAllocated = 0;
+    if (pcbActuallyDiscarded)
+        *pcbActuallyDiscarded = cbDiscard;
+    if (ppbmAllocationBitmap)
+        *ppbmAllocationBitmap = NULL;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
 /** @copydoc VDCACHEBACKEND::pfnGetVersion */
 static DECLCALLBACK(unsigned) vciGetVersion(void *pBackendData)
 {
@@ -1884,7 +2226,10 @@ static DECLCALLBACK(int) vciGetUuid(void *pBackendData, PRTUUID pUuid)
     AssertPtr(pCache);
 
     if (pCache)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pCache->uuidImage;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -1905,7 +2250,10 @@ static DECLCALLBACK(int) vciSetUuid(void *pBackendData, PCRTUUID pUuid)
     if (pCache)
     {
         if (!(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pCache->uuidImage = *pUuid;
+            rc = vciHdrWrite(pCache, pCache->fHdrUnclean);
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -1926,7 +2274,10 @@ static DECLCALLBACK(int) vciGetModificationUuid(void *pBackendData, PRTUUID pUui
     AssertPtr(pCache);
 
     if (pCache)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pCache->uuidModification;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -1946,7 +2297,10 @@ static DECLCALLBACK(int) vciSetModificationUuid(void *pBackendData, PCRTUUID pUu
     if (pCache)
     {
         if (!(pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pCache->uuidModification = *pUuid;
+            rc = vciHdrWrite(pCache, pCache->fHdrUnclean);
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -1991,7 +2345,7 @@ const VDCACHEBACKEND g_VciCacheBackend =
     /* pfnFlush */
     vciFlush,
     /* pfnDiscard */
-    NULL,
+    vciDiscard,
     /* pfnGetVersion */
     vciGetVersion,
     /* pfnGetSize */
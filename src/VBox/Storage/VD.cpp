@@ -40,6 +40,8 @@
 #include <iprt/list.h>
 #include <iprt/avl.h>
 #include <iprt/semaphore.h>
+#include <iprt/thread.h>
+#include <iprt/time.h>
 
 #include <VBox/vd-plugin.h>
 
@@ -57,6 +59,11 @@
 /** Buffer size used for merging images. */
 #define VD_MERGE_BUFFER_SIZE    (16 * _1M)
 
+/** Chunk size used by the pipelined copy. */
+#define VD_COPY_PIPELINE_CHUNK_SIZE _1M
+/** Number of chunks in flight between the reader and writer of the pipelined copy. */
+#define VD_COPY_PIPELINE_DEPTH      16
+
 /** Maximum number of segments in one I/O task. */
 #define VD_IO_TASK_SEGMENTS_MAX 64
 
@@ -129,6 +136,56 @@ typedef struct VDIMAGE
     VDIO                VDIo;
 } VDIMAGE, *PVDIMAGE;
 
+/**
+ * One chunk of the pipelined copy.
+ */
+typedef struct VDCOPYCHUNK
+{
+    /** The buffer holding the data. */
+    void                *pvBuf;
+    /** Start offset of the chunk. */
+    uint64_t             uOffset;
+    /** Number of bytes the chunk covers, can exceed the buffer size for unallocated ranges. */
+    uint64_t             cbChunk;
+    /** Number of bytes read into the buffer, never more than VD_COPY_PIPELINE_CHUNK_SIZE. */
+    size_t               cbRead;
+    /** Status of the read, VERR_VD_BLOCK_FREE if there is nothing to write. */
+    int                  rcRead;
+} VDCOPYCHUNK;
+/** Pointer to a copy chunk. */
+typedef VDCOPYCHUNK *PVDCOPYCHUNK;
+
+/**
+ * State of the pipelined copy shared between the reader thread and the writer.
+ */
+typedef struct VDCOPYPIPELINE
+{
+    /** The source disk. */
+    PVBOXHDD             pDiskFrom;
+    /** The source image. */
+    PVDIMAGE             pImageFrom;
+    /** Number of bytes to copy. */
+    uint64_t             cbSize;
+    /** Number of images to read from the source, see vdCopyHelper(). */
+    unsigned             cImagesFromRead;
+    /** Flag whether the source is read blockwise. */
+    bool                 fBlockwiseCopy;
+    /** Flag whether chunks containing only zeros can be skipped. */
+    bool                 fSkipZeroChunks;
+    /** Flag whether the reader should stop. */
+    volatile bool        fCancel;
+    /** Number of chunks filled by the reader and not yet consumed by the writer. */
+    volatile uint32_t    cChunksFilled;
+    /** Event signaled by the reader when a chunk was filled. */
+    RTSEMEVENT           hEvtFilled;
+    /** Event signaled by the writer when a chunk was consumed. */
+    RTSEMEVENT           hEvtConsumed;
+    /** The chunk ring. */
+    VDCOPYCHUNK          aChunks[VD_COPY_PIPELINE_DEPTH];
+} VDCOPYPIPELINE;
+/** Pointer to the pipelined copy state. */
+typedef VDCOPYPIPELINE *PVDCOPYPIPELINE;
+
 /**
  * uModified bit flags.
  */
@@ -289,6 +346,9 @@ struct VBOXHDD
 
     /** Pointer to the L2 disk cache if any. */
     PVDCACHE               pCache;
+    /** Incremented whenever data in the cache is invalidated, reads which were in
+     * flight at that time must not populate the cache with what they read. */
+    uint32_t               uCacheInvalidateGen;
     /** Pointer to the discard state if any. */
     PVDDISCARDSTATE        pDiscard;
 
@@ -395,6 +455,12 @@ typedef struct VDIOCTX
             uint64_t             uOffsetXferOrig;
             /** Original size of the transfer - required for fitlering read requests. */
             size_t               cbXferOrig;
+            /** Start of the range which missed the cache and is written to it on completion. */
+            uint64_t             offCacheFillStart;
+            /** End of the range to write to the cache on completion, equal to the start if nothing. */
+            uint64_t             offCacheFillEnd;
+            /** Cache invalidation generation when the first miss was read, see VBOXHDD::uCacheInvalidateGen. */
+            uint32_t             uCacheInvalidateGen;
         } Io;
         /** Discard requests. */
         struct
@@ -659,6 +725,11 @@ static unsigned g_cFilterBackends = 0;
 static PCVDFILTERBACKEND *g_apFilterBackends = NULL;
 /** Array of handles to the corresponding plugin. */
 static RTLDRMOD *g_ahFilterBackendPlugins = NULL;
+/** Builtin filter backends. */
+static PCVDFILTERBACKEND aStaticFilterBackends[] =
+{
+    &g_VDFilterDedup
+};
 
 /** Forward declaration of the async discard helper. */
 static DECLCALLBACK(int) vdDiscardHelperAsync(PVDIOCTX pIoCtx);
@@ -666,6 +737,7 @@ static DECLCALLBACK(int) vdWriteHelperAsync(PVDIOCTX pIoCtx);
 static void vdDiskProcessBlockedIoCtx(PVBOXHDD pDisk);
 static int vdDiskUnlock(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc);
 static void vdIoCtxSyncComplete(void *pvUser1, void *pvUser2, int rcReq);
+static void vdIoCtxCacheFill(PVBOXHDD pDisk, PVDIOCTX pIoCtx);
 
 /**
  * internal: add several backends.
@@ -1018,6 +1090,36 @@ static int vdFilterChainApplyWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWr
     return rc;
 }
 
+/**
+ * Internal: Creates a private copy of the data to write for the write filters.
+ *
+ * Write filters may change the data in place (encryption, deduplication), which
+ * must not be visible in the caller's buffer. It might even be guest memory.
+ *
+ * @returns Pointer to the allocation holding the segment and the data, free with RTMemFree().
+ *          NULL if out of memory.
+ * @param   pcSgBuf    The S/G buffer to copy from, not advanced.
+ * @param   cbData     Number of bytes to copy.
+ * @param   pSgBuf     Where to initialize the S/G buffer describing the copy.
+ */
+static void *vdFilterChainWriteBufDup(PCRTSGBUF pcSgBuf, size_t cbData, PRTSGBUF pSgBuf)
+{
+    /* Keep the data sector aligned for hosts doing uncached I/O. */
+    PRTSGSEG pSeg = (PRTSGSEG)RTMemAlloc(sizeof(RTSGSEG) + 512 + cbData);
+    if (pSeg)
+    {
+        RTSGBUF SgBufSrc;
+
+        pSeg->pvSeg = RT_ALIGN_PT((uint8_t *)(pSeg + 1), 512, void *);
+        pSeg->cbSeg = cbData;
+        RTSgBufClone(&SgBufSrc, pcSgBuf);
+        RTSgBufCopyToBuf(&SgBufSrc, pSeg->pvSeg, cbData);
+        RTSgBufInit(pSgBuf, pSeg, 1);
+    }
+
+    return pSeg;
+}
+
 /**
  * Applies the filter chain to the given read request.
  *
@@ -1054,8 +1156,11 @@ DECLINLINE(void) vdIoCtxRootComplete(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
 {
     if (   RT_SUCCESS(pIoCtx->rcReq)
         && pIoCtx->enmTxDir == VDIOCTXTXDIR_READ)
+    {
+        vdIoCtxCacheFill(pDisk, pIoCtx);
         pIoCtx->rcReq = vdFilterChainApplyRead(pDisk, pIoCtx->Req.Io.uOffsetXferOrig,
                                                pIoCtx->Req.Io.cbXferOrig, pIoCtx);
+    }
 
     pIoCtx->Type.Root.pfnComplete(pIoCtx->Type.Root.pvUser1,
                                   pIoCtx->Type.Root.pvUser2,
@@ -1081,6 +1186,9 @@ DECLINLINE(void) vdIoCtxInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, VDIOCTXTXDIR enmTx
     pIoCtx->Req.Io.pImageParentOverride = NULL;
     pIoCtx->Req.Io.uOffsetXferOrig      = uOffset;
     pIoCtx->Req.Io.cbXferOrig           = cbTransfer;
+    pIoCtx->Req.Io.offCacheFillStart    = 0;
+    pIoCtx->Req.Io.offCacheFillEnd      = 0;
+    pIoCtx->Req.Io.uCacheInvalidateGen  = 0;
     pIoCtx->cDataTransfersPending = 0;
     pIoCtx->cMetaTransfersPending = 0;
     pIoCtx->fComplete             = false;
@@ -1180,6 +1288,110 @@ static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
     return rc;
 }
 
+/**
+ * Internal: Populates the cache with data which was just read from the image chain.
+ *
+ * The data is copied out of the given S/G buffer and written through a private
+ * synchronous I/O context so the request context is left untouched. Errors are
+ * not fatal because the data is still available from the images.
+ *
+ * @returns nothing.
+ * @param   pDisk      The disk the cache belongs to.
+ * @param   uOffset    Offset of the virtual disk the data belongs to.
+ * @param   cbWrite    How much data to put into the cache.
+ * @param   pSgBuf     S/G buffer positioned at the start of the data, advanced on return.
+ */
+static void vdCacheUpdateFromSgBuf(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
+                                   PRTSGBUF pSgBuf)
+{
+    void *pvBuf = RTMemTmpAlloc(cbWrite);
+
+    if (pvBuf)
+    {
+        RTSGSEG Segment;
+        RTSGBUF SgBuf;
+        VDIOCTX IoCtx;
+
+        RTSgBufCopyToBuf(pSgBuf, pvBuf, cbWrite);
+
+        Segment.pvSeg = pvBuf;
+        Segment.cbSeg = cbWrite;
+        RTSgBufInit(&SgBuf, &Segment, 1);
+        vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_WRITE, uOffset, cbWrite, NULL, &SgBuf,
+                    NULL, NULL, VDIOCTX_FLAGS_SYNC | VDIOCTX_FLAGS_DONT_FREE);
+
+        int rc = vdCacheWriteHelper(pDisk->pCache, uOffset, cbWrite, &IoCtx, NULL);
+        if (RT_FAILURE(rc))
+            LogFlowFunc(("Updating the cache at %llu failed with %Rrc, ignored\n", uOffset, rc));
+
+        RTMemTmpFree(pvBuf);
+    }
+}
+
+/**
+ * Internal: Populates the cache with the data of a completed read which missed it.
+ *
+ * Called before the read filters are applied because the cache holds the data as
+ * stored in the images. Nothing is written if the cache was invalidated while the
+ * read was in flight because the data read might be stale already.
+ *
+ * @returns nothing.
+ * @param   pDisk      The disk the cache belongs to.
+ * @param   pIoCtx     The completed root read I/O context.
+ */
+static void vdIoCtxCacheFill(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
+{
+    VD_IS_LOCKED(pDisk);
+
+    if (   pDisk->pCache
+        && (pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
+        && pIoCtx->Req.Io.offCacheFillEnd > pIoCtx->Req.Io.offCacheFillStart
+        && pIoCtx->Req.Io.uCacheInvalidateGen == pDisk->uCacheInvalidateGen)
+    {
+        RTSGBUF SgBuf;
+
+        Assert(pIoCtx->Req.Io.offCacheFillStart >= pIoCtx->Req.Io.uOffsetXferOrig);
+        Assert(   pIoCtx->Req.Io.offCacheFillEnd
+               <= pIoCtx->Req.Io.uOffsetXferOrig + pIoCtx->Req.Io.cbXferOrig);
+
+        RTSgBufClone(&SgBuf, &pIoCtx->Req.Io.SgBuf);
+        RTSgBufReset(&SgBuf);
+        RTSgBufAdvance(&SgBuf, (size_t)(pIoCtx->Req.Io.offCacheFillStart - pIoCtx->Req.Io.uOffsetXferOrig));
+        vdCacheUpdateFromSgBuf(pDisk, pIoCtx->Req.Io.offCacheFillStart,
+                               (size_t)(pIoCtx->Req.Io.offCacheFillEnd - pIoCtx->Req.Io.offCacheFillStart),
+                               &SgBuf);
+    }
+
+    pIoCtx->Req.Io.offCacheFillStart = 0;
+    pIoCtx->Req.Io.offCacheFillEnd   = 0;
+}
+
+/**
+ * Internal: Drops the given range from the cache because the data changed.
+ *
+ * @returns nothing.
+ * @param   pDisk      The disk the cache belongs to.
+ * @param   uOffset    Start offset of the range.
+ * @param   cbRange    Size of the range.
+ */
+static void vdCacheInvalidate(PVBOXHDD pDisk, uint64_t uOffset, size_t cbRange)
+{
+    PVDCACHE pCache = pDisk->pCache;
+
+    if (pCache)
+        pDisk->uCacheInvalidateGen++;
+
+    if (   pCache
+        && pCache->Backend->pfnDiscard)
+    {
+        size_t cbDiscarded = 0;
+        int rc = pCache->Backend->pfnDiscard(pCache->pBackendData, NULL, uOffset, cbRange,
+                                             NULL, NULL, &cbDiscarded, NULL, 0);
+        if (RT_FAILURE(rc))
+            LogRel(("VD: Invalidating the cache at %llu failed with %Rrc\n", uOffset, rc));
+    }
+}
+
 /**
  * Creates a new empty discard state.
  *
@@ -1777,6 +1989,7 @@ static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
                 && RT_SUCCESS(pTmp->rcReq)
                 && pTmp->enmTxDir == VDIOCTXTXDIR_READ)
             {
+                   vdIoCtxCacheFill(pDisk, pTmp);
                    int rc2 = vdFilterChainApplyRead(pDisk, pTmp->Req.Io.uOffsetXferOrig,
                                                     pTmp->Req.Io.cbXferOrig, pTmp);
                     if (RT_FAILURE(rc2))
@@ -2056,12 +2269,22 @@ static DECLCALLBACK(int) vdReadHelperAsync(PVDIOCTX pIoCtx)
                 rc = vdDiskReadHelper(pDisk, pCurrImage, NULL, uOffset, cbThisRead,
                                       pIoCtx, &cbThisRead);
 
-                /* If the read was successful, write the data back into the cache. */
-                if (   RT_SUCCESS(rc)
-                    && pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
+                /*
+                 * Remember the range for writing it into the cache once the whole request
+                 * completed, the data of reads still in flight isn't there yet.
+                 * See vdIoCtxCacheFill().
+                 */
+                if (   (   RT_SUCCESS(rc)
+                        || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                    && (pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
+                    && !pIoCtx->pIoCtxParent)
                 {
-                    rc = vdCacheWriteHelper(pDisk->pCache, uOffset, cbThisRead,
-                                            pIoCtx, NULL);
+                    if (pIoCtx->Req.Io.offCacheFillEnd == pIoCtx->Req.Io.offCacheFillStart)
+                    {
+                        pIoCtx->Req.Io.offCacheFillStart   = uOffset;
+                        pIoCtx->Req.Io.uCacheInvalidateGen = pDisk->uCacheInvalidateGen;
+                    }
+                    pIoCtx->Req.Io.offCacheFillEnd = uOffset + cbThisRead;
                 }
             }
         }
@@ -2328,16 +2551,29 @@ static int vdWriteHelperEx(PVBOXHDD pDisk, PVDIMAGE pImage,
     RTSGBUF SgBuf;
     VDIOCTX IoCtx;
     RTSEMEVENT hEventComplete = NIL_RTSEMEVENT;
-
-    rc = RTSemEventCreate(&hEventComplete);
-    if (RT_FAILURE(rc))
-        return rc;
+    void *pvFilterBuf = NULL;
 
     fFlags |= VDIOCTX_FLAGS_SYNC | VDIOCTX_FLAGS_DONT_FREE;
 
     Segment.pvSeg = (void *)pvBuf;
     Segment.cbSeg = cbWrite;
     RTSgBufInit(&SgBuf, &Segment, 1);
+
+    /* The buffer is const, don't let the write filters modify it. */
+    if (!RTListIsEmpty(&pDisk->ListFilterChainWrite))
+    {
+        pvFilterBuf = vdFilterChainWriteBufDup(&SgBuf, cbWrite, &SgBuf);
+        if (!pvFilterBuf)
+            return VERR_NO_MEMORY;
+    }
+
+    rc = RTSemEventCreate(&hEventComplete);
+    if (RT_FAILURE(rc))
+    {
+        RTMemFree(pvFilterBuf);
+        return rc;
+    }
+
     vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_WRITE, uOffset, cbWrite, pImage, &SgBuf,
                 NULL, vdWriteHelperAsync, fFlags);
 
@@ -2351,6 +2587,8 @@ static int vdWriteHelperEx(PVBOXHDD pDisk, PVDIMAGE pImage,
         rc = vdIoCtxProcessSync(&IoCtx, hEventComplete);
 
     RTSemEventDestroy(hEventComplete);
+    if (pvFilterBuf)
+        RTMemFree(pvFilterBuf);
     return rc;
 }
 
@@ -2365,13 +2603,356 @@ static int vdWriteHelper(PVBOXHDD pDisk, PVDIMAGE pImage, uint64_t uOffset,
                            fFlags, 0);
 }
 
+/**
+ * Internal: Reads one chunk of the source for vdCopyHelper().
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_BLOCK_FREE if the range is unallocated in the images read
+ *          and doesn't need to be written to the destination.
+ * @param   pDiskFrom           The source disk, the caller holds the read lock.
+ * @param   pImageFrom          The source image.
+ * @param   uOffset             Where to start reading.
+ * @param   pvBuf               Where to store the data.
+ * @param   pcbThisRead         On input the number of bytes to read, on output
+ *                              the number of bytes actually read or found free.
+ * @param   cImagesFromRead     Number of images to read from, see vdCopyHelper().
+ * @param   fBlockwiseCopy      Flag whether to read blockwise from the backends.
+ */
+static int vdCopyHelperReadChunk(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, uint64_t uOffset,
+                                 void *pvBuf, size_t *pcbThisRead, unsigned cImagesFromRead,
+                                 bool fBlockwiseCopy)
+{
+    int rc;
+    size_t cbThisRead = *pcbThisRead;
+
+    if (fBlockwiseCopy)
+    {
+        RTSGSEG SegmentBuf;
+        RTSGBUF SgBuf;
+        VDIOCTX IoCtx;
+
+        SegmentBuf.pvSeg = pvBuf;
+        SegmentBuf.cbSeg = cbThisRead;
+        RTSgBufInit(&SgBuf, &SegmentBuf, 1);
+        vdIoCtxInit(&IoCtx, pDiskFrom, VDIOCTXTXDIR_READ, 0, 0, NULL,
+                    &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+
+        /* Read the source data. */
+        rc = pImageFrom->Backend->pfnRead(pImageFrom->pBackendData,
+                                          uOffset, cbThisRead, &IoCtx,
+                                          &cbThisRead);
+
+        if (   rc == VERR_VD_BLOCK_FREE
+            && cImagesFromRead != 1)
+        {
+            unsigned cImagesToProcess = cImagesFromRead;
+
+            for (PVDIMAGE pCurrImage = pImageFrom->pPrev;
+                 pCurrImage != NULL && rc == VERR_VD_BLOCK_FREE;
+                 pCurrImage = pCurrImage->pPrev)
+            {
+                rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
+                                                       uOffset, cbThisRead,
+                                                       &IoCtx, &cbThisRead);
+                if (cImagesToProcess == 1)
+                    break;
+                else if (cImagesToProcess > 0)
+                    cImagesToProcess--;
+            }
+        }
+    }
+    else
+        rc = vdReadHelper(pDiskFrom, pImageFrom, uOffset, pvBuf, cbThisRead,
+                          false /* fUpdateCache */);
+
+    *pcbThisRead = cbThisRead;
+    return rc;
+}
+
+/**
+ * Internal: Returns the number of bytes starting at the given offset which are
+ * unallocated in all images read by vdCopyHelper() and can be skipped without
+ * reading anything.
+ *
+ * @returns Number of unallocated bytes, 0 if the range at the given offset is
+ *          allocated or the allocation status can't be determined.
+ * @param   pImageFrom          The source image, the caller holds the read lock.
+ * @param   cImagesFromRead     Number of images to read from, see vdCopyHelper().
+ * @param   uOffset             Start offset.
+ * @param   cbRange             Maximum number of bytes to check.
+ */
+static uint64_t vdCopyHelperQueryUnallocated(PVDIMAGE pImageFrom, unsigned cImagesFromRead,
+                                             uint64_t uOffset, uint64_t cbRange)
+{
+    uint64_t cbUnallocated = cbRange;
+    unsigned cImagesToProcess = cImagesFromRead;
+
+    /* Walk the images the same way vdCopyHelperReadChunk() does. */
+    for (PVDIMAGE pCurrImage = pImageFrom;
+         pCurrImage != NULL && cbUnallocated;
+         pCurrImage = pCurrImage->pPrev)
+    {
+        bool fAllocated = true;
+        uint64_t cbExtent = 0;
+
+        if (!pCurrImage->Backend->pfnQueryAllocationStatus)
+            return 0;
+
+        int rc = pCurrImage->Backend->pfnQueryAllocationStatus(pCurrImage->pBackendData,
+                                                               uOffset, cbUnallocated,
+                                                               &fAllocated, &cbExtent);
+        if (RT_FAILURE(rc) || fAllocated)
+            return 0;
+
+        cbUnallocated = RT_MIN(cbUnallocated, cbExtent);
+
+        if (pCurrImage == pImageFrom)
+        {
+            if (cImagesFromRead == 1)
+                break;
+        }
+        else if (cImagesToProcess == 1)
+            break;
+        else if (cImagesToProcess > 0)
+            cImagesToProcess--;
+    }
+
+    return cbUnallocated;
+}
+
+/**
+ * Internal: Reader thread of the pipelined copy, fills the chunk ring in order.
+ *
+ * Doesn't lock the source disk itself, vdCopyHelperPipelined() holds the read
+ * lock for it until the thread is gone.
+ */
+static DECLCALLBACK(int) vdCopyPipelineReader(RTTHREAD hThread, void *pvUser)
+{
+    PVDCOPYPIPELINE pPipe = (PVDCOPYPIPELINE)pvUser;
+    uint64_t uOffset = 0;
+    unsigned idxChunk = 0;
+    int rc = VINF_SUCCESS;
+
+    NOREF(hThread);
+
+    while (   uOffset < pPipe->cbSize
+           && !ASMAtomicReadBool(&pPipe->fCancel))
+    {
+        /* Wait for a free chunk. */
+        while (   ASMAtomicReadU32(&pPipe->cChunksFilled) == VD_COPY_PIPELINE_DEPTH
+               && !ASMAtomicReadBool(&pPipe->fCancel))
+            RTSemEventWait(pPipe->hEvtConsumed, RT_INDEFINITE_WAIT);
+        if (ASMAtomicReadBool(&pPipe->fCancel))
+            break;
+
+        PVDCOPYCHUNK pChunk = &pPipe->aChunks[idxChunk];
+        size_t cbThisRead = (size_t)RT_MIN(VD_COPY_PIPELINE_CHUNK_SIZE, pPipe->cbSize - uOffset);
+        uint64_t cbUnallocated = 0;
+
+        if (pPipe->fBlockwiseCopy)
+            cbUnallocated = vdCopyHelperQueryUnallocated(pPipe->pImageFrom, pPipe->cImagesFromRead,
+                                                         uOffset, pPipe->cbSize - uOffset);
+        if (cbUnallocated)
+        {
+            rc = VERR_VD_BLOCK_FREE;
+            cbThisRead = 0;
+        }
+        else
+            rc = vdCopyHelperReadChunk(pPipe->pDiskFrom, pPipe->pImageFrom, uOffset, pChunk->pvBuf,
+                                       &cbThisRead, pPipe->cImagesFromRead, pPipe->fBlockwiseCopy);
+        AssertMsg(cbThisRead <= VD_COPY_PIPELINE_CHUNK_SIZE, ("cbThisRead=%zu\n", cbThisRead));
+
+        /* Nothing to write for chunks containing only zeros if the destination is fresh. */
+        if (   RT_SUCCESS(rc)
+            && rc != VERR_VD_BLOCK_FREE
+            && pPipe->fSkipZeroChunks
+            && !ASMMemIsAll8(pChunk->pvBuf, cbThisRead, 0))
+            rc = VERR_VD_BLOCK_FREE;
+
+        pChunk->uOffset = uOffset;
+        pChunk->cbChunk = cbUnallocated ? RT_MIN(cbUnallocated, pPipe->cbSize - uOffset) : cbThisRead;
+        pChunk->cbRead  = cbThisRead;
+        pChunk->rcRead  = rc;
+
+        ASMAtomicIncU32(&pPipe->cChunksFilled);
+        RTSemEventSignal(pPipe->hEvtFilled);
+
+        if (RT_FAILURE(rc) && rc != VERR_VD_BLOCK_FREE)
+            break;
+
+        uOffset += pChunk->cbChunk;
+        idxChunk = (idxChunk + 1) % VD_COPY_PIPELINE_DEPTH;
+    }
+
+    return rc;
+}
+
+/**
+ * Internal: Copies the content of one disk to another one overlapping the reads
+ * from the source with the writes to the destination.
+ *
+ * A reader thread fills a ring of VD_COPY_PIPELINE_DEPTH chunks while the
+ * calling thread writes them to the destination in order, so the slower side
+ * determines the throughput instead of the sum of both. Only possible if source
+ * and destination are different disks because they are locked independently.
+ *
+ * The calling thread holds the read lock of the source disk for the whole copy
+ * on behalf of the reader thread, so the source images can't be closed or
+ * merged underneath it. The destination is write locked for each chunk while
+ * holding it, i.e. the lock order is source before destination like in the
+ * sequential copy.
+ */
+static int vdCopyHelperPipelined(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
+                                 uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
+                                 bool fBlockwiseCopy, bool fSkipZeroChunks,
+                                 PVDINTERFACEPROGRESS pIfProgress,
+                                 PVDINTERFACEPROGRESS pDstIfProgress)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    uint64_t uOffset = 0;
+    uint64_t cbWritten = 0;
+    unsigned idxChunk = 0;
+    unsigned uProgressOld = 0;
+    uint64_t tsStart = RTTimeMilliTS();
+    RTTHREAD hThreadReader = NIL_RTTHREAD;
+    bool fLockReadFrom = false;
+
+    PVDCOPYPIPELINE pPipe = (PVDCOPYPIPELINE)RTMemAllocZ(sizeof(VDCOPYPIPELINE));
+    if (!pPipe)
+        return VERR_NO_MEMORY;
+
+    pPipe->pDiskFrom       = pDiskFrom;
+    pPipe->pImageFrom      = pImageFrom;
+    pPipe->cbSize          = cbSize;
+    pPipe->cImagesFromRead = cImagesFromRead;
+    pPipe->fBlockwiseCopy  = fBlockwiseCopy;
+    pPipe->fSkipZeroChunks = fSkipZeroChunks;
+    pPipe->hEvtFilled      = NIL_RTSEMEVENT;
+    pPipe->hEvtConsumed    = NIL_RTSEMEVENT;
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pPipe->aChunks) && RT_SUCCESS(rc); i++)
+    {
+        pPipe->aChunks[i].pvBuf = RTMemTmpAlloc(VD_COPY_PIPELINE_CHUNK_SIZE);
+        if (!pPipe->aChunks[i].pvBuf)
+            rc = VERR_NO_MEMORY;
+    }
+
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pPipe->hEvtFilled);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pPipe->hEvtConsumed);
+    if (RT_SUCCESS(rc))
+    {
+        rc2 = vdThreadStartRead(pDiskFrom);
+        AssertRC(rc2);
+        fLockReadFrom = true;
+
+        rc = RTThreadCreate(&hThreadReader, vdCopyPipelineReader, pPipe, 0,
+                            RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VDCopyRd");
+    }
+
+    while (   RT_SUCCESS(rc)
+           && uOffset < cbSize)
+    {
+        /* Wait for the next chunk. */
+        while (!ASMAtomicReadU32(&pPipe->cChunksFilled))
+            RTSemEventWait(pPipe->hEvtFilled, RT_INDEFINITE_WAIT);
+
+        PVDCOPYCHUNK pChunk = &pPipe->aChunks[idxChunk];
+        Assert(pChunk->uOffset == uOffset);
+
+        rc = pChunk->rcRead;
+        if (RT_SUCCESS(rc) && rc != VERR_VD_BLOCK_FREE)
+        {
+            rc2 = vdThreadStartWrite(pDiskTo);
+            AssertRC(rc2);
+
+            /* Only do collapsed I/O if we are copying the data blockwise. */
+            rc = vdWriteHelperEx(pDiskTo, pDiskTo->pLast, NULL, uOffset, pChunk->pvBuf,
+                                 pChunk->cbRead, VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG /* fFlags */,
+                                 fBlockwiseCopy ? cImagesToRead : 0);
+
+            rc2 = vdThreadFinishWrite(pDiskTo);
+            AssertRC(rc2);
+
+            cbWritten += pChunk->cbRead;
+        }
+        else if (rc == VERR_VD_BLOCK_FREE) /* Don't propagate the error to the outside */
+            rc = VINF_SUCCESS;
+
+        uOffset += pChunk->cbChunk;
+        idxChunk = (idxChunk + 1) % VD_COPY_PIPELINE_DEPTH;
+        ASMAtomicDecU32(&pPipe->cChunksFilled);
+        RTSemEventSignal(pPipe->hEvtConsumed);
+
+        if (RT_FAILURE(rc))
+            break;
+
+        unsigned uProgressNew = uOffset * 99 / cbSize;
+        if (uProgressNew != uProgressOld)
+        {
+            uProgressOld = uProgressNew;
+
+            if (pIfProgress && pIfProgress->pfnProgress)
+            {
+                rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
+                                              uProgressOld);
+                if (RT_FAILURE(rc))
+                    break;
+            }
+            if (pDstIfProgress && pDstIfProgress->pfnProgress)
+            {
+                rc = pDstIfProgress->pfnProgress(pDstIfProgress->Core.pvUser,
+                                                 uProgressOld);
+                if (RT_FAILURE(rc))
+                    break;
+            }
+        }
+    }
+
+    if (hThreadReader != NIL_RTTHREAD)
+    {
+        ASMAtomicWriteBool(&pPipe->fCancel, true);
+        RTSemEventSignal(pPipe->hEvtConsumed);
+        rc2 = RTThreadWait(hThreadReader, RT_INDEFINITE_WAIT, NULL);
+        AssertRC(rc2);
+    }
+
+    if (fLockReadFrom)
+    {
+        rc2 = vdThreadFinishRead(pDiskFrom);
+        AssertRC(rc2);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t cMsElapsed = RT_MAX(RTTimeMilliTS() - tsStart, 1);
+        LogRel(("VD: Copied %llu bytes (%llu bytes written) in %llu ms (%llu KB/s)\n",
+                cbSize, cbWritten, cMsElapsed, cbSize / cMsElapsed * 1000 / _1K));
+    }
+
+    if (pPipe->hEvtConsumed != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pPipe->hEvtConsumed);
+    if (pPipe->hEvtFilled != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pPipe->hEvtFilled);
+    for (unsigned i = 0; i < RT_ELEMENTS(pPipe->aChunks); i++)
+        if (pPipe->aChunks[i].pvBuf)
+            RTMemTmpFree(pPipe->aChunks[i].pvBuf);
+    RTMemFree(pPipe);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
 /**
  * Internal: Copies the content of one disk to another one applying optimizations
  * to speed up the copy process if possible.
  */
 static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
                         uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
-                        bool fSuppressRedundantIo, PVDINTERFACEPROGRESS pIfProgress,
+                        bool fSuppressRedundantIo, bool fSkipZeroChunks,
+                        PVDINTERFACEPROGRESS pIfProgress,
                         PVDINTERFACEPROGRESS pDstIfProgress)
 {
     int rc = VINF_SUCCESS;
@@ -2391,6 +2972,12 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
         && RTListIsEmpty(&pDiskFrom->ListFilterChainRead))
         fBlockwiseCopy = true;
 
+    /* Overlap reading and writing if the disks can be locked independently. */
+    if (pDiskFrom != pDiskTo)
+        return vdCopyHelperPipelined(pDiskFrom, pImageFrom, pDiskTo, cbSize,
+                                     cImagesFromRead, cImagesToRead, fBlockwiseCopy,
+                                     fSkipZeroChunks, pIfProgress, pDstIfProgress);
+
     /* Allocate tmp buffer. */
     pvBuf = RTMemTmpAlloc(VD_MERGE_BUFFER_SIZE);
     if (!pvBuf)
@@ -2399,6 +2986,7 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
     do
     {
         size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+        uint64_t cbUnallocated = 0;
 
         /* Note that we don't attempt to synchronize cross-disk accesses.
          * It wouldn't be very difficult to do, just the lock order would
@@ -2409,46 +2997,16 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
         AssertRC(rc2);
         fLockReadFrom = true;
 
+        /* Skip ranges which are unallocated in all source images without reading them. */
         if (fBlockwiseCopy)
-        {
-            RTSGSEG SegmentBuf;
-            RTSGBUF SgBuf;
-            VDIOCTX IoCtx;
-
-            SegmentBuf.pvSeg = pvBuf;
-            SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
-            RTSgBufInit(&SgBuf, &SegmentBuf, 1);
-            vdIoCtxInit(&IoCtx, pDiskFrom, VDIOCTXTXDIR_READ, 0, 0, NULL,
-                        &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
-
-            /* Read the source data. */
-            rc = pImageFrom->Backend->pfnRead(pImageFrom->pBackendData,
-                                              uOffset, cbThisRead, &IoCtx,
-                                              &cbThisRead);
-
-            if (   rc == VERR_VD_BLOCK_FREE
-                && cImagesFromRead != 1)
-            {
-                unsigned cImagesToProcess = cImagesFromRead;
-
-                for (PVDIMAGE pCurrImage = pImageFrom->pPrev;
-                     pCurrImage != NULL && rc == VERR_VD_BLOCK_FREE;
-                     pCurrImage = pCurrImage->pPrev)
-                {
-                    rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
-                                                           uOffset, cbThisRead,
-                                                           &IoCtx, &cbThisRead);
-                    if (cImagesToProcess == 1)
-                        break;
-                    else if (cImagesToProcess > 0)
-                        cImagesToProcess--;
-                }
-            }
-        }
+            cbUnallocated = RT_MIN(vdCopyHelperQueryUnallocated(pImageFrom, cImagesFromRead,
+                                                                uOffset, cbRemaining),
+                                   cbRemaining);
+        if (cbUnallocated)
+            rc = VERR_VD_BLOCK_FREE;
         else
-            rc = vdReadHelper(pDiskFrom, pImageFrom, uOffset, pvBuf, cbThisRead,
-                              false /* fUpdateCache */);
-
+            rc = vdCopyHelperReadChunk(pDiskFrom, pImageFrom, uOffset, pvBuf, &cbThisRead,
+                                       cImagesFromRead, fBlockwiseCopy);
         if (RT_FAILURE(rc) && rc != VERR_VD_BLOCK_FREE)
             break;
 
@@ -2476,8 +3034,16 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
         else /* Don't propagate the error to the outside */
             rc = VINF_SUCCESS;
 
-        uOffset += cbThisRead;
-        cbRemaining -= cbThisRead;
+        if (cbUnallocated)
+        {
+            uOffset += cbUnallocated;
+            cbRemaining -= cbUnallocated;
+        }
+        else
+        {
+            uOffset += cbThisRead;
+            cbRemaining -= cbThisRead;
+        }
 
         unsigned uProgressNew = uOffset * 99 / cbSize;
         if (uProgressNew != uProgressOld)
@@ -2984,6 +3550,9 @@ static DECLCALLBACK(int) vdWriteHelperAsync(PVDIOCTX pIoCtx)
     if (RT_FAILURE(rc))
         return rc;
 
+    /* The cache only holds clean data, drop what gets overwritten. */
+    vdCacheInvalidate(pDisk, uOffset, cbWrite);
+
     /* Loop until all written. */
     do
     {
@@ -3130,6 +3699,33 @@ static DECLCALLBACK(int) vdWriteHelperAsync(PVDIOCTX pIoCtx)
     return rc;
 }
 
+/**
+ * Internal: Flushes the state of all write filters, see VDFILTERBACKEND::pfnFlush.
+ *
+ * @returns VBox status code.
+ * @param   pDisk    The HDD container.
+ */
+static int vdFilterChainFlush(PVBOXHDD pDisk)
+{
+    int rc = VINF_SUCCESS;
+
+    VD_IS_LOCKED(pDisk);
+
+    PVDFILTER pFilter;
+    RTListForEach(&pDisk->ListFilterChainWrite, pFilter, VDFILTER, ListNodeChainWrite)
+    {
+        if (   pFilter->pBackend->cbSize >= RT_OFFSETOF(VDFILTERBACKEND, pfnFlush) + sizeof(pFilter->pBackend->pfnFlush)
+            && pFilter->pBackend->pfnFlush)
+        {
+            rc = pFilter->pBackend->pfnFlush(pFilter->pvBackendData);
+            if (RT_FAILURE(rc))
+                break;
+        }
+    }
+
+    return rc;
+}
+
 /**
  * Flush helper async version.
  */
@@ -3146,6 +3742,14 @@ static DECLCALLBACK(int) vdFlushHelperAsync(PVDIOCTX pIoCtx)
         pDisk->uOffsetStartLocked = 0;
         pDisk->uOffsetEndLocked = UINT64_C(0xffffffffffffffff);
 
+        /* The filter state must be persistent before the images are. */
+        rc = vdFilterChainFlush(pDisk);
+        if (RT_FAILURE(rc))
+        {
+            vdIoCtxUnlockDisk(pDisk, pIoCtx, true /* fProcessBlockedReqs */);
+            return rc;
+        }
+
         vdResetModifiedFlag(pDisk);
         rc = pImage->Backend->pfnFlush(pImage->pBackendData, pIoCtx);
         if (   (   RT_SUCCESS(rc)
@@ -3435,6 +4039,7 @@ static DECLCALLBACK(int) vdDiscardHelperAsync(PVDIOCTX pIoCtx)
             LogFlowFunc(("New range descriptor loaded (%u) offStart=%llu cbDiscard=%zu\n",
                          pIoCtx->Req.Discard.idxRange, offStart, cbDiscardLeft));
             pIoCtx->Req.Discard.idxRange++;
+            vdCacheInvalidate(pDisk, offStart, cbDiscardLeft);
         }
 
         /* Look for a matching block in the AVL tree first. */
@@ -3545,7 +4150,9 @@ static DECLCALLBACK(int) vdPluginRegisterFilter(void *pvUser, PCVDFILTERBACKEND
 {
     int rc = VINF_SUCCESS;
 
-    if (pBackend->cbSize == sizeof(VDFILTERBACKEND))
+    /* Backends without the optional pfnFlush callback are still accepted. */
+    if (   pBackend->cbSize == sizeof(VDFILTERBACKEND)
+        || pBackend->cbSize == RT_OFFSETOF(VDFILTERBACKEND, pfnFlush))
         vdAddFilterBackend((RTLDRMOD)pvUser, pBackend);
     else
     {
@@ -5665,6 +6272,8 @@ VBOXDDU_DECL(int) VDInit(void)
     if (RT_SUCCESS(rc))
     {
         rc = vdAddCacheBackends(NIL_RTLDRMOD, aStaticCacheBackends, RT_ELEMENTS(aStaticCacheBackends));
+        if (RT_SUCCESS(rc))
+            rc = vdAddFilterBackends(NIL_RTLDRMOD, aStaticFilterBackends, RT_ELEMENTS(aStaticFilterBackends));
         if (RT_SUCCESS(rc))
         {
             RTListInit(&g_ListPluginsLoaded);
@@ -6682,7 +7291,12 @@ VBOXDDU_DECL(int) VDCacheOpen(PVBOXHDD pDisk, const char *pszBackend,
                                                                &UuidImage);
             if (RT_SUCCESS(rc))
             {
-                if (RTUuidCompare(&UuidImage, &UuidCache))
+                /* A freshly created cache is empty and gets bound to the image now. */
+                if (   RTUuidIsNull(&UuidCache)
+                    && !(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                    rc = pCache->Backend->pfnSetModificationUuid(pCache->pBackendData,
+                                                                 &UuidImage);
+                else if (RTUuidCompare(&UuidImage, &UuidCache))
                     rc = VERR_VD_CACHE_NOT_UP_TO_DATE;
             }
         }
@@ -8287,10 +8901,14 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
         else
             cImagesToReadBack = pDiskTo->cImages - nImageToSame - 1;
 
+        /* A freshly created base image reads as zeros, no need to write chunks containing only zeros. */
+        bool fSkipZeroChunks = pszFilename != NULL && cImagesTo == 0;
+
         /* Copy the data. */
         rc = vdCopyHelper(pDiskFrom, pImageFrom, pDiskTo, cbSize,
                           cImagesFromReadBack, cImagesToReadBack,
-                          fSuppressRedundantIo, pIfProgress, pDstIfProgress);
+                          fSuppressRedundantIo, fSkipZeroChunks,
+                          pIfProgress, pDstIfProgress);
 
         if (RT_SUCCESS(rc))
         {
@@ -10777,7 +11395,7 @@ VBOXDDU_DECL(int) VDAsyncRead(PVBOXHDD pDisk, uint64_t uOffset, size_t cbRead,
                                   cbRead, pDisk->pLast, pcSgBuf,
                                   pfnComplete, pvUser1, pvUser2,
                                   NULL, vdReadHelperAsync,
-                                  VDIOCTX_FLAGS_ZERO_FREE_BLOCKS);
+                                  VDIOCTX_FLAGS_ZERO_FREE_BLOCKS | VDIOCTX_FLAGS_READ_UPDATE_CACHE);
         if (!pIoCtx)
         {
             rc = VERR_NO_MEMORY;
@@ -10818,6 +11436,8 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
     int rc2;
     bool fLockWrite = false;
     PVDIOCTX pIoCtx = NULL;
+    RTSGBUF SgBufFilter;
+    void *pvFilterBuf = NULL;
 
     LogFlowFunc(("pDisk=%#p uOffset=%llu cSgBuf=%#p cbWrite=%zu pvUser1=%#p pvUser2=%#p\n",
                  pDisk, uOffset, pcSgBuf, cbWrite, pvUser1, pvUser2));
@@ -10845,13 +11465,27 @@ VBOXDDU_DECL(int) VDAsyncWrite(PVBOXHDD pDisk, uint64_t uOffset, size_t cbWrite,
                            rc = VERR_INVALID_PARAMETER);
         AssertPtrBreakStmt(pDisk->pLast, rc = VERR_VD_NOT_OPENED);
 
+        /* The write filters work on a private copy, the caller's buffer may be guest memory. */
+        if (!RTListIsEmpty(&pDisk->ListFilterChainWrite))
+        {
+            pvFilterBuf = vdFilterChainWriteBufDup(pcSgBuf, cbWrite, &SgBufFilter);
+            if (!pvFilterBuf)
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
+            pcSgBuf = &SgBufFilter;
+        }
+
+        /* The copy is freed together with the I/O context. */
         pIoCtx = vdIoCtxRootAlloc(pDisk, VDIOCTXTXDIR_WRITE, uOffset,
                                   cbWrite, pDisk->pLast, pcSgBuf,
                                   pfnComplete, pvUser1, pvUser2,
-                                  NULL, vdWriteHelperAsync,
+                                  pvFilterBuf, vdWriteHelperAsync,
                                   VDIOCTX_FLAGS_DEFAULT);
         if (!pIoCtx)
         {
+            RTMemFree(pvFilterBuf);
             rc = VERR_NO_MEMORY;
             break;
         }
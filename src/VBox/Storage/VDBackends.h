@@ -38,6 +38,8 @@ extern const VBOXHDDBACKEND g_VhdxBackend;
 
 extern const VDCACHEBACKEND g_VciCacheBackend;
 
+extern const VDFILTERBACKEND g_VDFilterDedup;
+
 RT_C_DECLS_END
 
 #endif
@@ -0,0 +1,1143 @@
+/* $Id$ */
+/** @file
+ * VDFilterDedup - Content addressed block deduplication filter.
+ */
+
+/*
+ * Copyright (C) 2015 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*
+ * The filter hashes every full block written to the disk and stores the content
+ * in a host wide content store, a directory with one file per unique block named
+ * after the SHA-256 digest of the content. The block written to the image is
+ * replaced with zeros so the image backend does not allocate space for it
+ * (unless VD_OPEN_FLAGS_HONOR_ZEROES is set). Reads of such blocks are satisfied
+ * from the content store.
+ *
+ * A per disk map file records which blocks live in the content store. Partial
+ * writes to a block in the store are passed through to the image and tracked in
+ * a per block sector bitmap, these sectors are taken from the image on reads.
+ * Blocks in the content store are shared between all disks using the same store
+ * directory, VDDedupStoreCompact() removes content no map references anymore.
+ *
+ * Map updates are made persistent when the disk is flushed (dedupFlush), before
+ * the images are flushed. Every open filter instance keeps a file in the store
+ * locked so compacting the store can refuse to run while a VM uses it.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_VD
+#include <VBox/vd-plugin.h>
+#include <VBox/err.h>
+
+#include <VBox/log.h>
+#include <iprt/assert.h>
+#include <iprt/asm.h>
+#include <iprt/avl.h>
+#include <iprt/dir.h>
+#include <iprt/file.h>
+#include <iprt/mem.h>
+#include <iprt/path.h>
+#include <iprt/process.h>
+#include <iprt/sg.h>
+#include <iprt/sha.h>
+#include <iprt/string.h>
+#include <iprt/uuid.h>
+
+#include "VDBackends.h"
+
+
+/*********************************************************************************************************************************
+*   Constants And Macros, Structures and Typedefs                                                                                *
+*********************************************************************************************************************************/
+
+/** The magic of the map file header. */
+#define DEDUP_MAP_MAGIC            UINT32_C(0x50444456) /* VDDP */
+/** Current version of the map file. */
+#define DEDUP_MAP_VERSION          UINT32_C(0x00000001)
+/** Default block size. */
+#define DEDUP_BLOCK_SIZE_DEFAULT   _1M
+/** Entry flag: Block lives in the content store. */
+#define DEDUP_MAP_ENTRY_F_VALID    RT_BIT_32(0)
+/** Name of the file in the content store locked while compacting it. */
+#define DEDUP_STORE_COMPACT_LOCK   ".compact"
+/** Prefix of the files in the content store locked by open filter instances. */
+#define DEDUP_STORE_INUSE_PREFIX   ".inuse-"
+
+/**
+ * Map file header, all entries are stored in little endian order.
+ */
+#pragma pack(1)
+typedef struct DedupMapHdr
+{
+    /** Magic identifying the map. */
+    uint32_t    u32Magic;
+    /** Version of the map. */
+    uint32_t    u32Version;
+    /** Size of a deduplicated block in bytes. */
+    uint32_t    cbBlock;
+    /** Size of a map entry including the sector bitmap in bytes. */
+    uint32_t    cbEntry;
+    /** Reserved for future use. */
+    uint8_t     abReserved[496];
+} DedupMapHdr;
+#pragma pack()
+AssertCompileSize(DedupMapHdr, 512);
+
+/**
+ * Map file entry, followed by the bitmap of sectors which were written
+ * to the image after the block was put into the content store.
+ */
+#pragma pack(1)
+typedef struct DedupMapEntry
+{
+    /** SHA-256 digest of the block content. */
+    uint8_t     abHash[RTSHA256_HASH_SIZE];
+    /** Flags, DEDUP_MAP_ENTRY_F_*. */
+    uint32_t    fFlags;
+    /** Reserved. */
+    uint32_t    u32Reserved;
+} DedupMapEntry;
+#pragma pack()
+AssertCompileSize(DedupMapEntry, 40);
+
+/**
+ * In memory state of a block living in the content store.
+ */
+typedef struct DEDUPBLOCK
+{
+    /** AVL tree node, the key is the block index. */
+    AVLRU64NODECORE  Core;
+    /** SHA-256 digest of the content. */
+    uint8_t         abHash[RTSHA256_HASH_SIZE];
+    /** Number of sectors marked in the bitmap. */
+    uint32_t        cSectorsDirty;
+    /** Bitmap of sectors which need to be taken from the image - variable size. */
+    uint8_t         abBitmap[1];
+} DEDUPBLOCK, *PDEDUPBLOCK;
+
+/**
+ * Dedup filter instance data.
+ */
+typedef struct DEDUPFILTER
+{
+    /** Pointer to the per-disk VD interface list. */
+    PVDINTERFACE        pVDIfsDisk;
+    /** Pointer to the per-filter VD interface list. */
+    PVDINTERFACE        pVDIfsFilter;
+    /** Error interface. */
+    PVDINTERFACEERROR   pIfError;
+    /** Internal I/O interface. */
+    PVDINTERFACEIOINT   pIfIo;
+    /** Flag whether the filter was opened for information retrieval only. */
+    bool                fInfo;
+    /** Path of the content store directory. */
+    char               *pszStorePath;
+    /** Path of the map file. */
+    char               *pszMapPath;
+    /** Handle of the map file. */
+    RTFILE              hFileMap;
+    /** Flag whether the map file was written since the last flush. */
+    bool                fMapDirty;
+    /** Path of the file announcing that this instance uses the content store. */
+    char               *pszInUsePath;
+    /** Handle of the in use file, locked while the filter is open. */
+    RTFILE              hFileInUse;
+    /** Block size in bytes. */
+    uint32_t            cbBlock;
+    /** Number of sectors in a block. */
+    uint32_t            cSectorsBlock;
+    /** Size of a map entry including the bitmap. */
+    uint32_t            cbEntry;
+    /** Blocks living in the content store. */
+    AVLRU64TREE          TreeBlocks;
+    /** Scratch buffer of one block. */
+    uint8_t            *pbScratch;
+    /** Digest of the content in the scratch buffer if fScratchValid is true. */
+    uint8_t             abHashScratch[RTSHA256_HASH_SIZE];
+    /** Flag whether the scratch buffer holds the content of abHashScratch. */
+    bool                fScratchValid;
+    /** Buffer for writing a single map entry. */
+    uint8_t            *pbEntry;
+    /** Number of writes which found the content already in the store. */
+    uint64_t            cDedupHits;
+    /** Number of blocks added to the content store. */
+    uint64_t            cBlocksStored;
+} DEDUPFILTER, *PDEDUPFILTER;
+
+
+/*********************************************************************************************************************************
+*   Static Variables                                                                                                             *
+*********************************************************************************************************************************/
+
+/** Default block size as a string. */
+static const char *s_pszDedupConfigDefaultBlockSize = "1048576";
+
+/** Supported config keys. */
+static const VDCONFIGINFO s_aDedupConfigInfo[] =
+{
+    { "StorePath",  NULL,                              VDCFGVALUETYPE_STRING,  VD_CFGKEY_MANDATORY },
+    { "MapPath",    NULL,                              VDCFGVALUETYPE_STRING,  VD_CFGKEY_MANDATORY },
+    { "BlockSize",  s_pszDedupConfigDefaultBlockSize,  VDCFGVALUETYPE_INTEGER, VD_CFGKEY_EXPERT },
+    { NULL,         NULL,                              VDCFGVALUETYPE_INTEGER, 0 }
+};
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+
+static DECLCALLBACK(int) dedupDestroy(void *pvBackendData);
+
+/**
+ * Returns the path of the content store file for the given digest.
+ *
+ * @returns VBox status code.
+ * @param   pszStorePath    The content store directory.
+ * @param   pabHash         The SHA-256 digest of the content.
+ * @param   pszPath         Where to store the path.
+ * @param   cbPath          Size of the path buffer.
+ */
+static int dedupStoreGetPath(const char *pszStorePath, const uint8_t *pabHash, char *pszPath, size_t cbPath)
+{
+    char szDigest[RTSHA256_DIGEST_LEN + 1];
+
+    int rc = RTSha256ToString(pabHash, szDigest, sizeof(szDigest));
+    if (RT_SUCCESS(rc))
+    {
+        rc = RTStrCopy(pszPath, cbPath, pszStorePath);
+        if (RT_SUCCESS(rc))
+            rc = RTPathAppend(pszPath, cbPath, szDigest);
+    }
+
+    return rc;
+}
+
+/**
+ * Adds the given block content to the content store if it is not there already.
+ *
+ * The content is written to a temporary file first and renamed afterwards, so
+ * the store never contains partially written blocks even if several processes
+ * add the same content concurrently.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ * @param   pvBlock         The block content.
+ * @param   pabHash         The SHA-256 digest of the content.
+ */
+static int dedupStoreAdd(PDEDUPFILTER pThis, const void *pvBlock, const uint8_t *pabHash)
+{
+    char szPath[RTPATH_MAX];
+    int rc = dedupStoreGetPath(pThis->pszStorePath, pabHash, szPath, sizeof(szPath));
+    if (RT_FAILURE(rc))
+        return rc;
+
+    if (RTFileExists(szPath))
+    {
+        pThis->cDedupHits++;
+        return VINF_SUCCESS;
+    }
+
+    char szPathTmp[RTPATH_MAX];
+    RTStrPrintf(szPathTmp, sizeof(szPathTmp), "%s.tmp-%u", szPath, RTProcSelf());
+
+    RTFILE hFile = NIL_RTFILE;
+    rc = RTFileOpen(&hFile, szPathTmp, RTFILE_O_WRITE | RTFILE_O_CREATE_REPLACE | RTFILE_O_DENY_NONE);
+    if (RT_SUCCESS(rc))
+    {
+        rc = RTFileWrite(hFile, pvBlock, pThis->cbBlock, NULL);
+        if (RT_SUCCESS(rc))
+            rc = RTFileFlush(hFile);
+        RTFileClose(hFile);
+
+        if (RT_SUCCESS(rc))
+        {
+            rc = RTFileRename(szPathTmp, szPath, 0 /* fRename */);
+            if (rc == VERR_ALREADY_EXISTS)
+            {
+                /* Someone else added the same content in the meantime. */
+                RTFileDelete(szPathTmp);
+                pThis->cDedupHits++;
+                rc = VINF_SUCCESS;
+            }
+            else if (RT_SUCCESS(rc))
+                pThis->cBlocksStored++;
+        }
+
+        if (RT_FAILURE(rc))
+            RTFileDelete(szPathTmp);
+    }
+
+    return rc;
+}
+
+/**
+ * Reads the content of the given block from the content store into the scratch buffer.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ * @param   pabHash         The SHA-256 digest of the content.
+ */
+static int dedupStoreRead(PDEDUPFILTER pThis, const uint8_t *pabHash)
+{
+    if (   pThis->fScratchValid
+        && !memcmp(pThis->abHashScratch, pabHash, RTSHA256_HASH_SIZE))
+        return VINF_SUCCESS;
+
+    char szPath[RTPATH_MAX];
+    int rc = dedupStoreGetPath(pThis->pszStorePath, pabHash, szPath, sizeof(szPath));
+    if (RT_SUCCESS(rc))
+    {
+        RTFILE hFile = NIL_RTFILE;
+
+        pThis->fScratchValid = false;
+        rc = RTFileOpen(&hFile, szPath, RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_NONE);
+        if (RT_SUCCESS(rc))
+        {
+            rc = RTFileRead(hFile, pThis->pbScratch, pThis->cbBlock, NULL);
+            RTFileClose(hFile);
+            if (RT_SUCCESS(rc))
+            {
+                memcpy(pThis->abHashScratch, pabHash, RTSHA256_HASH_SIZE);
+                pThis->fScratchValid = true;
+            }
+        }
+    }
+
+    if (RT_FAILURE(rc))
+        LogRel(("VD/Dedup: Reading block content from '%s' failed with %Rrc\n", pThis->pszStorePath, rc));
+    return rc;
+}
+
+/**
+ * Writes the map entry for the given block index to the map file.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ * @param   idxBlock        The block index.
+ * @param   pBlock          The block state, NULL to clear the entry.
+ */
+static int dedupMapWriteEntry(PDEDUPFILTER pThis, uint64_t idxBlock, PDEDUPBLOCK pBlock)
+{
+    DedupMapEntry *pEntry = (DedupMapEntry *)pThis->pbEntry;
+
+    memset(pThis->pbEntry, 0, pThis->cbEntry);
+    if (pBlock)
+    {
+        memcpy(pEntry->abHash, pBlock->abHash, RTSHA256_HASH_SIZE);
+        pEntry->fFlags = RT_H2LE_U32(DEDUP_MAP_ENTRY_F_VALID);
+        memcpy(pEntry + 1, pBlock->abBitmap, pThis->cSectorsBlock / 8);
+    }
+
+    /* Made persistent with the next flush of the disk, before the images are flushed. */
+    int rc = RTFileWriteAt(pThis->hFileMap, sizeof(DedupMapHdr) + idxBlock * pThis->cbEntry,
+                           pThis->pbEntry, pThis->cbEntry, NULL);
+    if (RT_SUCCESS(rc))
+        pThis->fMapDirty = true;
+
+    return rc;
+}
+
+/**
+ * Announces that the filter instance uses the content store.
+ *
+ * Every instance keeps its own file in the store locked, a single shared file
+ * would lose the lock on some hosts as soon as any other instance in the same
+ * process closes it. VDDedupStoreCompact() refuses to run while any of these
+ * files is locked. It holds the compaction lock itself, which is checked here
+ * only after announcing the instance, so either side sees the other.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ */
+static int dedupStoreLockInUse(PDEDUPFILTER pThis)
+{
+    RTUUID Uuid;
+    char szUuid[RTUUID_STR_LENGTH];
+    char szName[64];
+
+    int rc = RTUuidCreate(&Uuid);
+    if (RT_SUCCESS(rc))
+        rc = RTUuidToStr(&Uuid, szUuid, sizeof(szUuid));
+    if (RT_FAILURE(rc))
+        return rc;
+
+    RTStrPrintf(szName, sizeof(szName), DEDUP_STORE_INUSE_PREFIX "%s", szUuid);
+    pThis->pszInUsePath = RTPathJoinA(pThis->pszStorePath, szName);
+    if (!pThis->pszInUsePath)
+        return VERR_NO_STR_MEMORY;
+
+    rc = RTFileOpen(&pThis->hFileInUse, pThis->pszInUsePath,
+                    RTFILE_O_READWRITE | RTFILE_O_CREATE | RTFILE_O_DENY_NONE);
+    if (RT_SUCCESS(rc))
+        rc = RTFileLock(pThis->hFileInUse, RTFILE_LOCK_WRITE | RTFILE_LOCK_IMMEDIATELY, 0, 1);
+    if (RT_SUCCESS(rc))
+    {
+        char szPath[RTPATH_MAX];
+        RTFILE hFileCompact = NIL_RTFILE;
+
+        rc = RTPathJoin(szPath, sizeof(szPath), pThis->pszStorePath, DEDUP_STORE_COMPACT_LOCK);
+        if (RT_SUCCESS(rc))
+            rc = RTFileOpen(&hFileCompact, szPath, RTFILE_O_READWRITE | RTFILE_O_OPEN_CREATE | RTFILE_O_DENY_NONE);
+        if (RT_SUCCESS(rc))
+        {
+            rc = RTFileLock(hFileCompact, RTFILE_LOCK_READ | RTFILE_LOCK_IMMEDIATELY, 0, 1);
+            if (RT_SUCCESS(rc))
+                RTFileUnlock(hFileCompact, 0, 1);
+            RTFileClose(hFileCompact);
+        }
+    }
+
+    if (rc == VERR_FILE_LOCK_VIOLATION)
+        return vdIfError(pThis->pIfError, rc, RT_SRC_POS,
+                         N_("Dedup: content store '%s' is being compacted"), pThis->pszStorePath);
+    if (RT_FAILURE(rc))
+        return vdIfError(pThis->pIfError, rc, RT_SRC_POS,
+                         N_("Dedup: cannot lock content store '%s'"), pThis->pszStorePath);
+    return rc;
+}
+
+/**
+ * Releases the lock taken by dedupStoreLockInUse() and removes the file.
+ *
+ * @returns nothing.
+ * @param   pThis           The filter instance.
+ */
+static void dedupStoreUnlockInUse(PDEDUPFILTER pThis)
+{
+    if (pThis->hFileInUse != NIL_RTFILE)
+    {
+        RTFileClose(pThis->hFileInUse);
+        pThis->hFileInUse = NIL_RTFILE;
+        RTFileDelete(pThis->pszInUsePath);
+    }
+    if (pThis->pszInUsePath)
+    {
+        RTStrFree(pThis->pszInUsePath);
+        pThis->pszInUsePath = NULL;
+    }
+}
+
+/**
+ * Creates the in memory state for a block living in the content store.
+ *
+ * @returns Pointer to the block state or NULL if out of memory.
+ * @param   pThis           The filter instance.
+ * @param   idxBlock        The block index.
+ * @param   pabHash         The SHA-256 digest of the content.
+ */
+static PDEDUPBLOCK dedupBlockAlloc(PDEDUPFILTER pThis, uint64_t idxBlock, const uint8_t *pabHash)
+{
+    PDEDUPBLOCK pBlock = (PDEDUPBLOCK)RTMemAllocZ(RT_OFFSETOF(DEDUPBLOCK, abBitmap[pThis->cSectorsBlock / 8]));
+    if (pBlock)
+    {
+        pBlock->Core.Key     = idxBlock;
+        pBlock->Core.KeyLast = idxBlock;
+        memcpy(pBlock->abHash, pabHash, RTSHA256_HASH_SIZE);
+    }
+
+    return pBlock;
+}
+
+/**
+ * Removes the given block from the map because the image holds the complete content now.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ * @param   pBlock          The block to remove.
+ */
+static int dedupBlockUnmap(PDEDUPFILTER pThis, PDEDUPBLOCK pBlock)
+{
+    int rc = dedupMapWriteEntry(pThis, pBlock->Core.Key, NULL);
+    if (RT_SUCCESS(rc))
+    {
+        RTAvlrU64Remove(&pThis->TreeBlocks, pBlock->Core.Key);
+        RTMemFree(pBlock);
+    }
+
+    return rc;
+}
+
+/**
+ * Loads the map file or creates a new one.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ */
+static int dedupMapLoad(PDEDUPFILTER pThis)
+{
+    DedupMapHdr Hdr;
+    uint64_t cbMap = 0;
+    uint32_t fOpen = pThis->fInfo
+                   ? RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_NONE
+                   : RTFILE_O_READWRITE | RTFILE_O_OPEN_CREATE | RTFILE_O_DENY_WRITE;
+
+    int rc = RTFileOpen(&pThis->hFileMap, pThis->pszMapPath, fOpen);
+    if (RT_FAILURE(rc))
+        return vdIfError(pThis->pIfError, rc, RT_SRC_POS,
+                         N_("Dedup: cannot open map file '%s'"), pThis->pszMapPath);
+
+    rc = RTFileGetSize(pThis->hFileMap, &cbMap);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    if (!cbMap)
+    {
+        if (pThis->fInfo)
+            return VINF_SUCCESS;
+
+        /* New map, write the header. */
+        memset(&Hdr, 0, sizeof(Hdr));
+        Hdr.u32Magic   = RT_H2LE_U32(DEDUP_MAP_MAGIC);
+        Hdr.u32Version = RT_H2LE_U32(DEDUP_MAP_VERSION);
+        Hdr.cbBlock    = RT_H2LE_U32(pThis->cbBlock);
+        Hdr.cbEntry    = RT_H2LE_U32(pThis->cbEntry);
+        rc = RTFileWriteAt(pThis->hFileMap, 0, &Hdr, sizeof(Hdr), NULL);
+        if (RT_SUCCESS(rc))
+            rc = RTFileFlush(pThis->hFileMap);
+        return rc;
+    }
+
+    rc = RTFileReadAt(pThis->hFileMap, 0, &Hdr, sizeof(Hdr), NULL);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    if (   RT_LE2H_U32(Hdr.u32Magic) != DEDUP_MAP_MAGIC
+        || RT_LE2H_U32(Hdr.u32Version) != DEDUP_MAP_VERSION
+        || RT_LE2H_U32(Hdr.cbEntry) != pThis->cbEntry
+        || RT_LE2H_U32(Hdr.cbBlock) != pThis->cbBlock)
+        return vdIfError(pThis->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         N_("Dedup: map file '%s' is invalid or uses a different block size"), pThis->pszMapPath);
+
+    uint64_t cEntries = (cbMap - sizeof(Hdr)) / pThis->cbEntry;
+    for (uint64_t idxBlock = 0; idxBlock < cEntries && RT_SUCCESS(rc); idxBlock++)
+    {
+        DedupMapEntry *pEntry = (DedupMapEntry *)pThis->pbEntry;
+
+        rc = RTFileReadAt(pThis->hFileMap, sizeof(Hdr) + idxBlock * pThis->cbEntry,
+                          pThis->pbEntry, pThis->cbEntry, NULL);
+        if (   RT_SUCCESS(rc)
+            && (RT_LE2H_U32(pEntry->fFlags) & DEDUP_MAP_ENTRY_F_VALID))
+        {
+            PDEDUPBLOCK pBlock = dedupBlockAlloc(pThis, idxBlock, pEntry->abHash);
+            if (pBlock)
+            {
+                memcpy(pBlock->abBitmap, pEntry + 1, pThis->cSectorsBlock / 8);
+                for (uint32_t iSector = 0; iSector < pThis->cSectorsBlock; iSector++)
+                    if (ASMBitTest(pBlock->abBitmap, iSector))
+                        pBlock->cSectorsDirty++;
+                RTAvlrU64Insert(&pThis->TreeBlocks, &pBlock->Core);
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Creates a segment array describing the data of the given I/O context and
+ * initializes a S/G buffer with it.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The filter instance.
+ * @param   pIoCtx          The I/O context.
+ * @param   cbData          Amount of data in the context.
+ * @param   pSgBuf          The S/G buffer to initialize.
+ * @param   ppaSeg          Where to store the segment array, free with RTMemTmpFree().
+ */
+static int dedupIoCtxSgBufCreate(PDEDUPFILTER pThis, PVDIOCTX pIoCtx, size_t cbData,
+                                 PRTSGBUF pSgBuf, PRTSGSEG *ppaSeg)
+{
+    unsigned cSegs = 0;
+
+    vdIfIoIntIoCtxSegArrayCreate(pThis->pIfIo, pIoCtx, NULL, &cSegs, cbData);
+    PRTSGSEG paSeg = (PRTSGSEG)RTMemTmpAllocZ(cSegs * sizeof(RTSGSEG));
+    if (!paSeg)
+        return VERR_NO_MEMORY;
+
+    vdIfIoIntIoCtxSegArrayCreate(pThis->pIfIo, pIoCtx, paSeg, &cSegs, cbData);
+    RTSgBufInit(pSgBuf, paSeg, cSegs);
+    *ppaSeg = paSeg;
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDFILTERBACKEND::pfnCreate */
+static DECLCALLBACK(int) dedupCreate(PVDINTERFACE pVDIfsDisk, uint32_t fFlags,
+                                     PVDINTERFACE pVDIfsFilter, void **ppvBackendData)
+{
+    int rc = VINF_SUCCESS;
+    PVDINTERFACECONFIG pIfCfg = VDIfConfigGet(pVDIfsFilter);
+    AssertPtrReturn(pIfCfg, VERR_INVALID_PARAMETER);
+
+    PDEDUPFILTER pThis = (PDEDUPFILTER)RTMemAllocZ(sizeof(DEDUPFILTER));
+    if (!pThis)
+        return VERR_NO_MEMORY;
+
+    pThis->pVDIfsDisk   = pVDIfsDisk;
+    pThis->pVDIfsFilter = pVDIfsFilter;
+    pThis->pIfError     = VDIfErrorGet(pVDIfsDisk);
+    pThis->pIfIo        = VDIfIoIntGet(pVDIfsFilter);
+    pThis->fInfo        = RT_BOOL(fFlags & VD_FILTER_FLAGS_INFO);
+    pThis->hFileMap     = NIL_RTFILE;
+    pThis->hFileInUse   = NIL_RTFILE;
+    pThis->TreeBlocks   = NULL;
+    AssertPtr(pThis->pIfIo);
+
+    do
+    {
+        rc = VDCFGQueryStringAlloc(pIfCfg, "StorePath", &pThis->pszStorePath);
+        if (RT_SUCCESS(rc))
+            rc = VDCFGQueryStringAlloc(pIfCfg, "MapPath", &pThis->pszMapPath);
+        if (RT_FAILURE(rc))
+        {
+            rc = vdIfError(pThis->pIfError, rc, RT_SRC_POS, N_("Dedup: configuration error: StorePath and MapPath are mandatory"));
+            break;
+        }
+
+        rc = VDCFGQueryU32Def(pIfCfg, "BlockSize", &pThis->cbBlock, DEDUP_BLOCK_SIZE_DEFAULT);
+        if (   RT_FAILURE(rc)
+            || pThis->cbBlock < _4K
+            || pThis->cbBlock > 64 * _1M
+            || !RT_IS_POWER_OF_TWO(pThis->cbBlock))
+        {
+            rc = vdIfError(pThis->pIfError, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                           N_("Dedup: configuration error: BlockSize must be a power of two between 4K and 64M"));
+            break;
+        }
+
+        pThis->cSectorsBlock = pThis->cbBlock / 512;
+        pThis->cbEntry       = RT_ALIGN_32(sizeof(DedupMapEntry) + pThis->cSectorsBlock / 8, 8);
+        pThis->pbScratch     = (uint8_t *)RTMemPageAlloc(pThis->cbBlock);
+        pThis->pbEntry       = (uint8_t *)RTMemAllocZ(pThis->cbEntry);
+        if (!pThis->pbScratch || !pThis->pbEntry)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        if (!pThis->fInfo && !RTDirExists(pThis->pszStorePath))
+        {
+            rc = RTDirCreateFullPath(pThis->pszStorePath, 0700);
+            if (RT_FAILURE(rc))
+            {
+                rc = vdIfError(pThis->pIfError, rc, RT_SRC_POS,
+                               N_("Dedup: cannot create content store '%s'"), pThis->pszStorePath);
+                break;
+            }
+        }
+
+        if (!pThis->fInfo)
+        {
+            rc = dedupStoreLockInUse(pThis);
+            if (RT_FAILURE(rc))
+                break;
+        }
+
+        rc = dedupMapLoad(pThis);
+    } while (0);
+
+    if (RT_SUCCESS(rc))
+        *ppvBackendData = pThis;
+    else
+        dedupDestroy(pThis);
+
+    return rc;
+}
+
+/**
+ * Frees a block state, callback for RTAvlrU64Destroy().
+ */
+static DECLCALLBACK(int) dedupBlockDestroy(PAVLRU64NODECORE pNode, void *pvUser)
+{
+    NOREF(pvUser);
+    RTMemFree(pNode);
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDFILTERBACKEND::pfnDestroy */
+static DECLCALLBACK(int) dedupDestroy(void *pvBackendData)
+{
+    PDEDUPFILTER pThis = (PDEDUPFILTER)pvBackendData;
+
+    if (pThis->cDedupHits || pThis->cBlocksStored)
+        LogRel(("VD/Dedup: %llu blocks added to the content store, %llu writes deduplicated\n",
+                pThis->cBlocksStored, pThis->cDedupHits));
+
+    if (pThis->hFileMap != NIL_RTFILE)
+    {
+        if (pThis->fMapDirty)
+            RTFileFlush(pThis->hFileMap);
+        RTFileClose(pThis->hFileMap);
+    }
+    dedupStoreUnlockInUse(pThis);
+    RTAvlrU64Destroy(&pThis->TreeBlocks, dedupBlockDestroy, NULL);
+    if (pThis->pbScratch)
+        RTMemPageFree(pThis->pbScratch, pThis->cbBlock);
+    if (pThis->pbEntry)
+        RTMemFree(pThis->pbEntry);
+    if (pThis->pszStorePath)
+        RTStrFree(pThis->pszStorePath);
+    if (pThis->pszMapPath)
+        RTStrFree(pThis->pszMapPath);
+    RTMemFree(pThis);
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDFILTERBACKEND::pfnFilterRead */
+static DECLCALLBACK(int) dedupFilterRead(void *pvBackendData, uint64_t uOffset, size_t cbRead,
+                                         PVDIOCTX pIoCtx)
+{
+    PDEDUPFILTER pThis = (PDEDUPFILTER)pvBackendData;
+    PRTSGSEG paSeg = NULL;
+    RTSGBUF SgBuf;
+
+    if (!pThis->TreeBlocks)
+        return VINF_SUCCESS;
+
+    int rc = dedupIoCtxSgBufCreate(pThis, pIoCtx, cbRead, &SgBuf, &paSeg);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    while (   cbRead
+           && RT_SUCCESS(rc))
+    {
+        uint64_t idxBlock   = uOffset / pThis->cbBlock;
+        uint32_t offBlock   = (uint32_t)(uOffset % pThis->cbBlock);
+        size_t   cbThisRead = RT_MIN(cbRead, pThis->cbBlock - offBlock);
+        PDEDUPBLOCK pBlock  = (PDEDUPBLOCK)RTAvlrU64Get(&pThis->TreeBlocks, idxBlock);
+
+        if (pBlock)
+        {
+            rc = dedupStoreRead(pThis, pBlock->abHash);
+            if (RT_SUCCESS(rc))
+            {
+                /* Take every sector not written since the block was put into the store from there. */
+                uint32_t iSector    = offBlock / 512;
+                uint32_t iSectorEnd = (uint32_t)((offBlock + cbThisRead) / 512);
+
+                while (iSector < iSectorEnd)
+                {
+                    bool fDirty = ASMBitTest(pBlock->abBitmap, iSector);
+                    uint32_t iSectorRunEnd = iSector + 1;
+
+                    while (   iSectorRunEnd < iSectorEnd
+                           && ASMBitTest(pBlock->abBitmap, iSectorRunEnd) == fDirty)
+                        iSectorRunEnd++;
+
+                    size_t cbRun = (iSectorRunEnd - iSector) * 512;
+                    if (fDirty)
+                        RTSgBufAdvance(&SgBuf, cbRun);
+                    else
+                        RTSgBufCopyFromBuf(&SgBuf, pThis->pbScratch + iSector * 512, cbRun);
+
+                    iSector = iSectorRunEnd;
+                }
+            }
+        }
+        else
+            RTSgBufAdvance(&SgBuf, cbThisRead);
+
+        uOffset += cbThisRead;
+        cbRead  -= cbThisRead;
+    }
+
+    RTMemTmpFree(paSeg);
+    return rc;
+}
+
+/** @copydoc VDFILTERBACKEND::pfnFilterWrite */
+static DECLCALLBACK(int) dedupFilterWrite(void *pvBackendData, uint64_t uOffset, size_t cbWrite,
+                                          PVDIOCTX pIoCtx)
+{
+    PDEDUPFILTER pThis = (PDEDUPFILTER)pvBackendData;
+    PRTSGSEG paSeg = NULL;
+    RTSGBUF SgBuf;
+
+    if (pThis->fInfo)
+        return VINF_SUCCESS;
+
+    int rc = dedupIoCtxSgBufCreate(pThis, pIoCtx, cbWrite, &SgBuf, &paSeg);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    while (   cbWrite
+           && RT_SUCCESS(rc))
+    {
+        uint64_t idxBlock    = uOffset / pThis->cbBlock;
+        uint32_t offBlock    = (uint32_t)(uOffset % pThis->cbBlock);
+        size_t   cbThisWrite = RT_MIN(cbWrite, pThis->cbBlock - offBlock);
+        PDEDUPBLOCK pBlock   = (PDEDUPBLOCK)RTAvlrU64Get(&pThis->TreeBlocks, idxBlock);
+
+        if (cbThisWrite == pThis->cbBlock)
+        {
+            RTSGBUF SgBufBlock;
+            uint8_t abHash[RTSHA256_HASH_SIZE];
+
+            RTSgBufClone(&SgBufBlock, &SgBuf);
+            RTSgBufCopyToBuf(&SgBufBlock, pThis->pbScratch, pThis->cbBlock);
+            pThis->fScratchValid = false;
+
+            if (ASMBitFirstSet(pThis->pbScratch, pThis->cbBlock * 8) == -1)
+            {
+                /* Zero blocks are left to the image backend. */
+                if (pBlock)
+                    rc = dedupBlockUnmap(pThis, pBlock);
+                RTSgBufAdvance(&SgBuf, cbThisWrite);
+            }
+            else
+            {
+                RTSha256(pThis->pbScratch, pThis->cbBlock, abHash);
+
+                int rc2 = dedupStoreAdd(pThis, pThis->pbScratch, abHash);
+                if (RT_SUCCESS(rc2))
+                {
+                    if (!pBlock)
+                    {
+                        pBlock = dedupBlockAlloc(pThis, idxBlock, abHash);
+                        if (pBlock)
+                            RTAvlrU64Insert(&pThis->TreeBlocks, &pBlock->Core);
+                    }
+                    else
+                    {
+                        memcpy(pBlock->abHash, abHash, sizeof(abHash));
+                        memset(pBlock->abBitmap, 0, pThis->cSectorsBlock / 8);
+                        pBlock->cSectorsDirty = 0;
+                    }
+
+                    if (pBlock)
+                        rc2 = dedupMapWriteEntry(pThis, idxBlock, pBlock);
+                    else
+                        rc2 = VERR_NO_MEMORY;
+                }
+
+                if (RT_SUCCESS(rc2))
+                {
+                    /*
+                     * The content lives in the store now, let the image see zeros. VD hands
+                     * write filters a private copy of the data, the caller's buffer (maybe
+                     * guest memory) is not touched.
+                     */
+                    memcpy(pThis->abHashScratch, abHash, sizeof(abHash));
+                    pThis->fScratchValid = true;
+                    RTSgBufSet(&SgBuf, 0, cbThisWrite);
+                }
+                else
+                {
+                    /* Pass the data through to the image and forget about the block. */
+                    LogRel(("VD/Dedup: Adding block %llu to the content store failed with %Rrc\n", idxBlock, rc2));
+                    pBlock = (PDEDUPBLOCK)RTAvlrU64Get(&pThis->TreeBlocks, idxBlock);
+                    if (pBlock)
+                        rc = dedupBlockUnmap(pThis, pBlock);
+                    RTSgBufAdvance(&SgBuf, cbThisWrite);
+                }
+            }
+        }
+        else
+        {
+            if (pBlock)
+            {
+                /* Partial write, remember which sectors are only in the image. */
+                uint32_t iSectorStart = offBlock / 512;
+                uint32_t iSectorEnd   = (uint32_t)((offBlock + cbThisWrite) / 512);
+
+                for (uint32_t iSector = iSectorStart; iSector < iSectorEnd; iSector++)
+                    if (!ASMBitTestAndSet(pBlock->abBitmap, iSector))
+                        pBlock->cSectorsDirty++;
+
+                if (pBlock->cSectorsDirty == pThis->cSectorsBlock)
+                    rc = dedupBlockUnmap(pThis, pBlock);
+                else
+                    rc = dedupMapWriteEntry(pThis, idxBlock, pBlock);
+            }
+
+            RTSgBufAdvance(&SgBuf, cbThisWrite);
+        }
+
+        uOffset += cbThisWrite;
+        cbWrite -= cbThisWrite;
+    }
+
+    RTMemTmpFree(paSeg);
+    return rc;
+}
+
+/** @copydoc VDFILTERBACKEND::pfnFlush */
+static DECLCALLBACK(int) dedupFlush(void *pvBackendData)
+{
+    PDEDUPFILTER pThis = (PDEDUPFILTER)pvBackendData;
+    int rc = VINF_SUCCESS;
+
+    /* The map entries must be persistent before the zeroed blocks in the image are. */
+    if (pThis->fMapDirty)
+    {
+        rc = RTFileFlush(pThis->hFileMap);
+        if (RT_SUCCESS(rc))
+            pThis->fMapDirty = false;
+    }
+
+    return rc;
+}
+
+/**
+ * Removes all content from a content store which is not referenced by any of the given maps.
+ *
+ * Fails with VERR_FILE_LOCK_VIOLATION if the store is in use by an open disk
+ * or compacted by someone else already.
+ *
+ * @returns VBox status code.
+ * @param   pszStorePath    The content store directory.
+ * @param   papszMaps       Array of map files referencing the store.
+ * @param   cMaps           Number of entries in the map array.
+ * @param   pcBlocksFreed   Where to store the number of blocks removed from the store, optional.
+ * @param   pcBlocksInUse   Where to store the number of blocks still referenced, optional.
+ */
+VBOXDDU_DECL(int) VDDedupStoreCompact(const char *pszStorePath, const char * const *papszMaps, unsigned cMaps,
+                                      uint64_t *pcBlocksFreed, uint64_t *pcBlocksInUse)
+{
+    AVLRU64TREE TreeRefs = NULL;   /* Referenced digests, keyed by the first 8 bytes with collisions chained. */
+    uint64_t cBlocksFreed = 0;
+    uint64_t cBlocksInUse = 0;
+    int rc = VINF_SUCCESS;
+
+    AssertPtrReturn(pszStorePath, VERR_INVALID_POINTER);
+    AssertReturn(!cMaps || VALID_PTR(papszMaps), VERR_INVALID_POINTER);
+
+    /*
+     * Lock out filter instances opening the store from now on, then make sure
+     * none has it open already. In use files of crashed VMs are not locked
+     * anymore and get removed. See dedupStoreLockInUse() for the other side.
+     */
+    char szPath[RTPATH_MAX];
+    RTFILE hFileCompact = NIL_RTFILE;
+
+    rc = RTPathJoin(szPath, sizeof(szPath), pszStorePath, DEDUP_STORE_COMPACT_LOCK);
+    if (RT_SUCCESS(rc))
+        rc = RTFileOpen(&hFileCompact, szPath, RTFILE_O_READWRITE | RTFILE_O_OPEN_CREATE | RTFILE_O_DENY_NONE);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = RTFileLock(hFileCompact, RTFILE_LOCK_WRITE | RTFILE_LOCK_IMMEDIATELY, 0, 1);
+    if (RT_SUCCESS(rc))
+    {
+        PRTDIR pDir = NULL;
+
+        rc = RTDirOpen(&pDir, pszStorePath);
+        if (RT_SUCCESS(rc))
+        {
+            RTDIRENTRY DirEntry;
+
+            while (   RT_SUCCESS(rc)
+                   && RT_SUCCESS(RTDirRead(pDir, &DirEntry, NULL)))
+            {
+                if (strncmp(DirEntry.szName, DEDUP_STORE_INUSE_PREFIX, sizeof(DEDUP_STORE_INUSE_PREFIX) - 1))
+                    continue;
+
+                RTFILE hFileInUse = NIL_RTFILE;
+                rc = RTPathJoin(szPath, sizeof(szPath), pszStorePath, DirEntry.szName);
+                if (RT_SUCCESS(rc))
+                    rc = RTFileOpen(&hFileInUse, szPath, RTFILE_O_READWRITE | RTFILE_O_OPEN | RTFILE_O_DENY_NONE);
+                if (RT_SUCCESS(rc))
+                {
+                    rc = RTFileLock(hFileInUse, RTFILE_LOCK_WRITE | RTFILE_LOCK_IMMEDIATELY, 0, 1);
+                    RTFileClose(hFileInUse);
+                    if (RT_SUCCESS(rc))
+                        RTFileDelete(szPath);
+                    else
+                        LogRel(("VD/Dedup: Content store '%s' is in use, '%s' is locked\n", pszStorePath, szPath));
+                }
+                else if (rc == VERR_FILE_NOT_FOUND) /* The instance just went away. */
+                    rc = VINF_SUCCESS;
+            }
+
+            RTDirClose(pDir);
+        }
+    }
+
+    if (RT_FAILURE(rc))
+    {
+        RTFileClose(hFileCompact);
+        LogFlowFunc(("returns %Rrc\n", rc));
+        return rc;
+    }
+
+    /*
+     * Collect the reference counts of all digests referenced by the maps.
+     */
+    typedef struct DEDUPREF
+    {
+        AVLRU64NODECORE   Core;
+        struct DEDUPREF *pNext;
+        uint8_t          abHash[RTSHA256_HASH_SIZE];
+        uint32_t         cRefs;
+    } DEDUPREF, *PDEDUPREF;
+
+    for (unsigned iMap = 0; iMap < cMaps && RT_SUCCESS(rc); iMap++)
+    {
+        RTFILE hFile = NIL_RTFILE;
+        DedupMapHdr Hdr;
+        uint64_t cbMap = 0;
+
+        rc = RTFileOpen(&hFile, papszMaps[iMap], RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_NONE);
+        if (RT_FAILURE(rc))
+            break;
+
+        rc = RTFileGetSize(hFile, &cbMap);
+        if (RT_SUCCESS(rc))
+            rc = RTFileReadAt(hFile, 0, &Hdr, sizeof(Hdr), NULL);
+        if (   RT_SUCCESS(rc)
+            && (   RT_LE2H_U32(Hdr.u32Magic) != DEDUP_MAP_MAGIC
+                || RT_LE2H_U32(Hdr.u32Version) != DEDUP_MAP_VERSION
+                || RT_LE2H_U32(Hdr.cbEntry) < sizeof(DedupMapEntry)))
+            rc = VERR_VD_GEN_INVALID_HEADER;
+
+        if (RT_SUCCESS(rc))
+        {
+            uint32_t cbEntry = RT_LE2H_U32(Hdr.cbEntry);
+            uint64_t cEntries = (cbMap - sizeof(Hdr)) / cbEntry;
+
+            for (uint64_t idx = 0; idx < cEntries && RT_SUCCESS(rc); idx++)
+            {
+                DedupMapEntry Entry;
+
+                rc = RTFileReadAt(hFile, sizeof(Hdr) + idx * cbEntry, &Entry, sizeof(Entry), NULL);
+                if (   RT_FAILURE(rc)
+                    || !(RT_LE2H_U32(Entry.fFlags) & DEDUP_MAP_ENTRY_F_VALID))
+                    continue;
+
+                uint64_t uKey = RT_MAKE_U64_FROM_U8(Entry.abHash[0], Entry.abHash[1], Entry.abHash[2], Entry.abHash[3],
+                                                    Entry.abHash[4], Entry.abHash[5], Entry.abHash[6], Entry.abHash[7]);
+                PDEDUPREF pRefHead = (PDEDUPREF)RTAvlrU64Get(&TreeRefs, uKey);
+                PDEDUPREF pRef = pRefHead;
+                while (pRef && memcmp(pRef->abHash, Entry.abHash, RTSHA256_HASH_SIZE))
+                    pRef = pRef->pNext;
+
+                if (!pRef)
+                {
+                    pRef = (PDEDUPREF)RTMemAllocZ(sizeof(DEDUPREF));
+                    if (!pRef)
+                    {
+                        rc = VERR_NO_MEMORY;
+                        break;
+                    }
+                    memcpy(pRef->abHash, Entry.abHash, RTSHA256_HASH_SIZE);
+                    if (pRefHead)
+                    {
+                        pRef->pNext = pRefHead->pNext;
+                        pRefHead->pNext = pRef;
+                    }
+                    else
+                    {
+                        pRef->Core.Key     = uKey;
+                        pRef->Core.KeyLast = uKey;
+                        RTAvlrU64Insert(&TreeRefs, &pRef->Core);
+                    }
+                }
+                pRef->cRefs++;
+            }
+        }
+
+        RTFileClose(hFile);
+    }
+
+    /*
+     * Walk the store and delete everything not referenced.
+     */
+    if (RT_SUCCESS(rc))
+    {
+        PRTDIR pDir = NULL;
+
+        rc = RTDirOpen(&pDir, pszStorePath);
+        if (RT_SUCCESS(rc))
+        {
+            RTDIRENTRY DirEntry;
+
+            while (RT_SUCCESS(RTDirRead(pDir, &DirEntry, NULL)))
+            {
+                uint8_t abHash[RTSHA256_HASH_SIZE];
+
+                if (   DirEntry.cbName != RTSHA256_DIGEST_LEN
+                    || RT_FAILURE(RTSha256FromString(DirEntry.szName, abHash)))
+                    continue; /* Not ours, or a temporary file of a running VM. */
+
+                uint64_t uKey = RT_MAKE_U64_FROM_U8(abHash[0], abHash[1], abHash[2], abHash[3],
+                                                    abHash[4], abHash[5], abHash[6], abHash[7]);
+                PDEDUPREF pRef = (PDEDUPREF)RTAvlrU64Get(&TreeRefs, uKey);
+                while (pRef && memcmp(pRef->abHash, abHash, RTSHA256_HASH_SIZE))
+                    pRef = pRef->pNext;
+
+                if (pRef)
+                    cBlocksInUse++;
+                else
+                {
+                    char szPath[RTPATH_MAX];
+
+                    int rc2 = dedupStoreGetPath(pszStorePath, abHash, szPath, sizeof(szPath));
+                    if (RT_SUCCESS(rc2))
+                        rc2 = RTFileDelete(szPath);
+                    if (RT_SUCCESS(rc2))
+                        cBlocksFreed++;
+                }
+            }
+
+            RTDirClose(pDir);
+        }
+    }
+
+    /* Free the reference tracking. */
+    while (TreeRefs)
+    {
+        PDEDUPREF pRef = (PDEDUPREF)RTAvlrU64Remove(&TreeRefs, TreeRefs->Key);
+        while (pRef)
+        {
+            PDEDUPREF pFree = pRef;
+            pRef = pRef->pNext;
+            RTMemFree(pFree);
+        }
+    }
+
+    /* Closing the file releases the lock. */
+    RTFileClose(hFileCompact);
+
+    if (pcBlocksFreed)
+        *pcBlocksFreed = cBlocksFreed;
+    if (pcBlocksInUse)
+        *pcBlocksInUse = cBlocksInUse;
+
+    LogFlowFunc(("returns %Rrc cBlocksFreed=%llu cBlocksInUse=%llu\n", rc, cBlocksFreed, cBlocksInUse));
+    return rc;
+}
+
+
+const VDFILTERBACKEND g_VDFilterDedup =
+{
+    /* pszBackendName */
+    "DEDUP",
+    /* cbSize */
+    sizeof(VDFILTERBACKEND),
+    /* paConfigInfo */
+    s_aDedupConfigInfo,
+    /* pfnCreate */
+    dedupCreate,
+    /* pfnDestroy */
+    dedupDestroy,
+    /* pfnFilterRead */
+    dedupFilterRead,
+    /* pfnFilterWrite */
+    dedupFilterWrite,
+    /* pfnFlush */
+    dedupFlush
+};
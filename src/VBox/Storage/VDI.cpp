@@ -30,11 +30,37 @@
 #include <iprt/uuid.h>
 #include <iprt/string.h>
 #include <iprt/asm.h>
+#include <iprt/sort.h>
+#include <iprt/zip.h>
 
 #include "VDBackends.h"
 
 #define VDI_IMAGE_DEFAULT_BLOCK_SIZE _1M
 
+/** Offset of the compressed block index, following the block array. */
+#define VDI_COMP_INDEX_OFFSET(offBlocks, cBlocks) \
+    RT_ALIGN_32((offBlocks) + (cBlocks) * sizeof(VDIIMAGEBLOCKPOINTER), 512)
+
+/** Number of block pointers in one sector of the block array. */
+#define VDI_BLOCKS_PER_SECTOR (512 / sizeof(VDIIMAGEBLOCKPOINTER))
+/** Maximum number of dirty block array sectors combined into one write. */
+#define VDI_BLOCKS_DIRTY_RUN_MAX 64
+/** Number of block allocations after which the block array changes are written
+ * without waiting for a flush. Bounds what is lost on a host crash when the
+ * guest's flushes never reach the image (DrvBlock's IgnoreFlush). */
+#define VDI_BLOCKS_DIRTY_ALLOCS_MAX 32
+/** Number of blocks the image file is grown by at once when allocating blocks. */
+#define VDI_PREALLOC_BLOCKS 8
+
+/** Offset of the discard bitmap, following the block array like the
+ * compressed block index (which is why compressed images have none). */
+#define VDI_TRIM_MAP_OFFSET(offBlocks, cBlocks) VDI_COMP_INDEX_OFFSET(offBlocks, cBlocks)
+/** Number of blocks covered by one sector of the discard bitmap. */
+#define VDI_TRIM_MAP_BLOCKS_PER_SECTOR (512 * 8)
+/** Size of the discard bitmap in the image file. */
+#define VDI_TRIM_MAP_SIZE(cBlocks) \
+    (RT_ALIGN_32((cBlocks), VDI_TRIM_MAP_BLOCKS_PER_SECTOR) / 8)
+
 /** Macros for endianess conversion. */
 #define SET_ENDIAN_U32(conv, u32) (conv == VDIECONV_H2F ? RT_H2LE_U32(u32) : RT_LE2H_U32(u32))
 #define SET_ENDIAN_U64(conv, u64) (conv == VDIECONV_H2F ? RT_H2LE_U64(u64) : RT_LE2H_U64(u64))
@@ -65,6 +91,17 @@ static int  vdiValidateHeader(PVDIHEADER pHeader);
 static void vdiSetupImageDesc(PVDIIMAGEDESC pImage);
 static int  vdiUpdateHeader(PVDIIMAGEDESC pImage);
 static int  vdiUpdateBlockInfo(PVDIIMAGEDESC pImage, unsigned uBlock);
+static int  vdiBlocksDirtyAlloc(PVDIIMAGEDESC pImage);
+static void vdiBlockMarkDirty(PVDIIMAGEDESC pImage, unsigned uBlock);
+static int  vdiBlockAllocated(PVDIIMAGEDESC pImage, unsigned uBlock, PVDIOCTX pIoCtx);
+static int  vdiBlocksDirtyWrite(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx);
+static void vdiPreallocTrim(PVDIIMAGEDESC pImage);
+static int  vdiTrimMapSetup(PVDIIMAGEDESC pImage);
+static void vdiTrimMapFree(PVDIIMAGEDESC pImage);
+static void vdiTrimMapCreate(PVDIIMAGEDESC pImage);
+static void vdiTrimMapMark(PVDIIMAGEDESC pImage, unsigned uBlock);
+static void vdiTrimMapReset(PVDIIMAGEDESC pImage);
+static int  vdiTrimMapWrite(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx);
 static int  vdiUpdateHeaderAsync(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx);
 static int  vdiUpdateBlockInfoAsync(PVDIIMAGEDESC pImage, unsigned uBlock, PVDIOCTX pIoCtx,
                                     bool fUpdateHdr);
@@ -196,6 +233,642 @@ static void vdiConvBlocksEndianess(VDIECONV enmConv, PVDIIMAGEBLOCKPOINTER paBlo
         paBlocks[i] = SET_ENDIAN_U32(enmConv, paBlocks[i]);
 }
 
+/**
+ * Internal: Flip the endianess of the compressed block index.
+ */
+static void vdiConvCompBlocksEndianess(VDIECONV enmConv, PVDICOMPBLOCK paCompBlocks,
+                                       unsigned cCompBlocks)
+{
+    for (unsigned i = 0; i < cCompBlocks; i++)
+    {
+        paCompBlocks[i].offBlock = SET_ENDIAN_U64(enmConv, paCompBlocks[i].offBlock);
+        paCompBlocks[i].cbStored = SET_ENDIAN_U32(enmConv, paCompBlocks[i].cbStored);
+        paCompBlocks[i].cbAlloc  = SET_ENDIAN_U32(enmConv, paCompBlocks[i].cbAlloc);
+    }
+}
+
+/**
+ * Internal: Allocate the index and the buffers needed to access a compressed image.
+ */
+static int vdiCompInit(PVDIIMAGEDESC pImage)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+
+    pImage->paCompBlocks = (PVDICOMPBLOCK)RTMemAllocZ(getImageBlocks(&pImage->Header) * sizeof(VDICOMPBLOCK));
+    pImage->pbCompBlock  = (uint8_t *)RTMemAlloc(cbBlock);
+    pImage->cbCompData   = cbBlock;
+    pImage->pbCompData   = (uint8_t *)RTMemAllocZ(pImage->cbCompData);
+    pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
+    RTListInit(&pImage->ListCompStores);
+
+    if (   !pImage->paCompBlocks
+        || !pImage->pbCompBlock
+        || !pImage->pbCompData)
+        return VERR_NO_MEMORY;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Add an unused range of the data area to the hole list, merging
+ * it with adjacent holes. Running out of memory only leaks the range until
+ * the image is opened again.
+ */
+static void vdiCompHoleAdd(PVDIIMAGEDESC pImage, uint64_t off, uint64_t cb)
+{
+    PVDICOMPHOLE paHoles = pImage->paCompHoles;
+    unsigned i = 0;
+
+    while (   i < pImage->cCompHoles
+           && paHoles[i].off < off)
+        i++;
+
+    bool fMergePrev = i > 0 && paHoles[i - 1].off + paHoles[i - 1].cb == off;
+    bool fMergeNext = i < pImage->cCompHoles && off + cb == paHoles[i].off;
+
+    if (fMergePrev && fMergeNext)
+    {
+        paHoles[i - 1].cb += cb + paHoles[i].cb;
+        memmove(&paHoles[i], &paHoles[i + 1], (pImage->cCompHoles - i - 1) * sizeof(VDICOMPHOLE));
+        pImage->cCompHoles--;
+    }
+    else if (fMergePrev)
+        paHoles[i - 1].cb += cb;
+    else if (fMergeNext)
+    {
+        paHoles[i].off = off;
+        paHoles[i].cb += cb;
+    }
+    else
+    {
+        if (pImage->cCompHoles == pImage->cCompHolesMax)
+        {
+            unsigned cHolesNew = pImage->cCompHolesMax ? pImage->cCompHolesMax * 2 : 64;
+            paHoles = (PVDICOMPHOLE)RTMemRealloc(pImage->paCompHoles, cHolesNew * sizeof(VDICOMPHOLE));
+            if (!paHoles)
+                return;
+            pImage->paCompHoles   = paHoles;
+            pImage->cCompHolesMax = cHolesNew;
+        }
+
+        memmove(&paHoles[i + 1], &paHoles[i], (pImage->cCompHoles - i) * sizeof(VDICOMPHOLE));
+        paHoles[i].off = off;
+        paHoles[i].cb  = cb;
+        pImage->cCompHoles++;
+    }
+}
+
+/**
+ * Internal: Allocate space for a compressed block, preferring the first hole
+ * big enough over growing the image.
+ */
+static uint64_t vdiCompSpaceAlloc(PVDIIMAGEDESC pImage, uint32_t cb)
+{
+    uint64_t off;
+
+    for (unsigned i = 0; i < pImage->cCompHoles; i++)
+    {
+        PVDICOMPHOLE pHole = &pImage->paCompHoles[i];
+        if (pHole->cb >= cb)
+        {
+            off = pHole->off;
+            pHole->off += cb;
+            pHole->cb  -= cb;
+            if (!pHole->cb)
+            {
+                memmove(pHole, pHole + 1, (pImage->cCompHoles - i - 1) * sizeof(VDICOMPHOLE));
+                pImage->cCompHoles--;
+            }
+            return off;
+        }
+    }
+
+    off = pImage->cbImage;
+    pImage->cbImage += cb;
+    return off;
+}
+
+/**
+ * Internal: Release the space of a compressed block. Space at the end of the
+ * image is given back to the file system.
+ */
+static void vdiCompSpaceFree(PVDIIMAGEDESC pImage, uint64_t off, uint32_t cb)
+{
+    if (off + cb == pImage->cbImage)
+    {
+        pImage->cbImage = off;
+        if (   pImage->cCompHoles
+            && pImage->paCompHoles[pImage->cCompHoles - 1].off + pImage->paCompHoles[pImage->cCompHoles - 1].cb == pImage->cbImage)
+        {
+            pImage->cbImage = pImage->paCompHoles[pImage->cCompHoles - 1].off;
+            pImage->cCompHoles--;
+        }
+        vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->cbImage); /* Errors only waste space. */
+    }
+    else
+        vdiCompHoleAdd(pImage, off, cb);
+}
+
+/**
+ * Internal: Sort callback for the used ranges of a compressed image.
+ */
+static DECLCALLBACK(int) vdiCompRangeCmp(void const *pvElement1, void const *pvElement2, void *pvUser)
+{
+    PVDICOMPHOLE pRange1 = (PVDICOMPHOLE)pvElement1;
+    PVDICOMPHOLE pRange2 = (PVDICOMPHOLE)pvElement2;
+    NOREF(pvUser);
+
+    if (pRange1->off < pRange2->off)
+        return -1;
+    if (pRange1->off > pRange2->off)
+        return 1;
+    return 0;
+}
+
+/**
+ * Internal: Load and check the compressed block index, and rebuild the hole
+ * list from the ranges not referenced by any block.
+ */
+static int vdiCompIndexLoad(PVDIIMAGEDESC pImage)
+{
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    unsigned cBlocksAllocated = getImageBlocksAllocated(&pImage->Header);
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+
+    int rc = vdiCompInit(pImage);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->offStartCompIndex,
+                               pImage->paCompBlocks, cBlocks * sizeof(VDICOMPBLOCK));
+    if (RT_FAILURE(rc))
+        return rc;
+    vdiConvCompBlocksEndianess(VDIECONV_F2H, pImage->paCompBlocks, cBlocks);
+
+    PVDICOMPHOLE paUsed = (PVDICOMPHOLE)RTMemAlloc(RT_MAX(cBlocksAllocated, 1) * sizeof(VDICOMPHOLE));
+    if (!paUsed)
+        return VERR_NO_MEMORY;
+
+    unsigned cUsed = 0;
+    for (unsigned i = 0; i < cBlocks; i++)
+    {
+        PVDICOMPBLOCK pCompBlock = &pImage->paCompBlocks[i];
+
+        if (!IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[i]))
+            continue;
+
+        /* The block array is written on flush while the index entry follows
+         * the data write, so an allocation interrupted by a crash leaves an
+         * empty entry behind. The block never completed, treat it as free. */
+        if (   !pCompBlock->offBlock
+            && !pCompBlock->cbStored
+            && !pCompBlock->cbAlloc)
+        {
+            LogRel(("VDI: Dropping incomplete compressed block %u in '%s'\n", i, pImage->pszFilename));
+            pImage->paBlocks[i] = VDI_IMAGE_BLOCK_FREE;
+            vdiBlockMarkDirty(pImage, i);
+            continue;
+        }
+
+        if (   cUsed >= cBlocksAllocated
+            || pCompBlock->offBlock < pImage->offStartData
+            || !pCompBlock->cbStored
+            || pCompBlock->cbStored > cbBlock
+            || pCompBlock->cbStored > pCompBlock->cbAlloc
+            || pCompBlock->offBlock + pCompBlock->cbAlloc > pImage->cbImage)
+        {
+            LogRel(("VDI: Invalid compressed block %u in '%s' (off=%llu cbStored=%u cbAlloc=%u)\n",
+                    i, pImage->pszFilename, pCompBlock->offBlock, pCompBlock->cbStored, pCompBlock->cbAlloc));
+            rc = VERR_VD_VDI_INVALID_HEADER;
+            break;
+        }
+
+        paUsed[cUsed].off = pCompBlock->offBlock;
+        paUsed[cUsed].cb  = pCompBlock->cbAlloc;
+        cUsed++;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t offCur = pImage->offStartData;
+
+        RTSortShell(paUsed, cUsed, sizeof(VDICOMPHOLE), vdiCompRangeCmp, NULL);
+        for (unsigned i = 0; i < cUsed; i++)
+        {
+            if (paUsed[i].off < offCur)
+            {
+                LogRel(("VDI: Overlapping compressed blocks at %llu in '%s'\n",
+                        paUsed[i].off, pImage->pszFilename));
+                rc = VERR_VD_VDI_INVALID_HEADER;
+                break;
+            }
+            if (paUsed[i].off > offCur)
+                vdiCompHoleAdd(pImage, offCur, paUsed[i].off - offCur);
+            offCur = paUsed[i].off + paUsed[i].cb;
+        }
+
+        /* Whatever follows the last block is reused when appending. */
+        if (RT_SUCCESS(rc))
+            pImage->cbImage = offCur;
+    }
+
+    RTMemFree(paUsed);
+    return rc;
+}
+
+/**
+ * Internal: Queue the slot of a rewritten block for release. The slot must
+ * not be reused before the index entry pointing to the new slot is on disk,
+ * a crash could leave the old entry referencing data of another block
+ * otherwise. Running out of memory only leaks the range until the image is
+ * opened again.
+ */
+static void vdiCompFreeQueue(PVDIIMAGEDESC pImage, uint64_t off, uint32_t cb)
+{
+    if (pImage->cCompFreePending == pImage->cCompFreePendingMax)
+    {
+        unsigned cNew = pImage->cCompFreePendingMax ? pImage->cCompFreePendingMax * 2 : 64;
+        PVDICOMPHOLE paNew = (PVDICOMPHOLE)RTMemRealloc(pImage->paCompFreePending, cNew * sizeof(VDICOMPHOLE));
+        if (!paNew)
+            return;
+        pImage->paCompFreePending   = paNew;
+        pImage->cCompFreePendingMax = cNew;
+    }
+
+    pImage->paCompFreePending[pImage->cCompFreePending].off = off;
+    pImage->paCompFreePending[pImage->cCompFreePending].cb  = cb;
+    pImage->cCompFreePending++;
+    if (!pImage->cCompIndexWrites)
+        pImage->cCompFreeWritten = pImage->cCompFreePending;
+}
+
+/**
+ * Internal: Release the first cRelease queued slots after a flush made the
+ * index entries replacing them durable.
+ *
+ * @param   pImage      The image instance.
+ * @param   cRelease    Number of queued slots to release.
+ * @param   fTruncate   Whether space at the end of the image may be given back
+ *                      to the file system, needs synchronous I/O.
+ */
+static void vdiCompFreeRelease(PVDIIMAGEDESC pImage, unsigned cRelease, bool fTruncate)
+{
+    Assert(cRelease <= pImage->cCompFreeWritten);
+
+    if (!cRelease)
+        return;
+
+    for (unsigned i = 0; i < cRelease; i++)
+    {
+        PVDICOMPHOLE pRange = &pImage->paCompFreePending[i];
+        if (fTruncate)
+            vdiCompSpaceFree(pImage, pRange->off, (uint32_t)pRange->cb);
+        else
+            vdiCompHoleAdd(pImage, pRange->off, pRange->cb);
+    }
+
+    memmove(pImage->paCompFreePending, &pImage->paCompFreePending[cRelease],
+            (pImage->cCompFreePending - cRelease) * sizeof(VDICOMPHOLE));
+    pImage->cCompFreePending  -= cRelease;
+    pImage->cCompFreeWritten  -= cRelease;
+    pImage->cCompFreeFlushing -= RT_MIN(cRelease, pImage->cCompFreeFlushing);
+}
+
+/**
+ * Completion callback for index entry writes.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vdiCompIndexUpdateDone(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+    NOREF(pIoCtx); NOREF(pvUser);
+
+    Assert(pImage->cCompIndexWrites > 0);
+    pImage->cCompIndexWrites--;
+
+    if (RT_FAILURE(rcReq))
+    {
+        /* The queued slots may still be referenced on disk, give them up and
+         * have the whole index rewritten on the next flush. */
+        LogRel(("VDI: Writing the compressed block index of '%s' failed (%Rrc)\n",
+                pImage->pszFilename, rcReq));
+        pImage->cCompFreePending  = 0;
+        pImage->cCompFreeWritten  = 0;
+        pImage->cCompFreeFlushing = 0;
+        pImage->fCompIndexDirty   = true;
+    }
+    else if (!pImage->cCompIndexWrites)
+        pImage->cCompFreeWritten = pImage->cCompFreePending;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Write the index entry of a compressed block.
+ */
+static int vdiCompIndexUpdate(PVDIIMAGEDESC pImage, unsigned uBlock, PVDICOMPBLOCK pCompBlock, PVDIOCTX pIoCtx)
+{
+    VDICOMPBLOCK CompBlock = *pCompBlock;
+
+    vdiConvCompBlocksEndianess(VDIECONV_H2F, &CompBlock, 1);
+    int rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offStartCompIndex + uBlock * sizeof(VDICOMPBLOCK),
+                                    &CompBlock, sizeof(CompBlock), pIoCtx,
+                                    vdiCompIndexUpdateDone, NULL);
+    if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        pImage->cCompIndexWrites++;
+    return rc;
+}
+
+/**
+ * Internal: Write the whole compressed block index, used when writing single
+ * entries failed.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   pIoCtx      The I/O context for asynchronous writes, NULL to write synchronously.
+ */
+static int vdiCompIndexWrite(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx)
+{
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    int rc;
+
+    if (!pImage->fCompIndexDirty)
+        return VINF_SUCCESS;
+
+    PVDICOMPBLOCK paBuf = (PVDICOMPBLOCK)RTMemTmpAlloc(cBlocks * sizeof(VDICOMPBLOCK));
+    if (!paBuf)
+        return VERR_NO_MEMORY;
+
+    memcpy(paBuf, pImage->paCompBlocks, cBlocks * sizeof(VDICOMPBLOCK));
+    vdiConvCompBlocksEndianess(VDIECONV_H2F, paBuf, cBlocks);
+    if (pIoCtx)
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, pImage->offStartCompIndex,
+                                    paBuf, cBlocks * sizeof(VDICOMPBLOCK), pIoCtx, NULL, NULL);
+    else
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offStartCompIndex,
+                                    paBuf, cBlocks * sizeof(VDICOMPBLOCK));
+    RTMemTmpFree(paBuf);
+
+    if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        pImage->fCompIndexDirty = false;
+    return rc;
+}
+
+/**
+ * Completion callback for flushes of compressed images, releases the slots
+ * queued before the flush was started.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vdiCompFlushDone(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+    NOREF(pIoCtx); NOREF(pvUser);
+
+    /* Overlapping flushes may complete in any order, only the completion of
+     * all of them guarantees the entries covered by the last one are durable. */
+    Assert(pImage->cCompFlushes > 0);
+    pImage->cCompFlushes--;
+    if (   RT_SUCCESS(rcReq)
+        && !pImage->cCompFlushes)
+        vdiCompFreeRelease(pImage, pImage->cCompFreeFlushing, false /* fTruncate */);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Load the uncompressed data of the given block into the block
+ * buffer. Blocks not allocated in the image read as zeroes.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_NOT_ENOUGH_METADATA if the data is still being read, the
+ *          request is continued when the read completed.
+ * @param   pImage      The image instance.
+ * @param   uBlock      The block to load.
+ * @param   pIoCtx      The I/O context of the request.
+ */
+static int vdiCompBlockLoad(PVDIIMAGEDESC pImage, unsigned uBlock, PVDIOCTX pIoCtx)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    int rc = VINF_SUCCESS;
+
+    if (pImage->idxCompBlockCached == uBlock)
+        return VINF_SUCCESS;
+
+    pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
+    if (!IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
+        memset(pImage->pbCompBlock, 0, cbBlock);
+    else
+    {
+        PVDICOMPBLOCK pCompBlock = &pImage->paCompBlocks[uBlock];
+        bool fCompressed = pCompBlock->cbStored != cbBlock;
+        PVDMETAXFER pMetaXfer = NULL;
+
+        /* Going through the metadata transfers picks up block writes still in
+         * progress and doesn't block asynchronous requests. */
+        rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage, pCompBlock->offBlock,
+                                   fCompressed ? pImage->pbCompData : pImage->pbCompBlock,
+                                   pCompBlock->cbStored, pIoCtx, &pMetaXfer, NULL, NULL);
+        if (RT_FAILURE(rc))
+            return rc;
+        vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+
+        if (fCompressed)
+        {
+            size_t cbActual = 0;
+            rc = RTZipBlockDecompress(RTZIPTYPE_LZF, 0, pImage->pbCompData, pCompBlock->cbStored, NULL,
+                                      pImage->pbCompBlock, cbBlock, &cbActual);
+            if (RT_SUCCESS(rc) && cbActual != cbBlock)
+                rc = VERR_ZIP_CORRUPTED;
+            if (RT_FAILURE(rc))
+                LogRel(("VDI: Decompressing block %u of '%s' failed (%Rrc)\n",
+                        uBlock, pImage->pszFilename, rc));
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+        pImage->idxCompBlockCached = uBlock;
+    return rc;
+}
+
+/**
+ * Internal: Finish a compressed block write once the data reached the new
+ * slot: point the index entry on disk to it and queue the old slot for
+ * release.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   pIoCtx      The I/O context of the request.
+ * @param   pStore      The block write state, freed.
+ * @param   rcReq       Status code of the data write.
+ */
+static int vdiCompBlockStoreFinish(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx, PVDICOMPSTORE pStore, int rcReq)
+{
+    unsigned uBlock = pStore->uBlock;
+    PVDICOMPBLOCK pCompBlock = &pImage->paCompBlocks[uBlock];
+    bool fNew = !pStore->CompBlockOld.cbAlloc;
+    int rc = rcReq;
+
+    RTListNodeRemove(&pStore->NodeStore);
+
+    if (pStore->fSuperseded)
+    {
+        /* A later write of the block took over, nothing refers to the slot. */
+        vdiCompHoleAdd(pImage, pStore->CompBlock.offBlock, pStore->CompBlock.cbAlloc);
+    }
+    else if (RT_SUCCESS(rcReq))
+    {
+        rc = vdiCompIndexUpdate(pImage, uBlock, &pStore->CompBlock, pIoCtx);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            if (fNew)
+            {
+                int rc2 = vdiBlockAllocated(pImage, uBlock, pIoCtx);
+                if (rc2 != VINF_SUCCESS)
+                    rc = rc2;
+            }
+            else
+                vdiCompFreeQueue(pImage, pStore->CompBlockOld.offBlock, pStore->CompBlockOld.cbAlloc);
+        }
+    }
+    else
+    {
+        /* Go back to the state on disk. */
+        vdiCompHoleAdd(pImage, pStore->CompBlock.offBlock, pStore->CompBlock.cbAlloc);
+        *pCompBlock = pStore->CompBlockOld;
+        if (fNew)
+            pImage->paBlocks[uBlock] = VDI_IMAGE_BLOCK_FREE;
+        if (pImage->idxCompBlockCached == uBlock)
+            pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
+    }
+
+    RTMemFree(pStore);
+    return rc;
+}
+
+/**
+ * Completion callback for compressed block data writes.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vdiCompBlockStoreDone(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+
+    int rc = vdiCompBlockStoreFinish(pImage, pIoCtx, (PVDICOMPSTORE)pvUser, rcReq);
+    if (   RT_FAILURE(rc)
+        && rc != VERR_VD_ASYNC_IO_IN_PROGRESS
+        && RT_SUCCESS(rcReq))
+    {
+        /* The data is in place, get the index entry written on the next flush. */
+        LogRel(("VDI: Writing the compressed block index of '%s' failed (%Rrc)\n",
+                pImage->pszFilename, rc));
+        pImage->fCompIndexDirty = true;
+        rc = VINF_SUCCESS;
+    }
+    else if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        rc = VINF_SUCCESS;
+
+    return rc;
+}
+
+/**
+ * Internal: Compress the block buffer and write it to the image. The data
+ * always goes to a fresh slot and the index entry on disk is only updated once
+ * it is written, so a crash leaves either the old or the new data behind.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   uBlock      The block to write.
+ * @param   pIoCtx      The I/O context of the request.
+ */
+static int vdiCompBlockStore(PVDIIMAGEDESC pImage, unsigned uBlock, PVDIOCTX pIoCtx)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    PVDICOMPBLOCK pCompBlock = &pImage->paCompBlocks[uBlock];
+    bool fAllocated = IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]);
+    uint8_t *pbData = pImage->pbCompData;
+    size_t cbStored = 0;
+
+    PVDICOMPSTORE pStore = (PVDICOMPSTORE)RTMemAllocZ(sizeof(VDICOMPSTORE));
+    if (!pStore)
+    {
+        pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
+        return VERR_NO_MEMORY;
+    }
+
+    int rc = RTZipBlockCompress(RTZIPTYPE_LZF, RTZIPLEVEL_DEFAULT, 0, pImage->pbCompBlock, cbBlock,
+                                pImage->pbCompData, pImage->cbCompData, &cbStored);
+    if (   RT_FAILURE(rc)
+        || RT_ALIGN_Z(cbStored, 512) >= cbBlock)
+    {
+        /* Not worth it, store the block uncompressed. */
+        pbData   = pImage->pbCompBlock;
+        cbStored = cbBlock;
+    }
+
+    uint32_t cbAlloc = RT_ALIGN_32((uint32_t)cbStored, 512);
+    pStore->uBlock             = uBlock;
+    pStore->CompBlock.offBlock = vdiCompSpaceAlloc(pImage, cbAlloc);
+    pStore->CompBlock.cbStored = (uint32_t)cbStored;
+    pStore->CompBlock.cbAlloc  = cbAlloc;
+
+    /* If an earlier write of the block is still pending its slot is dropped
+     * when it completes, the entry on disk is still the one it started from. */
+    bool fPending = false;
+    PVDICOMPSTORE pIt;
+    RTListForEach(&pImage->ListCompStores, pIt, VDICOMPSTORE, NodeStore)
+    {
+        if (   pIt->uBlock == uBlock
+            && !pIt->fSuperseded)
+        {
+            pIt->fSuperseded     = true;
+            pStore->CompBlockOld = pIt->CompBlockOld;
+            fPending = true;
+            break;
+        }
+    }
+    if (!fPending && fAllocated)
+        pStore->CompBlockOld = *pCompBlock;
+    RTListAppend(&pImage->ListCompStores, &pStore->NodeStore);
+
+    /* Requests from here on see the new data, reads of the slot are served
+     * from the metadata transfer while the write is in progress. */
+    *pCompBlock = pStore->CompBlock;
+    if (!fAllocated)
+    {
+        unsigned cBlocksAllocated = getImageBlocksAllocated(&pImage->Header);
+
+        pImage->paBlocks[uBlock] = cBlocksAllocated;
+        if (pImage->paBlocksRev)
+            pImage->paBlocksRev[cBlocksAllocated] = uBlock;
+        setImageBlocksAllocated(&pImage->Header, cBlocksAllocated + 1);
+    }
+    pImage->idxCompBlockCached = uBlock;
+
+    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, pStore->CompBlock.offBlock,
+                                pbData, cbAlloc, pIoCtx, vdiCompBlockStoreDone, pStore);
+    if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        return rc;
+
+    int rc2 = vdiCompBlockStoreFinish(pImage, pIoCtx, pStore, rc);
+    return RT_FAILURE(rc) ? rc : rc2;
+}
+
 /**
  * Internal: Flush the image file to disk.
  */
@@ -207,7 +880,22 @@ static void vdiFlushImage(PVDIIMAGEDESC pImage)
         int rc = vdiUpdateHeader(pImage);
         AssertMsgRC(rc, ("vdiUpdateHeader() failed, filename=\"%s\", rc=%Rrc\n",
                          pImage->pszFilename, rc));
-        vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        rc = vdiBlocksDirtyWrite(pImage, NULL);
+        AssertMsgRC(rc, ("vdiBlocksDirtyWrite() failed, filename=\"%s\", rc=%Rrc\n",
+                         pImage->pszFilename, rc));
+        rc = vdiTrimMapWrite(pImage, NULL);
+        AssertMsgRC(rc, ("vdiTrimMapWrite() failed, filename=\"%s\", rc=%Rrc\n",
+                         pImage->pszFilename, rc));
+        if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        {
+            rc = vdiCompIndexWrite(pImage, NULL);
+            AssertMsgRC(rc, ("vdiCompIndexWrite() failed, filename=\"%s\", rc=%Rrc\n",
+                             pImage->pszFilename, rc));
+        }
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        if (   RT_SUCCESS(rc)
+            && (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED))
+            vdiCompFreeRelease(pImage, pImage->cCompFreeWritten, true /* fTruncate */);
     }
 }
 
@@ -227,7 +915,10 @@ static int vdiFreeImage(PVDIIMAGEDESC pImage, bool fDelete)
         {
             /* No point updating the file that is deleted anyway. */
             if (!fDelete)
+            {
+                vdiPreallocTrim(pImage);
                 vdiFlushImage(pImage);
+            }
 
             rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
             pImage->pStorage = NULL;
@@ -245,6 +936,49 @@ static int vdiFreeImage(PVDIIMAGEDESC pImage, bool fDelete)
             pImage->paBlocksRev = NULL;
         }
 
+        if (pImage->pbmBlocksDirty)
+        {
+            RTMemFree(pImage->pbmBlocksDirty);
+            pImage->pbmBlocksDirty = NULL;
+            pImage->cBitsBlocksDirty = 0;
+            pImage->cBlocksDirty = 0;
+        }
+
+        vdiTrimMapFree(pImage);
+
+        if (pImage->paCompBlocks)
+        {
+            RTMemFree(pImage->paCompBlocks);
+            pImage->paCompBlocks = NULL;
+        }
+
+        if (pImage->paCompHoles)
+        {
+            RTMemFree(pImage->paCompHoles);
+            pImage->paCompHoles = NULL;
+            pImage->cCompHoles = pImage->cCompHolesMax = 0;
+        }
+
+        if (pImage->pbCompBlock)
+        {
+            RTMemFree(pImage->pbCompBlock);
+            pImage->pbCompBlock = NULL;
+        }
+
+        if (pImage->pbCompData)
+        {
+            RTMemFree(pImage->pbCompData);
+            pImage->pbCompData = NULL;
+        }
+
+        if (pImage->paCompFreePending)
+        {
+            Assert(RTListIsEmpty(&pImage->ListCompStores));
+            RTMemFree(pImage->paCompFreePending);
+            pImage->paCompFreePending = NULL;
+            pImage->cCompFreePending = pImage->cCompFreePendingMax = 0;
+        }
+
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
     }
@@ -339,7 +1073,7 @@ static void vdiInitHeader(PVDIHEADER pHeader, uint32_t uImageFlags,
     pHeader->uVersion = VDI_IMAGE_VERSION;
     pHeader->u.v1plus.cbHeader = sizeof(VDIHEADER1PLUS);
     pHeader->u.v1plus.u32Type = (uint32_t)vdiTranslateImageFlags2VDI(uImageFlags);
-    pHeader->u.v1plus.fFlags = (uImageFlags & VD_VDI_IMAGE_FLAGS_ZERO_EXPAND) ? 1 : 0;
+    pHeader->u.v1plus.fFlags = (uImageFlags & (VD_VDI_IMAGE_FLAGS_ZERO_EXPAND | VD_VDI_IMAGE_FLAGS_COMPRESSED)) >> 8;
 #ifdef VBOX_STRICT
     char achZero[VDI_IMAGE_COMMENT_SIZE] = {0};
     Assert(!memcmp(pHeader->u.v1plus.szComment, achZero, VDI_IMAGE_COMMENT_SIZE));
@@ -357,7 +1091,7 @@ static void vdiInitHeader(PVDIHEADER pHeader, uint32_t uImageFlags,
     pHeader->u.v1plus.LegacyGeometry.cHeads = 0;
     pHeader->u.v1plus.LegacyGeometry.cSectors = 0;
     pHeader->u.v1plus.LegacyGeometry.cbSector = VDI_GEOMETRY_SECTOR_SIZE;
-    pHeader->u.v1plus.u32Dummy = 0; /* used to be the translation value */
+    pHeader->u.v1plus.u32Dummy = 0; /* used to be the translation value, now the discard bitmap signature */
 
     pHeader->u.v1plus.cbDisk = cbDisk;
     pHeader->u.v1plus.cbBlock = cbBlock;
@@ -369,7 +1103,18 @@ static void vdiInitHeader(PVDIHEADER pHeader, uint32_t uImageFlags,
 
     /* Init offsets. */
     pHeader->u.v1plus.offBlocks = RT_ALIGN_32(sizeof(VDIPREHEADER) + sizeof(VDIHEADER1PLUS), cbDataAlign);
-    pHeader->u.v1plus.offData = RT_ALIGN_32(pHeader->u.v1plus.offBlocks + (pHeader->u.v1plus.cBlocks * sizeof(VDIIMAGEBLOCKPOINTER)), cbDataAlign);
+    if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        pHeader->u.v1plus.offData = RT_ALIGN_32(  VDI_COMP_INDEX_OFFSET(pHeader->u.v1plus.offBlocks, pHeader->u.v1plus.cBlocks)
+                                                + pHeader->u.v1plus.cBlocks * sizeof(VDICOMPBLOCK), cbDataAlign);
+    else if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        pHeader->u.v1plus.offData = RT_ALIGN_32(pHeader->u.v1plus.offBlocks + (pHeader->u.v1plus.cBlocks * sizeof(VDIIMAGEBLOCKPOINTER)), cbDataAlign);
+    else
+    {
+        /* Reserve room for the discard bitmap, it is all zero in the new file. */
+        pHeader->u.v1plus.offData = RT_ALIGN_32(  VDI_TRIM_MAP_OFFSET(pHeader->u.v1plus.offBlocks, pHeader->u.v1plus.cBlocks)
+                                                + VDI_TRIM_MAP_SIZE(pHeader->u.v1plus.cBlocks), cbDataAlign);
+        pHeader->u.v1plus.u32Dummy = VDI_TRIM_MAP_MAGIC;
+    }
 
     /* Init uuids. */
     RTUuidCreate(&pHeader->u.v1plus.uuidCreate);
@@ -489,6 +1234,26 @@ static int vdiValidateHeader(PVDIHEADER pHeader)
         fFailed = true;
     }
 
+    if (getImageFlags(pHeader) & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        if (   GET_MAJOR_HEADER_VERSION(pHeader) != 1
+            || getImageType(pHeader) == VDI_IMAGE_TYPE_FIXED
+            || getImageExtraBlockSize(pHeader) != 0)
+        {
+            LogRel(("VDI: unsupported compressed image (version %#x, type %d, extra size %d)\n",
+                   pHeader->uVersion, getImageType(pHeader), getImageExtraBlockSize(pHeader)));
+            fFailed = true;
+        }
+        else if (  getImageDataOffset(pHeader)
+                 <   VDI_COMP_INDEX_OFFSET(getImageBlocksOffset(pHeader), getImageBlocks(pHeader))
+                   + (uint64_t)getImageBlocks(pHeader) * sizeof(VDICOMPBLOCK))
+        {
+            LogRel(("VDI: image data offset %d overlaps the compressed block index\n",
+                   getImageDataOffset(pHeader)));
+            fFailed = true;
+        }
+    }
+
     if (RTUuidIsNull(getImageCreationUUID(pHeader)))
     {
         LogRel(("VDI: uuid of creator is 0\n"));
@@ -518,6 +1283,9 @@ static void vdiSetupImageDesc(PVDIIMAGEDESC pImage)
     pImage->offStartBlockData  = getImageExtraBlockSize(&pImage->Header);
     pImage->cbTotalBlockData   =   pImage->offStartBlockData
                                  + getImageBlockSize(&pImage->Header);
+    if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        pImage->offStartCompIndex = VDI_COMP_INDEX_OFFSET(pImage->offStartBlocks, getImageBlocks(&pImage->Header));
+    pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
 }
 
 /**
@@ -565,8 +1333,9 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
     }
 
     vdiInitPreHeader(&pImage->PreHeader);
-    vdiInitHeader(&pImage->Header, uImageFlags, pszComment, cbSize, VDI_IMAGE_DEFAULT_BLOCK_SIZE, 0,
-                  cbDataAlign);
+    vdiInitHeader(&pImage->Header, uImageFlags, pszComment, cbSize,
+                  (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED) ? VDI_IMAGE_COMPRESSED_BLOCK_SIZE : VDI_IMAGE_DEFAULT_BLOCK_SIZE,
+                  0, cbDataAlign);
     /* Save PCHS geometry. Not much work, and makes the flow of information
      * quite a bit clearer - relying on the higher level isn't obvious. */
     pImage->PCHSGeometry = *pPCHSGeometry;
@@ -583,6 +1352,10 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
         goto out;
     }
 
+    rc = vdiBlocksDirtyAlloc(pImage);
+    if (RT_FAILURE(rc))
+        goto out;
+
     if (!(uImageFlags & VD_IMAGE_FLAGS_FIXED))
     {
         /* for growing images mark all blocks in paBlocks as free. */
@@ -600,6 +1373,13 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
     /* Setup image parameters. */
     vdiSetupImageDesc(pImage);
 
+    if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        rc = vdiCompInit(pImage);
+        if (RT_FAILURE(rc))
+            goto out;
+    }
+
     /* Create image file. */
     rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename,
                            VDOpenFlagsToFileOpenFlags(uOpenFlags & ~VD_OPEN_FLAGS_READONLY,
@@ -644,6 +1424,7 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
         rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->offStartData);
         pImage->cbImage = pImage->offStartData;
     }
+    pImage->cbImagePrealloc = pImage->cbImage;
     if (RT_FAILURE(rc))
     {
         rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: setting image size failed for '%s'"),
@@ -692,6 +1473,27 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
         goto out;
     }
 
+    if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        /* The index was allocated zeroed, no endianess conversion needed. */
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offStartCompIndex, pImage->paCompBlocks,
+                                    getImageBlocks(&pImage->Header) * sizeof(VDICOMPBLOCK));
+        if (RT_FAILURE(rc))
+        {
+            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: writing compressed block index failed for '%s'"),
+                           pImage->pszFilename);
+            goto out;
+        }
+    }
+
+    rc = vdiTrimMapSetup(pImage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: setting up the discard bitmap failed for '%s'"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
     if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
     {
         /* Fill image with zeroes. We do this for every fixed-size image since on some systems
@@ -783,6 +1585,7 @@ static int vdiOpenImage(PVDIIMAGEDESC pImage, unsigned uOpenFlags)
         rc = VERR_VD_VDI_INVALID_HEADER;
         goto out;
     }
+    pImage->cbImagePrealloc = pImage->cbImage;
 
     /* Read pre-header. */
     VDIPREHEADER PreHeader;
@@ -876,6 +1679,10 @@ static int vdiOpenImage(PVDIIMAGEDESC pImage, unsigned uOpenFlags)
         goto out;
     }
 
+    rc = vdiBlocksDirtyAlloc(pImage);
+    if (RT_FAILURE(rc))
+        goto out;
+
     /* Read blocks array. */
     rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->offStartBlocks, pImage->paBlocks,
                                getImageBlocks(&pImage->Header) * sizeof(VDIIMAGEBLOCKPOINTER));
@@ -886,6 +1693,23 @@ static int vdiOpenImage(PVDIIMAGEDESC pImage, unsigned uOpenFlags)
     }
     vdiConvBlocksEndianess(VDIECONV_F2H, pImage->paBlocks, getImageBlocks(&pImage->Header));
 
+    if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        rc = vdiCompIndexLoad(pImage);
+        if (RT_FAILURE(rc))
+        {
+            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: Error reading the compressed block index in '%s'"), pImage->pszFilename);
+            goto out;
+        }
+    }
+
+    rc = vdiTrimMapSetup(pImage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: Error reading the discard bitmap in '%s'"), pImage->pszFilename);
+        goto out;
+    }
+
     if (uOpenFlags & VD_OPEN_FLAGS_DISCARD)
     {
         /*
@@ -1039,6 +1863,349 @@ static int vdiUpdateBlockInfo(PVDIIMAGEDESC pImage, unsigned uBlock)
     return rc;
 }
 
+/**
+ * Internal: Allocates the bitmap tracking dirty sectors of the block array.
+ */
+static int vdiBlocksDirtyAlloc(PVDIIMAGEDESC pImage)
+{
+    unsigned cSectors = (getImageBlocks(&pImage->Header) + VDI_BLOCKS_PER_SECTOR - 1) / VDI_BLOCKS_PER_SECTOR;
+    unsigned cBits = RT_ALIGN_32(RT_MAX(cSectors, 1), 32);
+
+    uint32_t *pbmNew = (uint32_t *)RTMemAllocZ(cBits / 8);
+    if (!pbmNew)
+        return VERR_NO_MEMORY;
+
+    /* Carry over dirty sectors, the block array can only grow. */
+    if (pImage->pbmBlocksDirty)
+    {
+        memcpy(pbmNew, pImage->pbmBlocksDirty, pImage->cBitsBlocksDirty / 8);
+        RTMemFree(pImage->pbmBlocksDirty);
+    }
+
+    pImage->pbmBlocksDirty   = pbmNew;
+    pImage->cBitsBlocksDirty = cBits;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Marks the block array sector holding the given block pointer as
+ * dirty. The sector is written to the image on the next flush.
+ */
+static void vdiBlockMarkDirty(PVDIIMAGEDESC pImage, unsigned uBlock)
+{
+    unsigned idxSector = uBlock / VDI_BLOCKS_PER_SECTOR;
+
+    Assert(idxSector < pImage->cBitsBlocksDirty);
+    if (!ASMBitTestAndSet(pImage->pbmBlocksDirty, idxSector))
+        pImage->cBlocksDirty++;
+}
+
+/**
+ * Internal: Records a newly allocated block. The block pointer is written on
+ * the next flush, or together with the header right away if too many
+ * allocations are pending already.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   uBlock      The allocated block.
+ * @param   pIoCtx      The I/O context of the allocating write.
+ */
+static int vdiBlockAllocated(PVDIIMAGEDESC pImage, unsigned uBlock, PVDIOCTX pIoCtx)
+{
+    vdiBlockMarkDirty(pImage, uBlock);
+    if (++pImage->cBlocksDirtyAllocs < VDI_BLOCKS_DIRTY_ALLOCS_MAX)
+        return VINF_SUCCESS;
+
+    int rc = vdiUpdateHeaderAsync(pImage, pIoCtx);
+    if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+    {
+        int rc2 = vdiBlocksDirtyWrite(pImage, pIoCtx);
+        if (rc2 != VINF_SUCCESS)
+            rc = rc2;
+    }
+    return rc;
+}
+
+/**
+ * Internal: Writes all dirty sectors of the block array to the image,
+ * adjacent sectors are combined into one write.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   pIoCtx      The I/O context for asynchronous writes, NULL to write synchronously.
+ */
+static int vdiBlocksDirtyWrite(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+    bool fIoInProgress = false;
+
+    if (!pImage->cBlocksDirty)
+        return VINF_SUCCESS;
+
+    PVDIIMAGEBLOCKPOINTER paBuf = (PVDIIMAGEBLOCKPOINTER)RTMemTmpAlloc(VDI_BLOCKS_DIRTY_RUN_MAX * 512);
+    if (!paBuf)
+        return VERR_NO_MEMORY;
+
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    int idxSector = ASMBitFirstSet(pImage->pbmBlocksDirty, pImage->cBitsBlocksDirty);
+    while (idxSector != -1)
+    {
+        unsigned cSectorsRun = 1;
+        while (   cSectorsRun < VDI_BLOCKS_DIRTY_RUN_MAX
+               && idxSector + cSectorsRun < pImage->cBitsBlocksDirty
+               && ASMBitTest(pImage->pbmBlocksDirty, idxSector + cSectorsRun))
+            cSectorsRun++;
+
+        unsigned uBlockFirst = idxSector * VDI_BLOCKS_PER_SECTOR;
+        unsigned cBlocksRun = RT_MIN(cSectorsRun * VDI_BLOCKS_PER_SECTOR, cBlocks - uBlockFirst);
+        for (unsigned i = 0; i < cBlocksRun; i++)
+            paBuf[i] = RT_H2LE_U32(pImage->paBlocks[uBlockFirst + i]);
+
+        uint64_t offWrite = pImage->offStartBlocks + (uint64_t)uBlockFirst * sizeof(VDIIMAGEBLOCKPOINTER);
+        size_t cbWrite = cBlocksRun * sizeof(VDIIMAGEBLOCKPOINTER);
+        if (pIoCtx)
+            rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offWrite, paBuf, cbWrite,
+                                        pIoCtx, NULL, NULL);
+        else
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offWrite, paBuf, cbWrite);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            fIoInProgress = true;
+        else if (RT_FAILURE(rc))
+            break;
+
+        ASMBitClearRange(pImage->pbmBlocksDirty, idxSector, idxSector + cSectorsRun);
+        pImage->cBlocksDirty -= cSectorsRun;
+        idxSector = ASMBitNextSet(pImage->pbmBlocksDirty, pImage->cBitsBlocksDirty,
+                                  idxSector + cSectorsRun - 1);
+    }
+
+    RTMemTmpFree(paBuf);
+    if (!pImage->cBlocksDirty)
+        pImage->cBlocksDirtyAllocs = 0;
+    if (RT_SUCCESS(rc) && fIoInProgress)
+        rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+    AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
+              ("vdiBlocksDirtyWrite failed, filename=\"%s\", rc=%Rrc\n", pImage->pszFilename, rc));
+    return rc;
+}
+
+/**
+ * Internal: Grows the image file ahead of block allocations so the file size
+ * doesn't change with every newly allocated block.
+ *
+ * @param   pImage      The image instance.
+ * @param   offEnd      End offset of the block being allocated.
+ */
+static void vdiPreallocate(PVDIIMAGEDESC pImage, uint64_t offEnd)
+{
+    if (offEnd <= pImage->cbImagePrealloc)
+        return;
+
+    uint64_t cbMax = pImage->offStartData + (uint64_t)getImageBlocks(&pImage->Header) * pImage->cbTotalBlockData;
+    uint64_t cbPrealloc = RT_MIN(offEnd + (uint64_t)(VDI_PREALLOC_BLOCKS - 1) * pImage->cbTotalBlockData,
+                                 RT_MAX(cbMax, offEnd));
+
+    /* Errors are not fatal, the write extends the file anyway. */
+    int rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, cbPrealloc);
+    if (RT_SUCCESS(rc))
+        pImage->cbImagePrealloc = cbPrealloc;
+}
+
+/**
+ * Internal: Cuts the image file back to the end of the allocated blocks,
+ * releasing any space grown ahead of allocations.
+ */
+static void vdiPreallocTrim(PVDIIMAGEDESC pImage)
+{
+    if (   (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        || (pImage->uImageFlags & (VD_IMAGE_FLAGS_FIXED | VD_VDI_IMAGE_FLAGS_COMPRESSED)))
+        return;
+
+    /* Never cut below the size the file had when it was opened. */
+    uint64_t cbUsed = pImage->offStartData
+                    + (uint64_t)getImageBlocksAllocated(&pImage->Header) * pImage->cbTotalBlockData;
+    cbUsed = RT_MAX(cbUsed, pImage->cbImage);
+    if (pImage->cbImagePrealloc > cbUsed)
+    {
+        int rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, cbUsed);
+        if (RT_SUCCESS(rc))
+            pImage->cbImagePrealloc = cbUsed;
+    }
+}
+
+/**
+ * Internal: Loads the discard bitmap if the image has a valid one, otherwise
+ * remembers to create it on the first discard if there is room between the
+ * block array and the data area.
+ */
+static int vdiTrimMapSetup(PVDIIMAGEDESC pImage)
+{
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    int rc = VINF_SUCCESS;
+
+    vdiTrimMapFree(pImage);
+
+    /* Compressed images keep their block index there, fixed images are never compacted. */
+    if (   GET_MAJOR_HEADER_VERSION(&pImage->Header) == 0
+        || (pImage->uImageFlags & (VD_IMAGE_FLAGS_FIXED | VD_VDI_IMAGE_FLAGS_COMPRESSED)))
+        return VINF_SUCCESS;
+
+    uint32_t offMap = VDI_TRIM_MAP_OFFSET(pImage->offStartBlocks, cBlocks);
+    uint32_t cbMap = VDI_TRIM_MAP_SIZE(cBlocks);
+    if ((uint64_t)offMap + cbMap > pImage->offStartData)
+        return VINF_SUCCESS;
+
+    pImage->cBitsTrimmed      = cbMap * 8;
+    pImage->offTrimMap        = offMap;
+    pImage->idxTrimDirtyFirst = UINT32_MAX;
+    pImage->idxTrimDirtyLast  = 0;
+
+    if (getImageTrimMapMagic(&pImage->Header) != VDI_TRIM_MAP_MAGIC)
+    {
+        /* Leave images alone until the guest discards something. */
+        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+            pImage->fTrimMapPending = true;
+        return VINF_SUCCESS;
+    }
+
+    uint32_t *pbmTrimmed = (uint32_t *)RTMemAllocZ(cbMap);
+    if (!pbmTrimmed)
+        return VERR_NO_MEMORY;
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offMap, pbmTrimmed, cbMap);
+    if (RT_SUCCESS(rc))
+    {
+        if (cBlocks < cbMap * 8)
+            ASMBitClearRange(pbmTrimmed, cBlocks, cbMap * 8);
+        pImage->pbmTrimmed = pbmTrimmed;
+    }
+    else
+        RTMemFree(pbmTrimmed);
+
+    return rc;
+}
+
+/**
+ * Internal: Creates the in-memory discard bitmap for an image which has none
+ * yet. The whole bitmap is written on the next flush, which also marks it
+ * valid in the header.
+ */
+static void vdiTrimMapCreate(PVDIIMAGEDESC pImage)
+{
+    uint32_t *pbmTrimmed = (uint32_t *)RTMemAllocZ(pImage->cBitsTrimmed / 8);
+    if (!pbmTrimmed)
+        return; /* Try again on the next discard. */
+
+    /* Discards from before the bitmap existed are unknown. */
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    for (unsigned i = 0; i < cBlocks; i++)
+        if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[i]))
+            ASMBitSet(pbmTrimmed, i);
+
+    pImage->pbmTrimmed        = pbmTrimmed;
+    pImage->idxTrimDirtyFirst = 0;
+    pImage->idxTrimDirtyLast  = pImage->cBitsTrimmed / VDI_TRIM_MAP_BLOCKS_PER_SECTOR - 1;
+}
+
+/**
+ * Internal: Frees the in-memory discard bitmap.
+ */
+static void vdiTrimMapFree(PVDIIMAGEDESC pImage)
+{
+    if (pImage->pbmTrimmed)
+    {
+        RTMemFree(pImage->pbmTrimmed);
+        pImage->pbmTrimmed = NULL;
+    }
+    pImage->fTrimMapPending = false;
+    pImage->cBitsTrimmed = 0;
+    pImage->offTrimMap = 0;
+}
+
+/**
+ * Internal: Records that the guest discarded a range in the given block,
+ * making it a candidate for the next compact. The bitmap is written to the
+ * image on the next flush.
+ */
+static void vdiTrimMapMark(PVDIIMAGEDESC pImage, unsigned uBlock)
+{
+    if (!pImage->pbmTrimmed && pImage->fTrimMapPending)
+    {
+        vdiTrimMapCreate(pImage);
+        return; /* The block is marked already, it is allocated. */
+    }
+
+    if (   !pImage->pbmTrimmed
+        || ASMBitTestAndSet(pImage->pbmTrimmed, uBlock))
+        return;
+
+    unsigned idxSector = uBlock / VDI_TRIM_MAP_BLOCKS_PER_SECTOR;
+    if (pImage->idxTrimDirtyFirst == UINT32_MAX)
+        pImage->idxTrimDirtyFirst = pImage->idxTrimDirtyLast = idxSector;
+    else
+    {
+        pImage->idxTrimDirtyFirst = RT_MIN(pImage->idxTrimDirtyFirst, idxSector);
+        pImage->idxTrimDirtyLast  = RT_MAX(pImage->idxTrimDirtyLast, idxSector);
+    }
+}
+
+/**
+ * Internal: Clears the discard bitmap after all candidates were checked.
+ */
+static void vdiTrimMapReset(PVDIIMAGEDESC pImage)
+{
+    if (!pImage->pbmTrimmed)
+        return;
+
+    ASMBitClearRange(pImage->pbmTrimmed, 0, pImage->cBitsTrimmed);
+    pImage->idxTrimDirtyFirst = 0;
+    pImage->idxTrimDirtyLast  = pImage->cBitsTrimmed / VDI_TRIM_MAP_BLOCKS_PER_SECTOR - 1;
+}
+
+/**
+ * Internal: Writes the dirty part of the discard bitmap to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   pIoCtx      The I/O context for asynchronous writes, NULL to write synchronously.
+ */
+static int vdiTrimMapWrite(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx)
+{
+    int rc;
+
+    if (   !pImage->pbmTrimmed
+        || pImage->idxTrimDirtyFirst == UINT32_MAX)
+        return VINF_SUCCESS;
+
+    uint64_t offWrite = pImage->offTrimMap + (uint64_t)pImage->idxTrimDirtyFirst * 512;
+    size_t cbWrite = (pImage->idxTrimDirtyLast - pImage->idxTrimDirtyFirst + 1) * 512;
+    uint8_t *pbWrite = (uint8_t *)pImage->pbmTrimmed + pImage->idxTrimDirtyFirst * 512;
+    if (pIoCtx)
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offWrite, pbWrite, cbWrite,
+                                    pIoCtx, NULL, NULL);
+    else
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offWrite, pbWrite, cbWrite);
+    if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+    {
+        pImage->idxTrimDirtyFirst = UINT32_MAX;
+        pImage->idxTrimDirtyLast  = 0;
+
+        /* A freshly created bitmap is only valid once it was written as a whole. */
+        if (pImage->fTrimMapPending)
+        {
+            pImage->fTrimMapPending = false;
+            setImageTrimMapMagic(&pImage->Header, VDI_TRIM_MAP_MAGIC);
+            if (pIoCtx)
+                rc = vdiUpdateHeaderAsync(pImage, pIoCtx);
+            else
+                rc = vdiUpdateHeader(pImage);
+        }
+    }
+    AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
+              ("vdiTrimMapWrite failed, filename=\"%s\", rc=%Rrc\n", pImage->pszFilename, rc));
+    return rc;
+}
+
 /**
  * Internal: Save block pointer to file, save header to file - async version.
  */
@@ -1080,7 +2247,29 @@ static int vdiFlushImageIoCtx(PVDIIMAGEDESC pImage, PVDIOCTX pIoCtx)
         AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
                   ("vdiUpdateHeaderAsync() failed, filename=\"%s\", rc=%Rrc\n",
                   pImage->pszFilename, rc));
-        rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, NULL, NULL);
+        /* Write the block array changes collected since the last flush. */
+        rc = vdiBlocksDirtyWrite(pImage, pIoCtx);
+        if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            return rc;
+        rc = vdiTrimMapWrite(pImage, pIoCtx);
+        if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            return rc;
+        if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        {
+            rc = vdiCompIndexWrite(pImage, pIoCtx);
+            if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                return rc;
+
+            /* Slots replaced by index entries already written become free
+             * once the flush completed. */
+            pImage->cCompFreeFlushing = pImage->cCompFreeWritten;
+            pImage->cCompFlushes++;
+            rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, vdiCompFlushDone, NULL);
+            if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                vdiCompFlushDone(pImage, pIoCtx, NULL, rc);
+        }
+        else
+            rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, NULL, NULL);
         AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
                   ("Flushing data to disk failed rc=%Rrc\n", rc));
     }
@@ -1163,6 +2352,8 @@ static DECLCALLBACK(int) vdiDiscardBlockAsyncUpdate(void *pBackendData, PVDIOCTX
             rc2 = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->cbImage);
             if (RT_FAILURE(rc2))
                 rc = rc2;
+            else
+                pImage->cbImagePrealloc = pImage->cbImage;
 
             /* Free discard state. */
             RTMemFree(pDiscardAsync->pvBlock);
@@ -1300,8 +2491,8 @@ static DECLCALLBACK(int) vdiBlockAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx
             pImage->paBlocksRev[pBlockAlloc->cBlocksAllocated] = pBlockAlloc->uBlock;
 
         setImageBlocksAllocated(&pImage->Header, pBlockAlloc->cBlocksAllocated + 1);
-        rc = vdiUpdateBlockInfoAsync(pImage, pBlockAlloc->uBlock, pIoCtx,
-                                     true /* fUpdateHdr */);
+        /* The header and block array are usually written on the next flush. */
+        rc = vdiBlockAllocated(pImage, pBlockAlloc->uBlock, pIoCtx);
     }
     /* else: I/O error don't update the block table. */
 
@@ -1423,8 +2614,10 @@ static DECLCALLBACK(int) vdiCreate(const char *pszFilename, uint64_t cbSize,
 
     PVDINTERFACECONFIG pIfCfg = VDIfConfigGet(pVDIfsOperation);
 
-    /* Check the image flags. */
-    if ((uImageFlags & ~VD_VDI_IMAGE_FLAGS_MASK) != 0)
+    /* Check the image flags. Compressed images can't be preallocated. */
+    if (   (uImageFlags & ~VD_VDI_IMAGE_FLAGS_MASK) != 0
+        || (   (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+            && (uImageFlags & VD_IMAGE_FLAGS_FIXED)))
     {
         rc = VERR_VD_INVALID_TYPE;
         goto out;
@@ -1606,6 +2799,12 @@ static DECLCALLBACK(int) vdiRead(void *pBackendData, uint64_t uOffset, size_t cb
 
         rc = VINF_SUCCESS;
     }
+    else if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        rc = vdiCompBlockLoad(pImage, uBlock, pIoCtx);
+        if (RT_SUCCESS(rc))
+            vdIfIoIntIoCtxCopyTo(pImage->pIfIo, pIoCtx, pImage->pbCompBlock + offRead, cbToRead);
+    }
     else
     {
         /* Block present in image file, read relevant data. */
@@ -1694,7 +2893,21 @@ static DECLCALLBACK(int) vdiWrite(void *pBackendData, uint64_t uOffset, size_t c
             }
 
             if (   cbToWrite == getImageBlockSize(&pImage->Header)
-                && !(fWrite & VD_WRITE_NO_ALLOC))
+                && !(fWrite & VD_WRITE_NO_ALLOC)
+                && (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED))
+            {
+                /* Full block write to previously unallocated block of a
+                 * compressed image. Compress and write to a new slot. */
+                Assert(!offWrite);
+                pImage->idxCompBlockCached = VDI_IMAGE_BLOCK_FREE;
+                vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pImage->pbCompBlock, cbToWrite);
+
+                *pcbPreRead = 0;
+                *pcbPostRead = 0;
+                rc = vdiCompBlockStore(pImage, uBlock, pIoCtx);
+            }
+            else if (   cbToWrite == getImageBlockSize(&pImage->Header)
+                     && !(fWrite & VD_WRITE_NO_ALLOC))
             {
                 /* Full block write to previously unallocated block.
                  * Allocate block and write data. */
@@ -1716,6 +2929,8 @@ static DECLCALLBACK(int) vdiWrite(void *pBackendData, uint64_t uOffset, size_t c
                 *pcbPreRead = 0;
                 *pcbPostRead = 0;
 
+                vdiPreallocate(pImage, u64Offset + cbToWrite);
+
                 rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
                                             u64Offset, pIoCtx, cbToWrite,
                                             vdiBlockAllocUpdate, pBlockAlloc);
@@ -1738,6 +2953,16 @@ static DECLCALLBACK(int) vdiWrite(void *pBackendData, uint64_t uOffset, size_t c
                 rc = VERR_VD_BLOCK_FREE;
             }
         }
+        else if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        {
+            /* Merge the new data into the block and write it back. */
+            rc = vdiCompBlockLoad(pImage, uBlock, pIoCtx);
+            if (RT_SUCCESS(rc))
+            {
+                vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pImage->pbCompBlock + offWrite, cbToWrite);
+                rc = vdiCompBlockStore(pImage, uBlock, pIoCtx);
+            }
+        }
         else
         {
             /* Block present in image file, write relevant data. */
@@ -2399,6 +3624,18 @@ static DECLCALLBACK(void) vdiDump(void *pBackendData)
         vdIfErrorMessage(pImage->pIfError, "!! WARNING: %u bad blocks found !!\n",
                          cBadBlocks);
     }
+    if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        uint64_t cbStored = 0;
+        uint64_t cbHoles = 0;
+        for (uBlock = 0; uBlock < cBlocks; uBlock++)
+            if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
+                cbStored += pImage->paCompBlocks[uBlock].cbStored;
+        for (unsigned i = 0; i < pImage->cCompHoles; i++)
+            cbHoles += pImage->paCompHoles[i].cb;
+        vdIfErrorMessage(pImage->pIfError, "Compressed: offIndex=%u cbStored=%llu cbHoles=%llu cHoles=%u\n",
+                         pImage->offStartCompIndex, cbStored, cbHoles, pImage->cCompHoles);
+    }
 }
 
 /** @copydoc VBOXHDDBACKEND::pfnCompact */
@@ -2432,6 +3669,19 @@ static DECLCALLBACK(int) vdiCompact(void *pBackendData, unsigned uPercentStart,
         AssertBreakStmt(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY),
                         rc = VERR_VD_IMAGE_READ_ONLY);
 
+        /* Compressed images reuse the space of relocated blocks already. */
+        if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        {
+            rc = VERR_NOT_SUPPORTED;
+            break;
+        }
+
+        /* Compacting goes by the file size, so drop the space grown ahead of
+         * allocations and bring the block array on disk up to date first. */
+        vdiPreallocTrim(pImage);
+        rc = vdiBlocksDirtyWrite(pImage, NULL);
+        AssertRCBreak(rc);
+
         unsigned cBlocks;
         unsigned cBlocksToMove = 0;
         size_t cbBlock;
@@ -2504,7 +3754,26 @@ static DECLCALLBACK(int) vdiCompact(void *pBackendData, unsigned uPercentStart,
         for (unsigned i = 0; i < cBlocks; i++)
         {
             VDIIMAGEBLOCKPOINTER ptrBlock = pImage->paBlocks[i];
-            if (IS_VDI_IMAGE_BLOCK_ALLOCATED(ptrBlock))
+            bool fMaybeZero = true;
+            /* Blocks the guest discarded nothing in since the last compact can
+             * still have been zeroed by it, but a non-zero first sector rules
+             * that out without reading the whole block. */
+            if (   IS_VDI_IMAGE_BLOCK_ALLOCATED(ptrBlock)
+                && !pfnParentRead
+                && pImage->pbmTrimmed
+                && !ASMBitTest(pImage->pbmTrimmed, i))
+            {
+                uint64_t u64Offset = (uint64_t)ptrBlock * pImage->cbTotalBlockData
+                                   + (pImage->offStartData + pImage->offStartBlockData);
+                size_t cbProbe = RT_MIN(cbBlock, 512);
+                rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, u64Offset, pvTmp, cbProbe);
+                if (RT_FAILURE(rc))
+                    break;
+                fMaybeZero = ASMBitFirstSet((volatile void *)pvTmp, (uint32_t)cbProbe * 8) == -1;
+            }
+
+            if (   IS_VDI_IMAGE_BLOCK_ALLOCATED(ptrBlock)
+                && fMaybeZero)
             {
                 /* Block present in image file, read relevant data. */
                 uint64_t u64Offset = (uint64_t)ptrBlock * pImage->cbTotalBlockData
@@ -2574,6 +3843,12 @@ static DECLCALLBACK(int) vdiCompact(void *pBackendData, unsigned uPercentStart,
         if (RT_FAILURE(rc))
             break;
 
+        /* All candidates are checked now, start recording discards afresh. */
+        vdiTrimMapReset(pImage);
+        rc = vdiTrimMapWrite(pImage, NULL);
+        if (RT_FAILURE(rc))
+            break;
+
         /* Fill bubbles with other data (if available). */
         unsigned cBlocksMoved = 0;
         unsigned uBlockUsedPos = cBlocksAllocated;
@@ -2629,6 +3904,12 @@ static DECLCALLBACK(int) vdiCompact(void *pBackendData, unsigned uPercentStart,
         rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage,
                                   (uint64_t)uBlockUsedPos * pImage->cbTotalBlockData
                                   + pImage->offStartData + pImage->offStartBlockData);
+        if (RT_SUCCESS(rc))
+        {
+            pImage->cbImage = (uint64_t)uBlockUsedPos * pImage->cbTotalBlockData
+                            + pImage->offStartData + pImage->offStartBlockData;
+            pImage->cbImagePrealloc = pImage->cbImage;
+        }
     } while (0);
 
     if (paBlocks2)
@@ -2672,10 +3953,21 @@ static DECLCALLBACK(int) vdiResize(void *pBackendData, uint64_t cbSize,
      * the user to know what he's doing. */
     if (   cbSize < getImageDiskSize(&pImage->Header)
         || GET_MAJOR_HEADER_VERSION(&pImage->Header) == 0
-        || pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        || pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED
+        || pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
         rc = VERR_NOT_SUPPORTED;
     else if (cbSize > getImageDiskSize(&pImage->Header))
     {
+        /* Blocks are relocated to the end of the file, so drop the space grown
+         * ahead of allocations and bring the block array on disk up to date first. */
+        vdiPreallocTrim(pImage);
+        rc = vdiBlocksDirtyWrite(pImage, NULL);
+        if (RT_FAILURE(rc))
+        {
+            LogFlowFunc(("returns %Rrc\n", rc));
+            return rc;
+        }
+
         unsigned cBlocksAllocated = getImageBlocksAllocated(&pImage->Header); /** < Blocks currently allocated, doesn't change during resize */
         uint32_t cBlocksNew = cbSize / getImageBlockSize(&pImage->Header);    /** < New number of blocks in the image after the resize */
         if (cbSize % getImageBlockSize(&pImage->Header))
@@ -2683,7 +3975,19 @@ static DECLCALLBACK(int) vdiResize(void *pBackendData, uint64_t cbSize,
 
         uint32_t cBlocksOld      = getImageBlocks(&pImage->Header);           /** < Number of blocks before the resize. */
         uint64_t cbBlockspaceNew = cBlocksNew * sizeof(VDIIMAGEBLOCKPOINTER); /** < Required space for the block array after the resize. */
-        uint64_t offStartDataNew = RT_ALIGN_32(pImage->offStartBlocks + cbBlockspaceNew, VDI_DATA_ALIGN); /** < New start offset for block data after the resize */
+        uint64_t offStartDataNew = RT_ALIGN_32(  VDI_TRIM_MAP_OFFSET(pImage->offStartBlocks, cBlocksNew)
+                                               + VDI_TRIM_MAP_SIZE(cBlocksNew), VDI_DATA_ALIGN); /** < New start offset for block data after the resize */
+
+        /* The grown block array overwrites the discard bitmap, it is set up
+         * again behind the new array once the resize is done. */
+        vdiTrimMapFree(pImage);
+        setImageTrimMapMagic(&pImage->Header, 0);
+        rc = vdiUpdateHeader(pImage);
+        if (RT_FAILURE(rc))
+        {
+            LogFlowFunc(("returns %Rrc\n", rc));
+            return rc;
+        }
 
         if (   pImage->offStartData != offStartDataNew
             && cBlocksAllocated > 0)
@@ -2828,6 +4132,9 @@ static DECLCALLBACK(int) vdiResize(void *pBackendData, uint64_t cbSize,
                 /* Update size and new block count. */
                 setImageDiskSize(&pImage->Header, cbSize);
                 setImageBlocks(&pImage->Header, cBlocksNew);
+                rc = vdiBlocksDirtyAlloc(pImage);
+                if (RT_SUCCESS(rc))
+                    rc = vdiTrimMapSetup(pImage);
                 /* Update geometry. */
                 pImage->PCHSGeometry = *pPCHSGeometry;
                 pImage->cbImage = cbSize;
@@ -2882,6 +4189,10 @@ static DECLCALLBACK(int) vdiDiscard(void *pBackendData, PVDIOCTX pIoCtx,
                      uOffset, cbDiscard),
                      VERR_INVALID_PARAMETER);
 
+    /* Discarding relies on the dense block layout of uncompressed images. */
+    if (pImage->uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        return VERR_NOT_SUPPORTED;
+
     do
     {
         AssertMsgBreakStmt(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY),
@@ -2911,6 +4222,9 @@ static DECLCALLBACK(int) vdiDiscard(void *pBackendData, PVDIOCTX pIoCtx,
             uint8_t *pbBlockData;
             size_t cbPreAllocated, cbPostAllocated;
 
+            /* Remember the block for the next compact in case it stays allocated. */
+            vdiTrimMapMark(pImage, uBlock);
+
             cbPreAllocated = offDiscard % getImageBlockSize(&pImage->Header);
             cbPostAllocated = getImageBlockSize(&pImage->Header) - cbDiscard - cbPreAllocated;
 
@@ -3151,9 +4465,13 @@ static DECLCALLBACK(int) vdiRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
 
                 /*
                  * Check that the offsets are valid (inside of the image) and
-                 * that there are no double references.
+                 * that there are no double references. Compressed images are
+                 * located through the block index, the block array only holds
+                 * allocation ordinals there.
                  */
-                if (offBlock + cbTotalBlockData > cbFile)
+                if (getImageFlags(&Hdr) & VD_VDI_IMAGE_FLAGS_COMPRESSED
+                    ? paBlocks[i] >= getImageBlocks(&Hdr)
+                    : offBlock + cbTotalBlockData > cbFile)
                 {
                     vdIfErrorMessage(pIfError, "Entry %u points to invalid offset %llu, clearing\n",
                                      i, offBlock);
@@ -3209,6 +4527,39 @@ static DECLCALLBACK(int) vdiRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
     return rc;
 }
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocationStatus */
+static DECLCALLBACK(int) vdiQueryAllocationStatus(void *pBackendData, uint64_t uOffset,
+                                                  uint64_t cbRange, bool *pfAllocated,
+                                                  uint64_t *pcbExtent)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu\n", pBackendData, uOffset, cbRange));
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+
+    AssertPtr(pImage);
+    AssertReturn(   uOffset + cbRange <= getImageDiskSize(&pImage->Header)
+                 && cbRange,
+                 VERR_INVALID_PARAMETER);
+
+    /* Zero blocks count as allocated as they hide the data of the parent. */
+    unsigned uBlock = (unsigned)(uOffset >> pImage->uShiftOffset2Index);
+    bool fAllocated = pImage->paBlocks[uBlock] != VDI_IMAGE_BLOCK_FREE;
+    uint64_t cbExtent = getImageBlockSize(&pImage->Header) - (uOffset & pImage->uBlockMask);
+
+    /* Extend the extent over all following blocks with the same status. */
+    while (cbExtent < cbRange)
+    {
+        uBlock++;
+        if ((pImage->paBlocks[uBlock] != VDI_IMAGE_BLOCK_FREE) != fAllocated)
+            break;
+        cbExtent += getImageBlockSize(&pImage->Header);
+    }
+
+    *pfAllocated = fAllocated;
+    *pcbExtent   = RT_MIN(cbExtent, cbRange);
+    LogFlowFunc(("returns VINF_SUCCESS fAllocated=%RTbool cbExtent=%llu\n", *pfAllocated, *pcbExtent));
+    return VINF_SUCCESS;
+}
+
 const VBOXHDDBACKEND g_VDIBackend =
 {
     /* pszBackendName */
@@ -3305,5 +4656,7 @@ const VBOXHDDBACKEND g_VDIBackend =
     /* pfnRepair */
     vdiRepair,
     /* pfnTraverseMetadata */
-    NULL
+    NULL,
+    /* pfnQueryAllocationStatus */
+    vdiQueryAllocationStatus
 };
@@ -30,6 +30,7 @@
 #include <iprt/uuid.h>
 #include <iprt/string.h>
 #include <iprt/asm.h>
+#include <iprt/list.h>
 
 
 /*******************************************************************************
@@ -240,6 +241,14 @@ typedef struct VDIHEADER
  * about proper alignment in the near future again. */
 #define VDI_DATA_ALIGN _1M
 
+/**
+ * Signature stored in the otherwise unused u32Dummy header field if the image
+ * has a valid discard bitmap after the block array. The bitmap has one bit
+ * per block, set if the guest discarded a range in it since the last compact.
+ * Older versions ignore the field, so the image stays readable everywhere.
+ */
+#define VDI_TRIM_MAP_MAGIC UINT32_C(0x4d495254) /* 'TRIM' */
+
 /** Block 'pointer'. */
 typedef uint32_t    VDIIMAGEBLOCKPOINTER;
 /** Pointer to a block 'pointer'. */
@@ -264,6 +273,48 @@ typedef VDIIMAGEBLOCKPOINTER *PVDIIMAGEBLOCKPOINTER;
 #define VDI_IMAGE_BLOCK_UNALLOCATED   (VDI_IMAGE_BLOCK_ZERO)
 #define IS_VDI_IMAGE_BLOCK_ALLOCATED(bp)   (bp < VDI_IMAGE_BLOCK_UNALLOCATED)
 
+/**
+ * Block size used for compressed images. Smaller than the default block size
+ * because every partial write has to recompress the whole block.
+ */
+#define VDI_IMAGE_COMPRESSED_BLOCK_SIZE _256K
+
+/**
+ * Compressed block index entry. Compressed images store an array of these
+ * directly after the block array (starting at the next 512 byte boundary),
+ * one per block. The block array itself only tracks the allocation state.
+ */
+#pragma pack(1)
+typedef struct VDICOMPBLOCK
+{
+    /** Absolute file offset of the block data, 0 if not allocated. */
+    uint64_t    offBlock;
+    /** Size of the stored data, equal to the block size if the block is
+     * stored uncompressed. */
+    uint32_t    cbStored;
+    /** Size of the slot reserved for the block in the file (512 byte
+     * granularity). */
+    uint32_t    cbAlloc;
+} VDICOMPBLOCK;
+#pragma pack()
+AssertCompileSize(VDICOMPBLOCK, 16);
+/** Pointer to a compressed block index entry. */
+typedef VDICOMPBLOCK *PVDICOMPBLOCK;
+
+/**
+ * Unused range in the data area of a compressed image, left behind when
+ * a block was rewritten.
+ */
+typedef struct VDICOMPHOLE
+{
+    /** Start offset of the hole. */
+    uint64_t    off;
+    /** Size of the hole. */
+    uint64_t    cb;
+} VDICOMPHOLE;
+/** Pointer to a hole descriptor. */
+typedef VDICOMPHOLE *PVDICOMPHOLE;
+
 #define GET_MAJOR_HEADER_VERSION(ph) (VDI_GET_VERSION_MAJOR((ph)->uVersion))
 #define GET_MINOR_HEADER_VERSION(ph) (VDI_GET_VERSION_MINOR((ph)->uVersion))
 
@@ -381,6 +432,27 @@ DECLINLINE(PVDIDISKGEOMETRY) getImageLCHSGeometry(PVDIHEADER ph)
     return NULL;
 }
 
+DECLINLINE(uint32_t) getImageTrimMapMagic(PVDIHEADER ph)
+{
+    switch (GET_MAJOR_HEADER_VERSION(ph))
+    {
+        case 0: return 0;
+        case 1: return ph->u.v1.u32Dummy;
+    }
+    AssertFailed();
+    return 0;
+}
+
+DECLINLINE(void) setImageTrimMapMagic(PVDIHEADER ph, uint32_t u32Magic)
+{
+    switch (GET_MAJOR_HEADER_VERSION(ph))
+    {
+        case 0: return;
+        case 1: ph->u.v1.u32Dummy = u32Magic; return;
+    }
+    AssertFailed();
+}
+
 DECLINLINE(uint64_t) getImageDiskSize(PVDIHEADER ph)
 {
     switch (GET_MAJOR_HEADER_VERSION(ph))
@@ -555,6 +627,68 @@ typedef struct VDIIMAGEDESC
     PVDINTERFACEIOINT       pIfIo;
     /** Current size of the image (used for range validation when reading). */
     uint64_t                cbImage;
+    /** Start offset of the compressed block index, compressed images only. */
+    unsigned                offStartCompIndex;
+    /** Compressed block index (host endianess), compressed images only. */
+    PVDICOMPBLOCK           paCompBlocks;
+    /** Sorted array of unused ranges in the data area. */
+    PVDICOMPHOLE            paCompHoles;
+    /** Number of entries in the hole array. */
+    unsigned                cCompHoles;
+    /** Number of entries the hole array has room for. */
+    unsigned                cCompHolesMax;
+    /** Buffer holding the uncompressed data of the block idxCompBlockCached. */
+    uint8_t                *pbCompBlock;
+    /** Buffer for the compressed data of a block. */
+    uint8_t                *pbCompData;
+    /** Size of the compressed data buffer. */
+    size_t                  cbCompData;
+    /** Block whose data is in pbCompBlock, VDI_IMAGE_BLOCK_FREE if none. */
+    unsigned                idxCompBlockCached;
+    /** List of compressed block writes with the data write still pending (VDICOMPSTORE). */
+    RTLISTANCHOR            ListCompStores;
+    /** Number of index entry writes in progress. */
+    unsigned                cCompIndexWrites;
+    /** Slots of rewritten blocks, released once the index entries pointing
+     * elsewhere are on disk. */
+    PVDICOMPHOLE            paCompFreePending;
+    /** Number of entries in the pending release array. */
+    unsigned                cCompFreePending;
+    /** Number of entries the pending release array has room for. */
+    unsigned                cCompFreePendingMax;
+    /** Number of leading pending entries whose index entries were written. */
+    unsigned                cCompFreeWritten;
+    /** Number of leading pending entries covered by the flushes in progress. */
+    unsigned                cCompFreeFlushing;
+    /** Number of flushes in progress. */
+    unsigned                cCompFlushes;
+    /** Set if the index entries on disk may be stale and the whole index has
+     * to be written on the next flush. */
+    bool                    fCompIndexDirty;
+    /** Bitmap of block array sectors with changes not yet written to the image. */
+    uint32_t               *pbmBlocksDirty;
+    /** Number of bits in the dirty bitmap, a multiple of 32. */
+    unsigned                cBitsBlocksDirty;
+    /** Number of dirty block array sectors. */
+    unsigned                cBlocksDirty;
+    /** Number of block allocations since the block array was last written. */
+    unsigned                cBlocksDirtyAllocs;
+    /** Size the image file was grown to ahead of block allocations. */
+    uint64_t                cbImagePrealloc;
+    /** Bitmap of blocks the guest discarded ranges in since the last compact,
+     * NULL if the image has no valid discard bitmap (yet). */
+    uint32_t               *pbmTrimmed;
+    /** Set if the image has room for a discard bitmap which is only created
+     * on the first discard, so images are not modified just by opening them. */
+    bool                    fTrimMapPending;
+    /** Number of bits in the discard bitmap, a multiple of the bits per sector. */
+    unsigned                cBitsTrimmed;
+    /** Offset of the discard bitmap in the image file. */
+    uint32_t                offTrimMap;
+    /** First dirty sector of the discard bitmap, UINT32_MAX if it is clean. */
+    unsigned                idxTrimDirtyFirst;
+    /** Last dirty sector of the discard bitmap. */
+    unsigned                idxTrimDirtyLast;
 } VDIIMAGEDESC, *PVDIIMAGEDESC;
 
 /**
@@ -604,6 +738,24 @@ typedef struct VDIASYNCBLOCKALLOC
     unsigned                uBlock;
 } VDIASYNCBLOCKALLOC, *PVDIASYNCBLOCKALLOC;
 
+/**
+ * Compressed block write state. The index entry is only updated once the
+ * data reached the new slot.
+ */
+typedef struct VDICOMPSTORE
+{
+    /** Node in the list of pending compressed block writes. */
+    RTLISTNODE              NodeStore;
+    /** Block index. */
+    unsigned                uBlock;
+    /** Set if a later write of the same block took over. */
+    bool                    fSuperseded;
+    /** New index entry. */
+    VDICOMPBLOCK            CompBlock;
+    /** Index entry on disk, zero if the block is not allocated there. */
+    VDICOMPBLOCK            CompBlockOld;
+} VDICOMPSTORE, *PVDICOMPSTORE;
+
 /**
  * Endianess conversion direction.
  */
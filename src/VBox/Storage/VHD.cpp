@@ -187,6 +187,14 @@ typedef struct VHDIMAGE
     uint64_t        u64DataOffset;
     /** Flag to force dynamic disk header update. */
     bool            fDynHdrNeedsUpdate;
+    /** Bitmap of BAT sectors with entries not yet written to the image. */
+    uint32_t        *pbmBatDirty;
+    /** Number of bits in the dirty bitmap, a multiple of 32. */
+    uint32_t        cBitsBatDirty;
+    /** Number of dirty BAT sectors. */
+    uint32_t        cBatDirty;
+    /** Number of blocks allocated since the BAT was last written. */
+    uint32_t        cBatDirtyAllocs;
 } VHDIMAGE, *PVHDIMAGE;
 
 /**
@@ -208,6 +216,14 @@ typedef struct VHDIMAGEEXPAND
     uint8_t           au8Bitmap[1];
 } VHDIMAGEEXPAND, *PVHDIMAGEEXPAND;
 
+/** Number of BAT entries in one sector. */
+#define VHD_BAT_ENTRIES_PER_SECTOR (VHD_SECTOR_SIZE / sizeof(uint32_t))
+/** Maximum number of dirty BAT sectors combined into one write. */
+#define VHD_BAT_DIRTY_RUN_MAX      64
+/** Number of block allocations after which the dirty BAT sectors are written
+ * without waiting for a flush, the guest's flushes may never get here. */
+#define VHD_BAT_DIRTY_ALLOCS_MAX   32
+
 /**
  * Flag defines
  */
@@ -494,6 +510,102 @@ static int vhdUpdateFooter(PVHDIMAGE pImage)
     return rc;
 }
 
+/**
+ * Internal: Allocates the bitmap tracking dirty BAT sectors, keeping
+ * the state of the entries which exist already.
+ */
+static int vhdBatDirtyAlloc(PVHDIMAGE pImage)
+{
+    uint32_t cSectors = (pImage->cBlockAllocationTableEntries + VHD_BAT_ENTRIES_PER_SECTOR - 1) / VHD_BAT_ENTRIES_PER_SECTOR;
+    uint32_t cBits = RT_ALIGN_32(RT_MAX(cSectors, 1), 32);
+
+    if (cBits <= pImage->cBitsBatDirty)
+        return VINF_SUCCESS;
+
+    uint32_t *pbmNew = (uint32_t *)RTMemAllocZ(cBits / 8);
+    if (!pbmNew)
+        return VERR_NO_MEMORY;
+
+    if (pImage->pbmBatDirty)
+    {
+        memcpy(pbmNew, pImage->pbmBatDirty, pImage->cBitsBatDirty / 8);
+        RTMemFree(pImage->pbmBatDirty);
+    }
+
+    pImage->pbmBatDirty   = pbmNew;
+    pImage->cBitsBatDirty = cBits;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Marks the BAT sector holding the given entry as dirty. The sector
+ * is written to the image on the next flush.
+ */
+static void vhdBatMarkDirty(PVHDIMAGE pImage, uint32_t idxBat)
+{
+    uint32_t idxSector = idxBat / VHD_BAT_ENTRIES_PER_SECTOR;
+
+    Assert(idxSector < pImage->cBitsBatDirty);
+    if (!ASMBitTestAndSet(pImage->pbmBatDirty, idxSector))
+        pImage->cBatDirty++;
+}
+
+/**
+ * Internal: Writes all dirty BAT sectors to the image, adjacent sectors are
+ * combined into one write.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance.
+ * @param   pIoCtx      The I/O context to write the sectors with.
+ */
+static int vhdBatDirtyWrite(PVHDIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+    bool fIoInProgress = false;
+
+    if (!pImage->cBatDirty)
+        return VINF_SUCCESS;
+
+    uint32_t *paBuf = (uint32_t *)RTMemTmpAlloc(VHD_BAT_DIRTY_RUN_MAX * VHD_SECTOR_SIZE);
+    if (!paBuf)
+        return VERR_NO_MEMORY;
+
+    int idxSector = ASMBitFirstSet(pImage->pbmBatDirty, pImage->cBitsBatDirty);
+    while (idxSector != -1)
+    {
+        uint32_t cSectorsRun = 1;
+        while (   cSectorsRun < VHD_BAT_DIRTY_RUN_MAX
+               && idxSector + cSectorsRun < pImage->cBitsBatDirty
+               && ASMBitTest(pImage->pbmBatDirty, idxSector + cSectorsRun))
+            cSectorsRun++;
+
+        uint32_t idxBatFirst = idxSector * VHD_BAT_ENTRIES_PER_SECTOR;
+        uint32_t cEntries = RT_MIN(cSectorsRun * VHD_BAT_ENTRIES_PER_SECTOR,
+                                   pImage->cBlockAllocationTableEntries - idxBatFirst);
+        for (uint32_t i = 0; i < cEntries; i++)
+            paBuf[i] = RT_H2BE_U32(pImage->pBlockAllocationTable[idxBatFirst + i]);
+
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->uBlockAllocationTableOffset + idxBatFirst * sizeof(uint32_t),
+                                    paBuf, cEntries * sizeof(uint32_t), pIoCtx, NULL, NULL);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            fIoInProgress = true;
+        else if (RT_FAILURE(rc))
+            break;
+
+        ASMBitClearRange(pImage->pbmBatDirty, idxSector, idxSector + cSectorsRun);
+        pImage->cBatDirty -= cSectorsRun;
+        idxSector = ASMBitNextSet(pImage->pbmBatDirty, pImage->cBitsBatDirty, idxSector + cSectorsRun - 1);
+    }
+
+    RTMemTmpFree(paBuf);
+    if (!pImage->cBatDirty)
+        pImage->cBatDirtyAllocs = 0;
+    if (RT_SUCCESS(rc) && fIoInProgress)
+        rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+    return rc;
+}
+
 /**
  * Internal. Flush image data to disk.
  */
@@ -524,8 +636,15 @@ static int vhdFlushImage(PVHDIMAGE pImage)
         /*
          * Write the block allocation table after the copy of the disk footer and the dynamic disk header.
          */
-        vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->uBlockAllocationTableOffset,
-                               pBlockAllocationTableToWrite, cbBlockAllocationTableToWrite);
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->uBlockAllocationTableOffset,
+                                    pBlockAllocationTableToWrite, cbBlockAllocationTableToWrite);
+        if (RT_SUCCESS(rc) && pImage->cBatDirty)
+        {
+            /* The whole table is on disk now. */
+            ASMBitClearRange(pImage->pbmBatDirty, 0, pImage->cBitsBatDirty);
+            pImage->cBatDirty = 0;
+            pImage->cBatDirtyAllocs = 0;
+        }
         if (pImage->fDynHdrNeedsUpdate)
             rc = vhdDynamicHeaderUpdate(pImage);
         RTMemFree(pBlockAllocationTableToWrite);
@@ -572,6 +691,13 @@ static int vhdFreeImage(PVHDIMAGE pImage, bool fDelete)
             RTMemFree(pImage->pBlockAllocationTable);
             pImage->pBlockAllocationTable = NULL;
         }
+        if (pImage->pbmBatDirty)
+        {
+            RTMemFree(pImage->pbmBatDirty);
+            pImage->pbmBatDirty = NULL;
+            pImage->cBitsBatDirty = 0;
+            pImage->cBatDirty = 0;
+        }
         if (pImage->pu8Bitmap)
         {
             RTMemFree(pImage->pu8Bitmap);
@@ -626,33 +752,17 @@ static int vhdAsyncExpansionComplete(PVHDIMAGE pImage, PVDIOCTX pIoCtx, PVHDIMAG
     /* Quick path, check if everything succeeded. */
     if (fFlags == VHDIMAGEEXPAND_ALL_SUCCESS)
     {
+        /* Link the block in, the BAT sector is written on the next flush
+         * unless too many allocations are pending already. */
         pImage->pBlockAllocationTable[pExpand->idxBatAllocated] = RT_BE2H_U32(pExpand->idxBlockBe);
+        vhdBatMarkDirty(pImage, pExpand->idxBatAllocated);
+        if (++pImage->cBatDirtyAllocs >= VHD_BAT_DIRTY_ALLOCS_MAX)
+            rc = vhdBatDirtyWrite(pImage, pIoCtx);
         RTMemFree(pExpand);
     }
     else
     {
-        uint32_t uStatus;
-
-        uStatus = VHDIMAGEEXPAND_STATUS_GET(pExpand->fFlags, VHDIMAGEEXPAND_BAT_STATUS_SHIFT);
-        if (   uStatus == VHDIMAGEEXPAND_STEP_FAILED
-            || uStatus == VHDIMAGEEXPAND_STEP_SUCCESS)
-        {
-            /* Undo and restore the old value. */
-            pImage->pBlockAllocationTable[pExpand->idxBatAllocated] = ~0U;
-
-            /* Restore the old value on the disk.
-             * No need for a completion callback because we can't
-             * do anything if this fails. */
-            if (uStatus == VHDIMAGEEXPAND_STEP_SUCCESS)
-            {
-                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                              pImage->uBlockAllocationTableOffset
-                                            + pExpand->idxBatAllocated * sizeof(uint32_t),
-                                            &pImage->pBlockAllocationTable[pExpand->idxBatAllocated],
-                                            sizeof(uint32_t), pIoCtx, NULL, NULL);
-                fIoInProgress |= rc == VERR_VD_ASYNC_IO_IN_PROGRESS;
-            }
-        }
+        /* The BAT entry is only linked in when everything succeeded, nothing to undo there. */
 
         /* Restore old size (including the footer because another application might
          * fill up the free space making it impossible to add the footer)
@@ -701,11 +811,6 @@ static DECLCALLBACK(int) vhdAsyncExpansionDataComplete(void *pBackendData, PVDIO
     return vhdAsyncExpansionStepCompleted(pBackendData, pIoCtx, pvUser, rcReq, VHDIMAGEEXPAND_USERBLOCK_STATUS_SHIFT);
 }
 
-static DECLCALLBACK(int) vhdAsyncExpansionBatUpdateComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
-{
-    return vhdAsyncExpansionStepCompleted(pBackendData, pIoCtx, pvUser, rcReq, VHDIMAGEEXPAND_BAT_STATUS_SHIFT);
-}
-
 static DECLCALLBACK(int) vhdAsyncExpansionFooterUpdateComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
 {
     return vhdAsyncExpansionStepCompleted(pBackendData, pIoCtx, pvUser, rcReq, VHDIMAGEEXPAND_FOOTER_STATUS_SHIFT);
@@ -784,6 +889,9 @@ static int vhdLoadDynamicDisk(PVHDIMAGE pImage, uint64_t uDynamicDiskHeaderOffse
 
     RTMemFree(pBlockAllocationTable);
 
+    if (RT_SUCCESS(rc))
+        rc = vhdBatDirtyAlloc(pImage);
+
     if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
         memcpy(pImage->ParentUuid.au8, vhdDynamicDiskHeader.ParentUuid, sizeof(pImage->ParentUuid));
 
@@ -1047,6 +1155,10 @@ static int vhdCreateDynamicImage(PVHDIMAGE pImage, uint64_t cbSize)
         pImage->pBlockAllocationTable[i] = 0xFFFFFFFF; /* It is actually big endian. */
     }
 
+    rc = vhdBatDirtyAlloc(pImage);
+    if (RT_FAILURE(rc))
+        return vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VHD: cannot allocate memory for BAT"));
+
     /* Round up to the sector size. */
     if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF) /* fix hyper-v unreadable error */
         pImage->uCurrentEndOfFile = vhdAllocateParentLocators(pImage, &DynamicDiskHeader,
@@ -1723,23 +1835,10 @@ static DECLCALLBACK(int) vhdWrite(void *pBackendData, uint64_t uOffset, size_t c
                 }
 
                 /*
-                 * Write entry in the BAT.
+                 * The BAT entry is not written here but batched with other
+                 * allocations and written on the next flush, see vhdFlush().
                  */
-                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                            pImage->uBlockAllocationTableOffset + cBlockAllocationTableEntry * sizeof(uint32_t),
-                                            &pExpand->idxBlockBe, sizeof(uint32_t), pIoCtx,
-                                            vhdAsyncExpansionBatUpdateComplete,
-                                            pExpand);
-                if (RT_SUCCESS(rc))
-                    VHDIMAGEEXPAND_STATUS_SET(pExpand->fFlags, VHDIMAGEEXPAND_BAT_STATUS_SHIFT, VHDIMAGEEXPAND_STEP_SUCCESS);
-                else if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
-                    fIoInProgress = true;
-                else
-                {
-                    VHDIMAGEEXPAND_STATUS_SET(pExpand->fFlags, VHDIMAGEEXPAND_BAT_STATUS_SHIFT, VHDIMAGEEXPAND_STEP_FAILED);
-                    VHDIMAGEEXPAND_STATUS_SET(pExpand->fFlags, VHDIMAGEEXPAND_FOOTER_STATUS_SHIFT, VHDIMAGEEXPAND_STEP_FAILED);
-                    break;
-                }
+                VHDIMAGEEXPAND_STATUS_SET(pExpand->fFlags, VHDIMAGEEXPAND_BAT_STATUS_SHIFT, VHDIMAGEEXPAND_STEP_SUCCESS);
 
                 /*
                  * Set the new end of the file and link the new block into the BAT.
@@ -1845,7 +1944,12 @@ static DECLCALLBACK(int) vhdFlush(void *pBackendData, PVDIOCTX pIoCtx)
 {
     PVHDIMAGE pImage = (PVHDIMAGE)pBackendData;
 
-    /* No need to write anything here. Data is always updated on a write. */
+    /* Write the BAT entries of blocks allocated since the last flush, everything else
+     * is updated on a write. */
+    int rc = vhdBatDirtyWrite(pImage, pIoCtx);
+    if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        return rc;
+
     return vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, NULL, NULL);
 }
 
@@ -2836,6 +2940,7 @@ static DECLCALLBACK(int) vhdResize(void *pBackendData, uint64_t cbSize,
                 /* Update size and new block count. */
                 pImage->cBlockAllocationTableEntries = cBlocksNew;
                 pImage->cbSize = cbSize;
+                rc = vhdBatDirtyAlloc(pImage);
 
                 /* Update geometry. */
                 pImage->PCHSGeometry = *pPCHSGeometry;
@@ -3198,6 +3303,45 @@ static DECLCALLBACK(int) vhdRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
     return rc;
 }
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocationStatus */
+static DECLCALLBACK(int) vhdQueryAllocationStatus(void *pBackendData, uint64_t uOffset,
+                                                  uint64_t cbRange, bool *pfAllocated,
+                                                  uint64_t *pcbExtent)
+{
+    PVHDIMAGE pImage = (PVHDIMAGE)pBackendData;
+
+    LogFlowFunc(("pBackendData=%p uOffset=%#llx cbRange=%llu\n", pBackendData, uOffset, cbRange));
+
+    AssertPtr(pImage);
+    AssertReturn(uOffset + cbRange <= pImage->cbSize && cbRange, VERR_INVALID_PARAMETER);
+
+    /* Fixed images are always fully allocated. */
+    if (!pImage->pBlockAllocationTable)
+    {
+        *pfAllocated = true;
+        *pcbExtent   = cbRange;
+        return VINF_SUCCESS;
+    }
+
+    /*
+     * An allocated block might still contain free sectors according to its bitmap,
+     * reading that would require I/O so the whole block is reported as allocated.
+     */
+    uint32_t idxBat = (uint32_t)(uOffset / pImage->cbDataBlock);
+    bool fAllocated = pImage->pBlockAllocationTable[idxBat] != ~0U;
+    uint64_t cbExtent = pImage->cbDataBlock - uOffset % pImage->cbDataBlock;
+
+    while (   cbExtent < cbRange
+           && ++idxBat < pImage->cBlockAllocationTableEntries
+           && (pImage->pBlockAllocationTable[idxBat] != ~0U) == fAllocated)
+        cbExtent += pImage->cbDataBlock;
+
+    *pfAllocated = fAllocated;
+    *pcbExtent   = RT_MIN(cbExtent, cbRange);
+    LogFlowFunc(("returns VINF_SUCCESS fAllocated=%RTbool cbExtent=%llu\n", *pfAllocated, *pcbExtent));
+    return VINF_SUCCESS;
+}
+
 
 const VBOXHDDBACKEND g_VhdBackend =
 {
@@ -3296,5 +3440,7 @@ const VBOXHDDBACKEND g_VhdBackend =
     /* pfnRepair */
     vhdRepair,
     /* pfnTraverseMetadata */
-    NULL
+    NULL,
+    /* pfnQueryAllocationStatus */
+    vhdQueryAllocationStatus
 };
@@ -2550,5 +2550,7 @@ const VBOXHDDBACKEND g_VhdxBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
+    NULL,
+    /* pfnQueryAllocationStatus */
     NULL
 };
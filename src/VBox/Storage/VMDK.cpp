@@ -32,6 +32,9 @@
 #include <iprt/rand.h>
 #include <iprt/zip.h>
 #include <iprt/asm.h>
+#include <iprt/mp.h>
+#include <iprt/semaphore.h>
+#include <iprt/thread.h>
 
 #include "VDBackends.h"
 
@@ -103,6 +106,13 @@
 /** Dummy marker for "don't check the marker value". */
 #define VMDK_MARKER_IGNORE 0xffffffffU
 
+/** Maximum number of worker threads compressing or decompressing the grains
+ * of a streamOptimized extent in parallel. */
+#define VMDK_STREAM_THREADS_MAX 8
+
+/** Number of grains in flight per worker thread. */
+#define VMDK_STREAM_JOBS_PER_THREAD 4
+
 /**
  * Magic number for hosted images created by VMware Workstation 4, VMware
  * Workstation 5, VMware Server or VMware Player. Not necessarily sparse.
@@ -325,6 +335,9 @@ typedef struct VMDKEXTENT
     void        *pvCompGrain;
     /** Decompressed grain buffer for streamOptimized extents. */
     void        *pvGrain;
+    /** Worker pool compressing/decompressing grains in parallel for sequential
+     * streamOptimized access, NULL if grains are processed one by one. */
+    struct VMDKSTREAMPIPE *pStreamPipe;
     /** Reference to the image in which this extent is used. Do not use this
      * on a regular basis to avoid passing pImage references to functions
      * explicitly. */
@@ -489,6 +502,71 @@ typedef struct VMDKCOMPRESSIO
 } VMDKCOMPRESSIO;
 
 
+/**
+ * A grain in flight in the streamOptimized worker pool.
+ */
+typedef struct VMDKSTREAMJOB
+{
+    /** Start sector (LBA) of the grain. */
+    uint64_t            uLBA;
+    /** Uncompressed grain data. */
+    void               *pvGrain;
+    /** Compressed grain data, with marker. */
+    void               *pvCompGrain;
+    /** Size of the compressed data including the marker header. */
+    uint32_t            cbCompData;
+    /** Size of the compressed data on disk, including marker and padding. */
+    uint32_t            cbMarkerData;
+    /** Status code of the compression or decompression. */
+    int                 rc;
+    /** Flag whether the worker finished processing the grain. */
+    volatile bool       fDone;
+} VMDKSTREAMJOB;
+/** Pointer to a grain in flight. */
+typedef VMDKSTREAMJOB *PVMDKSTREAMJOB;
+
+/**
+ * Worker pool for streamOptimized extents. The grains are handed out to the
+ * workers in order through a ring of jobs and consumed in the same order by
+ * the thread doing the I/O, so the file layout stays strictly sequential.
+ */
+typedef struct VMDKSTREAMPIPE
+{
+    /** Flag whether the workers compress (writing) or decompress (reading) grains. */
+    bool                fDeflate;
+    /** Flag whether the workers should terminate. */
+    volatile bool       fShutdown;
+    /** Flag whether the end of stream marker was reached while reading. */
+    bool                fEOS;
+    /** Size of an uncompressed grain in bytes. */
+    size_t              cbGrain;
+    /** Size of the compressed grain buffers in bytes. */
+    size_t              cbCompGrain;
+    /** Absolute sector of the next marker to read ahead. */
+    uint64_t            uSectorReadAhead;
+    /** Number of jobs in the ring. */
+    uint32_t            cJobs;
+    /** Number of jobs queued and not consumed yet. */
+    uint32_t            cJobsPending;
+    /** Total number of jobs queued. */
+    volatile uint32_t   cJobsQueued;
+    /** Total number of jobs picked up by a worker. */
+    volatile uint32_t   cJobsClaimed;
+    /** Event signaled when new jobs were queued or the workers should terminate. */
+    RTSEMEVENTMULTI     hEvtWork;
+    /** Event signaled when a worker finished a job. */
+    RTSEMEVENT          hEvtDone;
+    /** Number of worker threads. */
+    unsigned            cThreads;
+    /** The worker threads. */
+    RTTHREAD            ahThreads[VMDK_STREAM_THREADS_MAX];
+    /** The job ring. */
+    VMDKSTREAMJOB       aJobs[VMDK_STREAM_THREADS_MAX * VMDK_STREAM_JOBS_PER_THREAD];
+} VMDKSTREAMPIPE;
+/** Pointer to a streamOptimized worker pool. */
+typedef VMDKSTREAMPIPE *PVMDKSTREAMPIPE;
+
+
 /** Tracks async grain allocation. */
 typedef struct VMDKGRAINALLOCASYNC
 {
@@ -677,6 +755,44 @@ static DECLCALLBACK(int) vmdkFileInflateHelper(void *pvUser, void *pvBuf, size_t
 }
 #endif
 
+/**
+ * Internal: inflate a compressed grain which starts with the marker header.
+ * Safe to be called from any thread.
+ *
+ * @returns VBox status code.
+ * @param   pvCompGrain     The compressed grain, starting with the marker.
+ * @param   cbCompData      Size of the compressed data including the marker header.
+ * @param   pvBuf           Where to store the uncompressed data.
+ * @param   cbToRead        Expected size of the uncompressed data.
+ */
+static int vmdkInflateGrain(void *pvCompGrain, size_t cbCompData, void *pvBuf, size_t cbToRead)
+{
+    int rc;
+    size_t cbActuallyRead;
+
+#ifdef VMDK_USE_BLOCK_DECOMP_API
+    rc = RTZipBlockDecompress(RTZIPTYPE_ZLIB, 0 /*fFlags*/,
+                              pvCompGrain, cbCompData, NULL,
+                              pvBuf, cbToRead, &cbActuallyRead);
+#else
+    PRTZIPDECOMP pZip = NULL;
+    VMDKCOMPRESSIO InflateState;
+    InflateState.pImage = NULL;
+    InflateState.iOffset = -1;
+    InflateState.cbCompGrain = cbCompData;
+    InflateState.pvCompGrain = pvCompGrain;
+
+    rc = RTZipDecompCreate(&pZip, &InflateState, vmdkFileInflateHelper);
+    if (RT_FAILURE(rc))
+        return rc;
+    rc = RTZipDecompress(pZip, pvBuf, cbToRead, &cbActuallyRead);
+    RTZipDecompDestroy(pZip);
+#endif /* !VMDK_USE_BLOCK_DECOMP_API */
+    if (RT_SUCCESS(rc) && cbActuallyRead != cbToRead)
+        rc = VERR_VD_VMDK_INVALID_FORMAT;
+    return rc;
+}
+
 /**
  * Internal: read from a file and inflate the compressed data,
  * distinguishing between async and normal operation
@@ -687,11 +803,8 @@ DECLINLINE(int) vmdkFileInflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
                                     uint64_t *puLBA, uint32_t *pcbMarkerData)
 {
     int rc;
-#ifndef VMDK_USE_BLOCK_DECOMP_API
-    PRTZIPDECOMP pZip = NULL;
-#endif
     VMDKMARKER *pMarker = (VMDKMARKER *)pExtent->pvCompGrain;
-    size_t cbCompSize, cbActuallyRead;
+    size_t cbCompSize;
 
     if (!pcvMarker)
     {
@@ -737,31 +850,10 @@ DECLINLINE(int) vmdkFileInflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
                                   + RT_OFFSETOF(VMDKMARKER, uType),
                                   512);
 
-#ifdef VMDK_USE_BLOCK_DECOMP_API
-    rc = RTZipBlockDecompress(RTZIPTYPE_ZLIB, 0 /*fFlags*/,
-                              pExtent->pvCompGrain, cbCompSize + RT_OFFSETOF(VMDKMARKER, uType), NULL,
-                              pvBuf, cbToRead, &cbActuallyRead);
-#else
-    VMDKCOMPRESSIO InflateState;
-    InflateState.pImage = pImage;
-    InflateState.iOffset = -1;
-    InflateState.cbCompGrain = cbCompSize + RT_OFFSETOF(VMDKMARKER, uType);
-    InflateState.pvCompGrain = pExtent->pvCompGrain;
-
-    rc = RTZipDecompCreate(&pZip, &InflateState, vmdkFileInflateHelper);
-    if (RT_FAILURE(rc))
-        return rc;
-    rc = RTZipDecompress(pZip, pvBuf, cbToRead, &cbActuallyRead);
-    RTZipDecompDestroy(pZip);
-#endif /* !VMDK_USE_BLOCK_DECOMP_API */
-    if (RT_FAILURE(rc))
-    {
-        if (rc == VERR_ZIP_CORRUPTED)
-            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
-        return rc;
-    }
-    if (cbActuallyRead != cbToRead)
-        rc = VERR_VD_VMDK_INVALID_FORMAT;
+    rc = vmdkInflateGrain(pExtent->pvCompGrain, cbCompSize + RT_OFFSETOF(VMDKMARKER, uType),
+                          pvBuf, cbToRead);
+    if (rc == VERR_ZIP_CORRUPTED)
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
     return rc;
 }
 
@@ -787,22 +879,28 @@ static DECLCALLBACK(int) vmdkFileDeflateHelper(void *pvUser, const void *pvBuf,
 }
 
 /**
- * Internal: deflate the uncompressed data and write to a file,
- * distinguishing between async and normal operation
+ * Internal: deflate a grain and prepend the compressed grain marker, padding
+ * the result to a full sector. Safe to be called from any thread.
+ *
+ * @returns VBox status code.
+ * @param   pvCompGrain     Where to store the marker and the compressed data.
+ * @param   cbCompGrain     Size of the buffer.
+ * @param   pvBuf           The uncompressed data.
+ * @param   cbToWrite       Size of the uncompressed data.
+ * @param   uLBA            Start sector of the grain, stored in the marker.
+ * @param   pcbMarkerData   Where to store the size of the marker and the padded data.
  */
-DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
-                                    uint64_t uOffset, const void *pvBuf,
-                                    size_t cbToWrite, uint64_t uLBA,
-                                    uint32_t *pcbMarkerData)
+static int vmdkDeflateGrain(void *pvCompGrain, size_t cbCompGrain, const void *pvBuf,
+                            size_t cbToWrite, uint64_t uLBA, uint32_t *pcbMarkerData)
 {
     int rc;
     PRTZIPCOMP pZip = NULL;
     VMDKCOMPRESSIO DeflateState;
 
-    DeflateState.pImage = pImage;
+    DeflateState.pImage = NULL;
     DeflateState.iOffset = -1;
-    DeflateState.cbCompGrain = pExtent->cbCompGrain;
-    DeflateState.pvCompGrain = pExtent->pvCompGrain;
+    DeflateState.cbCompGrain = cbCompGrain;
+    DeflateState.pvCompGrain = pvCompGrain;
 
     rc = RTZipCompCreate(&pZip, &DeflateState, vmdkFileDeflateHelper,
                          RTZIPTYPE_ZLIB, RTZIPLEVEL_DEFAULT);
@@ -822,27 +920,218 @@ DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         if (uSize % 512)
         {
             uint32_t uSizeAlign = RT_ALIGN(uSize, 512);
-            memset((uint8_t *)pExtent->pvCompGrain + uSize, '\0',
+            memset((uint8_t *)pvCompGrain + uSize, '\0',
                    uSizeAlign - uSize);
             uSize = uSizeAlign;
         }
 
-        if (pcbMarkerData)
-            *pcbMarkerData = uSize;
+        *pcbMarkerData = uSize;
 
         /* Compressed grain marker. Data follows immediately. */
-        VMDKMARKER *pMarker = (VMDKMARKER *)pExtent->pvCompGrain;
+        VMDKMARKER *pMarker = (VMDKMARKER *)pvCompGrain;
         pMarker->uSector = RT_H2LE_U64(uLBA);
         pMarker->cbSize = RT_H2LE_U32(  DeflateState.iOffset
                                       - RT_OFFSETOF(VMDKMARKER, uType));
+    }
+    return rc;
+}
+
+/**
+ * Internal: deflate the uncompressed data and write to a file,
+ * distinguishing between async and normal operation
+ */
+DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                    uint64_t uOffset, const void *pvBuf,
+                                    size_t cbToWrite, uint64_t uLBA,
+                                    uint32_t *pcbMarkerData)
+{
+    uint32_t uSize = 0;
+    int rc = vmdkDeflateGrain(pExtent->pvCompGrain, pExtent->cbCompGrain, pvBuf,
+                              cbToWrite, uLBA, &uSize);
+    if (RT_SUCCESS(rc))
+    {
+        if (pcbMarkerData)
+            *pcbMarkerData = uSize;
         rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                    uOffset, pMarker, uSize);
-        if (RT_FAILURE(rc))
-            return rc;
+                                    uOffset, pExtent->pvCompGrain, uSize);
     }
     return rc;
 }
 
+/**
+ * Internal: worker thread of the streamOptimized worker pool, compressing or
+ * decompressing one grain at a time in the order they were queued.
+ */
+static DECLCALLBACK(int) vmdkStreamPipeWorker(RTTHREAD hThreadSelf, void *pvUser)
+{
+    PVMDKSTREAMPIPE pPipe = (PVMDKSTREAMPIPE)pvUser;
+    NOREF(hThreadSelf);
+
+    while (!ASMAtomicReadBool(&pPipe->fShutdown))
+    {
+        uint32_t iJob = ASMAtomicReadU32(&pPipe->cJobsClaimed);
+        if (iJob == ASMAtomicReadU32(&pPipe->cJobsQueued))
+        {
+            /* Nothing to do. Reset the event before checking again, a job
+             * queued after the check will signal it again. */
+            RTSemEventMultiReset(pPipe->hEvtWork);
+            if (   iJob == ASMAtomicReadU32(&pPipe->cJobsQueued)
+                && !ASMAtomicReadBool(&pPipe->fShutdown))
+                RTSemEventMultiWait(pPipe->hEvtWork, RT_INDEFINITE_WAIT);
+            continue;
+        }
+
+        if (!ASMAtomicCmpXchgU32(&pPipe->cJobsClaimed, iJob + 1, iJob))
+            continue;
+
+        PVMDKSTREAMJOB pJob = &pPipe->aJobs[iJob % pPipe->cJobs];
+        if (pPipe->fDeflate)
+            pJob->rc = vmdkDeflateGrain(pJob->pvCompGrain, pPipe->cbCompGrain,
+                                        pJob->pvGrain, pPipe->cbGrain,
+                                        pJob->uLBA, &pJob->cbMarkerData);
+        else
+            pJob->rc = vmdkInflateGrain(pJob->pvCompGrain, pJob->cbCompData,
+                                        pJob->pvGrain, pPipe->cbGrain);
+        ASMAtomicWriteBool(&pJob->fDone, true);
+        RTSemEventSignal(pPipe->hEvtDone);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: stop the worker threads and free the streamOptimized worker pool
+ * of an extent. Grains which are still in flight are discarded.
+ */
+static void vmdkStreamPipeDestroy(PVMDKEXTENT pExtent)
+{
+    PVMDKSTREAMPIPE pPipe = pExtent->pStreamPipe;
+
+    if (!pPipe)
+        return;
+
+    ASMAtomicWriteBool(&pPipe->fShutdown, true);
+    if (pPipe->hEvtWork != NIL_RTSEMEVENTMULTI)
+        RTSemEventMultiSignal(pPipe->hEvtWork);
+    for (unsigned i = 0; i < pPipe->cThreads; i++)
+        RTThreadWait(pPipe->ahThreads[i], RT_INDEFINITE_WAIT, NULL);
+
+    for (uint32_t i = 0; i < pPipe->cJobs; i++)
+    {
+        if (pPipe->aJobs[i].pvGrain)
+            RTMemFree(pPipe->aJobs[i].pvGrain);
+        if (pPipe->aJobs[i].pvCompGrain)
+            RTMemFree(pPipe->aJobs[i].pvCompGrain);
+    }
+    if (pPipe->hEvtWork != NIL_RTSEMEVENTMULTI)
+        RTSemEventMultiDestroy(pPipe->hEvtWork);
+    if (pPipe->hEvtDone != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pPipe->hEvtDone);
+
+    RTMemFree(pPipe);
+    pExtent->pStreamPipe = NULL;
+}
+
+/**
+ * Internal: set up the worker pool which compresses (when creating) or
+ * decompresses (when reading sequentially) the grains of a streamOptimized
+ * extent on all available CPUs. This is purely an optimization, so if the
+ * host has just one CPU or anything goes wrong the extent is left without
+ * a worker pool and the grains are processed by the calling thread.
+ */
+static void vmdkStreamPipeCreate(PVMDKEXTENT pExtent, bool fDeflate)
+{
+    unsigned cThreads = RT_MIN(RTMpGetOnlineCount(), VMDK_STREAM_THREADS_MAX);
+    int rc = VINF_SUCCESS;
+
+    if (cThreads < 2 || pExtent->pStreamPipe)
+        return;
+
+    PVMDKSTREAMPIPE pPipe = (PVMDKSTREAMPIPE)RTMemAllocZ(sizeof(VMDKSTREAMPIPE));
+    if (!pPipe)
+        return;
+
+    pPipe->fDeflate         = fDeflate;
+    pPipe->fShutdown        = false;
+    pPipe->fEOS             = false;
+    pPipe->cbGrain          = VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain);
+    pPipe->cbCompGrain      = pExtent->cbCompGrain;
+    pPipe->uSectorReadAhead = pExtent->uGrainSectorAbs;
+    pPipe->cJobs            = cThreads * VMDK_STREAM_JOBS_PER_THREAD;
+    pPipe->hEvtWork         = NIL_RTSEMEVENTMULTI;
+    pPipe->hEvtDone         = NIL_RTSEMEVENT;
+    pExtent->pStreamPipe    = pPipe;
+
+    for (uint32_t i = 0; i < pPipe->cJobs; i++)
+    {
+        pPipe->aJobs[i].pvGrain = RTMemAlloc(pPipe->cbGrain);
+        pPipe->aJobs[i].pvCompGrain = RTMemAlloc(pPipe->cbCompGrain);
+        if (!pPipe->aJobs[i].pvGrain || !pPipe->aJobs[i].pvCompGrain)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventMultiCreate(&pPipe->hEvtWork);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pPipe->hEvtDone);
+
+    for (unsigned i = 0; i < cThreads && RT_SUCCESS(rc); i++)
+    {
+        rc = RTThreadCreateF(&pPipe->ahThreads[i], vmdkStreamPipeWorker, pPipe, 0,
+                             RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VMDKZip%u", i);
+        if (RT_SUCCESS(rc))
+            pPipe->cThreads++;
+    }
+
+    if (RT_FAILURE(rc))
+    {
+        LogRel(("VMDK: Failed to set up parallel grain compression for '%s' (%Rrc), falling back to serial processing\n",
+                pExtent->pszFullname, rc));
+        vmdkStreamPipeDestroy(pExtent);
+    }
+}
+
+/**
+ * Internal: return the oldest grain in flight of the worker pool, waiting
+ * until a worker finished processing it.
+ */
+static PVMDKSTREAMJOB vmdkStreamPipeWaitOldest(PVMDKSTREAMPIPE pPipe)
+{
+    Assert(pPipe->cJobsPending);
+    PVMDKSTREAMJOB pJob = &pPipe->aJobs[(pPipe->cJobsQueued - pPipe->cJobsPending) % pPipe->cJobs];
+
+    while (!ASMAtomicReadBool(&pJob->fDone))
+        RTSemEventWait(pPipe->hEvtDone, RT_INDEFINITE_WAIT);
+    return pJob;
+}
+
+/**
+ * Internal: return the next free job of the worker pool. The caller must
+ * make sure that there is a free slot.
+ */
+DECLINLINE(PVMDKSTREAMJOB) vmdkStreamPipeNextFree(PVMDKSTREAMPIPE pPipe)
+{
+    Assert(pPipe->cJobsPending < pPipe->cJobs);
+    PVMDKSTREAMJOB pJob = &pPipe->aJobs[pPipe->cJobsQueued % pPipe->cJobs];
+
+    pJob->rc = VINF_SUCCESS;
+    pJob->fDone = false;
+    return pJob;
+}
+
+/**
+ * Internal: hand the job returned by vmdkStreamPipeNextFree() to the workers.
+ */
+DECLINLINE(void) vmdkStreamPipeQueue(PVMDKSTREAMPIPE pPipe)
+{
+    pPipe->cJobsPending++;
+    ASMAtomicIncU32(&pPipe->cJobsQueued);
+    RTSemEventMultiSignal(pPipe->hEvtWork);
+}
+
 
 /**
  * Internal: check if all files are closed, prevent leaking resources.
@@ -1310,6 +1599,8 @@ static int vmdkCreateGrainDirectory(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
     rc = vmdkAllocStreamBuffers(pImage, pExtent);
     if (RT_FAILURE(rc))
         goto out;
+    if (pImage->uImageFlags & VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED)
+        vmdkStreamPipeCreate(pExtent, true /* fDeflate */);
 
     rc = vmdkAllocGrainDirectory(pImage, pExtent);
     if (RT_FAILURE(rc))
@@ -2715,6 +3006,7 @@ static int vmdkReadMetaExtent(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
     {
         pExtent->uGrainSectorAbs = pExtent->cOverheadSectors;
         pExtent->cbGrainStreamRead = 0;
+        vmdkStreamPipeCreate(pExtent, false /* fDeflate */);
     }
 
 out:
@@ -2865,6 +3157,7 @@ out:
  */
 static void vmdkFreeStreamBuffers(PVMDKEXTENT pExtent)
 {
+    vmdkStreamPipeDestroy(pExtent);
     if (pExtent->pvCompGrain)
     {
         RTMemFree(pExtent->pvCompGrain);
@@ -4225,6 +4518,62 @@ static int vmdkStreamFlushGT(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
     return rc;
 }
 
+/**
+ * Internal. Write the oldest compressed grain of the worker pool to the
+ * image and enter it into the grain table.
+ */
+static int vmdkStreamPipeCommit(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    PVMDKSTREAMPIPE pPipe = pExtent->pStreamPipe;
+    PVMDKSTREAMJOB pJob = vmdkStreamPipeWaitOldest(pPipe);
+    int rc = pJob->rc;
+
+    pPipe->cJobsPending--;
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t uFileOffset = pExtent->uAppendPosition;
+        if (!uFileOffset)
+            return VERR_INTERNAL_ERROR;
+        /* Align to sector, as the previous write could have been any size. */
+        uFileOffset = RT_ALIGN_64(uFileOffset, 512);
+
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                    uFileOffset, pJob->pvCompGrain, pJob->cbMarkerData);
+        if (RT_SUCCESS(rc))
+        {
+            uint32_t uGrain = pJob->uLBA / pExtent->cSectorsPerGrain;
+            uint32_t uCacheLine = uGrain % pExtent->cGTEntries / VMDK_GT_CACHELINE_SIZE;
+            uint32_t uCacheEntry = uGrain % VMDK_GT_CACHELINE_SIZE;
+
+            pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry] = VMDK_BYTE2SECTOR(uFileOffset);
+            pExtent->uAppendPosition = uFileOffset + pJob->cbMarkerData;
+        }
+    }
+
+    if (RT_FAILURE(rc))
+    {
+        pExtent->uGrainSectorAbs = 0;
+        AssertRC(rc);
+        return vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: cannot write compressed data block in '%s'"), pExtent->pszFullname);
+    }
+    return rc;
+}
+
+/**
+ * Internal. Write all grains still in flight in the worker pool, which must
+ * happen before the grain table they belong to is flushed.
+ */
+static int vmdkStreamPipeDrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    int rc = VINF_SUCCESS;
+
+    while (   pExtent->pStreamPipe
+           && pExtent->pStreamPipe->cJobsPending
+           && RT_SUCCESS(rc))
+        rc = vmdkStreamPipeCommit(pImage, pExtent);
+    return rc;
+}
+
 /**
  * Internal. Free all allocated space for representing an image, and optionally
  * delete the image from disk.
@@ -4279,6 +4628,8 @@ static int vmdkFreeImage(PVMDKIMAGE pImage, bool fDelete)
             {
                 PVMDKEXTENT pExtent = &pImage->pExtents[0];
                 uint32_t uLastGDEntry = pExtent->uLastGrainAccess / pExtent->cGTEntries;
+                rc = vmdkStreamPipeDrain(pImage, pExtent);
+                AssertRC(rc);
                 rc = vmdkStreamFlushGT(pImage, pExtent, uLastGDEntry);
                 AssertRC(rc);
                 vmdkStreamClearGT(pImage, pExtent);
@@ -4627,6 +4978,9 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
 
     if (uGDEntry != uLastGDEntry)
     {
+        rc = vmdkStreamPipeDrain(pImage, pExtent);
+        if (RT_FAILURE(rc))
+            return rc;
         rc = vmdkStreamFlushGT(pImage, pExtent, uLastGDEntry);
         if (RT_FAILURE(rc))
             return rc;
@@ -4654,6 +5008,34 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         || pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry])
         return VERR_INTERNAL_ERROR;
 
+    PVMDKSTREAMPIPE pPipe = pExtent->pStreamPipe;
+    if (pPipe)
+    {
+        /* The grain table entry of a grain in flight is only set when it is
+         * written, so catch writing the last grain again explicitly. */
+        if (pPipe->cJobsPending && uGrain == pExtent->uLastGrainAccess)
+            return VERR_INTERNAL_ERROR;
+
+        /* Make room for one more grain, writing the oldest one in order. */
+        if (pPipe->cJobsPending == pPipe->cJobs)
+        {
+            rc = vmdkStreamPipeCommit(pImage, pExtent);
+            if (RT_FAILURE(rc))
+                return rc;
+        }
+
+        /* The I/O context is gone once this returns, so take a copy. */
+        PVMDKSTREAMJOB pJob = vmdkStreamPipeNextFree(pPipe);
+        vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pJob->pvGrain, cbWrite);
+        if (cbWrite != pPipe->cbGrain)
+            memset((char *)pJob->pvGrain + cbWrite, '\0', pPipe->cbGrain - cbWrite);
+        pJob->uLBA = uSector;
+        vmdkStreamPipeQueue(pPipe);
+
+        pExtent->uLastGrainAccess = uGrain;
+        return VINF_SUCCESS;
+    }
+
     /* Update grain table entry. */
     pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry] = VMDK_BYTE2SECTOR(uFileOffset);
 
@@ -5042,6 +5424,170 @@ static int vmdkAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent, PVDIOCTX pIoCt
     return rc;
 }
 
+/**
+ * Internal. Returns the number of sectors taken by a stream optimized marker
+ * which does not belong to a compressed grain, including the marker sector
+ * itself, or 0 if the marker type is unknown.
+ */
+static uint64_t vmdkStreamMarkerSectors(PVMDKEXTENT pExtent, uint32_t uType)
+{
+    switch (uType)
+    {
+        case VMDK_MARKER_EOS:
+            return 1;
+        case VMDK_MARKER_GT:
+            return 1 + VMDK_BYTE2SECTOR(pExtent->cGTEntries * sizeof(uint32_t));
+        case VMDK_MARKER_GD:
+            return 1 + VMDK_BYTE2SECTOR(RT_ALIGN(pExtent->cGDEntries * sizeof(uint32_t), 512));
+        case VMDK_MARKER_FOOTER:
+            return 2;
+        case VMDK_MARKER_UNSPECIFIED:
+            /* Skip over the contents of the unspecified marker
+             * type 4 which exists in some vSphere created files. */
+            /** @todo figure out what the payload means. */
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Internal. Reads ahead the compressed grains following the last one queued
+ * and hands them to the worker pool for decompression, until all jobs are
+ * in flight or the end of stream marker is reached.
+ */
+static int vmdkStreamPipeFill(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    PVMDKSTREAMPIPE pPipe = pExtent->pStreamPipe;
+    int rc = VINF_SUCCESS;
+
+    while (   pPipe->cJobsPending < pPipe->cJobs
+           && !pPipe->fEOS)
+    {
+        uint64_t uOffset = VMDK_SECTOR2BYTE(pPipe->uSectorReadAhead);
+        VMDKMARKER Marker;
+
+        RT_ZERO(Marker);
+        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                   uOffset, &Marker, RT_OFFSETOF(VMDKMARKER, uType));
+        if (RT_FAILURE(rc))
+            break;
+        Marker.uSector = RT_LE2H_U64(Marker.uSector);
+        Marker.cbSize = RT_LE2H_U32(Marker.cbSize);
+
+        if (Marker.cbSize == 0)
+        {
+            /* A marker for something else than a compressed grain. */
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                       uOffset + RT_OFFSETOF(VMDKMARKER, uType),
+                                       &Marker.uType, sizeof(Marker.uType));
+            if (RT_FAILURE(rc))
+                break;
+            Marker.uType = RT_LE2H_U32(Marker.uType);
+            uint64_t cSectors = vmdkStreamMarkerSectors(pExtent, Marker.uType);
+            if (!cSectors)
+            {
+                AssertMsgFailed(("VMDK: corrupted marker, type=%#x\n", Marker.uType));
+                rc = VERR_VD_VMDK_INVALID_STATE;
+                break;
+            }
+            pPipe->uSectorReadAhead += cSectors;
+            if (Marker.uType == VMDK_MARKER_EOS)
+            {
+                /* Read (or mostly skip) to the end of file, see the serial
+                 * code in vmdkStreamReadSequential(). */
+                vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                      VMDK_SECTOR2BYTE(pPipe->uSectorReadAhead) + 511,
+                                      &Marker.uSector, 1);
+                pPipe->fEOS = true;
+            }
+            continue;
+        }
+
+        /* A compressed grain, read it including the marker in one go. */
+        size_t cbCompData = Marker.cbSize + RT_OFFSETOF(VMDKMARKER, uType);
+        if (RT_ALIGN_Z(cbCompData, 512) > pPipe->cbCompGrain)
+        {
+            rc = VERR_VD_VMDK_INVALID_FORMAT;
+            break;
+        }
+
+        PVMDKSTREAMJOB pJob = vmdkStreamPipeNextFree(pPipe);
+        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                   uOffset, pJob->pvCompGrain, cbCompData);
+        if (RT_FAILURE(rc))
+            break;
+        pJob->uLBA = Marker.uSector;
+        pJob->cbCompData = (uint32_t)cbCompData;
+        vmdkStreamPipeQueue(pPipe);
+
+        pPipe->uSectorReadAhead += VMDK_BYTE2SECTOR(RT_ALIGN_Z(cbCompData, 512));
+    }
+
+    return rc;
+}
+
+/**
+ * Internal. Advances the sequential read to the grain containing the given
+ * grain or the next one after it, using the decompressed grains returned by
+ * the worker pool in stream order.
+ */
+static int vmdkStreamPipeReadGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                   uint32_t uGrain)
+{
+    PVMDKSTREAMPIPE pPipe = pExtent->pStreamPipe;
+    int rc = VINF_SUCCESS;
+
+    for (;;)
+    {
+        rc = vmdkStreamPipeFill(pImage, pExtent);
+        if (RT_FAILURE(rc))
+            break;
+
+        if (!pPipe->cJobsPending)
+        {
+            /* End of stream, see the serial code for why cbGrainStreamRead
+             * must be set to a non-zero value. */
+            Assert(pPipe->fEOS);
+            pExtent->uGrain = UINT32_MAX;
+            pExtent->cbGrainStreamRead = 1;
+            break;
+        }
+
+        PVMDKSTREAMJOB pJob = vmdkStreamPipeWaitOldest(pPipe);
+        pPipe->cJobsPending--;
+        rc = pJob->rc;
+        if (RT_FAILURE(rc))
+        {
+            if (rc == VERR_ZIP_CORRUPTED)
+                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
+            break;
+        }
+
+        uint32_t uGrainJob = pJob->uLBA / pExtent->cSectorsPerGrain;
+        if (   pExtent->uGrain
+            && uGrainJob <= pExtent->uGrain)
+        {
+            rc = VERR_VD_VMDK_INVALID_STATE;
+            break;
+        }
+
+        /* Swap buffers instead of copying, the job gets the old one. */
+        void *pvGrain = pExtent->pvGrain;
+        pExtent->pvGrain = pJob->pvGrain;
+        pJob->pvGrain = pvGrain;
+        pExtent->uGrain = uGrainJob;
+        pExtent->cbGrainStreamRead = RT_ALIGN_32(pJob->cbCompData, 512);
+
+        if (uGrainJob >= uGrain)
+            break;
+    }
+
+    if (RT_FAILURE(rc))
+        pExtent->uGrainSectorAbs = 0;
+    return rc;
+}
+
 /**
  * Internal. Reads the contents by sequentially going over the compressed
  * grains (hoping that they are in sequence).
@@ -5072,7 +5618,14 @@ static int vmdkStreamReadSequential(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
 
     /* Check if we need to read something from the image or if what we have
      * in the buffer is good to fulfill the request. */
-    if (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain)
+    if (   pExtent->pStreamPipe
+        && (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain))
+    {
+        rc = vmdkStreamPipeReadGrain(pImage, pExtent, uGrain);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    else if (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain)
     {
         uint32_t uGrainSectorAbs =   pExtent->uGrainSectorAbs
                                    + VMDK_BYTE2SECTOR(pExtent->cbGrainStreamRead);
@@ -5102,39 +5655,25 @@ static int vmdkStreamReadSequential(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
                 if (RT_FAILURE(rc))
                     return rc;
                 Marker.uType = RT_LE2H_U32(Marker.uType);
-                switch (Marker.uType)
+                uint64_t cSectors = vmdkStreamMarkerSectors(pExtent, Marker.uType);
+                if (!cSectors)
+                {
+                    AssertMsgFailed(("VMDK: corrupted marker, type=%#x\n", Marker.uType));
+                    pExtent->uGrainSectorAbs = 0;
+                    return VERR_VD_VMDK_INVALID_STATE;
+                }
+                uGrainSectorAbs += (uint32_t)cSectors;
+                if (Marker.uType == VMDK_MARKER_EOS)
                 {
-                    case VMDK_MARKER_EOS:
-                        uGrainSectorAbs++;
-                        /* Read (or mostly skip) to the end of file. Uses the
-                         * Marker (LBA sector) as it is unused anyway. This
-                         * makes sure that really everything is read in the
-                         * success case. If this read fails it means the image
-                         * is truncated, but this is harmless so ignore. */
-                        vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                                VMDK_SECTOR2BYTE(uGrainSectorAbs)
-                                              + 511,
-                                              &Marker.uSector, 1);
-                        break;
-                    case VMDK_MARKER_GT:
-                        uGrainSectorAbs += 1 + VMDK_BYTE2SECTOR(pExtent->cGTEntries * sizeof(uint32_t));
-                        break;
-                    case VMDK_MARKER_GD:
-                        uGrainSectorAbs += 1 + VMDK_BYTE2SECTOR(RT_ALIGN(pExtent->cGDEntries * sizeof(uint32_t), 512));
-                        break;
-                    case VMDK_MARKER_FOOTER:
-                        uGrainSectorAbs += 2;
-                        break;
-                    case VMDK_MARKER_UNSPECIFIED:
-                        /* Skip over the contents of the unspecified marker
-                         * type 4 which exists in some vSphere created files. */
-                        /** @todo figure out what the payload means. */
-                        uGrainSectorAbs += 1;
-                        break;
-                    default:
-                        AssertMsgFailed(("VMDK: corrupted marker, type=%#x\n", Marker.uType));
-                        pExtent->uGrainSectorAbs = 0;
-                        return VERR_VD_VMDK_INVALID_STATE;
+                    /* Read (or mostly skip) to the end of file. Uses the
+                     * Marker (LBA sector) as it is unused anyway. This
+                     * makes sure that really everything is read in the
+                     * success case. If this read fails it means the image
+                     * is truncated, but this is harmless so ignore. */
+                    vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                            VMDK_SECTOR2BYTE(uGrainSectorAbs)
+                                          + 511,
+                                          &Marker.uSector, 1);
                 }
                 pExtent->cbGrainStreamRead = 0;
             }
@@ -6590,6 +7129,62 @@ static DECLCALLBACK(void) vmdkDump(void *pBackendData)
     }
 }
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocationStatus */
+static DECLCALLBACK(int) vmdkQueryAllocationStatus(void *pBackendData, uint64_t uOffset,
+                                                   uint64_t cbRange, bool *pfAllocated,
+                                                   uint64_t *pcbExtent)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu\n", pBackendData, uOffset, cbRange));
+    PVMDKIMAGE pImage = (PVMDKIMAGE)pBackendData;
+    PVMDKEXTENT pExtent;
+    uint64_t uSectorExtentRel;
+    bool fAllocated = true;
+    uint64_t cbExtent;
+
+    AssertPtr(pImage);
+    AssertReturn(uOffset + cbRange <= pImage->cbSize && cbRange, VERR_INVALID_PARAMETER);
+
+    int rc = vmdkFindExtent(pImage, VMDK_BYTE2SECTOR(uOffset),
+                            &pExtent, &uSectorExtentRel);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* Never go beyond the current extent. */
+    uint64_t uSectorExtentEnd = pExtent->uSectorOffset + pExtent->cNominalSectors;
+    cbExtent = VMDK_SECTOR2BYTE(uSectorExtentEnd - uSectorExtentRel);
+
+    /*
+     * Only the grain directory is kept in memory, so a range is reported as unallocated
+     * only if no grain table is referenced for it. Stream optimized images don't have
+     * a usable grain directory in all cases and are always reported as allocated.
+     */
+    if (   (   pExtent->enmType == VMDKETYPE_HOSTED_SPARSE
+#ifdef VBOX_WITH_VMDK_ESX
+            || pExtent->enmType == VMDKETYPE_ESX_SPARSE
+#endif /* VBOX_WITH_VMDK_ESX */
+           )
+        && !(pImage->uImageFlags & VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED)
+        && pExtent->pGD)
+    {
+        uint64_t uGDIndex = uSectorExtentRel / pExtent->cSectorsPerGDE;
+        uint64_t uSectorGDEEnd;
+
+        fAllocated = pExtent->pGD[uGDIndex] != 0;
+        while (   ++uGDIndex < pExtent->cGDEntries
+               && VMDK_SECTOR2BYTE(uGDIndex * pExtent->cSectorsPerGDE - uSectorExtentRel) < cbRange
+               && (pExtent->pGD[uGDIndex] != 0) == fAllocated)
+            ;
+        uSectorGDEEnd = uGDIndex * pExtent->cSectorsPerGDE;
+        if (uSectorGDEEnd < uSectorExtentEnd)
+            cbExtent = VMDK_SECTOR2BYTE(uSectorGDEEnd - uSectorExtentRel);
+    }
+
+    *pfAllocated = fAllocated;
+    *pcbExtent   = RT_MIN(cbExtent, cbRange);
+    LogFlowFunc(("returns VINF_SUCCESS fAllocated=%RTbool cbExtent=%llu\n", *pfAllocated, *pcbExtent));
+    return VINF_SUCCESS;
+}
+
 
 
 const VBOXHDDBACKEND g_VmdkBackend =
@@ -6689,5 +7284,7 @@ const VBOXHDDBACKEND g_VmdkBackend =
     /* pfnRepair */
     NULL,
     /* pfnTraverseMetadata */
-    NULL
+    NULL,
+    /* pfnQueryAllocationStatus */
+    vmdkQueryAllocationStatus
 };
@@ -2899,6 +2899,7 @@ DECLHIDDEN(void) VDScriptCtxDestroy(VDSCRIPTCTX hScriptCtx)
 
     LogFlowFunc(("hScriptCtx=%p\n", pThis));
 
+    vdScriptCtxCompiledFree(pThis);
     RTStrSpaceDestroy(&pThis->hStrSpaceFn, vdScriptCtxDestroyFnSpace, NULL);
 
     /* Go through list of function ASTs and destroy them. */
@@ -2977,6 +2978,10 @@ DECLHIDDEN(int) VDScriptCtxLoadScript(VDSCRIPTCTX hScriptCtx, const char *pszScr
     AssertPtrReturn(pThis, VERR_INVALID_POINTER);
     AssertPtrReturn(pszScript, VERR_INVALID_POINTER);
 
+    /* New functions invalidate the compiled code, compile again on the next call. */
+    vdScriptCtxCompiledFree(pThis);
+    pThis->fCompileFailed = false;
+
     PVDTOKENIZER pTokenizer = vdScriptTokenizerCreate(pszScript);
     if (pTokenizer)
     {
@@ -2995,5 +3000,28 @@ DECLHIDDEN(int) VDScriptCtxCallFn(VDSCRIPTCTX hScriptCtx, const char *pszFnCall,
 {
     PVDSCRIPTCTXINT pThis = hScriptCtx;
     VDSCRIPTARG Ret;
+
+    AssertPtrReturn(pThis, VERR_INVALID_POINTER);
+
+    if (!pThis->fCompiled && !pThis->fCompileFailed)
+    {
+        int rc = vdScriptCtxCheck(pThis);
+        if (RT_FAILURE(rc) && rc != VERR_NOT_IMPLEMENTED)
+            return rc;
+
+        rc = vdScriptCtxCompile(pThis);
+        if (rc == VERR_NOT_SUPPORTED)
+        {
+            /* Use the AST interpreter for constructs the compiler can't handle yet. */
+            LogRel(("VDScript: Falling back to the interpreter\n"));
+            pThis->fCompileFailed = true;
+        }
+        else if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    if (pThis->fCompiled)
+        return vdScriptCtxExecute(pThis, pszFnCall, paArgs, cArgs, &Ret);
+
     return vdScriptCtxInterprete(pThis, pszFnCall, paArgs, cArgs, &Ret);
 }
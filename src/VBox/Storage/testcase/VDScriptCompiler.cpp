@@ -0,0 +1,1238 @@
+/** $Id$ */
+/** @file
+ *
+ * VBox HDD container test utility - scripting engine, bytecode compiler and virtual machine.
+ */
+
+/*
+ * Copyright (C) 2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+#define LOGGROUP LOGGROUP_DEFAULT
+#include <iprt/list.h>
+#include <iprt/mem.h>
+#include <iprt/assert.h>
+#include <iprt/string.h>
+#include <iprt/stream.h>
+
+#include <VBox/log.h>
+
+#include "VDScriptAst.h"
+#include "VDScriptStack.h"
+#include "VDScriptInternal.h"
+
+/** Marks the end of a list of jumps waiting for their target. */
+#define VDSCRIPTBC_PATCH_END UINT32_MAX
+
+/**
+ * Bytecode operations.
+ */
+typedef enum VDSCRIPTBCOP
+{
+    /** Invalid operation. */
+    VDSCRIPTBCOP_INVALID = 0,
+    /** Push the constant stored in the instruction. */
+    VDSCRIPTBCOP_PUSH_CONST,
+    /** Push the value of a local variable. */
+    VDSCRIPTBCOP_LOAD,
+    /** Store the topmost value in a local variable, the value stays on the stack. */
+    VDSCRIPTBCOP_STORE,
+    /** Discard the topmost value. */
+    VDSCRIPTBCOP_POP,
+    /** Unconditional jump. */
+    VDSCRIPTBCOP_JMP,
+    /** Pop the topmost value and jump if it is false. */
+    VDSCRIPTBCOP_JMP_FALSE,
+    /** Pop the topmost value and jump if it is true. */
+    VDSCRIPTBCOP_JMP_TRUE,
+    /** Unary operation on the topmost value. */
+    VDSCRIPTBCOP_UNARY,
+    /** Binary operation on the two topmost values. */
+    VDSCRIPTBCOP_BINARY,
+    /** Call an external function with the arguments on top of the stack. */
+    VDSCRIPTBCOP_CALL_EXT,
+    /** Call a function defined in the script. */
+    VDSCRIPTBCOP_CALL,
+    /** Return from the current function with the topmost value. */
+    VDSCRIPTBCOP_RET,
+    /** 32bit blowup. */
+    VDSCRIPTBCOP_32BIT_HACK = 0x7fffffff
+} VDSCRIPTBCOP;
+
+/**
+ * One bytecode instruction.
+ */
+typedef struct VDSCRIPTBCINSN
+{
+    /** The operation. */
+    VDSCRIPTBCOP                enmOp;
+    /** Operation dependent data. */
+    union
+    {
+        /** Local variable index for load and store operations. */
+        uint32_t                idxVar;
+        /** Instruction index of the jump target. */
+        uint32_t                idxTarget;
+        /** Expression type of unary and binary operations. */
+        VDSCRIPTEXPRTYPE        enmExprType;
+        /** Number of arguments for function calls. */
+        uint32_t                cArgs;
+    };
+    /** Operation dependent data. */
+    union
+    {
+        /** The constant to push. */
+        VDSCRIPTARG             Const;
+        /** The external function to call. */
+        PVDSCRIPTFN             pFn;
+        /** The script function to call. */
+        struct VDSCRIPTBCFN    *pBcFn;
+    };
+} VDSCRIPTBCINSN;
+/** Pointer to a bytecode instruction. */
+typedef VDSCRIPTBCINSN *PVDSCRIPTBCINSN;
+/** Pointer to a const bytecode instruction. */
+typedef const VDSCRIPTBCINSN *PCVDSCRIPTBCINSN;
+
+/**
+ * Compiled script function.
+ */
+typedef struct VDSCRIPTBCFN
+{
+    /** The AST of the function. */
+    PVDSCRIPTASTFN              pAstFn;
+    /** Number of arguments the function takes. */
+    unsigned                    cArgs;
+    /** Number of instructions. */
+    unsigned                    cInsns;
+    /** Number of instructions the array can hold. */
+    unsigned                    cInsnsMax;
+    /** The instructions. */
+    PVDSCRIPTBCINSN             paInsns;
+} VDSCRIPTBCFN;
+/** Pointer to a compiled script function. */
+typedef VDSCRIPTBCFN *PVDSCRIPTBCFN;
+
+/**
+ * Loop being compiled, for break and continue statements.
+ */
+typedef struct VDSCRIPTBCLOOP
+{
+    /** The enclosing loop if any. */
+    struct VDSCRIPTBCLOOP      *pPrev;
+    /** List of jumps to the end of the loop. */
+    uint32_t                    idxPatchBreak;
+    /** List of jumps to the next iteration of the loop. */
+    uint32_t                    idxPatchContinue;
+} VDSCRIPTBCLOOP;
+/** Pointer to a loop being compiled. */
+typedef VDSCRIPTBCLOOP *PVDSCRIPTBCLOOP;
+
+/**
+ * Compiler state.
+ */
+typedef struct VDSCRIPTBCCOMP
+{
+    /** The script context. */
+    PVDSCRIPTCTXINT             pScriptCtx;
+    /** The function being compiled. */
+    PVDSCRIPTBCFN               pBcFn;
+    /** Innermost loop being compiled. */
+    PVDSCRIPTBCLOOP             pLoop;
+} VDSCRIPTBCCOMP;
+/** Pointer to the compiler state. */
+typedef VDSCRIPTBCCOMP *PVDSCRIPTBCCOMP;
+
+/**
+ * Call frame of the virtual machine.
+ */
+typedef struct VDSCRIPTBCFRAME
+{
+    /** The function of the caller. */
+    PVDSCRIPTBCFN               pBcFn;
+    /** Instruction to continue with in the caller. */
+    uint32_t                    idxInsn;
+    /** Index of the first local variable of the caller on the value stack. */
+    uint32_t                    idxBase;
+} VDSCRIPTBCFRAME;
+/** Pointer to a call frame. */
+typedef VDSCRIPTBCFRAME *PVDSCRIPTBCFRAME;
+
+static int vdScriptBcCompileExpr(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExpr);
+static int vdScriptBcCompileStmt(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTSTMT pStmt);
+
+/**
+ * Record an error while compiling or executing.
+ *
+ * @returns VBox status code passed.
+ * @param   rc         The status code to record.
+ * @param   pPos       Position in the script the error relates to, optional.
+ * @param   pszFmt     Format string.
+ */
+static int vdScriptBcError(int rc, PVDSRCPOS pPos, const char *pszFmt, ...)
+{
+    va_list va;
+
+    if (pPos)
+        RTPrintf("Script line %u: ", pPos->iLine);
+    va_start(va, pszFmt);
+    RTPrintfV(pszFmt, va);
+    va_end(va);
+    return rc;
+}
+
+/**
+ * Records a construct the compiler can't handle yet. This is not an error
+ * in the script, the caller falls back to the AST interpreter.
+ *
+ * @returns VERR_NOT_SUPPORTED.
+ * @param   pPos       Position of the construct in the script.
+ * @param   pszWhat    Description of the construct.
+ * @param   iType      The AST node type.
+ */
+static int vdScriptBcNotSupported(PVDSRCPOS pPos, const char *pszWhat, int iType)
+{
+    LogRel(("VDScript: Line %u: %s type %d is not supported by the compiler\n", pPos->iLine, pszWhat, iType));
+    return VERR_NOT_SUPPORTED;
+}
+
+/**
+ * Returns the given integer or boolean value as an unsigned 64bit value.
+ */
+static uint64_t vdScriptBcArgToU64(const VDSCRIPTARG *pArg)
+{
+    switch (pArg->enmType)
+    {
+        case VDSCRIPTTYPE_UINT8:  return pArg->u8;
+        case VDSCRIPTTYPE_INT8:   return (uint64_t)(int64_t)pArg->i8;
+        case VDSCRIPTTYPE_UINT16: return pArg->u16;
+        case VDSCRIPTTYPE_INT16:  return (uint64_t)(int64_t)pArg->i16;
+        case VDSCRIPTTYPE_UINT32: return pArg->u32;
+        case VDSCRIPTTYPE_INT32:  return (uint64_t)(int64_t)pArg->i32;
+        case VDSCRIPTTYPE_UINT64: return pArg->u64;
+        case VDSCRIPTTYPE_INT64:  return (uint64_t)pArg->i64;
+        case VDSCRIPTTYPE_BOOL:   return pArg->f;
+        default:                  return 0;
+    }
+}
+
+/**
+ * Checks whether the value can be used in arithmetic operations.
+ */
+DECLINLINE(bool) vdScriptBcArgIsNumeric(const VDSCRIPTARG *pArg)
+{
+    return    pArg->enmType >= VDSCRIPTTYPE_UINT8
+           && pArg->enmType <= VDSCRIPTTYPE_INT64;
+}
+
+/**
+ * Evaluates a unary operation, shared by the constant folding and the
+ * virtual machine so both yield the same results.
+ *
+ * @returns VBox status code.
+ * @param   enmExprType    The operation.
+ * @param   pVal           The operand, replaced by the result.
+ */
+static int vdScriptBcEvalUnary(VDSCRIPTEXPRTYPE enmExprType, PVDSCRIPTARG pVal)
+{
+    if (enmExprType == VDSCRIPTEXPRTYPE_UNARY_NEGATE)
+    {
+        if (pVal->enmType != VDSCRIPTTYPE_BOOL && !vdScriptBcArgIsNumeric(pVal))
+            return VERR_INVALID_PARAMETER;
+        pVal->f       = !vdScriptBcArgToU64(pVal);
+        pVal->enmType = VDSCRIPTTYPE_BOOL;
+        return VINF_SUCCESS;
+    }
+
+    if (!vdScriptBcArgIsNumeric(pVal))
+        return VERR_INVALID_PARAMETER;
+
+    uint64_t u64 = vdScriptBcArgToU64(pVal);
+    switch (enmExprType)
+    {
+        case VDSCRIPTEXPRTYPE_UNARY_POSSIGN: break;
+        case VDSCRIPTEXPRTYPE_UNARY_NEGSIGN: u64 = (uint64_t)-(int64_t)u64; break;
+        case VDSCRIPTEXPRTYPE_UNARY_INVERT:  u64 = ~u64; break;
+        default:
+            AssertMsgFailedReturn(("Invalid unary operation %d\n", enmExprType), VERR_INVALID_PARAMETER);
+    }
+
+    pVal->enmType = VDSCRIPTTYPE_UINT64;
+    pVal->u64     = u64;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Evaluates a binary operation, shared by the constant folding and the
+ * virtual machine so both yield the same results.
+ *
+ * @returns VBox status code.
+ * @param   enmExprType    The operation.
+ * @param   pLeft          The left operand, replaced by the result.
+ * @param   pRight         The right operand.
+ */
+static int vdScriptBcEvalBinary(VDSCRIPTEXPRTYPE enmExprType, PVDSCRIPTARG pLeft, const VDSCRIPTARG *pRight)
+{
+    /* Strings and booleans can only be compared for equality. */
+    if (   (   enmExprType == VDSCRIPTEXPRTYPE_EQUAL
+            || enmExprType == VDSCRIPTEXPRTYPE_NOTEQUAL)
+        && (   pLeft->enmType == VDSCRIPTTYPE_STRING
+            || pRight->enmType == VDSCRIPTTYPE_STRING))
+    {
+        if (pLeft->enmType != pRight->enmType)
+            return VERR_INVALID_PARAMETER;
+        bool fEqual = !RTStrCmp(pLeft->psz, pRight->psz);
+        pLeft->enmType = VDSCRIPTTYPE_BOOL;
+        pLeft->f       = enmExprType == VDSCRIPTEXPRTYPE_EQUAL ? fEqual : !fEqual;
+        return VINF_SUCCESS;
+    }
+
+    if (   (pLeft->enmType != VDSCRIPTTYPE_BOOL && !vdScriptBcArgIsNumeric(pLeft))
+        || (pRight->enmType != VDSCRIPTTYPE_BOOL && !vdScriptBcArgIsNumeric(pRight)))
+        return VERR_INVALID_PARAMETER;
+
+    uint64_t u64Left  = vdScriptBcArgToU64(pLeft);
+    uint64_t u64Right = vdScriptBcArgToU64(pRight);
+    bool fBoolResult  = true;
+    bool f = false;
+
+    switch (enmExprType)
+    {
+        case VDSCRIPTEXPRTYPE_LOWER:        f = u64Left <  u64Right; break;
+        case VDSCRIPTEXPRTYPE_HIGHER:       f = u64Left >  u64Right; break;
+        case VDSCRIPTEXPRTYPE_LOWEREQUAL:   f = u64Left <= u64Right; break;
+        case VDSCRIPTEXPRTYPE_HIGHEREQUAL:  f = u64Left >= u64Right; break;
+        case VDSCRIPTEXPRTYPE_EQUAL:        f = u64Left == u64Right; break;
+        case VDSCRIPTEXPRTYPE_NOTEQUAL:     f = u64Left != u64Right; break;
+        default:
+        {
+            fBoolResult = false;
+            switch (enmExprType)
+            {
+                case VDSCRIPTEXPRTYPE_MULTIPLICATION: u64Left *= u64Right; break;
+                case VDSCRIPTEXPRTYPE_DIVISION:
+                case VDSCRIPTEXPRTYPE_MODULUS:
+                    if (!u64Right)
+                        return VERR_INVALID_PARAMETER;
+                    if (enmExprType == VDSCRIPTEXPRTYPE_DIVISION)
+                        u64Left /= u64Right;
+                    else
+                        u64Left %= u64Right;
+                    break;
+                case VDSCRIPTEXPRTYPE_ADDITION:    u64Left += u64Right; break;
+                case VDSCRIPTEXPRTYPE_SUBTRACTION: u64Left -= u64Right; break;
+                case VDSCRIPTEXPRTYPE_LSR:         u64Left = u64Right < 64 ? u64Left >> u64Right : 0; break;
+                case VDSCRIPTEXPRTYPE_LSL:         u64Left = u64Right < 64 ? u64Left << u64Right : 0; break;
+                case VDSCRIPTEXPRTYPE_BITWISE_AND: u64Left &= u64Right; break;
+                case VDSCRIPTEXPRTYPE_BITWISE_XOR: u64Left ^= u64Right; break;
+                case VDSCRIPTEXPRTYPE_BITWISE_OR:  u64Left |= u64Right; break;
+                default:
+                    AssertMsgFailedReturn(("Invalid binary operation %d\n", enmExprType), VERR_INVALID_PARAMETER);
+            }
+        }
+    }
+
+    if (fBoolResult)
+    {
+        pLeft->enmType = VDSCRIPTTYPE_BOOL;
+        pLeft->f       = f;
+    }
+    else
+    {
+        pLeft->enmType = VDSCRIPTTYPE_UINT64;
+        pLeft->u64     = u64Left;
+    }
+    return VINF_SUCCESS;
+}
+
+/**
+ * Appends a new instruction to the function being compiled.
+ *
+ * @returns Pointer to the new zeroed instruction, NULL if out of memory.
+ * @param   pThis      The compiler state.
+ * @param   enmOp      The operation of the instruction.
+ */
+static PVDSCRIPTBCINSN vdScriptBcEmit(PVDSCRIPTBCCOMP pThis, VDSCRIPTBCOP enmOp)
+{
+    PVDSCRIPTBCFN pBcFn = pThis->pBcFn;
+
+    if (pBcFn->cInsns == pBcFn->cInsnsMax)
+    {
+        unsigned cInsnsMaxNew = pBcFn->cInsnsMax + 64;
+        PVDSCRIPTBCINSN paInsnsNew = (PVDSCRIPTBCINSN)RTMemRealloc(pBcFn->paInsns, cInsnsMaxNew * sizeof(VDSCRIPTBCINSN));
+        if (!paInsnsNew)
+            return NULL;
+        pBcFn->paInsns   = paInsnsNew;
+        pBcFn->cInsnsMax = cInsnsMaxNew;
+    }
+
+    PVDSCRIPTBCINSN pInsn = &pBcFn->paInsns[pBcFn->cInsns++];
+    RT_ZERO(*pInsn);
+    pInsn->enmOp = enmOp;
+    return pInsn;
+}
+
+/**
+ * Appends an instruction taking a 32bit operand.
+ */
+static int vdScriptBcEmitU32(PVDSCRIPTBCCOMP pThis, VDSCRIPTBCOP enmOp, uint32_t u32)
+{
+    PVDSCRIPTBCINSN pInsn = vdScriptBcEmit(pThis, enmOp);
+    if (!pInsn)
+        return VERR_NO_MEMORY;
+    pInsn->idxVar = u32;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Appends an instruction pushing the given constant.
+ */
+static int vdScriptBcEmitConst(PVDSCRIPTBCCOMP pThis, const VDSCRIPTARG *pConst)
+{
+    PVDSCRIPTBCINSN pInsn = vdScriptBcEmit(pThis, VDSCRIPTBCOP_PUSH_CONST);
+    if (!pInsn)
+        return VERR_NO_MEMORY;
+    pInsn->Const = *pConst;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Appends a jump with a still unknown target, linking it into the given
+ * patch list.
+ */
+static int vdScriptBcEmitJmpPatch(PVDSCRIPTBCCOMP pThis, VDSCRIPTBCOP enmOp, uint32_t *pidxPatch)
+{
+    uint32_t idxInsn = pThis->pBcFn->cInsns;
+    int rc = vdScriptBcEmitU32(pThis, enmOp, *pidxPatch);
+    if (RT_SUCCESS(rc))
+        *pidxPatch = idxInsn;
+    return rc;
+}
+
+/**
+ * Resolves all jumps in the given patch list to the given target.
+ */
+static void vdScriptBcPatch(PVDSCRIPTBCCOMP pThis, uint32_t idxPatch, uint32_t idxTarget)
+{
+    while (idxPatch != VDSCRIPTBC_PATCH_END)
+    {
+        PVDSCRIPTBCINSN pInsn = &pThis->pBcFn->paInsns[idxPatch];
+        idxPatch = pInsn->idxTarget;
+        pInsn->idxTarget = idxTarget;
+    }
+}
+
+/**
+ * Returns the local variable index of the given identifier in the function
+ * being compiled. Only the function arguments can be referenced, as the
+ * parser does not support declarations yet.
+ */
+static int vdScriptBcResolveVar(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTIDE pIde, uint32_t *pidxVar)
+{
+    PVDSCRIPTASTFN pAstFn = pThis->pBcFn->pAstFn;
+    PVDSCRIPTASTFNARG pArg;
+    uint32_t idxVar = 0;
+
+    RTListForEach(&pAstFn->ListArgs, pArg, VDSCRIPTASTFNARG, Core.ListNode)
+    {
+        if (!RTStrCmp(pArg->pArgIde->aszIde, pIde->aszIde))
+        {
+            *pidxVar = idxVar;
+            return VINF_SUCCESS;
+        }
+        idxVar++;
+    }
+
+    return vdScriptBcError(VERR_NOT_FOUND, &pIde->Core.Pos, "Unknown identifier \"%s\"\n", pIde->aszIde);
+}
+
+/**
+ * Returns the binary operation an assignment expression performs, or
+ * VDSCRIPTEXPRTYPE_INVALID for a plain assignment.
+ */
+static VDSCRIPTEXPRTYPE vdScriptBcAssignOp(VDSCRIPTEXPRTYPE enmExprType)
+{
+    switch (enmExprType)
+    {
+        case VDSCRIPTEXPRTYPE_ASSIGN_MULT: return VDSCRIPTEXPRTYPE_MULTIPLICATION;
+        case VDSCRIPTEXPRTYPE_ASSIGN_DIV:  return VDSCRIPTEXPRTYPE_DIVISION;
+        case VDSCRIPTEXPRTYPE_ASSIGN_MOD:  return VDSCRIPTEXPRTYPE_MODULUS;
+        case VDSCRIPTEXPRTYPE_ASSIGN_ADD:  return VDSCRIPTEXPRTYPE_ADDITION;
+        case VDSCRIPTEXPRTYPE_ASSIGN_SUB:  return VDSCRIPTEXPRTYPE_SUBTRACTION;
+        case VDSCRIPTEXPRTYPE_ASSIGN_LSL:  return VDSCRIPTEXPRTYPE_LSL;
+        case VDSCRIPTEXPRTYPE_ASSIGN_LSR:  return VDSCRIPTEXPRTYPE_LSR;
+        case VDSCRIPTEXPRTYPE_ASSIGN_AND:  return VDSCRIPTEXPRTYPE_BITWISE_AND;
+        case VDSCRIPTEXPRTYPE_ASSIGN_XOR:  return VDSCRIPTEXPRTYPE_BITWISE_XOR;
+        case VDSCRIPTEXPRTYPE_ASSIGN_OR:   return VDSCRIPTEXPRTYPE_BITWISE_OR;
+        default:                           return VDSCRIPTEXPRTYPE_INVALID;
+    }
+}
+
+/**
+ * Compiles an assignment, increment or decrement of a variable.
+ *
+ * @returns VBox status code.
+ * @param   pThis          The compiler state.
+ * @param   pExpr          The expression, used for error reporting.
+ * @param   pExprVar       The expression denoting the variable.
+ * @param   pExprValue     The value to assign or combine, NULL for increment and decrement.
+ * @param   enmOp          The binary operation to combine the old value with,
+ *                         VDSCRIPTEXPRTYPE_INVALID for a plain assignment.
+ * @param   fPostfix       Whether the old value is the result of the expression.
+ */
+static int vdScriptBcCompileAssign(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExpr, PVDSCRIPTASTEXPR pExprVar,
+                                   PVDSCRIPTASTEXPR pExprValue, VDSCRIPTEXPRTYPE enmOp, bool fPostfix)
+{
+    uint32_t idxVar = 0;
+
+    if (pExprVar->enmType != VDSCRIPTEXPRTYPE_PRIMARY_IDENTIFIER)
+        return vdScriptBcNotSupported(&pExpr->Core.Pos, "Assignment to expression", pExprVar->enmType);
+
+    int rc = vdScriptBcResolveVar(pThis, pExprVar->pIde, &idxVar);
+    if (RT_SUCCESS(rc) && fPostfix)
+        rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_LOAD, idxVar);
+    if (RT_SUCCESS(rc) && enmOp != VDSCRIPTEXPRTYPE_INVALID)
+        rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_LOAD, idxVar);
+    if (RT_SUCCESS(rc))
+    {
+        if (pExprValue)
+            rc = vdScriptBcCompileExpr(pThis, pExprValue);
+        else
+        {
+            VDSCRIPTARG One;
+            One.enmType = VDSCRIPTTYPE_UINT64;
+            One.u64     = 1;
+            rc = vdScriptBcEmitConst(pThis, &One);
+        }
+    }
+    if (RT_SUCCESS(rc) && enmOp != VDSCRIPTEXPRTYPE_INVALID)
+        rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_BINARY, enmOp);
+    if (RT_SUCCESS(rc))
+        rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_STORE, idxVar);
+    if (RT_SUCCESS(rc) && fPostfix)
+        rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_POP, 0);
+
+    return rc;
+}
+
+/**
+ * Compiles a function call expression, checking the number of arguments.
+ */
+static int vdScriptBcCompileFnCall(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExpr)
+{
+    PVDSCRIPTASTEXPR pExprFn = pExpr->FnCall.pFnIde;
+
+    if (pExprFn->enmType != VDSCRIPTEXPRTYPE_PRIMARY_IDENTIFIER)
+        return vdScriptBcNotSupported(&pExpr->Core.Pos, "Call through expression", pExprFn->enmType);
+
+    PVDSCRIPTFN pFn = (PVDSCRIPTFN)RTStrSpaceGet(&pThis->pScriptCtx->hStrSpaceFn, pExprFn->pIde->aszIde);
+    if (!pFn)
+        return vdScriptBcError(VERR_NOT_FOUND, &pExpr->Core.Pos, "Unknown function \"%s\"\n", pExprFn->pIde->aszIde);
+
+    int rc = VINF_SUCCESS;
+    uint32_t cArgs = 0;
+    PVDSCRIPTASTEXPR pArg;
+    RTListForEach(&pExpr->FnCall.ListArgs, pArg, VDSCRIPTASTEXPR, Core.ListNode)
+    {
+        rc = vdScriptBcCompileExpr(pThis, pArg);
+        if (RT_FAILURE(rc))
+            return rc;
+        cArgs++;
+    }
+
+    unsigned cArgsExpected = pFn->fExternal ? pFn->cArgs : pFn->Type.Internal.pBcFn->cArgs;
+    if (cArgs != cArgsExpected)
+        return vdScriptBcError(VERR_INVALID_PARAMETER, &pExpr->Core.Pos,
+                               "Function \"%s\" expects %u arguments, got %u\n",
+                               pExprFn->pIde->aszIde, cArgsExpected, cArgs);
+
+    PVDSCRIPTBCINSN pInsn = vdScriptBcEmit(pThis, pFn->fExternal ? VDSCRIPTBCOP_CALL_EXT : VDSCRIPTBCOP_CALL);
+    if (!pInsn)
+        return VERR_NO_MEMORY;
+    pInsn->cArgs = cArgs;
+    if (pFn->fExternal)
+        pInsn->pFn = pFn;
+    else
+        pInsn->pBcFn = pFn->Type.Internal.pBcFn;
+    return rc;
+}
+
+/**
+ * Compiles an expression leaving exactly one value on the stack. Operations
+ * on constants are folded into a single constant.
+ *
+ * @returns VBox status code.
+ * @param   pThis      The compiler state.
+ * @param   pExpr      The expression to compile.
+ */
+static int vdScriptBcCompileExpr(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExpr)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t idxStart = pThis->pBcFn->cInsns;
+
+    switch (pExpr->enmType)
+    {
+        case VDSCRIPTEXPRTYPE_PRIMARY_NUMCONST:
+        {
+            VDSCRIPTARG NumConst;
+            NumConst.enmType = VDSCRIPTTYPE_UINT64;
+            NumConst.u64     = pExpr->u64;
+            rc = vdScriptBcEmitConst(pThis, &NumConst);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_PRIMARY_STRINGCONST:
+        {
+            VDSCRIPTARG StringConst;
+            StringConst.enmType = VDSCRIPTTYPE_STRING;
+            StringConst.psz     = pExpr->pszStr;
+            rc = vdScriptBcEmitConst(pThis, &StringConst);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_PRIMARY_BOOLEAN:
+        {
+            VDSCRIPTARG BoolConst;
+            BoolConst.enmType = VDSCRIPTTYPE_BOOL;
+            BoolConst.f       = pExpr->f;
+            rc = vdScriptBcEmitConst(pThis, &BoolConst);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_PRIMARY_IDENTIFIER:
+        {
+            uint32_t idxVar = 0;
+            rc = vdScriptBcResolveVar(pThis, pExpr->pIde, &idxVar);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_LOAD, idxVar);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_POSTFIX_FNCALL:
+            rc = vdScriptBcCompileFnCall(pThis, pExpr);
+            break;
+        case VDSCRIPTEXPRTYPE_POSTFIX_INCREMENT:
+        case VDSCRIPTEXPRTYPE_POSTFIX_DECREMENT:
+        case VDSCRIPTEXPRTYPE_UNARY_INCREMENT:
+        case VDSCRIPTEXPRTYPE_UNARY_DECREMENT:
+            rc = vdScriptBcCompileAssign(pThis, pExpr, pExpr->pExpr, NULL,
+                                            pExpr->enmType == VDSCRIPTEXPRTYPE_POSTFIX_INCREMENT
+                                         || pExpr->enmType == VDSCRIPTEXPRTYPE_UNARY_INCREMENT
+                                         ? VDSCRIPTEXPRTYPE_ADDITION : VDSCRIPTEXPRTYPE_SUBTRACTION,
+                                            pExpr->enmType == VDSCRIPTEXPRTYPE_POSTFIX_INCREMENT
+                                         || pExpr->enmType == VDSCRIPTEXPRTYPE_POSTFIX_DECREMENT);
+            break;
+        case VDSCRIPTEXPRTYPE_UNARY_POSSIGN:
+        case VDSCRIPTEXPRTYPE_UNARY_NEGSIGN:
+        case VDSCRIPTEXPRTYPE_UNARY_INVERT:
+        case VDSCRIPTEXPRTYPE_UNARY_NEGATE:
+        {
+            rc = vdScriptBcCompileExpr(pThis, pExpr->pExpr);
+            if (RT_FAILURE(rc))
+                break;
+
+            /* Fold into the constant if the operand is one. */
+            PVDSCRIPTBCINSN pInsn = &pThis->pBcFn->paInsns[pThis->pBcFn->cInsns - 1];
+            if (   pThis->pBcFn->cInsns == idxStart + 1
+                && pInsn->enmOp == VDSCRIPTBCOP_PUSH_CONST)
+            {
+                rc = vdScriptBcEvalUnary(pExpr->enmType, &pInsn->Const);
+                if (RT_FAILURE(rc))
+                    rc = vdScriptBcError(rc, &pExpr->Core.Pos, "Invalid operand for unary operation\n");
+            }
+            else
+                rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_UNARY, pExpr->enmType);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_MULTIPLICATION:
+        case VDSCRIPTEXPRTYPE_DIVISION:
+        case VDSCRIPTEXPRTYPE_MODULUS:
+        case VDSCRIPTEXPRTYPE_ADDITION:
+        case VDSCRIPTEXPRTYPE_SUBTRACTION:
+        case VDSCRIPTEXPRTYPE_LSR:
+        case VDSCRIPTEXPRTYPE_LSL:
+        case VDSCRIPTEXPRTYPE_LOWER:
+        case VDSCRIPTEXPRTYPE_HIGHER:
+        case VDSCRIPTEXPRTYPE_LOWEREQUAL:
+        case VDSCRIPTEXPRTYPE_HIGHEREQUAL:
+        case VDSCRIPTEXPRTYPE_EQUAL:
+        case VDSCRIPTEXPRTYPE_NOTEQUAL:
+        case VDSCRIPTEXPRTYPE_BITWISE_AND:
+        case VDSCRIPTEXPRTYPE_BITWISE_XOR:
+        case VDSCRIPTEXPRTYPE_BITWISE_OR:
+        {
+            rc = vdScriptBcCompileExpr(pThis, pExpr->BinaryOp.pLeftExpr);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcCompileExpr(pThis, pExpr->BinaryOp.pRightExpr);
+            if (RT_FAILURE(rc))
+                break;
+
+            /* Fold into one constant if both operands are constants. */
+            PVDSCRIPTBCINSN paInsns = pThis->pBcFn->paInsns;
+            if (   pThis->pBcFn->cInsns == idxStart + 2
+                && paInsns[idxStart].enmOp == VDSCRIPTBCOP_PUSH_CONST
+                && paInsns[idxStart + 1].enmOp == VDSCRIPTBCOP_PUSH_CONST)
+            {
+                rc = vdScriptBcEvalBinary(pExpr->enmType, &paInsns[idxStart].Const, &paInsns[idxStart + 1].Const);
+                if (RT_FAILURE(rc))
+                    rc = vdScriptBcError(rc, &pExpr->Core.Pos, "Invalid operands for binary operation\n");
+                pThis->pBcFn->cInsns--;
+            }
+            else
+                rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_BINARY, pExpr->enmType);
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_LOGICAL_AND:
+        case VDSCRIPTEXPRTYPE_LOGICAL_OR:
+        {
+            /*
+             * Short circuit evaluation:
+             *     left; JMP_FALSE/JMP_TRUE Short; right; JMP End; Short: PUSH false/true; End:
+             */
+            bool fAnd = pExpr->enmType == VDSCRIPTEXPRTYPE_LOGICAL_AND;
+            uint32_t idxPatchShort = VDSCRIPTBC_PATCH_END;
+            uint32_t idxPatchEnd = VDSCRIPTBC_PATCH_END;
+
+            rc = vdScriptBcCompileExpr(pThis, pExpr->BinaryOp.pLeftExpr);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcEmitJmpPatch(pThis, fAnd ? VDSCRIPTBCOP_JMP_FALSE : VDSCRIPTBCOP_JMP_TRUE, &idxPatchShort);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcCompileExpr(pThis, pExpr->BinaryOp.pRightExpr);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcEmitJmpPatch(pThis, VDSCRIPTBCOP_JMP, &idxPatchEnd);
+            if (RT_SUCCESS(rc))
+            {
+                vdScriptBcPatch(pThis, idxPatchShort, pThis->pBcFn->cInsns);
+
+                VDSCRIPTARG BoolConst;
+                BoolConst.enmType = VDSCRIPTTYPE_BOOL;
+                BoolConst.f       = !fAnd;
+                rc = vdScriptBcEmitConst(pThis, &BoolConst);
+                vdScriptBcPatch(pThis, idxPatchEnd, pThis->pBcFn->cInsns);
+            }
+            break;
+        }
+        case VDSCRIPTEXPRTYPE_ASSIGN:
+        case VDSCRIPTEXPRTYPE_ASSIGN_MULT:
+        case VDSCRIPTEXPRTYPE_ASSIGN_DIV:
+        case VDSCRIPTEXPRTYPE_ASSIGN_MOD:
+        case VDSCRIPTEXPRTYPE_ASSIGN_ADD:
+        case VDSCRIPTEXPRTYPE_ASSIGN_SUB:
+        case VDSCRIPTEXPRTYPE_ASSIGN_LSL:
+        case VDSCRIPTEXPRTYPE_ASSIGN_LSR:
+        case VDSCRIPTEXPRTYPE_ASSIGN_AND:
+        case VDSCRIPTEXPRTYPE_ASSIGN_XOR:
+        case VDSCRIPTEXPRTYPE_ASSIGN_OR:
+            rc = vdScriptBcCompileAssign(pThis, pExpr, pExpr->BinaryOp.pLeftExpr, pExpr->BinaryOp.pRightExpr,
+                                         vdScriptBcAssignOp(pExpr->enmType), false /* fPostfix */);
+            break;
+        default:
+            /* Pointers, structures, casts and assignment lists are not there yet. */
+            rc = vdScriptBcNotSupported(&pExpr->Core.Pos, "Expression", pExpr->enmType);
+    }
+
+    return rc;
+}
+
+/**
+ * Compiles a condition, jumping to the given patch list if it is false.
+ */
+static int vdScriptBcCompileCond(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExprCond, uint32_t *pidxPatchFalse)
+{
+    uint32_t idxStart = pThis->pBcFn->cInsns;
+    int rc = vdScriptBcCompileExpr(pThis, pExprCond);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* A constant condition doesn't need to be checked at runtime. */
+    PVDSCRIPTBCINSN pInsn = &pThis->pBcFn->paInsns[pThis->pBcFn->cInsns - 1];
+    if (   pThis->pBcFn->cInsns == idxStart + 1
+        && pInsn->enmOp == VDSCRIPTBCOP_PUSH_CONST
+        && pInsn->Const.enmType == VDSCRIPTTYPE_BOOL)
+    {
+        bool f = pInsn->Const.f;
+        pThis->pBcFn->cInsns--;
+        return f ? VINF_SUCCESS : vdScriptBcEmitJmpPatch(pThis, VDSCRIPTBCOP_JMP, pidxPatchFalse);
+    }
+
+    return vdScriptBcEmitJmpPatch(pThis, VDSCRIPTBCOP_JMP_FALSE, pidxPatchFalse);
+}
+
+/**
+ * Compiles an expression statement or loop expression, discarding the result.
+ */
+static int vdScriptBcCompileExprDiscard(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTEXPR pExpr)
+{
+    int rc = VINF_SUCCESS;
+
+    if (pExpr)
+    {
+        rc = vdScriptBcCompileExpr(pThis, pExpr);
+        if (RT_SUCCESS(rc))
+            rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_POP, 0);
+    }
+    return rc;
+}
+
+/**
+ * Compiles a loop body, resolving break and continue statements in it.
+ *
+ * @returns VBox status code.
+ * @param   pThis              The compiler state.
+ * @param   pStmt              The loop body.
+ * @param   pLoop              The loop state to use.
+ */
+static int vdScriptBcCompileLoopBody(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTSTMT pStmt, PVDSCRIPTBCLOOP pLoop)
+{
+    pLoop->pPrev            = pThis->pLoop;
+    pLoop->idxPatchBreak    = VDSCRIPTBC_PATCH_END;
+    pLoop->idxPatchContinue = VDSCRIPTBC_PATCH_END;
+    pThis->pLoop = pLoop;
+    int rc = vdScriptBcCompileStmt(pThis, pStmt);
+    pThis->pLoop = pLoop->pPrev;
+    return rc;
+}
+
+/**
+ * Compiles a statement.
+ *
+ * @returns VBox status code.
+ * @param   pThis      The compiler state.
+ * @param   pStmt      The statement to compile.
+ */
+static int vdScriptBcCompileStmt(PVDSCRIPTBCCOMP pThis, PVDSCRIPTASTSTMT pStmt)
+{
+    int rc = VINF_SUCCESS;
+
+    switch (pStmt->enmStmtType)
+    {
+        case VDSCRIPTSTMTTYPE_COMPOUND:
+        {
+            if (!RTListIsEmpty(&pStmt->Compound.ListDecls))
+                return vdScriptBcNotSupported(&pStmt->Core.Pos, "Declaration in statement", pStmt->enmStmtType);
+
+            PVDSCRIPTASTSTMT pStmtCurr;
+            RTListForEach(&pStmt->Compound.ListStmts, pStmtCurr, VDSCRIPTASTSTMT, Core.ListNode)
+            {
+                rc = vdScriptBcCompileStmt(pThis, pStmtCurr);
+                if (RT_FAILURE(rc))
+                    break;
+            }
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_EXPRESSION:
+            rc = vdScriptBcCompileExprDiscard(pThis, pStmt->pExpr);
+            break;
+        case VDSCRIPTSTMTTYPE_IF:
+        {
+            uint32_t idxPatchElse = VDSCRIPTBC_PATCH_END;
+            uint32_t idxPatchEnd = VDSCRIPTBC_PATCH_END;
+
+            rc = vdScriptBcCompileCond(pThis, pStmt->If.pCond, &idxPatchElse);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcCompileStmt(pThis, pStmt->If.pTrueStmt);
+            if (RT_SUCCESS(rc) && pStmt->If.pElseStmt)
+            {
+                rc = vdScriptBcEmitJmpPatch(pThis, VDSCRIPTBCOP_JMP, &idxPatchEnd);
+                vdScriptBcPatch(pThis, idxPatchElse, pThis->pBcFn->cInsns);
+                idxPatchElse = VDSCRIPTBC_PATCH_END;
+                if (RT_SUCCESS(rc))
+                    rc = vdScriptBcCompileStmt(pThis, pStmt->If.pElseStmt);
+            }
+            vdScriptBcPatch(pThis, idxPatchElse, pThis->pBcFn->cInsns);
+            vdScriptBcPatch(pThis, idxPatchEnd, pThis->pBcFn->cInsns);
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_WHILE:
+        {
+            VDSCRIPTBCLOOP Loop;
+            uint32_t idxPatchEnd = VDSCRIPTBC_PATCH_END;
+
+            if (pStmt->While.fDoWhile)
+            {
+                /* Body: body; Continue: cond; JMP_TRUE Body */
+                uint32_t idxBody = pThis->pBcFn->cInsns;
+                rc = vdScriptBcCompileLoopBody(pThis, pStmt->While.pStmt, &Loop);
+                if (RT_SUCCESS(rc))
+                {
+                    vdScriptBcPatch(pThis, Loop.idxPatchContinue, pThis->pBcFn->cInsns);
+                    rc = vdScriptBcCompileExpr(pThis, pStmt->While.pCond);
+                }
+                if (RT_SUCCESS(rc))
+                {
+                    PVDSCRIPTBCINSN pInsn = vdScriptBcEmit(pThis, VDSCRIPTBCOP_JMP_TRUE);
+                    if (pInsn)
+                        pInsn->idxTarget = idxBody;
+                    else
+                        rc = VERR_NO_MEMORY;
+                }
+            }
+            else
+            {
+                /* Continue: cond; JMP_FALSE End; body; JMP Continue; End: */
+                uint32_t idxCond = pThis->pBcFn->cInsns;
+                rc = vdScriptBcCompileCond(pThis, pStmt->While.pCond, &idxPatchEnd);
+                if (RT_SUCCESS(rc))
+                    rc = vdScriptBcCompileLoopBody(pThis, pStmt->While.pStmt, &Loop);
+                if (RT_SUCCESS(rc))
+                {
+                    vdScriptBcPatch(pThis, Loop.idxPatchContinue, idxCond);
+                    rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_JMP, idxCond);
+                }
+            }
+
+            if (RT_SUCCESS(rc))
+            {
+                vdScriptBcPatch(pThis, Loop.idxPatchBreak, pThis->pBcFn->cInsns);
+                vdScriptBcPatch(pThis, idxPatchEnd, pThis->pBcFn->cInsns);
+            }
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_FOR:
+        {
+            /* start; Cond: cond; JMP_FALSE End; body; Continue: expr3; JMP Cond; End: */
+            VDSCRIPTBCLOOP Loop;
+            uint32_t idxPatchEnd = VDSCRIPTBC_PATCH_END;
+
+            rc = vdScriptBcCompileExprDiscard(pThis, pStmt->For.pExprStart);
+            uint32_t idxCond = pThis->pBcFn->cInsns;
+            if (RT_SUCCESS(rc) && pStmt->For.pExprCond)
+                rc = vdScriptBcCompileCond(pThis, pStmt->For.pExprCond, &idxPatchEnd);
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcCompileLoopBody(pThis, pStmt->For.pStmt, &Loop);
+            if (RT_SUCCESS(rc))
+            {
+                vdScriptBcPatch(pThis, Loop.idxPatchContinue, pThis->pBcFn->cInsns);
+                rc = vdScriptBcCompileExprDiscard(pThis, pStmt->For.pExpr3);
+            }
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_JMP, idxCond);
+            if (RT_SUCCESS(rc))
+            {
+                vdScriptBcPatch(pThis, Loop.idxPatchBreak, pThis->pBcFn->cInsns);
+                vdScriptBcPatch(pThis, idxPatchEnd, pThis->pBcFn->cInsns);
+            }
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_CONTINUE:
+        case VDSCRIPTSTMTTYPE_BREAK:
+        {
+            if (!pThis->pLoop)
+                return vdScriptBcError(VERR_INVALID_PARAMETER, &pStmt->Core.Pos, "break or continue outside of a loop\n");
+            rc = vdScriptBcEmitJmpPatch(pThis, VDSCRIPTBCOP_JMP,
+                                          pStmt->enmStmtType == VDSCRIPTSTMTTYPE_BREAK
+                                        ? &pThis->pLoop->idxPatchBreak
+                                        : &pThis->pLoop->idxPatchContinue);
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_RETURN:
+        {
+            if (pStmt->pExpr)
+                rc = vdScriptBcCompileExpr(pThis, pStmt->pExpr);
+            else
+            {
+                VDSCRIPTARG Void;
+                RT_ZERO(Void);
+                Void.enmType = VDSCRIPTTYPE_VOID;
+                rc = vdScriptBcEmitConst(pThis, &Void);
+            }
+            if (RT_SUCCESS(rc))
+                rc = vdScriptBcEmitU32(pThis, VDSCRIPTBCOP_RET, 0);
+            break;
+        }
+        case VDSCRIPTSTMTTYPE_SWITCH:
+        case VDSCRIPTSTMTTYPE_CASE:
+        case VDSCRIPTSTMTTYPE_DEFAULT:
+        default:
+            rc = vdScriptBcNotSupported(&pStmt->Core.Pos, "Statement", pStmt->enmStmtType);
+    }
+
+    return rc;
+}
+
+/**
+ * String space callback allocating the compiled function of every function
+ * defined in the script, so calls can be bound directly while compiling.
+ */
+static DECLCALLBACK(int) vdScriptBcFnAlloc(PRTSTRSPACECORE pStr, void *pvUser)
+{
+    PVDSCRIPTFN pFn = (PVDSCRIPTFN)pStr;
+    NOREF(pvUser);
+
+    if (!pFn->fExternal)
+    {
+        PVDSCRIPTBCFN pBcFn = (PVDSCRIPTBCFN)RTMemAllocZ(sizeof(VDSCRIPTBCFN));
+        if (!pBcFn)
+            return VERR_NO_MEMORY;
+        pBcFn->pAstFn = pFn->Type.Internal.pAstFn;
+        pBcFn->cArgs  = pBcFn->pAstFn->cArgs;
+        pFn->Type.Internal.pBcFn = pBcFn;
+    }
+    return VINF_SUCCESS;
+}
+
+/**
+ * String space callback compiling a function defined in the script.
+ */
+static DECLCALLBACK(int) vdScriptBcFnCompile(PRTSTRSPACECORE pStr, void *pvUser)
+{
+    PVDSCRIPTFN pFn = (PVDSCRIPTFN)pStr;
+    VDSCRIPTBCCOMP Comp;
+
+    if (pFn->fExternal)
+        return VINF_SUCCESS;
+
+    Comp.pScriptCtx = (PVDSCRIPTCTXINT)pvUser;
+    Comp.pBcFn      = pFn->Type.Internal.pBcFn;
+    Comp.pLoop      = NULL;
+
+    int rc = vdScriptBcCompileStmt(&Comp, Comp.pBcFn->pAstFn->pCompoundStmts);
+    if (RT_SUCCESS(rc))
+    {
+        /* Implicit return at the end of the function. */
+        VDSCRIPTARG Void;
+        RT_ZERO(Void);
+        Void.enmType = VDSCRIPTTYPE_VOID;
+        rc = vdScriptBcEmitConst(&Comp, &Void);
+        if (RT_SUCCESS(rc))
+            rc = vdScriptBcEmitU32(&Comp, VDSCRIPTBCOP_RET, 0);
+    }
+
+    return rc;
+}
+
+/**
+ * String space callback freeing the compiled function.
+ */
+static DECLCALLBACK(int) vdScriptBcFnFree(PRTSTRSPACECORE pStr, void *pvUser)
+{
+    PVDSCRIPTFN pFn = (PVDSCRIPTFN)pStr;
+    NOREF(pvUser);
+
+    if (   !pFn->fExternal
+        && pFn->Type.Internal.pBcFn)
+    {
+        RTMemFree(pFn->Type.Internal.pBcFn->paInsns);
+        RTMemFree(pFn->Type.Internal.pBcFn);
+        pFn->Type.Internal.pBcFn = NULL;
+    }
+    return VINF_SUCCESS;
+}
+
+DECLHIDDEN(int) vdScriptCtxCompile(PVDSCRIPTCTXINT pThis)
+{
+    AssertPtrReturn(pThis, VERR_INVALID_POINTER);
+
+    vdScriptCtxCompiledFree(pThis);
+
+    int rc = RTStrSpaceEnumerate(&pThis->hStrSpaceFn, vdScriptBcFnAlloc, NULL);
+    if (RT_SUCCESS(rc))
+        rc = RTStrSpaceEnumerate(&pThis->hStrSpaceFn, vdScriptBcFnCompile, pThis);
+
+    if (RT_SUCCESS(rc))
+        pThis->fCompiled = true;
+    else
+        vdScriptCtxCompiledFree(pThis);
+
+    return rc;
+}
+
+DECLHIDDEN(void) vdScriptCtxCompiledFree(PVDSCRIPTCTXINT pThis)
+{
+    RTStrSpaceEnumerate(&pThis->hStrSpaceFn, vdScriptBcFnFree, NULL);
+    pThis->fCompiled = false;
+}
+
+/**
+ * Pushes a value onto the value stack of the virtual machine.
+ */
+DECLINLINE(int) vdScriptBcPush(PVDSCRIPTSTACK pStack, const VDSCRIPTARG *pVal)
+{
+    PVDSCRIPTARG pValStack = (PVDSCRIPTARG)vdScriptStackGetUnused(pStack);
+    if (RT_UNLIKELY(!pValStack))
+        return vdScriptBcError(VERR_NO_MEMORY, NULL, "Out of memory pushing a value on the value stack\n");
+
+    *pValStack = *pVal;
+    vdScriptStackPush(pStack);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Returns the value at the given index of the value stack.
+ */
+DECLINLINE(PVDSCRIPTARG) vdScriptBcGetValue(PVDSCRIPTSTACK pStack, uint32_t idx)
+{
+    Assert(idx < pStack->cOnStack);
+    return (PVDSCRIPTARG)pStack->pvStack + idx;
+}
+
+/**
+ * The virtual machine executing the compiled functions.
+ *
+ * @returns VBox status code.
+ * @param   pBcFn      The function to execute.
+ * @param   pStackValues The value stack holding the arguments of the function.
+ * @param   pRet       Where to store the return value.
+ */
+static int vdScriptBcRun(PVDSCRIPTBCFN pBcFn, PVDSCRIPTSTACK pStackValues, PVDSCRIPTARG pRet)
+{
+    int rc = VINF_SUCCESS;
+    VDSCRIPTSTACK StackFrames;
+    uint32_t idxInsn = 0;
+    uint32_t idxBase = pStackValues->cOnStack - pBcFn->cArgs;
+
+    vdScriptStackInit(&StackFrames, sizeof(VDSCRIPTBCFRAME));
+
+    while (RT_SUCCESS(rc))
+    {
+        AssertBreakStmt(idxInsn < pBcFn->cInsns, rc = VERR_INTERNAL_ERROR);
+        PCVDSCRIPTBCINSN pInsn = &pBcFn->paInsns[idxInsn++];
+
+        switch (pInsn->enmOp)
+        {
+            case VDSCRIPTBCOP_PUSH_CONST:
+                rc = vdScriptBcPush(pStackValues, &pInsn->Const);
+                break;
+            case VDSCRIPTBCOP_LOAD:
+            {
+                VDSCRIPTARG Val = *vdScriptBcGetValue(pStackValues, idxBase + pInsn->idxVar);
+                rc = vdScriptBcPush(pStackValues, &Val);
+                break;
+            }
+            case VDSCRIPTBCOP_STORE:
+                *vdScriptBcGetValue(pStackValues, idxBase + pInsn->idxVar) = *(PVDSCRIPTARG)vdScriptStackGetUsed(pStackValues);
+                break;
+            case VDSCRIPTBCOP_POP:
+                vdScriptStackPop(pStackValues);
+                break;
+            case VDSCRIPTBCOP_JMP:
+                idxInsn = pInsn->idxTarget;
+                break;
+            case VDSCRIPTBCOP_JMP_FALSE:
+            case VDSCRIPTBCOP_JMP_TRUE:
+            {
+                PVDSCRIPTARG pCond = (PVDSCRIPTARG)vdScriptStackGetUsed(pStackValues);
+                bool f = vdScriptBcArgToU64(pCond) != 0;
+                if (f == (pInsn->enmOp == VDSCRIPTBCOP_JMP_TRUE))
+                    idxInsn = pInsn->idxTarget;
+                vdScriptStackPop(pStackValues);
+                break;
+            }
+            case VDSCRIPTBCOP_UNARY:
+                rc = vdScriptBcEvalUnary(pInsn->enmExprType, (PVDSCRIPTARG)vdScriptStackGetUsed(pStackValues));
+                if (RT_FAILURE(rc))
+                    rc = vdScriptBcError(rc, NULL, "Invalid operand for unary operation %d\n", pInsn->enmExprType);
+                break;
+            case VDSCRIPTBCOP_BINARY:
+            {
+                uint32_t cOnStack = pStackValues->cOnStack;
+                rc = vdScriptBcEvalBinary(pInsn->enmExprType, vdScriptBcGetValue(pStackValues, cOnStack - 2),
+                                          vdScriptBcGetValue(pStackValues, cOnStack - 1));
+                if (RT_FAILURE(rc))
+                    rc = vdScriptBcError(rc, NULL, "Invalid operands for binary operation %d\n", pInsn->enmExprType);
+                vdScriptStackPop(pStackValues);
+                break;
+            }
+            case VDSCRIPTBCOP_CALL_EXT:
+            {
+                /* The arguments are on the stack in order already, pass them directly. */
+                PVDSCRIPTFN pFn = pInsn->pFn;
+                PVDSCRIPTARG paArgs =   pInsn->cArgs
+                                      ? vdScriptBcGetValue(pStackValues, pStackValues->cOnStack - pInsn->cArgs)
+                                      : NULL;
+                rc = pFn->Type.External.pfnCallback(paArgs, pFn->Type.External.pvUser);
+                pStackValues->cOnStack -= pInsn->cArgs;
+                if (RT_SUCCESS(rc))
+                {
+                    VDSCRIPTARG Void;
+                    RT_ZERO(Void);
+                    Void.enmType = VDSCRIPTTYPE_VOID;
+                    rc = vdScriptBcPush(pStackValues, &Void);
+                }
+                break;
+            }
+            case VDSCRIPTBCOP_CALL:
+            {
+                PVDSCRIPTBCFRAME pFrame = (PVDSCRIPTBCFRAME)vdScriptStackGetUnused(&StackFrames);
+                if (!pFrame)
+                {
+                    rc = vdScriptBcError(VERR_NO_MEMORY, NULL, "Out of memory creating a call frame\n");
+                    break;
+                }
+                pFrame->pBcFn   = pBcFn;
+                pFrame->idxInsn = idxInsn;
+                pFrame->idxBase = idxBase;
+                vdScriptStackPush(&StackFrames);
+
+                pBcFn   = pInsn->pBcFn;
+                idxInsn = 0;
+                idxBase = pStackValues->cOnStack - pInsn->cArgs;
+                break;
+            }
+            case VDSCRIPTBCOP_RET:
+            {
+                VDSCRIPTARG Ret = *(PVDSCRIPTARG)vdScriptStackGetUsed(pStackValues);
+                pStackValues->cOnStack = idxBase;
+
+                PVDSCRIPTBCFRAME pFrame = (PVDSCRIPTBCFRAME)vdScriptStackGetUsed(&StackFrames);
+                if (!pFrame)
+                {
+                    /* Returned from the outermost function, done. */
+                    *pRet = Ret;
+                    vdScriptStackDestroy(&StackFrames);
+                    return VINF_SUCCESS;
+                }
+
+                pBcFn   = pFrame->pBcFn;
+                idxInsn = pFrame->idxInsn;
+                idxBase = pFrame->idxBase;
+                vdScriptStackPop(&StackFrames);
+                rc = vdScriptBcPush(pStackValues, &Ret);
+                break;
+            }
+            default:
+                AssertMsgFailedBreakStmt(("Invalid bytecode operation %d\n", pInsn->enmOp), rc = VERR_INTERNAL_ERROR);
+        }
+    }
+
+    vdScriptStackDestroy(&StackFrames);
+    return rc;
+}
+
+DECLHIDDEN(int) vdScriptCtxExecute(PVDSCRIPTCTXINT pThis, const char *pszFn,
+                                   PVDSCRIPTARG paArgs, unsigned cArgs,
+                                   PVDSCRIPTARG pRet)
+{
+    int rc = VINF_SUCCESS;
+    VDSCRIPTSTACK StackValues;
+
+    AssertPtrReturn(pThis, VERR_INVALID_POINTER);
+    AssertPtrReturn(pszFn, VERR_INVALID_POINTER);
+    AssertReturn(pThis->fCompiled, VERR_INVALID_STATE);
+    AssertReturn(   (!cArgs && !paArgs)
+                 || (cArgs && paArgs), VERR_INVALID_PARAMETER);
+
+    PVDSCRIPTFN pFn = (PVDSCRIPTFN)RTStrSpaceGet(&pThis->hStrSpaceFn, pszFn);
+    if (!pFn)
+        return vdScriptBcError(VERR_NOT_FOUND, NULL, "Function with identifier \"%s\" not found\n", pszFn);
+
+    if (pFn->fExternal)
+        return pFn->Type.External.pfnCallback(paArgs, pFn->Type.External.pvUser);
+
+    PVDSCRIPTBCFN pBcFn = pFn->Type.Internal.pBcFn;
+    if (cArgs != pBcFn->cArgs)
+        return vdScriptBcError(VERR_INVALID_PARAMETER, NULL, "Invalid number of parameters, expected %u got %u\n",
+                               pBcFn->cArgs, cArgs);
+
+    vdScriptStackInit(&StackValues, sizeof(VDSCRIPTARG));
+    for (unsigned i = 0; i < cArgs && RT_SUCCESS(rc); i++)
+        rc = vdScriptBcPush(&StackValues, &paArgs[i]);
+    if (RT_SUCCESS(rc))
+        rc = vdScriptBcRun(pBcFn, &StackValues, pRet);
+    vdScriptStackDestroy(&StackValues);
+
+    return rc;
+}
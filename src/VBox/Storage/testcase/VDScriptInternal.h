@@ -40,6 +40,8 @@ typedef struct VDSCRIPTFN
         {
             /** Pointer to the AST defining the function. */
             PVDSCRIPTASTFN       pAstFn;
+            /** Pointer to the compiled function, NULL if not compiled. */
+            struct VDSCRIPTBCFN *pBcFn;
         } Internal;
         /** Data for external defined functions. */
         struct
@@ -74,6 +76,10 @@ typedef struct VDSCRIPTCTXINT
     RTLISTANCHOR      ListAst;
     /** Pointer to the current tokenizer state. */
     PVDTOKENIZER      pTokenizer;
+    /** Flag whether the loaded functions were compiled to bytecode. */
+    bool              fCompiled;
+    /** Flag whether compiling failed and the AST interpreter is used. */
+    bool              fCompileFailed;
 } VDSCRIPTCTXINT;
 /** Pointer to a script context. */
 typedef VDSCRIPTCTXINT *PVDSCRIPTCTXINT;
@@ -104,4 +110,37 @@ DECLHIDDEN(int) vdScriptCtxInterprete(PVDSCRIPTCTXINT pThis, const char *pszFn,
                                       PVDSCRIPTARG paArgs, unsigned cArgs,
                                       PVDSCRIPTARG pRet);
 
+/**
+ * Compile all functions defined in the script to bytecode.
+ * The context must be type correct.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_NOT_SUPPORTED if the script uses constructs the compiler
+ *          can't handle yet, the AST interpreter must be used then.
+ * @param   pThis    The script context.
+ */
+DECLHIDDEN(int) vdScriptCtxCompile(PVDSCRIPTCTXINT pThis);
+
+/**
+ * Frees the bytecode of all compiled functions.
+ *
+ * @returns nothing.
+ * @param   pThis    The script context.
+ */
+DECLHIDDEN(void) vdScriptCtxCompiledFree(PVDSCRIPTCTXINT pThis);
+
+/**
+ * Execute a given function using the compiled bytecode.
+ *
+ * @returns VBox status code.
+ * @param   pThis    The script context.
+ * @param   pszFn    The function name to execute.
+ * @param   paArgs   Arguments to pass to the function.
+ * @param   cArgs    Number of arguments.
+ * @param   pRet     Where to store the return value on success.
+ */
+DECLHIDDEN(int) vdScriptCtxExecute(PVDSCRIPTCTXINT pThis, const char *pszFn,
+                                   PVDSCRIPTARG paArgs, unsigned cArgs,
+                                   PVDSCRIPTARG pRet);
+
 #endif /* _VDScriptInternal_h__ */
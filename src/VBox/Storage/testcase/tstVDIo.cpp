@@ -189,8 +189,37 @@ typedef struct VDIOREQ
     void          *pvBufRead;
     /** Opaque user data. */
     void          *pvUser;
+    /** Timestamp when the request was submitted, 0 if the latency was recorded already. */
+    uint64_t      tsStart;
+    /** Nanoseconds it took to complete the request. */
+    uint64_t      cNsLatency;
 } VDIOREQ, *PVDIOREQ;
 
+/** Number of sub buckets per power of two in the latency histogram. */
+#define VDIOLATHIST_SUB_BUCKETS_SHIFT 4
+/** Number of buckets in the latency histogram. */
+#define VDIOLATHIST_BUCKETS           (64 << VDIOLATHIST_SUB_BUCKETS_SHIFT)
+
+/**
+ * Request latency histogram.
+ *
+ * The buckets are spaced logarithmically with 16 linear sub buckets for every
+ * power of two, so the reported percentiles are off by at most 6.25%.
+ */
+typedef struct VDIOLATHIST
+{
+    /** Number of recorded requests. */
+    uint64_t      cSamples;
+    /** Sum of all latencies in nanoseconds. */
+    uint64_t      cNsTotal;
+    /** Lowest latency seen. */
+    uint64_t      cNsMin;
+    /** Highest latency seen. */
+    uint64_t      cNsMax;
+    /** The buckets. */
+    uint32_t      acSamples[VDIOLATHIST_BUCKETS];
+} VDIOLATHIST, *PVDIOLATHIST;
+
 /**
  * I/O test data.
  */
@@ -233,6 +262,7 @@ typedef struct VDIOTEST
 static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerOpen(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerBenchmark(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerFlush(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerMerge(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerCompact(PVDSCRIPTARG paScriptArgs, void *pvUser);
@@ -303,6 +333,20 @@ const VDSCRIPTTYPE g_aArgIo[] =
     VDSCRIPTTYPE_STRING  /* pattern */
 };
 
+/* Benchmark action */
+const VDSCRIPTTYPE g_aArgBenchmark[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_BOOL,   /* async */
+    VDSCRIPTTYPE_STRING, /* mode */
+    VDSCRIPTTYPE_STRING, /* blocksizes */
+    VDSCRIPTTYPE_STRING, /* iodepths */
+    VDSCRIPTTYPE_STRING, /* numjobs */
+    VDSCRIPTTYPE_UINT64, /* size */
+    VDSCRIPTTYPE_UINT32, /* writes */
+    VDSCRIPTTYPE_STRING  /* json */
+};
+
 /* flush action */
 const VDSCRIPTTYPE g_aArgFlush[] =
 {
@@ -476,6 +520,7 @@ const VDSCRIPTCALLBACK g_aScriptActions[] =
     {"create",                     VDSCRIPTTYPE_VOID, g_aArgCreate,                      RT_ELEMENTS(g_aArgCreate),                     vdScriptHandlerCreate},
     {"open",                       VDSCRIPTTYPE_VOID, g_aArgOpen,                        RT_ELEMENTS(g_aArgOpen),                       vdScriptHandlerOpen},
     {"io",                         VDSCRIPTTYPE_VOID, g_aArgIo,                          RT_ELEMENTS(g_aArgIo),                         vdScriptHandlerIo},
+    {"benchmark",                  VDSCRIPTTYPE_VOID, g_aArgBenchmark,                   RT_ELEMENTS(g_aArgBenchmark),                  vdScriptHandlerBenchmark},
     {"flush",                      VDSCRIPTTYPE_VOID, g_aArgFlush,                       RT_ELEMENTS(g_aArgFlush),                      vdScriptHandlerFlush},
     {"close",                      VDSCRIPTTYPE_VOID, g_aArgClose,                       RT_ELEMENTS(g_aArgClose),                      vdScriptHandlerClose},
     {"printfilesize",              VDSCRIPTTYPE_VOID, g_aArgPrintFileSize,               RT_ELEMENTS(g_aArgPrintFileSize),              vdScriptHandlerPrintFileSize},
@@ -551,6 +596,7 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
     PVDDISK pDisk = NULL;
     bool fBase = false;
     bool fDynamic = true;
+    bool fCompressed = false;
     bool fIgnoreFlush = false;
     bool fHonorSame = false;
     PVDIOBACKEND pIoBackend = NULL;
@@ -570,6 +616,8 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
         fDynamic = false;
     else if (!RTStrICmp(paScriptArgs[3].psz, "dynamic"))
         fDynamic = true;
+    else if (!RTStrICmp(paScriptArgs[3].psz, "compressed"))
+        fCompressed = true;
     else
     {
         RTPrintf("Invalid image type '%s' given\n", paScriptArgs[3].psz);
@@ -591,6 +639,9 @@ static DECLCALLBACK(int) vdScriptHandlerCreate(PVDSCRIPTARG paScriptArgs, void *
             if (!fDynamic)
                 fImageFlags |= VD_IMAGE_FLAGS_FIXED;
 
+            if (fCompressed)
+                fImageFlags |= VD_VDI_IMAGE_FLAGS_COMPRESSED;
+
             if (fIgnoreFlush)
                 fOpenFlags |= VD_OPEN_FLAGS_IGNORE_FLUSH;
 
@@ -701,6 +752,350 @@ static uint64_t tstVDIoGetSpeedKBs(uint64_t cbIo, uint64_t tsNano)
     return uSpeedKBs;
 }
 
+/**
+ * Returns the histogram bucket for the given latency.
+ *
+ * @returns Bucket index.
+ * @param   cNs      The latency in nanoseconds.
+ */
+static unsigned tstVDIoLatHistGetBucket(uint64_t cNs)
+{
+    if (cNs < RT_BIT_64(VDIOLATHIST_SUB_BUCKETS_SHIFT))
+        return (unsigned)cNs;
+
+    unsigned iBitLast = RT_HI_U32(cNs) ? ASMBitLastSetU32(RT_HI_U32(cNs)) + 32 : ASMBitLastSetU32(RT_LO_U32(cNs));
+    unsigned iExp     = iBitLast - 1 - VDIOLATHIST_SUB_BUCKETS_SHIFT;
+    unsigned iSub     = (unsigned)(cNs >> iExp) & (RT_BIT_32(VDIOLATHIST_SUB_BUCKETS_SHIFT) - 1);
+
+    return ((iExp + 1) << VDIOLATHIST_SUB_BUCKETS_SHIFT) + iSub;
+}
+
+/**
+ * Returns the highest latency falling into the given histogram bucket.
+ *
+ * @returns Latency in nanoseconds.
+ * @param   idxBucket    The bucket index.
+ */
+static uint64_t tstVDIoLatHistGetBucketMax(unsigned idxBucket)
+{
+    if (idxBucket < RT_BIT_32(VDIOLATHIST_SUB_BUCKETS_SHIFT))
+        return idxBucket;
+
+    unsigned iExp = (idxBucket >> VDIOLATHIST_SUB_BUCKETS_SHIFT) - 1;
+    uint64_t uMantissa = RT_BIT_64(VDIOLATHIST_SUB_BUCKETS_SHIFT)
+                       + (idxBucket & (RT_BIT_32(VDIOLATHIST_SUB_BUCKETS_SHIFT) - 1));
+
+    return ((uMantissa + 1) << iExp) - 1;
+}
+
+static void tstVDIoLatHistInit(PVDIOLATHIST pLatHist)
+{
+    RT_ZERO(*pLatHist);
+    pLatHist->cNsMin = UINT64_MAX;
+}
+
+static void tstVDIoLatHistAdd(PVDIOLATHIST pLatHist, uint64_t cNs)
+{
+    pLatHist->cSamples++;
+    pLatHist->cNsTotal += cNs;
+    pLatHist->cNsMin    = RT_MIN(pLatHist->cNsMin, cNs);
+    pLatHist->cNsMax    = RT_MAX(pLatHist->cNsMax, cNs);
+    pLatHist->acSamples[tstVDIoLatHistGetBucket(cNs)]++;
+}
+
+/**
+ * Returns the latency the given share of all requests stayed below.
+ *
+ * @returns Latency in nanoseconds.
+ * @param   pLatHist     The histogram.
+ * @param   uPerMill     The percentile in tenths of a percent (990 for p99).
+ */
+static uint64_t tstVDIoLatHistGetPercentile(PVDIOLATHIST pLatHist, unsigned uPerMill)
+{
+    if (!pLatHist->cSamples)
+        return 0;
+
+    uint64_t cSamplesBelow = (pLatHist->cSamples * uPerMill + 999) / 1000;
+    uint64_t cSamples = 0;
+    for (unsigned i = 0; i < RT_ELEMENTS(pLatHist->acSamples); i++)
+    {
+        cSamples += pLatHist->acSamples[i];
+        if (cSamples >= cSamplesBelow)
+            return RT_MIN(tstVDIoLatHistGetBucketMax(i), pLatHist->cNsMax);
+    }
+
+    return pLatHist->cNsMax;
+}
+
+/**
+ * Records the latency of a completed request if not done already.
+ */
+static void tstVDIoTestReqLatencyRecord(PVDIOREQ pIoReq, PVDIOLATHIST pLatHist)
+{
+    if (pIoReq->tsStart)
+    {
+        if (pLatHist)
+            tstVDIoLatHistAdd(pLatHist, pIoReq->cNsLatency);
+        pIoReq->tsStart = 0;
+    }
+}
+
+/**
+ * Runs the given I/O tests against a disk until all of them are done.
+ *
+ * @returns VBox status code.
+ * @param   pGlob          Global test state.
+ * @param   pDisk          The disk to run the tests against.
+ * @param   paIoTests      The tests to run, one for every job.
+ * @param   cJobs          Number of jobs issuing I/O concurrently.
+ * @param   fAsync         Flag whether to use the async I/O interface.
+ * @param   cReqsPerJob    Number of requests every job keeps outstanding.
+ * @param   pLatHist       Where to record the latency of every request, optional.
+ */
+static int tstVDIoTestRun(PVDTESTGLOB pGlob, PVDDISK pDisk, PVDIOTEST paIoTests, unsigned cJobs,
+                          bool fAsync, unsigned cReqsPerJob, PVDIOLATHIST pLatHist)
+{
+    int rc = VINF_SUCCESS;
+    PVDIOREQ paIoReq = NULL;
+    unsigned cMaxTasksOutstanding = cJobs * cReqsPerJob;
+    RTSEMEVENT EventSem;
+
+    rc = RTSemEventCreate(&EventSem);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    paIoReq = (PVDIOREQ)RTMemAllocZ(cMaxTasksOutstanding * sizeof(VDIOREQ));
+    if (!paIoReq)
+    {
+        RTSemEventDestroy(EventSem);
+        return VERR_NO_MEMORY;
+    }
+
+    /* Init requests. */
+    for (unsigned i = 0; i < cMaxTasksOutstanding; i++)
+    {
+        paIoReq[i].idx = i;
+        paIoReq[i].pvBufRead = RTMemAlloc(paIoTests[i / cReqsPerJob].cbBlkIo);
+        if (!paIoReq[i].pvBufRead)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+    }
+
+    bool fRunning = true;
+    while (   fRunning
+           && RT_SUCCESS(rc))
+    {
+        bool fTasksOutstanding = false;
+        unsigned idx = 0;
+
+        /* Submit all idling requests. */
+        fRunning = false;
+        while (   idx < cMaxTasksOutstanding
+               && RT_SUCCESS(rc))
+        {
+            PVDIOREQ pIoReq = &paIoReq[idx];
+            PVDIOTEST pIoTest = &paIoTests[idx / cReqsPerJob];
+
+            idx++;
+            if (tstVDIoTestReqOutstanding(pIoReq))
+            {
+                fTasksOutstanding = true;
+                fRunning = true;
+                continue;
+            }
+
+            tstVDIoTestReqLatencyRecord(pIoReq, pLatHist);
+            if (!tstVDIoTestRunning(pIoTest))
+                continue;
+
+            fRunning = true;
+            rc = tstVDIoTestReqInit(pIoTest, pIoReq, pDisk);
+            AssertRC(rc);
+            if (RT_FAILURE(rc))
+                break;
+
+            pIoReq->tsStart = RTTimeNanoTS();
+            if (!fAsync)
+            {
+                switch (pIoReq->enmTxDir)
+                {
+                    case VDIOREQTXDIR_READ:
+                    {
+                        rc = VDRead(pDisk->pVD, pIoReq->off, pIoReq->DataSeg.pvSeg, pIoReq->cbReq);
+                        pIoReq->cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+
+                        if (RT_SUCCESS(rc)
+                            && pDisk->pMemDiskVerify)
+                        {
+                            RTSGBUF SgBuf;
+                            RTSgBufInit(&SgBuf, &pIoReq->DataSeg, 1);
+
+                            if (VDMemDiskCmp(pDisk->pMemDiskVerify, pIoReq->off, pIoReq->cbReq, &SgBuf))
+                            {
+                                RTTestFailed(pGlob->hTest, "Corrupted disk at offset %llu!\n", pIoReq->off);
+                                rc = VERR_INVALID_STATE;
+                            }
+                        }
+                        break;
+                    }
+                    case VDIOREQTXDIR_WRITE:
+                    {
+                        rc = VDWrite(pDisk->pVD, pIoReq->off, pIoReq->DataSeg.pvSeg, pIoReq->cbReq);
+                        pIoReq->cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+
+                        if (RT_SUCCESS(rc)
+                            && pDisk->pMemDiskVerify)
+                        {
+                            RTSGBUF SgBuf;
+                            RTSgBufInit(&SgBuf, &pIoReq->DataSeg, 1);
+                            rc = VDMemDiskWrite(pDisk->pMemDiskVerify, pIoReq->off, pIoReq->cbReq, &SgBuf);
+                        }
+                        break;
+                    }
+                    case VDIOREQTXDIR_FLUSH:
+                    {
+                        rc = VDFlush(pDisk->pVD);
+                        pIoReq->cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+                        break;
+                    }
+                    case VDIOREQTXDIR_DISCARD:
+                        AssertMsgFailed(("Invalid\n"));
+                }
+
+                ASMAtomicXchgBool(&pIoReq->fOutstanding, false);
+            }
+            else
+            {
+                LogFlow(("Queuing request %d\n", pIoReq->idx));
+                switch (pIoReq->enmTxDir)
+                {
+                    case VDIOREQTXDIR_READ:
+                    {
+                        rc = VDAsyncRead(pDisk->pVD, pIoReq->off, pIoReq->cbReq, &pIoReq->SgBuf,
+                                         tstVDIoTestReqComplete, pIoReq, EventSem);
+                        break;
+                    }
+                    case VDIOREQTXDIR_WRITE:
+                    {
+                        rc = VDAsyncWrite(pDisk->pVD, pIoReq->off, pIoReq->cbReq, &pIoReq->SgBuf,
+                                          tstVDIoTestReqComplete, pIoReq, EventSem);
+                        break;
+                    }
+                    case VDIOREQTXDIR_FLUSH:
+                    {
+                        rc = VDAsyncFlush(pDisk->pVD, tstVDIoTestReqComplete, pIoReq, EventSem);
+                        break;
+                    }
+                    case VDIOREQTXDIR_DISCARD:
+                        AssertMsgFailed(("Invalid\n"));
+                }
+
+                if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                {
+                    fTasksOutstanding = true;
+                    rc = VINF_SUCCESS;
+                }
+                else if (rc == VINF_VD_ASYNC_IO_FINISHED)
+                {
+                    LogFlow(("Request %d completed\n", pIoReq->idx));
+                    pIoReq->cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+                    switch (pIoReq->enmTxDir)
+                    {
+                        case VDIOREQTXDIR_READ:
+                        {
+                            if (pDisk->pMemDiskVerify)
+                            {
+                                RTCritSectEnter(&pDisk->CritSectVerify);
+                                RTSgBufReset(&pIoReq->SgBuf);
+
+                                if (VDMemDiskCmp(pDisk->pMemDiskVerify, pIoReq->off, pIoReq->cbReq,
+                                                 &pIoReq->SgBuf))
+                                {
+                                    RTTestFailed(pGlob->hTest, "Corrupted disk at offset %llu!\n", pIoReq->off);
+                                    rc = VERR_INVALID_STATE;
+                                }
+                                RTCritSectLeave(&pDisk->CritSectVerify);
+                            }
+                            break;
+                        }
+                        case VDIOREQTXDIR_WRITE:
+                        {
+                            if (pDisk->pMemDiskVerify)
+                            {
+                                RTCritSectEnter(&pDisk->CritSectVerify);
+                                RTSgBufReset(&pIoReq->SgBuf);
+
+                                rc = VDMemDiskWrite(pDisk->pMemDiskVerify, pIoReq->off, pIoReq->cbReq,
+                                                    &pIoReq->SgBuf);
+                                RTCritSectLeave(&pDisk->CritSectVerify);
+                            }
+                            break;
+                        }
+                        case VDIOREQTXDIR_FLUSH:
+                            break;
+                        case VDIOREQTXDIR_DISCARD:
+                            AssertMsgFailed(("Invalid\n"));
+                    }
+
+                    ASMAtomicXchgBool(&pIoReq->fOutstanding, false);
+                    if (rc != VERR_INVALID_STATE)
+                        rc = VINF_SUCCESS;
+                }
+            }
+
+            if (RT_FAILURE(rc))
+                RTPrintf("Error submitting task %u rc=%Rrc\n", pIoReq->idx, rc);
+        }
+
+        /* Wait for a request to complete. */
+        if (   fAsync
+            && fTasksOutstanding
+            && RT_SUCCESS(rc))
+        {
+            rc = RTSemEventWait(EventSem, RT_INDEFINITE_WAIT);
+            AssertRC(rc);
+        }
+    }
+
+    /* Cleanup, wait for all tasks to complete. */
+    while (fAsync)
+    {
+        unsigned idx = 0;
+        bool fAllIdle = true;
+
+        while (idx < cMaxTasksOutstanding)
+        {
+            if (tstVDIoTestReqOutstanding(&paIoReq[idx]))
+            {
+                fAllIdle = false;
+                break;
+            }
+            idx++;
+        }
+
+        if (!fAllIdle)
+        {
+            int rc2 = RTSemEventWait(EventSem, 100);
+            Assert(RT_SUCCESS(rc2) || rc2 == VERR_TIMEOUT); NOREF(rc2);
+        }
+        else
+            break;
+    }
+
+    for (unsigned i = 0; i < cMaxTasksOutstanding; i++)
+    {
+        tstVDIoTestReqLatencyRecord(&paIoReq[i], pLatHist);
+        if (paIoReq[i].pvBufRead)
+            RTMemFree(paIoReq[i].pvBufRead);
+    }
+
+    RTSemEventDestroy(EventSem);
+    RTMemFree(paIoReq);
+    return rc;
+}
+
 static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUser)
 {
     int rc = VINF_SUCCESS;
@@ -781,239 +1176,272 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
         rc = tstVDIoTestInit(&IoTest, pGlob, fRandomAcc, cbIo, cbBlkSize, offStart, offEnd, uWriteChance, pPattern);
         if (RT_SUCCESS(rc))
         {
-            PVDIOREQ paIoReq = NULL;
-            unsigned cMaxTasksOutstanding = fAsync ? cMaxReqs : 1;
-            RTSEMEVENT EventSem;
-
-            rc = RTSemEventCreate(&EventSem);
-            paIoReq = (PVDIOREQ)RTMemAllocZ(cMaxTasksOutstanding * sizeof(VDIOREQ));
-            if (paIoReq && RT_SUCCESS(rc))
+            uint64_t NanoTS = RTTimeNanoTS();
+            rc = tstVDIoTestRun(pGlob, pDisk, &IoTest, 1, fAsync, fAsync ? cMaxReqs : 1, NULL);
+            NanoTS = RTTimeNanoTS() - NanoTS;
+            if (RT_SUCCESS(rc))
             {
-                uint64_t NanoTS = RTTimeNanoTS();
+                uint64_t SpeedKBs = tstVDIoGetSpeedKBs(cbIo, NanoTS);
+                RTTestValue(pGlob->hTest, "Throughput", SpeedKBs, RTTESTUNIT_KILOBYTES_PER_SEC);
+            }
 
-                /* Init requests. */
-                for (unsigned i = 0; i < cMaxTasksOutstanding; i++)
-                {
-                    paIoReq[i].idx = i;
-                    paIoReq[i].pvBufRead = RTMemAlloc(cbBlkSize);
-                    if (!paIoReq[i].pvBufRead)
-                    {
-                        rc = VERR_NO_MEMORY;
-                        break;
-                    }
-                }
+            tstVDIoTestDestroy(&IoTest);
+        }
+        RTTestSubDone(pGlob->hTest);
+    }
 
-                while (   tstVDIoTestRunning(&IoTest)
-                       && RT_SUCCESS(rc))
-                {
-                    bool fTasksOutstanding = false;
-                    unsigned idx = 0;
+    return rc;
+}
 
-                    /* Submit all idling requests. */
-                    while (   idx < cMaxTasksOutstanding
-                           && tstVDIoTestRunning(&IoTest))
-                    {
-                        if (!tstVDIoTestReqOutstanding(&paIoReq[idx]))
-                        {
-                            rc = tstVDIoTestReqInit(&IoTest, &paIoReq[idx], pDisk);
-                            AssertRC(rc);
+/**
+ * Parses a comma separated list of sizes or counts with an optional K, M or G
+ * suffix like "4K,64K,1M".
+ *
+ * @returns VBox status code.
+ * @param   pszList      The list to parse.
+ * @param   pau64        Where to store the values.
+ * @param   cMax         Maximum number of values the array can hold.
+ * @param   pcValues     Where to store the number of values parsed.
+ */
+static int tstVDIoParseList(const char *pszList, uint64_t *pau64, unsigned cMax, unsigned *pcValues)
+{
+    unsigned cValues = 0;
+    char *pszNext = (char *)pszList;
 
-                            if (RT_SUCCESS(rc))
-                            {
-                                if (!fAsync)
-                                {
-                                    switch (paIoReq[idx].enmTxDir)
-                                    {
-                                        case VDIOREQTXDIR_READ:
-                                        {
-                                            rc = VDRead(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].DataSeg.pvSeg, paIoReq[idx].cbReq);
-
-                                            if (RT_SUCCESS(rc)
-                                                && pDisk->pMemDiskVerify)
-                                            {
-                                                RTSGBUF SgBuf;
-                                                RTSgBufInit(&SgBuf, &paIoReq[idx].DataSeg, 1);
-
-                                                if (VDMemDiskCmp(pDisk->pMemDiskVerify, paIoReq[idx].off, paIoReq[idx].cbReq, &SgBuf))
-                                                {
-                                                    RTTestFailed(pGlob->hTest, "Corrupted disk at offset %llu!\n", paIoReq[idx].off);
-                                                    rc = VERR_INVALID_STATE;
-                                                }
-                                            }
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_WRITE:
-                                        {
-                                            rc = VDWrite(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].DataSeg.pvSeg, paIoReq[idx].cbReq);
-
-                                            if (RT_SUCCESS(rc)
-                                                && pDisk->pMemDiskVerify)
-                                            {
-                                                RTSGBUF SgBuf;
-                                                RTSgBufInit(&SgBuf, &paIoReq[idx].DataSeg, 1);
-                                                rc = VDMemDiskWrite(pDisk->pMemDiskVerify, paIoReq[idx].off, paIoReq[idx].cbReq, &SgBuf);
-                                            }
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_FLUSH:
-                                        {
-                                            rc = VDFlush(pDisk->pVD);
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_DISCARD:
-                                            AssertMsgFailed(("Invalid\n"));
-                                    }
-
-                                    ASMAtomicXchgBool(&paIoReq[idx].fOutstanding, false);
-                                    if (RT_SUCCESS(rc))
-                                        idx++;
-                                }
-                                else
-                                {
-                                    LogFlow(("Queuing request %d\n", idx));
-                                    switch (paIoReq[idx].enmTxDir)
-                                    {
-                                        case VDIOREQTXDIR_READ:
-                                        {
-                                            rc = VDAsyncRead(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
-                                                             tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_WRITE:
-                                        {
-                                            rc = VDAsyncWrite(pDisk->pVD, paIoReq[idx].off, paIoReq[idx].cbReq, &paIoReq[idx].SgBuf,
-                                                              tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_FLUSH:
-                                        {
-                                            rc = VDAsyncFlush(pDisk->pVD, tstVDIoTestReqComplete, &paIoReq[idx], EventSem);
-                                            break;
-                                        }
-                                        case VDIOREQTXDIR_DISCARD:
-                                            AssertMsgFailed(("Invalid\n"));
-                                    }
-
-                                    if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
-                                    {
-                                        idx++;
-                                        fTasksOutstanding = true;
-                                        rc = VINF_SUCCESS;
-                                    }
-                                    else if (rc == VINF_VD_ASYNC_IO_FINISHED)
-                                    {
-                                        LogFlow(("Request %d completed\n", idx));
-                                        switch (paIoReq[idx].enmTxDir)
-                                        {
-                                            case VDIOREQTXDIR_READ:
-                                            {
-                                                if (pDisk->pMemDiskVerify)
-                                                {
-                                                    RTCritSectEnter(&pDisk->CritSectVerify);
-                                                    RTSgBufReset(&paIoReq[idx].SgBuf);
-
-                                                    if (VDMemDiskCmp(pDisk->pMemDiskVerify, paIoReq[idx].off, paIoReq[idx].cbReq,
-                                                                     &paIoReq[idx].SgBuf))
-                                                    {
-                                                        RTTestFailed(pGlob->hTest, "Corrupted disk at offset %llu!\n", paIoReq[idx].off);
-                                                        rc = VERR_INVALID_STATE;
-                                                    }
-                                                    RTCritSectLeave(&pDisk->CritSectVerify);
-                                                }
-                                                break;
-                                            }
-                                            case VDIOREQTXDIR_WRITE:
-                                            {
-                                                if (pDisk->pMemDiskVerify)
-                                                {
-                                                    RTCritSectEnter(&pDisk->CritSectVerify);
-                                                    RTSgBufReset(&paIoReq[idx].SgBuf);
-
-                                                    rc = VDMemDiskWrite(pDisk->pMemDiskVerify, paIoReq[idx].off, paIoReq[idx].cbReq,
-                                                                        &paIoReq[idx].SgBuf);
-                                                    RTCritSectLeave(&pDisk->CritSectVerify);
-                                                }
-                                                break;
-                                            }
-                                            case VDIOREQTXDIR_FLUSH:
-                                                break;
-                                            case VDIOREQTXDIR_DISCARD:
-                                                AssertMsgFailed(("Invalid\n"));
-                                        }
-
-                                        ASMAtomicXchgBool(&paIoReq[idx].fOutstanding, false);
-                                        if (rc != VERR_INVALID_STATE)
-                                            rc = VINF_SUCCESS;
-                                    }
-                                }
+    while (*pszNext)
+    {
+        uint64_t u64 = 0;
+        int rc = RTStrToUInt64Ex(RTStrStripL(pszNext), &pszNext, 10, &u64);
+        if (RT_FAILURE(rc) && rc != VWRN_TRAILING_CHARS)
+            return VERR_INVALID_PARAMETER;
 
-                                if (RT_FAILURE(rc))
-                                    RTPrintf("Error submitting task %u rc=%Rrc\n", paIoReq[idx].idx, rc);
-                            }
-                        }
+        switch (RT_C_TO_UPPER(*pszNext))
+        {
+            case 'K': u64 *= _1K; pszNext++; break;
+            case 'M': u64 *= _1M; pszNext++; break;
+            case 'G': u64 *= _1G; pszNext++; break;
+            default: break;
+        }
+
+        pszNext = RTStrStripL(pszNext);
+        if (*pszNext == ',')
+            pszNext++;
+        else if (*pszNext)
+            return VERR_INVALID_PARAMETER;
+
+        if (!u64 || cValues == cMax)
+            return VERR_INVALID_PARAMETER;
+        pau64[cValues++] = u64;
+    }
+
+    *pcValues = cValues;
+    return cValues ? VINF_SUCCESS : VERR_INVALID_PARAMETER;
+}
+
+static DECLCALLBACK(int) vdScriptHandlerBenchmark(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszDisk = paScriptArgs[0].psz;
+    bool fAsync = paScriptArgs[1].f;
+    bool fRandomAcc = false;
+    uint64_t cbIo = paScriptArgs[6].u64;
+    uint8_t uWriteChance = (uint8_t)paScriptArgs[7].u64;
+    const char *pcszJson = paScriptArgs[8].psz;
+    uint64_t au64BlkSizes[16];
+    uint64_t au64IoDepths[16];
+    uint64_t au64Jobs[16];
+    unsigned cBlkSizes = 0;
+    unsigned cIoDepths = 0;
+    unsigned cJobsMax = 0;
+    PVDDISK pDisk = NULL;
+    PRTSTREAM pStrmJson = NULL;
+    PVDIOLATHIST pLatHist = NULL;
+
+    if (!RTStrICmp(paScriptArgs[2].psz, "seq"))
+        fRandomAcc = false;
+    else if (!RTStrICmp(paScriptArgs[2].psz, "rnd"))
+        fRandomAcc = true;
+    else
+    {
+        RTPrintf("Invalid access mode '%s'\n", paScriptArgs[2].psz);
+        rc = VERR_INVALID_PARAMETER;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        rc = tstVDIoParseList(paScriptArgs[3].psz, &au64BlkSizes[0], RT_ELEMENTS(au64BlkSizes), &cBlkSizes);
+        if (RT_SUCCESS(rc))
+            rc = tstVDIoParseList(paScriptArgs[4].psz, &au64IoDepths[0], RT_ELEMENTS(au64IoDepths), &cIoDepths);
+        if (RT_SUCCESS(rc))
+            rc = tstVDIoParseList(paScriptArgs[5].psz, &au64Jobs[0], RT_ELEMENTS(au64Jobs), &cJobsMax);
+        if (RT_FAILURE(rc))
+            RTPrintf("Invalid block size, I/O depth or job list\n");
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+        if (!pDisk)
+            rc = VERR_NOT_FOUND;
+    }
+
+    uint64_t cbDisk = 0;
+    if (RT_SUCCESS(rc))
+    {
+        cbDisk = VDGetSize(pDisk->pVD, VD_LAST_IMAGE);
+        if (!cbDisk)
+            rc = VERR_INVALID_STATE;
+        if (!cbIo)
+            cbIo = cbDisk;
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        pLatHist = (PVDIOLATHIST)RTMemAlloc(sizeof(VDIOLATHIST));
+        if (!pLatHist)
+            rc = VERR_NO_MEMORY;
+    }
+
+    if (   RT_SUCCESS(rc)
+        && RTStrCmp(pcszJson, "none"))
+    {
+        rc = RTStrmOpen(pcszJson, "w", &pStrmJson);
+        if (RT_SUCCESS(rc))
+            RTStrmPrintf(pStrmJson,
+                         "{\n"
+                         "  \"disk\": \"%s\",\n"
+                         "  \"backend\": \"%s\",\n"
+                         "  \"async\": %RTbool,\n"
+                         "  \"mode\": \"%s\",\n"
+                         "  \"writes\": %u,\n"
+                         "  \"results\": [",
+                         pcszDisk, pGlob->pszIoBackend, fAsync, fRandomAcc ? "rnd" : "seq", uWriteChance);
+        else
+            RTPrintf("Creating the JSON output file '%s' failed rc=%Rrc\n", pcszJson, rc);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        bool fFirst = true;
+
+        /* Synchronous I/O always has a depth of one, don't repeat the same run. */
+        if (!fAsync)
+            cIoDepths = 1;
+
+        RTTestSub(pGlob->hTest, "Benchmark");
+
+        for (unsigned iBlkSize = 0; iBlkSize < cBlkSizes && RT_SUCCESS(rc); iBlkSize++)
+            for (unsigned iIoDepth = 0; iIoDepth < cIoDepths && RT_SUCCESS(rc); iIoDepth++)
+                for (unsigned iJobs = 0; iJobs < cJobsMax && RT_SUCCESS(rc); iJobs++)
+                {
+                    uint64_t cbBlkSize = au64BlkSizes[iBlkSize];
+                    unsigned cReqsPerJob = fAsync ? (unsigned)au64IoDepths[iIoDepth] : 1;
+                    unsigned cJobs = (unsigned)au64Jobs[iJobs];
+
+                    /* Every job gets its own block aligned slice of the disk. */
+                    uint64_t cbSlice = (cbDisk / cJobs) & ~(cbBlkSize - 1);
+                    if (   !cbSlice
+                        || (cbBlkSize & (cbBlkSize - 1)))
+                    {
+                        RTPrintf("Block size %llu must be a power of two and fit %u times into the disk\n",
+                                 cbBlkSize, cJobs);
+                        rc = VERR_INVALID_PARAMETER;
+                        break;
                     }
 
-                    /* Wait for a request to complete. */
-                    if (   fAsync
-                        && fTasksOutstanding)
+                    PVDIOTEST paIoTests = (PVDIOTEST)RTMemAllocZ(cJobs * sizeof(VDIOTEST));
+                    if (!paIoTests)
                     {
-                        rc = RTSemEventWait(EventSem, RT_INDEFINITE_WAIT);
-                        AssertRC(rc);
+                        rc = VERR_NO_MEMORY;
+                        break;
                     }
-                }
 
-                /* Cleanup, wait for all tasks to complete. */
-                while (fAsync)
-                {
-                    unsigned idx = 0;
-                    bool fAllIdle = true;
+                    unsigned cJobsInit = 0;
+                    for (; cJobsInit < cJobs && RT_SUCCESS(rc); cJobsInit++)
+                        rc = tstVDIoTestInit(&paIoTests[cJobsInit], pGlob, fRandomAcc, cbIo / cJobs, cbBlkSize,
+                                             cbSlice * cJobsInit, cbSlice * (cJobsInit + 1), uWriteChance, NULL);
 
-                    while (idx < cMaxTasksOutstanding)
+                    if (RT_SUCCESS(rc))
                     {
-                        if (tstVDIoTestReqOutstanding(&paIoReq[idx]))
+                        uint64_t cMsKernelStart = 0, cMsUserStart = 0;
+                        uint64_t cMsKernel = 0, cMsUser = 0;
+
+                        tstVDIoLatHistInit(pLatHist);
+                        RTThreadGetExecutionTimeMilli(&cMsKernelStart, &cMsUserStart);
+                        uint64_t NanoTS = RTTimeNanoTS();
+                        rc = tstVDIoTestRun(pGlob, pDisk, paIoTests, cJobs, fAsync, cReqsPerJob, pLatHist);
+                        NanoTS = RTTimeNanoTS() - NanoTS;
+                        RTThreadGetExecutionTimeMilli(&cMsKernel, &cMsUser);
+
+                        if (RT_SUCCESS(rc))
                         {
-                            fAllIdle = false;
-                            break;
+                            uint64_t cbDone    = (cbIo / cJobs) * cJobs;
+                            uint64_t SpeedKBs  = tstVDIoGetSpeedKBs(cbDone, NanoTS);
+                            uint64_t cIops     = NanoTS ? pLatHist->cSamples * RT_NS_1SEC / NanoTS : 0;
+                            uint64_t cNsAvg    = pLatHist->cSamples ? pLatHist->cNsTotal / pLatHist->cSamples : 0;
+                            uint64_t cNsP50    = tstVDIoLatHistGetPercentile(pLatHist, 500);
+                            uint64_t cNsP99    = tstVDIoLatHistGetPercentile(pLatHist, 990);
+                            uint64_t cNsP999   = tstVDIoLatHistGetPercentile(pLatHist, 999);
+                            /* Only the submitting thread is accounted, I/O backend threads are not. */
+                            uint64_t cNsCpuPerIo =   pLatHist->cSamples
+                                                   ? (cMsKernel + cMsUser - cMsKernelStart - cMsUserStart) * RT_NS_1MS
+                                                     / pLatHist->cSamples
+                                                   : 0;
+
+                            RTTestValueF(pGlob->hTest, SpeedKBs, RTTESTUNIT_KILOBYTES_PER_SEC,
+                                         "bs=%llu qd=%u jobs=%u Throughput", cbBlkSize, cReqsPerJob, cJobs);
+                            RTTestValueF(pGlob->hTest, cIops, RTTESTUNIT_OCCURRENCES_PER_SEC,
+                                         "bs=%llu qd=%u jobs=%u IOPS", cbBlkSize, cReqsPerJob, cJobs);
+                            RTTestValueF(pGlob->hTest, cNsP50, RTTESTUNIT_NS,
+                                         "bs=%llu qd=%u jobs=%u Latency p50", cbBlkSize, cReqsPerJob, cJobs);
+                            RTTestValueF(pGlob->hTest, cNsP99, RTTESTUNIT_NS,
+                                         "bs=%llu qd=%u jobs=%u Latency p99", cbBlkSize, cReqsPerJob, cJobs);
+                            RTTestValueF(pGlob->hTest, cNsP999, RTTESTUNIT_NS,
+                                         "bs=%llu qd=%u jobs=%u Latency p99.9", cbBlkSize, cReqsPerJob, cJobs);
+                            RTTestValueF(pGlob->hTest, cNsCpuPerIo, RTTESTUNIT_NS_PER_OCCURRENCE,
+                                         "bs=%llu qd=%u jobs=%u CPU per I/O", cbBlkSize, cReqsPerJob, cJobs);
+
+                            if (pStrmJson)
+                            {
+                                RTStrmPrintf(pStrmJson,
+                                             "%s\n"
+                                             "    {\n"
+                                             "      \"blocksize\": %llu,\n"
+                                             "      \"iodepth\": %u,\n"
+                                             "      \"numjobs\": %u,\n"
+                                             "      \"bytes\": %llu,\n"
+                                             "      \"runtime_ns\": %llu,\n"
+                                             "      \"kbps\": %llu,\n"
+                                             "      \"iops\": %llu,\n"
+                                             "      \"cpu_ns_per_io\": %llu,\n"
+                                             "      \"latency_ns\": { \"min\": %llu, \"avg\": %llu, \"p50\": %llu, "
+                                             "\"p99\": %llu, \"p99.9\": %llu, \"max\": %llu }\n"
+                                             "    }",
+                                             fFirst ? "" : ",",
+                                             cbBlkSize, cReqsPerJob, cJobs, cbDone, NanoTS, SpeedKBs, cIops,
+                                             cNsCpuPerIo, pLatHist->cSamples ? pLatHist->cNsMin : 0, cNsAvg,
+                                             cNsP50, cNsP99, cNsP999, pLatHist->cNsMax);
+                                fFirst = false;
+                            }
                         }
-                        idx++;
                     }
 
-                    if (!fAllIdle)
-                    {
-                        rc = RTSemEventWait(EventSem, 100);
-                        Assert(RT_SUCCESS(rc) || rc == VERR_TIMEOUT);
-                    }
-                    else
-                        break;
-                }
-
-                NanoTS = RTTimeNanoTS() - NanoTS;
-                uint64_t SpeedKBs = tstVDIoGetSpeedKBs(cbIo, NanoTS);
-                RTTestValue(pGlob->hTest, "Throughput", SpeedKBs, RTTESTUNIT_KILOBYTES_PER_SEC);
-
-                for (unsigned i = 0; i < cMaxTasksOutstanding; i++)
-                {
-                    if (paIoReq[i].pvBufRead)
-                        RTMemFree(paIoReq[i].pvBufRead);
+                    for (unsigned i = 0; i < cJobsInit; i++)
+                        tstVDIoTestDestroy(&paIoTests[i]);
+                    RTMemFree(paIoTests);
                 }
 
-                RTSemEventDestroy(EventSem);
-                RTMemFree(paIoReq);
-            }
-            else
-            {
-                if (paIoReq)
-                    RTMemFree(paIoReq);
-                if RT_SUCCESS(rc)
-                    RTSemEventDestroy(EventSem);
-                rc = VERR_NO_MEMORY;
-            }
-
-            tstVDIoTestDestroy(&IoTest);
-        }
         RTTestSubDone(pGlob->hTest);
     }
 
+    if (pStrmJson)
+    {
+        RTStrmPrintf(pStrmJson, "\n  ]\n}\n");
+        RTStrmClose(pStrmJson);
+    }
+
+    RTMemFree(pLatHist);
     return rc;
 }
 
@@ -2543,7 +2971,7 @@ static int tstVDIoTestReqInit(PVDIOTEST pIoTest, PVDIOREQ pIoReq, void *pvUser)
                 }
 
                 Assert(idx != -1);
-                pIoReq->off = (uint64_t)idx * pIoTest->cbBlkIo;
+                pIoReq->off = RT_MIN(pIoTest->offStart, pIoTest->offEnd) + (uint64_t)idx * pIoTest->cbBlkIo;
                 pIoTest->u.Rnd.cBlocksLeft--;
                 if (!pIoTest->u.Rnd.cBlocksLeft)
                 {
@@ -2566,7 +2994,7 @@ static int tstVDIoTestReqInit(PVDIOTEST pIoTest, PVDIOREQ pIoReq, void *pvUser)
                 else
                 {
                     pIoTest->u.offNext = pIoTest->u.offNext + pIoTest->cbBlkIo >= pIoTest->offEnd
-                                         ? 0
+                                         ? pIoTest->offStart
                                          : RT_MIN(pIoTest->offEnd, pIoTest->u.offNext + pIoTest->cbBlkIo);
                 }
             }
@@ -2588,6 +3016,8 @@ static void tstVDIoTestReqComplete(void *pvUser1, void *pvUser2, int rcReq)
 
     LogFlow(("Request %d completed\n", pIoReq->idx));
 
+    pIoReq->cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+
     if (pDisk->pMemDiskVerify)
     {
         switch (pIoReq->enmTxDir)
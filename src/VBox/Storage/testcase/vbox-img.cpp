@@ -30,6 +30,7 @@
 #include <iprt/stream.h>
 #include <iprt/message.h>
 #include <iprt/getopt.h>
+#include <iprt/mem.h>
 #include <iprt/assert.h>
 #include <iprt/dvm.h>
 #include <iprt/filesystem.h>
@@ -58,7 +59,7 @@ static void printUsage(PRTSTREAM pStrm)
                  "                [--stdin]|[--stdout]\n"
                  "                [--srcformat VDI|VMDK|VHD|RAW|..]\n"
                  "                [--dstformat VDI|VMDK|VHD|RAW|..]\n"
-                 "                [--variant Standard,Fixed,Split2G,Stream,ESX]\n"
+                 "                [--variant Standard,Fixed,Split2G,Stream,ESX,Compressed]\n"
                  "\n"
                  "   info         --filename <filename>\n"
                  "\n"
@@ -71,7 +72,7 @@ static void printUsage(PRTSTREAM pStrm)
                  "   createbase   --filename <filename>\n"
                  "                --size <size in bytes>\n"
                  "                [--format VDI|VMDK|VHD] (default: VDI)\n"
-                 "                [--variant Standard,Fixed,Split2G,Stream,ESX]\n"
+                 "                [--variant Standard,Fixed,Split2G,Stream,ESX,Compressed]\n"
                  "                [--dataalignment <alignment in bytes>]\n"
                  "\n"
                  "   repair       --filename <filename>\n"
@@ -81,7 +82,10 @@ static void printUsage(PRTSTREAM pStrm)
                  "   clearcomment --filename <filename>\n"
                  "\n"
                  "   resize       --filename <filename>\n"
-                 "                --size <new size>\n",
+                 "                --size <new size>\n"
+                 "\n"
+                 "   dedupcompact --store <directory>\n"
+                 "                --map <filename> [--map <filename> ...]\n",
                  g_pszProgName);
 }
 
@@ -179,6 +183,8 @@ static int parseDiskVariant(const char *psz, unsigned *puImageFlags)
                 uImageFlags |= VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED;
             else if (!RTStrNICmp(psz, "esx", len))
                 uImageFlags |= VD_VMDK_IMAGE_FLAGS_ESX;
+            else if (!RTStrNICmp(psz, "compressed", len))
+                uImageFlags |= VD_VDI_IMAGE_FLAGS_COMPRESSED;
             else
                 rc = VERR_PARSE_ERROR;
         }
@@ -972,6 +978,8 @@ static int handleConvert(HandlerArg *a)
                     uImageFlags |= VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED;
                 else if (!RTStrNICmp(pszVariant, "esx", len))
                     uImageFlags |= VD_VMDK_IMAGE_FLAGS_ESX;
+                else if (!RTStrNICmp(pszVariant, "compressed", len))
+                    uImageFlags |= VD_VDI_IMAGE_FLAGS_COMPRESSED;
                 else
                     return errorSyntax("Invalid --variant option\n");
             }
@@ -1773,6 +1781,78 @@ static int handleClearResize(HandlerArg *a)
 }
 
 
+static int handleDedupCompact(HandlerArg *a)
+{
+    int rc = VINF_SUCCESS;
+    const char *pszStore = NULL;
+    const char **papszMaps = NULL;
+    unsigned cMaps = 0;
+
+    /* Parse the command line. */
+    static const RTGETOPTDEF s_aOptions[] =
+    {
+        { "--store", 's', RTGETOPT_REQ_STRING },
+        { "--map",   'm', RTGETOPT_REQ_STRING }
+    };
+    int ch;
+    RTGETOPTUNION ValueUnion;
+    RTGETOPTSTATE GetState;
+    RTGetOptInit(&GetState, a->argc, a->argv, s_aOptions, RT_ELEMENTS(s_aOptions), 0, 0 /* fFlags */);
+    while ((ch = RTGetOpt(&GetState, &ValueUnion)))
+    {
+        switch (ch)
+        {
+            case 's':   // --store
+                pszStore = ValueUnion.psz;
+                break;
+
+            case 'm':   // --map
+            {
+                const char **papszMapsNew = (const char **)RTMemRealloc(papszMaps, (cMaps + 1) * sizeof(const char *));
+                if (!papszMapsNew)
+                {
+                    RTMemFree(papszMaps);
+                    return errorRuntime("Out of memory\n");
+                }
+                papszMaps = papszMapsNew;
+                papszMaps[cMaps++] = ValueUnion.psz;
+                break;
+            }
+
+            default:
+                RTMemFree(papszMaps);
+                ch = RTGetOptPrintError(ch, &ValueUnion);
+                printUsage(g_pStdErr);
+                return ch;
+        }
+    }
+
+    /* Check for mandatory parameters. */
+    if (!pszStore)
+    {
+        RTMemFree(papszMaps);
+        return errorSyntax("Mandatory --store option missing\n");
+    }
+
+    /* Without any map everything would be removed, that is most likely not what the user wants. */
+    if (!cMaps)
+        return errorSyntax("At least one --map option is required, all maps referencing the store must be given\n");
+
+    uint64_t cBlocksFreed = 0;
+    uint64_t cBlocksInUse = 0;
+    rc = VDDedupStoreCompact(pszStore, papszMaps, cMaps, &cBlocksFreed, &cBlocksInUse);
+    if (rc == VERR_FILE_LOCK_VIOLATION)
+        rc = errorRuntime("The content store is in use by a running VM or being compacted already\n");
+    else if (RT_FAILURE(rc))
+        rc = errorRuntime("Error while compacting the content store: %Rrf (%Rrc)\n", rc, rc);
+    else
+        RTPrintf("Removed %llu unreferenced blocks, %llu blocks still in use\n", cBlocksFreed, cBlocksInUse);
+
+    RTMemFree(papszMaps);
+    return rc;
+}
+
+
 int main(int argc, char *argv[])
 {
     int exitcode = 0;
@@ -1865,6 +1945,7 @@ int main(int argc, char *argv[])
         { "repair",       handleRepair       },
         { "clearcomment", handleClearComment },
         { "resize",       handleClearResize  },
+        { "dedupcompact", handleDedupCompact },
         { NULL,           NULL               }
     };
 
@@ -1734,6 +1734,41 @@ int pgmPhysGCPhys2CCPtrInternalReadOnly(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys
 }
 
 
+/**
+ * Makes sure a page absent on a post-copy or lazy RAM restore target has
+ * arrived before it is mapped without going thru the access handlers.
+ *
+ * @returns VBox status code.
+ * @retval  VINF_SUCCESS if the page is present (or never was absent).
+ * @retval  VERR_PGM_PHYS_TLB_CATCH_ALL if the page is still absent and we
+ *          cannot wait for it here, i.e. in R0 and RC or while owning the
+ *          PGM lock.  The caller must take the access handler route.
+ *
+ * @param   pVM         Pointer to the VM.
+ * @param   GCPhys      The guest physical address.
+ *
+ * @remarks Cheap unless a post-copy target has pages outstanding.
+ */
+int pgmPhysPostCopyFaultIn(PVM pVM, RTGCPHYS GCPhys)
+{
+    if (RT_LIKELY(!ASMAtomicReadBool(&pVM->pgm.s.fPostCopyAbsent)))
+        return VINF_SUCCESS;
+
+    /* Absent pages are covered by catch-all handlers which are switched off
+       page by page as the contents arrive. */
+    PPGMPAGE pPage = pgmPhysGetPage(pVM, GCPhys);
+    if (   !pPage
+        || PGM_PAGE_GET_HNDL_PHYS_STATE(pPage) != PGM_PAGE_HNDL_PHYS_STATE_ALL
+        || PGM_PAGE_GET_TYPE(pPage) != PGMPAGETYPE_RAM)
+        return VINF_SUCCESS;
+#ifdef IN_RING3
+    return pgmR3PostCopyTrgFaultIn(pVM, GCPhys);
+#else
+    return VERR_PGM_PHYS_TLB_CATCH_ALL;
+#endif
+}
+
+
 /**
  * Requests the mapping of a guest page into the current context.
  *
@@ -1769,7 +1804,11 @@ int pgmPhysGCPhys2CCPtrInternalReadOnly(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys
  */
 VMM_INT_DECL(int) PGMPhysGCPhys2CCPtr(PVM pVM, RTGCPHYS GCPhys, void **ppv, PPGMPAGEMAPLOCK pLock)
 {
-    int rc = pgmLock(pVM);
+    int rc = pgmPhysPostCopyFaultIn(pVM, GCPhys);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = pgmLock(pVM);
     AssertRCReturn(rc, rc);
 
 #if defined(IN_RC) || defined(VBOX_WITH_2X_4GB_ADDR_SPACE_IN_R0)
@@ -1872,7 +1911,11 @@ VMM_INT_DECL(int) PGMPhysGCPhys2CCPtr(PVM pVM, RTGCPHYS GCPhys, void **ppv, PPGM
  */
 VMM_INT_DECL(int) PGMPhysGCPhys2CCPtrReadOnly(PVM pVM, RTGCPHYS GCPhys, void const **ppv, PPGMPAGEMAPLOCK pLock)
 {
-    int rc = pgmLock(pVM);
+    int rc = pgmPhysPostCopyFaultIn(pVM, GCPhys);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = pgmLock(pVM);
     AssertRCReturn(rc, rc);
 
 #if defined(IN_RC) || defined(VBOX_WITH_2X_4GB_ADDR_SPACE_IN_R0)
@@ -2128,11 +2171,16 @@ int pgmPhysGCPhys2R3Ptr(PVM pVM, RTGCPHYS GCPhys, PRTR3PTR pR3Ptr)
     NOREF(pVM); NOREF(pR3Ptr);
     AssertFailedReturn(VERR_NOT_IMPLEMENTED);
 #else
+    /* The guest page table walker gets here, it must not see absent pages. */
+    int rc = pgmPhysPostCopyFaultIn(pVM, GCPhys);
+    if (RT_FAILURE(rc))
+        return rc;
+
     pgmLock(pVM);
 
     PPGMRAMRANGE pRam;
     PPGMPAGE pPage;
-    int rc = pgmPhysGetPageAndRangeEx(pVM, GCPhys, &pPage, &pRam);
+    rc = pgmPhysGetPageAndRangeEx(pVM, GCPhys, &pPage, &pRam);
     if (RT_SUCCESS(rc))
         rc = pgmPhysGCPhys2CCPtrInternalDepr(pVM, pPage, GCPhys, (void **)pR3Ptr);
 
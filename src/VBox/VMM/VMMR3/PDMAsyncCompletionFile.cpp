@@ -442,6 +442,7 @@ int pdmacFileAioMgrCreate(PPDMASYNCCOMPLETIONEPCLASSFILE pEpClass, PPPDMACEPFILE
             pAioMgrNew->enmMgrType = pEpClass->enmMgrTypeOverride;
 
         pAioMgrNew->msBwLimitExpired = RT_INDEFINITE_WAIT;
+        pAioMgrNew->fAioCtxFlags     = pEpClass->fIoRing ? RTFILEAIOCTX_FLAGS_IO_RING : 0;
 
         rc = RTSemEventCreate(&pAioMgrNew->EventSem);
         if (RT_SUCCESS(rc))
@@ -836,8 +837,29 @@ static DECLCALLBACK(int) pdmacFileInitialize(PPDMASYNCCOMPLETIONEPCLASS pClassGl
             LogRel(("AIOMgr: Default file backend is '%s'\n", pdmacFileBackendTypeToName(pEpClassFile->enmEpBackendDefault)));
 
 #ifdef RT_OS_LINUX
+            /* Check whether io_uring should and can be used. */
+            bool fIoRing = false;
+            rc = CFGMR3QueryBoolDef(pCfgNode, "UseIoRing", &fIoRing, false);
+            AssertLogRelRCReturn(rc, rc);
+
+            if (fIoRing)
+            {
+                RTFILEAIOCTX hAioCtx = NIL_RTFILEAIOCTX;
+                rc = RTFileAioCtxCreate(&hAioCtx, 64 /* cAioReqsMax */, RTFILEAIOCTX_FLAGS_IO_RING);
+                if (RT_SUCCESS(rc))
+                {
+                    RTFileAioCtxDestroy(hAioCtx);
+                    pEpClassFile->fIoRing = true;
+                    LogRel(("AIOMgr: Using io_uring for async I/O\n"));
+                }
+                else
+                    LogRel(("AIOMgr: io_uring is not supported by the host (rc=%Rrc), using the legacy interface\n", rc));
+                rc = VINF_SUCCESS;
+            }
+
             if (   pEpClassFile->enmMgrTypeOverride == PDMACEPFILEMGRTYPE_ASYNC
-                && pEpClassFile->enmEpBackendDefault == PDMACFILEEPBACKEND_BUFFERED)
+                && pEpClassFile->enmEpBackendDefault == PDMACFILEEPBACKEND_BUFFERED
+                && !pEpClassFile->fIoRing)
             {
                 LogRel(("AIOMgr: Linux does not support buffered async I/O, changing to non buffered\n"));
                 pEpClassFile->enmEpBackendDefault = PDMACFILEEPBACKEND_NON_BUFFERED;
@@ -906,7 +928,9 @@ static DECLCALLBACK(int) pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndp
      */
     if (fFlags & PDMACEP_FILE_FLAGS_HOST_CACHE_ENABLED)
     {
-        enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
+        /* io_uring handles buffered files asynchronously, so keep the async manager in that case. */
+        if (!pEpClassFile->fIoRing)
+            enmMgrType = PDMACEPFILEMGRTYPE_SIMPLE;
         enmEpBackend = PDMACFILEEPBACKEND_BUFFERED;
     }
 
@@ -927,7 +951,10 @@ static DECLCALLBACK(int) pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndp
             fFileFlags |= RTFILE_O_DENY_WRITE;
     }
 
-    if (enmMgrType == PDMACEPFILEMGRTYPE_ASYNC)
+    /* RTFILE_O_ASYNC_IO implies O_DIRECT on Linux which io_uring doesn't need for buffered files. */
+    if (   enmMgrType == PDMACEPFILEMGRTYPE_ASYNC
+        && (   enmEpBackend == PDMACFILEEPBACKEND_NON_BUFFERED
+            || !pEpClassFile->fIoRing))
         fFileFlags |= RTFILE_O_ASYNC_IO;
 
     int rc;
@@ -958,7 +985,8 @@ static DECLCALLBACK(int) pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndp
 
 #ifdef RT_OS_LINUX
                 fFileFlags &= ~RTFILE_O_ASYNC_IO;
-                enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
+                if (!pEpClassFile->fIoRing)
+                    enmMgrType = PDMACEPFILEMGRTYPE_SIMPLE;
 #endif
             }
             RTFileClose(hFile);
@@ -988,7 +1016,8 @@ static DECLCALLBACK(int) pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndp
 
 #ifdef RT_OS_LINUX
         fFileFlags &= ~RTFILE_O_ASYNC_IO;
-        enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
+        if (!pEpClassFile->fIoRing)
+            enmMgrType = PDMACEPFILEMGRTYPE_SIMPLE;
 #endif
 
         /* Open again. */
@@ -55,9 +55,9 @@ int pdmacFileAioMgrNormalInit(PPDMACEPFILEMGR pAioMgr)
 {
     pAioMgr->cRequestsActiveMax = PDMACEPFILEMGR_REQS_STEP;
 
-    int rc = RTFileAioCtxCreate(&pAioMgr->hAioCtx, RTFILEAIO_UNLIMITED_REQS, 0 /* fFlags */);
+    int rc = RTFileAioCtxCreate(&pAioMgr->hAioCtx, RTFILEAIO_UNLIMITED_REQS, pAioMgr->fAioCtxFlags);
     if (rc == VERR_OUT_OF_RANGE)
-        rc = RTFileAioCtxCreate(&pAioMgr->hAioCtx, pAioMgr->cRequestsActiveMax, 0 /* fFlags */);
+        rc = RTFileAioCtxCreate(&pAioMgr->hAioCtx, pAioMgr->cRequestsActiveMax, pAioMgr->fAioCtxFlags);
 
     if (RT_SUCCESS(rc))
     {
@@ -355,9 +355,9 @@ static int pdmacFileAioMgrNormalGrow(PPDMACEPFILEMGR pAioMgr)
     pAioMgr->cRequestsActiveMax += PDMACEPFILEMGR_REQS_STEP;
 
     RTFILEAIOCTX hAioCtxNew = NIL_RTFILEAIOCTX;
-    int rc = RTFileAioCtxCreate(&hAioCtxNew, RTFILEAIO_UNLIMITED_REQS, 0 /* fFlags */);
+    int rc = RTFileAioCtxCreate(&hAioCtxNew, RTFILEAIO_UNLIMITED_REQS, pAioMgr->fAioCtxFlags);
     if (rc == VERR_OUT_OF_RANGE)
-        rc = RTFileAioCtxCreate(&hAioCtxNew, pAioMgr->cRequestsActiveMax, 0 /* fFlags */);
+        rc = RTFileAioCtxCreate(&hAioCtxNew, pAioMgr->cRequestsActiveMax, pAioMgr->fAioCtxFlags);
 
     if (RT_SUCCESS(rc))
     {
@@ -17,6 +17,21 @@
 
 /** @page pg_pdm_block_cache     PDM Block Cache - The I/O cache
  * This component implements an I/O cache based on the 2Q cache algorithm.
+ *
+ * Alternatively the adaptive replacement cache (ARC) algorithm can be selected
+ * with the PDM/BlkCache/ReplacementPolicy CFGM key. ARC reuses the 2Q lists
+ * (T1 = recently used in, B1 = recently used out, T2 = frequently used) and adds
+ * a second ghost list (B2) for entries evicted from the frequently used list.
+ * The target size of the recently used list is adapted on every ghost list hit,
+ * which keeps the frequently used set intact during large sequential scans.
+ *
+ * Cache hits don't touch the LRU lists and therefore don't need the global
+ * cache lock. A hit only sets the reference bit of the entry and the list
+ * update is deferred to the eviction path which runs with the lock held
+ * anyway: referenced entries at the tail of the frequently used list get a
+ * second chance at the head (and referenced entries at the tail of the
+ * recently used list are promoted to the frequently used list for ARC)
+ * instead of being evicted, like a CLOCK hand sweeping over the list.
  */
 
 
@@ -109,8 +124,12 @@ static void pdmBlkCacheValidate(PPDMBLKCACHEGLOBAL pCache)
     AssertMsg(pCache->LruRecentlyUsedIn.cbCached + pCache->LruFrequentlyUsed.cbCached == pCache->cbCached,
               ("Amount of cached data doesn't match\n"));
 
-    AssertMsg(pCache->LruRecentlyUsedOut.cbCached <= pCache->cbRecentlyUsedOutMax,
-              ("Paged out list exceeds maximum\n"));
+    if (pCache->enmPolicy == PDMBLKCACHEPOLICY_2Q)
+        AssertMsg(pCache->LruRecentlyUsedOut.cbCached <= pCache->cbRecentlyUsedOutMax,
+                  ("Paged out list exceeds maximum\n"));
+    else
+        AssertMsg(pCache->LruRecentlyUsedOut.cbCached <= pCache->cbMax,
+                  ("Paged out list exceeds maximum\n"));
 }
 #endif
 
@@ -278,6 +297,113 @@ static void pdmBlkCacheEntryAddToList(PPDMBLKLRULIST pList, PPDMBLKCACHEENTRY pE
 #endif
 }
 
+/**
+ * Returns the maximum number of bytes the given ghost list may hold.
+ *
+ * @returns Maximum size of the ghost list in bytes.
+ * @param   pCache        Pointer to the global cache data.
+ * @param   pGhostList    The ghost list.
+ *
+ * @note The caller must own the critical section of the cache.
+ */
+static size_t pdmBlkCacheGhostListMax(PPDMBLKCACHEGLOBAL pCache, PPDMBLKLRULIST pGhostList)
+{
+    if (pCache->enmPolicy == PDMBLKCACHEPOLICY_2Q)
+        return pCache->cbRecentlyUsedOutMax;
+
+    /*
+     * ARC keeps the size of T1 + B1 below the cache size and the size
+     * of all four lists below twice the cache size.
+     */
+    uint64_t cbUsed;
+    uint64_t cbLimit;
+    if (pGhostList == &pCache->LruRecentlyUsedOut)
+    {
+        cbUsed  = pCache->LruRecentlyUsedIn.cbCached;
+        cbLimit = pCache->cbMax;
+    }
+    else
+    {
+        Assert(pGhostList == &pCache->LruFrequentlyUsedOut);
+        cbUsed  =   (uint64_t)pCache->LruRecentlyUsedIn.cbCached
+                  + pCache->LruRecentlyUsedOut.cbCached
+                  + pCache->LruFrequentlyUsed.cbCached;
+        cbLimit = 2 * (uint64_t)pCache->cbMax;
+    }
+
+    return cbUsed < cbLimit ? (size_t)(cbLimit - cbUsed) : 0;
+}
+
+/**
+ * Updates the cache state for a hit on an entry holding data.
+ *
+ * This only marks the entry as referenced without taking the cache lock,
+ * the entry is moved when it reaches the tail of its list during eviction
+ * (see pdmBlkCacheEvictPagesFrom()).
+ *
+ * @returns nothing.
+ * @param   pCache    Pointer to the global cache data.
+ * @param   pEntry    The entry which was hit, must be referenced by the caller.
+ */
+DECLINLINE(void) pdmBlkCacheEntryHit(PPDMBLKCACHEGLOBAL pCache, PPDMBLKCACHEENTRY pEntry)
+{
+    NOREF(pCache);
+    Assert(pEntry->cRefs > 0);
+
+    /* Avoid dirtying the cache line if the bit is already set. */
+    if (!ASMAtomicReadBool(&pEntry->fReferenced))
+        ASMAtomicWriteBool(&pEntry->fReferenced, true);
+}
+
+/**
+ * Updates the cache state for a hit on an entry in one of the ghost lists.
+ *
+ * For ARC the target size of the recently used list is adapted. A hit in B1
+ * means the recently used list was too small, a hit in B2 means the frequently
+ * used list was too small.
+ *
+ * @returns nothing.
+ * @param   pCache    Pointer to the global cache data.
+ * @param   pEntry    The ghost entry which was hit.
+ *
+ * @note The caller must own the critical section of the cache and call this
+ *       before the entry is removed from the ghost list.
+ */
+static void pdmBlkCacheEntryGhostHit(PPDMBLKCACHEGLOBAL pCache, PPDMBLKCACHEENTRY pEntry)
+{
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
+
+    if (pEntry->pList == &pCache->LruRecentlyUsedOut)
+    {
+        STAM_REL_COUNTER_INC(&pCache->StatGhostHitsRecentlyUsed);
+
+        if (pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+        {
+            uint32_t cbB1 = pCache->LruRecentlyUsedOut.cbCached;
+            uint32_t cbB2 = pCache->LruFrequentlyUsedOut.cbCached;
+            uint64_t cbDelta = (uint64_t)RT_MAX(cbB2 / RT_MAX(cbB1, 1), 1) * pEntry->cbData;
+
+            pCache->cbRecentlyUsedInMax = (uint32_t)RT_MIN(pCache->cbRecentlyUsedInMax + cbDelta, pCache->cbMax);
+        }
+    }
+    else
+    {
+        Assert(pEntry->pList == &pCache->LruFrequentlyUsedOut);
+        STAM_REL_COUNTER_INC(&pCache->StatGhostHitsFrequentlyUsed);
+
+        uint32_t cbB1 = pCache->LruRecentlyUsedOut.cbCached;
+        uint32_t cbB2 = pCache->LruFrequentlyUsedOut.cbCached;
+        uint64_t cbDelta = (uint64_t)RT_MAX(cbB1 / RT_MAX(cbB2, 1), 1) * pEntry->cbData;
+
+        if (pCache->cbRecentlyUsedInMax > cbDelta)
+            pCache->cbRecentlyUsedInMax -= (uint32_t)cbDelta;
+        else
+            pCache->cbRecentlyUsedInMax = 0;
+    }
+
+    LogFlowFunc(("cbRecentlyUsedInMax=%u\n", pCache->cbRecentlyUsedInMax));
+}
+
 /**
  * Destroys a LRU list freeing all entries.
  *
@@ -330,8 +456,9 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
 
     AssertMsg(cbData > 0, ("Evicting 0 bytes not possible\n"));
     AssertMsg(   !pGhostListDst
-              || (pGhostListDst == &pCache->LruRecentlyUsedOut),
-              ("Destination list must be NULL or the recently used but paged out list\n"));
+              || (pGhostListDst == &pCache->LruRecentlyUsedOut)
+              || (pGhostListDst == &pCache->LruFrequentlyUsedOut),
+              ("Destination list must be NULL or one of the paged out lists\n"));
 
     if (fReuseBuffer)
     {
@@ -348,6 +475,24 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
 
         pEntry = pEntry->pPrev;
 
+        /*
+         * Give entries which were hit since they were last moved a second chance.
+         * For 2Q this only applies to the frequently used list, ARC promotes
+         * referenced entries from the recently used list as well.
+         */
+        if (ASMAtomicXchgBool(&pCurr->fReferenced, false))
+        {
+            if (   pListSrc == &pCache->LruFrequentlyUsed
+                || pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+            {
+                LogFlow(("Entry %#p (%u bytes) was referenced, moving to the frequently used list\n",
+                         pCurr, pCurr->cbData));
+                pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pCurr);
+                STAM_COUNTER_INC(&pCache->StatSecondChance);
+                continue;
+            }
+        }
+
         /* We can't evict pages which are currently in progress or dirty but not in progress */
         if (   !(pCurr->fFlags & PDMBLKCACHE_NOT_EVICTABLE)
             && (ASMAtomicReadU32(&pCurr->cRefs) == 0))
@@ -381,9 +526,10 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
                     PPDMBLKCACHEENTRY pGhostEntFree = pGhostListDst->pTail;
+                    size_t cbGhostMax = pdmBlkCacheGhostListMax(pCache, pGhostListDst);
 
                     /* We have to remove the last entries from the paged out list. */
-                    while (   pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax
+                    while (   pGhostListDst->cbCached + pCurr->cbData > cbGhostMax
                            && pGhostEntFree)
                     {
                         PPDMBLKCACHEENTRY pFree = pGhostEntFree;
@@ -407,7 +553,7 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                         RTSemRWReleaseWrite(pBlkCacheFree->SemRWEntries);
                     }
 
-                    if (pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax)
+                    if (pGhostListDst->cbCached + pCurr->cbData > cbGhostMax)
                     {
                         /* Couldn't remove enough entries. Delete */
                         STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
@@ -442,6 +588,10 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
 static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fReuseBuffer, uint8_t **ppbBuffer)
 {
     size_t cbRemoved = 0;
+    /* ARC remembers entries evicted from the frequently used list too. */
+    PPDMBLKLRULIST pGhostListFrequentlyUsed =   pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC
+                                              ? &pCache->LruFrequentlyUsedOut
+                                              : NULL;
 
     if ((pCache->cbCached + cbData) < pCache->cbMax)
         return true;
@@ -465,17 +615,32 @@ static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fR
              */
             if (!cbRemoved)
                 cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
-                                                          NULL, fReuseBuffer, ppbBuffer);
+                                                          pGhostListFrequentlyUsed, fReuseBuffer, ppbBuffer);
             else
                 cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData - cbRemoved, &pCache->LruFrequentlyUsed,
-                                                          NULL, false, NULL);
+                                                          pGhostListFrequentlyUsed, false, NULL);
         }
     }
     else
     {
         /* We have to remove entries from frequently access list. */
         cbRemoved = pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
-                                                 NULL, fReuseBuffer, ppbBuffer);
+                                                 pGhostListFrequentlyUsed, fReuseBuffer, ppbBuffer);
+
+        /*
+         * The recently used list might be below its target size for ARC
+         * and contain the only evictable entries.
+         */
+        if (   cbRemoved < cbData
+            && pCache->enmPolicy == PDMBLKCACHEPOLICY_ARC)
+        {
+            if (!cbRemoved)
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruRecentlyUsedIn,
+                                                       &pCache->LruRecentlyUsedOut, fReuseBuffer, ppbBuffer);
+            else
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData - cbRemoved, &pCache->LruRecentlyUsedIn,
+                                                       &pCache->LruRecentlyUsedOut, false, NULL);
+        }
     }
 
     LogFlowFunc((": removed %u bytes, requested %u\n", cbRemoved, cbData));
@@ -1023,14 +1188,41 @@ int pdmR3BlkCacheInit(PVM pVM)
     pBlkCacheGlobal->LruFrequentlyUsed.pTail    = NULL;
     pBlkCacheGlobal->LruFrequentlyUsed.cbCached = 0;
 
+    pBlkCacheGlobal->LruFrequentlyUsedOut.pHead    = NULL;
+    pBlkCacheGlobal->LruFrequentlyUsedOut.pTail    = NULL;
+    pBlkCacheGlobal->LruFrequentlyUsedOut.cbCached = 0;
+
     do
     {
         rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheSize", &pBlkCacheGlobal->cbMax, 5 * _1M);
         AssertLogRelRCBreak(rc);
         LogFlowFunc(("Maximum number of bytes cached %u\n", pBlkCacheGlobal->cbMax));
 
-        pBlkCacheGlobal->cbRecentlyUsedInMax  = (pBlkCacheGlobal->cbMax / 100) * 25; /* 25% of the buffer size */
-        pBlkCacheGlobal->cbRecentlyUsedOutMax = (pBlkCacheGlobal->cbMax / 100) * 50; /* 50% of the buffer size */
+        char szPolicy[16];
+        rc = CFGMR3QueryStringDef(pCfgBlkCache, "ReplacementPolicy", szPolicy, sizeof(szPolicy), "2Q");
+        AssertLogRelRCBreak(rc);
+        if (!RTStrICmp(szPolicy, "2Q"))
+            pBlkCacheGlobal->enmPolicy = PDMBLKCACHEPOLICY_2Q;
+        else if (!RTStrICmp(szPolicy, "ARC"))
+            pBlkCacheGlobal->enmPolicy = PDMBLKCACHEPOLICY_ARC;
+        else
+        {
+            rc = VMSetError(pVM, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                            N_("BlkCache: Invalid replacement policy '%s' (must be '2Q' or 'ARC')"), szPolicy);
+            break;
+        }
+
+        if (pBlkCacheGlobal->enmPolicy == PDMBLKCACHEPOLICY_2Q)
+        {
+            pBlkCacheGlobal->cbRecentlyUsedInMax  = (pBlkCacheGlobal->cbMax / 100) * 25; /* 25% of the buffer size */
+            pBlkCacheGlobal->cbRecentlyUsedOutMax = (pBlkCacheGlobal->cbMax / 100) * 50; /* 50% of the buffer size */
+        }
+        else
+        {
+            /* The target size adapts at runtime and the ghost lists are sized dynamically. */
+            pBlkCacheGlobal->cbRecentlyUsedInMax  = 0;
+            pBlkCacheGlobal->cbRecentlyUsedOutMax = pBlkCacheGlobal->cbMax;
+        }
         LogFlowFunc(("cbRecentlyUsedInMax=%u cbRecentlyUsedOutMax=%u\n",
                      pBlkCacheGlobal->cbRecentlyUsedInMax, pBlkCacheGlobal->cbRecentlyUsedOutMax));
 
@@ -1068,6 +1260,28 @@ int pdmR3BlkCacheInit(PVM pVM)
                        "/PDM/BlkCache/cbCachedFru",
                        STAMUNIT_BYTES,
                        "Number of bytes cached in FRU ghost list");
+        STAMR3Register(pVM, &pBlkCacheGlobal->LruFrequentlyUsedOut.cbCached,
+                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/cbCachedFruOut",
+                       STAMUNIT_BYTES,
+                       "Number of bytes in the FRU ghost list (ARC only)");
+        STAMR3Register(pVM, &pBlkCacheGlobal->cbRecentlyUsedInMax,
+                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/cbMruInMax",
+                       STAMUNIT_BYTES,
+                       "Target size of the MRU list (adaptive for ARC)");
+        STAMR3Register(pVM, &pBlkCacheGlobal->StatGhostHitsRecentlyUsed,
+                       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/GhostHitsMruOut",
+                       STAMUNIT_COUNT, "Number of hits in the MRU ghost list");
+        STAMR3Register(pVM, &pBlkCacheGlobal->StatGhostHitsFrequentlyUsed,
+                       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/GhostHitsFruOut",
+                       STAMUNIT_COUNT, "Number of hits in the FRU ghost list (ARC only)");
+        STAMR3Register(pVM, &pBlkCacheGlobal->StatGhostMisses,
+                       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/GhostMisses",
+                       STAMUNIT_COUNT, "Number of misses which didn't hit any ghost list either");
 
 #ifdef VBOX_WITH_STATISTICS
         STAMR3Register(pVM, &pBlkCacheGlobal->cHits,
@@ -1106,6 +1320,10 @@ int pdmR3BlkCacheInit(PVM pVM)
                        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
                        "/PDM/BlkCache/CacheBuffersReused",
                        STAMUNIT_COUNT, "Number of times a buffer could be reused");
+        STAMR3Register(pVM, &pBlkCacheGlobal->StatSecondChance,
+                       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS,
+                       "/PDM/BlkCache/CacheSecondChance",
+                       STAMUNIT_COUNT, "Number of referenced entries moved instead of evicted");
 #endif
 
         /* Initialize the critical section */
@@ -1132,6 +1350,8 @@ int pdmR3BlkCacheInit(PVM pVM)
             if (RT_SUCCESS(rc))
             {
                 LogRel(("BlkCache: Cache successfully initialized. Cache size is %u bytes\n", pBlkCacheGlobal->cbMax));
+                LogRel(("BlkCache: Cache replacement policy is %s\n",
+                        pBlkCacheGlobal->enmPolicy == PDMBLKCACHEPOLICY_ARC ? "ARC" : "2Q"));
                 LogRel(("BlkCache: Cache commit interval is %u ms\n", pBlkCacheGlobal->u32CommitTimeoutMs));
                 LogRel(("BlkCache: Cache commit threshold is %u bytes\n", pBlkCacheGlobal->cbCommitDirtyThreshold));
                 pUVM->pdm.s.pBlkCacheGlobal = pBlkCacheGlobal;
@@ -1162,6 +1382,7 @@ void pdmR3BlkCacheTerm(PVM pVM)
         pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedIn);
         pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedOut);
         pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruFrequentlyUsed);
+        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruFrequentlyUsedOut);
 
         pdmBlkCacheLockLeave(pBlkCacheGlobal);
 
@@ -2010,12 +2231,7 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                 }
 
                 /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
-                {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
-                }
+                pdmBlkCacheEntryHit(pCache, pEntry);
                 /* Release the entry */
                 pdmBlkCacheEntryRelease(pEntry);
             }
@@ -2026,6 +2242,7 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                 LogFlow(("Fetching data for ghost entry %#p from file\n", pEntry));
 
                 pdmBlkCacheLockEnter(pCache);
+                pdmBlkCacheEntryGhostHit(pCache, pEntry);
                 pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
                 bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
 
@@ -2077,6 +2294,8 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
 
             cbRead -= cbToRead;
 
+            STAM_REL_COUNTER_INC(&pCache->StatGhostMisses);
+
             if (pEntryNew)
             {
                 if (!cbRead)
@@ -2245,12 +2464,7 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
                 } /* Dirty bit not set */
 
                 /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
-                {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
-                }
+                pdmBlkCacheEntryHit(pCache, pEntry);
 
                 pdmBlkCacheEntryRelease(pEntry);
             }
@@ -2259,6 +2473,7 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
                 uint8_t *pbBuffer = NULL;
 
                 pdmBlkCacheLockEnter(pCache);
+                pdmBlkCacheEntryGhostHit(pCache, pEntry);
                 pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
                 bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
 
@@ -2313,6 +2528,8 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
 
             cbWrite -= cbToWrite;
 
+            STAM_REL_COUNTER_INC(&pCache->StatGhostMisses);
+
             if (pEntryNew)
             {
                 uint64_t offDiff = off - pEntryNew->Core.Key;
@@ -1466,6 +1466,8 @@ VMMR3DECL(int) PGMR3Init(PVM pVM)
                                               NULL, NULL, "pgmPhysRomWritePfHandler",
                                               "ROM write protection",
                                               &pVM->pgm.s.hRomPhysHandlerType);
+    if (RT_SUCCESS(rc))
+        rc = pgmR3PostCopyInit(pVM);
 
     /*
      * Init the paging.
@@ -1752,6 +1754,9 @@ static int pgmR3InitStats(PVM pVM)
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cDirtyPagesShort,     STAMTYPE_U32,     "/PGM/LiveSave/cDirtyPagesShort",     STAMUNIT_COUNT,     "Short term dirty page average.");
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cPagesPerSecond,      STAMTYPE_U32,     "/PGM/LiveSave/cPagesPerSecond",      STAMUNIT_COUNT,     "Pages per second.");
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cSavedPages,          STAMTYPE_U64,     "/PGM/LiveSave/cSavedPages",          STAMUNIT_COUNT,     "The total number of saved pages.");
+    STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cDeltaPages,          STAMTYPE_U64,     "/PGM/LiveSave/cDeltaPages",          STAMUNIT_COUNT,     "The number of RAM pages saved as deltas.");
+    STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cbDeltaSaved,         STAMTYPE_U64,     "/PGM/LiveSave/cbDeltaSaved",         STAMUNIT_BYTES,     "The number of bytes saved by delta encoding RAM pages.");
+    STAM_REL_REG_USED(pVM, &pPGM->LiveSave.cDupPages,            STAMTYPE_U64,     "/PGM/LiveSave/cDupPages",            STAMUNIT_COUNT,     "The number of RAM pages saved as references to identical pages.");
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.Ram.cReadyPages,      STAMTYPE_U32,     "/PGM/LiveSave/Ram/cReadPages",       STAMUNIT_COUNT,     "RAM: Ready pages.");
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.Ram.cDirtyPages,      STAMTYPE_U32,     "/PGM/LiveSave/Ram/cDirtyPages",      STAMUNIT_COUNT,     "RAM: Dirty pages.");
     STAM_REL_REG_USED(pVM, &pPGM->LiveSave.Ram.cZeroPages,       STAMTYPE_U32,     "/PGM/LiveSave/Ram/cZeroPages",       STAMUNIT_COUNT,     "RAM: Ready zero pages.");
@@ -2575,6 +2580,11 @@ VMMR3_INT_DECL(void) PGMR3Reset(PVM pVM)
 
     pgmLock(pVM);
 
+    /*
+     * Stop waiting for pages still absent after a post-copy migration.
+     */
+    pgmR3PostCopyReset(pVM);
+
     /*
      * Unfix any fixed mappings and disable CR3 monitoring.
      */
@@ -2708,6 +2718,7 @@ VMMR3DECL(int) PGMR3Term(PVM pVM)
     pgmR3PhysRomTerm(pVM);
     pgmUnlock(pVM);
 
+    pgmR3PostCopyTerm(pVM);
     PGMDeregisterStringFormatTypes();
     return PDMR3CritSectDelete(&pVM->pgm.s.CritSectX);
 }
@@ -0,0 +1,1322 @@
+/* $Id$ */
+/** @file
+ * PGM - Page Manager and Monitor, Post-copy live migration.
+ */
+
+/*
+ * Copyright (C) 2006-2015 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_pgm_post_copy  PGM Post-copy Live Migration
+ *
+ * With plain live migration (pre-copy) RAM pages are sent over and over again
+ * until the guest dirties few enough pages for the rest to be sent while the
+ * VM is suspended.  Guests writing heavily to their memory never get there.
+ *
+ * In post-copy mode the source does a configurable number of pre-copy passes
+ * (PGM/PostCopyPrecopyPasses, default 1) and then stops.  The final pass saves
+ * an absent record (PGM_STATE_REC_RAM_ABSENT) for each RAM page which is still
+ * dirty instead of its contents, and the source remembers these pages.  The
+ * target loads the state and can be resumed right away.
+ *
+ * The target backs the absent pages with memory and covers them with
+ * physical access handlers.  Any access to such a page ends up in
+ * pgmR3PostCopyHandler, which asks the source for the page through a callback
+ * and blocks the accessing thread until the page arrives.  Other vCPUs keep
+ * running.  Meanwhile the source pushes the remaining pages in the background
+ * and gives requested pages priority.  The transport belongs to the caller
+ * (the teleporter in Main), PGM only provides the page contents on the source
+ * (PGMR3PostCopySrcNextPage, PGMR3PostCopySrcGetPage) and takes them on the
+ * target (PGMR3PostCopyTrgPutPage).
+ *
+ * Once all pages have arrived the access handlers are deregistered.
+ *
+ * Some paths map guest pages without consulting the access handlers, e.g.
+ * PGMPhysGCPhys2CCPtr, PGMPhysSimpleReadGCPhys and the guest page table
+ * walker.  These call pgmPhysPostCopyFaultIn first, which waits for the page
+ * in ring-3 (pgmR3PostCopyTrgFaultIn) and sends R0 and RC callers the
+ * access handler way.
+ *
+ *
+ * @section sec_pgm_lazy_ram    Lazy RAM Restore
+ *
+ * The same target machinery restores RAM lazily from a saved state file.  A
+ * non-live save configured with PGM/SaveLazyRam saves a lazy record
+ * (PGM_STATE_REC_RAM_LAZY) for each RAM page with contents, and then the
+ * contents of all these pages as an uncompressed, page aligned run at the end
+ * of the RAM section (PGM_STATE_REC_RAM_LAZY_PAGES, SSMR3PutPagesBegin).
+ *
+ * When loading such a state from a file with PGM/LoadLazyRam enabled (it is
+ * off by default), SSM skips the page run and hands us its file offset.  The pages are set up
+ * as absent pages with the file as page source: pgmR3LazyRamRequest reads a
+ * page on demand, and a "PGM-LazyRam" thread reads the others in large
+ * chunks in the background.  So the VM is resumed without waiting for the
+ * bulk of its RAM.  Saved state streams, or a disabled PGM/LoadLazyRam, read
+ * the page run in one go during the load.
+ *
+ * The stream CRC doesn't cover pages read from the file behind SSM's back, so
+ * the save includes a CRC-32 for each page which is checked before the page is
+ * put into place.  A mismatch is treated like a read error and gives up the
+ * remaining pages.
+ *
+ * Pages that haven't been read when the VM is saved again are pulled in
+ * first, see pgmR3LazyRamFlush.
+ */
+
+
+/*********************************************************************************************************************************
+*   Header Files                                                                                                                 *
+*********************************************************************************************************************************/
+#define LOG_GROUP LOG_GROUP_PGM
+#include <VBox/vmm/pgm.h>
+#include <VBox/vmm/cfgm.h>
+#include <VBox/vmm/ssm.h>
+#include <VBox/vmm/uvm.h>
+#include "PGMInternal.h"
+#include <VBox/vmm/vm.h>
+#include "PGMInline.h"
+#include <VBox/param.h>
+#include <VBox/err.h>
+#include <VBox/log.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/crc.h>
+#include <iprt/file.h>
+#include <iprt/mem.h>
+#include <iprt/semaphore.h>
+#include <iprt/string.h>
+#include <iprt/thread.h>
+
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The number of pages the lazy RAM fill thread reads at a time. */
+#define PGM_LAZY_RAM_CHUNK_PAGES    64
+
+
+/*********************************************************************************************************************************
+*   Internal Functions                                                                                                           *
+*********************************************************************************************************************************/
+static DECLCALLBACK(VBOXSTRICTRC) pgmR3PostCopyHandler(PVM pVM, PVMCPU pVCpu, RTGCPHYS GCPhys, void *pvPhys, void *pvBuf,
+                                                       size_t cbBuf, PGMACCESSTYPE enmAccessType, PGMACCESSORIGIN enmOrigin,
+                                                       void *pvUser);
+static int pgmR3LazyRamStart(PVM pVM, PPGMPOSTCOPY pPostCopy);
+
+
+/**
+ * Registers the access handler type used on the target.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ */
+int pgmR3PostCopyInit(PVM pVM)
+{
+    return PGMR3HandlerPhysicalTypeRegister(pVM, PGMPHYSHANDLERKIND_ALL,
+                                            pgmR3PostCopyHandler,
+                                            NULL, NULL, NULL,
+                                            NULL, NULL, NULL,
+                                            "Post-copy absent page",
+                                            &pVM->pgm.s.hPostCopyPhysHandlerType);
+}
+
+
+/**
+ * Frees the post-copy state.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+static void pgmR3PostCopyFree(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy)
+    {
+        pVM->pgm.s.pPostCopyR3 = NULL;
+        if (pPostCopy->hLazyThread != NIL_RTTHREAD)
+        {
+            /* Only gets here after the thread is done with the state. */
+            ASMAtomicWriteBool(&pPostCopy->fLazyTerminate, true);
+            RTThreadWait(pPostCopy->hLazyThread, RT_INDEFINITE_WAIT, NULL);
+        }
+        if (pPostCopy->hLazyFile != NIL_RTFILE)
+            RTFileClose(pPostCopy->hLazyFile);
+        if (pPostCopy->pahEvtWaiting)
+            for (VMCPUID i = 0; i < pVM->cCpus; i++)
+                RTSemEventDestroy(pPostCopy->pahEvtWaiting[i]);
+        RTMemFree(pPostCopy->pahEvtWaiting);
+        RTMemFree((void *)pPostCopy->paGCPhysWaiting);
+        RTMemFree(pPostCopy->paiRuns);
+        RTMemFree((void *)pPostCopy->pbmLeft);
+        RTMemFree(pPostCopy->paGCPhys);
+        RTMemFree(pPostCopy->pau32LazyCrc);
+        RTMemFree(pPostCopy);
+    }
+}
+
+
+/**
+ * Creates the post-copy state.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   fSource             Whether this is the source or target side.
+ */
+static int pgmR3PostCopyCreate(PVM pVM, bool fSource)
+{
+    pgmR3PostCopyFree(pVM);
+
+    PPGMPOSTCOPY pPostCopy = (PPGMPOSTCOPY)RTMemAllocZ(sizeof(*pPostCopy));
+    AssertReturn(pPostCopy, VERR_NO_MEMORY);
+    pPostCopy->fSource     = fSource;
+    pPostCopy->hLazyFile   = NIL_RTFILE;
+    pPostCopy->hLazyThread = NIL_RTTHREAD;
+    pVM->pgm.s.pPostCopyR3 = pPostCopy;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Adds a page to the post-copy page list, worker shared by both sides.
+ *
+ * @returns VBox status code.
+ * @param   pPostCopy           The post-copy state.
+ * @param   GCPhys              The page address.  Must be higher than the
+ *                              previously added one.
+ */
+static int pgmR3PostCopyAddPage(PPGMPOSTCOPY pPostCopy, RTGCPHYS GCPhys)
+{
+    uint32_t const iPage = pPostCopy->cPages;
+    AssertLogRelMsgReturn(!iPage || pPostCopy->paGCPhys[iPage - 1] < GCPhys,
+                          ("%RGp after %RGp\n", GCPhys, pPostCopy->paGCPhys[iPage - 1]), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+    AssertReturn(iPage < UINT32_MAX / 2, VERR_OUT_OF_RANGE);
+
+    if (!(iPage & (_64K - 1)))
+    {
+        uint32_t const cNew = iPage + _64K;
+        PRTGCPHYS paGCPhys = (PRTGCPHYS)RTMemRealloc(pPostCopy->paGCPhys, cNew * sizeof(RTGCPHYS));
+        AssertReturn(paGCPhys, VERR_NO_MEMORY);
+        pPostCopy->paGCPhys = paGCPhys;
+
+        uint32_t *pbmLeft = (uint32_t *)RTMemRealloc((void *)pPostCopy->pbmLeft, cNew / 8);
+        AssertReturn(pbmLeft, VERR_NO_MEMORY);
+        pPostCopy->pbmLeft = pbmLeft;
+    }
+
+    pPostCopy->paGCPhys[iPage] = GCPhys;
+    ASMBitSet(pPostCopy->pbmLeft, iPage);
+    pPostCopy->cPages     = iPage + 1;
+    pPostCopy->cPagesLeft = iPage + 1;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Looks up a page in the post-copy page list.
+ *
+ * @returns The page index, UINT32_MAX if not found.
+ * @param   pPostCopy           The post-copy state.
+ * @param   GCPhys              The page address.
+ */
+static uint32_t pgmR3PostCopyLookup(PPGMPOSTCOPY pPostCopy, RTGCPHYS GCPhys)
+{
+    uint32_t iStart = 0;
+    uint32_t iEnd   = pPostCopy->cPages;
+    while (iStart < iEnd)
+    {
+        uint32_t const i = iStart + (iEnd - iStart) / 2;
+        RTGCPHYS const GCPhysCur = pPostCopy->paGCPhys[i];
+        if (GCPhys < GCPhysCur)
+            iEnd = i;
+        else if (GCPhys > GCPhysCur)
+            iStart = i + 1;
+        else
+            return i;
+    }
+    return UINT32_MAX;
+}
+
+
+/**
+ * Gets the start address of the access handler covering a page, target side.
+ *
+ * @returns Handler start address.
+ * @param   pPostCopy           The post-copy state.
+ * @param   iPage               The page index.
+ */
+static RTGCPHYS pgmR3PostCopyTrgRunStart(PPGMPOSTCOPY pPostCopy, uint32_t iPage)
+{
+    uint32_t iStart = 0;
+    uint32_t iEnd   = pPostCopy->cRuns;
+    while (iEnd - iStart > 1)
+    {
+        uint32_t const i = iStart + (iEnd - iStart) / 2;
+        if (pPostCopy->paiRuns[i] <= iPage)
+            iStart = i;
+        else
+            iEnd = i;
+    }
+    return pPostCopy->paGCPhys[pPostCopy->paiRuns[iStart]];
+}
+
+
+/**
+ * Deregisters the access handlers on the target.
+ *
+ * @param   pVM                 Pointer to the VM.
+ *
+ * @thread  EMT
+ */
+static DECLCALLBACK(void) pgmR3PostCopyTrgDeregister(PVM pVM)
+{
+    VM_ASSERT_EMT(pVM);
+    pgmLock(pVM);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy && pPostCopy->fHandlers)
+    {
+        pPostCopy->fHandlers = false;
+        ASMAtomicWriteBool(&pVM->pgm.s.fPostCopyAbsent, false);
+        for (uint32_t iRun = 0; iRun < pPostCopy->cRuns; iRun++)
+        {
+            int rc = PGMHandlerPhysicalDeregister(pVM, pPostCopy->paGCPhys[pPostCopy->paiRuns[iRun]]);
+            AssertRC(rc);
+        }
+    }
+    pgmUnlock(pVM);
+}
+
+
+/**
+ * Resets the post-copy state, called on VM reset.
+ *
+ * RAM is cleared on reset, so any pages still missing on the target are no
+ * longer of interest.  The state itself is kept until termination since the
+ * caller's transport may still be delivering pages.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+void pgmR3PostCopyReset(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy && !pPostCopy->fSource)
+    {
+        if (!pPostCopy->fAborted && pPostCopy->cPagesLeft)
+            LogRel(("PGM: Post-copy: Dropping %u missing pages because of VM reset\n", pPostCopy->cPagesLeft));
+        PGMR3PostCopyTrgAbort(pVM->pUVM);
+        pgmR3PostCopyTrgDeregister(pVM);
+
+        /* A state left behind by a failed load is of no further use. */
+        if (!pPostCopy->pfnRequest)
+            pgmR3PostCopyFree(pVM);
+    }
+}
+
+
+/**
+ * Frees the post-copy state on VM termination.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+void pgmR3PostCopyTerm(PVM pVM)
+{
+    pgmR3LazyRamStop(pVM);
+    pgmR3PostCopyFree(pVM);
+}
+
+
+/*
+ *
+ * Source side.
+ *
+ */
+
+/**
+ * Enables post-copy mode for the next live save.
+ *
+ * @returns VBox status code.
+ * @param   pUVM                The user mode VM handle.
+ * @thread  Any, but not while saving.
+ */
+VMMR3DECL(int) PGMR3PostCopySrcEnable(PUVM pUVM)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, VERR_INVALID_VM_HANDLE);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, VERR_INVALID_VM_HANDLE);
+    AssertReturn(!pVM->pgm.s.LiveSave.fActive, VERR_WRONG_ORDER);
+
+    uint32_t cPrecopyPasses;
+    int rc = CFGMR3QueryU32Def(CFGMR3GetChild(CFGMR3GetRoot(pVM), "/PGM"), "PostCopyPrecopyPasses", &cPrecopyPasses, 1);
+    AssertLogRelRCReturn(rc, rc);
+
+    rc = pgmR3PostCopyCreate(pVM, true /*fSource*/);
+    if (RT_SUCCESS(rc))
+    {
+        pVM->pgm.s.pPostCopyR3->cPrecopyPasses = cPrecopyPasses;
+        LogRel(("PGM: Post-copy enabled, %u pre-copy passes\n", cPrecopyPasses));
+    }
+    return rc;
+}
+
+
+/**
+ * Disables post-copy mode and forgets about any pages not yet sent.
+ *
+ * @param   pUVM                The user mode VM handle.
+ * @thread  Any, but not while saving.
+ */
+VMMR3DECL(void) PGMR3PostCopySrcDisable(PUVM pUVM)
+{
+    UVM_ASSERT_VALID_EXT_RETURN_VOID(pUVM);
+    PVM pVM = pUVM->pVM;
+    AssertReturnVoid(VM_IS_VALID_EXT(pVM));
+
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy && pPostCopy->fSource)
+    {
+        if (pPostCopy->cPagesLeft)
+            LogRel(("PGM: Post-copy: %u of %u pages were never sent\n", pPostCopy->cPagesLeft, pPostCopy->cPages));
+        pgmR3PostCopyFree(pVM);
+    }
+}
+
+
+/**
+ * Checks whether RAM pages should be saved in the given live pass.
+ *
+ * @returns true if they should, false if they're left for post-copy.
+ * @param   pVM                 Pointer to the VM.
+ * @param   uPass               The live pass.
+ */
+bool pgmR3PostCopySrcIsPrecopyPass(PVM pVM, uint32_t uPass)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    return !pPostCopy
+        || !pPostCopy->fSource
+        || uPass < pPostCopy->cPrecopyPasses;
+}
+
+
+/**
+ * Checks whether the RAM pages still dirty in the final pass should be left
+ * out for post-copy.
+ *
+ * @returns true if post-copy is active.
+ * @param   pVM                 Pointer to the VM.
+ */
+bool pgmR3PostCopySrcIsActive(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    return pPostCopy
+        && pPostCopy->fSource;
+}
+
+
+/**
+ * Records a page left out of the final pass.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The page address.
+ */
+int pgmR3PostCopySrcAddPage(PVM pVM, RTGCPHYS GCPhys)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertReturn(pPostCopy && pPostCopy->fSource, VERR_WRONG_ORDER);
+    return pgmR3PostCopyAddPage(pPostCopy, GCPhys);
+}
+
+
+/**
+ * Gets the number of pages the source still has to send.
+ *
+ * @returns Page count, 0 if post-copy isn't active.
+ * @param   pUVM                The user mode VM handle.
+ */
+VMMR3DECL(uint32_t) PGMR3PostCopySrcPagesLeft(PUVM pUVM)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, 0);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, 0);
+
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    return pPostCopy && pPostCopy->fSource ? pPostCopy->cPagesLeft : 0;
+}
+
+
+/**
+ * Gets the next page to push to the target.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_NOT_FOUND if all pages have been sent.
+ * @param   pUVM                The user mode VM handle.
+ * @param   pGCPhys             Where to return the page address.
+ */
+VMMR3DECL(int) PGMR3PostCopySrcNextPage(PUVM pUVM, PRTGCPHYS pGCPhys)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, VERR_INVALID_VM_HANDLE);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, VERR_INVALID_VM_HANDLE);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertReturn(pPostCopy && pPostCopy->fSource, VERR_WRONG_ORDER);
+
+    uint32_t iPage = pPostCopy->iNextPush;
+    while (iPage < pPostCopy->cPages && !ASMBitTest(pPostCopy->pbmLeft, iPage))
+        iPage++;
+    pPostCopy->iNextPush = iPage;
+    if (iPage >= pPostCopy->cPages)
+        return VERR_NOT_FOUND;
+    *pGCPhys = pPostCopy->paGCPhys[iPage];
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Gets the contents of a page to send and marks it as sent.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_NOT_FOUND if the page isn't pending (sent already or never
+ *          left out).
+ * @param   pUVM                The user mode VM handle.
+ * @param   GCPhys              The page address.
+ * @param   pvPage              Where to return the contents, PAGE_SIZE bytes.
+ * @thread  Any.  The VM shall be suspended.
+ */
+VMMR3DECL(int) PGMR3PostCopySrcGetPage(PUVM pUVM, RTGCPHYS GCPhys, void *pvPage)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, VERR_INVALID_VM_HANDLE);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, VERR_INVALID_VM_HANDLE);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertReturn(pPostCopy && pPostCopy->fSource, VERR_WRONG_ORDER);
+
+    uint32_t const iPage = pgmR3PostCopyLookup(pPostCopy, GCPhys);
+    if (   iPage == UINT32_MAX
+        || !ASMBitTest(pPostCopy->pbmLeft, iPage))
+        return VERR_NOT_FOUND;
+
+    pgmLock(pVM);
+    PPGMPAGE pPage;
+    int rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+    if (RT_SUCCESS(rc))
+    {
+        if (PGM_PAGE_IS_ZERO(pPage) || PGM_PAGE_IS_BALLOONED(pPage))
+            RT_BZERO(pvPage, PAGE_SIZE);
+        else
+        {
+            PGMPAGEMAPLOCK  PgMpLck;
+            void const     *pvSrc;
+            rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pPage, GCPhys, &pvSrc, &PgMpLck);
+            if (RT_SUCCESS(rc))
+            {
+                memcpy(pvPage, pvSrc, PAGE_SIZE);
+                pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+            }
+        }
+        if (RT_SUCCESS(rc))
+        {
+            ASMBitClear(pPostCopy->pbmLeft, iPage);
+            pPostCopy->cPagesLeft--;
+        }
+    }
+    pgmUnlock(pVM);
+    AssertLogRelMsgRC(rc, ("GCPhys=%RGp rc=%Rrc\n", GCPhys, rc));
+    return rc;
+}
+
+
+/*
+ *
+ * Target side.
+ *
+ */
+
+/**
+ * Records an absent page while loading the state.
+ *
+ * The page gets backed by memory right away so its host mapping doesn't
+ * change when the contents arrive.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pPage               The page.
+ * @param   GCPhys              The page address.
+ * @param   fLazy               Set if the contents are further down in the
+ *                              saved state (lazy RAM restore), clear if they
+ *                              come from the migration source.
+ *
+ * @remarks Caller owns the PGM lock.
+ */
+int pgmR3PostCopyTrgAddPage(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, bool fLazy)
+{
+    PGM_LOCK_ASSERT_OWNER(pVM);
+    AssertLogRelMsgReturn(PGM_PAGE_GET_TYPE(pPage) == PGMPAGETYPE_RAM, ("GCPhys=%RGp %R[pgmpage]\n", GCPhys, pPage),
+                          VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (!pPostCopy || pPostCopy->fSource)
+    {
+        int rc = pgmR3PostCopyCreate(pVM, false /*fSource*/);
+        AssertRCReturn(rc, rc);
+        pPostCopy = pVM->pgm.s.pPostCopyR3;
+        pPostCopy->fLazy = fLazy;
+    }
+    else
+        AssertLogRelMsgReturn(pPostCopy->fLazy == fLazy, ("GCPhys=%RGp fLazy=%RTbool\n", GCPhys, fLazy),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    PGMPAGEMAPLOCK  PgMpLck;
+    void           *pvDstPage;
+    int rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
+    AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+    pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+
+    return pgmR3PostCopyAddPage(pPostCopy, GCPhys);
+}
+
+
+/**
+ * Covers the absent pages with access handlers once the state is loaded.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ */
+int pgmR3PostCopyTrgLoadDone(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (!pPostCopy || pPostCopy->fSource || !pPostCopy->cPages)
+        return VINF_SUCCESS;
+
+    /*
+     * Split the pages into physically contiguous runs within one RAM range.
+     */
+    uint32_t     cRuns    = 0;
+    uint32_t    *paiRuns  = NULL;
+    PPGMRAMRANGE pRamPrev = NULL;
+    pgmLock(pVM);
+    for (uint32_t iPage = 0; iPage < pPostCopy->cPages; iPage++)
+    {
+        RTGCPHYS const GCPhys = pPostCopy->paGCPhys[iPage];
+        PPGMRAMRANGE   pRam   = pgmPhysGetRange(pVM, GCPhys);
+        if (   !iPage
+            || pRam != pRamPrev
+            || pPostCopy->paGCPhys[iPage - 1] + PAGE_SIZE != GCPhys)
+        {
+            if (!(cRuns & 255))
+            {
+                uint32_t *paiNew = (uint32_t *)RTMemRealloc(paiRuns, (cRuns + 256) * sizeof(uint32_t));
+                if (!paiNew)
+                {
+                    pgmUnlock(pVM);
+                    RTMemFree(paiRuns);
+                    return VERR_NO_MEMORY;
+                }
+                paiRuns = paiNew;
+            }
+            paiRuns[cRuns++] = iPage;
+        }
+        pRamPrev = pRam;
+    }
+    pPostCopy->paiRuns = paiRuns;
+    pPostCopy->cRuns   = cRuns;
+
+    /*
+     * Register the handlers.
+     */
+    int rc = VINF_SUCCESS;
+    for (uint32_t iRun = 0; iRun < cRuns && RT_SUCCESS(rc); iRun++)
+    {
+        uint32_t const iFirst = paiRuns[iRun];
+        uint32_t const iLast  = (iRun + 1 < cRuns ? paiRuns[iRun + 1] : pPostCopy->cPages) - 1;
+        rc = PGMHandlerPhysicalRegister(pVM, pPostCopy->paGCPhys[iFirst], pPostCopy->paGCPhys[iLast] | PAGE_OFFSET_MASK,
+                                        pVM->pgm.s.hPostCopyPhysHandlerType, NULL, NIL_RTR0PTR, NIL_RTRCPTR, NULL);
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("PGM: Post-copy: Failed to register the handler for %RGp-%RGp: %Rrc\n",
+                    pPostCopy->paGCPhys[iFirst], pPostCopy->paGCPhys[iLast] | PAGE_OFFSET_MASK, rc));
+            while (iRun-- > 0)
+                PGMHandlerPhysicalDeregister(pVM, pPostCopy->paGCPhys[paiRuns[iRun]]);
+        }
+    }
+    pPostCopy->fHandlers = RT_SUCCESS(rc);
+    ASMAtomicWriteBool(&pVM->pgm.s.fPostCopyAbsent, RT_SUCCESS(rc));
+    pgmUnlock(pVM);
+
+    /*
+     * Set up waiting.
+     */
+    if (RT_SUCCESS(rc))
+    {
+        pPostCopy->paGCPhysWaiting = (RTGCPHYS volatile *)RTMemAlloc(pVM->cCpus * sizeof(RTGCPHYS));
+        pPostCopy->pahEvtWaiting   = (PRTSEMEVENT)RTMemAllocZ(pVM->cCpus * sizeof(RTSEMEVENT));
+        if (pPostCopy->paGCPhysWaiting && pPostCopy->pahEvtWaiting)
+        {
+            for (VMCPUID i = 0; i < pVM->cCpus && RT_SUCCESS(rc); i++)
+            {
+                pPostCopy->paGCPhysWaiting[i] = NIL_RTGCPHYS;
+                rc = RTSemEventCreate(&pPostCopy->pahEvtWaiting[i]);
+            }
+        }
+        else
+            rc = VERR_NO_MEMORY;
+    }
+    if (RT_SUCCESS(rc))
+    {
+        LogRel(("PGM: Post-copy: %u pages absent in %u ranges\n", pPostCopy->cPages, cRuns));
+        if (pPostCopy->fLazy)
+            rc = pgmR3LazyRamStart(pVM, pPostCopy);
+    }
+    return rc;
+}
+
+
+/**
+ * Gets the number of pages the target is still waiting for.
+ *
+ * @returns Page count, 0 if post-copy isn't active.
+ * @param   pUVM                The user mode VM handle.
+ */
+VMMR3DECL(uint32_t) PGMR3PostCopyTrgPagesLeft(PUVM pUVM)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, 0);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, 0);
+
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    return pPostCopy && !pPostCopy->fSource && !pPostCopy->fAborted ? pPostCopy->cPagesLeft : 0;
+}
+
+
+/**
+ * Clears the page request callback and waits for any callers to return.
+ *
+ * @param   pPostCopy           The post-copy state.
+ */
+static void pgmR3PostCopyTrgClearRequest(PPGMPOSTCOPY pPostCopy)
+{
+    ASMAtomicWriteNullPtr(&pPostCopy->pfnRequest);
+    while (ASMAtomicReadU32(&pPostCopy->cRequestsBusy) > 0)
+        RTThreadSleep(1);
+    pPostCopy->pvRequestUser = NULL;
+}
+
+
+/**
+ * Sets or clears the callback used for requesting absent pages from the
+ * source.
+ *
+ * The callback must be set before the VM is resumed on the target.  Clearing
+ * it waits for any callers to return, so the caller can free the resources
+ * used by the callback afterwards.
+ *
+ * @returns VBox status code.
+ * @param   pUVM                The user mode VM handle.
+ * @param   pfnRequest          The callback, NULL to clear it.
+ * @param   pvUser              User argument for the callback.
+ */
+VMMR3DECL(int) PGMR3PostCopyTrgStart(PUVM pUVM, PFNPGMPOSTCOPYREQUEST pfnRequest, void *pvUser)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, VERR_INVALID_VM_HANDLE);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, VERR_INVALID_VM_HANDLE);
+    AssertPtrNullReturn(pfnRequest, VERR_INVALID_POINTER);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertReturn(pPostCopy && !pPostCopy->fSource, VERR_WRONG_ORDER);
+
+    if (pfnRequest)
+    {
+        AssertReturn(pPostCopy->fHandlers, VERR_WRONG_ORDER);
+        pPostCopy->pvRequestUser = pvUser;
+        ASMAtomicWritePtr(&pPostCopy->pfnRequest, pfnRequest);
+    }
+    else
+        pgmR3PostCopyTrgClearRequest(pPostCopy);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Wakes up anyone waiting for the given page.
+ *
+ * @param   pVM                 Pointer to the VM.
+ * @param   pPostCopy           The post-copy state.
+ * @param   GCPhys              The page address, NIL_RTGCPHYS for everyone.
+ */
+static void pgmR3PostCopyTrgWakeUp(PVM pVM, PPGMPOSTCOPY pPostCopy, RTGCPHYS GCPhys)
+{
+    if (pPostCopy->pahEvtWaiting)
+        for (VMCPUID i = 0; i < pVM->cCpus; i++)
+        {
+            RTGCPHYS const GCPhysWaiting = ASMAtomicReadU64(&pPostCopy->paGCPhysWaiting[i]);
+            if (   GCPhysWaiting != NIL_RTGCPHYS
+                && (GCPhysWaiting == GCPhys || GCPhys == NIL_RTGCPHYS))
+                RTSemEventSignal(pPostCopy->pahEvtWaiting[i]);
+        }
+}
+
+
+/**
+ * Stores the contents of an absent page on the target.
+ *
+ * Pages which aren't absent (duplicates) are ignored.
+ *
+ * @returns VBox status code.
+ * @param   pUVM                The user mode VM handle.
+ * @param   GCPhys              The page address.
+ * @param   pvPage              The page contents, PAGE_SIZE bytes.
+ * @thread  Any.
+ */
+VMMR3DECL(int) PGMR3PostCopyTrgPutPage(PUVM pUVM, RTGCPHYS GCPhys, const void *pvPage)
+{
+    UVM_ASSERT_VALID_EXT_RETURN(pUVM, VERR_INVALID_VM_HANDLE);
+    PVM pVM = pUVM->pVM;
+    VM_ASSERT_VALID_EXT_RETURN(pVM, VERR_INVALID_VM_HANDLE);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertReturn(pPostCopy && !pPostCopy->fSource, VERR_WRONG_ORDER);
+
+    uint32_t const iPage = pgmR3PostCopyLookup(pPostCopy, GCPhys);
+    AssertLogRelMsgReturn(iPage != UINT32_MAX, ("GCPhys=%RGp\n", GCPhys), VERR_NOT_FOUND);
+    if (pPostCopy->fAborted)
+        return VINF_SUCCESS;
+
+    pgmLock(pVM);
+    int rc = VINF_SUCCESS;
+    if (   ASMBitTest(pPostCopy->pbmLeft, iPage)
+        && !pPostCopy->fAborted /* a reset may have given up on it while we waited */)
+    {
+        /* Write the contents without going thru the access handler. */
+        PPGMPAGE pPage;
+        rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+        if (RT_SUCCESS(rc) && !PGM_PAGE_IS_BALLOONED(pPage))
+        {
+            PGMPAGEMAPLOCK  PgMpLck;
+            void           *pvDst;
+            rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDst, &PgMpLck);
+            if (RT_SUCCESS(rc))
+            {
+                memcpy(pvDst, pvPage, PAGE_SIZE);
+                pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+            }
+        }
+        if (RT_SUCCESS(rc))
+        {
+            if (pPostCopy->fHandlers)
+                PGMHandlerPhysicalPageTempOff(pVM, pgmR3PostCopyTrgRunStart(pPostCopy, iPage), GCPhys);
+            ASMAtomicBitClear(pPostCopy->pbmLeft, iPage);
+            if (ASMAtomicDecU32(&pPostCopy->cPagesLeft) == 0)
+            {
+                LogRel(("PGM: Post-copy: All %u pages received, %u were requested on demand\n",
+                        pPostCopy->cPages, pPostCopy->cDemandRequests));
+                rc = VMR3ReqCallVoidNoWait(pVM, VMCPUID_ANY, (PFNRT)pgmR3PostCopyTrgDeregister, 1, pVM);
+                AssertRC(rc);
+                rc = VINF_SUCCESS;
+            }
+        }
+    }
+    pgmUnlock(pVM);
+    AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp rc=%Rrc\n", GCPhys, rc), rc);
+
+    pgmR3PostCopyTrgWakeUp(pVM, pPostCopy, GCPhys);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Gives up waiting for the absent pages on the target.
+ *
+ * Threads blocked on absent pages are released, see pgmR3PostCopyHandler.
+ * The caller is expected to power off the VM unless this happens because of
+ * a VM reset.
+ *
+ * @param   pUVM                The user mode VM handle.
+ */
+VMMR3DECL(void) PGMR3PostCopyTrgAbort(PUVM pUVM)
+{
+    UVM_ASSERT_VALID_EXT_RETURN_VOID(pUVM);
+    PVM pVM = pUVM->pVM;
+    AssertReturnVoid(VM_IS_VALID_EXT(pVM));
+
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy && !pPostCopy->fSource)
+    {
+        ASMAtomicWriteBool(&pPostCopy->fAborted, true);
+        pgmR3PostCopyTrgWakeUp(pVM, pPostCopy, NIL_RTGCPHYS);
+    }
+}
+
+
+/**
+ * Requests an absent page and blocks the calling thread until it arrives.
+ *
+ * @returns true if the page is there, false if it was given up on.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pVCpu               The calling vCPU, NULL if not an EMT.
+ * @param   pPostCopy           The post-copy state.
+ * @param   iPage               The page index.
+ * @param   GCPhys              The page address.
+ *
+ * @remarks Must not be called while owning the PGM lock as
+ *          PGMR3PostCopyTrgPutPage needs it.
+ */
+static bool pgmR3PostCopyTrgWait(PVM pVM, PVMCPU pVCpu, PPGMPOSTCOPY pPostCopy, uint32_t iPage, RTGCPHYS GCPhys)
+{
+    bool fRequested = false;
+    while (ASMBitTest(pPostCopy->pbmLeft, iPage))
+    {
+        if (ASMAtomicReadBool(&pPostCopy->fAborted))
+            return false;
+
+        if (!fRequested)
+        {
+            /* The busy count keeps PGMR3PostCopyTrgStart from pulling the rug. */
+            ASMAtomicIncU32(&pPostCopy->cRequestsBusy);
+            PFNPGMPOSTCOPYREQUEST pfnRequest = ASMAtomicReadPtrT(&pPostCopy->pfnRequest, PFNPGMPOSTCOPYREQUEST);
+            if (pfnRequest)
+            {
+                Log(("pgmR3PostCopyTrgWait: Requesting %RGp\n", GCPhys));
+                ASMAtomicIncU32(&pPostCopy->cDemandRequests);
+                int rc = pfnRequest(pVM->pUVM, GCPhys, pPostCopy->pvRequestUser);
+                AssertLogRelMsgRC(rc, ("GCPhys=%RGp rc=%Rrc\n", GCPhys, rc));
+                fRequested = RT_SUCCESS(rc); /* retried after the wait otherwise */
+            }
+            ASMAtomicDecU32(&pPostCopy->cRequestsBusy);
+        }
+
+        if (pVCpu && pPostCopy->pahEvtWaiting)
+        {
+            ASMAtomicWriteU64(&pPostCopy->paGCPhysWaiting[pVCpu->idCpu], GCPhys);
+            if (ASMBitTest(pPostCopy->pbmLeft, iPage) && !ASMAtomicReadBool(&pPostCopy->fAborted))
+                RTSemEventWait(pPostCopy->pahEvtWaiting[pVCpu->idCpu], 1000);
+            ASMAtomicWriteU64(&pPostCopy->paGCPhysWaiting[pVCpu->idCpu], NIL_RTGCPHYS);
+        }
+        else
+            RTThreadSleep(1);
+    }
+    return true;
+}
+
+
+/**
+ * Fetches an absent page before it is mapped without going thru the access
+ * handlers, see pgmPhysPostCopyFaultIn.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_PGM_PHYS_TLB_CATCH_ALL if the caller owns the PGM lock and the
+ *          page is still absent.
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The guest physical address.
+ * @thread  Any.
+ */
+int pgmR3PostCopyTrgFaultIn(PVM pVM, RTGCPHYS GCPhys)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (!pPostCopy || pPostCopy->fSource)
+        return VINF_SUCCESS;
+
+    GCPhys &= ~(RTGCPHYS)PAGE_OFFSET_MASK;
+    uint32_t const iPage = pgmR3PostCopyLookup(pPostCopy, GCPhys);
+    if (   iPage == UINT32_MAX
+        || !ASMBitTest(pPostCopy->pbmLeft, iPage)
+        || ASMAtomicReadBool(&pPostCopy->fAborted))
+        return VINF_SUCCESS;
+
+    /* The page can't arrive while we're sitting on the lock. */
+    if (PGMIsLockOwner(pVM))
+        return VERR_PGM_PHYS_TLB_CATCH_ALL;
+
+    /* A page given up on means the VM is being reset or powered off, the
+       contents no longer matter then. */
+    pgmR3PostCopyTrgWait(pVM, VMMGetCpu(pVM), pPostCopy, iPage, GCPhys);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Access handler for absent pages on the target.
+ *
+ * Requests the page from the source and blocks the calling thread until it
+ * arrives.
+ */
+static DECLCALLBACK(VBOXSTRICTRC) pgmR3PostCopyHandler(PVM pVM, PVMCPU pVCpu, RTGCPHYS GCPhys, void *pvPhys, void *pvBuf,
+                                                       size_t cbBuf, PGMACCESSTYPE enmAccessType, PGMACCESSORIGIN enmOrigin,
+                                                       void *pvUser)
+{
+    NOREF(pvPhys); NOREF(enmOrigin); NOREF(pvUser);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (!pPostCopy)
+        return VINF_PGM_HANDLER_DO_DEFAULT;
+
+    GCPhys &= ~(RTGCPHYS)PAGE_OFFSET_MASK;
+    uint32_t const iPage = pgmR3PostCopyLookup(pPostCopy, GCPhys);
+    if (iPage != UINT32_MAX)
+    {
+        if (!pgmR3PostCopyTrgWait(pVM, pVCpu, pPostCopy, iPage, GCPhys))
+        {
+            /* The VM is going down, don't let the guest see stale data. */
+            if (enmAccessType == PGMACCESSTYPE_READ)
+                memset(pvBuf, 0xff, cbBuf);
+            return VINF_SUCCESS;
+        }
+
+        /* The page may have arrived before the handler state was switched off. */
+        if (pPostCopy->fHandlers)
+        {
+            pgmLock(pVM);
+            if (pPostCopy->fHandlers)
+                PGMHandlerPhysicalPageTempOff(pVM, pgmR3PostCopyTrgRunStart(pPostCopy, iPage), GCPhys);
+            pgmUnlock(pVM);
+        }
+    }
+    return VINF_PGM_HANDLER_DO_DEFAULT;
+}
+
+
+/*
+ *
+ * Lazy RAM restore.
+ *
+ */
+
+/**
+ * Checks a page read from the saved state file against its saved CRC-32.
+ *
+ * @returns VBox status code.
+ * @param   pPostCopy           The post-copy state.
+ * @param   iPage               The page index.
+ * @param   pvPage              The page contents.
+ */
+static int pgmR3LazyRamCheckPage(PPGMPOSTCOPY pPostCopy, uint32_t iPage, void const *pvPage)
+{
+    uint32_t const u32Crc = RTCrc32(pvPage, PAGE_SIZE);
+    if (RT_LIKELY(u32Crc == pPostCopy->pau32LazyCrc[iPage]))
+        return VINF_SUCCESS;
+    LogRel(("PGM: Lazy RAM: CRC mismatch for page #%u (%RGp): %#x, expected %#x\n",
+            iPage, pPostCopy->paGCPhys[iPage], u32Crc, pPostCopy->pau32LazyCrc[iPage]));
+    return VERR_SSM_INTEGRITY_CRC;
+}
+
+
+/**
+ * @callback_method_impl{FNPGMPOSTCOPYREQUEST, Reads an absent page from the
+ *                      saved state file.}
+ */
+static DECLCALLBACK(int) pgmR3LazyRamRequest(PUVM pUVM, RTGCPHYS GCPhys, void *pvUser)
+{
+    PPGMPOSTCOPY   pPostCopy = (PPGMPOSTCOPY)pvUser;
+    uint32_t const iPage     = pgmR3PostCopyLookup(pPostCopy, GCPhys);
+    AssertReturn(iPage != UINT32_MAX, VERR_NOT_FOUND);
+
+    uint8_t abPage[PAGE_SIZE];
+    int rc = RTFileReadAt(pPostCopy->hLazyFile, pPostCopy->offLazyPages + ((uint64_t)iPage << PAGE_SHIFT),
+                          abPage, sizeof(abPage), NULL);
+    if (RT_SUCCESS(rc))
+        rc = pgmR3LazyRamCheckPage(pPostCopy, iPage, abPage);
+    if (RT_SUCCESS(rc))
+        rc = PGMR3PostCopyTrgPutPage(pUVM, GCPhys, abPage);
+    return rc;
+}
+
+
+/**
+ * Reads all the pages still absent from the saved state file.
+ *
+ * Stops early if the fill thread is told to quit or the pages are given up.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pPostCopy           The post-copy state.
+ */
+static int pgmR3LazyRamFill(PVM pVM, PPGMPOSTCOPY pPostCopy)
+{
+    uint8_t *pbBuf = (uint8_t *)RTMemPageAlloc(PGM_LAZY_RAM_CHUNK_PAGES * PAGE_SIZE);
+    AssertReturn(pbBuf, VERR_NO_PAGE_MEMORY);
+
+    int      rc    = VINF_SUCCESS;
+    uint32_t iPage = 0;
+    while (   iPage < pPostCopy->cPages
+           && RT_SUCCESS(rc)
+           && !ASMAtomicReadBool(&pPostCopy->fLazyTerminate)
+           && !ASMAtomicReadBool(&pPostCopy->fAborted))
+    {
+        if (!ASMBitTest(pPostCopy->pbmLeft, iPage))
+        {
+            iPage++;
+            continue;
+        }
+
+        uint32_t const cChunk = RT_MIN(PGM_LAZY_RAM_CHUNK_PAGES, pPostCopy->cPages - iPage);
+        rc = RTFileReadAt(pPostCopy->hLazyFile, pPostCopy->offLazyPages + ((uint64_t)iPage << PAGE_SHIFT),
+                          pbBuf, (size_t)cChunk << PAGE_SHIFT, NULL);
+        if (RT_FAILURE(rc))
+            break;
+        uint32_t const iFirst = iPage;
+        for (; iPage < iFirst + cChunk; iPage++)
+            if (ASMBitTest(pPostCopy->pbmLeft, iPage))
+            {
+                uint8_t const *pbPage = &pbBuf[(size_t)(iPage - iFirst) << PAGE_SHIFT];
+                rc = pgmR3LazyRamCheckPage(pPostCopy, iPage, pbPage);
+                if (RT_SUCCESS(rc))
+                    rc = PGMR3PostCopyTrgPutPage(pVM->pUVM, pPostCopy->paGCPhys[iPage], pbPage);
+                if (RT_FAILURE(rc))
+                    break;
+            }
+    }
+    if (RT_FAILURE(rc))
+        LogRel(("PGM: Lazy RAM: Failed to load page #%u (%RGp): %Rrc\n", iPage, pPostCopy->paGCPhys[iPage], rc));
+
+    RTMemPageFree(pbBuf, PGM_LAZY_RAM_CHUNK_PAGES * PAGE_SIZE);
+    return rc;
+}
+
+
+/**
+ * Stops requesting pages from the saved state file and closes it.
+ *
+ * @param   pPostCopy           The post-copy state.
+ */
+static void pgmR3LazyRamClose(PPGMPOSTCOPY pPostCopy)
+{
+    pgmR3PostCopyTrgClearRequest(pPostCopy);
+    if (pPostCopy->hLazyFile != NIL_RTFILE)
+    {
+        RTFileClose(pPostCopy->hLazyFile);
+        pPostCopy->hLazyFile = NIL_RTFILE;
+    }
+}
+
+
+/**
+ * The lazy RAM fill thread.
+ *
+ * @returns VINF_SUCCESS.
+ * @param   hThreadSelf         The thread handle.
+ * @param   pvUser              Pointer to the VM.
+ */
+static DECLCALLBACK(int) pgmR3LazyRamThread(RTTHREAD hThreadSelf, void *pvUser)
+{
+    PVM          pVM       = (PVM)pvUser;
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    NOREF(hThreadSelf);
+
+    int rc = pgmR3LazyRamFill(pVM, pPostCopy);
+
+    /* The pages are no longer needed when done or given up; pgmR3LazyRamStop
+       and pgmR3LazyRamFlush take care of the file when telling us to quit. */
+    if (!ASMAtomicReadBool(&pPostCopy->fLazyTerminate))
+    {
+        if (RT_FAILURE(rc))
+        {
+            /* Release anyone waiting for the pages we couldn't read. */
+            LogRel(("PGM: Lazy RAM: Giving up %u pages\n", ASMAtomicReadU32(&pPostCopy->cPagesLeft)));
+            PGMR3PostCopyTrgAbort(pVM->pUVM);
+        }
+        pgmR3LazyRamClose(pPostCopy);
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Starts restoring the absent pages from the saved state file, called at the
+ * end of the load.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pPostCopy           The post-copy state.
+ */
+static int pgmR3LazyRamStart(PVM pVM, PPGMPOSTCOPY pPostCopy)
+{
+    Assert(pPostCopy->fLazy && pPostCopy->fHandlers);
+    AssertReturn(pPostCopy->hLazyFile != NIL_RTFILE, VERR_WRONG_ORDER);
+
+    pPostCopy->pvRequestUser = pPostCopy;
+    ASMAtomicWritePtr(&pPostCopy->pfnRequest, (PFNPGMPOSTCOPYREQUEST)pgmR3LazyRamRequest);
+
+    int rc = RTThreadCreate(&pPostCopy->hLazyThread, pgmR3LazyRamThread, pVM, 0, RTTHREADTYPE_IO,
+                            RTTHREADFLAGS_WAITABLE, "PGM-LazyRam");
+    if (RT_FAILURE(rc))
+    {
+        LogRel(("PGM: Lazy RAM: Failed to create the fill thread: %Rrc\n", rc));
+        pPostCopy->hLazyThread = NIL_RTTHREAD;
+        pgmR3LazyRamClose(pPostCopy);
+    }
+    return rc;
+}
+
+
+/**
+ * Loads the page run following the lazy RAM records, PGM_STATE_REC_RAM_LAZY_PAGES.
+ *
+ * When loading from a file with PGM/LoadLazyRam enabled this only records
+ * where the pages are and loads their CRCs.  Otherwise the pages are read
+ * right away.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pSSM                The saved state handle.
+ *
+ * @remarks Caller owns the PGM lock.
+ */
+int pgmR3LazyRamLoadPages(PVM pVM, PSSMHANDLE pSSM)
+{
+    PGM_LOCK_ASSERT_OWNER(pVM);
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    AssertLogRelReturn(pPostCopy && !pPostCopy->fSource && pPostCopy->fLazy, VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+    AssertLogRelReturn(pPostCopy->hLazyFile == NIL_RTFILE, VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    /*
+     * Open our own handle to the saved state file if we can and may.
+     */
+    bool fLazy;
+    int rc = CFGMR3QueryBoolDef(CFGMR3GetChild(CFGMR3GetRoot(pVM), "/PGM"), "LoadLazyRam", &fLazy, false);
+    AssertLogRelRCReturn(rc, rc);
+    const char *pszFilename = SSMR3HandleFilename(pSSM);
+    if (fLazy && pszFilename)
+    {
+        rc = RTFileOpen(&pPostCopy->hLazyFile, pszFilename,
+                        RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_WRITE | RTFILE_O_DENY_NOT_DELETE);
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("PGM: Lazy RAM: Failed to open '%s': %Rrc, loading the pages now\n", pszFilename, rc));
+            pPostCopy->hLazyFile = NIL_RTFILE;
+            fLazy = false;
+        }
+    }
+    else
+        fLazy = false;
+
+    uint32_t cPages;
+    uint64_t offPages;
+    rc = SSMR3GetPagesBegin(pSSM, fLazy, &cPages, &offPages);
+    if (RT_FAILURE(rc))
+        return rc;
+    AssertLogRelMsgReturn(cPages == pPostCopy->cPages, ("cPages=%#x, expected %#x\n", cPages, pPostCopy->cPages),
+                          VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    if (offPages != UINT64_MAX)
+    {
+        pPostCopy->pau32LazyCrc = (uint32_t *)RTMemAlloc(cPages * sizeof(uint32_t));
+        AssertReturn(pPostCopy->pau32LazyCrc, VERR_NO_MEMORY);
+        rc = SSMR3GetMem(pSSM, pPostCopy->pau32LazyCrc, cPages * sizeof(uint32_t));
+        if (RT_FAILURE(rc))
+            return rc;
+        pPostCopy->offLazyPages = offPages;
+        LogRel(("PGM: Lazy RAM: Restoring %u pages from '%s' on demand\n", cPages, pszFilename));
+        return VINF_SUCCESS;
+    }
+
+    /*
+     * Read the pages now.  There is nothing left to do afterwards, so the
+     * post-copy state goes away before pgmR3PostCopyTrgLoadDone sees it.
+     */
+    if (pPostCopy->hLazyFile != NIL_RTFILE)
+    {
+        RTFileClose(pPostCopy->hLazyFile);
+        pPostCopy->hLazyFile = NIL_RTFILE;
+    }
+    for (uint32_t iPage = 0; iPage < cPages; iPage++)
+    {
+        RTGCPHYS const GCPhys = pPostCopy->paGCPhys[iPage];
+        PPGMPAGE pPage;
+        rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp rc=%Rrc\n", GCPhys, rc), rc);
+
+        PGMPAGEMAPLOCK  PgMpLck;
+        void           *pvDstPage;
+        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
+        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+        rc = SSMR3GetPage(pSSM, pvDstPage);
+        pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    /* The stream CRC covered the pages already. */
+    rc = SSMR3Skip(pSSM, cPages * sizeof(uint32_t));
+    if (RT_FAILURE(rc))
+        return rc;
+    pgmR3PostCopyFree(pVM);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Tells the lazy RAM fill thread to quit and waits for it.
+ *
+ * @param   pPostCopy           The post-copy state.
+ */
+static void pgmR3LazyRamStopThread(PPGMPOSTCOPY pPostCopy)
+{
+    if (pPostCopy->hLazyThread != NIL_RTTHREAD)
+    {
+        ASMAtomicWriteBool(&pPostCopy->fLazyTerminate, true);
+        int rc = RTThreadWait(pPostCopy->hLazyThread, RT_INDEFINITE_WAIT, NULL);
+        AssertLogRelRC(rc);
+        pPostCopy->hLazyThread = NIL_RTTHREAD;
+    }
+}
+
+
+/**
+ * Gives up on restoring RAM lazily, called when loading a new state and on
+ * termination.
+ *
+ * @param   pVM                 Pointer to the VM.
+ *
+ * @remarks Must not be called while owning the PGM lock as the fill thread
+ *          needs it.
+ */
+void pgmR3LazyRamStop(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (pPostCopy && !pPostCopy->fSource && pPostCopy->fLazy)
+    {
+        ASMAtomicWriteBool(&pPostCopy->fAborted, true);
+        pgmR3PostCopyTrgWakeUp(pVM, pPostCopy, NIL_RTGCPHYS);
+        pgmR3LazyRamStopThread(pPostCopy);
+        pgmR3LazyRamClose(pPostCopy);
+    }
+}
+
+
+/**
+ * Reads all RAM pages still absent from the saved state file, called before
+ * saving the state.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ *
+ * @remarks Must not be called while owning the PGM lock as the fill thread
+ *          needs it.
+ * @thread  EMT
+ */
+int pgmR3LazyRamFlush(PVM pVM)
+{
+    PPGMPOSTCOPY pPostCopy = pVM->pgm.s.pPostCopyR3;
+    if (   !pPostCopy
+        || pPostCopy->fSource
+        || !pPostCopy->fLazy)
+        return VINF_SUCCESS;
+
+    pgmR3LazyRamStopThread(pPostCopy);
+    int rc = VINF_SUCCESS;
+    if (pPostCopy->hLazyFile != NIL_RTFILE)
+    {
+        ASMAtomicWriteBool(&pPostCopy->fLazyTerminate, false);
+        if (   ASMAtomicReadU32(&pPostCopy->cPagesLeft) > 0
+            && !ASMAtomicReadBool(&pPostCopy->fAborted))
+        {
+            LogRel(("PGM: Lazy RAM: Loading the remaining %u pages before saving\n", pPostCopy->cPagesLeft));
+            rc = pgmR3LazyRamFill(pVM, pPostCopy);
+        }
+        pgmR3LazyRamClose(pPostCopy);
+    }
+    pgmR3PostCopyTrgDeregister(pVM);
+    return rc;
+}
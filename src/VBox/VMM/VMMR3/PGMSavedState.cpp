@@ -46,7 +46,15 @@
 *   Defined Constants And Macros                                                                                                 *
 *********************************************************************************************************************************/
 /** Saved state data unit version.  */
-#define PGM_SAVED_STATE_VERSION                 14
+#define PGM_SAVED_STATE_VERSION                 18
+/** Saved state data unit version before the lazy RAM page records. */
+#define PGM_SAVED_STATE_VERSION_PRE_LAZY        17
+/** Saved state data unit version before the duplicate RAM page records. */
+#define PGM_SAVED_STATE_VERSION_PRE_DEDUP       16
+/** Saved state data unit version before the post-copy absent page records. */
+#define PGM_SAVED_STATE_VERSION_PRE_POST_COPY   15
+/** Saved state data unit version before the RAM page delta records. */
+#define PGM_SAVED_STATE_VERSION_PRE_DELTA       14
 /** Saved state data unit version before the PAE PDPE registers. */
 #define PGM_SAVED_STATE_VERSION_PRE_PAE         13
 /** Saved state data unit version after this includes ballooned page flags in
@@ -87,8 +95,26 @@
 #define PGM_STATE_REC_ROM_PROT          UINT8_C(0x07)
 /** Ballooned page. No data. */
 #define PGM_STATE_REC_RAM_BALLOONED     UINT8_C(0x08)
+/** Changes to a RAM page relative to the contents saved by an earlier record
+ *  in the same stream.  Followed by the size of the changes (16-bit) and the
+ *  changes as encoded by pgmR3LsDeltaEncode. */
+#define PGM_STATE_REC_RAM_DELTA         UINT8_C(0x09)
+/** RAM page whose contents will be sent after the VM has been handed over
+ *  (post-copy live migration).  No data. */
+#define PGM_STATE_REC_RAM_ABSENT        UINT8_C(0x0a)
+/** RAM page with the same contents as a page saved earlier in the same
+ *  pass.  Followed by the address of that page (RTGCPHYS). */
+#define PGM_STATE_REC_RAM_DUP           UINT8_C(0x0b)
+/** RAM page whose contents are in the page run following the
+ *  PGM_STATE_REC_RAM_LAZY_PAGES record.  No data. */
+#define PGM_STATE_REC_RAM_LAZY          UINT8_C(0x0c)
+/** The contents of all the PGM_STATE_REC_RAM_LAZY pages in the order they
+ *  were saved, stored as a SSM page run (SSMR3PutPagesBegin) followed by the
+ *  CRC-32 of each page (uint32_t).  There is no address and it can only be
+ *  given once, after the last lazy page. */
+#define PGM_STATE_REC_RAM_LAZY_PAGES    UINT8_C(0x0d)
 /** The last record type. */
-#define PGM_STATE_REC_LAST              PGM_STATE_REC_RAM_BALLOONED
+#define PGM_STATE_REC_LAST              PGM_STATE_REC_RAM_LAZY_PAGES
 /** End marker. */
 #define PGM_STATE_REC_END               UINT8_C(0xff)
 /** Flag indicating that the data is preceded by the page address.
@@ -103,6 +129,16 @@
 /** The CRC-32 for a zero half page. */
 #define PGM_STATE_CRC32_ZERO_HALF_PAGE  UINT32_C(0xf1e8ba9e)
 
+/** The default size of the live save delta cache, see the
+ *  PGM/LiveSaveDeltaCacheSize config value. */
+#define PGM_LS_DELTA_CACHE_SIZE_DEFAULT (64 * _1M)
+/** The max size of an encoded delta.  Pages with more changes are saved in
+ *  full, leaving it to SSM to compress them. */
+#define PGM_LS_DELTA_MAX                (PAGE_SIZE / 4)
+/** The default number of entries in the duplicate page hash table, see the
+ *  PGM/SaveDedupEntries config value. */
+#define PGM_SAVE_DEDUP_ENTRIES_DEFAULT  _256K
+
 
 
 /** @name Old Page types used in older saved states.
@@ -128,6 +164,58 @@
 /*********************************************************************************************************************************
 *   Structures and Typedefs                                                                                                      *
 *********************************************************************************************************************************/
+/**
+ * Cache of RAM page contents as they were last saved during a live save.
+ *
+ * Pages dirtied and saved again in a later pass are saved as a delta against
+ * the cached contents if they hit the cache.  The cache is direct mapped on
+ * the guest physical page number.
+ */
+typedef struct PGMLSDELTACACHE
+{
+    /** The number of entries (power of two). */
+    uint32_t                        cEntries;
+    /** The RAM range generation the cached contents are valid for. */
+    uint32_t                        idRamRangesGen;
+    /** The address of the page in each entry, NIL_RTGCPHYS if unused. */
+    RTGCPHYS                       *paGCPhys;
+    /** The page contents, cEntries pages. */
+    uint8_t                        *pbPages;
+} PGMLSDELTACACHE;
+/** Pointer to the live save delta cache. */
+typedef PGMLSDELTACACHE *PPGMLSDELTACACHE;
+
+/**
+ * Hash table entry for finding duplicate RAM pages.
+ */
+typedef struct PGMSAVEDEDUPENTRY
+{
+    /** The hash of the page contents. */
+    uint64_t                        uHash;
+    /** The address of the page, NIL_RTGCPHYS if unused. */
+    RTGCPHYS                        GCPhys;
+} PGMSAVEDEDUPENTRY;
+
+/**
+ * Hash table of the RAM pages saved in the current pass, used for saving
+ * pages with the same contents as a reference to the first one.
+ *
+ * References are only made within a pass since a page can only be saved once
+ * per pass, which means the loading side still has the contents we hashed.
+ * The table is direct mapped on the hash and newer pages replace older ones.
+ */
+typedef struct PGMSAVEDEDUP
+{
+    /** The number of entries (power of two). */
+    uint32_t                        cEntries;
+    /** The RAM range generation the entries are valid for. */
+    uint32_t                        idRamRangesGen;
+    /** The entries. */
+    PGMSAVEDEDUPENTRY              *paEntries;
+} PGMSAVEDEDUP;
+/** Pointer to the duplicate page hash table. */
+typedef PGMSAVEDEDUP *PPGMSAVEDEDUP;
+
 /** For loading old saved states. (pre-smp) */
 typedef struct
 {
@@ -1536,6 +1624,472 @@ static void pgmR3ScanRamPages(PVM pVM, bool fFinalPass)
 }
 
 
+/**
+ * Creates the live save delta cache, unless disabled by configuration.
+ *
+ * The cache is an optimization, so failing to allocate it is not fatal.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ */
+static int pgmR3LsDeltaCacheCreate(PVM pVM)
+{
+    /*
+     * Get the size and round it down to a power of two number of pages.
+     */
+    uint64_t cbCache;
+    int rc = CFGMR3QueryU64Def(CFGMR3GetChild(CFGMR3GetRoot(pVM), "/PGM"), "LiveSaveDeltaCacheSize",
+                               &cbCache, PGM_LS_DELTA_CACHE_SIZE_DEFAULT);
+    AssertLogRelRCReturn(rc, rc);
+    if (cbCache < PAGE_SIZE)
+        return VINF_SUCCESS;
+
+    uint32_t cEntries = 1;
+    while (   (uint64_t)cEntries * 2 * PAGE_SIZE <= cbCache
+           && cEntries < _1M)
+        cEntries *= 2;
+
+    PPGMLSDELTACACHE pCache = (PPGMLSDELTACACHE)MMR3HeapAllocZ(pVM, MM_TAG_PGM, sizeof(*pCache));
+    if (pCache)
+    {
+        pCache->paGCPhys = (RTGCPHYS *)MMR3HeapAlloc(pVM, MM_TAG_PGM, cEntries * sizeof(RTGCPHYS));
+        pCache->pbPages  = (uint8_t *)RTMemPageAlloc((size_t)cEntries << PAGE_SHIFT);
+        if (pCache->paGCPhys && pCache->pbPages)
+        {
+            for (uint32_t i = 0; i < cEntries; i++)
+                pCache->paGCPhys[i] = NIL_RTGCPHYS;
+            pCache->cEntries       = cEntries;
+            pgmLock(pVM);
+            pCache->idRamRangesGen = pVM->pgm.s.idRamRangesGen;
+            pgmUnlock(pVM);
+            pVM->pgm.s.LiveSave.pDeltaCache = pCache;
+            LogRel(("PGM: Live save delta cache of %u pages\n", cEntries));
+            return VINF_SUCCESS;
+        }
+
+        if (pCache->pbPages)
+            RTMemPageFree(pCache->pbPages, (size_t)cEntries << PAGE_SHIFT);
+        MMR3HeapFree(pCache->paGCPhys);
+        MMR3HeapFree(pCache);
+    }
+    LogRel(("PGM: Failed to allocate the live save delta cache (%RU64 bytes), saving without it\n", cbCache));
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Destroys the live save delta cache.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+static void pgmR3LsDeltaCacheDestroy(PVM pVM)
+{
+    PPGMLSDELTACACHE pCache = pVM->pgm.s.LiveSave.pDeltaCache;
+    if (pCache)
+    {
+        pVM->pgm.s.LiveSave.pDeltaCache = NULL;
+        RTMemPageFree(pCache->pbPages, (size_t)pCache->cEntries << PAGE_SHIFT);
+        MMR3HeapFree(pCache->paGCPhys);
+        MMR3HeapFree(pCache);
+    }
+}
+
+
+/**
+ * Invalidates the whole delta cache if the RAM ranges changed.
+ *
+ * Pages may have been remapped, so the contents the loading side has for an
+ * address can no longer be relied upon.
+ *
+ * @param   pVM                 Pointer to the VM.
+ *
+ * @remarks Caller owns the PGM lock.
+ */
+static void pgmR3LsDeltaCacheCheckGen(PVM pVM)
+{
+    PPGMLSDELTACACHE pCache = pVM->pgm.s.LiveSave.pDeltaCache;
+    if (   pCache
+        && pCache->idRamRangesGen != pVM->pgm.s.idRamRangesGen)
+    {
+        for (uint32_t i = 0; i < pCache->cEntries; i++)
+            pCache->paGCPhys[i] = NIL_RTGCPHYS;
+        pCache->idRamRangesGen = pVM->pgm.s.idRamRangesGen;
+    }
+}
+
+
+/**
+ * Drops a page from the delta cache, used when it's saved as zero or
+ * ballooned page.
+ *
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The page address.
+ */
+static void pgmR3LsDeltaCacheDrop(PVM pVM, RTGCPHYS GCPhys)
+{
+    PPGMLSDELTACACHE pCache = pVM->pgm.s.LiveSave.pDeltaCache;
+    if (pCache)
+    {
+        uint32_t const iEntry = (uint32_t)(GCPhys >> PAGE_SHIFT) & (pCache->cEntries - 1);
+        if (pCache->paGCPhys[iEntry] == GCPhys)
+            pCache->paGCPhys[iEntry] = NIL_RTGCPHYS;
+    }
+}
+
+
+/**
+ * Encodes the changes of a page.
+ *
+ * The encoding is a sequence of runs, each consisting of the number of
+ * unchanged bytes (16-bit), the number of changed bytes (16-bit) and the
+ * changed bytes.  Unchanged bytes at the end of the page are not encoded.
+ * The page is compared in 64-bit words, so all counts are multiples of 8.
+ *
+ * @returns The size of the encoded changes, UINT32_MAX if they exceed @a cbDst.
+ * @param   pbOld               The previous page contents.
+ * @param   pbNew               The current page contents.
+ * @param   pbDst               Where to store the encoded changes.
+ * @param   cbDst               The size of the output buffer.
+ */
+static uint32_t pgmR3LsDeltaEncode(uint8_t const *pbOld, uint8_t const *pbNew, uint8_t *pbDst, uint32_t cbDst)
+{
+    uint64_t const *pu64Old = (uint64_t const *)pbOld;
+    uint64_t const *pu64New = (uint64_t const *)pbNew;
+    uint32_t const  cWords  = PAGE_SIZE / sizeof(uint64_t);
+    uint32_t        iWord   = 0;
+    uint32_t        offDst  = 0;
+
+    for (;;)
+    {
+        uint32_t const iSame = iWord;
+        while (iWord < cWords && pu64Old[iWord] == pu64New[iWord])
+            iWord++;
+        if (iWord >= cWords)
+            return offDst;
+
+        uint32_t const iDiff = iWord;
+        while (iWord < cWords && pu64Old[iWord] != pu64New[iWord])
+            iWord++;
+
+        uint16_t const cbSame = (uint16_t)((iDiff - iSame) * sizeof(uint64_t));
+        uint16_t const cbDiff = (uint16_t)((iWord - iDiff) * sizeof(uint64_t));
+        if (offDst + 2 * sizeof(uint16_t) + cbDiff > cbDst)
+            return UINT32_MAX;
+        memcpy(&pbDst[offDst], &cbSame, sizeof(cbSame));
+        memcpy(&pbDst[offDst + sizeof(uint16_t)], &cbDiff, sizeof(cbDiff));
+        memcpy(&pbDst[offDst + 2 * sizeof(uint16_t)], &pbNew[iDiff * sizeof(uint64_t)], cbDiff);
+        offDst += 2 * sizeof(uint16_t) + cbDiff;
+    }
+}
+
+
+/**
+ * Applies changes encoded by pgmR3LsDeltaEncode to a page.
+ *
+ * @returns VBox status code.
+ * @param   pbPage              The page to update.
+ * @param   pbSrc               The encoded changes.
+ * @param   cbSrc               The size of the encoded changes.
+ */
+static int pgmR3LsDeltaDecode(uint8_t *pbPage, uint8_t const *pbSrc, uint32_t cbSrc)
+{
+    uint32_t offPage = 0;
+    uint32_t offSrc  = 0;
+    while (offSrc < cbSrc)
+    {
+        uint16_t cbSame;
+        uint16_t cbDiff;
+        AssertLogRelMsgReturn(cbSrc - offSrc >= 2 * sizeof(uint16_t), ("%#x %#x\n", offSrc, cbSrc),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+        memcpy(&cbSame, &pbSrc[offSrc], sizeof(cbSame));
+        memcpy(&cbDiff, &pbSrc[offSrc + sizeof(uint16_t)], sizeof(cbDiff));
+        offSrc += 2 * sizeof(uint16_t);
+
+        AssertLogRelMsgReturn(   cbSame <= PAGE_SIZE - offPage
+                              && cbDiff <= PAGE_SIZE - offPage - cbSame
+                              && cbDiff <= cbSrc - offSrc,
+                              ("offPage=%#x cbSame=%#x cbDiff=%#x offSrc=%#x cbSrc=%#x\n", offPage, cbSame, cbDiff, offSrc, cbSrc),
+                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+        offPage += cbSame;
+        memcpy(&pbPage[offPage], &pbSrc[offSrc], cbDiff);
+        offPage += cbDiff;
+        offSrc  += cbDiff;
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Tries to delta encode a RAM page about to be saved and updates the cache.
+ *
+ * @returns The size of the encoded delta, UINT32_MAX if the page must be saved
+ *          in full.
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The page address.
+ * @param   pbPage              The current page contents.
+ * @param   pbDelta             Where to return the delta, PGM_LS_DELTA_MAX bytes.
+ * @param   uPass               The pass number.  The cache isn't updated in
+ *                              the final pass.
+ */
+static uint32_t pgmR3LsDeltaCacheSave(PVM pVM, RTGCPHYS GCPhys, uint8_t const *pbPage, uint8_t *pbDelta, uint32_t uPass)
+{
+    PPGMLSDELTACACHE pCache = pVM->pgm.s.LiveSave.pDeltaCache;
+    if (!pCache)
+        return UINT32_MAX;
+
+    uint32_t const iEntry   = (uint32_t)(GCPhys >> PAGE_SHIFT) & (pCache->cEntries - 1);
+    uint8_t       *pbCached = &pCache->pbPages[(size_t)iEntry << PAGE_SHIFT];
+    uint32_t       cbDelta  = UINT32_MAX;
+    if (pCache->paGCPhys[iEntry] == GCPhys)
+    {
+        cbDelta = pgmR3LsDeltaEncode(pbCached, pbPage, pbDelta, PGM_LS_DELTA_MAX);
+        if (cbDelta != UINT32_MAX)
+        {
+            pVM->pgm.s.LiveSave.cDeltaPages++;
+            pVM->pgm.s.LiveSave.cbDeltaSaved += PAGE_SIZE - sizeof(uint16_t) - cbDelta;
+        }
+    }
+
+    if (uPass != SSM_PASS_FINAL)
+    {
+        memcpy(pbCached, pbPage, PAGE_SIZE);
+        pCache->paGCPhys[iEntry] = GCPhys;
+    }
+    return cbDelta;
+}
+
+
+/**
+ * Creates the duplicate page hash table, unless disabled by configuration.
+ *
+ * The table is an optimization, so failing to allocate it is not fatal.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ *
+ * @remarks Caller owns the PGM lock.
+ */
+static int pgmR3SaveDedupCreate(PVM pVM)
+{
+    uint32_t cEntries;
+    int rc = CFGMR3QueryU32Def(CFGMR3GetChild(CFGMR3GetRoot(pVM), "/PGM"), "SaveDedupEntries",
+                               &cEntries, PGM_SAVE_DEDUP_ENTRIES_DEFAULT);
+    AssertLogRelRCReturn(rc, rc);
+    if (!cEntries)
+        return VINF_SUCCESS;
+    cEntries = RT_MIN(cEntries, _4M);
+    while (cEntries & (cEntries - 1))
+        cEntries &= cEntries - 1;
+
+    PPGMSAVEDEDUP pDedup = (PPGMSAVEDEDUP)MMR3HeapAllocZ(pVM, MM_TAG_PGM, sizeof(*pDedup));
+    if (pDedup)
+    {
+        pDedup->paEntries = (PGMSAVEDEDUPENTRY *)RTMemAlloc(cEntries * sizeof(PGMSAVEDEDUPENTRY));
+        if (pDedup->paEntries)
+        {
+            pDedup->cEntries       = cEntries;
+            pDedup->idRamRangesGen = UINT32_MAX;
+            pVM->pgm.s.LiveSave.pDedup    = pDedup;
+            pVM->pgm.s.LiveSave.cDupPages = 0;
+            return VINF_SUCCESS;
+        }
+        MMR3HeapFree(pDedup);
+    }
+    LogRel(("PGM: Failed to allocate the duplicate page table (%u entries), saving without it\n", cEntries));
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Destroys the duplicate page hash table.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+static void pgmR3SaveDedupDestroy(PVM pVM)
+{
+    PPGMSAVEDEDUP pDedup = pVM->pgm.s.LiveSave.pDedup;
+    if (pDedup)
+    {
+        pVM->pgm.s.LiveSave.pDedup = NULL;
+        RTMemFree(pDedup->paEntries);
+        MMR3HeapFree(pDedup);
+    }
+}
+
+
+/**
+ * Empties the duplicate page hash table, done at the start of each pass.
+ *
+ * @param   pVM                 Pointer to the VM.
+ */
+static void pgmR3SaveDedupReset(PVM pVM)
+{
+    PPGMSAVEDEDUP pDedup = pVM->pgm.s.LiveSave.pDedup;
+    if (pDedup)
+    {
+        for (uint32_t i = 0; i < pDedup->cEntries; i++)
+            pDedup->paEntries[i].GCPhys = NIL_RTGCPHYS;
+        pDedup->idRamRangesGen = pVM->pgm.s.idRamRangesGen;
+    }
+}
+
+
+/**
+ * Hashes the contents of a page.
+ *
+ * This is FNV-1a on 64-bit words, it only has to spread the pages over the
+ * table since hits are verified by comparing the contents.
+ *
+ * @returns The hash.
+ * @param   pbPage              The page contents.
+ */
+DECLINLINE(uint64_t) pgmR3SaveDedupHash(uint8_t const *pbPage)
+{
+    uint64_t const *pu64Page = (uint64_t const *)pbPage;
+    uint64_t        uHash    = UINT64_C(0xcbf29ce484222325);
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        uHash = (uHash ^ pu64Page[i]) * UINT64_C(0x00000100000001b3);
+    return uHash ^ (uHash >> 32);
+}
+
+
+/**
+ * Looks for a page saved earlier in the pass with the same contents and adds
+ * the page to the hash table if there is none.
+ *
+ * The candidate is compared with the current contents of the earlier page.
+ * During the live passes the earlier page must also still be write monitored,
+ * i.e. unchanged since it was saved.  Otherwise the VM is suspended.
+ *
+ * @returns The address of the identical page, NIL_RTGCPHYS if none.
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The address of the page being saved.
+ * @param   pbPage              The page contents.
+ * @param   fLivePass           Whether this is a live pass, i.e. the VM is
+ *                              running.
+ *
+ * @remarks Caller owns the PGM lock.
+ */
+static RTGCPHYS pgmR3SaveDedupLookup(PVM pVM, RTGCPHYS GCPhys, uint8_t const *pbPage, bool fLivePass)
+{
+    PPGMSAVEDEDUP pDedup = pVM->pgm.s.LiveSave.pDedup;
+    if (!pDedup)
+        return NIL_RTGCPHYS;
+    if (pDedup->idRamRangesGen != pVM->pgm.s.idRamRangesGen)
+        pgmR3SaveDedupReset(pVM);
+
+    uint64_t const      uHash  = pgmR3SaveDedupHash(pbPage);
+    PGMSAVEDEDUPENTRY  *pEntry = &pDedup->paEntries[uHash & (pDedup->cEntries - 1)];
+    if (   pEntry->GCPhys != NIL_RTGCPHYS
+        && pEntry->uHash  == uHash
+        && pEntry->GCPhys != GCPhys)
+    {
+        PPGMPAGE pOrgPage;
+        int rc = pgmPhysGetPageEx(pVM, pEntry->GCPhys, &pOrgPage);
+        if (   RT_SUCCESS(rc)
+            && PGM_PAGE_GET_TYPE(pOrgPage) == PGMPAGETYPE_RAM
+            && (   !fLivePass
+                || PGM_PAGE_GET_STATE(pOrgPage) == PGM_PAGE_STATE_WRITE_MONITORED))
+        {
+            PGMPAGEMAPLOCK  PgMpLck;
+            void const     *pvOrgPage;
+            rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pOrgPage, pEntry->GCPhys, &pvOrgPage, &PgMpLck);
+            if (RT_SUCCESS(rc))
+            {
+                bool const fSame = !memcmp(pvOrgPage, pbPage, PAGE_SIZE);
+                pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+                if (fSame)
+                {
+                    pVM->pgm.s.LiveSave.cDupPages++;
+                    return pEntry->GCPhys;
+                }
+            }
+        }
+    }
+
+    pEntry->uHash  = uHash;
+    pEntry->GCPhys = GCPhys;
+    return NIL_RTGCPHYS;
+}
+
+
+/**
+ * Records a RAM page saved as a lazy record.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   GCPhys              The page address.
+ */
+static int pgmR3SaveLazyRamAddPage(PVM pVM, RTGCPHYS GCPhys)
+{
+    uint32_t const iPage = pVM->pgm.s.LiveSave.cLazyPages;
+    AssertReturn(iPage < UINT32_MAX / 2, VERR_OUT_OF_RANGE);
+    if (!(iPage & (_64K - 1)))
+    {
+        PRTGCPHYS paGCPhys = (PRTGCPHYS)RTMemRealloc(pVM->pgm.s.LiveSave.paLazyGCPhys, (iPage + _64K) * sizeof(RTGCPHYS));
+        AssertReturn(paGCPhys, VERR_NO_MEMORY);
+        pVM->pgm.s.LiveSave.paLazyGCPhys = paGCPhys;
+    }
+    pVM->pgm.s.LiveSave.paLazyGCPhys[iPage] = GCPhys;
+    pVM->pgm.s.LiveSave.cLazyPages = iPage + 1;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Saves the contents of the lazy RAM pages as a page aligned run the loader
+ * can read straight from the file.
+ *
+ * @returns VBox status code.
+ * @param   pVM                 Pointer to the VM.
+ * @param   pSSM                The SSM handle.
+ */
+static int pgmR3SaveLazyRamPages(PVM pVM, PSSMHANDLE pSSM)
+{
+    uint32_t const cPages = pVM->pgm.s.LiveSave.cLazyPages;
+    if (!cPages)
+        return VINF_SUCCESS;
+
+    uint32_t *pau32Crc = (uint32_t *)RTMemAlloc(cPages * sizeof(uint32_t));
+    AssertReturn(pau32Crc, VERR_NO_MEMORY);
+
+    SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_LAZY_PAGES);
+    int rc = SSMR3PutPagesBegin(pSSM, cPages);
+    for (uint32_t iPage = 0; iPage < cPages && RT_SUCCESS(rc); iPage++)
+    {
+        RTGCPHYS const GCPhys = pVM->pgm.s.LiveSave.paLazyGCPhys[iPage];
+        uint8_t        abPage[PAGE_SIZE];
+        pgmLock(pVM);
+        PPGMPAGE pPage;
+        rc = pgmPhysGetPageEx(pVM, GCPhys, &pPage);
+        if (RT_SUCCESS(rc))
+        {
+            PGMPAGEMAPLOCK  PgMpLck;
+            void const     *pvPage;
+            rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pPage, GCPhys, &pvPage, &PgMpLck);
+            if (RT_SUCCESS(rc))
+            {
+                memcpy(abPage, pvPage, PAGE_SIZE);
+                pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+            }
+        }
+        pgmUnlock(pVM);
+        AssertLogRelMsgRCBreak(rc, ("rc=%Rrc GCPhys=%RGp\n", rc, GCPhys));
+
+        pau32Crc[iPage] = RTCrc32(abPage, PAGE_SIZE);
+        rc = SSMR3PutPage(pSSM, abPage);
+    }
+    if (RT_SUCCESS(rc))
+        rc = SSMR3PutPagesEnd(pSSM);
+    if (RT_SUCCESS(rc))
+        rc = SSMR3PutMem(pSSM, pau32Crc, cPages * sizeof(uint32_t));
+    if (RT_SUCCESS(rc))
+        LogRel(("PGM: Saved %u RAM pages for lazy restoring\n", cPages));
+    RTMemFree(pau32Crc);
+    return rc;
+}
+
+
 /**
  * Save quiescent RAM pages.
  *
@@ -1547,8 +2101,6 @@ static void pgmR3ScanRamPages(PVM pVM, bool fFinalPass)
  */
 static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t uPass)
 {
-    NOREF(fLiveSave);
-
     /*
      * The RAM.
      */
@@ -1556,11 +2108,26 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
     RTGCPHYS GCPhysCur = 0;
     PPGMRAMRANGE pCur;
     bool fFTMDeltaSaveActive = FTMIsDeltaLoadSaveActive(pVM);
+    bool const fLivePass = fLiveSave && uPass != SSM_PASS_FINAL;
 
     pgmLock(pVM);
+    if (!fFTMDeltaSaveActive)
+    {
+        if (!pVM->pgm.s.LiveSave.pDedup)
+        {
+            int rc = pgmR3SaveDedupCreate(pVM);
+            if (RT_FAILURE(rc))
+            {
+                pgmUnlock(pVM);
+                return rc;
+            }
+        }
+        pgmR3SaveDedupReset(pVM);
+    }
     do
     {
         uint32_t const  idRamRangesGen = pVM->pgm.s.idRamRangesGen;
+        pgmR3LsDeltaCacheCheckGen(pVM);
         for (pCur = pVM->pgm.s.pRamRangesXR3; pCur; pCur = pCur->pNextR3)
         {
             if (   pCur->GCPhysLast > GCPhysCur
@@ -1633,7 +2200,31 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
                     bool        fBallooned = PGM_PAGE_IS_BALLOONED(pCurPage);
                     bool        fSkipped = false;
 
-                    if (!fZero && !fBallooned)
+                    if (   !fZero
+                        && !fBallooned
+                        && uPass == SSM_PASS_FINAL
+                        && paLSPages
+                        && !fFTMDeltaSaveActive
+                        && pgmR3PostCopySrcIsActive(pVM))
+                    {
+                        /*
+                         * Post-copy: The contents are sent once the VM has
+                         * been handed over, just tell the target it's coming.
+                         */
+                        rc = pgmR3PostCopySrcAddPage(pVM, GCPhys);
+                        pgmUnlock(pVM);
+                        AssertLogRelMsgRCReturn(rc, ("rc=%Rrc GCPhys=%RGp\n", rc, GCPhys), rc);
+
+                        pgmR3LsDeltaCacheDrop(pVM, GCPhys);
+                        if (GCPhys == GCPhysLast + PAGE_SIZE)
+                            rc = SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_ABSENT);
+                        else
+                        {
+                            SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_ABSENT | PGM_STATE_REC_FLAG_ADDR);
+                            rc = SSMR3PutGCPhys(pSSM, GCPhys);
+                        }
+                    }
+                    else if (!fZero && !fBallooned)
                     {
                         /*
                          * Copy the page and then save it outside the lock (since any
@@ -1642,6 +2233,8 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
                         uint8_t         abPage[PAGE_SIZE];
                         PGMPAGEMAPLOCK  PgMpLck;
                         void const     *pvPage;
+                        RTGCPHYS        GCPhysDup = NIL_RTGCPHYS;
+                        bool const      fLazyRam  = pVM->pgm.s.LiveSave.fLazyRam;
                         rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pCurPage, GCPhys, &pvPage, &PgMpLck);
                         if (RT_SUCCESS(rc))
                         {
@@ -1651,6 +2244,9 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
                                 pgmR3StateVerifyCrc32ForPage(abPage, pCur, paLSPages, iPage, "save#3");
 #endif
                             pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+                            /* (Lazy pages can't serve as duplicate sources, their contents come later.) */
+                            if (!fFTMDeltaSaveActive && !fLazyRam && !ASMMemIsZeroPage(abPage))
+                                GCPhysDup = pgmR3SaveDedupLookup(pVM, GCPhys, abPage, fLivePass);
                         }
                         pgmUnlock(pVM);
                         AssertLogRelMsgRCReturn(rc, ("rc=%Rrc GCPhys=%RGp\n", rc, GCPhys), rc);
@@ -1678,20 +2274,67 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
                                 else
                                     fSkipped = true;
                             }
+                            else if (fLazyRam)
+                            {
+                                /* The contents go into the page run at the end, see pgmR3SaveLazyRamPages. */
+                                rc = pgmR3SaveLazyRamAddPage(pVM, GCPhys);
+                                if (RT_SUCCESS(rc))
+                                {
+                                    if (GCPhys == GCPhysLast + PAGE_SIZE)
+                                        rc = SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_LAZY);
+                                    else
+                                    {
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_LAZY | PGM_STATE_REC_FLAG_ADDR);
+                                        rc = SSMR3PutGCPhys(pSSM, GCPhys);
+                                    }
+                                }
+                            }
                             else
                             {
-                                if (GCPhys == GCPhysLast + PAGE_SIZE)
-                                    SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_RAW);
+                                /* Pages sent before are saved as changes if there are few enough. */
+                                uint8_t  abDelta[PGM_LS_DELTA_MAX];
+                                uint32_t cbDelta = pgmR3LsDeltaCacheSave(pVM, GCPhys, abPage, abDelta, uPass);
+                                if (cbDelta != UINT32_MAX)
+                                {
+                                    if (GCPhys == GCPhysLast + PAGE_SIZE)
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_DELTA);
+                                    else
+                                    {
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_DELTA | PGM_STATE_REC_FLAG_ADDR);
+                                        SSMR3PutGCPhys(pSSM, GCPhys);
+                                    }
+                                    rc = SSMR3PutU16(pSSM, (uint16_t)cbDelta);
+                                    if (cbDelta)
+                                        rc = SSMR3PutMem(pSSM, abDelta, cbDelta);
+                                }
+                                else if (GCPhysDup != NIL_RTGCPHYS)
+                                {
+                                    /* Same contents as a page saved earlier in this pass. */
+                                    if (GCPhys == GCPhysLast + PAGE_SIZE)
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_DUP);
+                                    else
+                                    {
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_DUP | PGM_STATE_REC_FLAG_ADDR);
+                                        SSMR3PutGCPhys(pSSM, GCPhys);
+                                    }
+                                    rc = SSMR3PutGCPhys(pSSM, GCPhysDup);
+                                }
                                 else
                                 {
-                                    SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_RAW | PGM_STATE_REC_FLAG_ADDR);
-                                    SSMR3PutGCPhys(pSSM, GCPhys);
+                                    if (GCPhys == GCPhysLast + PAGE_SIZE)
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_RAW);
+                                    else
+                                    {
+                                        SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_RAW | PGM_STATE_REC_FLAG_ADDR);
+                                        SSMR3PutGCPhys(pSSM, GCPhys);
+                                    }
+                                    rc = SSMR3PutMem(pSSM, abPage, PAGE_SIZE);
                                 }
-                                rc = SSMR3PutMem(pSSM, abPage, PAGE_SIZE);
                             }
                         }
                         else
                         {
+                            pgmR3LsDeltaCacheDrop(pVM, GCPhys);
                             if (GCPhys == GCPhysLast + PAGE_SIZE)
                                 rc = SSMR3PutU8(pSSM, PGM_STATE_REC_RAM_ZERO);
                             else
@@ -1712,6 +2355,7 @@ static int pgmR3SaveRamPages(PVM pVM, PSSMHANDLE pSSM, bool fLiveSave, uint32_t
 #endif
                         pgmUnlock(pVM);
 
+                        pgmR3LsDeltaCacheDrop(pVM, GCPhys);
                         uint8_t u8RecType = fBallooned ? PGM_STATE_REC_RAM_BALLOONED : PGM_STATE_REC_RAM_ZERO;
                         if (GCPhys == GCPhysLast + PAGE_SIZE)
                             rc = SSMR3PutU8(pSSM, u8RecType);
@@ -1880,7 +2524,7 @@ static DECLCALLBACK(int) pgmR3LiveExec(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
         rc = pgmR3SaveShadowedRomPages(pVM, pSSM, true /*fLiveSave*/, false /*fFinalPass*/);
     if (RT_SUCCESS(rc))
         rc = pgmR3SaveMmio2Pages(      pVM, pSSM, true /*fLiveSave*/, uPass);
-    if (RT_SUCCESS(rc))
+    if (RT_SUCCESS(rc) && pgmR3PostCopySrcIsPrecopyPass(pVM, uPass))
         rc = pgmR3SaveRamPages(        pVM, pSSM, true /*fLiveSave*/, uPass);
     SSMR3PutU8(pSSM, PGM_STATE_REC_END);    /* (Ignore the rc, SSM takes care of it.) */
 
@@ -1899,6 +2543,16 @@ static DECLCALLBACK(int) pgmR3LiveExec(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
  */
 static DECLCALLBACK(int)  pgmR3LiveVote(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
 {
+    /*
+     * In post-copy mode we're done after the pre-copy passes, whatever is
+     * dirty by then is sent after the hand over.
+     */
+    if (!pgmR3PostCopySrcIsPrecopyPass(pVM, uPass + 1))
+    {
+        LogRel(("PGM: Post-copy: Switching after pass %u\n", uPass));
+        return VINF_SUCCESS;
+    }
+
     /*
      * Update and calculate parameters used in the decision making.
      */
@@ -2011,6 +2665,13 @@ static DECLCALLBACK(int)  pgmR3LiveVote(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass
  */
 static DECLCALLBACK(int) pgmR3LivePrep(PVM pVM, PSSMHANDLE pSSM)
 {
+    /*
+     * Pull in any RAM pages still absent after a lazy restore.
+     */
+    int rc = pgmR3LazyRamFlush(pVM);
+    if (RT_FAILURE(rc))
+        return rc;
+
     /*
      * Indicate that we will be using the write monitoring.
      */
@@ -2041,15 +2702,19 @@ static DECLCALLBACK(int) pgmR3LivePrep(PVM pVM, PSSMHANDLE pSSM)
     pVM->pgm.s.LiveSave.cSavedPages       = 0;
     pVM->pgm.s.LiveSave.uSaveStartNS      = RTTimeNanoTS();
     pVM->pgm.s.LiveSave.cPagesPerSecond   = 8192;
+    pVM->pgm.s.LiveSave.cDeltaPages       = 0;
+    pVM->pgm.s.LiveSave.cbDeltaSaved      = 0;
 
     /*
      * Per page type.
      */
-    int rc = pgmR3PrepRomPages(pVM);
+    rc = pgmR3PrepRomPages(pVM);
     if (RT_SUCCESS(rc))
         rc = pgmR3PrepMmio2Pages(pVM);
     if (RT_SUCCESS(rc))
         rc = pgmR3PrepRamPages(pVM);
+    if (RT_SUCCESS(rc))
+        rc = pgmR3LsDeltaCacheCreate(pVM);
 
     NOREF(pSSM);
     return rc;
@@ -2068,6 +2733,23 @@ static DECLCALLBACK(int) pgmR3SaveExec(PVM pVM, PSSMHANDLE pSSM)
     int     rc   = VINF_SUCCESS;
     PPGM    pPGM = &pVM->pgm.s;
 
+    /*
+     * Pull in any RAM pages still absent after a lazy restore.
+     */
+    if (!pVM->pgm.s.LiveSave.fActive)
+    {
+        rc = pgmR3LazyRamFlush(pVM);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        /* Non-live saves can store the RAM for lazy restoring. */
+        bool fLazyRam;
+        rc = CFGMR3QueryBoolDef(CFGMR3GetChild(CFGMR3GetRoot(pVM), "/PGM"), "SaveLazyRam", &fLazyRam, false);
+        AssertLogRelRCReturn(rc, rc);
+        pVM->pgm.s.LiveSave.fLazyRam   = fLazyRam && !FTMIsDeltaLoadSaveActive(pVM);
+        pVM->pgm.s.LiveSave.cLazyPages = 0;
+    }
+
     /*
      * Lock PGM and set the no-more-writes indicator.
      */
@@ -2117,6 +2799,8 @@ static DECLCALLBACK(int) pgmR3SaveExec(PVM pVM, PSSMHANDLE pSSM)
                 rc = pgmR3SaveMmio2Pages(      pVM, pSSM, false /*fLiveSave*/, SSM_PASS_FINAL);
             if (RT_SUCCESS(rc))
                 rc = pgmR3SaveRamPages(        pVM, pSSM, false /*fLiveSave*/, SSM_PASS_FINAL);
+            if (RT_SUCCESS(rc))
+                rc = pgmR3SaveLazyRamPages(    pVM, pSSM);
         }
         SSMR3PutU8(pSSM, PGM_STATE_REC_END);    /* (Ignore the rc, SSM takes of it.) */
     }
@@ -2143,7 +2827,20 @@ static DECLCALLBACK(int) pgmR3SaveDone(PVM pVM, PSSMHANDLE pSSM)
         pgmR3DoneRomPages(pVM);
         pgmR3DoneMmio2Pages(pVM);
         pgmR3DoneRamPages(pVM);
+        if (pVM->pgm.s.LiveSave.pDeltaCache)
+            LogRel(("PGM: Saved %RU64 RAM pages as deltas, saving %RU64 bytes\n",
+                    pVM->pgm.s.LiveSave.cDeltaPages, pVM->pgm.s.LiveSave.cbDeltaSaved));
+        pgmR3LsDeltaCacheDestroy(pVM);
     }
+    if (pVM->pgm.s.LiveSave.pDedup)
+    {
+        LogRel(("PGM: Saved %RU64 RAM pages as duplicates\n", pVM->pgm.s.LiveSave.cDupPages));
+        pgmR3SaveDedupDestroy(pVM);
+    }
+    RTMemFree(pVM->pgm.s.LiveSave.paLazyGCPhys);
+    pVM->pgm.s.LiveSave.paLazyGCPhys = NULL;
+    pVM->pgm.s.LiveSave.cLazyPages   = 0;
+    pVM->pgm.s.LiveSave.fLazyRam     = false;
 
     /*
      * Clear the live save indicator and disengage write monitoring.
@@ -2169,6 +2866,12 @@ static DECLCALLBACK(int) pgmR3SaveDone(PVM pVM, PSSMHANDLE pSSM)
  */
 static DECLCALLBACK(int) pgmR3LoadPrep(PVM pVM, PSSMHANDLE pSSM)
 {
+    /*
+     * Stop restoring RAM lazily from any previously loaded state (the fill
+     * thread needs the PGM lock, so do it before the reset grabs it).
+     */
+    pgmR3LazyRamStop(pVM);
+
     /*
      * Call the reset function to make sure all the memory is cleared.
      */
@@ -2683,12 +3386,30 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
         AssertLogRelMsgReturn((u8 & ~PGM_STATE_REC_FLAG_ADDR) <= PGM_STATE_REC_LAST, ("%#x\n", u8), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
         switch (u8 & ~PGM_STATE_REC_FLAG_ADDR)
         {
+            /*
+             * The contents of the lazy RAM pages.
+             */
+            case PGM_STATE_REC_RAM_LAZY_PAGES:
+            {
+                AssertLogRelMsgReturn(   uVersion > PGM_SAVED_STATE_VERSION_PRE_LAZY
+                                      && !(u8 & PGM_STATE_REC_FLAG_ADDR),
+                                      ("%u %#x\n", uVersion, u8), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                rc = pgmR3LazyRamLoadPages(pVM, pSSM);
+                if (RT_FAILURE(rc))
+                    return rc;
+                break;
+            }
+
             /*
              * RAM page.
              */
             case PGM_STATE_REC_RAM_ZERO:
             case PGM_STATE_REC_RAM_RAW:
             case PGM_STATE_REC_RAM_BALLOONED:
+            case PGM_STATE_REC_RAM_DELTA:
+            case PGM_STATE_REC_RAM_ABSENT:
+            case PGM_STATE_REC_RAM_DUP:
+            case PGM_STATE_REC_RAM_LAZY:
             {
                 /*
                  * Get the address and resolve it into a page descriptor.
@@ -2794,6 +3515,91 @@ static int pgmR3LoadMemory(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t
                         break;
                     }
 
+                    case PGM_STATE_REC_RAM_DELTA:
+                    {
+                        /* The page contents were loaded by an earlier record, apply the changes. */
+                        AssertLogRelMsgReturn(uVersion > PGM_SAVED_STATE_VERSION_PRE_DELTA, ("%u\n", uVersion),
+                                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        uint16_t cbDelta;
+                        rc = SSMR3GetU16(pSSM, &cbDelta);
+                        if (RT_FAILURE(rc))
+                            return rc;
+                        AssertLogRelMsgReturn(cbDelta <= PGM_LS_DELTA_MAX, ("%#x\n", cbDelta), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        uint8_t abDelta[PGM_LS_DELTA_MAX];
+                        if (cbDelta)
+                        {
+                            rc = SSMR3GetMem(pSSM, abDelta, cbDelta);
+                            if (RT_FAILURE(rc))
+                                return rc;
+                        }
+
+                        PGMPAGEMAPLOCK PgMpLck;
+                        void          *pvDstPage;
+                        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
+                        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+                        rc = pgmR3LsDeltaDecode((uint8_t *)pvDstPage, abDelta, cbDelta);
+                        pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+                        if (RT_FAILURE(rc))
+                            return rc;
+                        break;
+                    }
+
+                    case PGM_STATE_REC_RAM_ABSENT:
+                    {
+                        /* The contents arrive after the load, see PGMR3PostCopyTrgPutPage. */
+                        AssertLogRelMsgReturn(uVersion > PGM_SAVED_STATE_VERSION_PRE_POST_COPY, ("%u\n", uVersion),
+                                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        rc = pgmR3PostCopyTrgAddPage(pVM, pPage, GCPhys, false /*fLazy*/);
+                        if (RT_FAILURE(rc))
+                            return rc;
+                        break;
+                    }
+
+                    case PGM_STATE_REC_RAM_LAZY:
+                    {
+                        /* The contents are in the page run after the last lazy record, see pgmR3LazyRamLoadPages. */
+                        AssertLogRelMsgReturn(uVersion > PGM_SAVED_STATE_VERSION_PRE_LAZY, ("%u\n", uVersion),
+                                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        rc = pgmR3PostCopyTrgAddPage(pVM, pPage, GCPhys, true /*fLazy*/);
+                        if (RT_FAILURE(rc))
+                            return rc;
+                        break;
+                    }
+
+                    case PGM_STATE_REC_RAM_DUP:
+                    {
+                        /* Copy the page loaded earlier in the same pass. */
+                        AssertLogRelMsgReturn(uVersion > PGM_SAVED_STATE_VERSION_PRE_DEDUP, ("%u\n", uVersion),
+                                              VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        RTGCPHYS GCPhysOrg;
+                        rc = SSMR3GetGCPhys(pSSM, &GCPhysOrg);
+                        if (RT_FAILURE(rc))
+                            return rc;
+                        AssertLogRelMsgReturn(!(GCPhysOrg & PAGE_OFFSET_MASK) && GCPhysOrg != GCPhys,
+                                              ("%RGp %RGp\n", GCPhysOrg, GCPhys), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+                        PPGMPAGE pOrgPage;
+                        rc = pgmPhysGetPageEx(pVM, GCPhysOrg, &pOrgPage);
+                        AssertLogRelMsgRCReturn(rc, ("rc=%Rrc %RGp\n", rc, GCPhysOrg), rc);
+                        AssertLogRelMsgReturn(PGM_PAGE_GET_TYPE(pOrgPage) == PGMPAGETYPE_RAM,
+                                              ("GCPhysOrg=%RGp %R[pgmpage]\n", GCPhysOrg, pOrgPage), VERR_PGM_LOAD_UNEXPECTED_PAGE_TYPE);
+
+                        PGMPAGEMAPLOCK PgMpLckOrg;
+                        void const    *pvOrgPage;
+                        rc = pgmPhysGCPhys2CCPtrInternalReadOnly(pVM, pOrgPage, GCPhysOrg, &pvOrgPage, &PgMpLckOrg);
+                        AssertLogRelMsgRCReturn(rc, ("GCPhysOrg=%RGp %R[pgmpage] rc=%Rrc\n", GCPhysOrg, pOrgPage, rc), rc);
+                        PGMPAGEMAPLOCK PgMpLck;
+                        void          *pvDstPage;
+                        rc = pgmPhysGCPhys2CCPtrInternal(pVM, pPage, GCPhys, &pvDstPage, &PgMpLck);
+                        if (RT_SUCCESS(rc))
+                        {
+                            memcpy(pvDstPage, pvOrgPage, PAGE_SIZE);
+                            pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLck);
+                        }
+                        pgmPhysReleaseInternalPageMappingLock(pVM, &PgMpLckOrg);
+                        AssertLogRelMsgRCReturn(rc, ("GCPhys=%RGp %R[pgmpage] rc=%Rrc\n", GCPhys, pPage, rc), rc);
+                        break;
+                    }
+
                     default:
                         AssertMsgFailedReturn(("%#x\n", u8), VERR_PGM_SAVED_REC_TYPE);
                 }
@@ -3161,11 +3967,19 @@ static DECLCALLBACK(int) pgmR3Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion,
      */
     if (   (   uPass != SSM_PASS_FINAL
             && uVersion != PGM_SAVED_STATE_VERSION
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_LAZY
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_DEDUP
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_POST_COPY
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_DELTA
             && uVersion != PGM_SAVED_STATE_VERSION_PRE_PAE
             && uVersion != PGM_SAVED_STATE_VERSION_BALLOON_BROKEN
             && uVersion != PGM_SAVED_STATE_VERSION_PRE_BALLOON
             && uVersion != PGM_SAVED_STATE_VERSION_NO_RAM_CFG)
         || (   uVersion != PGM_SAVED_STATE_VERSION
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_LAZY
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_DEDUP
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_POST_COPY
+            && uVersion != PGM_SAVED_STATE_VERSION_PRE_DELTA
             && uVersion != PGM_SAVED_STATE_VERSION_PRE_PAE
             && uVersion != PGM_SAVED_STATE_VERSION_BALLOON_BROKEN
             && uVersion != PGM_SAVED_STATE_VERSION_PRE_BALLOON
@@ -3211,6 +4025,8 @@ static DECLCALLBACK(int) pgmR3Load(PVM pVM, PSSMHANDLE pSSM, uint32_t uVersion,
         rc = pgmR3LoadFinalLocked(pVM, pSSM, uVersion);
         pVM->pgm.s.LiveSave.fActive = false;
         pgmUnlock(pVM);
+        if (RT_SUCCESS(rc))
+            rc = pgmR3PostCopyTrgLoadDone(pVM);
         if (RT_SUCCESS(rc))
         {
             /*
@@ -112,7 +112,17 @@
  *       - type 5: Named data - length prefixed name followed by the data. This
  *                 type is not implemented yet as we're missing the API part, so
  *                 the type assignment is tentative.
- *       - types 6 thru 15 are current undefined.
+ *       - type 6: Raw data compressed by LZ4 (block format).  Same layout as
+ *                 type 3.  Only written when selected by /SSM/Compression.
+ *       - type 7: Raw page run.  The record data is a 32-bit page count and a
+ *                 32-bit padding size.  It is followed by the padding (zero
+ *                 bytes aligning the next byte on a page boundary in the
+ *                 stream), the uncompressed pages, and a 32-bit intermediate
+ *                 stream CRC (zero if not checksummed) taken at the end of the
+ *                 pages.  Only the count and padding size are covered by the
+ *                 record size.  The alignment and the CRC allow the loader to
+ *                 seek past the pages and read them lazily from the file.
+ *       - types 8 thru 15 are current undefined.
  *   - bit 4: Important (set), can be skipped (clear).
  *   - bit 5: Undefined flag, must be zero.
  *   - bit 6: Undefined flag, must be zero.
@@ -145,6 +155,7 @@
 *********************************************************************************************************************************/
 #define LOG_GROUP LOG_GROUP_SSM
 #include <VBox/vmm/ssm.h>
+#include <VBox/vmm/cfgm.h>
 #include <VBox/vmm/dbgf.h>
 #include <VBox/vmm/pdmapi.h>
 #include <VBox/vmm/pdmcritsect.h>
@@ -227,10 +238,18 @@
 /** Named data items.
  * A length prefix zero terminated string (i.e. max 255) followed by the data.  */
 #define SSM_REC_TYPE_NAMED                      5
+/** Raw data compressed by LZ4.
+ * Same layout as SSM_REC_TYPE_RAW_LZF. */
+#define SSM_REC_TYPE_RAW_LZ4                    6
+/** Raw page run.
+ * The record data is a 32-bit page count and a 32-bit padding size.  The
+ * padding, the pages and a 32-bit intermediate stream CRC follows it outside
+ * the record, see SSMR3PutPagesBegin. */
+#define SSM_REC_TYPE_RAW_PAGES                  7
 /** Macro for validating the record type.
  * This can be used with the flags+type byte, no need to mask out the type first. */
 #define SSM_REC_TYPE_IS_VALID(u8Type)           (   ((u8Type) & SSM_REC_TYPE_MASK) >  SSM_REC_TYPE_INVALID \
-                                                 && ((u8Type) & SSM_REC_TYPE_MASK) <= SSM_REC_TYPE_NAMED )
+                                                 && ((u8Type) & SSM_REC_TYPE_MASK) <= SSM_REC_TYPE_RAW_PAGES )
 /** @} */
 
 /** The flag mask. */
@@ -285,6 +304,14 @@
 #define SSM_ZIP_BLOCK_SIZE                      _4K
 AssertCompile(SSM_ZIP_BLOCK_SIZE / _1K * _1K == SSM_ZIP_BLOCK_SIZE);
 
+/** The max number of compression worker threads. */
+#define SSM_ZIP_POOL_MAX_THREADS                16
+/** The number of compression slots per worker thread. */
+#define SSM_ZIP_POOL_SLOTS_PER_THREAD           8
+/** The amount of uncompressed stream data that can be queued up between two
+ * compressed blocks before the pool is drained. */
+#define SSM_ZIP_POOL_RAW_SIZE                   _8K
+
 
 /**
  * Asserts that the handle is writable and returns with VERR_SSM_INVALID_STATE
@@ -447,6 +474,83 @@ typedef struct SSMSTRM
 typedef SSMSTRM *PSSMSTRM;
 
 
+/** @name SSMZIPSLOT::enmState
+ * @{ */
+/** The slot is free or being filled with raw data by the saving thread. */
+#define SSMZIPSLOT_STATE_FREE                   UINT32_C(0)
+/** The block is waiting for a compressor. */
+#define SSMZIPSLOT_STATE_QUEUED                 UINT32_C(1)
+/** The block is being compressed. */
+#define SSMZIPSLOT_STATE_BUSY                   UINT32_C(2)
+/** The record is ready for writing to the stream. */
+#define SSMZIPSLOT_STATE_DONE                   UINT32_C(3)
+/** @} */
+
+/**
+ * A slot in the compressor pool ring.
+ *
+ * The slot holds the uncompressed stream bytes preceding the block (record
+ * headers and small records) so they can be written out in the right order
+ * once the block has been compressed.
+ */
+typedef struct SSMZIPSLOT
+{
+    /** The slot state (SSMZIPSLOT_STATE_XXX). */
+    uint32_t volatile       enmState;
+    /** The number of bytes in abRaw. */
+    uint32_t                cbRaw;
+    /** The size of the record in abRec (valid when done). */
+    uint32_t                cbRec;
+    /** Explicit padding. */
+    uint32_t                u32Padding;
+    /** The uncompressed block. */
+    uint8_t                 abBlock[SSM_ZIP_BLOCK_SIZE];
+    /** The complete record for the block (header, size and data). */
+    uint8_t                 abRec[1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE];
+    /** Stream bytes preceding the record. */
+    uint8_t                 abRaw[SSM_ZIP_POOL_RAW_SIZE];
+} SSMZIPSLOT;
+/** Pointer to a compressor pool slot. */
+typedef SSMZIPSLOT *PSSMZIPSLOT;
+
+/**
+ * Compressor thread pool for saving.
+ *
+ * The saving thread copies each block into the next slot in the ring and
+ * moves on, the workers compress the queued slots in whatever order they
+ * like, and the saving thread writes the slots to the stream strictly in ring
+ * order.  The stream therefore ends up exactly as if the blocks had been
+ * compressed inline.
+ */
+typedef struct SSMZIPPOOL
+{
+    /** The compression type. */
+    RTZIPTYPE               enmZipType;
+    /** The number of slots in the ring. */
+    uint32_t                cSlots;
+    /** The oldest queued slot, i.e. the next to write to the stream. */
+    uint32_t volatile       iDrain;
+    /** The slot currently being filled with raw data. */
+    uint32_t                iFill;
+    /** The number of queued slots (iDrain thru iFill - 1). */
+    uint32_t                cQueued;
+    /** Set when the worker threads should terminate. */
+    bool volatile           fTerminate;
+    /** Signalled when a slot has been queued. */
+    RTSEMEVENT              hEvtWork;
+    /** Signalled when a slot has been compressed. */
+    RTSEMEVENT              hEvtDone;
+    /** The number of worker threads. */
+    uint32_t                cThreads;
+    /** The worker threads. */
+    RTTHREAD                ahThreads[SSM_ZIP_POOL_MAX_THREADS];
+    /** The slot ring. */
+    PSSMZIPSLOT             paSlots;
+} SSMZIPPOOL;
+/** Pointer to a compressor pool. */
+typedef SSMZIPPOOL *PSSMZIPPOOL;
+
+
 /**
  * Handle structure.
  */
@@ -514,6 +618,14 @@ typedef struct SSMHANDLE
             uint8_t         abDataBuffer[4096];
             /** The maximum downtime given as milliseconds. */
             uint32_t        cMsMaxDowntime;
+            /** The block compression type (LZF, LZ4 or STORE). */
+            RTZIPTYPE       enmZipType;
+            /** The compressor thread pool, NULL if compressing inline. */
+            PSSMZIPPOOL     pZipPool;
+            /** Pages left in the current raw page run (SSMR3PutPagesBegin). */
+            uint32_t        cPagesLeft;
+            /** Set while inside a raw page run. */
+            bool            fInPages;
         } Write;
 
         /** Read data. */
@@ -536,6 +648,10 @@ typedef struct SSMHANDLE
             bool            fEndOfData;
             /** V2: The type and flags byte fo the current record. */
             uint8_t         u8TypeAndFlags;
+            /** V2: Set while reading the pages of a raw page run. */
+            bool            fInPages;
+            /** V2: Pages left in the current raw page run (SSMR3GetPage). */
+            uint32_t        cPagesLeft;
 
             /** @name Context info for SSMR3SetLoadError.
              * @{  */
@@ -891,6 +1007,7 @@ static int                  ssmR3StrmReadMore(PSSMSTRM pStrm);
 
 #ifndef SSM_STANDALONE
 static int                  ssmR3DataFlushBuffer(PSSMHANDLE pSSM);
+static int                  ssmR3DataFlushAll(PSSMHANDLE pSSM);
 #endif
 static int                  ssmR3DataReadRecHdrV2(PSSMHANDLE pSSM);
 
@@ -2887,7 +3004,7 @@ static void ssmR3StrmDisableChecksumming(PSSMSTRM pStrm)
 
 
 /**
- * Used by SSMR3Seek to position the stream at the new unit.
+ * Used by SSMR3Seek and SSMR3GetPagesBegin to reposition the stream.
  *
  * @returns VBox status code.
  * @param   pStrm       The strem handle.
@@ -2916,15 +3033,22 @@ static int ssmR3StrmSeek(PSSMSTRM pStrm, int64_t off, uint32_t uMethod, uint32_t
             ssmR3StrmPutFreeBuf(pStrm, pStrm->pCur);
             pStrm->pCur = NULL;
         }
-        if (pStrm->pPending)
+
+        /* Recycle any read ahead buffers, we may restart the I/O thread. */
+        PSSMSTRMBUF pBuf = pStrm->pPending;
+        pStrm->pPending = NULL;
+        while (pBuf)
         {
-            ssmR3StrmDestroyBufList(pStrm->pPending);
-            pStrm->pPending = NULL;
+            PSSMSTRMBUF pNext = pBuf->pNext;
+            ssmR3StrmPutFreeBuf(pStrm, pBuf);
+            pBuf = pNext;
         }
-        if (pStrm->pHead)
+        pBuf = ASMAtomicXchgPtrT(&pStrm->pHead, NULL, PSSMSTRMBUF);
+        while (pBuf)
         {
-            ssmR3StrmDestroyBufList(pStrm->pHead);
-            pStrm->pHead = NULL;
+            PSSMSTRMBUF pNext = pBuf->pNext;
+            ssmR3StrmPutFreeBuf(pStrm, pBuf);
+            pBuf = pNext;
         }
     }
     return rc;
@@ -3266,6 +3390,302 @@ DECLINLINE(bool) ssmR3IsHostMsc32(PSSMHANDLE pSSM)
 
 #ifndef SSM_STANDALONE
 
+/**
+ * Compresses one block into a complete data record.
+ *
+ * Falls back on a raw record if the block doesn't compress well enough.
+ *
+ * @returns The size of the record.
+ * @param   enmZipType      The compression type.
+ * @param   pvBlock         The block, SSM_ZIP_BLOCK_SIZE bytes.
+ * @param   pbRec           Where to put the record.  Must have room for
+ *                          1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE bytes.
+ *
+ * @thread  Any.
+ */
+static size_t ssmR3DataZipBlock(RTZIPTYPE enmZipType, const void *pvBlock, uint8_t *pbRec)
+{
+    AssertCompile(1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE < 0x00010000);
+    size_t  cbRec = SSM_ZIP_BLOCK_SIZE - (SSM_ZIP_BLOCK_SIZE / 16);
+    int     rc    = VERR_BUFFER_OVERFLOW;
+    if (enmZipType != RTZIPTYPE_STORE)
+        rc = RTZipBlockCompress(enmZipType, RTZIPLEVEL_FAST, 0 /*fFlags*/,
+                                pvBlock, SSM_ZIP_BLOCK_SIZE,
+                                pbRec + 1 + 3 + 1, cbRec, &cbRec);
+    if (RT_SUCCESS(rc))
+    {
+        pbRec[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT
+                 | (enmZipType == RTZIPTYPE_LZ4 ? SSM_REC_TYPE_RAW_LZ4 : SSM_REC_TYPE_RAW_LZF);
+        pbRec[4] = SSM_ZIP_BLOCK_SIZE / _1K;
+        cbRec += 1;
+    }
+    else
+    {
+        pbRec[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW;
+        memcpy(&pbRec[4], pvBlock, SSM_ZIP_BLOCK_SIZE);
+        cbRec = SSM_ZIP_BLOCK_SIZE;
+    }
+    pbRec[1] = (uint8_t)(0xe0 | ( cbRec >> 12));
+    pbRec[2] = (uint8_t)(0x80 | ((cbRec >>  6) & 0x3f));
+    pbRec[3] = (uint8_t)(0x80 | ( cbRec        & 0x3f));
+    return cbRec + 1 + 3;
+}
+
+
+/**
+ * Compresses the block in a slot if it is still queued.
+ *
+ * @returns true if this call compressed it, false if the slot wasn't queued.
+ * @param   pPool           The compressor pool.
+ * @param   pSlot           The slot.
+ *
+ * @thread  Any.
+ */
+static bool ssmR3ZipPoolTryCompress(PSSMZIPPOOL pPool, PSSMZIPSLOT pSlot)
+{
+    if (!ASMAtomicCmpXchgU32(&pSlot->enmState, SSMZIPSLOT_STATE_BUSY, SSMZIPSLOT_STATE_QUEUED))
+        return false;
+    pSlot->cbRec = (uint32_t)ssmR3DataZipBlock(pPool->enmZipType, pSlot->abBlock, pSlot->abRec);
+    ASMAtomicWriteU32(&pSlot->enmState, SSMZIPSLOT_STATE_DONE);
+    RTSemEventSignal(pPool->hEvtDone);
+    return true;
+}
+
+
+/**
+ * @callback_method_impl{FNRTTHREAD, Compressor pool worker.}
+ */
+static DECLCALLBACK(int) ssmR3ZipPoolThread(RTTHREAD hThreadSelf, void *pvUser)
+{
+    PSSMZIPPOOL pPool = (PSSMZIPPOOL)pvUser;
+    NOREF(hThreadSelf);
+
+    while (!ASMAtomicReadBool(&pPool->fTerminate))
+    {
+        /* Scan the ring starting with the oldest slot as that's the one the
+           saving thread will be waiting on first. */
+        bool     fFound = false;
+        uint32_t iSlot  = ASMAtomicReadU32(&pPool->iDrain);
+        for (uint32_t i = 0; i < pPool->cSlots; i++, iSlot = (iSlot + 1) % pPool->cSlots)
+            if (ssmR3ZipPoolTryCompress(pPool, &pPool->paSlots[iSlot]))
+                fFound = true;
+        if (!fFound)
+        {
+            int rc = RTSemEventWait(pPool->hEvtWork, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgBreak(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc));
+        }
+    }
+
+    /* Pass the termination signal on to the next worker. */
+    RTSemEventSignal(pPool->hEvtWork);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Destroys the compressor pool of a save handle, if any.
+ *
+ * Anything still queued is discarded.
+ *
+ * @param   pSSM            The saved state handle.
+ */
+static void ssmR3ZipPoolDestroy(PSSMHANDLE pSSM)
+{
+    PSSMZIPPOOL pPool = pSSM->u.Write.pZipPool;
+    if (!pPool)
+        return;
+    pSSM->u.Write.pZipPool = NULL;
+
+    ASMAtomicWriteBool(&pPool->fTerminate, true);
+    if (pPool->hEvtWork != NIL_RTSEMEVENT)
+        RTSemEventSignal(pPool->hEvtWork);
+    for (uint32_t i = 0; i < pPool->cThreads; i++)
+    {
+        int rc = RTThreadWait(pPool->ahThreads[i], RT_INDEFINITE_WAIT, NULL);
+        AssertLogRelRC(rc);
+    }
+    RTSemEventDestroy(pPool->hEvtWork);
+    RTSemEventDestroy(pPool->hEvtDone);
+    RTMemFree(pPool->paSlots);
+    RTMemFree(pPool);
+}
+
+
+/**
+ * Creates the compressor pool for a save handle.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   cThreads        The number of worker threads.
+ */
+static int ssmR3ZipPoolCreate(PSSMHANDLE pSSM, uint32_t cThreads)
+{
+    Assert(cThreads > 0 && cThreads <= SSM_ZIP_POOL_MAX_THREADS);
+    PSSMZIPPOOL pPool = (PSSMZIPPOOL)RTMemAllocZ(sizeof(*pPool));
+    if (!pPool)
+        return VERR_NO_MEMORY;
+    pPool->enmZipType = pSSM->u.Write.enmZipType;
+    pPool->cSlots     = cThreads * SSM_ZIP_POOL_SLOTS_PER_THREAD;
+    pPool->hEvtWork   = NIL_RTSEMEVENT;
+    pPool->hEvtDone   = NIL_RTSEMEVENT;
+    pSSM->u.Write.pZipPool = pPool;
+
+    pPool->paSlots = (PSSMZIPSLOT)RTMemAllocZ(sizeof(pPool->paSlots[0]) * pPool->cSlots);
+    int rc = pPool->paSlots ? VINF_SUCCESS : VERR_NO_MEMORY;
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pPool->hEvtWork);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&pPool->hEvtDone);
+    for (uint32_t i = 0; i < cThreads && RT_SUCCESS(rc); i++)
+    {
+        rc = RTThreadCreateF(&pPool->ahThreads[i], ssmR3ZipPoolThread, pPool, 0 /*cbStack*/,
+                             RTTHREADTYPE_DEFAULT, RTTHREADFLAGS_WAITABLE, "SSM-Zip%u", i);
+        if (RT_SUCCESS(rc))
+            pPool->cThreads++;
+    }
+    if (RT_FAILURE(rc))
+        ssmR3ZipPoolDestroy(pSSM);
+    return rc;
+}
+
+
+/**
+ * Writes the oldest queued slot to the stream, compressing it on this thread
+ * if no worker has gotten to it yet.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3ZipPoolWriteOldest(PSSMHANDLE pSSM)
+{
+    PSSMZIPPOOL pPool = pSSM->u.Write.pZipPool;
+    PSSMZIPSLOT pSlot = &pPool->paSlots[pPool->iDrain];
+    Assert(pPool->cQueued > 0);
+
+    while (   ASMAtomicReadU32(&pSlot->enmState) != SSMZIPSLOT_STATE_DONE
+           && !ssmR3ZipPoolTryCompress(pPool, pSlot))
+    {
+        int rc = RTSemEventWait(pPool->hEvtDone, RT_INDEFINITE_WAIT);
+        AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+    }
+
+    int rc = VINF_SUCCESS;
+    if (pSlot->cbRaw)
+        rc = ssmR3StrmWrite(&pSSM->Strm, pSlot->abRaw, pSlot->cbRaw);
+    if (RT_SUCCESS(rc))
+        rc = ssmR3StrmWrite(&pSSM->Strm, pSlot->abRec, pSlot->cbRec);
+    pSSM->offUnit += pSlot->cbRaw + pSlot->cbRec;
+
+    pSlot->cbRaw = 0;
+    ASMAtomicWriteU32(&pSlot->enmState, SSMZIPSLOT_STATE_FREE);
+    ASMAtomicWriteU32(&pPool->iDrain, (pPool->iDrain + 1) % pPool->cSlots);
+    pPool->cQueued--;
+    return rc;
+}
+
+
+/**
+ * Queues a block for compression.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pvBlock         The block, SSM_ZIP_BLOCK_SIZE bytes.
+ */
+static int ssmR3ZipPoolQueue(PSSMHANDLE pSSM, const void *pvBlock)
+{
+    PSSMZIPPOOL pPool = pSSM->u.Write.pZipPool;
+    PSSMZIPSLOT pSlot = &pPool->paSlots[pPool->iFill];
+    Assert(ASMAtomicReadU32(&pSlot->enmState) == SSMZIPSLOT_STATE_FREE);
+
+    memcpy(pSlot->abBlock, pvBlock, SSM_ZIP_BLOCK_SIZE);
+    ASMAtomicWriteU32(&pSlot->enmState, SSMZIPSLOT_STATE_QUEUED);
+    RTSemEventSignal(pPool->hEvtWork);
+    pPool->cQueued++;
+    pPool->iFill = (pPool->iFill + 1) % pPool->cSlots;
+
+    /* When the ring is full, the next slot to fill is the oldest one. */
+    if (pPool->cQueued < pPool->cSlots)
+        return VINF_SUCCESS;
+    return ssmR3ZipPoolWriteOldest(pSSM);
+}
+
+
+/**
+ * Writes everything queued in the compressor pool to the stream.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3ZipPoolFlush(PSSMHANDLE pSSM)
+{
+    PSSMZIPPOOL pPool = pSSM->u.Write.pZipPool;
+    int         rc    = VINF_SUCCESS;
+    while (pPool->cQueued > 0)
+    {
+        int rc2 = ssmR3ZipPoolWriteOldest(pSSM);
+        if (RT_SUCCESS(rc))
+            rc = rc2;
+    }
+
+    PSSMZIPSLOT pSlot = &pPool->paSlots[pPool->iFill];
+    if (pSlot->cbRaw)
+    {
+        if (RT_SUCCESS(rc))
+            rc = ssmR3StrmWrite(&pSSM->Strm, pSlot->abRaw, pSlot->cbRaw);
+        pSSM->offUnit += pSlot->cbRaw;
+        pSlot->cbRaw = 0;
+    }
+    return rc;
+}
+
+
+/**
+ * Configures the block compression for a save operation.
+ *
+ * @returns VBox status code.
+ * @param   pVM             Pointer to the VM.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3SaveDoConfigZip(PVM pVM, PSSMHANDLE pSSM)
+{
+    PCFGMNODE pCfgSSM = CFGMR3GetChild(CFGMR3GetRoot(pVM), "SSM");
+
+    /** @cfgm{/SSM/Compression, string, "lzf"}
+     * The block compression used when saving: "lzf", "lz4" or "none".  LZ4 is
+     * considerably faster than LZF at a similar ratio, but the saved state
+     * cannot be loaded by older versions. */
+    char szZip[16];
+    int rc = CFGMR3QueryStringDef(pCfgSSM, "Compression", szZip, sizeof(szZip), "lzf");
+    AssertLogRelRCReturn(rc, rc);
+    if (!RTStrICmp(szZip, "lzf"))
+        pSSM->u.Write.enmZipType = RTZIPTYPE_LZF;
+    else if (!RTStrICmp(szZip, "lz4"))
+        pSSM->u.Write.enmZipType = RTZIPTYPE_LZ4;
+    else if (!RTStrICmp(szZip, "none"))
+        pSSM->u.Write.enmZipType = RTZIPTYPE_STORE;
+    else
+        AssertLogRelMsgFailedReturn(("SSM: Unknown compression '%s'\n", szZip), VERR_INVALID_PARAMETER);
+
+    /** @cfgm{/SSM/CompressionThreads, uint32_t, 0, 0, 16}
+     * The number of threads compressing blocks in parallel while saving.  Zero
+     * compresses inline on the saving thread.  The output is the same either
+     * way.  The pool is opt-in since its threads compete with the EMTs and the
+     * I/O threads of a VM which keeps running during a live save. */
+    uint32_t cThreads;
+    rc = CFGMR3QueryU32Def(pCfgSSM, "CompressionThreads", &cThreads, 0);
+    AssertLogRelRCReturn(rc, rc);
+    cThreads = RT_MIN(cThreads, SSM_ZIP_POOL_MAX_THREADS);
+
+    if (cThreads > 0 && pSSM->u.Write.enmZipType != RTZIPTYPE_STORE)
+    {
+        rc = ssmR3ZipPoolCreate(pSSM, cThreads);
+        if (RT_FAILURE(rc))
+            LogRel(("SSM: Failed to create %u compression threads (%Rrc), compressing inline.\n", cThreads, rc));
+    }
+    return VINF_SUCCESS;
+}
+
+
 /**
  * Finishes a data unit.
  * All buffers and compressor instances are flushed and destroyed.
@@ -3276,7 +3696,16 @@ DECLINLINE(bool) ssmR3IsHostMsc32(PSSMHANDLE pSSM)
 static int ssmR3DataWriteFinish(PSSMHANDLE pSSM)
 {
     //Log2(("ssmR3DataWriteFinish: %#010llx start\n", ssmR3StrmTell(&pSSM->Strm)));
-    int rc = ssmR3DataFlushBuffer(pSSM);
+    if (RT_UNLIKELY(pSSM->u.Write.fInPages))
+    {
+        LogRel(("SSM: Unterminated page run with %#x pages left\n", pSSM->u.Write.cPagesLeft));
+        pSSM->u.Write.fInPages = false;
+        if (RT_SUCCESS(pSSM->rc))
+            pSSM->rc = VERR_WRONG_ORDER;
+        return pSSM->rc;
+    }
+
+    int rc = ssmR3DataFlushAll(pSSM);
     if (RT_SUCCESS(rc))
     {
         pSSM->offUnit     = UINT64_MAX;
@@ -3324,6 +3753,25 @@ static int ssmR3DataWriteRaw(PSSMHANDLE pSSM, const void *pvBuf, size_t cbBuf)
     if (RT_FAILURE(pSSM->rc))
         return pSSM->rc;
 
+    /*
+     * If there are blocks in the compressor pool, the data must be queued up
+     * behind them to keep the stream in order.
+     */
+    PSSMZIPPOOL pPool = pSSM->u.Write.pZipPool;
+    if (pPool && pPool->cQueued)
+    {
+        PSSMZIPSLOT pSlot = &pPool->paSlots[pPool->iFill];
+        if (cbBuf <= sizeof(pSlot->abRaw) - pSlot->cbRaw)
+        {
+            memcpy(&pSlot->abRaw[pSlot->cbRaw], pvBuf, cbBuf);
+            pSlot->cbRaw += (uint32_t)cbBuf;
+            return VINF_SUCCESS;
+        }
+        int rc = ssmR3ZipPoolFlush(pSSM);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
     /*
      * Write the data item in 1MB chunks for progress indicator reasons.
      */
@@ -3439,6 +3887,27 @@ static int ssmR3DataFlushBuffer(PSSMHANDLE pSSM)
 }
 
 
+/**
+ * Flushes the buffered data and everything queued in the compressor pool.
+ *
+ * This must be done before looking at the stream position or CRC.
+ *
+ * @returns VBox status code. Will set pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3DataFlushAll(PSSMHANDLE pSSM)
+{
+    int rc = ssmR3DataFlushBuffer(pSSM);
+    if (RT_SUCCESS(rc) && pSSM->u.Write.pZipPool)
+    {
+        rc = ssmR3ZipPoolFlush(pSSM);
+        if (RT_FAILURE(rc) && RT_SUCCESS(pSSM->rc))
+            pSSM->rc = rc;
+    }
+    return rc;
+}
+
+
 /**
  * ssmR3DataWrite worker that writes big stuff.
  *
@@ -3466,38 +3935,27 @@ static int ssmR3DataWriteBig(PSSMHANDLE pSSM, const void *pvBuf, size_t cbBuf)
                )
             {
                 /*
-                 * Compress it.
+                 * Compress it, either by handing it to the compressor pool
+                 * or directly into the stream buffer.
                  */
-                AssertCompile(1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE < 0x00010000);
-                uint8_t *pb;
-                rc = ssmR3StrmReserveWriteBufferSpace(&pSSM->Strm, 1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE, &pb);
-                if (RT_FAILURE(rc))
-                    break;
-                size_t cbRec = SSM_ZIP_BLOCK_SIZE - (SSM_ZIP_BLOCK_SIZE / 16);
-                rc = RTZipBlockCompress(RTZIPTYPE_LZF, RTZIPLEVEL_FAST, 0 /*fFlags*/,
-                                        pvBuf, SSM_ZIP_BLOCK_SIZE,
-                                        pb + 1 + 3 + 1, cbRec, &cbRec);
-                if (RT_SUCCESS(rc))
+                if (pSSM->u.Write.pZipPool)
                 {
-                    pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW_LZF;
-                    pb[4] = SSM_ZIP_BLOCK_SIZE / _1K;
-                    cbRec += 1;
+                    rc = ssmR3ZipPoolQueue(pSSM, pvBuf);
+                    if (RT_FAILURE(rc))
+                        break;
                 }
                 else
                 {
-                    pb[0] = SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW;
-                    memcpy(&pb[4], pvBuf, SSM_ZIP_BLOCK_SIZE);
-                    cbRec = SSM_ZIP_BLOCK_SIZE;
+                    uint8_t *pb;
+                    rc = ssmR3StrmReserveWriteBufferSpace(&pSSM->Strm, 1 + 3 + 1 + SSM_ZIP_BLOCK_SIZE, &pb);
+                    if (RT_FAILURE(rc))
+                        break;
+                    size_t cbRec = ssmR3DataZipBlock(pSSM->u.Write.enmZipType, pvBuf, pb);
+                    rc = ssmR3StrmCommitWriteBufferSpace(&pSSM->Strm, cbRec);
+                    if (RT_FAILURE(rc))
+                        break;
+                    pSSM->offUnit += cbRec;
                 }
-                pb[1] = (uint8_t)(0xe0 | ( cbRec >> 12));
-                pb[2] = (uint8_t)(0x80 | ((cbRec >>  6) & 0x3f));
-                pb[3] = (uint8_t)(0x80 | ( cbRec        & 0x3f));
-                cbRec += 1 + 3;
-                rc = ssmR3StrmCommitWriteBufferSpace(&pSSM->Strm, cbRec);
-                if (RT_FAILURE(rc))
-                    break;
-
-                pSSM->offUnit += cbRec;
                 ssmR3ProgressByByte(pSSM, SSM_ZIP_BLOCK_SIZE);
 
                 /* advance */
@@ -4352,6 +4810,109 @@ VMMR3DECL(int) SSMR3PutMem(PSSMHANDLE pSSM, const void *pv, size_t cb)
 }
 
 
+/**
+ * Begins a run of raw, uncompressed pages in the current data unit.
+ *
+ * The pages are stored on page aligned stream offsets so a loader can pick
+ * them straight out of the saved state file later on, see
+ * SSMR3GetPagesBegin.  Each page is written using SSMR3PutPage and the run
+ * must be concluded by SSMR3PutPagesEnd before putting anything else.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   cPages          The number of pages in the run.
+ */
+VMMR3DECL(int) SSMR3PutPagesBegin(PSSMHANDLE pSSM, uint32_t cPages)
+{
+    SSM_ASSERT_WRITEABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    AssertReturn(!pSSM->u.Write.fInPages, VERR_WRONG_ORDER);
+
+    /*
+     * Flush buffered and queued data so we know where the pages will end up.
+     */
+    int rc = ssmR3DataFlushAll(pSSM);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    uint32_t au32Rec[2];
+    au32Rec[0] = cPages;
+    au32Rec[1] = (uint32_t)(0 - (ssmR3StrmTell(&pSSM->Strm) + 2 + sizeof(au32Rec))) & PAGE_OFFSET_MASK;
+    rc = ssmR3DataWriteRecHdr(pSSM, sizeof(au32Rec), SSM_REC_FLAGS_FIXED | SSM_REC_FLAGS_IMPORTANT | SSM_REC_TYPE_RAW_PAGES);
+    if (RT_SUCCESS(rc))
+        rc = ssmR3DataWriteRaw(pSSM, &au32Rec[0], sizeof(au32Rec));
+    uint32_t cbPadding = au32Rec[1];
+    while (RT_SUCCESS(rc) && cbPadding > 0)
+    {
+        uint32_t cb = RT_MIN(sizeof(g_abZero), cbPadding);
+        rc = ssmR3DataWriteRaw(pSSM, g_abZero, cb);
+        cbPadding -= cb;
+    }
+    if (RT_FAILURE(rc))
+    {
+        if (RT_SUCCESS(pSSM->rc))
+            pSSM->rc = rc;
+        return rc;
+    }
+    Assert(!(ssmR3StrmTell(&pSSM->Strm) & PAGE_OFFSET_MASK));
+
+    pSSM->u.Write.cPagesLeft = cPages;
+    pSSM->u.Write.fInPages   = true;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Saves the next page of a raw page run.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pvPage          The page content (PAGE_SIZE bytes).
+ */
+VMMR3DECL(int) SSMR3PutPage(PSSMHANDLE pSSM, const void *pvPage)
+{
+    SSM_ASSERT_WRITEABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    AssertReturn(pSSM->u.Write.fInPages && pSSM->u.Write.cPagesLeft > 0, VERR_WRONG_ORDER);
+
+    int rc = ssmR3DataWriteRaw(pSSM, pvPage, PAGE_SIZE);
+    if (RT_SUCCESS(rc))
+    {
+        pSSM->u.Write.cPagesLeft--;
+        pSSM->offUnitUser += PAGE_SIZE;
+        ssmR3ProgressByByte(pSSM, PAGE_SIZE);
+    }
+    else if (RT_SUCCESS(pSSM->rc))
+        pSSM->rc = rc;
+    return rc;
+}
+
+
+/**
+ * Concludes a raw page run started by SSMR3PutPagesBegin.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ */
+VMMR3DECL(int) SSMR3PutPagesEnd(PSSMHANDLE pSSM)
+{
+    SSM_ASSERT_WRITEABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    AssertReturn(pSSM->u.Write.fInPages, VERR_WRONG_ORDER);
+    AssertMsgReturn(!pSSM->u.Write.cPagesLeft, ("%#x pages missing\n", pSSM->u.Write.cPagesLeft),
+                    pSSM->rc = VERR_WRONG_ORDER);
+
+    /* The trailer lets a loader seeking past the pages resume the stream CRC. */
+    uint32_t u32CRC = ssmR3StrmCurCRC(&pSSM->Strm);
+    int rc = ssmR3DataWriteRaw(pSSM, &u32CRC, sizeof(u32CRC));
+    if (RT_SUCCESS(rc))
+        pSSM->u.Write.fInPages = false;
+    else if (RT_SUCCESS(pSSM->rc))
+        pSSM->rc = rc;
+    return rc;
+}
+
+
 /**
  * Saves a zero terminated string item to the current data unit.
  *
@@ -4428,7 +4989,7 @@ static int ssmR3LiveControlEmit(PSSMHANDLE pSSM, long double lrdPct, uint32_t uP
         AssertMsg(u16PartsPerTenThousand <= 10000, ("%u\n", u16PartsPerTenThousand));
         ssmR3DataWrite(pSSM, &u16PartsPerTenThousand, sizeof(u16PartsPerTenThousand));
 
-        rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+        rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         if (RT_SUCCESS(rc))
         {
             /*
@@ -4577,6 +5138,7 @@ static int ssmR3SaveDoClose(PVM pVM, PSSMHANDLE pSSM)
      * Make it non-cancellable, close the stream and delete the file on failure.
      */
     ssmR3SetCancellable(pVM, pSSM, false);
+    ssmR3ZipPoolDestroy(pSSM);
     int rc = ssmR3StrmClose(&pSSM->Strm, pSSM->rc == VERR_SSM_CANCELLED);
     if (RT_SUCCESS(rc))
         rc = pSSM->rc;
@@ -4903,7 +5465,7 @@ static int ssmR3SaveDoExecRun(PVM pVM, PSSMHANDLE pSSM)
         if (RT_FAILURE(rc) && RT_SUCCESS_NP(pSSM->rc))
             pSSM->rc = rc;
         else
-            rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+            rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         if (RT_FAILURE(rc))
         {
             LogRel(("SSM: Execute save failed with rc=%Rrc for data unit '%s'/#%u.\n", rc, pUnit->szName, pUnit->u32Instance));
@@ -5177,8 +5739,18 @@ static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS
     pSSM->pszFilename               = pszFilename;
     pSSM->u.Write.offDataBuffer     = 0;
     pSSM->u.Write.cMsMaxDowntime    = UINT32_MAX;
+    pSSM->u.Write.enmZipType        = RTZIPTYPE_LZF;
+    pSSM->u.Write.pZipPool          = NULL;
+    pSSM->u.Write.cPagesLeft        = 0;
+    pSSM->u.Write.fInPages          = false;
+
+    int rc = ssmR3SaveDoConfigZip(pVM, pSSM);
+    if (RT_FAILURE(rc))
+    {
+        RTMemFree(pSSM);
+        return rc;
+    }
 
-    int rc;
     if (pStreamOps)
         rc = ssmR3StrmInit(&pSSM->Strm, pStreamOps, pvStreamOpsUser, true /*fWrite*/, true /*fChecksummed*/, 8 /*cBuffers*/);
     else
@@ -5186,6 +5758,7 @@ static int ssmR3SaveDoCreateFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS
     if (RT_FAILURE(rc))
     {
         LogRel(("SSM: Failed to create save state file '%s', rc=%Rrc.\n",  pszFilename, rc));
+        ssmR3ZipPoolDestroy(pSSM);
         RTMemFree(pSSM);
         return rc;
     }
@@ -5487,7 +6060,7 @@ static int ssmR3LiveDoExecRun(PVM pVM, PSSMHANDLE pSSM, uint32_t uPass)
         {
             if (rc == VINF_SSM_DONT_CALL_AGAIN)
                 pUnit->fDoneLive = true;
-            rc = ssmR3DataFlushBuffer(pSSM); /* will return SSMHANDLE::rc if it is set */
+            rc = ssmR3DataFlushAll(pSSM); /* will return SSMHANDLE::rc if it is set */
         }
         if (RT_FAILURE(rc))
         {
@@ -5794,6 +6367,7 @@ VMMR3_INT_DECL(int) SSMR3LiveSave(PVM pVM, uint32_t cMsMaxDowntime,
         return VINF_SUCCESS;
     }
     /* bail out. */
+    ssmR3ZipPoolDestroy(pSSM);
     int rc2 = ssmR3StrmClose(&pSSM->Strm, pSSM->rc == VERR_SSM_CANCELLED);
     RTMemFree(pSSM);
     rc2 = RTFileDelete(pszFilename);
@@ -5936,6 +6510,8 @@ static void ssmR3DataReadBeginV2(PSSMHANDLE pSSM)
     pSSM->u.Read.offDataBuffer  = 0;
     pSSM->u.Read.fEndOfData     = false;
     pSSM->u.Read.u8TypeAndFlags = 0;
+    pSSM->u.Read.fInPages       = false;
+    pSSM->u.Read.cPagesLeft     = 0;
 }
 
 
@@ -6009,13 +6585,13 @@ DECLINLINE(int) ssmR3DataReadV2Raw(PSSMHANDLE pSSM, void *pvBuf, size_t cbToRead
 
 
 /**
- * Reads and checks the LZF "header".
+ * Reads and checks the LZF/LZ4 "header".
  *
  * @returns VBox status code. Sets pSSM->rc on error.
  * @param   pSSM            The saved state handle..
  * @param   pcbDecompr      Where to store the size of the decompressed data.
  */
-DECLINLINE(int) ssmR3DataReadV2RawLzfHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
+DECLINLINE(int) ssmR3DataReadV2RawZipHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
 {
     *pcbDecompr = 0; /* shuts up gcc. */
     AssertLogRelMsgReturn(   pSSM->u.Read.cbRecLeft > 1
@@ -6041,15 +6617,15 @@ DECLINLINE(int) ssmR3DataReadV2RawLzfHdr(PSSMHANDLE pSSM, uint32_t *pcbDecompr)
 
 
 /**
- * Reads an LZF block from the stream and decompresses into the specified
- * buffer.
+ * Reads an LZF or LZ4 block from the stream and decompresses into the
+ * specified buffer.
  *
  * @returns VBox status code. Sets pSSM->rc on error.
  * @param   SSM             The saved state handle.
  * @param   pvDst           Pointer to the output buffer.
  * @param   cbDecompr       The size of the decompressed data.
  */
-static int ssmR3DataReadV2RawLzf(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
+static int ssmR3DataReadV2RawZip(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
 {
     int         rc;
     uint32_t    cbCompr    = pSSM->u.Read.cbRecLeft;
@@ -6075,8 +6651,10 @@ static int ssmR3DataReadV2RawLzf(PSSMHANDLE pSSM, void *pvDst, size_t cbDecompr)
     /*
      * Decompress it.
      */
+    RTZIPTYPE const enmZipType = (pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK) == SSM_REC_TYPE_RAW_LZ4
+                               ? RTZIPTYPE_LZ4 : RTZIPTYPE_LZF;
     size_t cbDstActual;
-    rc = RTZipBlockDecompress(RTZIPTYPE_LZF, 0 /*fFlags*/,
+    rc = RTZipBlockDecompress(enmZipType, 0 /*fFlags*/,
                               pb, cbCompr, NULL /*pcbSrcActual*/,
                               pvDst, cbDecompr, &cbDstActual);
     if (RT_SUCCESS(rc))
@@ -6349,20 +6927,21 @@ static int ssmR3DataReadUnbufferedV2(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
             }
 
             case SSM_REC_TYPE_RAW_LZF:
+            case SSM_REC_TYPE_RAW_LZ4:
             {
-                int rc = ssmR3DataReadV2RawLzfHdr(pSSM, &cbToRead);
+                int rc = ssmR3DataReadV2RawZipHdr(pSSM, &cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
                 if (cbToRead <= cbBuf)
                 {
-                    rc = ssmR3DataReadV2RawLzf(pSSM, pvBuf, cbToRead);
+                    rc = ssmR3DataReadV2RawZip(pSSM, pvBuf, cbToRead);
                     if (RT_FAILURE(rc))
                         return rc;
                 }
                 else
                 {
                     /* The output buffer is too small, use the data buffer. */
-                    rc = ssmR3DataReadV2RawLzf(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
+                    rc = ssmR3DataReadV2RawZip(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
                     if (RT_FAILURE(rc))
                         return rc;
                     pSSM->u.Read.cbDataBuffer  = cbToRead;
@@ -6472,11 +7051,12 @@ static int ssmR3DataReadBufferedV2(PSSMHANDLE pSSM, void *pvBuf, size_t cbBuf)
             }
 
             case SSM_REC_TYPE_RAW_LZF:
+            case SSM_REC_TYPE_RAW_LZ4:
             {
-                int rc = ssmR3DataReadV2RawLzfHdr(pSSM, &cbToRead);
+                int rc = ssmR3DataReadV2RawZipHdr(pSSM, &cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
-                rc = ssmR3DataReadV2RawLzf(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
+                rc = ssmR3DataReadV2RawZip(pSSM, &pSSM->u.Read.abDataBuffer[0], cbToRead);
                 if (RT_FAILURE(rc))
                     return rc;
                 pSSM->u.Read.cbDataBuffer = cbToRead;
@@ -7495,6 +8075,225 @@ VMMR3DECL(int) SSMR3Skip(PSSMHANDLE pSSM, size_t cb)
 }
 
 
+/**
+ * Reads the record data of a raw page run.
+ *
+ * The record header must have been read already.
+ *
+ * @returns VBox status code. Sets pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ * @param   pcPages         Where to return the number of pages.
+ * @param   pcbPadding      Where to return the padding size.
+ */
+static int ssmR3DataReadV2PagesHdr(PSSMHANDLE pSSM, uint32_t *pcPages, uint32_t *pcbPadding)
+{
+    AssertLogRelMsgReturn(pSSM->u.Read.cbRecLeft == sizeof(uint32_t) * 2, ("%#x\n", pSSM->u.Read.cbRecLeft),
+                          pSSM->rc = VERR_SSM_INTEGRITY_REC_HDR);
+    uint32_t au32Rec[2];
+    int rc = ssmR3DataReadV2Raw(pSSM, &au32Rec[0], sizeof(au32Rec));
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    pSSM->u.Read.cbRecLeft = 0;
+
+    AssertLogRelMsgReturn(   au32Rec[1] < PAGE_SIZE
+                          && !((ssmR3StrmTell(&pSSM->Strm) + au32Rec[1]) & PAGE_OFFSET_MASK),
+                          ("cPages=%#x cbPadding=%#x off=%#llx\n", au32Rec[0], au32Rec[1], ssmR3StrmTell(&pSSM->Strm)),
+                          pSSM->rc = VERR_SSM_INTEGRITY_REC_HDR);
+    *pcPages    = au32Rec[0];
+    *pcbPadding = au32Rec[1];
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Reads and checks the CRC trailer of a raw page run.
+ *
+ * @returns VBox status code. Sets pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ */
+static int ssmR3DataReadV2PagesEnd(PSSMHANDLE pSSM)
+{
+    uint32_t const u32CurCRC = ssmR3StrmCurCRC(&pSSM->Strm);
+    uint32_t       u32CRC;
+    int rc = ssmR3DataReadV2Raw(pSSM, &u32CRC, sizeof(u32CRC));
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    AssertLogRelMsgReturn(!pSSM->Strm.fChecksummed || u32CRC == u32CurCRC, ("%#x, %#x\n", u32CRC, u32CurCRC),
+                          pSSM->rc = VERR_SSM_INTEGRITY_CRC);
+    pSSM->u.Read.fInPages   = false;
+    pSSM->u.Read.cPagesLeft = 0;
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Skips over (the rest of) the pages of a raw page run and reads the CRC
+ * trailer.
+ *
+ * File streams are repositioned right after the pages, using the trailer to
+ * resume the stream CRC.  Other streams are read thru.
+ *
+ * @returns VBox status code. Sets pSSM->rc on error.
+ * @param   pSSM            The saved state handle.
+ * @param   cbToSkip        Number of bytes (padding and pages) to skip.
+ */
+static int ssmR3DataReadV2PagesSkip(PSSMHANDLE pSSM, uint64_t cbToSkip)
+{
+    PSSMSTRM pStrm = &pSSM->Strm;
+#ifndef SSM_STANDALONE
+    if (   cbToSkip > 0
+        && ssmR3StrmIsFile(pStrm))
+    {
+        uint64_t const offEnd    = ssmR3StrmTell(pStrm) + cbToSkip;
+        bool const     fIoThread = pStrm->hIoThread != NIL_RTTHREAD;
+        ssmR3StrmStopIoThread(pStrm);
+
+        uint32_t u32CRC;
+        int rc = ssmR3StrmPeekAt(pStrm, offEnd, &u32CRC, sizeof(u32CRC), NULL);
+        if (RT_SUCCESS(rc))
+            rc = ssmR3StrmSeek(pStrm, offEnd, RTFILE_SEEK_BEGIN, u32CRC);
+        if (fIoThread)
+            ssmR3StrmStartIoThread(pStrm);
+        if (RT_FAILURE(rc))
+        {
+            LogRel(("SSM: Failed to skip %#llx bytes of pages to %#llx: %Rrc\n", cbToSkip, offEnd, rc));
+            return pSSM->rc = rc;
+        }
+        pSSM->offUnit += cbToSkip;
+        ssmR3ProgressByByte(pSSM, cbToSkip);
+    }
+    else
+#endif
+    {
+        while (cbToSkip > 0)
+        {
+            uint8_t  abBuf[8192];
+            uint32_t cbToRead = (uint32_t)RT_MIN(cbToSkip, sizeof(abBuf));
+            int rc = ssmR3DataReadV2Raw(pSSM, abBuf, cbToRead);
+            if (RT_FAILURE(rc))
+                return pSSM->rc = rc;
+            cbToSkip -= cbToRead;
+        }
+    }
+
+    return ssmR3DataReadV2PagesEnd(pSSM);
+}
+
+
+/**
+ * Begins reading a raw page run saved by SSMR3PutPagesBegin.
+ *
+ * When @a fLazy is set and the saved state is a file, the pages are skipped
+ * and the file offset of the first one is returned so the caller can read
+ * them directly from the file (see SSMR3HandleFilename) whenever it needs
+ * them.  Otherwise the pages must be read in order using SSMR3GetPage.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   fLazy           Whether the caller prefers reading the pages from
+ *                          the file on its own.
+ * @param   pcPages         Where to return the number of pages in the run.
+ * @param   poffPages       Where to return the file offset of the first page.
+ *                          This is UINT64_MAX if the pages must be read using
+ *                          SSMR3GetPage.
+ *
+ * @remarks Pages skipped this way are not covered by the stream CRC check.
+ */
+VMMR3DECL(int) SSMR3GetPagesBegin(PSSMHANDLE pSSM, bool fLazy, uint32_t *pcPages, uint64_t *poffPages)
+{
+    SSM_ASSERT_READABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    AssertPtrReturn(pcPages, VERR_INVALID_POINTER);
+    AssertPtrReturn(poffPages, VERR_INVALID_POINTER);
+    *pcPages   = 0;
+    *poffPages = UINT64_MAX;
+    AssertReturn(pSSM->u.Read.uFmtVerMajor >= 2, VERR_NOT_SUPPORTED);
+    AssertReturn(!pSSM->u.Read.fInPages, VERR_WRONG_ORDER);
+
+    /*
+     * The page run is a record of its own, so everything in front of it
+     * must've been consumed.
+     */
+    AssertLogRelMsgReturn(   pSSM->u.Read.offDataBuffer == pSSM->u.Read.cbDataBuffer
+                          && !pSSM->u.Read.cbRecLeft,
+                          ("offDataBuffer=%#x cbDataBuffer=%#x cbRecLeft=%#x\n",
+                           pSSM->u.Read.offDataBuffer, pSSM->u.Read.cbDataBuffer, pSSM->u.Read.cbRecLeft),
+                          pSSM->rc = VERR_SSM_LOADED_TOO_LITTLE);
+    pSSM->u.Read.cbDataBuffer  = 0;
+    pSSM->u.Read.offDataBuffer = 0;
+
+    int rc = ssmR3DataReadRecHdrV2(pSSM);
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    AssertLogRelMsgReturn(   !pSSM->u.Read.fEndOfData
+                          && (pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK) == SSM_REC_TYPE_RAW_PAGES,
+                          ("u8TypeAndFlags=%#x\n", pSSM->u.Read.u8TypeAndFlags),
+                          pSSM->rc = VERR_SSM_BAD_REC_TYPE);
+
+    uint32_t cPages;
+    uint32_t cbPadding;
+    rc = ssmR3DataReadV2PagesHdr(pSSM, &cPages, &cbPadding);
+    if (RT_FAILURE(rc))
+        return rc;
+    *pcPages = cPages;
+
+    if (   fLazy
+        && ssmR3StrmIsFile(&pSSM->Strm))
+    {
+        uint64_t const offPages = ssmR3StrmTell(&pSSM->Strm) + cbPadding;
+        uint64_t const cbPages  = (uint64_t)cPages << PAGE_SHIFT;
+        rc = ssmR3DataReadV2PagesSkip(pSSM, cbPadding + cbPages);
+        if (RT_SUCCESS(rc))
+        {
+            pSSM->offUnitUser += cbPages;
+            *poffPages = offPages;
+        }
+        return rc;
+    }
+
+    /*
+     * Sequential reading, skip the padding.
+     */
+    while (cbPadding > 0)
+    {
+        uint8_t  abBuf[256];
+        uint32_t cbToRead = RT_MIN(cbPadding, sizeof(abBuf));
+        rc = ssmR3DataReadV2Raw(pSSM, abBuf, cbToRead);
+        if (RT_FAILURE(rc))
+            return pSSM->rc = rc;
+        cbPadding -= cbToRead;
+    }
+    pSSM->u.Read.fInPages   = true;
+    pSSM->u.Read.cPagesLeft = cPages;
+    if (!cPages)
+        return ssmR3DataReadV2PagesEnd(pSSM);
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Loads the next page of a raw page run.
+ *
+ * @returns VBox status code.
+ * @param   pSSM            The saved state handle.
+ * @param   pvPage          Where to store the page (PAGE_SIZE bytes).
+ */
+VMMR3DECL(int) SSMR3GetPage(PSSMHANDLE pSSM, void *pvPage)
+{
+    SSM_ASSERT_READABLE_RET(pSSM);
+    SSM_CHECK_CANCELLED_RET(pSSM);
+    AssertReturn(pSSM->u.Read.fInPages && pSSM->u.Read.cPagesLeft > 0, VERR_WRONG_ORDER);
+
+    int rc = ssmR3DataReadV2Raw(pSSM, pvPage, PAGE_SIZE);
+    if (RT_FAILURE(rc))
+        return pSSM->rc = rc;
+    pSSM->offUnitUser += PAGE_SIZE;
+    if (--pSSM->u.Read.cPagesLeft == 0)
+        return ssmR3DataReadV2PagesEnd(pSSM);
+    return VINF_SUCCESS;
+}
+
+
 /**
  * Skips to the end of the current data unit.
  *
@@ -7516,10 +8315,29 @@ VMMR3DECL(int) SSMR3SkipToEndOfUnit(PSSMHANDLE pSSM)
          */
         pSSM->u.Read.cbDataBuffer  = 0;
         pSSM->u.Read.offDataBuffer = 0;
+        if (pSSM->u.Read.fInPages)
+        {
+            int rc = ssmR3DataReadV2PagesSkip(pSSM, (uint64_t)pSSM->u.Read.cPagesLeft << PAGE_SHIFT);
+            if (RT_FAILURE(rc))
+                return rc;
+        }
         if (!pSSM->u.Read.fEndOfData)
         {
             do
             {
+                /* skip raw page runs (the record data is just the header) */
+                if (   (pSSM->u.Read.u8TypeAndFlags & SSM_REC_TYPE_MASK) == SSM_REC_TYPE_RAW_PAGES
+                    && pSSM->u.Read.cbRecLeft)
+                {
+                    uint32_t cPages;
+                    uint32_t cbPadding;
+                    int rc = ssmR3DataReadV2PagesHdr(pSSM, &cPages, &cbPadding);
+                    if (RT_SUCCESS(rc))
+                        rc = ssmR3DataReadV2PagesSkip(pSSM, cbPadding + ((uint64_t)cPages << PAGE_SHIFT));
+                    if (RT_FAILURE(rc))
+                        return rc;
+                }
+
                 /* read the rest of the current record */
                 while (pSSM->u.Read.cbRecLeft)
                 {
@@ -8059,6 +8877,8 @@ static int ssmR3OpenFile(PVM pVM, const char *pszFilename, PCSSMSTRMOPS pStreamO
     pSSM->u.Read.offDataBuffer  = 0;
     pSSM->u.Read.fEndOfData     = 0;
     pSSM->u.Read.u8TypeAndFlags = 0;
+    pSSM->u.Read.fInPages       = false;
+    pSSM->u.Read.cPagesLeft     = 0;
 
     pSSM->u.Read.pCurUnit       = NULL;
     pSSM->u.Read.uCurUnitVer    = UINT32_MAX;
@@ -9463,6 +10283,19 @@ VMMR3DECL(int) SSMR3HandleGetStatus(PSSMHANDLE pSSM)
 }
 
 
+/**
+ * Gets the name of the saved state file.
+ *
+ * @returns The filename, NULL if the saved state is a stream.
+ * @param   pSSM            The saved state handle.
+ */
+VMMR3DECL(const char *) SSMR3HandleFilename(PSSMHANDLE pSSM)
+{
+    SSM_ASSERT_VALID_HANDLE(pSSM);
+    return pSSM->pszFilename;
+}
+
+
 /**
  * Fail the load operation.
  *
@@ -155,6 +155,8 @@ typedef struct PDMACEPFILEMGR
     RTTHREAD                               Thread;
     /** The async I/O context for this manager. */
     RTFILEAIOCTX                           hAioCtx;
+    /** Flags passed to RTFileAioCtxCreate() (RTFILEAIOCTX_FLAGS_*). */
+    uint32_t                               fAioCtxFlags;
     /** Flag whether the I/O manager was woken up. */
     volatile bool                          fWokenUp;
     /** List of endpoints assigned to this manager. */
@@ -271,6 +273,9 @@ typedef struct PDMASYNCCOMPLETIONEPCLASSFILE
     RTR3UINTPTR                         uBitmaskAlignment;
     /** Flag whether the out of resources warning was printed already. */
     bool                                fOutOfResourcesWarningPrinted;
+    /** Flag whether the async I/O managers use io_uring (Linux only).
+     * Async I/O works with the host cache enabled in that case. */
+    bool                                fIoRing;
 #ifdef PDM_ASYNC_COMPLETION_FILE_WITH_DELAY
     /** Timer for delayed request completion. */
     PTMTIMERR3                          pTimer;
@@ -63,6 +63,9 @@ typedef struct PDMBLKCACHEENTRY
     volatile uint32_t               fFlags;
     /** Reference counter. Prevents eviction of the entry if > 0. */
     volatile uint32_t               cRefs;
+    /** Flag whether the entry was hit since it was last moved in the LRU lists.
+     * Set without holding the cache lock, consumed during eviction. */
+    volatile bool                   fReferenced;
     /** Size of the entry. */
     uint32_t                        cbData;
     /** Pointer to the memory containing the data. */
@@ -96,6 +99,22 @@ typedef struct PDMBLKLRULIST
     uint32_t          cbCached;
 } PDMBLKLRULIST;
 
+/**
+ * Cache replacement policy.
+ */
+typedef enum PDMBLKCACHEPOLICY
+{
+    /** Invalid policy. */
+    PDMBLKCACHEPOLICY_INVALID = 0,
+    /** 2Q with fixed sized A1in/A1out queues (default). */
+    PDMBLKCACHEPOLICY_2Q,
+    /** Adaptive replacement cache (ARC) with two ghost lists and
+     * a self tuning target size for the recently used list. */
+    PDMBLKCACHEPOLICY_ARC,
+    /** 32bit hack. */
+    PDMBLKCACHEPOLICY_32BIT_HACK = 0x7fffffff
+} PDMBLKCACHEPOLICY;
+
 /**
  * Global cache data.
  */
@@ -109,7 +128,10 @@ typedef struct PDMBLKCACHEGLOBAL
     uint32_t            cbCached;
     /** Critical section protecting the cache. */
     RTCRITSECT          CritSect;
-    /** Maximum number of bytes cached. */
+    /** The replacement policy in use. */
+    PDMBLKCACHEPOLICY   enmPolicy;
+    /** Maximum number of bytes cached.
+     * This is the adaptive target size of the recently used list for ARC. */
     uint32_t            cbRecentlyUsedInMax;
     /** Maximum number of bytes in the paged out list .*/
     uint32_t            cbRecentlyUsedOutMax;
@@ -119,6 +141,14 @@ typedef struct PDMBLKCACHEGLOBAL
     PDMBLKLRULIST       LruRecentlyUsedOut;
     /** List of frequently used cache entries */
     PDMBLKLRULIST       LruFrequentlyUsed;
+    /** Ghost list of entries evicted from the frequently used list (ARC only). */
+    PDMBLKLRULIST       LruFrequentlyUsedOut;
+    /** Number of hits in the recently used ghost list. */
+    STAMCOUNTER         StatGhostHitsRecentlyUsed;
+    /** Number of hits in the frequently used ghost list. */
+    STAMCOUNTER         StatGhostHitsFrequentlyUsed;
+    /** Number of misses which didn't hit any ghost list either. */
+    STAMCOUNTER         StatGhostMisses;
     /** Commit timeout in milli seconds */
     uint32_t            u32CommitTimeoutMs;
     /** Number of dirty bytes needed to start a commit of the data to the disk. */
@@ -154,6 +184,8 @@ typedef struct PDMBLKCACHEGLOBAL
     STAMPROFILEADV      StatTreeRemove;
     /** Number of times a buffer could be reused. */
     STAMCOUNTER         StatBuffersReused;
+    /** Number of referenced entries which got a second chance during eviction. */
+    STAMCOUNTER         StatSecondChance;
 #endif
 } PDMBLKCACHEGLOBAL;
 #ifdef VBOX_WITH_STATISTICS
@@ -269,6 +269,16 @@ DECLINLINE(int) pgmRZDynMapGCPageV2Inlined(PVM pVM, PVMCPU pVCpu, RTGCPHYS GCPhy
     STAM_PROFILE_START(&pVCpu->pgm.s.CTX_SUFF(pStats)->StatRZDynMapGCPageInl, a);
     AssertMsg(!(GCPhys & PAGE_OFFSET_MASK), ("%RGp\n", GCPhys));
 
+    if (RT_UNLIKELY(pVM->pgm.s.fPostCopyAbsent))
+    {
+        int rc = pgmPhysPostCopyFaultIn(pVM, GCPhys);
+        if (RT_FAILURE(rc))
+        {
+            STAM_PROFILE_STOP(&pVCpu->pgm.s.CTX_SUFF(pStats)->StatRZDynMapGCPageInl, a);
+            return rc;
+        }
+    }
+
     /*
      * Get the ram range.
      */
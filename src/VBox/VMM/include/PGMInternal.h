@@ -1465,6 +1465,69 @@ typedef PGMLIVESAVERAMPAGE *PPGMLIVESAVERAMPAGE;
 #define PGMLIVSAVEPAGE_MAX_DIRTIED 0x00fffff0
 
 
+/**
+ * Post-copy live migration state, ring-3 only.
+ *
+ * On the source this tracks the RAM pages left out of the final live save
+ * pass, on the target the pages which haven't been received yet.  The target
+ * side is also used for restoring RAM lazily from a saved state file.
+ */
+typedef struct PGMPOSTCOPY
+{
+    /** Set on the source, clear on the target. */
+    bool                            fSource;
+    /** Target: Set if we've given up on the absent pages (reset, power off). */
+    bool volatile                   fAborted;
+    /** Target: Set while the access handlers are registered. */
+    bool                            fHandlers;
+    /** Target: Set if the pages come from a saved state file rather than from
+     * a migration source (lazy RAM restore). */
+    bool                            fLazy;
+    /** Lazy: Tells the fill thread to quit. */
+    bool volatile                   fLazyTerminate;
+    /** Source: The number of live passes saving RAM pages. */
+    uint32_t                        cPrecopyPasses;
+    /** The number of entries in paGCPhys. */
+    uint32_t                        cPages;
+    /** The number of pages not yet sent (source) or received (target). */
+    uint32_t volatile               cPagesLeft;
+    /** Source: Where to look for the next page to push. */
+    uint32_t                        iNextPush;
+    /** Target: The number of entries in paiRuns. */
+    uint32_t                        cRuns;
+    /** Target: The number of pages requested on demand. */
+    uint32_t volatile               cDemandRequests;
+    /** Target: The number of threads currently calling pfnRequest. */
+    uint32_t volatile               cRequestsBusy;
+    /** The page addresses in ascending order. */
+    PRTGCPHYS                       paGCPhys;
+    /** Bitmap with a bit set for each page in paGCPhys not yet sent/received. */
+    uint32_t volatile              *pbmLeft;
+    /** Target: The index of the first page covered by each access handler.
+     * A handler covers the pages up to the next one. */
+    uint32_t                       *paiRuns;
+    /** Target: The page each vCPU is waiting for, NIL_RTGCPHYS if none. */
+    RTGCPHYS volatile              *paGCPhysWaiting;
+    /** Target: The event semaphore each vCPU waits on. */
+    PRTSEMEVENT                     pahEvtWaiting;
+    /** Target: Callback for requesting a page from the source. */
+    PFNPGMPOSTCOPYREQUEST volatile  pfnRequest;
+    /** Target: The user argument for pfnRequest. */
+    void                           *pvRequestUser;
+    /** Lazy: The saved state file, NIL_RTFILE if closed. */
+    RTFILE                          hLazyFile;
+    /** Lazy: The file offset of the first page. */
+    uint64_t                        offLazyPages;
+    /** Lazy: The CRC-32 of each page in the file, indexed like paGCPhys.
+     * The pages are read outside the saved state stream and its CRC check. */
+    uint32_t                       *pau32LazyCrc;
+    /** Lazy: The thread reading the remaining pages in the background. */
+    RTTHREAD                        hLazyThread;
+} PGMPOSTCOPY;
+/** Pointer to the post-copy live migration state. */
+typedef PGMPOSTCOPY *PPGMPOSTCOPY;
+
+
 /**
  * RAM range for GC Phys to HC Phys conversion.
  *
@@ -3264,8 +3327,9 @@ typedef struct PGM
 
     /** Physical access handler type for ROM protection. */
     PGMPHYSHANDLERTYPE              hRomPhysHandlerType;
-    /** Alignment padding.   */
-    uint32_t                        u32Padding;
+    /** Physical access handler type for pages absent during post-copy
+     *  live migration. */
+    PGMPHYSHANDLERTYPE              hPostCopyPhysHandlerType;
 
     /** 4 MB page mask; 32 or 36 bits depending on PSE-36 (identical for all VCPUs) */
     RTGCPHYS                        GCPhys4MBPSEMask;
@@ -3520,8 +3584,11 @@ typedef struct PGM
         uint32_t                    cIgnoredPages;
         /** Indicates that a live save operation is active. */
         bool                        fActive;
+        /** Set by non-live saves storing the RAM pages in a page aligned run
+         * at the end of the unit for lazy restoring (PGM/SaveLazyRam). */
+        bool                        fLazyRam;
         /** Padding. */
-        bool                        afReserved[2];
+        bool                        afReserved[1];
         /** The next history index. */
         uint8_t                     iDirtyPagesHistory;
         /** History of the total amount of dirty pages. */
@@ -3540,8 +3607,41 @@ typedef struct PGM
         /** Pages per second (for statistics). */
         uint32_t                    cPagesPerSecond;
         uint32_t                    cAlignment;
+        /** The number of RAM pages saved as deltas against the previously sent
+         * contents. */
+        uint64_t                    cDeltaPages;
+        /** The number of bytes the delta encoding saved. */
+        uint64_t                    cbDeltaSaved;
+        /** The number of RAM pages saved as references to identical pages saved
+         * earlier in the same pass.  Also counted by normal saves. */
+        uint64_t                    cDupPages;
+        /** Cache of previously sent RAM pages for delta encoding, NULL if
+         * disabled.  Only accessed by the saving thread. */
+        R3PTRTYPE(struct PGMLSDELTACACHE *) pDeltaCache;
+        /** RAM page content hash table for finding duplicate pages, NULL if
+         * not saving or disabled.  Also used by normal saves.  Only accessed
+         * by the saving thread. */
+        R3PTRTYPE(struct PGMSAVEDEDUP *) pDedup;
+        /** The addresses of the RAM pages saved as lazy records, in the order
+         * they were saved.  Only accessed by the saving thread. */
+        R3PTRTYPE(PRTGCPHYS)        paLazyGCPhys;
+        /** The number of entries in paLazyGCPhys. */
+        uint32_t                    cLazyPages;
+#if HC_ARCH_BITS == 64
+        uint32_t                    u32LazyPadding;
+#endif
     } LiveSave;
 
+    /** Post-copy live migration state, NULL if not active. */
+    R3PTRTYPE(PPGMPOSTCOPY)         pPostCopyR3;
+#if HC_ARCH_BITS == 32
+    uint32_t                        u32PostCopyPadding;
+#endif
+    /** Set while the post-copy target has absent pages covered by access
+     * handlers, see pgmPhysPostCopyFaultIn. */
+    bool volatile                   fPostCopyAbsent;
+    bool                            afPostCopyPadding[7];
+
     /** @name   Error injection.
      * @{ */
     /** Inject handy page allocation errors pretending we're completely out of
@@ -4140,6 +4240,18 @@ void            pgmHandlerVirtualDumpPhysPages(PVM pVM);
 #endif /* VBOX_WITH_RAW_MODE */
 DECLCALLBACK(void) pgmR3InfoHandlers(PVM pVM, PCDBGFINFOHLP pHlp, const char *pszArgs);
 int             pgmR3InitSavedState(PVM pVM, uint64_t cbRam);
+int             pgmR3PostCopyInit(PVM pVM);
+void            pgmR3PostCopyReset(PVM pVM);
+void            pgmR3PostCopyTerm(PVM pVM);
+bool            pgmR3PostCopySrcIsPrecopyPass(PVM pVM, uint32_t uPass);
+bool            pgmR3PostCopySrcIsActive(PVM pVM);
+int             pgmR3PostCopySrcAddPage(PVM pVM, RTGCPHYS GCPhys);
+int             pgmR3PostCopyTrgAddPage(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, bool fLazy);
+int             pgmR3PostCopyTrgLoadDone(PVM pVM);
+int             pgmR3PostCopyTrgFaultIn(PVM pVM, RTGCPHYS GCPhys);
+int             pgmR3LazyRamLoadPages(PVM pVM, PSSMHANDLE pSSM);
+int             pgmR3LazyRamFlush(PVM pVM);
+void            pgmR3LazyRamStop(PVM pVM);
 
 int             pgmPhysAllocPage(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys);
 int             pgmPhysAllocLargePage(PVM pVM, RTGCPHYS GCPhys);
@@ -4153,6 +4265,7 @@ int             pgmPhysPageMap(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, void **
 int             pgmPhysPageMapReadOnly(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, void const **ppv);
 int             pgmPhysPageMapByPageID(PVM pVM, uint32_t idPage, RTHCPHYS HCPhys, void **ppv);
 int             pgmPhysGCPhys2R3Ptr(PVM pVM, RTGCPHYS GCPhys, PRTR3PTR pR3Ptr);
+int             pgmPhysPostCopyFaultIn(PVM pVM, RTGCPHYS GCPhys);
 int             pgmPhysCr3ToHCPtr(PVM pVM, RTGCPHYS GCPhys, PRTR3PTR pR3Ptr);
 int             pgmPhysGCPhys2CCPtrInternalDepr(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, void **ppv);
 int             pgmPhysGCPhys2CCPtrInternal(PVM pVM, PPGMPAGE pPage, RTGCPHYS GCPhys, void **ppv, PPGMPAGEMAPLOCK pLock);
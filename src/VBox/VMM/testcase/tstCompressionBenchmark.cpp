@@ -34,6 +34,7 @@
 #include <iprt/param.h>
 #include <iprt/stream.h>
 #include <iprt/string.h>
+#include <iprt/thread.h>
 #include <iprt/time.h>
 #include <iprt/zip.h>
 
@@ -220,6 +221,119 @@ static void tstBenchmarkCRCsPageByPage(uint8_t const *pabSrc, size_t cbSrc)
 }
 
 
+/**
+ * Per thread data for tstBenchmarkParallelBlocks.
+ */
+typedef struct TSTPARBLOCKS
+{
+    /** The compression type. */
+    RTZIPTYPE       enmType;
+    /** The first page. */
+    size_t          iFirstPage;
+    /** The page stride, i.e. the number of threads. */
+    size_t          cStride;
+    /** The number of compressed bytes produced. */
+    uint64_t        cbCompr;
+    /** The status of the first failure. */
+    int             rc;
+} TSTPARBLOCKS;
+
+
+/**
+ * Thread compressing every cStride'th page, the way the SSM compressor pool
+ * works on the pages of a saved state.
+ */
+static DECLCALLBACK(int) tstBenchmarkParallelBlocksThread(RTTHREAD hThreadSelf, void *pvUser)
+{
+    TSTPARBLOCKS *pArgs = (TSTPARBLOCKS *)pvUser;
+    NOREF(hThreadSelf);
+    uint8_t abDst[PAGE_SIZE * 2];
+    for (size_t iPage = pArgs->iFirstPage; iPage < g_cPages; iPage += pArgs->cStride)
+    {
+        size_t cbDst;
+        int rc = RTZipBlockCompress(pArgs->enmType, RTZIPLEVEL_FAST, 0 /*fFlags*/,
+                                    &g_pabSrc[iPage * PAGE_SIZE], PAGE_SIZE,
+                                    abDst, sizeof(abDst), &cbDst);
+        if (RT_FAILURE(rc))
+        {
+            pArgs->rc = rc;
+            break;
+        }
+        pArgs->cbCompr += cbDst;
+    }
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * Benchmarks page by page block compression fanned out over several threads.
+ *
+ * @param  cThreads The number of threads.
+ */
+static void tstBenchmarkParallelBlocks(uint32_t cThreads)
+{
+    static const struct { RTZIPTYPE enmType; const char *pszName; } s_aTypes[] =
+    {
+        { RTZIPTYPE_LZF,  "LZF"  },
+        { RTZIPTYPE_LZ4,  "LZ4"  },
+        { RTZIPTYPE_ZSTD, "zstd" },
+    };
+
+    RTPrintf("Algorithm  Threads       Speed                  Time      Ratio\n"
+             "------------------------------------------------------------------\n");
+    for (uint32_t iType = 0; iType < RT_ELEMENTS(s_aTypes); iType++)
+        for (uint32_t cCurThreads = 1; cCurThreads <= cThreads; cCurThreads *= 2)
+        {
+            TSTPARBLOCKS aArgs[64];
+            RTTHREAD     ahThreads[64];
+            uint32_t     cStarted = 0;
+            AssertBreak(cCurThreads <= RT_ELEMENTS(aArgs));
+
+            uint64_t NanoTS = RTTimeNanoTS();
+            for (uint32_t i = 0; i < cCurThreads; i++)
+            {
+                aArgs[i].enmType    = s_aTypes[iType].enmType;
+                aArgs[i].iFirstPage = i;
+                aArgs[i].cStride    = cCurThreads;
+                aArgs[i].cbCompr    = 0;
+                aArgs[i].rc         = VINF_SUCCESS;
+                int rc = RTThreadCreateF(&ahThreads[i], tstBenchmarkParallelBlocksThread, &aArgs[i], 0,
+                                         RTTHREADTYPE_DEFAULT, RTTHREADFLAGS_WAITABLE, "tstZip%u", i);
+                if (RT_FAILURE(rc))
+                {
+                    aArgs[i].rc = rc;
+                    break;
+                }
+                cStarted++;
+            }
+
+            uint64_t cbCompr = 0;
+            int      rc      = VINF_SUCCESS;
+            for (uint32_t i = 0; i < cStarted; i++)
+                RTThreadWait(ahThreads[i], RT_INDEFINITE_WAIT, NULL);
+            NanoTS = RTTimeNanoTS() - NanoTS;
+            for (uint32_t i = 0; i < cCurThreads; i++)
+            {
+                cbCompr += aArgs[i].cbCompr;
+                if (RT_FAILURE(aArgs[i].rc) && RT_SUCCESS(rc))
+                    rc = aArgs[i].rc;
+            }
+
+            if (RT_SUCCESS(rc))
+            {
+                unsigned uSpeed = (unsigned)(g_cbPages / (long double)NanoTS * 1000000000.0 / 1024);
+                RTPrintf("%-9s  %7u  %'9u KB/s  %'15llu ns  %3u%%\n", s_aTypes[iType].pszName, cCurThreads,
+                         uSpeed, NanoTS, (unsigned)(cbCompr * 100 / g_cbPages));
+            }
+            else
+            {
+                RTPrintf("%-9s  %7u  %Rrc\n", s_aTypes[iType].pszName, cCurThreads, rc);
+                break;
+            }
+        }
+}
+
+
 /** Prints an error message and returns 1 for quick return from main use. */
 static int Error(const char *pszMsgFmt, ...)
 {
@@ -246,12 +360,14 @@ int main(int argc, char **argv)
         { "--page-at-a-time", 'c', RTGETOPT_REQ_UINT32 },
         { "--page-file",      'f', RTGETOPT_REQ_STRING },
         { "--offset",         'o', RTGETOPT_REQ_UINT64 },
+        { "--threads",        't', RTGETOPT_REQ_UINT32 },
     };
 
     const char     *pszPageFile = NULL;
     uint64_t        offPageFile = 0;
     uint32_t        cIterations = 1;
     uint32_t        cPagesAtATime = 1;
+    uint32_t        cThreads = 8;
     RTGETOPTUNION   Val;
     RTGETOPTSTATE   State;
     int rc = RTGetOptInit(&State, argc, argv, &s_aOptions[0], RT_ELEMENTS(s_aOptions), 1, 0);
@@ -289,6 +405,12 @@ int main(int argc, char **argv)
                 offPageFile = Val.u64;
                 break;
 
+            case 't':
+                cThreads = Val.u32;
+                if (cThreads < 1 || cThreads > 64)
+                    return Error("The specified thread count is out of range: %u\n", cThreads);
+                break;
+
             case 'O':
                 offPageFile = Val.u64 * PAGE_SIZE;
                 break;
@@ -309,7 +431,10 @@ int main(int argc, char **argv)
                          "    File or device to read the page from. The default\n"
                          "    is to generate some garbage.\n"
                          "  -o, --offset <file-offset>\n"
-                         "    Offset into the page file to start reading at.\n");
+                         "    Offset into the page file to start reading at.\n"
+                         "  -t, --threads <num>\n"
+                         "    Max number of threads for the parallel block compression\n"
+                         "    benchmark (default 8).\n");
                 return 0;
 
             case 'V':
@@ -399,6 +524,8 @@ int main(int argc, char **argv)
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZF,   RTZIPLEVEL_DEFAULT, "RTZipBlock/LZF"   },
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZJB,  RTZIPLEVEL_DEFAULT, "RTZipBlock/LZJB"  },
         { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZO,   RTZIPLEVEL_DEFAULT, "RTZipBlock/LZO"   },
+        { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_LZ4,   RTZIPLEVEL_DEFAULT, "RTZipBlock/LZ4"   },
+        { 0, 0, 0, VINF_SUCCESS, true,  RTZIPTYPE_ZSTD,  RTZIPLEVEL_FAST,    "RTZipBlock/zstd"  },
     };
     RTPrintf("tstCompressionBenchmark: TESTING..");
     for (uint32_t i = 0; i < cIterations; i++)
@@ -614,6 +741,14 @@ int main(int argc, char **argv)
     }
     RTPrintf("       %'10zu zero pages (%u %%)\n", cZeroPages, cZeroPages * 100 / g_cPages);
 
+    /*
+     * Page by page block compression spread over several threads, as done
+     * by SSM when saving.
+     */
+    RTPrintf("\n"
+             "tstCompressionBenchmark: Parallel Block Compression\n");
+    tstBenchmarkParallelBlocks(cThreads);
+
     /*
      * A little extension to the test, benchmark relevant CRCs.
      */